@@ -3,8 +3,10 @@
 #include <micron.h>
 #include <drivers/sdcard/sdcard.h>
 #include <drivers/fs/fat/fat.h>
+#include <drivers/fs/exfat/exfat.h>
 
 MicronSdCardState sdcard;
+MicronSdReadAhead readAhead;
 
 void blink(int n) {
     gpioSetPinMode(13, PIN_MODE_OUTPUT); //onboard LED
@@ -58,27 +60,30 @@ int resetSD() {
     }
 
     printf("SD size: %lld MB\r\n", sdcard.cardSize / 1048576LL);
-    //in theory we can go up to 25MHz, but in practice I get errors
-    //at somewhere around 20MHz, probably because of my shoddy wiring.
-    uint32_t baud = 1000000;
-    err = spiSetSpeed(sdcard.port, baud);
-    if(!err) err = sdcardUpdateSpeed(&sdcard, 1000);
-    if(!err) printf("Increase baud to %ld\r\n", baud);
-    else printf("Error adjusting baud rate: %d\r\n", err);
-    return err;
+    //go as fast as the card and the wiring allow. if errors start
+    //happening later, the driver slows down by itself.
+    err = sdNegotiateSpeed(&sdcard, true, 1000);
+    if(err < 0) {
+        printf("Error adjusting baud rate: %d\r\n", err);
+        return err;
+    }
+    printf("Increase baud to %d%s\r\n", err,
+        sdcard.highSpeed ? " (high speed mode)" : "");
+    return 0;
 }
 
 int initSD() {
     //XXX move to driver
     sdcard.port = 0;
     sdcard.pinCS = 10;
-    sdcard.blockCacheSize = 8;
+    sdcard.blockCacheSize = 16;
 
     //XXX shouldn't init SPI for us unless it isn't already inited
     printf("SD init... ");
     int err = sdcardInit(&sdcard);
     printf("%d\r\n", err);
     if(err) return err;
+    sdReadAheadInit(&sdcard, &readAhead, 1000, true);
 
     return resetSD();
 }
@@ -187,12 +192,27 @@ void cmd_setBaud(const char *param) {
     if(!err) err = sdcardUpdateSpeed(&sdcard, 1000);
     if(err) printf("Error %d\r\n", err);
     else printf("OK\r\n");
+    sdcard.spiSpeed = 0; //don't let the driver change it
+}
+
+void cmd_speedStats(const char *param) {
+    MicronSdSpeedStats *stats = &sdcard.speedStats;
+    printf("Clock: %ld Hz%s\r\n", sdcard.spiSpeed,
+        sdcard.highSpeed ? " (high speed mode)" : "");
+    printf("CRC errors: %ld, response errors: %ld\r\n",
+        stats->crcErrors, stats->respErrors);
+    printf("Step downs: %ld, failed speeds: %ld\r\n",
+        stats->stepDowns, stats->verifyFails);
+    MicronSdReadAheadStats *ra = &readAhead.stats;
+    printf("Read-ahead: %ld streams, %ld blocks, %ld used, %ld wasted\r\n",
+        ra->streams, ra->issued, ra->hits, ra->wasted);
 }
 
 void cmd_speedTest(const char *param) {
     static const char *units = " KMG";
 
     //read sector at low speed
+    sdcard.spiSpeed = 0; //don't let the driver change it
     printf("Read sector 0 at low speed (wait!)...\r\n");
     uint8_t buf[512]; //XXX check card sector size
     int err = sdReadBlock(&sdcard, 0, buf, 20000, true);
@@ -272,6 +292,38 @@ void cmd_reset(const char *param) {
     resetSD();
 }
 
+static void listExfat(FILE *card, MicronPartition *partition) {
+    exfat_boot boot;
+    int err = exfatMount(card, partition->sector, &boot,
+        FAT_DEFAULT_CACHE_SIZE, 10000);
+    if(err < 0) {
+        printf("exfatMount error %d\r\n", err);
+        return;
+    }
+    printf("exFAT: %lld bytes free\r\n", exfatGetFreeSpace(&boot));
+
+    MicronExfatDir *rootDir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    MicronExfatDirent *dir = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    err = (rootDir && dir) ? exfatOpenDir(&boot, NULL, rootDir) : -ENOMEM;
+    while(err == 0) {
+        err = exfatReadDirNext(card, &boot, rootDir, dir, 10000);
+        if(err == -ENOENT) break;
+        else if(err < 0) {
+            printf("exfatReadDirNext error %d\r\n", err);
+            break;
+        }
+        printf("dirent %ld: %s (%llu bytes%s)\r\n", rootDir->entIndex,
+            dir->name, dir->size,
+            (dir->flags & EXFAT_FLAG_NO_FAT_CHAIN) ? ", contiguous" : "");
+    }
+    if(rootDir) free(rootDir);
+    if(dir) free(dir);
+
+    printf("Done\r\n");
+    exfatUnmount(card, &boot, 10000);
+}
+
 void cmd_list(const char *param) {
     uint32_t partNo = strtoul(param, (char**)&param, 0);
     printf("Read partition %ld\r\n", partNo);
@@ -293,10 +345,16 @@ void cmd_list(const char *param) {
     printf("Partition sector 0x%llX, size 0x%llX, type 0x%lX\r\n",
         partition.sector, partition.size, partition.type);
 
+    if(partition.type == 0x07) { //exFAT (or NTFS)
+        listExfat(card, &partition);
+        close(card);
+        return;
+    }
+
     fat32_mbr mbr;
-    err = fatGetMBR(card, partition.sector, &mbr, 10000);
+    err = fatMount(card, partition.sector, &mbr, FAT_DEFAULT_CACHE_SIZE, 10000);
     if(err < 0) {
-        printf("fatGetMBR error %d\r\n", err);
+        printf("fatMount error %d\r\n", err);
         close(card);
         return;
     }
@@ -305,6 +363,7 @@ void cmd_list(const char *param) {
     err = fatGetFsInfo(card, &mbr, &fsInfo, 10000);
     if(err < 0) {
         printf("fatGetInfo error %d\r\n", err);
+        fatUnmount(card, &mbr, 10000);
         close(card);
         return;
     }
@@ -312,20 +371,28 @@ void cmd_list(const char *param) {
 
     fatGetInfo(card, partition.sector, 10000);
 
-    int iFile = 0;
-    while(true) {
+    MicronFatDir rootDir;
+    err = fatOpenDir(&mbr, 0, &rootDir);
+    while(err == 0) {
         micronDirent dir;
-        printf("Read dirent %d\r\n", iFile);
-        err = fatReadDir(card, &mbr, iFile, &dir, 10000);
+        err = fatReadDirNext(card, &mbr, &rootDir, &dir, 10000);
         if(err == -ENOENT) break;
         else if(err < 0) {
-            printf("fatReadDir error %d\r\n", err);
+            printf("fatReadDirNext error %d\r\n", err);
             break;
         }
-        else iFile = err; //returns next idx
+        printf("dirent %ld: %s\r\n", rootDir.entIndex, dir.name);
     }
 
+    MicronFatCache *cache = mbr._micron_fatCache;
+    if(cache) printf("FAT cache: %ld hits, %ld misses, %ld evictions\r\n",
+        cache->blocks.hits, cache->blocks.misses, cache->blocks.evictions);
+    printf("SD cache: %ld hits, %ld misses, %ld evictions\r\n",
+        sdcard.blockCache.hits, sdcard.blockCache.misses,
+        sdcard.blockCache.evictions);
+
     printf("Done\r\n");
+    fatUnmount(card, &mbr, 10000);
     close(card);
 }
 
@@ -415,6 +482,7 @@ static struct {
 	{"read",      cmd_readSector},
 	{"baud",      cmd_setBaud},
     {"speedtest", cmd_speedTest},
+    {"stats",     cmd_speedStats},
     {"reset",     cmd_reset},
     {"ls",        cmd_list},
     {"peek1",     cmd_peek1},
@@ -461,6 +529,7 @@ int main() {
     bool redraw = true;
     while(1) {
         idle();
+        sdReadAheadStep(&sdcard);
         if(redraw) {
             if(_spiState[0] && false) {
                 ////save cursor; cursor to 1,1; set color
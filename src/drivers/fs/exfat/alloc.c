@@ -0,0 +1,308 @@
+//Cluster allocation.
+//exFAT records which clusters are in use in its allocation bitmap, a file
+//in the cluster heap with one bit per cluster, rather than in the FAT.
+//Finding free space means scanning a few sectors of it (each covers 4096
+//clusters), which we access through the FAT sector cache; nothing has to
+//be read at mount time except to count the free clusters. The FAT itself
+//is only written for files whose clusters aren't contiguous.
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / 4) //in the FAT
+#define BITS_PER_SECTOR (FAT_SECTOR_SIZE * 8) //in the bitmap
+#define SCAN_SECTORS 8 //bitmap sectors to read at once when counting
+
+static int _countFree(FILE *blkdev, exfat_boot *boot, uint32_t *out) {
+    //count the zero bits in the bitmap.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint8_t *buf = (uint8_t*)malloc(SCAN_SECTORS * FAT_SECTOR_SIZE);
+    if(!buf) return -ENOMEM;
+
+    uint32_t count = boot->clusterCount, used = 0;
+    uint32_t numSectors = (count + BITS_PER_SECTOR - 1) / BITS_PER_SECTOR;
+    for(uint32_t sector=0; sector<numSectors; sector += SCAN_SECTORS) {
+        uint32_t n = MIN(numSectors - sector, (uint32_t)SCAN_SECTORS);
+        int err = _fatReadSectors(blkdev,
+            vol->bitmap._micron_startSector + sector, n, buf);
+        if(err < 0) {
+            free(buf);
+            return err;
+        }
+        uint32_t bit = sector * BITS_PER_SECTOR;
+        for(uint32_t i=0; i < n * FAT_SECTOR_SIZE && bit < count; i++) {
+            uint8_t b = buf[i];
+            if(count - bit < 8) b &= (1 << (count - bit)) - 1; //past the end
+            used += __builtin_popcount(b);
+            bit  += 8;
+        }
+    }
+    free(buf);
+    *out = count - used;
+    return 0;
+}
+
+
+int exfatAllocInit(FILE *blkdev, exfat_boot *boot,
+const exfat_table_entry *ent, uint32_t timeout) {
+    /** Set up cluster allocation.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param ent The allocation bitmap's entry in the root directory
+     *   (type 0 if there isn't one).
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by exfatMount(). If the bitmap is missing or
+     *   isn't contiguous, it still succeeds, but the volume is read-only.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    vol->writable = false;
+    uint32_t clusterSize = exfatClusterSize(boot);
+    if(ent->type != EXFAT_ENTRY_BITMAP || ent->firstCluster < 2
+    || ent->size < (boot->clusterCount + 7) / 8) {
+        #if EXFAT_DEBUG_PRINT
+            printf("exFAT: no allocation bitmap; read only\r\n");
+        #endif
+        return 0;
+    }
+
+    //we access the bitmap by sector number, so it has to be contiguous.
+    //formatters always make it so.
+    uint32_t numClusters = (ent->size + clusterSize - 1) / clusterSize;
+    uint32_t cluster = ent->firstCluster;
+    for(uint32_t i=1; i<numClusters; i++) {
+        int next = fatGetNextCluster(blkdev, &vol->fat, cluster, timeout);
+        if(next < 0) return next;
+        if((uint32_t)next != cluster + 1) {
+            #if EXFAT_DEBUG_PRINT
+                printf("exFAT: allocation bitmap is fragmented; read only\r\n");
+            #endif
+            return 0;
+        }
+        cluster = next;
+    }
+
+    vol->bitmapCluster = ent->firstCluster;
+    vol->bitmap.bytesPerSector      = FAT_SECTOR_SIZE;
+    vol->bitmap.numFats             = 1;
+    vol->bitmap.sectorsPerFat32     = (ent->size + FAT_SECTOR_SIZE - 1) /
+        FAT_SECTOR_SIZE;
+    vol->bitmap._micron_startSector = exfatClusterToSector(boot,
+        ent->firstCluster);
+    int err = _countFree(blkdev, boot, &vol->numFree);
+    if(err) return err;
+    err = fatCacheInit(&vol->bitmap, EXFAT_DEFAULT_BITMAP_CACHE_SIZE);
+    if(err) return err;
+    vol->writable = vol->bitmap._micron_fatCache != NULL;
+
+    #if EXFAT_DEBUG_PRINT
+        printf("exFAT: %ld of %ld clusters free\r\n", vol->numFree,
+            boot->clusterCount);
+    #endif
+    return 0;
+}
+
+
+void exfatAllocFree(FILE *blkdev, exfat_boot *boot, uint32_t timeout) {
+    /** Free the memory used for cluster allocation.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @note This is called by exfatUnmount(), after exfatSync().
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    fatCacheFree(blkdev, &vol->bitmap, timeout);
+    vol->writable = false;
+}
+
+
+static int _setBit(FILE *blkdev, exfat_boot *boot, uint32_t cluster,
+bool used, uint32_t timeout) {
+    //mark a cluster as used or free in the bitmap.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint32_t bit = cluster - 2;
+    uint32_t sector = bit / BITS_PER_SECTOR;
+    uint8_t *data;
+    int err = fatCacheGetSector(blkdev, &vol->bitmap, sector, &data, timeout);
+    if(err) return err;
+    uint8_t mask = 1 << (bit % 8);
+    uint8_t *b = &data[(bit % BITS_PER_SECTOR) / 8];
+    if(used) *b |= mask;
+    else *b &= ~mask;
+    return fatCacheMarkDirty(&vol->bitmap, sector);
+}
+
+
+int exfatIsFree(FILE *blkdev, exfat_boot *boot, uint32_t cluster,
+uint32_t timeout) {
+    /** Check whether a cluster is free.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param cluster The cluster number.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 1 if it's free, 0 if it's in use or doesn't exist, or
+     *   negative error code on failure.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol->writable) return -EROFS;
+    if(cluster < 2 || cluster >= boot->clusterCount + 2) return 0;
+    uint32_t bit = cluster - 2;
+    uint8_t *data;
+    int err = fatCacheGetSector(blkdev, &vol->bitmap, bit / BITS_PER_SECTOR,
+        &data, timeout);
+    if(err) return err;
+    return (data[(bit % BITS_PER_SECTOR) / 8] & (1 << (bit % 8))) ? 0 : 1;
+}
+
+
+static int _findFree(FILE *blkdev, exfat_boot *boot, uint32_t start,
+uint32_t *out, uint32_t timeout) {
+    //find a free cluster, starting from `start` and wrapping around.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint32_t count = boot->clusterCount;
+    if(start < 2 || start >= count + 2) start = 2;
+    uint32_t bit = start - 2;
+
+    for(uint32_t n=0; n < count; ) {
+        uint32_t sector = bit / BITS_PER_SECTOR;
+        uint8_t *data;
+        int err = fatCacheGetSector(blkdev, &vol->bitmap, sector, &data,
+            timeout);
+        if(err) return err;
+
+        //look through the rest of this sector.
+        uint32_t end = MIN((sector + 1) * BITS_PER_SECTOR, count);
+        while(bit < end && n < count) {
+            uint8_t b = data[(bit % BITS_PER_SECTOR) / 8];
+            if((bit % 8) == 0 && b == 0xFF) { //skip a full byte at once
+                bit += 8;
+                n   += 8;
+                continue;
+            }
+            if(!(b & (1 << (bit % 8)))) {
+                *out = bit + 2;
+                return 0;
+            }
+            bit++;
+            n++;
+        }
+        if(bit >= count) bit = 0;
+    }
+    return -ENOSPC;
+}
+
+
+int exfatAllocCluster(FILE *blkdev, exfat_boot *boot, uint32_t hint,
+uint32_t *out, uint32_t timeout) {
+    /** Allocate a cluster.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector.
+     *  @param hint Where to start looking, eg the cluster after the end of
+     *   the file it's for, or 0 to continue after the last allocation.
+     *  @param out Receives the new cluster number.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOSPC if the volume is full, or negative
+     *   error code on failure.
+     *  @note This only marks the cluster as used in the bitmap; the FAT
+     *   isn't changed, and neither are the cluster's contents.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol->writable) return -EROFS;
+    uint32_t cluster;
+    int err = _findFree(blkdev, boot, hint ? hint : vol->nextFree, &cluster,
+        timeout);
+    if(!err) err = _setBit(blkdev, boot, cluster, true, timeout);
+    if(err) return err;
+    if(vol->numFree) vol->numFree--;
+    vol->nextFree = cluster + 1;
+    *out = cluster;
+    return 0;
+}
+
+
+int exfatFreeClusters(FILE *blkdev, exfat_boot *boot, uint32_t first,
+uint32_t count, uint32_t timeout) {
+    /** Mark a run of clusters as free.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector.
+     *  @param first First cluster of the run.
+     *  @param count Number of clusters.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Nothing may refer to the clusters any more. Their FAT entries
+     *   don't need to be changed; exFAT ignores them for free clusters.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol->writable) return -EROFS;
+    if(first < 2 || first + count > boot->clusterCount + 2
+    || first + count < first) return -EINVAL;
+    for(uint32_t i=0; i<count; i++) {
+        int err = _setBit(blkdev, boot, first + i, false, timeout);
+        if(err) return err;
+        vol->numFree++;
+    }
+    if(count && first < vol->nextFree) vol->nextFree = first;
+    return 0;
+}
+
+
+int exfatSetFatEntry(FILE *blkdev, exfat_boot *boot, uint32_t cluster,
+uint32_t value, uint32_t timeout) {
+    /** Change a cluster's entry in the FAT.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector.
+     *  @param cluster The cluster number.
+     *  @param value The new entry: the next cluster, or FAT_CLUSTER_EOC.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Unlike fatSetFatEntry(), this writes all 32 bits, since exFAT
+     *   doesn't reserve any; FAT_CLUSTER_EOC becomes 0xFFFFFFFF.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(cluster < 2 || cluster >= boot->clusterCount + 2) return -EINVAL;
+    if(value == FAT_CLUSTER_EOC) value = 0xFFFFFFFF;
+    uint32_t sector = cluster / ENTRIES_PER_SECTOR;
+    uint32_t idx    = cluster % ENTRIES_PER_SECTOR;
+    uint8_t *cached;
+    int err = fatCacheGetSector(blkdev, &vol->fat, sector, &cached, timeout);
+    if(err == -ENOSYS) {
+        uint32_t buf[ENTRIES_PER_SECTOR];
+        err = _fatReadSector(blkdev, vol->fat._micron_startSector + sector,
+            buf);
+        if(err < 0) return err;
+        buf[idx] = value;
+        return fatWriteFatSector(blkdev, &vol->fat, sector, buf);
+    }
+    if(err < 0) return err;
+    ((uint32_t*)cached)[idx] = value;
+    return fatCacheMarkDirty(&vol->fat, sector);
+}
+
+
+int exfatAllocFlush(FILE *blkdev, exfat_boot *boot, uint32_t timeout) {
+    /** Write any modified FAT and bitmap sectors to disk.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The bitmap is written first, so that a chain never refers to
+     *   a cluster that's free on the disk. The root directory has no entry,
+     *   so its chain is all that refers to its clusters.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    int err = fatCacheFlush(blkdev, &vol->bitmap, timeout);
+    if(!err) err = fatCacheFlush(blkdev, &vol->fat, timeout);
+    return err;
+}
+
+
+int64_t exfatGetFreeSpace(exfat_boot *boot) {
+    /** Get the amount of free space on the volume.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @return Number of free bytes, or negative error code on failure.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!(vol && vol->writable)) return -EROFS;
+    return (int64_t)vol->numFree * exfatClusterSize(boot);
+}
@@ -0,0 +1,240 @@
+//Directory iteration.
+//Each file is described by a set of consecutive entries: a file entry
+//(attributes and times), a stream extension (size and clusters), and one
+//or more name entries, protected by a checksum. We read the directory one
+//sector at a time and assemble these sets as we go; they can cross sector
+//and cluster boundaries.
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / EXFAT_ENTRY_SIZE)
+
+uint16_t exfatSetChecksum(const uint8_t *entries, int count) {
+    /** Compute the checksum of a directory entry set.
+     *  @param entries The entries, starting with the file entry.
+     *  @param count Number of entries.
+     *  @return The checksum.
+     *  @note The checksum field itself (bytes 2 and 3) is skipped.
+     */
+    uint16_t sum = 0;
+    for(int i=0; i < count * EXFAT_ENTRY_SIZE; i++) {
+        if(i == 2 || i == 3) continue;
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + entries[i];
+    }
+    return sum;
+}
+
+
+int exfatOpenDir(exfat_boot *boot, const MicronExfatDirent *dirent,
+MicronExfatDir *out) {
+    /** Prepare to read a directory.
+     *  @param boot The volume's boot sector.
+     *  @param dirent The directory's entry, or NULL for the root directory.
+     *  @param out Receives the directory state.
+     *  @return 0 on success, -ENOTDIR if it's not a directory, or negative
+     *   error code on failure.
+     */
+    memset(out, 0, sizeof(MicronExfatDir));
+    if(dirent && dirent->entrySectors[0]) {
+        if(!(dirent->attributes & FAT_ATTR_DIRECTORY)) return -ENOTDIR;
+        out->firstCluster = dirent->cluster;
+        out->flags        = dirent->flags;
+        out->numClusters  = (dirent->size + exfatClusterSize(boot) - 1) /
+            exfatClusterSize(boot);
+    }
+    else out->firstCluster = boot->rootCluster; //root uses the FAT
+    if(out->firstCluster < 2) return -EILSEQ;
+    out->cluster = out->firstCluster;
+    return 0;
+}
+
+
+void exfatRewindDir(MicronExfatDir *dir) {
+    /** Go back to the beginning of a directory.
+     *  @param dir The directory.
+     */
+    dir->cluster    = dir->firstCluster;
+    dir->clusterIdx = 0;
+    dir->sector     = 0;
+    dir->entry      = 0;
+    dir->index      = 0;
+    dir->loaded     = false;
+    dir->end        = false;
+}
+
+
+static int _loadSector(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir,
+uint32_t timeout) {
+    //read the current sector of the directory, moving on to the
+    //next cluster if needed.
+    if(dir->sector >= (1UL << boot->sectorsPerClusterShift)) {
+        uint32_t next;
+        if(dir->flags & EXFAT_FLAG_NO_FAT_CHAIN) {
+            next = (dir->clusterIdx + 1 < dir->numClusters) ?
+                dir->cluster + 1 : 0;
+        }
+        else {
+            int err = fatGetNextCluster(blkdev, &boot->_micron_vol->fat,
+                dir->cluster, timeout);
+            if(err < 0) return err;
+            next = err;
+        }
+        if(next < 2) {
+            dir->end = true;
+            return -ENOENT;
+        }
+        dir->cluster = next;
+        dir->clusterIdx++;
+        dir->sector  = 0;
+    }
+    dir->bufSector = exfatClusterToSector(boot, dir->cluster) + dir->sector;
+    int err = _fatReadSector(blkdev, dir->bufSector, dir->buffer);
+    if(err < 0) return err;
+    dir->loaded = true;
+    return 0;
+}
+
+
+int exfatReadDirRaw(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir,
+const uint8_t **out, uint32_t timeout) {
+    /** Read the next raw entry from a directory.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param dir The directory, from exfatOpenDir().
+     *  @param out Receives a pointer to the 32-byte entry, which remains
+     *   valid until the next call.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT at the end of the directory's
+     *   clusters, or negative error code on failure.
+     *  @note This returns every entry as it is on disk, including deleted
+     *   entries and the unused entries after the end marker.
+     *   `dir->entSector`, `dir->entOffset` and `dir->entIndex` receive its
+     *   location.
+     */
+    if(dir->end) return -ENOENT;
+    if(!dir->loaded) {
+        int err = _loadSector(blkdev, boot, dir, timeout);
+        if(err < 0) return err;
+    }
+
+    *out = &dir->buffer[dir->entry * EXFAT_ENTRY_SIZE];
+    dir->entSector = dir->bufSector;
+    dir->entOffset = dir->entry * EXFAT_ENTRY_SIZE;
+    dir->entIndex  = dir->index;
+
+    dir->index++;
+    if(++dir->entry >= ENTRIES_PER_SECTOR) {
+        dir->entry  = 0;
+        dir->sector++;
+        dir->loaded = false;
+    }
+    return 0;
+}
+
+
+static int _readSet(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir,
+MicronExfatDirent *out, uint32_t timeout) {
+    //read the secondary entries following a file entry, which is already
+    //in dir->set. returns 0 if the set is valid, -EILSEQ if not.
+    const exfat_file_entry *file = (const exfat_file_entry*)dir->set;
+    int count = file->secondaryCount + 1;
+    int numSectors = 1;
+    out->entrySectors[0] = dir->entSector;
+    out->entrySectors[1] = 0;
+    out->entrySectors[2] = 0;
+    out->entryOffset     = dir->entOffset;
+
+    //need a stream entry and at least one name entry.
+    if(count < 3 || count > EXFAT_MAX_SET) return -EILSEQ;
+    for(int i=1; i<count; i++) {
+        const uint8_t *ent;
+        int err = exfatReadDirRaw(blkdev, boot, dir, &ent, timeout);
+        if(err) return err;
+        if(ent[0] == EXFAT_ENTRY_END) {
+            dir->end = true;
+            return -ENOENT;
+        }
+        if(dir->entSector != out->entrySectors[numSectors - 1]) {
+            out->entrySectors[numSectors++] = dir->entSector;
+        }
+        memcpy(&dir->set[i * EXFAT_ENTRY_SIZE], ent, EXFAT_ENTRY_SIZE);
+        //secondary entries have bits 7 and 6 set.
+        if((ent[0] & 0xC0) != 0xC0) return -EILSEQ;
+    }
+
+    const exfat_stream_entry *stream =
+        (const exfat_stream_entry*)&dir->set[EXFAT_ENTRY_SIZE];
+    if(stream->type != EXFAT_ENTRY_STREAM
+    || stream->nameLength == 0
+    || (stream->nameLength + 14) / 15 > count - 2
+    || exfatSetChecksum(dir->set, count) != file->setChecksum) {
+        return -EILSEQ;
+    }
+
+    //collect the name from the name entries.
+    uint16_t name[EXFAT_MAX_NAME];
+    int len = 0;
+    for(int i=2; i<count && len < stream->nameLength; i++) {
+        const exfat_name_entry *n =
+            (const exfat_name_entry*)&dir->set[i * EXFAT_ENTRY_SIZE];
+        if(n->type != EXFAT_ENTRY_NAME) return -EILSEQ;
+        for(int j=0; j<15 && len < stream->nameLength; j++) {
+            name[len++] = n->name[j];
+        }
+    }
+    exfatNameToUtf8(name, len, out->name, sizeof(out->name));
+
+    out->attributes = file->attributes;
+    out->flags      = stream->flags;
+    out->numEntries = count;
+    out->nameHash   = stream->nameHash;
+    out->createTime = exfatDecodeTimestamp(file->createTime, file->create10ms);
+    out->modifyTime = exfatDecodeTimestamp(file->modifyTime, file->modify10ms);
+    out->accessTime = exfatDecodeTimestamp(file->accessTime, 0);
+    out->cluster    = stream->firstCluster;
+    out->size       = stream->size;
+    out->validSize  = MIN(stream->validSize, stream->size);
+    return 0;
+}
+
+
+int exfatReadDirNext(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir,
+MicronExfatDirent *out, uint32_t timeout) {
+    /** Read the next file or directory from a directory.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param dir The directory, from exfatOpenDir().
+     *  @param out Receives the entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT at the end of the directory, or
+     *   negative error code on failure.
+     *  @note Deleted entries, entry sets with a bad checksum, and other
+     *   kinds of entries (volume label, allocation bitmap etc) are skipped.
+     *   `dir->entIndex` receives the index of the set's file entry.
+     */
+    while(1) {
+        const uint8_t *ent;
+        int err = exfatReadDirRaw(blkdev, boot, dir, &ent, timeout);
+        if(err) return err;
+        if(ent[0] == EXFAT_ENTRY_END) {
+            dir->end = true;
+            return -ENOENT;
+        }
+        if(ent[0] != EXFAT_ENTRY_FILE) continue;
+
+        uint32_t index = dir->entIndex;
+        memcpy(dir->set, ent, EXFAT_ENTRY_SIZE);
+        err = _readSet(blkdev, boot, dir, out, timeout);
+        if(err == -EILSEQ) {
+            #if EXFAT_DEBUG_PRINT
+                printf("exFAT: bad entry set at index %ld\r\n", index);
+            #endif
+            continue;
+        }
+        if(err) return err;
+        dir->entIndex = index;
+        return 0;
+    }
+}
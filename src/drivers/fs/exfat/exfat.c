@@ -0,0 +1,300 @@
+//Mounting exFAT volumes.
+//The boot sector gives the location of the FAT and the cluster heap; the
+//allocation bitmap and up-case table are found through entries in the
+//root directory.
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+#define BOOT_REGION_SECTORS 12 //boot sector, extended boot, OEM, checksum
+
+static uint32_t _bootChecksum(const uint8_t *data, uint32_t len) {
+    //checksum of the boot region. VolumeFlags and PercentInUse are
+    //skipped, so that they can change without rewriting it.
+    uint32_t sum = 0;
+    for(uint32_t i=0; i<len; i++) {
+        if(i == 106 || i == 107 || i == 112) continue;
+        sum = ((sum & 1) ? 0x80000000UL : 0) + (sum >> 1) + data[i];
+    }
+    return sum;
+}
+
+
+uint32_t exfatClusterSize(exfat_boot *boot) {
+    /** Get the size of a cluster, in bytes.
+     *  @param boot The volume's boot sector.
+     *  @return The cluster size.
+     */
+    return FAT_SECTOR_SIZE << boot->sectorsPerClusterShift;
+}
+
+
+uint64_t exfatClusterToSector(exfat_boot *boot, uint32_t cluster) {
+    /** Find where a cluster is on the disk.
+     *  @param boot The volume's boot sector.
+     *  @param cluster The cluster number.
+     *  @return The absolute sector number of the cluster's first sector.
+     */
+    return boot->_micron_startSector + boot->clusterHeapOffset +
+        ((uint64_t)(cluster - 2) << boot->sectorsPerClusterShift);
+}
+
+
+uint32_t exfatDecodeTimestamp(uint32_t stamp, uint8_t centisecs) {
+    /** Convert an exFAT timestamp to a UNIX timestamp.
+     *  @param stamp The timestamp: FAT date in the upper 16 bits and FAT
+     *   time in the lower 16 bits.
+     *  @param centisecs The 10ms field that goes with it (0 to 199).
+     *  @return Seconds since 1970-01-01 00:00:00.
+     *  @note The UTC offset isn't applied, so this is in whatever time zone
+     *   the timestamp was written in.
+     */
+    uint16_t year;
+    uint8_t month, day, hour, minute, second;
+    fatDecodeDate(stamp >> 16, &year, &month, &day);
+    fatDecodeTime(stamp & 0xFFFF, &hour, &minute, &second);
+    if(month < 1 || month > 12 || day < 1) return 0;
+
+    //convert the civil date to days since epoch.
+    //see http://howardhinnant.github.io/date_algorithms.html
+    uint32_t y   = year - (month <= 2 ? 1 : 0);
+    uint32_t era = y / 400;
+    uint32_t yoe = y - (era * 400);
+    uint32_t doy = ((153 * (month > 2 ? month - 3 : month + 9)) + 2) / 5 +
+        day - 1;
+    uint32_t doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+    uint32_t days = (era * 146097) + doe - 719468;
+    return (days * 86400) + (hour * 3600) + (minute * 60) + second +
+        (centisecs / 100);
+}
+
+
+int exfatGetBoot(FILE *blkdev, uint64_t sector, exfat_boot *out,
+uint32_t timeout) {
+    /** Read and check an exFAT boot sector.
+     *  @param blkdev Block device to read from.
+     *  @param sector Which sector the volume begins at.
+     *  @param out Receives the boot sector.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EILSEQ if it's not an exFAT volume or the
+     *   boot region is corrupt, -ENOSYS if it uses features we don't
+     *   support, or other negative error code on failure.
+     */
+    uint8_t *buf = (uint8_t*)malloc(BOOT_REGION_SECTORS * FAT_SECTOR_SIZE);
+    if(!buf) return -ENOMEM;
+    int err = _fatReadSectors(blkdev, sector, BOOT_REGION_SECTORS, buf);
+    if(err < 0) {
+        free(buf);
+        return err;
+    }
+    memcpy(out, buf, sizeof(exfat_boot));
+
+    //the last sector of the boot region is filled with its checksum.
+    uint32_t sum = _bootChecksum(buf,
+        (BOOT_REGION_SECTORS - 1) * FAT_SECTOR_SIZE);
+    uint32_t stored;
+    memcpy(&stored, &buf[(BOOT_REGION_SECTORS - 1) * FAT_SECTOR_SIZE], 4);
+    free(buf);
+
+    if(out->bootSig != 0xAA55 || memcmp(out->fsName, "EXFAT   ", 8)) {
+        #if EXFAT_DEBUG_PRINT
+            printf("exFAT: not an exFAT boot sector\r\n");
+        #endif
+        return -EILSEQ;
+    }
+    if(sum != stored) {
+        #if EXFAT_DEBUG_PRINT
+            printf("exFAT: boot checksum 0x%08lX, expected 0x%08lX\r\n",
+                sum, stored);
+        #endif
+        return -EILSEQ;
+    }
+    out->_micron_startSector = sector;
+    out->_micron_vol         = NULL;
+
+    #if EXFAT_DEBUG_PRINT
+        printf("exFAT boot sector at 0x%08llx:\r\n", sector);
+        printf("  volumeLength:      0x%08llX\r\n", out->volumeLength);
+        printf("  fatOffset:         0x%08lX\r\n", out->fatOffset);
+        printf("  fatLength:         0x%08lX\r\n", out->fatLength);
+        printf("  clusterHeapOffset: 0x%08lX\r\n", out->clusterHeapOffset);
+        printf("  clusterCount:      0x%08lX\r\n", out->clusterCount);
+        printf("  rootCluster:       0x%08lX\r\n", out->rootCluster);
+        printf("  serial:            0x%08lX\r\n", out->serial);
+        printf("  revision:          0x%04X\r\n",  out->revision);
+        printf("  volumeFlags:       0x%04X\r\n",  out->volumeFlags);
+        printf("  sectorShift:       %d\r\n",      out->bytesPerSectorShift);
+        printf("  clusterShift:      %d\r\n",
+            out->sectorsPerClusterShift);
+        printf("  numFats:           %d\r\n",      out->numFats);
+        printf("  percentInUse:      %d\r\n",      out->percentInUse);
+    #endif
+
+    if((1 << out->bytesPerSectorShift) != FAT_SECTOR_SIZE
+    || out->sectorsPerClusterShift > 25 - 9 //clusters are at most 32MB
+    || out->numFats != 1 //TexFAT
+    || (out->revision >> 8) != 1) {
+        #if EXFAT_DEBUG_PRINT
+            printf("exFAT: unsupported volume\r\n");
+        #endif
+        return -ENOSYS;
+    }
+    return 0;
+}
+
+
+static int _findTables(FILE *blkdev, exfat_boot *boot,
+exfat_table_entry *bitmap, exfat_table_entry *upcase, uint32_t timeout) {
+    //look through the root directory for the allocation bitmap and
+    //up-case table. they come before any files, but not necessarily
+    //in the first sector.
+    MicronExfatDir *dir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    if(!dir) return -ENOMEM;
+    memset(bitmap, 0, sizeof(exfat_table_entry));
+    memset(upcase, 0, sizeof(exfat_table_entry));
+
+    int err = exfatOpenDir(boot, NULL, dir);
+    while(!err) {
+        const uint8_t *ent;
+        err = exfatReadDirRaw(blkdev, boot, dir, &ent, timeout);
+        if(err) break;
+        if(ent[0] == EXFAT_ENTRY_END) break;
+        if(ent[0] == EXFAT_ENTRY_BITMAP && !bitmap->type) {
+            memcpy(bitmap, ent, sizeof(exfat_table_entry));
+        }
+        else if(ent[0] == EXFAT_ENTRY_UPCASE && !upcase->type) {
+            memcpy(upcase, ent, sizeof(exfat_table_entry));
+        }
+        if(bitmap->type && upcase->type) break;
+    }
+    free(dir);
+    if(err == -ENOENT) err = 0;
+    return err;
+}
+
+
+int exfatMount(FILE *blkdev, uint64_t sector, exfat_boot *out,
+uint16_t cacheSize, uint32_t timeout) {
+    /** Prepare to access an exFAT volume.
+     *  @param blkdev Block device to read from.
+     *  @param sector Which sector the volume begins at.
+     *  @param out Receives the volume's boot sector and our state.
+     *  @param cacheSize How many sectors of the FAT to cache.
+     *   FAT_DEFAULT_CACHE_SIZE is a reasonable choice.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Unlike fatMount(), this doesn't need to read the FAT, since
+     *   exFAT keeps track of free clusters in its own bitmap. It does read
+     *   the bitmap once to count them. If the bitmap can't be used, the
+     *   volume can still be read, but writes fail with -EROFS.
+     *   Call exfatUnmount() when done.
+     */
+    int err = exfatGetBoot(blkdev, sector, out, timeout);
+    if(err) return err;
+
+    MicronExfatVolume *vol = (MicronExfatVolume*)malloc(
+        sizeof(MicronExfatVolume));
+    if(!vol) return -ENOMEM;
+    memset(vol, 0, sizeof(MicronExfatVolume));
+    vol->fat.bytesPerSector      = FAT_SECTOR_SIZE;
+    vol->fat.numFats             = 1;
+    vol->fat.sectorsPerFat32     = out->fatLength;
+    vol->fat._micron_startSector = sector + out->fatOffset;
+    vol->numFree  = 0xFFFFFFFF;
+    vol->nextFree = 2;
+
+    err = fatCacheInit(&vol->fat, cacheSize);
+    if(err) {
+        free(vol);
+        return err;
+    }
+    out->_micron_vol = vol;
+
+    exfat_table_entry bitmap, upcase;
+    err = _findTables(blkdev, out, &bitmap, &upcase, timeout);
+    if(!err) err = exfatUpcaseInit(blkdev, out, &upcase, timeout);
+    if(!err) err = exfatAllocInit(blkdev, out, &bitmap, timeout);
+    if(err) {
+        fatCacheFree(blkdev, &vol->fat, timeout);
+        free(vol);
+        out->_micron_vol = NULL;
+    }
+    return err;
+}
+
+
+int exfatSetDirty(FILE *blkdev, exfat_boot *boot, bool dirty,
+uint32_t timeout) {
+    /** Set or clear the volume's dirty flag.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param dirty Whether to set it.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The flag tells other systems to check the volume if it wasn't
+     *   cleared, ie if we lost power while changing it. It's set before
+     *   the first change, and cleared by exfatSync(). PercentInUse is
+     *   updated at the same time.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol) return -EINVAL;
+    if(vol->dirty == dirty) return 0;
+
+    //we keep our state in the boot code area, so re-read the sector
+    //rather than writing our copy. these fields aren't included in the
+    //boot checksum, so it doesn't need updating.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    int err = _fatReadSector(blkdev, boot->_micron_startSector, buf);
+    if(err < 0) return err;
+    exfat_boot *disk = (exfat_boot*)buf;
+    if(dirty) disk->volumeFlags |=  EXFAT_VOLUME_DIRTY;
+    else      disk->volumeFlags &= ~EXFAT_VOLUME_DIRTY;
+    if(vol->numFree != 0xFFFFFFFF && boot->clusterCount) {
+        disk->percentInUse = ((uint64_t)(boot->clusterCount - vol->numFree)
+            * 100) / boot->clusterCount;
+    }
+    err = _fatWriteSector(blkdev, boot->_micron_startSector, buf);
+    if(err < 0) return err;
+    boot->volumeFlags  = disk->volumeFlags;
+    boot->percentInUse = disk->percentInUse;
+    vol->dirty = dirty;
+    return 0;
+}
+
+
+int exfatSync(FILE *blkdev, exfat_boot *boot, uint32_t timeout) {
+    /** Write all pending changes to disk.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by exfatUnmount(). Afterward, the volume is
+     *   marked clean until it's next changed.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol) return 0;
+    int err = exfatAllocFlush(blkdev, boot, timeout);
+    if(!err) err = exfatSetDirty(blkdev, boot, false, timeout);
+    return err;
+}
+
+
+int exfatUnmount(FILE *blkdev, exfat_boot *boot, uint32_t timeout) {
+    /** Finish accessing an exFAT volume.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Any pending changes are written, and memory used by the
+     *   volume state is freed.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!vol) return 0;
+    int err = exfatSync(blkdev, boot, timeout);
+    exfatAllocFree(blkdev, boot, timeout);
+    int err2 = fatCacheFree(blkdev, &vol->fat, timeout);
+    free(vol);
+    boot->_micron_vol = NULL;
+    return err ? err : err2;
+}
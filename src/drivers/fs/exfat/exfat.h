@@ -0,0 +1,266 @@
+#ifndef _MICRON_DRIVERS_FS_EXFAT_H_
+#define _MICRON_DRIVERS_FS_EXFAT_H_
+
+//exFAT keeps FAT32's layout for the FAT itself (32-bit entries, clusters
+//numbered from 2), so we build on the FAT driver's sector I/O, FAT cache
+//and cluster map code.
+#include "../fat/fat.h"
+
+#ifndef EXFAT_DEBUG_PRINT
+#define EXFAT_DEBUG_PRINT 1
+#endif
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+//number of allocation bitmap sectors to cache, used by exfatMount().
+//each one covers 4096 clusters.
+#ifndef EXFAT_DEFAULT_BITMAP_CACHE_SIZE
+#define EXFAT_DEFAULT_BITMAP_CACHE_SIZE 2
+#endif
+
+//how much of the up-case table to keep in memory, in characters (2 bytes
+//each). names with characters beyond this are up-cased by reading the
+//table from the disk, which is much slower, but only happens when such
+//a name is created or its hash matches one being looked up.
+#ifndef EXFAT_UPCASE_CHARS
+#define EXFAT_UPCASE_CHARS 256
+#endif
+
+#define EXFAT_MAX_NAME 255 //max name length, in UTF-16 characters
+#define EXFAT_MAX_NAME_UTF8 (EXFAT_MAX_NAME * 3) //in bytes of UTF-8
+#define EXFAT_MAX_SET 19 //max entries per file: file, stream, 17 names
+#define EXFAT_ENTRY_SIZE 32
+
+struct MicronExfatVolume; //declare
+
+typedef struct PACKED {
+    uint8_t  jumpCode[3];
+    char     fsName[8];          //"EXFAT   "
+    uint8_t  mustBeZero[53];     //where FAT's BIOS parameter block would be
+    uint64_t partitionOffset;    //in sectors; 0 = ignore
+    uint64_t volumeLength;       //in sectors
+    uint32_t fatOffset;          //in sectors, from start of volume
+    uint32_t fatLength;          //in sectors
+    uint32_t clusterHeapOffset;  //in sectors, from start of volume
+    uint32_t clusterCount;
+    uint32_t rootCluster;        //first cluster of root directory
+    uint32_t serial;
+    uint16_t revision;           //0x0100 = 1.00
+    uint16_t volumeFlags;        //EXFAT_VOLUME_*
+    uint8_t  bytesPerSectorShift;    //log2(bytes per sector)
+    uint8_t  sectorsPerClusterShift; //log2(sectors per cluster)
+    uint8_t  numFats;            //2 only for TexFAT
+    uint8_t  driveSelect;
+    uint8_t  percentInUse;       //0xFF = unknown
+    uint8_t  reserved[7];
+    union PACKED {
+        uint8_t  bootCode[390];
+        struct PACKED { //we'll use this space to store our own state
+            uint64_t _micron_startSector; //sector the boot sector is at
+            struct MicronExfatVolume *_micron_vol; //set by exfatMount
+        };
+    };
+    uint16_t bootSig;            //0xAA55
+} exfat_boot;
+
+#define EXFAT_VOLUME_ACTIVE_FAT    BIT(0) //which FAT is in use (TexFAT)
+#define EXFAT_VOLUME_DIRTY         BIT(1) //not cleanly unmounted
+#define EXFAT_VOLUME_MEDIA_FAILURE BIT(2) //device reported errors
+
+//directory entry types. bit 7 is cleared when the entry is deleted.
+#define EXFAT_ENTRY_END     0x00 //no more entries in this directory
+#define EXFAT_ENTRY_INUSE   0x80
+#define EXFAT_ENTRY_BITMAP  0x81 //allocation bitmap
+#define EXFAT_ENTRY_UPCASE  0x82 //up-case table
+#define EXFAT_ENTRY_LABEL   0x83 //volume label
+#define EXFAT_ENTRY_FILE    0x85 //file or directory; followed by:
+#define EXFAT_ENTRY_GUID    0xA0 //volume GUID
+#define EXFAT_ENTRY_STREAM  0xC0 //stream extension (size and clusters)
+#define EXFAT_ENTRY_NAME    0xC1 //up to 15 characters of the name
+
+//exFAT uses the same attributes as FAT (FAT_ATTR_*), minus the volume
+//label bit, in 16 bits.
+
+typedef struct PACKED {
+    uint8_t  type;            //EXFAT_ENTRY_FILE
+    uint8_t  secondaryCount;  //number of entries that follow
+    uint16_t setChecksum;     //of this and the following entries
+    uint16_t attributes;      //FAT_ATTR_*
+    uint16_t reserved1;
+    //timestamps are FAT date << 16 | FAT time.
+    uint32_t createTime;
+    uint32_t modifyTime;
+    uint32_t accessTime;
+    uint8_t  create10ms;      //0 to 199, added to createTime
+    uint8_t  modify10ms;
+    uint8_t  createUtcOffset; //bit 7 = valid, bits 0-6 = 15-minute units
+    uint8_t  modifyUtcOffset;
+    uint8_t  accessUtcOffset;
+    uint8_t  reserved2[7];
+} exfat_file_entry;
+
+#define EXFAT_FLAG_ALLOC_POSSIBLE BIT(0) //must be set if it has clusters
+#define EXFAT_FLAG_NO_FAT_CHAIN   BIT(1) //clusters are contiguous; the FAT
+                                         //isn't used for this file
+
+typedef struct PACKED {
+    uint8_t  type;            //EXFAT_ENTRY_STREAM
+    uint8_t  flags;           //EXFAT_FLAG_*
+    uint8_t  reserved1;
+    uint8_t  nameLength;      //in UTF-16 characters
+    uint16_t nameHash;        //see exfatNameHash()
+    uint16_t reserved2;
+    uint64_t validSize;       //bytes written so far; the rest reads as 0
+    uint32_t reserved3;
+    uint32_t firstCluster;    //0 = none
+    uint64_t size;            //bytes allocated
+} exfat_stream_entry;
+
+typedef struct PACKED {
+    uint8_t  type;            //EXFAT_ENTRY_NAME
+    uint8_t  flags;
+    uint16_t name[15];        //UTF-16, padded with zeros
+} exfat_name_entry;
+
+typedef struct PACKED {
+    uint8_t  type;            //EXFAT_ENTRY_BITMAP or EXFAT_ENTRY_UPCASE
+    uint8_t  flags;           //bitmap: which FAT it's for (TexFAT)
+    uint8_t  reserved1[2];
+    uint32_t checksum;        //up-case table only
+    uint8_t  reserved2[12];
+    uint32_t firstCluster;
+    uint64_t size;            //in bytes
+} exfat_table_entry;
+
+typedef struct {
+    char     name[EXFAT_MAX_NAME_UTF8 + 1]; //UTF-8
+    uint16_t attributes;   //FAT_ATTR_*
+    uint8_t  flags;        //EXFAT_FLAG_*
+    uint8_t  numEntries;   //number of directory entries in its set
+    uint16_t nameHash;     //from its stream entry
+    uint32_t createTime;   //UNIX timestamp
+    uint32_t modifyTime;   //UNIX timestamp
+    uint32_t accessTime;   //UNIX timestamp
+    uint32_t cluster;      //first cluster (0 = none)
+    uint64_t size;         //bytes allocated
+    uint64_t validSize;    //bytes that have been written
+    //where its entries are: entry `i` of the set is at byte
+    //((entryOffset / 32) + i) * 32, counting from the start of
+    //entrySectors[0] and continuing in entrySectors[1] and [2].
+    //entrySectors[0] is 0 for the root directory, which has no entry.
+    uint64_t entrySectors[3];
+    uint16_t entryOffset;
+} MicronExfatDirent;
+
+typedef struct {
+    //for files whose clusters are in the FAT, this maps them just as it
+    //does for FAT32. `map.firstCluster` is the file's first cluster.
+    MicronFatFile map;
+    uint32_t numClusters;  //number of clusters allocated
+    uint16_t attributes;   //FAT_ATTR_*
+    uint8_t  flags;        //EXFAT_FLAG_*
+    uint8_t  numEntries;   //as in MicronExfatDirent
+    uint64_t size;         //bytes allocated
+    uint64_t validSize;    //bytes that have been written
+    uint64_t entrySectors[3]; //as in MicronExfatDirent
+    uint16_t entryOffset;
+} MicronExfatFile;
+
+typedef struct {
+    uint32_t firstCluster; //directory's first cluster
+    uint32_t numClusters;  //its length, if EXFAT_FLAG_NO_FAT_CHAIN is set
+    uint8_t  flags;        //EXFAT_FLAG_*
+    uint32_t cluster;      //current cluster
+    uint32_t clusterIdx;   //index of current cluster within directory
+    uint32_t sector;       //current sector within cluster
+    uint32_t index;        //index of next entry within directory
+    uint16_t entry;        //index of next entry within sector
+    bool     loaded;       //whether `buffer` holds the current sector
+    bool     end;          //whether we reached the end
+    uint64_t bufSector;    //which sector is in `buffer`
+    uint8_t  buffer[FAT_SECTOR_SIZE];
+    //information about the last raw entry returned
+    uint32_t entIndex;     //index within directory
+    uint64_t entSector;    //sector it's in
+    uint16_t entOffset;    //byte offset within that sector
+    //entry set being assembled by exfatReadDirNext()
+    uint8_t  set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+} MicronExfatDir;
+
+typedef struct MicronExfatVolume {
+    //the FAT and the allocation bitmap are each described as a FAT32
+    //FAT with one copy and no reserved sectors, so that they can use the
+    //FAT sector cache (see ../fat/cache.c) and chain walking code.
+    fat32_mbr fat;
+    fat32_mbr bitmap;
+    uint32_t  bitmapCluster; //allocation bitmap's first cluster
+    uint32_t  numFree;     //number of free clusters (0xFFFFFFFF = unknown)
+    uint32_t  nextFree;    //where to start looking for a free cluster
+    bool      writable;    //whether we found a usable allocation bitmap
+    bool      dirty;       //whether we've set EXFAT_VOLUME_DIRTY on disk
+    uint32_t  upcaseCluster; //up-case table's first cluster (0 = none)
+    uint32_t  upcaseSize;    //its size in bytes
+    uint16_t  upcase[EXFAT_UPCASE_CHARS]; //its first part, decompressed
+} MicronExfatVolume;
+
+//alloc.c
+int exfatAllocInit(FILE *blkdev, exfat_boot *boot, const exfat_table_entry *ent, uint32_t timeout);
+void exfatAllocFree(FILE *blkdev, exfat_boot *boot, uint32_t timeout);
+int exfatAllocCluster(FILE *blkdev, exfat_boot *boot, uint32_t hint, uint32_t *out, uint32_t timeout);
+int exfatFreeClusters(FILE *blkdev, exfat_boot *boot, uint32_t first, uint32_t count, uint32_t timeout);
+int exfatIsFree(FILE *blkdev, exfat_boot *boot, uint32_t cluster, uint32_t timeout);
+int exfatSetFatEntry(FILE *blkdev, exfat_boot *boot, uint32_t cluster, uint32_t value, uint32_t timeout);
+int exfatAllocFlush(FILE *blkdev, exfat_boot *boot, uint32_t timeout);
+int64_t exfatGetFreeSpace(exfat_boot *boot);
+
+//dir.c
+uint16_t exfatSetChecksum(const uint8_t *entries, int count);
+int exfatOpenDir(exfat_boot *boot, const MicronExfatDirent *dirent, MicronExfatDir *out);
+void exfatRewindDir(MicronExfatDir *dir);
+int exfatReadDirRaw(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir, const uint8_t **out, uint32_t timeout);
+int exfatReadDirNext(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir, MicronExfatDirent *out, uint32_t timeout);
+
+//exfat.c
+int exfatGetBoot(FILE *blkdev, uint64_t sector, exfat_boot *out, uint32_t timeout);
+int exfatMount(FILE *blkdev, uint64_t sector, exfat_boot *out, uint16_t cacheSize, uint32_t timeout);
+int exfatUnmount(FILE *blkdev, exfat_boot *boot, uint32_t timeout);
+int exfatSync(FILE *blkdev, exfat_boot *boot, uint32_t timeout);
+int exfatSetDirty(FILE *blkdev, exfat_boot *boot, bool dirty, uint32_t timeout);
+uint32_t exfatClusterSize(exfat_boot *boot);
+uint64_t exfatClusterToSector(exfat_boot *boot, uint32_t cluster);
+uint32_t exfatDecodeTimestamp(uint32_t stamp, uint8_t centisecs);
+
+//file.c
+int exfatOpenFile(exfat_boot *boot, const MicronExfatDirent *dirent, MicronExfatFile *out, uint16_t maxExtents);
+void exfatCloseFile(MicronExfatFile *file);
+int exfatMapCluster(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file, uint32_t idx, uint32_t *outCluster, uint32_t *outRun, uint32_t timeout);
+int exfatReadFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file, uint64_t offset, uint32_t size, void *out, uint32_t timeout);
+
+//name.c
+int exfatUpcaseInit(FILE *blkdev, exfat_boot *boot, const exfat_table_entry *ent, uint32_t timeout);
+int exfatUpcaseName(FILE *blkdev, exfat_boot *boot, uint16_t *name, int len, uint32_t timeout);
+uint16_t exfatNameHash(const uint16_t *name, int len);
+int exfatNameFromUtf8(const char *name, size_t len, uint16_t *out);
+int exfatNameToUtf8(const uint16_t *name, int len, char *out, size_t size);
+
+//path.c
+int exfatLookup(FILE *blkdev, exfat_boot *boot, const MicronExfatDirent *parent, const char *name, size_t len, MicronExfatDirent *out, uint32_t timeout);
+int exfatLookupPath(FILE *blkdev, exfat_boot *boot, const char *path, MicronExfatDirent *out, uint32_t timeout);
+int exfatLookupParent(FILE *blkdev, exfat_boot *boot, const char *path, MicronExfatDirent *out, const char **outName, uint32_t timeout);
+int exfatOpenPath(FILE *blkdev, exfat_boot *boot, const char *path, MicronExfatFile *out, uint16_t maxExtents, uint32_t timeout);
+
+//write.c
+int exfatCreate(FILE *blkdev, exfat_boot *boot, const char *path, uint16_t attributes, MicronExfatFile *out, uint16_t maxExtents, uint32_t timeout);
+int exfatMkdir(FILE *blkdev, exfat_boot *boot, const char *path, uint32_t timeout);
+int exfatDelete(FILE *blkdev, exfat_boot *boot, const char *path, uint32_t timeout);
+int exfatWriteFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file, uint64_t offset, uint32_t size, const void *data, uint32_t timeout);
+int exfatAppendFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file, const void *data, uint32_t size, uint32_t timeout);
+int exfatTruncateFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file, uint64_t size, uint32_t timeout);
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#endif //_MICRON_DRIVERS_FS_EXFAT_H_
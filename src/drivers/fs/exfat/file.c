@@ -0,0 +1,160 @@
+//Reading files.
+//A file marked NoFatChain occupies consecutive clusters, so finding any
+//part of it is just arithmetic, and it can be read in one request no
+//matter how large it is. Other files have their chain in the FAT, which we
+//map the same way as on FAT32 (see ../fat/extent.c).
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+int exfatOpenFile(exfat_boot *boot, const MicronExfatDirent *dirent,
+MicronExfatFile *out, uint16_t maxExtents) {
+    /** Prepare to access a file.
+     *  @param boot The volume's boot sector.
+     *  @param dirent The file's directory entry.
+     *  @param out Receives the file state.
+     *  @param maxExtents Maximum number of extents to remember, if the
+     *   file's clusters are in the FAT; see fatOpenFile().
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This doesn't read anything from the disk. Call exfatCloseFile()
+     *   when done.
+     */
+    memset(out, 0, sizeof(MicronExfatFile));
+    uint32_t clusterSize = exfatClusterSize(boot);
+    out->attributes  = dirent->attributes;
+    out->flags       = dirent->flags;
+    out->numEntries  = dirent->numEntries;
+    out->size        = dirent->size;
+    out->validSize   = dirent->validSize;
+    out->entryOffset = dirent->entryOffset;
+    out->numClusters = (dirent->size + clusterSize - 1) / clusterSize;
+    memcpy(out->entrySectors, dirent->entrySectors,
+        sizeof(out->entrySectors));
+
+    out->map.firstCluster = dirent->cluster;
+    out->map.size         = MIN(dirent->size, 0xFFFFFFFFULL);
+    out->map.complete     = dirent->cluster < 2;
+    if(dirent->cluster < 2) out->numClusters = 0;
+    if(maxExtents) {
+        out->map.extents = (MicronFatExtent*)malloc(
+            maxExtents * sizeof(MicronFatExtent));
+        if(!out->map.extents) return -ENOMEM;
+        out->map.maxExtents = maxExtents;
+    }
+    return 0;
+}
+
+
+void exfatCloseFile(MicronExfatFile *file) {
+    /** Free resources used by an open file.
+     *  @param file The file to close.
+     */
+    fatCloseFile(&file->map);
+}
+
+
+int exfatMapCluster(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint32_t idx, uint32_t *outCluster, uint32_t *outRun, uint32_t timeout) {
+    /** Find which cluster holds part of a file.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param file The file to look up.
+     *  @param idx Which cluster of the file (ie offset / cluster size).
+     *  @param outCluster Receives the cluster number.
+     *  @param outRun Receives the number of clusters, starting at this one,
+     *   which are known to be contiguous. Always at least 1.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ERANGE if the file doesn't have that many
+     *   clusters, or another negative error code on failure.
+     */
+    if(idx >= file->numClusters) return -ERANGE;
+    if(file->flags & EXFAT_FLAG_NO_FAT_CHAIN) {
+        *outCluster = file->map.firstCluster + idx;
+        *outRun     = file->numClusters - idx;
+        return 0;
+    }
+    return fatMapCluster(blkdev, &boot->_micron_vol->fat, &file->map, idx,
+        outCluster, outRun, timeout);
+}
+
+
+int exfatReadFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint64_t offset, uint32_t size, void *out, uint32_t timeout) {
+    /** Read from a file.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param file The file to read, from exfatOpenFile().
+     *  @param offset Byte offset to read from.
+     *  @param size Number of bytes to read.
+     *  @param out Destination buffer.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes read, which is less than `size` if the end
+     *   of the file is reached, or negative error code on failure.
+     *  @note As with fatReadFile(), whole sectors are read directly into
+     *   `out`, as many at once as are contiguous on the disk. Anything
+     *   past the file's valid size reads as zeros, without reading the
+     *   disk.
+     */
+    uint8_t  *dest = (uint8_t*)out;
+    uint32_t spc = 1UL << boot->sectorsPerClusterShift;
+    uint32_t clusterSize = exfatClusterSize(boot);
+    if(offset >= file->size) return 0;
+    size = MIN((uint64_t)size, file->size - offset);
+
+    uint32_t destOffs = 0;
+    while(destOffs < size) {
+        uint64_t pos = offset + destOffs;
+        uint32_t remain = size - destOffs;
+        if(pos >= file->validSize) { //never written
+            memset(&dest[destOffs], 0, remain);
+            destOffs += remain;
+            break;
+        }
+        remain = MIN((uint64_t)remain, file->validSize - pos);
+
+        uint32_t idx = pos / clusterSize;
+        uint32_t cluster, run;
+        int err = exfatMapCluster(blkdev, boot, file, idx, &cluster, &run,
+            timeout);
+        if(err == -ERANGE) break; //chain is shorter than file size
+        if(err < 0) return err;
+
+        uint32_t secInCluster = (pos % clusterSize) / FAT_SECTOR_SIZE;
+        uint64_t sector = exfatClusterToSector(boot, cluster) + secInCluster;
+        uint32_t part = pos % FAT_SECTOR_SIZE;
+
+        if(part || remain < FAT_SECTOR_SIZE) {
+            //partial sector; read it into a buffer and copy what we need.
+            uint32_t len = MIN(remain, FAT_SECTOR_SIZE - part);
+            uint8_t buffer[FAT_SECTOR_SIZE];
+            err = _fatReadSector(blkdev, sector, buffer);
+            if(err < 0) return err;
+            memcpy(&dest[destOffs], &buffer[part], len);
+            destOffs += len;
+            continue;
+        }
+
+        //see how many of the following clusters are contiguous with this
+        //one, until we have enough to cover the rest of the read.
+        uint32_t want = remain / FAT_SECTOR_SIZE; //whole sectors needed
+        while(((uint64_t)run * spc) - secInCluster < want) {
+            uint32_t next, nextRun;
+            err = exfatMapCluster(blkdev, boot, file, idx + run, &next,
+                &nextRun, timeout);
+            if(err == -ERANGE) break;
+            if(err < 0) return err;
+            if(next != cluster + run) break; //fragmented here
+            run += nextRun;
+        }
+
+        //read all of them straight into the destination.
+        uint32_t count = MIN((uint64_t)want, ((uint64_t)run * spc) -
+            secInCluster);
+        err = _fatReadSectors(blkdev, sector, count, &dest[destOffs]);
+        if(err < 0) return err;
+        destOffs += count * FAT_SECTOR_SIZE;
+    }
+
+    return destOffs;
+}
@@ -0,0 +1,228 @@
+//File names.
+//exFAT names are UTF-16, and compared without regard to case using the
+//volume's up-case table, which maps each character to its uppercase form.
+//The table is compressed: 0xFFFF followed by N means the next N characters
+//map to themselves. We keep the start of it (which covers ASCII and
+//Latin-1) in memory, and read the rest from the disk only when needed.
+//Each name is stored with a hash of its uppercase form, so most entries
+//can be skipped without comparing names at all.
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+//longest list of characters _readUpcase() is given.
+#define MAX_CHARS (EXFAT_UPCASE_CHARS > EXFAT_MAX_NAME ? \
+    EXFAT_UPCASE_CHARS : EXFAT_MAX_NAME)
+
+static bool _validChar(uint32_t c) {
+    if(c < 0x20) return false;
+    return c > 0x7F || !strchr("\"*/:<>?\\|", c);
+}
+
+
+static int _readUpcase(FILE *blkdev, exfat_boot *boot, uint16_t *chars,
+int len, uint32_t from, uint32_t timeout) {
+    //replace each character in `chars` that's >= `from` with its entry in
+    //the up-case table, reading the table from the disk.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint16_t orig[MAX_CHARS];
+    uint32_t highest = 0;
+    for(int i=0; i<len; i++) {
+        orig[i] = chars[i];
+        if(chars[i] >= from && chars[i] > highest) highest = chars[i];
+    }
+    if(!highest && from) return 0; //nothing to do
+
+    uint8_t buf[FAT_SECTOR_SIZE];
+    uint32_t cluster = vol->upcaseCluster;
+    uint32_t spc = 1UL << boot->sectorsPerClusterShift;
+    uint32_t idx = 0; //character the next table entry is for
+    bool skip = false; //whether the next entry is a run length
+    for(uint32_t pos=0; pos < vol->upcaseSize && idx <= highest; ) {
+        uint32_t sector = (pos / FAT_SECTOR_SIZE) % spc;
+        if(pos && !sector) {
+            int next = fatGetNextCluster(blkdev, &vol->fat, cluster, timeout);
+            if(next <= 0) return next ? next : -EILSEQ;
+            cluster = next;
+        }
+        int err = _fatReadSector(blkdev,
+            exfatClusterToSector(boot, cluster) + sector, buf);
+        if(err < 0) return err;
+
+        const uint16_t *table = (const uint16_t*)buf;
+        uint32_t n = MIN((uint32_t)FAT_SECTOR_SIZE, vol->upcaseSize - pos) / 2;
+        for(uint32_t i=0; i<n; i++) {
+            uint16_t val = table[i];
+            if(skip) { //identity run
+                idx += val;
+                skip = false;
+            }
+            else if(val == 0xFFFF) skip = true;
+            else {
+                for(int j=0; j<len; j++) {
+                    if(orig[j] == idx && orig[j] >= from) chars[j] = val;
+                }
+                idx++;
+            }
+        }
+        pos += FAT_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+
+int exfatUpcaseInit(FILE *blkdev, exfat_boot *boot,
+const exfat_table_entry *ent, uint32_t timeout) {
+    /** Load the start of the volume's up-case table.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param ent The table's entry in the root directory (type 0 if
+     *   there isn't one).
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by exfatMount(). Without a table, only ASCII
+     *   letters are folded.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    for(int i=0; i<EXFAT_UPCASE_CHARS; i++) {
+        vol->upcase[i] = (i >= 'a' && i <= 'z') ? i - 0x20 : i;
+    }
+    if(ent->type != EXFAT_ENTRY_UPCASE || ent->firstCluster < 2) {
+        #if EXFAT_DEBUG_PRINT
+            printf("exFAT: no up-case table\r\n");
+        #endif
+        return 0;
+    }
+    vol->upcaseCluster = ent->firstCluster;
+    vol->upcaseSize    = ent->size;
+    return _readUpcase(blkdev, boot, vol->upcase, EXFAT_UPCASE_CHARS, 0,
+        timeout);
+}
+
+
+int exfatUpcaseName(FILE *blkdev, exfat_boot *boot, uint16_t *name, int len,
+uint32_t timeout) {
+    /** Convert a name to uppercase, using the volume's up-case table.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param name The name, in UTF-16. It's converted in place.
+     *  @param len Length of the name, in characters.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    MicronExfatVolume *vol = boot->_micron_vol;
+    bool high = false;
+    for(int i=0; i<len; i++) {
+        if(name[i] < EXFAT_UPCASE_CHARS) name[i] = vol->upcase[name[i]];
+        else high = true;
+    }
+    if(!high || !vol->upcaseCluster) return 0;
+    return _readUpcase(blkdev, boot, name, len, EXFAT_UPCASE_CHARS, timeout);
+}
+
+
+uint16_t exfatNameHash(const uint16_t *name, int len) {
+    /** Compute the hash of a name, as stored in its stream entry.
+     *  @param name The name, in UTF-16, already converted to uppercase.
+     *  @param len Length of the name, in characters.
+     *  @return The hash.
+     */
+    uint16_t hash = 0;
+    for(int i=0; i<len; i++) {
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (name[i] & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (name[i] >> 8);
+    }
+    return hash;
+}
+
+
+int exfatNameFromUtf8(const char *name, size_t len, uint16_t *out) {
+    /** Convert a UTF-8 name to UTF-16, and check that it's valid.
+     *  @param name The name. Doesn't need to be NUL-terminated.
+     *  @param len Length of the name, in bytes.
+     *  @param out Receives the name. Must have room for EXFAT_MAX_NAME
+     *   characters.
+     *  @return Number of UTF-16 characters, -EINVAL if the name contains
+     *   characters that aren't allowed, -EILSEQ if it isn't valid UTF-8,
+     *   -ENAMETOOLONG if it's too long.
+     */
+    int n = 0;
+    for(size_t i=0; i<len; ) {
+        uint8_t b = name[i];
+        uint32_t c;
+        int extra;
+        if     (b < 0x80) { c = b;        extra = 0; }
+        else if(b < 0xC0) return -EILSEQ; //stray continuation byte
+        else if(b < 0xE0) { c = b & 0x1F; extra = 1; }
+        else if(b < 0xF0) { c = b & 0x0F; extra = 2; }
+        else if(b < 0xF8) { c = b & 0x07; extra = 3; }
+        else return -EILSEQ;
+        if(extra && i + extra >= len) return -EILSEQ; //truncated
+        i++;
+        for(int j=0; j<extra; j++, i++) {
+            if((name[i] & 0xC0) != 0x80) return -EILSEQ;
+            c = (c << 6) | (name[i] & 0x3F);
+        }
+        if(!_validChar(c)) return -EINVAL;
+
+        if(c >= 0x10000) { //needs a surrogate pair
+            if(n + 2 > EXFAT_MAX_NAME) return -ENAMETOOLONG;
+            c -= 0x10000;
+            out[n++] = 0xD800 | (c >> 10);
+            out[n++] = 0xDC00 | (c & 0x3FF);
+        }
+        else {
+            if(n + 1 > EXFAT_MAX_NAME) return -ENAMETOOLONG;
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+
+int exfatNameToUtf8(const uint16_t *name, int len, char *out, size_t size) {
+    /** Convert a UTF-16 name to UTF-8.
+     *  @param name The name.
+     *  @param len Length of the name, in characters.
+     *  @param out Receives the NUL-terminated name.
+     *  @param size Size of `out`, in bytes. The name is truncated (at a
+     *   character boundary) if it doesn't fit.
+     *  @return Length of the result, in bytes.
+     */
+    size_t pos = 0;
+    for(int i=0; i<len; i++) {
+        uint32_t c = name[i];
+        if(c >= 0xD800 && c <= 0xDBFF && i+1 < len
+        && name[i+1] >= 0xDC00 && name[i+1] <= 0xDFFF) { //surrogate pair
+            c = 0x10000 + ((c - 0xD800) << 10) + (name[++i] - 0xDC00);
+        }
+
+        uint8_t buf[4];
+        int n;
+        if(c < 0x80) { buf[0] = c; n = 1; }
+        else if(c < 0x800) {
+            buf[0] = 0xC0 |  (c >>  6);
+            buf[1] = 0x80 |  (c        & 0x3F);
+            n = 2;
+        }
+        else if(c < 0x10000) {
+            buf[0] = 0xE0 |  (c >> 12);
+            buf[1] = 0x80 | ((c >>  6) & 0x3F);
+            buf[2] = 0x80 |  (c        & 0x3F);
+            n = 3;
+        }
+        else {
+            buf[0] = 0xF0 |  (c >> 18);
+            buf[1] = 0x80 | ((c >> 12) & 0x3F);
+            buf[2] = 0x80 | ((c >>  6) & 0x3F);
+            buf[3] = 0x80 |  (c        & 0x3F);
+            n = 4;
+        }
+        if(pos + n >= size) break;
+        memcpy(&out[pos], buf, n);
+        pos += n;
+    }
+    out[pos] = '\0';
+    return pos;
+}
@@ -0,0 +1,186 @@
+//Path resolution.
+//Each name is compared by its hash first, which is stored in its stream
+//entry, so only names that hash the same need to be up-cased and compared.
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+static void _setRoot(exfat_boot *boot, MicronExfatDirent *out) {
+    //describe the root directory, which has no entry of its own.
+    memset(out, 0, sizeof(MicronExfatDirent));
+    out->attributes = FAT_ATTR_DIRECTORY;
+    out->cluster    = boot->rootCluster;
+    out->numEntries = 0;
+    strcpy(out->name, "/");
+}
+
+
+static int _matches(FILE *blkdev, exfat_boot *boot, MicronExfatDir *dir,
+const uint16_t *name, int len, uint32_t timeout) {
+    //compare the name of the entry set that was just read with `name`,
+    //which is already up-cased. returns 1 if they match.
+    const exfat_stream_entry *stream =
+        (const exfat_stream_entry*)&dir->set[EXFAT_ENTRY_SIZE];
+    if(stream->nameLength != len) return 0;
+
+    uint16_t other[EXFAT_MAX_NAME];
+    for(int i=0; i<len; i++) {
+        const exfat_name_entry *n = (const exfat_name_entry*)
+            &dir->set[((i / 15) + 2) * EXFAT_ENTRY_SIZE];
+        other[i] = n->name[i % 15];
+    }
+    int err = exfatUpcaseName(blkdev, boot, other, len, timeout);
+    if(err) return err;
+    return memcmp(name, other, len * sizeof(uint16_t)) ? 0 : 1;
+}
+
+
+int exfatLookup(FILE *blkdev, exfat_boot *boot,
+const MicronExfatDirent *parent, const char *name, size_t len,
+MicronExfatDirent *out, uint32_t timeout) {
+    /** Find a name in a directory.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param parent The directory's entry, or NULL for the root directory.
+     *  @param name The name to look for, in UTF-8. Doesn't need to be
+     *   NUL-terminated.
+     *  @param len Length of name, in bytes.
+     *  @param out Receives the directory entry. Can be the same as `parent`.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -ENOTDIR if `parent`
+     *   isn't a directory, or negative error code on failure.
+     *  @note Names are matched without regard to case.
+     */
+    uint16_t target[EXFAT_MAX_NAME];
+    int n = exfatNameFromUtf8(name, len, target);
+    if(n == 0 || n == -EINVAL) return -ENOENT; //can't exist
+    if(n < 0) return n;
+    int err = exfatUpcaseName(blkdev, boot, target, n, timeout);
+    if(err) return err;
+    uint16_t hash = exfatNameHash(target, n);
+
+    MicronExfatDir *dir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    if(!dir) return -ENOMEM;
+    err = exfatOpenDir(boot, parent, dir);
+    while(!err) {
+        err = exfatReadDirNext(blkdev, boot, dir, out, timeout);
+        if(err) break; //including -ENOENT at the end
+        if(out->nameHash != hash) continue;
+        err = _matches(blkdev, boot, dir, target, n, timeout);
+        if(err == 1) {
+            err = 0;
+            break;
+        }
+    }
+    free(dir);
+    return err;
+}
+
+
+static int _lookupPath(FILE *blkdev, exfat_boot *boot, const char *path,
+const char *pathEnd, MicronExfatDirent *out, uint32_t timeout) {
+    _setRoot(boot, out);
+    while(path < pathEnd) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        const char *end = path;
+        while(end < pathEnd && *end != '/') end++;
+        size_t len = end - path;
+
+        if(!(out->attributes & FAT_ATTR_DIRECTORY)) return -ENOTDIR;
+        if(len == 1 && path[0] == '.') { //nothing to do
+            path = end;
+            continue;
+        }
+        if(len == 2 && path[0] == '.' && path[1] == '.') {
+            //exFAT directories have no ".." entries, so we'd have to
+            //remember how we got here.
+            if(!out->entrySectors[0]) { //root has no parent
+                path = end;
+                continue;
+            }
+            return -EINVAL;
+        }
+
+        int err = exfatLookup(blkdev, boot, out, path, len, out, timeout);
+        if(err) return err;
+        path = end;
+    }
+    return 0;
+}
+
+
+int exfatLookupPath(FILE *blkdev, exfat_boot *boot, const char *path,
+MicronExfatDirent *out, uint32_t timeout) {
+    /** Find a file or directory by its path.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param path The path, eg "/config/net.txt". Paths are always relative
+     *   to the root directory, so the leading "/" is optional.
+     *  @param out Receives the directory entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -ENOTDIR if a component
+     *   other than the last isn't a directory, -EINVAL if the path uses
+     *   ".." other than at the root, or negative error code on failure.
+     *  @note "/" refers to the root directory, which has no directory entry
+     *   of its own; `out` is filled in to describe it.
+     */
+    return _lookupPath(blkdev, boot, path, path + strlen(path), out, timeout);
+}
+
+
+int exfatLookupParent(FILE *blkdev, exfat_boot *boot, const char *path,
+MicronExfatDirent *out, const char **outName, uint32_t timeout) {
+    /** Find the directory that a path refers to something in.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param path The path, eg "/config/net.txt".
+     *  @param out Receives the directory entry of the parent directory
+     *   (eg "/config").
+     *  @param outName Receives a pointer to the last component of the path
+     *   (eg "net.txt"), which may be followed by a "/".
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if the parent isn't found or the path
+     *   has no last component (eg "/"), -ENOTDIR if the parent isn't a
+     *   directory, or negative error code on failure.
+     */
+    const char *end = path + strlen(path);
+    while(end > path && end[-1] == '/') end--; //ignore trailing slashes
+    const char *name = end;
+    while(name > path && name[-1] != '/') name--;
+    if(name == end) return -ENOENT;
+
+    int err = _lookupPath(blkdev, boot, path, name, out, timeout);
+    if(err) return err;
+    if(!(out->attributes & FAT_ATTR_DIRECTORY)) return -ENOTDIR;
+    *outName = name;
+    return 0;
+}
+
+
+int exfatOpenPath(FILE *blkdev, exfat_boot *boot, const char *path,
+MicronExfatFile *out, uint16_t maxExtents, uint32_t timeout) {
+    /** Prepare to access a file by its path.
+     *  @param blkdev Block device to read from.
+     *  @param boot The volume's boot sector.
+     *  @param path The path, eg "/config/net.txt".
+     *  @param out Receives the file state.
+     *  @param maxExtents Maximum number of extents to remember; see
+     *   exfatOpenFile().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -EISDIR if it's a
+     *   directory, or negative error code on failure.
+     *  @note Call exfatCloseFile() when done.
+     */
+    MicronExfatDirent *dirent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    if(!dirent) return -ENOMEM;
+    int err = exfatLookupPath(blkdev, boot, path, dirent, timeout);
+    if(!err && (dirent->attributes & FAT_ATTR_DIRECTORY)) err = -EISDIR;
+    if(!err) err = exfatOpenFile(boot, dirent, out, maxExtents);
+    free(dirent);
+    return err;
+}
@@ -0,0 +1,850 @@
+//Creating, modifying and deleting files.
+//This follows the same ordering rules as the FAT driver (see
+//../fat/write.c), so that losing power at worst leaves some clusters
+//marked as used that nothing refers to:
+//- new data is written before anything refers to it;
+//- the bitmap and FAT are written before a file's entry refers to them;
+//- a file's entry is removed or shrunk before its clusters are freed.
+//Files are kept contiguous (NoFatChain) as long as possible, so most never
+//touch the FAT at all. The volume is marked dirty before the first change,
+//and clean again by exfatSync().
+extern "C" {
+    #include <micron.h>
+    #include "exfat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / EXFAT_ENTRY_SIZE)
+
+static const uint8_t _zeros[FAT_SECTOR_SIZE] = {0};
+
+static uint32_t _now(uint8_t *centisecs) {
+    //get the current time as an exFAT timestamp.
+    uint32_t secs = 0;
+    uint16_t date, time;
+    if(rtcGet(&secs, NULL) < 0) secs = 0; //not set; use 1980-01-01
+    fatEncodeDateTime(secs, &date, &time);
+    *centisecs = (secs % 2) * 100;
+    return ((uint32_t)date << 16) | time;
+}
+
+static int _begin(FILE *blkdev, exfat_boot *boot, uint32_t timeout) {
+    //check that the volume is writable, and mark it dirty.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    if(!(vol && vol->writable)) return -EROFS;
+    return exfatSetDirty(blkdev, boot, true, timeout);
+}
+
+static uint32_t _clustersFor(exfat_boot *boot, uint64_t size) {
+    //how many clusters it takes to hold `size` bytes.
+    uint32_t clusterSize = exfatClusterSize(boot);
+    return (size + clusterSize - 1) / clusterSize;
+}
+
+static int _zeroCluster(FILE *blkdev, exfat_boot *boot, uint32_t cluster) {
+    //fill a cluster with zeros, eg before using it as a directory.
+    uint64_t sector = exfatClusterToSector(boot, cluster);
+    for(uint32_t i=0; i < (1UL << boot->sectorsPerClusterShift); i++) {
+        int err = _fatWriteSector(blkdev, sector + i, _zeros);
+        if(err < 0) return err;
+    }
+    return 0;
+}
+
+
+/* ------------------------------- Entry sets ----------------------------- */
+
+static int _readSet(FILE *blkdev, const uint64_t *sectors, uint16_t offset,
+int count, uint8_t *out) {
+    //read a file's entry set from the sectors it's in.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    int loaded = -1;
+    for(int i=0; i<count; i++) {
+        uint32_t n = (offset / EXFAT_ENTRY_SIZE) + i;
+        int s = n / ENTRIES_PER_SECTOR;
+        if(s != loaded) {
+            int err = _fatReadSector(blkdev, sectors[s], buf);
+            if(err < 0) return err;
+            loaded = s;
+        }
+        memcpy(&out[i * EXFAT_ENTRY_SIZE],
+            &buf[(n % ENTRIES_PER_SECTOR) * EXFAT_ENTRY_SIZE],
+            EXFAT_ENTRY_SIZE);
+    }
+    return 0;
+}
+
+static int _writeSet(FILE *blkdev, const uint64_t *sectors, uint16_t offset,
+int count, const uint8_t *set, bool fileEntryLast) {
+    //write a file's entry set to the sectors it's in. if it spans more than
+    //one, the order matters: a new set should have its file entry written
+    //last, so that it doesn't appear until it's complete, and a deleted
+    //one should have it written first.
+    int first = offset / EXFAT_ENTRY_SIZE;
+    int numSectors = ((first + count - 1) / ENTRIES_PER_SECTOR) + 1;
+    uint8_t buf[FAT_SECTOR_SIZE];
+    for(int k=0; k<numSectors; k++) {
+        int s = fileEntryLast ? numSectors - (k + 1) : k;
+        int err = _fatReadSector(blkdev, sectors[s], buf);
+        if(err < 0) return err;
+        for(int i=0; i<count; i++) {
+            int n = first + i;
+            if(n / ENTRIES_PER_SECTOR != s) continue;
+            memcpy(&buf[(n % ENTRIES_PER_SECTOR) * EXFAT_ENTRY_SIZE],
+                &set[i * EXFAT_ENTRY_SIZE], EXFAT_ENTRY_SIZE);
+        }
+        err = _fatWriteSector(blkdev, sectors[s], buf);
+        if(err < 0) return err;
+    }
+    return 0;
+}
+
+static int _updateEntry(FILE *blkdev, exfat_boot *boot,
+MicronExfatFile *file) {
+    //write a file's clusters and size to its entry set.
+    if(!file->entrySectors[0]) return 0; //root directory has no entry
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+    int count = file->numEntries;
+    int err = _readSet(blkdev, file->entrySectors, file->entryOffset, count,
+        set);
+    if(err) return err;
+
+    exfat_file_entry *ent = (exfat_file_entry*)set;
+    exfat_stream_entry *stream = (exfat_stream_entry*)&set[EXFAT_ENTRY_SIZE];
+    if(ent->type != EXFAT_ENTRY_FILE || stream->type != EXFAT_ENTRY_STREAM
+    || ent->secondaryCount + 1 != count) return -EILSEQ; //moved?
+
+    ent->modifyTime      = _now(&ent->modify10ms);
+    ent->accessTime      = ent->modifyTime;
+    ent->modifyUtcOffset = 0;
+    ent->accessUtcOffset = 0;
+    if(!(file->attributes & FAT_ATTR_DIRECTORY)) {
+        file->attributes |= FAT_ATTR_ARCHIVE;
+    }
+    ent->attributes      = file->attributes;
+    stream->flags        = file->flags;
+    stream->firstCluster = file->map.firstCluster;
+    stream->size         = file->size;
+    stream->validSize    = file->validSize;
+    ent->setChecksum     = exfatSetChecksum(set, count);
+
+    //only the first two entries changed. _findSlots() keeps them in the
+    //same sector, so this is a single write.
+    return _writeSet(blkdev, file->entrySectors, file->entryOffset, 2, set,
+        true);
+}
+
+static int _buildSet(uint8_t *set, const uint16_t *name, int len,
+uint16_t hash, uint16_t attributes, uint8_t flags, uint32_t cluster,
+uint64_t size) {
+    //fill in the entry set for a new file. returns the number of entries.
+    int count = 2 + ((len + 14) / 15);
+    memset(set, 0, count * EXFAT_ENTRY_SIZE);
+
+    exfat_file_entry *ent = (exfat_file_entry*)set;
+    ent->type           = EXFAT_ENTRY_FILE;
+    ent->secondaryCount = count - 1;
+    ent->attributes     = attributes;
+    ent->createTime     = _now(&ent->create10ms);
+    ent->modifyTime     = ent->createTime;
+    ent->modify10ms     = ent->create10ms;
+    ent->accessTime     = ent->createTime;
+
+    exfat_stream_entry *stream = (exfat_stream_entry*)&set[EXFAT_ENTRY_SIZE];
+    stream->type         = EXFAT_ENTRY_STREAM;
+    stream->flags        = flags;
+    stream->nameLength   = len;
+    stream->nameHash     = hash;
+    stream->firstCluster = cluster;
+    stream->size         = size;
+    stream->validSize    = size;
+
+    for(int i=0; i<len; i++) {
+        exfat_name_entry *n = (exfat_name_entry*)
+            &set[((i / 15) + 2) * EXFAT_ENTRY_SIZE];
+        n->type = EXFAT_ENTRY_NAME;
+        n->name[i % 15] = name[i];
+    }
+    ent->setChecksum = exfatSetChecksum(set, count);
+    return count;
+}
+
+
+/* ------------------------------ Allocation ------------------------------ */
+
+static int _writeChain(FILE *blkdev, exfat_boot *boot, uint32_t first,
+uint32_t count, uint32_t timeout) {
+    //record a run of contiguous clusters as a chain in the FAT.
+    for(uint32_t i=0; i<count; i++) {
+        uint32_t next = (i + 1 < count) ? first + i + 1 : FAT_CLUSTER_EOC;
+        int err = exfatSetFatEntry(blkdev, boot, first + i, next, timeout);
+        if(err) return err;
+    }
+    return 0;
+}
+
+static int _addCluster(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint32_t timeout) {
+    //add a cluster to the end of a file, without updating its entry.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint32_t last = 0, run;
+    if(file->numClusters) {
+        int err = exfatMapCluster(blkdev, boot, file, file->numClusters - 1,
+            &last, &run, timeout);
+        if(err) return (err == -ERANGE) ? -EIO : err;
+    }
+
+    //look right after the last cluster first, to keep it contiguous.
+    uint32_t cluster;
+    int err = exfatAllocCluster(blkdev, boot, last ? last + 1 : 0, &cluster,
+        timeout);
+    if(err) return err;
+
+    if(!last) { //the file's first cluster
+        file->map.firstCluster = cluster;
+        file->flags |= EXFAT_FLAG_ALLOC_POSSIBLE | EXFAT_FLAG_NO_FAT_CHAIN;
+        fatMapReset(&file->map);
+    }
+    else if(cluster != last + 1 || !(file->flags & EXFAT_FLAG_NO_FAT_CHAIN)) {
+        if(file->flags & EXFAT_FLAG_NO_FAT_CHAIN) {
+            //it's no longer contiguous, so its clusters need to be in the
+            //FAT. until its entry is updated, the FAT isn't used for it.
+            err = _writeChain(blkdev, boot, file->map.firstCluster,
+                file->numClusters, timeout);
+            if(err) {
+                exfatFreeClusters(blkdev, boot, cluster, 1, timeout);
+                return err;
+            }
+            file->flags &= ~EXFAT_FLAG_NO_FAT_CHAIN;
+            fatMapReset(&file->map);
+            if(file->map.maxExtents) { //we already know where they are
+                file->map.extents[0].cluster = file->map.firstCluster;
+                file->map.extents[0].length  = file->numClusters;
+                file->map.numExtents  = 1;
+                file->map.numClusters = file->numClusters;
+                file->map.complete    = true;
+            }
+        }
+
+        //as in fatAllocCluster(), end the chain at the new cluster before
+        //linking to it. the link can reach the disk as soon as it's made
+        //(without a FAT cache, or if it's evicted), so the cluster has to
+        //be marked as used there first.
+        err = exfatSetFatEntry(blkdev, boot, cluster, FAT_CLUSTER_EOC,
+            timeout);
+        if(!err && (last / (FAT_SECTOR_SIZE / 4)) !=
+        (cluster / (FAT_SECTOR_SIZE / 4))) {
+            err = fatCacheFlush(blkdev, &vol->fat, timeout);
+        }
+        if(!err) err = fatCacheFlush(blkdev, &vol->bitmap, timeout);
+        if(!err) err = exfatSetFatEntry(blkdev, boot, last, cluster, timeout);
+        if(err) {
+            exfatFreeClusters(blkdev, boot, cluster, 1, timeout);
+            return err;
+        }
+        fatMapAppend(&file->map, cluster);
+    }
+    file->numClusters++;
+    return 0;
+}
+
+static int _freeClusters(FILE *blkdev, exfat_boot *boot, uint32_t cluster,
+uint32_t count, bool contiguous, uint32_t timeout) {
+    //free `count` clusters of a file, starting at `cluster`, which nothing
+    //may refer to any more.
+    if(contiguous) return exfatFreeClusters(blkdev, boot, cluster, count,
+        timeout);
+    for(uint32_t i=0; i<count && cluster >= 2; i++) {
+        int next = fatGetNextCluster(blkdev, &boot->_micron_vol->fat,
+            cluster, timeout);
+        if(next < 0) return next;
+        int err = exfatFreeClusters(blkdev, boot, cluster, 1, timeout);
+        if(err) return err;
+        cluster = next;
+    }
+    return 0;
+}
+
+static int _commit(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint32_t timeout) {
+    //make a file's changes permanent: its clusters must be recorded on
+    //disk before its entry refers to them.
+    int err = exfatAllocFlush(blkdev, boot, timeout);
+    if(err) return err;
+    return _updateEntry(blkdev, boot, file);
+}
+
+
+/* ------------------------------ File contents --------------------------- */
+
+static int _writeData(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint64_t offset, uint64_t size, const uint8_t *data, uint32_t timeout) {
+    //write to a file's clusters, which must already be allocated, without
+    //changing its size or entry. if `data` is NULL, write zeros.
+    uint32_t spc = 1UL << boot->sectorsPerClusterShift;
+    uint32_t clusterSize = exfatClusterSize(boot);
+    uint64_t done = 0;
+    while(done < size) {
+        uint64_t pos = offset + done;
+        uint64_t remain = size - done;
+        uint32_t idx = pos / clusterSize;
+        uint32_t cluster, run;
+        int err = exfatMapCluster(blkdev, boot, file, idx, &cluster, &run,
+            timeout);
+        if(err) return (err == -ERANGE) ? -EIO : err;
+
+        uint32_t secInCluster = (pos % clusterSize) / FAT_SECTOR_SIZE;
+        uint64_t sector = exfatClusterToSector(boot, cluster) + secInCluster;
+        uint32_t part = pos % FAT_SECTOR_SIZE;
+
+        if(part || remain < FAT_SECTOR_SIZE) {
+            //partial sector; merge with what's already there, if anything.
+            uint32_t len = MIN(remain, (uint64_t)(FAT_SECTOR_SIZE - part));
+            uint8_t buffer[FAT_SECTOR_SIZE];
+            if(pos - part < file->validSize) {
+                err = _fatReadSector(blkdev, sector, buffer);
+                if(err < 0) return err;
+            }
+            else memset(buffer, 0, sizeof(buffer));
+            if(data) memcpy(&buffer[part], &data[done], len);
+            else memset(&buffer[part], 0, len);
+            err = _fatWriteSector(blkdev, sector, buffer);
+            if(err < 0) return err;
+            done += len;
+            continue;
+        }
+
+        //extend the run across following contiguous clusters.
+        uint64_t want = remain / FAT_SECTOR_SIZE; //whole sectors needed
+        while(((uint64_t)run * spc) - secInCluster < want) {
+            uint32_t next, nextRun;
+            err = exfatMapCluster(blkdev, boot, file, idx + run, &next,
+                &nextRun, timeout);
+            if(err == -ERANGE) break;
+            if(err < 0) return err;
+            if(next != cluster + run) break; //fragmented here
+            run += nextRun;
+        }
+
+        uint32_t count = MIN(want, ((uint64_t)run * spc) - secInCluster);
+        if(data) {
+            //write all of them straight from the source.
+            err = _fatWriteSectors(blkdev, sector, count, &data[done]);
+            if(err < 0) return err;
+        }
+        else {
+            for(uint32_t i=0; i<count; i++) {
+                err = _fatWriteSector(blkdev, sector + i, _zeros);
+                if(err < 0) return err;
+            }
+        }
+        done += (uint64_t)count * FAT_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int _fillTo(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint64_t pos, uint32_t timeout) {
+    //write zeros from the end of the valid data up to `pos`, so that data
+    //can be written there. the valid size isn't updated on disk.
+    if(pos <= file->validSize) return 0;
+    int err = _writeData(blkdev, boot, file, file->validSize,
+        pos - file->validSize, NULL, timeout);
+    if(err) return err;
+    file->validSize = pos;
+    return 0;
+}
+
+static void _restore(MicronExfatFile *file, const MicronExfatFile *old) {
+    //after a failed change, go back to what the file's entry still says.
+    file->map.firstCluster = old->map.firstCluster;
+    file->numClusters      = old->numClusters;
+    file->flags            = old->flags;
+    file->size             = old->size;
+    file->validSize        = old->validSize;
+    fatMapReset(&file->map);
+}
+
+
+/* ------------------------------- Directories ---------------------------- */
+
+static int _openDirFile(FILE *blkdev, exfat_boot *boot,
+const MicronExfatDirent *dirent, MicronExfatFile *out, uint32_t timeout) {
+    //access a directory as a file, to add clusters to it.
+    int err = exfatOpenFile(boot, dirent, out, 0);
+    if(err || dirent->entrySectors[0]) return err;
+
+    //the root directory has no entry, so we have to measure it.
+    MicronExfatVolume *vol = boot->_micron_vol;
+    uint32_t cluster = boot->rootCluster;
+    out->flags       = 0;
+    out->numClusters = 1;
+    while(out->numClusters <= boot->clusterCount) {
+        int next = fatGetNextCluster(blkdev, &vol->fat, cluster, timeout);
+        if(next < 0) return next;
+        if(next == 0) break;
+        cluster = next;
+        out->numClusters++;
+    }
+    return 0;
+}
+
+static int _extendDir(FILE *blkdev, exfat_boot *boot,
+MicronExfatDirent *parent, uint32_t timeout) {
+    //add a cluster to a directory, and update `parent` to match.
+    MicronExfatFile file;
+    int err = _openDirFile(blkdev, boot, parent, &file, timeout);
+    if(!err) err = _addCluster(blkdev, boot, &file, timeout);
+    if(err) {
+        exfatCloseFile(&file);
+        return err;
+    }
+
+    //zero it before anything refers to it, so it's never seen with junk
+    //in it.
+    uint32_t cluster, run;
+    err = exfatMapCluster(blkdev, boot, &file, file.numClusters - 1,
+        &cluster, &run, timeout);
+    if(!err) err = _zeroCluster(blkdev, boot, cluster);
+    if(!err) {
+        file.size      = (uint64_t)file.numClusters * exfatClusterSize(boot);
+        file.validSize = file.size;
+        err = _commit(blkdev, boot, &file, timeout);
+    }
+    if(!err) {
+        parent->cluster   = file.map.firstCluster;
+        parent->flags     = file.flags;
+        parent->size      = file.size;
+        parent->validSize = file.validSize;
+    }
+    exfatCloseFile(&file);
+    return err;
+}
+
+static int _skipEntry(FILE *blkdev, uint64_t sector, uint16_t offset) {
+    //turn an end-of-directory marker into an unused entry, so that
+    //entries can be added after it.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    int err = _fatReadSector(blkdev, sector, buf);
+    if(err < 0) return err;
+    buf[offset] = EXFAT_ENTRY_FILE & ~EXFAT_ENTRY_INUSE; //deleted file
+    err = _fatWriteSector(blkdev, sector, buf);
+    return (err < 0) ? err : 0;
+}
+
+static int _findSlots(FILE *blkdev, exfat_boot *boot,
+MicronExfatDirent *parent, int count, uint64_t *sectors, uint16_t *offset,
+uint32_t timeout) {
+    //find `count` consecutive unused entries in a directory, extending it
+    //if needed. `sectors` and `offset` receive their location, as in
+    //MicronExfatDirent.
+    MicronExfatDir *dir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    if(!dir) return -ENOMEM;
+    int err = 0;
+    while(!err) {
+        int run = 0, numSectors = 0;
+        bool pastEnd = false; //everything after the end marker is unused
+        err = exfatOpenDir(boot, parent, dir);
+        while(!err) {
+            const uint8_t *ent;
+            err = exfatReadDirRaw(blkdev, boot, dir, &ent, timeout);
+            if(err) break;
+            if(ent[0] == EXFAT_ENTRY_END) pastEnd = true;
+            if(!pastEnd && (ent[0] & EXFAT_ENTRY_INUSE)) {
+                run = 0;
+                continue;
+            }
+            if(!run) {
+                //keep the file and stream entries in the same sector, so
+                //that updating them can't be interrupted halfway.
+                if(dir->entOffset == FAT_SECTOR_SIZE - EXFAT_ENTRY_SIZE) {
+                    if(pastEnd) { //mustn't leave an end marker before it
+                        err = _skipEntry(blkdev, dir->entSector,
+                            dir->entOffset);
+                    }
+                    continue;
+                }
+                numSectors = 0;
+                *offset = dir->entOffset;
+            }
+            if(!numSectors || sectors[numSectors - 1] != dir->entSector) {
+                sectors[numSectors++] = dir->entSector;
+            }
+            if(++run == count) break;
+        }
+        if(err == -ENOENT) err = 0;
+        if(err || run == count) break;
+
+        //not enough room, so add a cluster and look again.
+        err = _extendDir(blkdev, boot, parent, timeout);
+    }
+    free(dir);
+    return err;
+}
+
+static int _checkNew(FILE *blkdev, exfat_boot *boot, const char *path,
+MicronExfatDirent *parent, uint16_t *name, uint32_t timeout) {
+    //find the directory a new entry goes in, and check that the name is
+    //valid and not already used there. returns the name's length.
+    const char *str;
+    int err = exfatLookupParent(blkdev, boot, path, parent, &str, timeout);
+    if(err) return err;
+    size_t len = 0;
+    while(str[len] && str[len] != '/') len++;
+    if(str[len-1] == '.' || str[len-1] == ' ') {
+        return -EINVAL; //includes "." and ".."
+    }
+    int n = exfatNameFromUtf8(str, len, name);
+    if(n < 0) return n;
+
+    MicronExfatDirent *other = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    if(!other) return -ENOMEM;
+    err = exfatLookup(blkdev, boot, parent, str, len, other, timeout);
+    free(other);
+    if(err == 0) return -EEXIST;
+    if(err != -ENOENT) return err;
+    return n;
+}
+
+static int _createEntry(FILE *blkdev, exfat_boot *boot,
+MicronExfatDirent *parent, const uint16_t *name, int len,
+uint16_t attributes, uint8_t flags, uint32_t cluster, uint64_t size,
+MicronExfatDirent *out, uint32_t timeout) {
+    //add an entry set to a directory. the name must not already exist.
+    uint16_t upper[EXFAT_MAX_NAME];
+    memcpy(upper, name, len * sizeof(uint16_t));
+    int err = exfatUpcaseName(blkdev, boot, upper, len, timeout);
+    if(err) return err;
+
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+    int count = _buildSet(set, name, len, exfatNameHash(upper, len),
+        attributes, flags, cluster, size);
+    uint64_t sectors[3] = {0, 0, 0};
+    uint16_t offset = 0;
+    err = _findSlots(blkdev, boot, parent, count, sectors, &offset, timeout);
+    if(!err) err = _writeSet(blkdev, sectors, offset, count, set, true);
+    if(err) return err;
+
+    memset(out, 0, sizeof(MicronExfatDirent));
+    exfatNameToUtf8(name, len, out->name, sizeof(out->name));
+    const exfat_file_entry *ent = (const exfat_file_entry*)set;
+    out->attributes  = attributes;
+    out->flags       = flags;
+    out->numEntries  = count;
+    out->nameHash    = exfatNameHash(upper, len);
+    out->createTime  = exfatDecodeTimestamp(ent->createTime, ent->create10ms);
+    out->modifyTime  = out->createTime;
+    out->accessTime  = out->createTime;
+    out->cluster     = cluster;
+    out->size        = size;
+    out->validSize   = size;
+    out->entryOffset = offset;
+    memcpy(out->entrySectors, sectors, sizeof(sectors));
+    return 0;
+}
+
+
+/* ---------------------------------- API --------------------------------- */
+
+int exfatCreate(FILE *blkdev, exfat_boot *boot, const char *path,
+uint16_t attributes, MicronExfatFile *out, uint16_t maxExtents,
+uint32_t timeout) {
+    /** Create an empty file.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param path The file's path, eg "/logs/0001.csv".
+     *   The directory must already exist.
+     *  @param attributes FAT_ATTR_* for the file. Only READONLY, HIDDEN,
+     *   SYSTEM and ARCHIVE are allowed.
+     *  @param out Receives the file state; see exfatOpenFile().
+     *  @param maxExtents Maximum number of extents to remember.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EEXIST if the name is already used, -EINVAL if
+     *   it's not a valid name, -ENOSPC if the directory can't be extended,
+     *   or other negative error code on failure.
+     *  @note Call exfatCloseFile() when done.
+     */
+    if(attributes & ~(FAT_ATTR_READONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM
+    | FAT_ATTR_ARCHIVE)) return -EINVAL;
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+
+    MicronExfatDirent *dirent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    if(!dirent) return -ENOMEM;
+    uint16_t name[EXFAT_MAX_NAME];
+    int len = _checkNew(blkdev, boot, path, dirent, name, timeout);
+    err = (len < 0) ? len : 0;
+    if(!err) err = _createEntry(blkdev, boot, dirent, name, len,
+        attributes | FAT_ATTR_ARCHIVE, EXFAT_FLAG_ALLOC_POSSIBLE, 0, 0,
+        dirent, timeout);
+    if(!err) err = exfatOpenFile(boot, dirent, out, maxExtents);
+    free(dirent);
+    return err;
+}
+
+
+int exfatMkdir(FILE *blkdev, exfat_boot *boot, const char *path,
+uint32_t timeout) {
+    /** Create a directory.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param path The directory's path. Its parent must already exist.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EEXIST if the name is already used, or other
+     *   negative error code on failure.
+     */
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+    MicronExfatDirent *dirent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    if(!dirent) return -ENOMEM;
+    uint16_t name[EXFAT_MAX_NAME];
+    int len = _checkNew(blkdev, boot, path, dirent, name, timeout);
+    if(len < 0) {
+        free(dirent);
+        return len;
+    }
+
+    //set up the new directory's cluster first. exFAT directories don't
+    //have "." and ".." entries, so it's just empty.
+    uint32_t cluster;
+    err = exfatAllocCluster(blkdev, boot, 0, &cluster, timeout);
+    if(err) {
+        free(dirent);
+        return err;
+    }
+    err = _zeroCluster(blkdev, boot, cluster);
+    if(!err) err = exfatAllocFlush(blkdev, boot, timeout);
+
+    //then add it to its parent.
+    if(!err) err = _createEntry(blkdev, boot, dirent, name, len,
+        FAT_ATTR_DIRECTORY, EXFAT_FLAG_ALLOC_POSSIBLE |
+        EXFAT_FLAG_NO_FAT_CHAIN, cluster, exfatClusterSize(boot), dirent,
+        timeout);
+    if(err) exfatFreeClusters(blkdev, boot, cluster, 1, timeout);
+    free(dirent);
+    if(err) return err;
+    return exfatSync(blkdev, boot, timeout);
+}
+
+
+int exfatDelete(FILE *blkdev, exfat_boot *boot, const char *path,
+uint32_t timeout) {
+    /** Delete a file or empty directory.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param path The path to delete.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -ENOTEMPTY if it's a
+     *   directory that isn't empty, or other negative error code on failure.
+     *  @note Don't delete a file that's open.
+     */
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+    MicronExfatDirent *dirent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    MicronExfatDir *dir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    err = (dirent && dir) ? 0 : -ENOMEM;
+    if(!err) err = exfatLookupPath(blkdev, boot, path, dirent, timeout);
+    if(!err && !dirent->entrySectors[0]) err = -EBUSY; //root directory
+
+    //a directory must be empty.
+    if(!err && (dirent->attributes & FAT_ATTR_DIRECTORY)) {
+        MicronExfatDirent *child = (MicronExfatDirent*)malloc(
+            sizeof(MicronExfatDirent));
+        err = child ? exfatOpenDir(boot, dirent, dir) : -ENOMEM;
+        if(!err) err = exfatReadDirNext(blkdev, boot, dir, child, timeout);
+        if(!err) err = -ENOTEMPTY;
+        else if(err == -ENOENT) err = 0;
+        if(child) free(child);
+    }
+
+    //mark its entries as unused, file entry first, so that it's gone in
+    //one write.
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+    if(!err) err = _readSet(blkdev, dirent->entrySectors,
+        dirent->entryOffset, dirent->numEntries, set);
+    if(!err) {
+        for(int i=0; i<dirent->numEntries; i++) {
+            set[i * EXFAT_ENTRY_SIZE] &= ~EXFAT_ENTRY_INUSE;
+        }
+        err = _writeSet(blkdev, dirent->entrySectors, dirent->entryOffset,
+            dirent->numEntries, set, false);
+    }
+
+    //now nothing refers to its clusters, so they can be freed.
+    if(!err && dirent->cluster >= 2) {
+        err = _freeClusters(blkdev, boot, dirent->cluster,
+            _clustersFor(boot, dirent->size),
+            dirent->flags & EXFAT_FLAG_NO_FAT_CHAIN, timeout);
+    }
+    if(dirent) free(dirent);
+    if(dir) free(dir);
+    if(err) return err;
+    return exfatSync(blkdev, boot, timeout);
+}
+
+
+int exfatAppendFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+const void *data, uint32_t size, uint32_t timeout) {
+    /** Write to the end of a file.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param file The file, from exfatCreate() or exfatOpenFile().
+     *  @param data Data to write.
+     *  @param size Number of bytes to write.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, or negative error code on failure.
+     *   On failure the file is unchanged, apart from possibly some lost
+     *   clusters.
+     *  @note The file's entry is updated before this returns, so the data
+     *   is safe from power loss. All the clusters needed are allocated
+     *   before writing, so as long as there's free space right after the
+     *   file, the data is written in one request.
+     */
+    if(!file->entrySectors[0]) return -EROFS;
+    if(size > 0x7FFFFFFF) return -EINVAL; //can't return it
+    if(!size) return 0;
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+
+    MicronExfatFile old = *file;
+    uint64_t end = file->size + size;
+    err = _fillTo(blkdev, boot, file, file->size, timeout);
+    while(!err && file->numClusters < _clustersFor(boot, end)) {
+        err = _addCluster(blkdev, boot, file, timeout);
+    }
+    if(!err) err = _writeData(blkdev, boot, file, file->size, size,
+        (const uint8_t*)data, timeout);
+    if(!err) {
+        file->size      = end;
+        file->validSize = end;
+        err = _commit(blkdev, boot, file, timeout);
+    }
+    if(err) {
+        //the entry still has the old values.
+        _restore(file, &old);
+        return err;
+    }
+    return size;
+}
+
+
+int exfatWriteFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint64_t offset, uint32_t size, const void *data, uint32_t timeout) {
+    /** Overwrite part of a file.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param file The file, from exfatOpenFile().
+     *  @param offset Byte offset to write at.
+     *  @param size Number of bytes to write.
+     *  @param data Data to write.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, which is less than `size` if the end
+     *   of the file is reached, or negative error code on failure.
+     *  @note This never changes the file's size or clusters. Within the
+     *   file's valid size, it doesn't change its entry either, so it's as
+     *   safe as the device's own writes. Beyond it (eg after
+     *   exfatTruncateFile() has grown the file), the gap is filled with
+     *   zeros and the valid size is updated.
+     */
+    if(offset >= file->size) return 0;
+    size = MIN((uint64_t)size, file->size - offset);
+    if(size > 0x7FFFFFFF) size = 0x7FFFFFFF; //can't return more
+    uint64_t end = offset + size;
+
+    if(end <= file->validSize) {
+        int err = _writeData(blkdev, boot, file, offset, size,
+            (const uint8_t*)data, timeout);
+        return err ? err : (int)size;
+    }
+
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+    uint64_t oldValid = file->validSize;
+    err = _fillTo(blkdev, boot, file, offset, timeout);
+    if(!err) err = _writeData(blkdev, boot, file, offset, size,
+        (const uint8_t*)data, timeout);
+    if(!err) {
+        file->validSize = end;
+        err = _updateEntry(blkdev, boot, file);
+    }
+    if(err) {
+        file->validSize = oldValid;
+        return err;
+    }
+    return size;
+}
+
+
+int exfatTruncateFile(FILE *blkdev, exfat_boot *boot, MicronExfatFile *file,
+uint64_t size, uint32_t timeout) {
+    /** Change the size of a file.
+     *  @param blkdev Block device to write to.
+     *  @param boot The volume's boot sector, from exfatMount().
+     *  @param file The file.
+     *  @param size The new size, in bytes.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Growing a file only allocates clusters; the new part reads as
+     *   zeros without being written, since it's beyond the valid size.
+     */
+    if(!file->entrySectors[0]) return -EROFS;
+    if(size == file->size) return 0;
+    int err = _begin(blkdev, boot, timeout);
+    if(err) return err;
+
+    if(size > file->size) {
+        MicronExfatFile old = *file;
+        while(!err && file->numClusters < _clustersFor(boot, size)) {
+            err = _addCluster(blkdev, boot, file, timeout);
+        }
+        if(!err) {
+            file->size = size;
+            err = _commit(blkdev, boot, file, timeout);
+        }
+        if(err) _restore(file, &old);
+        return err;
+    }
+
+    //find the clusters that are no longer needed.
+    uint32_t keep = _clustersFor(boot, size);
+    uint32_t drop = file->numClusters - keep;
+    uint32_t tail = 0, first = file->map.firstCluster, run;
+    bool contiguous = file->flags & EXFAT_FLAG_NO_FAT_CHAIN;
+    if(keep) {
+        err = exfatMapCluster(blkdev, boot, file, keep - 1, &tail, &run,
+            timeout);
+        if(err) return (err == -ERANGE) ? -EIO : err;
+        first = contiguous ? tail + 1 : 0;
+        if(!contiguous && drop) {
+            err = fatGetNextCluster(blkdev, &boot->_micron_vol->fat, tail,
+                timeout);
+            if(err < 0) return err;
+            first = err;
+        }
+    }
+
+    //shrink the entry first; then end the chain at the new last cluster;
+    //then free the rest.
+    file->size        = size;
+    file->validSize   = MIN(file->validSize, size);
+    file->numClusters = keep;
+    if(!keep) {
+        file->map.firstCluster = 0;
+        file->flags = EXFAT_FLAG_ALLOC_POSSIBLE;
+    }
+    fatMapReset(&file->map);
+    err = _updateEntry(blkdev, boot, file);
+    if(err) return err;
+    if(tail && drop && !contiguous) {
+        err = exfatSetFatEntry(blkdev, boot, tail, FAT_CLUSTER_EOC, timeout);
+        if(!err) err = exfatAllocFlush(blkdev, boot, timeout);
+        if(err) return err;
+    }
+    if(drop && first >= 2) err = _freeClusters(blkdev, boot, first, drop,
+        contiguous, timeout);
+    if(!err) err = exfatSync(blkdev, boot, timeout);
+    return err;
+}
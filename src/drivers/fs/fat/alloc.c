@@ -0,0 +1,592 @@
+//Cluster allocation.
+//At mount time we read the whole FAT once and build a bitmap of which
+//clusters are in use, so finding a free cluster is a scan through a few
+//words of memory rather than through the FAT on disk. The bitmap is only a
+//copy; the FAT is always updated too, so it remains the authority.
+//Reading the FAT takes a while on a large volume, so it can instead be
+//done a few sectors at a time when idle (see fatScanStep()). Until then,
+//clusters beyond the part scanned so far are looked up in the FAT itself.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / 4)
+#define SCAN_SECTORS 8 //FAT sectors to read at once when building the bitmap
+#define FSINFO_SIGNATURE 0x41615252 //"RRaA"
+#define FSINFO_SIGNATURE2 0x61417272 //"rrAa"
+
+static inline bool _isUsed(MicronFatAlloc *alloc, uint32_t cluster) {
+    uint32_t bit = cluster - 2;
+    return alloc->bitmap[bit / 32] & (1UL << (bit % 32));
+}
+
+static inline void _setUsed(MicronFatAlloc *alloc, uint32_t cluster,
+bool used) {
+    uint32_t bit = cluster - 2;
+    if(used) alloc->bitmap[bit / 32] |=  (1UL << (bit % 32));
+    else     alloc->bitmap[bit / 32] &= ~(1UL << (bit % 32));
+}
+
+static uint64_t _fatStart(fat32_mbr *mbr) {
+    //first sector of the FAT we read from.
+    uint32_t active = (mbr->flags & 0x80) ? (mbr->flags & 0x0F) : 0;
+    return mbr->_micron_startSector + mbr->reservedSectors +
+        ((uint64_t)active * mbr->sectorsPerFat32);
+}
+
+static bool _validCluster(fat32_mbr *mbr, uint32_t cluster) {
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(cluster < 2) return false;
+    if(alloc) return cluster < alloc->numClusters + 2;
+    return cluster < mbr->sectorsPerFat32 * ENTRIES_PER_SECTOR;
+}
+
+
+static void _discardRun(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+uint32_t count, uint32_t timeout) {
+    //discard clusters that were just freed. that's only a hint, so if it
+    //fails, the clusters are still free.
+    if(fatDiscardClusters(blkdev, mbr, cluster, count, timeout) < 0) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: discard of %ld clusters at %ld failed\r\n",
+                count, cluster);
+        #endif
+    }
+}
+
+
+static int _scanBatch(FILE *blkdev, fat32_mbr *mbr, uint8_t *buf) {
+    //scan the next few sectors of the FAT, noting which clusters are in
+    //use. `buf` must have room for SCAN_SECTORS sectors.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint32_t last = alloc->numClusters + 2; //one past the last cluster
+    uint32_t numSectors = ((last * 4) + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+    uint32_t sector = alloc->scanCluster / ENTRIES_PER_SECTOR;
+    uint32_t count = MIN(numSectors - sector, (uint32_t)SCAN_SECTORS);
+    int err = _fatReadSectors(blkdev, _fatStart(mbr) + sector, count, buf);
+    if(err < 0) return err;
+
+    //the disk may have changed since an earlier batch, so set or clear
+    //each bit rather than assuming the bitmap started out empty.
+    const uint32_t *map = (const uint32_t*)buf;
+    uint32_t first = sector * ENTRIES_PER_SECTOR;
+    uint32_t end = MIN(last, (sector + count) * ENTRIES_PER_SECTOR);
+    for(uint32_t cluster = alloc->scanCluster; cluster < end; cluster++) {
+        bool used = map[cluster - first] & 0x0FFFFFFF;
+        if(alloc->bitmap) _setUsed(alloc, cluster, used);
+        if(!used) alloc->scanFree++;
+    }
+    alloc->scanCluster = end;
+    return 0;
+}
+
+static void _scanDone(MicronFatAlloc *alloc) {
+    //the scan is finished, so we know exactly how many clusters are free.
+    if(alloc->scanFree != alloc->numFree) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: %ld free clusters (FSInfo said %ld)\r\n",
+                alloc->scanFree, alloc->numFree);
+        #endif
+        alloc->numFree     = alloc->scanFree;
+        alloc->fsInfoDirty = true;
+    }
+}
+
+static int _buildBitmap(FILE *blkdev, fat32_mbr *mbr) {
+    //read the whole FAT and note which clusters are in use.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint8_t *buf = (uint8_t*)malloc(SCAN_SECTORS * FAT_SECTOR_SIZE);
+    if(!buf) return -ENOMEM;
+    int err = 0;
+    while(!err && alloc->scanCluster < alloc->numClusters + 2) {
+        err = _scanBatch(blkdev, mbr, buf);
+    }
+    free(buf);
+    if(!err) _scanDone(alloc);
+    return err;
+}
+
+
+int fatAllocInit(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Set up cluster allocation.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by fatMount(). If there isn't enough memory for
+     *   the free cluster bitmap, it still succeeds, but allocation is slower.
+     *   If FAT_SCAN_AT_MOUNT is 0, the FAT isn't read here; see
+     *   fatScanStep().
+     */
+    mbr->_micron_alloc = NULL;
+    uint64_t dataStart = mbr->reservedSectors +
+        ((uint64_t)mbr->numFats * mbr->sectorsPerFat32);
+    uint64_t numSectors = mbr->numSectors ?
+        mbr->numSectors : mbr->numSmallSectors;
+    if(numSectors <= dataStart) return -EILSEQ;
+
+    MicronFatAlloc *alloc = (MicronFatAlloc*)malloc(sizeof(MicronFatAlloc));
+    if(!alloc) return -ENOMEM;
+    memset(alloc, 0, sizeof(MicronFatAlloc));
+    alloc->numClusters = (numSectors - dataStart) / mbr->sectorsPerCluster;
+    uint32_t maxClusters = (mbr->sectorsPerFat32 * ENTRIES_PER_SECTOR) - 2;
+    if(alloc->numClusters > maxClusters) alloc->numClusters = maxClusters;
+    alloc->numFree     = 0xFFFFFFFF;
+    alloc->nextFree    = 2;
+    alloc->scanCluster = 2;
+
+    //FSInfo has hints that save us from scanning the FAT if we
+    //don't have memory for the bitmap.
+    fat32_fsinfo fsInfo;
+    if(mbr->fsInfoSector && mbr->fsInfoSector != 0xFFFF
+    && fatGetFsInfo(blkdev, mbr, &fsInfo, timeout) == 0
+    && fsInfo.signature == FSINFO_SIGNATURE
+    && fsInfo.fsInfoSig == FSINFO_SIGNATURE2) {
+        if(fsInfo.numFreeClusters <= alloc->numClusters) {
+            alloc->numFree = fsInfo.numFreeClusters;
+        }
+        if(_validCluster(mbr, fsInfo.lastUsedCluster)
+        && fsInfo.lastUsedCluster < alloc->numClusters + 2) {
+            alloc->nextFree = fsInfo.lastUsedCluster;
+        }
+    }
+
+    alloc->bitmap = (uint32_t*)malloc(((alloc->numClusters + 31) / 32) * 4);
+    if(alloc->bitmap) {
+        memset(alloc->bitmap, 0, ((alloc->numClusters + 31) / 32) * 4);
+    }
+    mbr->_micron_alloc = alloc;
+    if(alloc->bitmap && FAT_SCAN_AT_MOUNT) {
+        int err = _buildBitmap(blkdev, mbr);
+        if(err == -ENOMEM) {
+            free(alloc->bitmap);
+            alloc->bitmap      = NULL;
+            alloc->scanCluster = 2;
+            alloc->scanFree    = 0;
+        }
+        else if(err < 0) {
+            free(alloc->bitmap);
+            free(alloc);
+            mbr->_micron_alloc = NULL;
+            return err;
+        }
+    }
+    #if FAT_DEBUG_PRINT
+        if(!alloc->bitmap) {
+            printf("FAT: not enough memory for free cluster bitmap\r\n");
+        }
+    #endif
+    return 0;
+}
+
+
+void fatAllocFree(fat32_mbr *mbr) {
+    /** Free the memory used for cluster allocation.
+     *  @param mbr The filesystem's MBR.
+     *  @note This is called by fatUnmount(), after fatSyncFsInfo().
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return;
+    if(alloc->bitmap) free(alloc->bitmap);
+    free(alloc);
+    mbr->_micron_alloc = NULL;
+}
+
+
+int fatGetFatEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+uint32_t *out, uint32_t timeout) {
+    /** Read a cluster's entry in the FAT.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster The cluster number.
+     *  @param out Receives the entry, masked to 28 bits.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Unlike fatGetNextCluster(), this returns the raw entry, so free,
+     *   bad and end-of-chain clusters can be told apart.
+     */
+    if(!_validCluster(mbr, cluster)) return -EINVAL;
+    uint32_t sector = cluster / ENTRIES_PER_SECTOR;
+    uint8_t *cached;
+    int err = fatCacheGetSector(blkdev, mbr, sector, &cached, timeout);
+    if(err == -ENOSYS) {
+        uint32_t buf[ENTRIES_PER_SECTOR];
+        err = _fatReadSector(blkdev, _fatStart(mbr) + sector, buf);
+        if(err < 0) return err;
+        *out = buf[cluster % ENTRIES_PER_SECTOR] & 0x0FFFFFFF;
+        return 0;
+    }
+    if(err < 0) return err;
+    *out = ((uint32_t*)cached)[cluster % ENTRIES_PER_SECTOR] & 0x0FFFFFFF;
+    return 0;
+}
+
+
+int fatSetFatEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+uint32_t value, uint32_t timeout) {
+    /** Change a cluster's entry in the FAT.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster The cluster number.
+     *  @param value The new entry, eg the next cluster or FAT_CLUSTER_EOC.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note If the FAT is cached, the change isn't written until the sector
+     *   is evicted or fatCacheFlush() is called. Every copy of the FAT is
+     *   updated. This doesn't update the free cluster bitmap.
+     */
+    if(!_validCluster(mbr, cluster)) return -EINVAL;
+    uint32_t sector = cluster / ENTRIES_PER_SECTOR;
+    uint32_t idx    = cluster % ENTRIES_PER_SECTOR;
+    uint8_t *cached;
+    int err = fatCacheGetSector(blkdev, mbr, sector, &cached, timeout);
+    if(err == -ENOSYS) {
+        uint32_t buf[ENTRIES_PER_SECTOR];
+        err = _fatReadSector(blkdev, _fatStart(mbr) + sector, buf);
+        if(err < 0) return err;
+        //the top 4 bits are reserved and must be preserved.
+        buf[idx] = (buf[idx] & 0xF0000000) | (value & 0x0FFFFFFF);
+        return fatWriteFatSector(blkdev, mbr, sector, buf);
+    }
+    if(err < 0) return err;
+    uint32_t *map = (uint32_t*)cached;
+    map[idx] = (map[idx] & 0xF0000000) | (value & 0x0FFFFFFF);
+    return fatCacheMarkDirty(mbr, sector);
+}
+
+
+static int _findFree(FILE *blkdev, fat32_mbr *mbr, uint32_t start,
+uint32_t *out, uint32_t timeout) {
+    //find a free cluster, starting from `start` and wrapping around.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint32_t last = alloc->numClusters + 2;
+    if(start < 2 || start >= last) start = 2;
+    uint32_t cluster = start;
+
+    if(alloc->bitmap) {
+        for(uint32_t n=0; n < alloc->numClusters; ) {
+            uint32_t bit = cluster - 2;
+            if(cluster >= alloc->scanCluster) {
+                //not scanned yet, so the bitmap doesn't know.
+                uint32_t entry;
+                int err = fatGetFatEntry(blkdev, mbr, cluster, &entry,
+                    timeout);
+                if(err < 0) return err;
+                if(entry == FAT_CLUSTER_FREE) {
+                    *out = cluster;
+                    return 0;
+                }
+                n++;
+                cluster++;
+            }
+            else if((bit % 32) == 0 && alloc->bitmap[bit / 32] == 0xFFFFFFFF
+            && cluster + 32 <= alloc->scanCluster) {
+                n += 32; //skip a full word at once
+                cluster += 32;
+            }
+            else {
+                if(!_isUsed(alloc, cluster)) {
+                    *out = cluster;
+                    return 0;
+                }
+                n++;
+                cluster++;
+            }
+            if(cluster >= last) cluster = 2;
+        }
+        return -ENOSPC;
+    }
+
+    //no bitmap, so search the FAT itself.
+    for(uint32_t n=0; n < alloc->numClusters; n++) {
+        uint32_t entry;
+        int err = fatGetFatEntry(blkdev, mbr, cluster, &entry, timeout);
+        if(err < 0) return err;
+        if(entry == FAT_CLUSTER_FREE) {
+            *out = cluster;
+            return 0;
+        }
+        if(++cluster >= last) cluster = 2;
+    }
+    return -ENOSPC;
+}
+
+
+int fatAllocCluster(FILE *blkdev, fat32_mbr *mbr, uint32_t prev,
+uint32_t *out, uint32_t timeout) {
+    /** Allocate a cluster.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param prev Cluster to link the new one to (ie the current last
+     *   cluster of the file), or 0 to start a new chain.
+     *  @param out Receives the new cluster number.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOSPC if the disk is full, or negative error
+     *   code on failure.
+     *  @note The new cluster is marked as the end of its chain before
+     *   `prev` is linked to it, so a chain never points to a free cluster,
+     *   even if power is lost partway through. The cluster's contents are
+     *   not changed.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+
+    //look right after the previous cluster first, to keep files contiguous.
+    uint32_t cluster;
+    int err = _findFree(blkdev, mbr, prev ? prev + 1 : alloc->nextFree,
+        &cluster, timeout);
+    if(err < 0) return err;
+
+    err = fatSetFatEntry(blkdev, mbr, cluster, FAT_CLUSTER_EOC, timeout);
+    if(err < 0) return err;
+    if(alloc->bitmap) _setUsed(alloc, cluster, true);
+    if(alloc->numFree != 0xFFFFFFFF && alloc->numFree) alloc->numFree--;
+    if(cluster < alloc->scanCluster) alloc->scanFree--;
+    alloc->nextFree    = cluster + 1;
+    alloc->fsInfoDirty = true;
+
+    if(prev) {
+        //if the two entries are in different sectors, make sure the new
+        //one reaches the disk first.
+        if(prev / ENTRIES_PER_SECTOR != cluster / ENTRIES_PER_SECTOR) {
+            err = fatCacheFlush(blkdev, mbr, timeout);
+            if(err < 0) return err;
+        }
+        err = fatSetFatEntry(blkdev, mbr, prev, cluster, timeout);
+        if(err < 0) return err;
+    }
+
+    *out = cluster;
+    return 0;
+}
+
+
+int fatFreeChain(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+uint32_t timeout) {
+    /** Free a chain of clusters.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster First cluster of the chain.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Nothing may refer to the chain any more; unlink it first (and
+     *   make sure that's on disk) so that losing power partway through only
+     *   leaves unreachable clusters behind. If FAT_DISCARD_FREED is set, the
+     *   freed clusters are also discarded (see fatDiscardClusters()).
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+
+    //limit the number of steps, in case the chain is corrupt and loops.
+    //contiguous runs of freed clusters are discarded together.
+    uint32_t runStart = 0, runLength = 0;
+    for(uint32_t n=0; n < alloc->numClusters && _validCluster(mbr, cluster);
+    n++) {
+        uint32_t next;
+        int err = fatGetFatEntry(blkdev, mbr, cluster, &next, timeout);
+        if(err < 0) return err;
+        if(next == FAT_CLUSTER_FREE || next == FAT_CLUSTER_BAD) break;
+
+        err = fatSetFatEntry(blkdev, mbr, cluster, FAT_CLUSTER_FREE, timeout);
+        if(err < 0) return err;
+        if(alloc->bitmap) _setUsed(alloc, cluster, false);
+        if(alloc->numFree != 0xFFFFFFFF) alloc->numFree++;
+        if(cluster < alloc->scanCluster) alloc->scanFree++;
+        if(cluster < alloc->nextFree) alloc->nextFree = cluster;
+        alloc->fsInfoDirty = true;
+
+        if(FAT_DISCARD_FREED) {
+            if(runLength && cluster == runStart + runLength) runLength++;
+            else {
+                if(runLength) _discardRun(blkdev, mbr, runStart, runLength,
+                    timeout);
+                runStart  = cluster;
+                runLength = 1;
+            }
+        }
+        cluster = next;
+    }
+    if(runLength) _discardRun(blkdev, mbr, runStart, runLength, timeout);
+    return 0;
+}
+
+
+int fatDiscardClusters(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+uint32_t count, uint32_t timeout) {
+    /** Tell the block device that some clusters' contents aren't needed.
+     *  @param blkdev Block device.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster First cluster.
+     *  @param count Number of consecutive clusters.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Afterward the clusters may read back as anything, so this is
+     *   for free clusters, or ones about to be overwritten (eg a file that's
+     *   about to be rewritten in full), so the device can prepare them.
+     *   It's a hint; devices that don't support it ignore it.
+     */
+    if(!count) return 0;
+    if(!_validCluster(mbr, cluster) || !_validCluster(mbr, cluster + count - 1)) {
+        return -EINVAL;
+    }
+    uint64_t sector = fatClusterToSector(mbr, cluster);
+    uint64_t numSectors = (uint64_t)count * mbr->sectorsPerCluster;
+    fatViewUpdate(mbr, sector, numSectors, NULL);
+    while(numSectors) {
+        uint32_t n = MIN(numSectors, (uint64_t)FAT_DISCARD_MAX_SECTORS);
+        int err = _fatDiscardSectors(blkdev, sector, n);
+        if(err < 0) return err;
+        sector += n;
+        numSectors -= n;
+    }
+    return 0;
+}
+
+
+int64_t fatDiscardFree(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Tell the block device that all the free clusters aren't needed.
+     *  @param blkdev Block device.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of clusters discarded, or negative error code on
+     *   failure.
+     *  @note This catches clusters freed by other systems, or while
+     *   FAT_DISCARD_FREED was 0. It's quick if the free cluster bitmap is
+     *   there and the scan (see fatScanStep()) is done; otherwise it reads
+     *   the FAT.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+    uint32_t last = alloc->numClusters + 2;
+    uint32_t runStart = 0, runLength = 0;
+    int64_t total = 0;
+    for(uint32_t cluster = 2; cluster <= last; cluster++) {
+        bool isFree = false;
+        if(cluster < last) {
+            if(alloc->bitmap && cluster < alloc->scanCluster) {
+                isFree = !_isUsed(alloc, cluster);
+            }
+            else {
+                uint32_t entry;
+                int err = fatGetFatEntry(blkdev, mbr, cluster, &entry, timeout);
+                if(err < 0) return err;
+                isFree = (entry == FAT_CLUSTER_FREE);
+            }
+        }
+        if(isFree) {
+            if(!runLength) runStart = cluster;
+            runLength++;
+        }
+        else if(runLength) {
+            int err = fatDiscardClusters(blkdev, mbr, runStart, runLength,
+                timeout);
+            if(err < 0) return err;
+            total += runLength;
+            runLength = 0;
+        }
+    }
+    return total;
+}
+
+
+int fatSyncFsInfo(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Update the free cluster count and next free cluster hint in the
+     *  FSInfo sector, if they've changed.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note These are only hints, so other systems don't trust them, and
+     *   it doesn't matter if they're out of date after losing power.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!(alloc && alloc->fsInfoDirty)) return 0;
+    if(mbr->fsInfoSector == 0 || mbr->fsInfoSector == 0xFFFF) return 0;
+
+    fat32_fsinfo fsInfo;
+    uint64_t sector = mbr->_micron_startSector + mbr->fsInfoSector;
+    int err = _fatReadSector(blkdev, sector, &fsInfo);
+    if(err < 0) return err;
+    if(fsInfo.signature != FSINFO_SIGNATURE
+    || fsInfo.fsInfoSig != FSINFO_SIGNATURE2 || fsInfo.mbrSig != 0xAA55) {
+        return 0; //not valid, so leave it alone
+    }
+
+    fsInfo.numFreeClusters = alloc->numFree;
+    fsInfo.lastUsedCluster = alloc->nextFree;
+    err = _fatWriteSector(blkdev, sector, &fsInfo);
+    if(err < 0) return err;
+    alloc->fsInfoDirty = false;
+    return 0;
+}
+
+
+int64_t fatGetFreeSpace(fat32_mbr *mbr) {
+    /** Get the amount of free space on the filesystem.
+     *  @param mbr The filesystem's MBR.
+     *  @return Number of free bytes, or negative error code on failure.
+     *   (-ENODATA if unknown.)
+     *  @note Until the free cluster scan finishes (see fatScanStep()), this
+     *   is based on FSInfo, which may be wrong.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+    if(alloc->numFree == 0xFFFFFFFF) return -ENODATA;
+    return (int64_t)alloc->numFree * mbr->sectorsPerCluster * FAT_SECTOR_SIZE;
+}
+
+
+int fatScanStep(FILE *blkdev, fat32_mbr *mbr, uint32_t budget,
+uint32_t timeout) {
+    /** Continue finding which clusters are free, a little at a time.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param budget Roughly how long to spend, in milliseconds. At least
+     *   a few sectors of the FAT are read each time, even if this is 0.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Percentage of the FAT scanned so far (100 when finished), or
+     *   negative error code on failure.
+     *  @note This is only needed if FAT_SCAN_AT_MOUNT is 0; call it when
+     *   idle until it returns 100. Files can be used meanwhile. When it
+     *   finishes, the free cluster count is corrected and written to
+     *   FSInfo.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+    uint32_t last = alloc->numClusters + 2;
+    if(alloc->scanCluster >= last) return 100;
+
+    //we read the FAT from the disk, so make sure it's up to date.
+    int err = fatCacheFlush(blkdev, mbr, timeout);
+    if(err < 0) return err;
+
+    uint8_t *buf = (uint8_t*)malloc(SCAN_SECTORS * FAT_SECTOR_SIZE);
+    if(!buf) return -ENOMEM;
+    uint32_t start = millis();
+    do {
+        err = _scanBatch(blkdev, mbr, buf);
+    } while(!err && alloc->scanCluster < last && millis() - start < budget);
+    free(buf);
+    if(err < 0) return err;
+
+    if(alloc->scanCluster >= last) {
+        _scanDone(alloc);
+        err = fatSyncFsInfo(blkdev, mbr, timeout);
+        if(err < 0) return err;
+    }
+    return fatScanProgress(mbr);
+}
+
+
+int fatScanProgress(fat32_mbr *mbr) {
+    /** Check how far the free cluster scan has got.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @return Percentage of the FAT scanned so far (100 when finished), or
+     *   negative error code on failure.
+     */
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+    if(!alloc->numClusters) return 100;
+    return ((uint64_t)(alloc->scanCluster - 2) * 100) / alloc->numClusters;
+}
@@ -0,0 +1,269 @@
+//Fragmentation analysis.
+//This only reads the volume, and does it a slice at a time (see
+//fatAnalyzeStep()) so it can run in the background while the volume is in
+//use. First the FAT is scanned for runs of free clusters, then the
+//directory tree is walked and each file's cluster chain is followed to
+//count its extents. Everything it needs fits in MicronFatAnalysis, so the
+//memory used doesn't depend on the size of the volume.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / 4)
+#define SCAN_SECTORS 8   //FAT sectors to read at once when finding free runs
+#define BITMAP_BATCH 4096 //clusters to look at at once when using the bitmap
+#define CHAIN_BATCH 256  //clusters to follow at once in a file's chain
+
+static uint64_t _fatStart(fat32_mbr *mbr) {
+    //first sector of the FAT we read from.
+    uint32_t active = (mbr->flags & 0x80) ? (mbr->flags & 0x0F) : 0;
+    return mbr->_micron_startSector + mbr->reservedSectors +
+        ((uint64_t)active * mbr->sectorsPerFat32);
+}
+
+static void _addRun(MicronFatAnalysis *a, uint32_t start, uint32_t length) {
+    //record a run of free clusters.
+    uint32_t bucket = 0;
+    while(bucket < FAT_ANALYZE_HIST_BUCKETS - 1 && (length >> (bucket+1))) {
+        bucket++;
+    }
+    a->freeHist[bucket]++;
+    a->numFreeRuns++;
+    a->freeClusters += length;
+    if(length > a->largestFree) {
+        a->largestFree   = length;
+        a->largestFreeAt = start;
+    }
+}
+
+static void _noteCluster(MicronFatAnalysis *a, uint32_t cluster, bool used) {
+    //look at one cluster while scanning for free runs.
+    if(!used && !a->runStart) a->runStart = cluster;
+    else if(used && a->runStart) {
+        _addRun(a, a->runStart, cluster - a->runStart);
+        a->runStart = 0;
+    }
+}
+
+
+static int _scanFree(FILE *blkdev, fat32_mbr *mbr, MicronFatAnalysis *a,
+uint8_t *buf) {
+    //look at the next batch of clusters. `buf` must have room for
+    //SCAN_SECTORS sectors.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint32_t last = alloc->numClusters + 2; //one past the last cluster
+    uint32_t end;
+    if(alloc->bitmap && alloc->scanCluster >= last) {
+        //the bitmap is complete, so we don't need to read the FAT.
+        end = MIN(last, a->cluster + BITMAP_BATCH);
+        for(uint32_t cluster = a->cluster; cluster < end; cluster++) {
+            uint32_t bit = cluster - 2;
+            _noteCluster(a, cluster,
+                alloc->bitmap[bit / 32] & (1UL << (bit % 32)));
+        }
+    }
+    else {
+        uint32_t numSectors =
+            ((last * 4) + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+        uint32_t sector = a->cluster / ENTRIES_PER_SECTOR;
+        uint32_t count = MIN(numSectors - sector, (uint32_t)SCAN_SECTORS);
+        int err = _fatReadSectors(blkdev, _fatStart(mbr) + sector, count, buf);
+        if(err < 0) return err;
+        const uint32_t *map = (const uint32_t*)buf;
+        uint32_t first = sector * ENTRIES_PER_SECTOR;
+        end = MIN(last, (sector + count) * ENTRIES_PER_SECTOR);
+        for(uint32_t cluster = a->cluster; cluster < end; cluster++) {
+            _noteCluster(a, cluster, map[cluster - first] & 0x0FFFFFFF);
+        }
+    }
+    a->cluster = end;
+
+    if(end >= last) { //finished
+        if(a->runStart) _addRun(a, a->runStart, last - a->runStart);
+        a->runStart = 0;
+        if(a->freeClusters) {
+            a->freeFragmentation = 1000 - (uint16_t)(
+                ((uint64_t)a->largestFree * 1000) / a->freeClusters);
+        }
+        a->phase = FAT_ANALYZE_TREE;
+    }
+    return 0;
+}
+
+
+static void _fileDone(MicronFatAnalysis *a) {
+    //we've counted the extents of the file in `a->dirent`.
+    a->fileClusters += a->chainLength;
+    a->fileExtents  += a->chainExtents;
+    if(a->chainExtents > 1) a->numFragmented++;
+    if(a->chainExtents > a->worstExtents) {
+        a->worstExtents = a->chainExtents;
+        a->worstCluster = a->dirent.cluster;
+        memcpy(a->worstName, a->dir.shortName, sizeof(a->worstName));
+    }
+    if(a->callback) {
+        a->callback(&a->dirent, &a->dir, a->depth, a->chainExtents, a->param);
+    }
+    a->chainCluster = 0;
+}
+
+static int _followChain(FILE *blkdev, fat32_mbr *mbr, MicronFatAnalysis *a,
+uint32_t timeout) {
+    //follow the current file's chain a bit further.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    for(int i=0; i<CHAIN_BATCH; i++) {
+        int next = fatGetNextCluster(blkdev, mbr, a->chainCluster, timeout);
+        if(next < 0) return next;
+        if(next == 0) {
+            _fileDone(a);
+            return 0;
+        }
+        //a chain can't be longer than the volume unless it loops.
+        if((uint32_t)next >= alloc->numClusters + 2
+        || a->chainLength >= alloc->numClusters) return -EILSEQ;
+        if((uint32_t)next != a->chainCluster + 1) a->chainExtents++;
+        a->chainLength++;
+        a->chainCluster = next;
+    }
+    return 0;
+}
+
+
+static int _walkTree(FILE *blkdev, fat32_mbr *mbr, MicronFatAnalysis *a,
+uint32_t timeout) {
+    //look at the next directory entry, or continue with the current file.
+    if(a->chainCluster) return _followChain(blkdev, mbr, a, timeout);
+
+    int err = fatReadDirNext(blkdev, mbr, &a->dir, &a->dirent, timeout);
+    if(err == -ENOENT) { //end of directory; go back up
+        if(!a->depth) {
+            a->phase = FAT_ANALYZE_DONE;
+            return 0;
+        }
+        a->depth--;
+        err = fatOpenDir(mbr, a->stack[a->depth].cluster, &a->dir);
+        if(!err) err = fatSeekDir(blkdev, mbr, &a->dir,
+            a->stack[a->depth].index, timeout);
+        //if the subdirectory was the last entry in the parent's last
+        //cluster, there's nothing to go back to; fatSeekDir() has marked
+        //the parent as ended, so the next call goes up again.
+        return (err == -ENOENT) ? 0 : err;
+    }
+    if(err < 0) return err;
+
+    uint32_t cluster = a->dirent.cluster;
+    if(a->dirent.attributes & FAT_ATTR_VOLUME_LABEL) return 0;
+    if(a->dirent.attributes & FAT_ATTR_DIRECTORY) {
+        if(!strcmp(a->dir.shortName, ".") || !strcmp(a->dir.shortName, "..")) {
+            return 0;
+        }
+        a->numDirs++;
+        if(a->depth >= FAT_ANALYZE_MAX_DEPTH || cluster < 2) {
+            a->numSkipped++;
+            return 0;
+        }
+        a->stack[a->depth].cluster = a->dir.firstCluster;
+        a->stack[a->depth].index   = a->dir.index;
+        a->depth++;
+        return fatOpenDir(mbr, cluster, &a->dir);
+    }
+
+    a->numFiles++;
+    a->chainLength  = 0;
+    a->chainExtents = 0;
+    if(cluster < 2) { //empty file
+        a->numEmpty++;
+        _fileDone(a);
+        return 0;
+    }
+    if(cluster >= mbr->_micron_alloc->numClusters + 2) return -EILSEQ;
+    a->chainCluster = cluster;
+    a->chainLength  = 1;
+    a->chainExtents = 1;
+    return 0;
+}
+
+
+void fatAnalyzeBegin(MicronFatAnalysis *out, MicronFatAnalyzeCallback callback,
+void *param) {
+    /** Prepare to analyze how fragmented a volume is.
+     *  @param out Receives the analysis state, and later the results.
+     *  @param callback Function to call for each file, or NULL.
+     *  @param param Parameter to pass to callback.
+     *  @note Call fatAnalyzeStep() until it returns 100.
+     */
+    memset(out, 0, sizeof(MicronFatAnalysis));
+    out->phase    = FAT_ANALYZE_FREE;
+    out->cluster  = 2;
+    out->callback = callback;
+    out->param    = param;
+}
+
+
+int fatAnalyzeStep(FILE *blkdev, fat32_mbr *mbr, MicronFatAnalysis *analysis,
+uint32_t budget, uint32_t timeout) {
+    /** Continue analyzing how fragmented a volume is, a little at a time.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param analysis The analysis state, from fatAnalyzeBegin().
+     *  @param budget Roughly how long to spend, in milliseconds. Some
+     *   progress is made each time, even if this is 0.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Rough percentage done (100 when finished), or negative error
+     *   code on failure.
+     *  @note Nothing is written to the volume. It can be modified between
+     *   calls, but then the results only approximately describe it.
+     *   -EILSEQ means a cluster chain is invalid or loops.
+     *   Once finished, the results are in `analysis`, and the callback has
+     *   been called for each file.
+     */
+    MicronFatAnalysis *a = analysis;
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    if(!alloc) return -EROFS;
+    if(a->phase == FAT_ANALYZE_DONE) return 100;
+
+    int err = 0;
+    uint8_t *buf = NULL;
+    uint32_t start = millis();
+    if(a->phase == FAT_ANALYZE_FREE) {
+        //we read the FAT from the disk, so make sure it's up to date.
+        err = fatCacheFlush(blkdev, mbr, timeout);
+        if(err < 0) return err;
+        buf = (uint8_t*)malloc(SCAN_SECTORS * FAT_SECTOR_SIZE);
+        if(!buf) return -ENOMEM;
+        do {
+            err = _scanFree(blkdev, mbr, a, buf);
+        } while(!err && a->phase == FAT_ANALYZE_FREE
+            && millis() - start < budget);
+        free(buf);
+        if(err < 0) return err;
+        if(a->phase == FAT_ANALYZE_TREE) {
+            err = fatOpenDir(mbr, 0, &a->dir);
+            if(err < 0) return err;
+        }
+        else return ((uint64_t)(a->cluster - 2) * 50) / alloc->numClusters;
+    }
+
+    do {
+        err = _walkTree(blkdev, mbr, a, timeout);
+    } while(!err && a->phase == FAT_ANALYZE_TREE
+        && millis() - start < budget);
+    if(err < 0) return err;
+
+    if(a->phase == FAT_ANALYZE_DONE) {
+        //a file of n clusters in e extents has n-1 steps from one cluster
+        //to the next, e-1 of which aren't to the adjacent cluster.
+        uint64_t steps = a->fileClusters - (a->numFiles - a->numEmpty);
+        if(steps) {
+            a->fragmentation = (uint16_t)(((a->fileExtents -
+                (a->numFiles - a->numEmpty)) * 1000) / steps);
+        }
+        return 100;
+    }
+
+    //estimate how far we've got by how much of the used space we've seen.
+    uint32_t used = alloc->numClusters - a->freeClusters;
+    if(!used) return 99;
+    return 50 + (int)MIN((uint64_t)49, (a->fileClusters * 50) / used);
+}
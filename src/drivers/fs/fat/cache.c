@@ -0,0 +1,183 @@
+//Cache for sectors of the file allocation table.
+//Following a cluster chain touches the same FAT sector over and over
+//(each one holds 128 entries), so keeping a few of them in memory saves
+//most of the reads. Everything that reads the FAT goes through here,
+//so chain walks, directory traversal and free space scans share it. The
+//sectors are kept in a MicronBlockCache, keyed by their index in the FAT.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+static uint32_t _activeFat(fat32_mbr *mbr) {
+    //if bit 7 of flags is set, only one FAT is in use, and
+    //bits 0-3 tell which one. otherwise, all are mirrored.
+    if(mbr->flags & 0x80) return mbr->flags & 0x0F;
+    return 0;
+}
+
+static int _writeBack(FILE *blkdev, fat32_mbr *mbr, MicronFatCache *cache,
+uint16_t i) {
+    //write a dirty entry to disk.
+    MicronBlockCacheEntry *ent = &cache->blocks.entries[i];
+    int err = fatWriteFatSector(blkdev, mbr, (uint32_t)ent->block,
+        blockCacheData(&cache->blocks, i));
+    if(err < 0) return err;
+    ent->flags &= ~BLOCKCACHE_DIRTY;
+    cache->writebacks++;
+    return 0;
+}
+
+
+int fatWriteFatSector(FILE *blkdev, fat32_mbr *mbr, uint32_t sector,
+const void *data) {
+    /** Write a sector of the FAT to every copy of the FAT.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param sector Which sector of the FAT.
+     *  @param data The sector's contents.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The copies are written in order, so if power is lost partway
+     *   through, the first FAT is always the newest.
+     */
+    uint64_t start = mbr->_micron_startSector + mbr->reservedSectors;
+    uint32_t first = 0, last = mbr->numFats;
+    if(mbr->flags & 0x80) { //mirroring disabled
+        first = _activeFat(mbr);
+        last  = first + 1;
+    }
+    for(uint32_t iFat=first; iFat<last; iFat++) {
+        int err = _fatWriteSector(blkdev,
+            start + ((uint64_t)iFat * mbr->sectorsPerFat32) + sector, data);
+        if(err < 0) return err;
+    }
+    return 0;
+}
+
+
+int fatCacheInit(fat32_mbr *mbr, uint16_t size) {
+    /** Set up the FAT sector cache.
+     *  @param mbr The filesystem's MBR.
+     *  @param size Number of sectors to cache. Can be zero to disable it.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by fatMount().
+     */
+    mbr->_micron_fatCache = NULL;
+    if(!size) return 0;
+
+    MicronFatCache *cache = (MicronFatCache*)malloc(sizeof(MicronFatCache));
+    if(!cache) return -ENOMEM;
+    int err = blockCacheInit(&cache->blocks, size, FAT_SECTOR_SIZE);
+    if(err) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: not enough memory for FAT cache\r\n");
+        #endif
+        free(cache);
+        return err;
+    }
+    cache->writebacks = 0;
+    mbr->_micron_fatCache = cache;
+    return 0;
+}
+
+
+int fatCacheFlush(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Write any modified FAT sectors to disk.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    MicronFatCache *cache = mbr->_micron_fatCache;
+    if(!cache) return 0;
+    for(uint16_t i=0; i<cache->blocks.size; i++) {
+        if(cache->blocks.entries[i].flags & BLOCKCACHE_DIRTY) {
+            int err = _writeBack(blkdev, mbr, cache, i);
+            if(err < 0) return err;
+        }
+    }
+    return 0;
+}
+
+
+int fatCacheFree(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Flush and free the FAT sector cache.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The cache is freed even if flushing fails.
+     */
+    MicronFatCache *cache = mbr->_micron_fatCache;
+    if(!cache) return 0;
+    int err = fatCacheFlush(blkdev, mbr, timeout);
+    blockCacheFree(&cache->blocks);
+    free(cache);
+    mbr->_micron_fatCache = NULL;
+    return err;
+}
+
+
+int fatCacheGetSector(FILE *blkdev, fat32_mbr *mbr, uint32_t sector,
+uint8_t **out, uint32_t timeout) {
+    /** Get a sector of the FAT, reading it into the cache if needed.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param sector Which sector of the FAT.
+     *  @param out Receives a pointer to the cached sector.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOSYS if there's no cache, or negative error
+     *   code on failure.
+     *  @note The pointer is only valid until the next call to this function.
+     *   If you modify the data, call fatCacheMarkDirty() afterward.
+     */
+    MicronFatCache *cache = mbr->_micron_fatCache;
+    if(!cache) return -ENOSYS;
+
+    int i = blockCacheFind(&cache->blocks, sector);
+    if(i >= 0) {
+        *out = blockCacheData(&cache->blocks, i);
+        return 0;
+    }
+
+    //not found, so replace the least recently used entry.
+    //empty entries are always at the tail, so they're used first.
+    i = blockCacheVictim(&cache->blocks);
+    if(i < 0) return i;
+    if(cache->blocks.entries[i].flags & BLOCKCACHE_DIRTY) {
+        int err = _writeBack(blkdev, mbr, cache, i);
+        if(err < 0) return err;
+    }
+
+    blockCacheAssign(&cache->blocks, i, sector);
+    uint64_t start = mbr->_micron_startSector + mbr->reservedSectors +
+        ((uint64_t)_activeFat(mbr) * mbr->sectorsPerFat32);
+    #if FAT_DEBUG_PRINT
+        printf("FAT: cache miss, read FAT sector 0x%lX\r\n", sector);
+    #endif
+    int err = _fatReadSector(blkdev, start + sector,
+        blockCacheData(&cache->blocks, i));
+    if(err < 0) {
+        blockCacheDiscard(&cache->blocks, i);
+        return err;
+    }
+    *out = blockCacheData(&cache->blocks, i);
+    return 0;
+}
+
+
+int fatCacheMarkDirty(fat32_mbr *mbr, uint32_t sector) {
+    /** Mark a cached FAT sector as modified.
+     *  @param mbr The filesystem's MBR.
+     *  @param sector Which sector of the FAT.
+     *  @return 0 on success, or -ENOENT if the sector isn't in the cache.
+     *  @note The sector will be written to all copies of the FAT when it's
+     *   evicted or when fatCacheFlush() is called.
+     */
+    MicronFatCache *cache = mbr->_micron_fatCache;
+    if(!cache) return -ENOENT;
+    int i = blockCachePeek(&cache->blocks, sector);
+    if(i < 0) return -ENOENT;
+    cache->blocks.entries[i].flags |= BLOCKCACHE_DIRTY;
+    return 0;
+}
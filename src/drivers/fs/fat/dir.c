@@ -0,0 +1,297 @@
+//Directory iteration.
+//A directory is just a file whose contents are `fat32_dirent`s, so we read
+//it one sector (16 entries) at a time, following its cluster chain, and
+//assemble long file names as we go.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / sizeof(fat32_dirent))
+
+uint8_t fatShortNameChecksum(const char *name) {
+    /** Compute the checksum of a short name, as stored in LFN entries.
+     *  @param name The 11-byte name, as stored in the directory entry
+     *   (8 bytes name followed by 3 bytes extension, space padded).
+     *  @return The checksum.
+     */
+    const uint8_t *n = (const uint8_t*)name;
+    uint8_t sum = 0;
+    for(int i=0; i<11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + n[i];
+    }
+    return sum;
+}
+
+
+static void _formatShortName(const fat32_dirent *ent, char *out) {
+    //convert "FOO     TXT" to "FOO.TXT".
+    //extAttributes bits 3 and 4 are used by Windows NT to mark names
+    //whose base/extension are entirely lowercase.
+    int len = 0;
+    for(int i=0; i<8 && ent->shortName[i] != ' '; i++) {
+        char c = ent->shortName[i];
+        if(i == 0 && c == 0x05) c = 0xE5; //escaped
+        if((ent->extAttributes & 0x08) && c >= 'A' && c <= 'Z') c += 0x20;
+        out[len++] = c;
+    }
+    if(ent->shortExt[0] != ' ') {
+        out[len++] = '.';
+        for(int i=0; i<3 && ent->shortExt[i] != ' '; i++) {
+            char c = ent->shortExt[i];
+            if((ent->extAttributes & 0x10) && c >= 'A' && c <= 'Z') c += 0x20;
+            out[len++] = c;
+        }
+    }
+    out[len] = '\0';
+}
+
+
+static void _addLfn(MicronFatDir *dir, const vfat_lfn *lfn) {
+    //store one LFN entry. they're stored in reverse order, and the first
+    //one (ie the end of the name) has bit 6 of its sequence number set.
+    int seq = lfn->seq & 0x1F;
+    if(lfn->seq & 0x40) {
+        if(seq < 1 || seq > FAT_LFN_MAX_ENTRIES) {
+            dir->lfnSeq = 0;
+            return;
+        }
+        dir->lfnChecksum = lfn->checksum;
+        dir->lfnLength = seq * 13;
+        dir->lfnCount = 0;
+    }
+    else if(dir->lfnSeq == 0 || seq != dir->lfnSeq - 1
+    || lfn->checksum != dir->lfnChecksum) {
+        dir->lfnSeq = 0; //out of sequence; discard it.
+        return;
+    }
+
+    uint16_t *name = &dir->lfn[(seq - 1) * 13];
+    for(int i=0; i<5; i++) name[i   ] = lfn->name0[i];
+    for(int i=0; i<6; i++) name[i+5 ] = lfn->name1[i];
+    for(int i=0; i<2; i++) name[i+11] = lfn->name2[i];
+    dir->lfnSeq = seq;
+    dir->lfnCount++;
+}
+
+
+static int _lfnToUtf8(const uint16_t *lfn, int len, char *out, size_t size) {
+    //convert a UTF-16 long name to UTF-8.
+    size_t pos = 0;
+    for(int i=0; i<len; i++) {
+        uint32_t c = lfn[i];
+        if(c == 0x0000 || c == 0xFFFF) break; //terminator, padding
+        if(c >= 0xD800 && c <= 0xDBFF && i+1 < len
+        && lfn[i+1] >= 0xDC00 && lfn[i+1] <= 0xDFFF) { //surrogate pair
+            c = 0x10000 + ((c - 0xD800) << 10) + (lfn[++i] - 0xDC00);
+        }
+
+        uint8_t buf[4];
+        int n;
+        if(c < 0x80) { buf[0] = c; n = 1; }
+        else if(c < 0x800) {
+            buf[0] = 0xC0 |  (c >>  6);
+            buf[1] = 0x80 |  (c        & 0x3F);
+            n = 2;
+        }
+        else if(c < 0x10000) {
+            buf[0] = 0xE0 |  (c >> 12);
+            buf[1] = 0x80 | ((c >>  6) & 0x3F);
+            buf[2] = 0x80 |  (c        & 0x3F);
+            n = 3;
+        }
+        else {
+            buf[0] = 0xF0 |  (c >> 18);
+            buf[1] = 0x80 | ((c >> 12) & 0x3F);
+            buf[2] = 0x80 | ((c >>  6) & 0x3F);
+            buf[3] = 0x80 |  (c        & 0x3F);
+            n = 4;
+        }
+        if(pos + n >= size) break;
+        memcpy(&out[pos], buf, n);
+        pos += n;
+    }
+    out[pos] = '\0';
+    return pos;
+}
+
+
+int fatOpenDir(fat32_mbr *mbr, uint32_t cluster, MicronFatDir *out) {
+    /** Prepare to read a directory.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster The directory's first cluster, or 0 for the root
+     *   directory. (".." entries use 0 to refer to the root.)
+     *  @param out Receives the directory state.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    if(cluster == 0) cluster = mbr->rootCluster;
+    if(cluster < 2) return -EINVAL;
+    memset(out, 0, sizeof(MicronFatDir));
+    out->firstCluster = cluster;
+    out->cluster      = cluster;
+    return 0;
+}
+
+
+void fatRewindDir(MicronFatDir *dir) {
+    /** Go back to the beginning of a directory.
+     *  @param dir The directory.
+     */
+    dir->cluster = dir->firstCluster;
+    dir->sector  = 0;
+    dir->entry   = 0;
+    dir->index   = 0;
+    dir->loaded  = false;
+    dir->end     = false;
+    dir->lfnSeq  = 0;
+}
+
+
+int fatSeekDir(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir,
+uint32_t index, uint32_t timeout) {
+    /** Go to a specific entry in a directory.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param dir The directory.
+     *  @param index The entry index to go to.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if the directory isn't that long,
+     *   or negative error code on failure.
+     */
+    uint32_t perCluster = ENTRIES_PER_SECTOR * mbr->sectorsPerCluster;
+    fatRewindDir(dir);
+    for(uint32_t i=0; i < index / perCluster; i++) {
+        int next = fatGetNextCluster(blkdev, mbr, dir->cluster, timeout);
+        if(next <  0) return next;
+        if(next == 0) {
+            dir->end = true;
+            return -ENOENT;
+        }
+        dir->cluster = next;
+    }
+    dir->sector = (index % perCluster) / ENTRIES_PER_SECTOR;
+    dir->entry  = index % ENTRIES_PER_SECTOR;
+    dir->index  = index;
+    return 0;
+}
+
+
+static int _loadSector(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir,
+uint32_t timeout) {
+    //read the current sector of the directory, moving on to the
+    //next cluster if needed.
+    if(dir->sector >= mbr->sectorsPerCluster) {
+        int next = fatGetNextCluster(blkdev, mbr, dir->cluster, timeout);
+        if(next <  0) return next;
+        if(next == 0) {
+            dir->end = true;
+            return -ENOENT;
+        }
+        dir->cluster = next;
+        dir->sector  = 0;
+    }
+    dir->bufSector = fatClusterToSector(mbr, dir->cluster) + dir->sector;
+    int err = _fatReadSector(blkdev, dir->bufSector, dir->buffer);
+    if(err < 0) return err;
+    dir->loaded = true;
+    return 0;
+}
+
+
+int fatReadDirRaw(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir,
+const fat32_dirent **out, uint32_t timeout) {
+    /** Read the next raw entry from a directory.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param dir The directory, from fatOpenDir().
+     *  @param out Receives a pointer to the entry, which remains valid until
+     *   the next call.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT at the end of the directory's cluster
+     *   chain, or negative error code on failure.
+     *  @note Unlike fatReadDirNext(), this returns every entry as it is on
+     *   disk, including deleted entries, LFN entries, and the unused entries
+     *   after the end marker. `dir->entSector`, `dir->entOffset` and
+     *   `dir->entIndex` receive its location.
+     */
+    if(dir->end) return -ENOENT;
+    if(!dir->loaded) {
+        int err = _loadSector(blkdev, mbr, dir, timeout);
+        if(err < 0) return err;
+    }
+
+    *out = (const fat32_dirent*)&dir->buffer[dir->entry * sizeof(fat32_dirent)];
+    dir->entSector = dir->bufSector;
+    dir->entOffset = dir->entry * sizeof(fat32_dirent);
+    dir->entIndex  = dir->index;
+
+    //move on to the next entry. we still have the buffer, so `out`
+    //remains valid until the next call.
+    dir->index++;
+    if(++dir->entry >= ENTRIES_PER_SECTOR) {
+        dir->entry  = 0;
+        dir->sector++;
+        dir->loaded = false;
+    }
+    return 0;
+}
+
+
+int fatReadDirNext(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir,
+micronDirent *out, uint32_t timeout) {
+    /** Read the next entry from a directory.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param dir The directory, from fatOpenDir().
+     *  @param out Receives the entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT at the end of the directory, or
+     *   negative error code on failure.
+     *  @note Deleted entries are skipped. Volume labels, "." and ".." are
+     *   returned like any other entry. `dir->shortName` receives the entry's
+     *   8.3 name, and `out->name` receives its long name if it has a valid
+     *   one, or the 8.3 name if not.
+     */
+    while(1) {
+        const fat32_dirent *ent;
+        int err = fatReadDirRaw(blkdev, mbr, dir, &ent, timeout);
+        if(err) return err;
+
+        uint8_t first = (uint8_t)ent->shortName[0];
+        if(first == 0x00) { //end of directory
+            dir->end = true;
+            return -ENOENT;
+        }
+        if(first == 0xE5) { //deleted entry
+            dir->lfnSeq = 0;
+            continue;
+        }
+        if(ent->attributes == 0x0F) { //long file name entry
+            _addLfn(dir, (const vfat_lfn*)ent);
+            continue;
+        }
+
+        //this is a regular entry.
+        //XXX decode date/time fields
+        _formatShortName(ent, dir->shortName);
+        out->attributes = ent->attributes | (ent->extAttributes << 8);
+        out->cluster    = ent->startClusterLo | (ent->startClusterHi << 16);
+        out->size       = ent->size;
+        out->createTime = 0;
+        out->accessTime = 0;
+        out->modifyTime = 0;
+        out->entryPos   = (dir->entSector * FAT_SECTOR_SIZE) + dir->entOffset;
+
+        if(dir->lfnSeq == 1 && dir->lfnChecksum ==
+        fatShortNameChecksum(ent->shortName)) {
+            _lfnToUtf8(dir->lfn, dir->lfnLength, out->name, sizeof(out->name));
+        }
+        else {
+            dir->lfnCount = 0;
+            strncpy(out->name, dir->shortName, sizeof(out->name));
+        }
+        dir->entLfnCount = dir->lfnCount;
+        dir->lfnSeq = 0;
+        return 0;
+    }
+}
@@ -0,0 +1,201 @@
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+int fatOpenFile(const micronDirent *dirent, MicronFatFile *out,
+uint16_t maxExtents) {
+    /** Prepare to access a file.
+     *  @param dirent The file's directory entry.
+     *  @param out Receives the file state.
+     *  @param maxExtents Maximum number of extents to remember. Each one
+     *   costs 8 bytes of memory. If the file is more fragmented than this,
+     *   access beyond the last extent is slower. Can be zero, in which case
+     *   only the position of the most recent access is remembered.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This doesn't read anything from the disk; the cluster map is
+     *   filled in as the file is accessed. Call fatCloseFile() when done.
+     */
+    memset(out, 0, sizeof(MicronFatFile));
+    out->firstCluster = dirent->cluster;
+    out->size         = dirent->size;
+    out->entryPos     = dirent->entryPos;
+    out->complete     = out->firstCluster < 2; //empty file has no chain
+    if(maxExtents) {
+        out->extents = (MicronFatExtent*)malloc(
+            maxExtents * sizeof(MicronFatExtent));
+        if(!out->extents) return -ENOMEM;
+        out->maxExtents = maxExtents;
+    }
+    return 0;
+}
+
+
+void fatCloseFile(MicronFatFile *file) {
+    /** Free resources used by an open file.
+     *  @param file The file to close.
+     */
+    if(file->extents) free(file->extents);
+    file->extents    = NULL;
+    file->maxExtents = 0;
+    file->numExtents = 0;
+}
+
+
+static bool _lookupExtent(MicronFatFile *file, uint32_t idx,
+uint32_t *outCluster, uint32_t *outRun) {
+    //find the cluster at `idx` in the extents we already know about.
+    uint32_t base = 0;
+    for(int i=0; i<file->numExtents; i++) {
+        MicronFatExtent *ext = &file->extents[i];
+        if(idx < base + ext->length) {
+            *outCluster = ext->cluster + (idx - base);
+            *outRun     = ext->length  - (idx - base);
+            return true;
+        }
+        base += ext->length;
+    }
+    return false;
+}
+
+
+static bool _appendCluster(MicronFatFile *file, uint32_t cluster) {
+    //add the next cluster of the chain to the end of the map.
+    //returns false if the map is full.
+    if(file->numExtents) {
+        MicronFatExtent *ext = &file->extents[file->numExtents - 1];
+        if(cluster == ext->cluster + ext->length) {
+            ext->length++;
+            file->numClusters++;
+            return true;
+        }
+    }
+    if(file->numExtents >= file->maxExtents) return false;
+    file->extents[file->numExtents].cluster = cluster;
+    file->extents[file->numExtents].length  = 1;
+    file->numExtents++;
+    file->numClusters++;
+    return true;
+}
+
+
+int fatMapCluster(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t idx, uint32_t *outCluster, uint32_t *outRun, uint32_t timeout) {
+    /** Find which cluster holds part of a file.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param file The file to look up.
+     *  @param idx Which cluster of the file (ie offset / cluster size).
+     *  @param outCluster Receives the cluster number.
+     *  @param outRun Receives the number of clusters, starting at this one,
+     *   which are known to be contiguous. Always at least 1.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ERANGE if the chain ends before `idx`, or
+     *   another negative error code on failure.
+     *  @note The chain is only read as far as needed, and what's read is
+     *   remembered, so seeking within the mapped part of a file needs no
+     *   disk access at all.
+     */
+    if(_lookupExtent(file, idx, outCluster, outRun)) return 0;
+    if(file->complete || file->firstCluster < 2) return -ERANGE;
+
+    //walk the chain from the furthest point we know of.
+    uint32_t curIdx, cur;
+    bool mapping = true; //whether we're still adding to the map
+    if(file->numExtents) {
+        MicronFatExtent *ext = &file->extents[file->numExtents - 1];
+        curIdx = file->numClusters - 1;
+        cur    = ext->cluster + ext->length - 1;
+    }
+    else {
+        curIdx = 0;
+        cur    = file->firstCluster;
+        mapping = _appendCluster(file, cur);
+    }
+
+    //if the map is full, we'll still keep adding to it as long as the
+    //chain is contiguous, since that just extends the last extent.
+    if(file->cursorCluster && file->cursorIdx <= idx &&
+    file->cursorIdx > curIdx) {
+        //we've been past the end of the map before, and that's
+        //closer to where we're going.
+        curIdx  = file->cursorIdx;
+        cur     = file->cursorCluster;
+        mapping = false;
+    }
+
+    while(curIdx < idx) {
+        int next = fatGetNextCluster(blkdev, mbr, cur, timeout);
+        if(next < 0) return next;
+        if(next == 0) { //end of chain
+            if(mapping) file->complete = true;
+            return -ERANGE;
+        }
+        curIdx++;
+        cur = next;
+        if(mapping) mapping = _appendCluster(file, cur);
+    }
+
+    if(!mapping) { //remember where we got to
+        file->cursorIdx     = curIdx;
+        file->cursorCluster = cur;
+    }
+    *outCluster = cur;
+    *outRun     = 1; //it's the last one we know of
+    return 0;
+}
+
+
+int fatMapFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t timeout) {
+    /** Map a file's entire cluster chain now, rather than as it's accessed.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param file The file to map.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of extents the file has, or -E2BIG if there are more
+     *   than fit in the map (which still works, but accesses beyond the
+     *   last extent need to read the FAT), or -EIO if the chain is shorter
+     *   than the file, or another negative error code on failure.
+     *  @note Afterward, reading and overwriting the file within the mapped
+     *   extents needs no FAT access at all.
+     */
+    uint32_t clusterSize = mbr->sectorsPerCluster * FAT_SECTOR_SIZE;
+    uint32_t numClusters = (file->size + clusterSize - 1) / clusterSize;
+    if(!numClusters) return 0;
+
+    uint32_t cluster, run;
+    int err = fatMapCluster(blkdev, mbr, file, numClusters - 1, &cluster,
+        &run, timeout);
+    if(err == -ERANGE) return -EIO;
+    if(err < 0) return err;
+    if(file->numClusters < numClusters) return -E2BIG;
+    return file->numExtents;
+}
+
+
+void fatMapAppend(MicronFatFile *file, uint32_t cluster) {
+    /** Record that a cluster was added to the end of a file.
+     *  @param file The file.
+     *  @param cluster The new cluster.
+     *  @note This keeps a complete map complete, so that writing to a file
+     *   doesn't make it slower to read.
+     */
+    if(file->complete) {
+        if(!_appendCluster(file, cluster)) file->complete = false;
+    }
+}
+
+
+void fatMapReset(MicronFatFile *file) {
+    /** Forget a file's cluster map.
+     *  @param file The file.
+     *  @note Call this when a file's cluster chain is shortened, after
+     *   updating `file->firstCluster`.
+     */
+    file->numExtents    = 0;
+    file->numClusters   = 0;
+    file->complete      = file->firstCluster < 2; //empty file
+    file->cursorIdx     = 0;
+    file->cursorCluster = 0;
+}
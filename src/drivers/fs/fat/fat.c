@@ -16,7 +16,47 @@ uint8_t *second) {
     *hour   =  time >> 11;
 }
 
-int _readSector(FILE *blkdev, uint64_t sector, void *out) {
+void fatEncodeDateTime(uint32_t secs, uint16_t *date, uint16_t *time) {
+    /** Convert a UNIX timestamp to FAT date and time fields.
+     *  @param secs Seconds since 1970-01-01 00:00:00.
+     *  @param date Receives the date.
+     *  @param time Receives the time of day.
+     *  @note Times before 1980 (which FAT can't represent) become
+     *   1980-01-01 00:00:00.
+     */
+    if(secs < 315532800UL) secs = 315532800UL; //1980-01-01
+    uint32_t days = secs / 86400, rem = secs % 86400;
+    *time = ((rem / 3600) << 11) | (((rem / 60) % 60) << 5) | ((rem % 60) / 2);
+
+    //convert days since epoch to a civil date.
+    //see http://howardhinnant.github.io/date_algorithms.html
+    uint32_t z   = days + 719468;
+    uint32_t era = z / 146097;
+    uint32_t doe = z - (era * 146097);
+    uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+    uint32_t mp  = (5*doy + 2) / 153;
+    uint32_t day = doy - (153*mp + 2)/5 + 1;
+    uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    uint32_t year  = yoe + (era * 400) + (month <= 2 ? 1 : 0);
+    *date = ((year - 1980) << 9) | (month << 5) | day;
+}
+
+static int _fatCheckCount(int result, uint32_t expected) {
+    //a device that moves fewer bytes than asked hasn't failed as far as
+    //read()/write() are concerned, but the rest of the buffer would be
+    //stale, so treat it as an error.
+    if(result >= 0 && (uint32_t)result != expected) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: short transfer: %d of %lu bytes\r\n", result,
+                (unsigned long)expected);
+        #endif
+        return -EIO;
+    }
+    return result;
+}
+
+int _fatReadSector(FILE *blkdev, uint64_t sector, void *out) {
     int err = fseek(blkdev, sector * FAT_SECTOR_SIZE, SEEK_SET);
     if(err < 0) {
         #if FAT_DEBUG_PRINT
@@ -24,11 +64,51 @@ int _readSector(FILE *blkdev, uint64_t sector, void *out) {
         #endif
         return err;
     }
-    return read(blkdev, out, FAT_SECTOR_SIZE);
+    return _fatCheckCount(read(blkdev, out, FAT_SECTOR_SIZE),
+        FAT_SECTOR_SIZE);
+}
+
+int _fatWriteSector(FILE *blkdev, uint64_t sector, const void *data) {
+    int err = fseek(blkdev, sector * FAT_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: seek to sector 0x%llX failed: %d\r\n", sector, err);
+        #endif
+        return err;
+    }
+    return _fatCheckCount(write(blkdev, data, FAT_SECTOR_SIZE),
+        FAT_SECTOR_SIZE);
+}
+
+int _fatReadSectors(FILE *blkdev, uint64_t sector, uint32_t count,
+void *out) {
+    //read several consecutive sectors in one request.
+    int err = fseek(blkdev, sector * FAT_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) return err;
+    return _fatCheckCount(read(blkdev, out, count * FAT_SECTOR_SIZE),
+        count * FAT_SECTOR_SIZE);
+}
+
+int _fatWriteSectors(FILE *blkdev, uint64_t sector, uint32_t count,
+const void *data) {
+    //write several consecutive sectors in one request.
+    int err = fseek(blkdev, sector * FAT_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) return err;
+    return _fatCheckCount(write(blkdev, data, count * FAT_SECTOR_SIZE),
+        count * FAT_SECTOR_SIZE);
+}
+
+int _fatDiscardSectors(FILE *blkdev, uint64_t sector, uint32_t count) {
+    //tell the device some sectors aren't needed. that's only a hint, so
+    //it's fine if the device doesn't support it.
+    int err = fseek(blkdev, sector * FAT_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) return err;
+    err = discard(blkdev, (size_t)count * FAT_SECTOR_SIZE);
+    return (err == -ENOSYS) ? 0 : err;
 }
 
 int fatGetMBR(FILE *blkdev, uint64_t sector, fat32_mbr *out, uint32_t timeout) {
-    int err = _readSector(blkdev, sector, out);
+    int err = _fatReadSector(blkdev, sector, out);
     if(err < 0) return err;
 
     if(out->mbrSig != 0xAA55) {
@@ -39,6 +119,9 @@ int fatGetMBR(FILE *blkdev, uint64_t sector, fat32_mbr *out, uint32_t timeout) {
         return -EILSEQ;
     }
     out->_micron_startSector = sector;
+    out->_micron_fatCache    = NULL;
+    out->_micron_dentryCache = NULL;
+    out->_micron_alloc       = NULL;
 
     #if FAT_DEBUG_PRINT
         char oemName[16], volName[16], fatName[16];
@@ -81,9 +164,66 @@ int fatGetMBR(FILE *blkdev, uint64_t sector, fat32_mbr *out, uint32_t timeout) {
 }
 
 
+int fatMount(FILE *blkdev, uint64_t sector, fat32_mbr *out,
+uint16_t cacheSize, uint32_t timeout) {
+    /** Prepare to access a FAT filesystem.
+     *  @param blkdev Block device to read from.
+     *  @param sector Which sector the filesystem begins at.
+     *  @param out Receives the filesystem's MBR and our state.
+     *  @param cacheSize How many sectors of the FAT to cache.
+     *   FAT_DEFAULT_CACHE_SIZE is a reasonable choice.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This reads the entire FAT to find which clusters are free, so
+     *   it can take a while on large volumes, unless FAT_SCAN_AT_MOUNT is 0
+     *   (see fatScanStep()). Call fatUnmount() when done.
+     */
+    int err = fatGetMBR(blkdev, sector, out, timeout);
+    if(err) return err;
+
+    if(out->bytesPerSector != FAT_SECTOR_SIZE || out->sectorsPerFat != 0
+    || out->sectorsPerFat32 == 0 || out->sectorsPerCluster == 0) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: not a supported FAT32 filesystem\r\n");
+        #endif
+        return -ENOSYS;
+    }
+
+    out->_micron_viewCache = NULL; //see fatViewCacheInit()
+    err = fatCacheInit(out, cacheSize);
+    if(err) return err;
+
+    err = fatDentryCacheInit(out, FAT_DEFAULT_DENTRY_CACHE_SIZE);
+    if(!err) err = fatAllocInit(blkdev, out, timeout);
+    if(err) {
+        fatDentryCacheFree(out);
+        fatCacheFree(blkdev, out, timeout);
+    }
+    return err;
+}
+
+
+int fatUnmount(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Finish accessing a FAT filesystem.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Any pending changes are written, and memory used by the
+     *   filesystem state is freed.
+     */
+    int err = fatSync(blkdev, mbr, timeout);
+    fatAllocFree(mbr);
+    fatViewCacheFree(mbr);
+    fatDentryCacheFree(mbr);
+    int err2 = fatCacheFree(blkdev, mbr, timeout);
+    return err ? err : err2;
+}
+
+
 int fatGetFsInfo(FILE *blkdev, fat32_mbr *mbr, fat32_fsinfo *out,
 uint32_t timeout) {
-    int err = _readSector(blkdev,
+    int err = _fatReadSector(blkdev,
         mbr->fsInfoSector + mbr->_micron_startSector, out);
     if(err < 0) {
         #if FAT_DEBUG_PRINT
@@ -114,15 +254,27 @@ uint32_t timeout) {
 
 
 int fatGetNextCluster(FILE *blkdev, fat32_mbr *mbr, int cluster, uint32_t timeout) {
-    uint64_t mapSector = mbr->_micron_startSector + mbr->reservedSectors +
-        ((cluster * 4) / FAT_SECTOR_SIZE);
-    uint32_t map[FAT_SECTOR_SIZE / 4];
+    uint32_t mapSector = (cluster * 4) / FAT_SECTOR_SIZE; //within the FAT
+    int idx = cluster % (FAT_SECTOR_SIZE / 4);
+    uint32_t *map;
 
-    #if FAT_DEBUG_PRINT
-        printf("Read cluster map item %d from 0x%08llX: start=0x%08llX rsvd=0x%08X\r\n",
-            cluster, mapSector, mbr->_micron_startSector, mbr->reservedSectors);
-    #endif
-    int err = _readSector(blkdev, mapSector, map);
+    //use the cache if we have one.
+    uint8_t *cached;
+    uint32_t buf[FAT_SECTOR_SIZE / 4];
+    int err = fatCacheGetSector(blkdev, mbr, mapSector, &cached, timeout);
+    if(err == -ENOSYS) {
+        #if FAT_DEBUG_PRINT
+            printf("Read cluster map item %d from 0x%08lX: start=0x%08llX rsvd=0x%08X\r\n",
+                cluster, mapSector, mbr->_micron_startSector, mbr->reservedSectors);
+        #endif
+        //if mirroring is off, bits 0-3 of flags tell which FAT is in use.
+        uint32_t active = (mbr->flags & 0x80) ? (mbr->flags & 0x0F) : 0;
+        err = _fatReadSector(blkdev, mbr->_micron_startSector +
+            mbr->reservedSectors + ((uint64_t)active * mbr->sectorsPerFat32) +
+            mapSector, buf);
+        map = buf;
+    }
+    else map = (uint32_t*)cached;
     if(err < 0) {
         #if FAT_DEBUG_PRINT
             printf("FAT: Read cluster map sector failed: %d\r\n", err);
@@ -130,20 +282,8 @@ int fatGetNextCluster(FILE *blkdev, fat32_mbr *mbr, int cluster, uint32_t timeou
         return err;
     }
 
-
-    #if FAT_DEBUG_PRINT
-        printf("FAT: Cluster map at sector %d:\r\n", cluster);
-        for(int i=0; i<FAT_SECTOR_SIZE/4; i += 4) {
-            for(int j=0; j<4; j++) {
-                printf("%08X ", map[i+j]);
-            }
-            printf("\r\n");
-        }
-    #endif
-
-    int idx = cluster % (FAT_SECTOR_SIZE / 4);
     int r = map[idx] & 0x0FFFFFFF;
-    #if FAT_DEBUG_PRINT
+    #if 0 && FAT_DEBUG_PRINT
         printf("cluster[%d]: %08lX -> %08X\r\n", idx, map[idx], r);
     #endif
     if(r < 2 || r >= 0x0FFFFFF0) return 0;
@@ -161,6 +301,20 @@ int fatGetNextCluster(FILE *blkdev, fat32_mbr *mbr, int cluster, uint32_t timeou
 }
 
 
+uint64_t fatClusterToSector(fat32_mbr *mbr, uint32_t cluster) {
+    /** Find where a cluster is on the disk.
+     *  @param mbr The filesystem's MBR.
+     *  @param cluster The cluster number.
+     *  @return The absolute sector number of the cluster's first sector.
+     *  @note Clusters are numbered from 2; the data area follows the
+     *   reserved sectors and every copy of the FAT.
+     */
+    return mbr->_micron_startSector + mbr->reservedSectors +
+        ((uint64_t)mbr->numFats * mbr->sectorsPerFat32) +
+        ((uint64_t)(cluster - 2) * mbr->sectorsPerCluster);
+}
+
+
 int fatGetDirEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t idx,
 fat32_dirent *out, uint32_t timeout) {
     uint64_t dataSector = mbr->_micron_startSector + mbr->reservedSectors +
@@ -169,7 +323,7 @@ fat32_dirent *out, uint32_t timeout) {
 
     //read the entry
     uint8_t buffer[FAT_SECTOR_SIZE];
-    int err = _readSector(blkdev, dataSector, buffer);
+    int err = _fatReadSector(blkdev, dataSector, buffer);
     if(err < 0) return err;
 
     uint32_t bPos = (idx * sizeof(fat32_dirent)) % FAT_SECTOR_SIZE;
@@ -223,104 +377,95 @@ fat32_dirent *out, uint32_t timeout) {
 
 int fatReadDir(FILE *blkdev, fat32_mbr *mbr, int idx, micronDirent *out,
 uint32_t timeout) {
-    int err;
-    fat32_dirent dir;
-    //uint16_t year;
-    //uint8_t month, day, hour, minute, second;
-    char longName[2048];
-    longName[0] = '\0';
-
-    //really, a directory is just a file with the DIRECTORY attribute,
-    //whose contents are `fat32_dirent`s.
-    while(1) {
-        err = fatGetDirEntry(blkdev, mbr, idx++, &dir, timeout);
-        if(err) return err;
-        if(dir.shortName[0] == 0) return -ENOENT;
-        if(dir.shortName[0] == 0xE5) {
-            //deleted entry. XXX what do?
-            continue;
-        }
-        if(dir.attributes == 0x0F) {
-            //This is a long file name entry
-            vfat_lfn *lfn = (vfat_lfn*)&dir;
-            int seq = (lfn->seq & 0x1F) - 1;
-            char *name = &longName[seq*13];
-            //XXX UTF-8/UCS-2?
-            for(int i=0; i<5; i++) name[i   ] = lfn->name0[i] & 0xFF;
-            for(int i=0; i<6; i++) name[i+5 ] = lfn->name1[i] & 0xFF;
-            for(int i=0; i<2; i++) name[i+11] = lfn->name2[i] & 0xFF;
-            continue;
-        }
-        break;
-    }
-
-    //XXX decode date/time fields
-    out->attributes = dir.attributes | (dir.extAttributes << 8);
-    out->cluster    = dir.startClusterLo | (dir.startClusterHi << 16);
-    out->size       = dir.size;
-
-    if(longName[0] == '\0') {
-        char shortName[16], shortExt[4];
-        memset(shortName, 0, sizeof(shortName));
-        memset(shortExt,  0, sizeof(shortExt));
-        strncpy(shortName, dir.shortName,  8);
-        strncpy(shortExt,  dir.shortExt,   3);
-        snprintf(out->name, sizeof(out->name), "%-8s.%-3s",
-            shortName, shortExt);
-    }
-    else strncpy(out->name, longName, sizeof(out->name));
-    return idx;
+    /** Read one entry from the root directory.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param idx Index of entry to start searching at.
+     *  @param out Receives the entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Index to pass to get the next entry, -ENOENT at the end of
+     *   the directory, or other negative error code on failure.
+     *  @note This has to find its place in the directory again each time.
+     *   To list a whole directory, fatOpenDir() and fatReadDirNext() are
+     *   much faster.
+     */
+    MicronFatDir dir;
+    int err = fatOpenDir(mbr, 0, &dir);
+    if(err) return err;
+    err = fatSeekDir(blkdev, mbr, &dir, idx, timeout);
+    if(err) return err;
+    err = fatReadDirNext(blkdev, mbr, &dir, out, timeout);
+    if(err) return err;
+    return dir.index;
 }
 
 
-int fatReadFile(FILE *blkdev, fat32_mbr *mbr, micronDirent *file,
+int fatReadFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
 uint32_t offset, uint32_t size, void *out, uint32_t timeout) {
-    int err;
+    /** Read from a file.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param file The file to read, from fatOpenFile().
+     *  @param offset Byte offset to read from.
+     *  @param size Number of bytes to read.
+     *  @param out Destination buffer.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes read, which is less than `size` if the end
+     *   of the file is reached, or negative error code on failure.
+     *  @note Whole sectors are read directly into `out`, as many at once as
+     *   are contiguous on the disk, even across clusters. Only a partial
+     *   sector at the start or end goes through a temporary buffer.
+     */
     uint8_t  *dest = (uint8_t*)out;
-    uint64_t start = mbr->_micron_startSector;
-    uint32_t clusterSize = mbr->sectorsPerCluster * mbr->bytesPerSector;
-    uint32_t clusterIdx  = offset / clusterSize;
-    uint64_t dataSector  = start + (mbr->numFats * mbr->sectorsPerFat32);
-
-    //Read the cluster map for the first cluster.
-    //XXX cache this stuff
-    uint32_t map[FAT_SECTOR_SIZE / 4];
-    uint64_t prevSector = 0;
-    int cluster = file->cluster;
-    for(uint32_t i=0; i<clusterIdx; i++) {
-        uint64_t mapSector = start + mbr->reservedSectors +
-            ((cluster * 4) / FAT_SECTOR_SIZE);
-
-        if(mapSector != prevSector) {
-            err = _readSector(blkdev, mapSector, map);
-            if(err < 0) return err;
-        }
-        prevSector = mapSector;
+    uint32_t spc = mbr->sectorsPerCluster;
+    uint32_t clusterSize = spc * FAT_SECTOR_SIZE;
+    if(offset >= file->size) return 0;
+    size = MIN(size, file->size - offset);
 
-        int idx = cluster % (FAT_SECTOR_SIZE / 4);
-        int r = map[idx] & 0x0FFFFFFF;
-        if(r < 2 || r >= 0x0FFFFFF0) return -ERANGE;
-        cluster = r;
-    }
-
-    //read data
     uint32_t destOffs = 0;
-    while(size > 0) {
-        //read that cluster
-        uint8_t buffer[FAT_SECTOR_SIZE];
-        uint64_t sector = ((cluster * clusterSize) / FAT_SECTOR_SIZE) + dataSector;
-        //printf("Read cluster %d => sector 0x%08llX\r\n", cluster, sector);
-        err = _readSector(blkdev, sector, buffer);
+    while(destOffs < size) {
+        uint32_t pos = offset + destOffs;
+        uint32_t remain = size - destOffs;
+        uint32_t idx = pos / clusterSize;
+        uint32_t cluster, run;
+        int err = fatMapCluster(blkdev, mbr, file, idx, &cluster, &run,
+            timeout);
+        if(err == -ERANGE) break; //chain is shorter than file size
         if(err < 0) return err;
-        memcpy((void*)&dest[destOffs], buffer, MIN(size, (size_t)FAT_SECTOR_SIZE));
-        destOffs += MIN(size, (size_t)FAT_SECTOR_SIZE);
 
-        if(size > FAT_SECTOR_SIZE) size -= FAT_SECTOR_SIZE;
-        else break;
+        uint32_t secInCluster = (pos % clusterSize) / FAT_SECTOR_SIZE;
+        uint64_t sector = fatClusterToSector(mbr, cluster) + secInCluster;
+        uint32_t part = pos % FAT_SECTOR_SIZE;
+
+        if(part || remain < FAT_SECTOR_SIZE) {
+            //partial sector; read it into a buffer and copy what we need.
+            uint32_t len = MIN(remain, FAT_SECTOR_SIZE - part);
+            uint8_t buffer[FAT_SECTOR_SIZE];
+            err = _fatReadSector(blkdev, sector, buffer);
+            if(err < 0) return err;
+            memcpy(&dest[destOffs], &buffer[part], len);
+            destOffs += len;
+            continue;
+        }
 
-        cluster = fatGetNextCluster(blkdev, mbr, cluster, timeout);
-        if(cluster <  0) return cluster;
-        if(cluster == 0) break;
+        //see how many of the following clusters are contiguous with this
+        //one, until we have enough to cover the rest of the read.
+        uint32_t want = remain / FAT_SECTOR_SIZE; //whole sectors needed
+        while((run * spc) - secInCluster < want) {
+            uint32_t next, nextRun;
+            err = fatMapCluster(blkdev, mbr, file, idx + run, &next,
+                &nextRun, timeout);
+            if(err == -ERANGE) break;
+            if(err < 0) return err;
+            if(next != cluster + run) break; //fragmented here
+            run += nextRun;
+        }
+
+        //read all of them straight into the destination.
+        uint32_t count = MIN(want, (run * spc) - secInCluster);
+        err = _fatReadSectors(blkdev, sector, count, &dest[destOffs]);
+        if(err < 0) return err;
+        destOffs += count * FAT_SECTOR_SIZE;
     }
 
     return destOffs;
@@ -343,16 +488,18 @@ int fatGetInfo(FILE *blkdev, uint64_t sector, uint32_t timeout) {
     if(err) return err;
 
     //read root dir
-    int idx = 0;
+    MicronFatDir rootDir;
+    err = fatOpenDir(&mbr, 0, &rootDir);
+    if(err) return err;
 
     //printf("FileName.Ext Attribs  Ex  FileSize Created                Accessed   Modified            1stCluster LongName\r\n");
-    printf("Attribs      FileSize 1stCluster NextClustr Name\r\n");
+    printf("Attribs      FileSize 1stCluster Index      Name\r\n");
     while(1) {
         micronDirent dir;
-        err = fatReadDir(blkdev, &mbr, idx, &dir, timeout);
+        err = fatReadDirNext(blkdev, &mbr, &rootDir, &dir, timeout);
         if(err == -ENOENT) break;
         else if(err < 0) return err;
-        else idx = err; //returns next index
+        int idx = rootDir.entIndex;
 
         printf("%c%c%c%c%c%c%c%c %12llu 0x%08llX 0x%08X ",
             (dir.attributes & FAT_ATTR_READONLY)     ? 'R' : '-',
@@ -364,6 +511,7 @@ int fatGetInfo(FILE *blkdev, uint64_t sector, uint32_t timeout) {
             (dir.attributes & FAT_ATTR_DEVICE)       ? 'V' : '-',
             (dir.attributes & 0x80)                  ? 'X' : '-',
             dir.size, dir.cluster, idx);
+        //name is UTF-8, so show non-ASCII bytes escaped
         for(int i=0; dir.name[i]; i++) {
             char c = dir.name[i];
             if(c >= 0x20 && c <= 0x7E) putc(c, stdout);
@@ -391,7 +539,10 @@ int fatGetInfo(FILE *blkdev, uint64_t sector, uint32_t timeout) {
         */
 
         /* uint8_t buffer[512];
-        int r = fatReadFile(blkdev, &mbr, &dir, 0, 512, buffer, timeout);
+        MicronFatFile file;
+        fatOpenFile(&dir, &file, FAT_DEFAULT_MAX_EXTENTS);
+        int r = fatReadFile(blkdev, &mbr, &file, 0, 512, buffer, timeout);
+        fatCloseFile(&file);
         printf("read: %d: ", r);
         for(int i=0; i<16; i++) {
             char c = buffer[i];
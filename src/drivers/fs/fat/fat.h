@@ -1,7 +1,9 @@
 #ifndef _MICRON_DRIVERS_FS_FAT_H_
 #define _MICRON_DRIVERS_FS_FAT_H_
 
+#ifndef FAT_DEBUG_PRINT
 #define FAT_DEBUG_PRINT 1
+#endif
 
 #ifdef __cplusplus
 	extern "C" {
@@ -9,6 +11,68 @@
 
 #define FAT_SECTOR_SIZE 512 //independent of block device's sector size
 
+//default number of FAT sectors to cache, used by fatMount() if not
+//otherwise specified. each one holds 128 cluster entries.
+#ifndef FAT_DEFAULT_CACHE_SIZE
+#define FAT_DEFAULT_CACHE_SIZE 4
+#endif
+
+//default number of extents kept in each open file's cluster map.
+//each one costs 8 bytes, and covers any number of contiguous clusters,
+//so an unfragmented file only ever needs one.
+#ifndef FAT_DEFAULT_MAX_EXTENTS
+#define FAT_DEFAULT_MAX_EXTENTS 16
+#endif
+
+//default number of path components remembered by the dentry cache,
+//used by fatMount(). each one costs about 100 bytes.
+#ifndef FAT_DEFAULT_DENTRY_CACHE_SIZE
+#define FAT_DEFAULT_DENTRY_CACHE_SIZE 16
+#endif
+
+//whether fatMount() reads the whole FAT to find free clusters before
+//returning. if 0, it returns right away, and fatScanStep() should be called
+//when idle to do it in the background; until that finishes, allocation is
+//slower and the free space is only FSInfo's estimate.
+#ifndef FAT_SCAN_AT_MOUNT
+#define FAT_SCAN_AT_MOUNT 1
+#endif
+
+//how many levels of subdirectories fatAnalyzeStep() descends into.
+//each one costs 8 bytes of MicronFatAnalysis.
+#ifndef FAT_ANALYZE_MAX_DEPTH
+#define FAT_ANALYZE_MAX_DEPTH 16
+#endif
+
+//number of buckets in the free run histogram. bucket i counts runs of
+//2^i to 2^(i+1)-1 clusters; the last one also counts anything longer.
+#define FAT_ANALYZE_HIST_BUCKETS 24
+
+//largest block that fatViewCacheInit() will use, in sectors. blocks are
+//never bigger than a cluster, since a cluster's sectors are contiguous.
+//at most 64, since MicronBlockCache blocks are limited to 64K.
+#ifndef FAT_VIEW_MAX_BLOCK_SECTORS
+#define FAT_VIEW_MAX_BLOCK_SECTORS 8
+#endif
+
+//whether fatFreeChain() tells the block device that the clusters it frees
+//aren't needed (see discard()), so that eg an SD card can erase them ahead
+//of time and write them faster later.
+#ifndef FAT_DISCARD_FREED
+#define FAT_DISCARD_FREED 1
+#endif
+
+//most sectors discarded at once, so the length fits in a size_t.
+#define FAT_DISCARD_MAX_SECTORS 0x400000
+
+//names longer than this (in bytes of UTF-8) aren't kept in the dentry cache.
+#define FAT_DENTRY_MAX_NAME 63
+
+struct MicronFatCache; //declare
+struct MicronFatDentryCache; //declare
+struct MicronFatAlloc; //declare
+struct MicronFatViewCache; //declare
+
 typedef struct PACKED {
     uint8_t  jumpCode[3];
     char     oemName[8];
@@ -38,8 +102,13 @@ typedef struct PACKED {
     char     fatName[8];
     union PACKED {
         uint8_t  bootCode[420]; //executable code for DOS
-        uint64_t _micron_startSector; //we'll use this to store the sector
-            //that the MBR is at
+        struct PACKED { //we'll use this space to store our own state
+            uint64_t _micron_startSector; //sector that the MBR is at
+            struct MicronFatCache *_micron_fatCache; //set by fatMount
+            struct MicronFatDentryCache *_micron_dentryCache; //set by fatMount
+            struct MicronFatAlloc *_micron_alloc; //set by fatMount
+            struct MicronFatViewCache *_micron_viewCache; //set by fatViewCacheInit
+        };
     };
     uint16_t mbrSig; //MBR signature: 0x55 0xAA
 } fat32_mbr;
@@ -113,17 +182,257 @@ typedef struct {
     uint32_t modifyTime; //UNIX timestamp
     uint64_t size; //file size in bytes
     uint64_t cluster; //FS-specific start cluster/file ID
+    uint64_t entryPos; //FS-specific location of directory entry (0 = none)
 } micronDirent;
 
+typedef struct {
+    uint32_t cluster; //first cluster of this run
+    uint32_t length;  //number of consecutive clusters in this run
+} MicronFatExtent;
+
+typedef struct {
+    uint32_t firstCluster; //file's first cluster, from its directory entry
+    uint32_t size;         //file size in bytes
+    uint64_t entryPos;     //location of directory entry, from micronDirent
+    //map of the cluster chain, built lazily as the file is accessed.
+    //contiguous runs of clusters are collapsed into one extent each.
+    MicronFatExtent *extents; //allocated by fatOpenFile
+    uint16_t maxExtents;   //capacity of `extents`
+    uint16_t numExtents;   //number of extents filled in
+    uint32_t numClusters;  //number of clusters covered by `extents`
+    bool     complete;     //whether `extents` covers the entire chain
+    //position of the last lookup past the end of a full map, so that
+    //sequential access beyond it doesn't rewalk the chain.
+    uint32_t cursorIdx;     //index of cluster within file
+    uint32_t cursorCluster; //cluster number (0 = not set)
+} MicronFatFile;
+
+#define FAT_LFN_MAX_ENTRIES 20 //max LFN entries per name (13 chars each)
+
+typedef struct {
+    uint32_t firstCluster; //directory's first cluster
+    uint32_t cluster;  //current cluster
+    uint32_t sector;   //current sector within cluster
+    uint32_t index;    //index of next entry within directory
+    uint16_t entry;    //index of next entry within sector
+    bool     loaded;   //whether `buffer` holds the current sector
+    bool     end;      //whether we reached the end
+    uint64_t bufSector; //which sector is in `buffer`
+    uint8_t  buffer[FAT_SECTOR_SIZE];
+    //long file name being assembled
+    uint16_t lfn[FAT_LFN_MAX_ENTRIES * 13]; //UTF-16
+    uint16_t lfnLength;  //number of chars
+    uint8_t  lfnSeq;     //last sequence number stored (0 = none)
+    uint8_t  lfnChecksum;
+    uint8_t  lfnCount;   //number of LFN entries stored
+    //information about the last entry returned
+    char     shortName[13]; //8.3 name, eg "FOO.TXT"
+    uint8_t  entLfnCount;   //number of LFN entries preceding it
+    uint32_t entIndex;      //index within directory
+    uint64_t entSector;     //sector it's in
+    uint16_t entOffset;     //byte offset within that sector
+} MicronFatDir;
+
+typedef struct MicronFatCache {
+    MicronBlockCache blocks; //keyed by sector within the FAT
+    uint32_t writebacks;     //number of dirty sectors written out
+} MicronFatCache;
+
+typedef struct {
+    uint32_t parent;     //first cluster of directory it's in (0 = unused)
+    uint32_t hash;       //hash of parent and name
+    uint16_t prev, next; //links in LRU list
+    uint16_t chain;      //next entry in the same hash bucket
+    uint32_t cluster;    //first cluster
+    uint32_t size;       //size in bytes
+    uint32_t attributes; //as in micronDirent
+    uint64_t entryPos;   //location of directory entry, as in micronDirent
+    char     name[FAT_DENTRY_MAX_NAME+1]; //name that was looked up
+} MicronFatDentry;
+
+typedef struct MicronFatDentryCache {
+    uint16_t size;       //number of entries
+    uint16_t numBuckets; //number of hash buckets (power of 2)
+    uint16_t head, tail; //most/least recently used entry
+    uint32_t hits, misses; //statistics
+    uint16_t *buckets;   //first entry in each bucket
+    MicronFatDentry *entries;
+} MicronFatDentryCache;
+
+typedef struct MicronFatViewCache {
+    MicronBlockCache blocks; //keyed by first sector of block
+    uint16_t blockSectors;   //sectors per block
+} MicronFatViewCache;
+
+typedef struct {
+    const uint8_t *data; //the file's data, in the cache
+    uint32_t size;       //number of bytes at `data`
+    uint16_t block;      //which cache entry it's in
+} MicronFatView;
+
+#define FAT_CLUSTER_FREE 0x00000000 //FAT entry for an unused cluster
+#define FAT_CLUSTER_BAD  0x0FFFFFF7 //FAT entry for a bad cluster
+#define FAT_CLUSTER_EOC  0x0FFFFFFF //FAT entry for end of chain
+
+typedef struct MicronFatAlloc {
+    uint32_t numClusters; //number of data clusters (numbered from 2)
+    uint32_t numFree;     //number of free clusters (0xFFFFFFFF = unknown)
+    uint32_t nextFree;    //where to start looking for a free cluster
+    //one bit per cluster, set if it's in use. if there wasn't enough
+    //memory for this, it's NULL, and allocation searches the FAT instead.
+    uint32_t *bitmap;
+    bool     fsInfoDirty; //whether numFree/nextFree need to be written
+    //progress of the free cluster scan (see fatScanStep()). clusters below
+    //scanCluster have been scanned; it's numClusters + 2 when done.
+    uint32_t scanCluster;
+    uint32_t scanFree;    //free clusters found below scanCluster
+} MicronFatAlloc;
+
+//called by fatAnalyzeStep() for each file, once its extents are counted.
+//`depth` is 0 for files in the root directory.
+typedef void (*MicronFatAnalyzeCallback)(const micronDirent *dirent,
+    const MicronFatDir *dir, uint32_t depth, uint32_t extents, void *param);
+
+typedef enum {
+    FAT_ANALYZE_FREE, //scanning the FAT for free runs
+    FAT_ANALYZE_TREE, //walking the directory tree
+    FAT_ANALYZE_DONE,
+} MicronFatAnalyzePhase;
+
+typedef struct {
+    //free space
+    uint32_t freeClusters;   //number of free clusters
+    uint32_t numFreeRuns;    //number of runs of contiguous free clusters
+    uint32_t largestFree;    //length of the longest run, in clusters
+    uint32_t largestFreeAt;  //its first cluster
+    uint32_t freeHist[FAT_ANALYZE_HIST_BUCKETS]; //runs by length
+    //files
+    uint32_t numFiles;       //files found (not including directories)
+    uint32_t numDirs;        //directories found (not including the root)
+    uint32_t numFragmented;  //files in more than one extent
+    uint32_t numEmpty;       //files with no clusters
+    uint32_t numSkipped;     //directories deeper than FAT_ANALYZE_MAX_DEPTH
+    uint64_t fileClusters;   //clusters used by files
+    uint64_t fileExtents;    //extents used by files
+    uint32_t worstExtents;   //most extents in one file
+    uint32_t worstCluster;   //first cluster of that file
+    char     worstName[13];  //its 8.3 name
+    //scores, in thousandths. `fragmentation` is the fraction of
+    //cluster-to-cluster steps within files that aren't to the next
+    //cluster; `freeFragmentation` is the fraction of free space that isn't
+    //in the largest free run. 0 is perfectly contiguous.
+    uint16_t fragmentation;
+    uint16_t freeFragmentation;
+
+    //progress (private)
+    MicronFatAnalyzePhase phase;
+    uint32_t cluster;        //next cluster to look at in the FAT
+    uint32_t runStart;       //first cluster of current free run (0 = none)
+    uint32_t depth;          //number of parent directories in `stack`
+    struct {
+        uint32_t cluster;    //first cluster of parent directory
+        uint32_t index;      //entry to resume at
+    } stack[FAT_ANALYZE_MAX_DEPTH];
+    uint32_t chainCluster;   //cluster reached in current file (0 = none)
+    uint32_t chainLength;    //clusters counted so far
+    uint32_t chainExtents;   //extents counted so far
+    MicronFatAnalyzeCallback callback;
+    void    *param;
+    MicronFatDir dir;        //directory being read
+    micronDirent dirent;     //file being counted
+} MicronFatAnalysis;
+
+//alloc.c
+int fatAllocInit(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+void fatAllocFree(fat32_mbr *mbr);
+int fatGetFatEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster, uint32_t *out, uint32_t timeout);
+int fatSetFatEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster, uint32_t value, uint32_t timeout);
+int fatAllocCluster(FILE *blkdev, fat32_mbr *mbr, uint32_t prev, uint32_t *out, uint32_t timeout);
+int fatFreeChain(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster, uint32_t timeout);
+int fatDiscardClusters(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster, uint32_t count, uint32_t timeout);
+int64_t fatDiscardFree(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+int fatSyncFsInfo(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+int64_t fatGetFreeSpace(fat32_mbr *mbr);
+int fatScanStep(FILE *blkdev, fat32_mbr *mbr, uint32_t budget, uint32_t timeout);
+int fatScanProgress(fat32_mbr *mbr);
+
+//cache.c
+int fatCacheInit(fat32_mbr *mbr, uint16_t size);
+int fatCacheFree(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+int fatCacheFlush(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+int fatCacheGetSector(FILE *blkdev, fat32_mbr *mbr, uint32_t sector, uint8_t **out, uint32_t timeout);
+int fatCacheMarkDirty(fat32_mbr *mbr, uint32_t sector);
+int fatWriteFatSector(FILE *blkdev, fat32_mbr *mbr, uint32_t sector, const void *data);
+
+//dir.c
+uint8_t fatShortNameChecksum(const char *name);
+int fatOpenDir(fat32_mbr *mbr, uint32_t cluster, MicronFatDir *out);
+void fatRewindDir(MicronFatDir *dir);
+int fatSeekDir(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir, uint32_t index, uint32_t timeout);
+int fatReadDirRaw(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir, const fat32_dirent **out, uint32_t timeout);
+int fatReadDirNext(FILE *blkdev, fat32_mbr *mbr, MicronFatDir *dir, micronDirent *out, uint32_t timeout);
+
+//fat.c
+int _fatReadSector(FILE *blkdev, uint64_t sector, void *out);
 void fatDecodeDate(uint16_t date, uint16_t *year, uint8_t *month, uint8_t *day);
 void fatDecodeTime(uint16_t time, uint8_t *hour, uint8_t *minute, uint8_t *second);
+int _fatWriteSector(FILE *blkdev, uint64_t sector, const void *data);
+int _fatReadSectors(FILE *blkdev, uint64_t sector, uint32_t count, void *out);
+int _fatWriteSectors(FILE *blkdev, uint64_t sector, uint32_t count, const void *data);
+int _fatDiscardSectors(FILE *blkdev, uint64_t sector, uint32_t count);
+void fatEncodeDateTime(uint32_t secs, uint16_t *date, uint16_t *time);
 int fatGetMBR(FILE *blkdev, uint64_t sector, fat32_mbr *out, uint32_t timeout);
+int fatMount(FILE *blkdev, uint64_t sector, fat32_mbr *out, uint16_t cacheSize, uint32_t timeout);
+int fatUnmount(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
 int fatGetFsInfo(FILE *blkdev, fat32_mbr *mbr, fat32_fsinfo *out, uint32_t timeout);
 int fatGetNextCluster(FILE *blkdev, fat32_mbr *mbr, int cluster, uint32_t timeout);
 int fatGetDirEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t idx, fat32_dirent *out, uint32_t timeout);
 int fatReadDir(FILE *blkdev, fat32_mbr *mbr, int idx, micronDirent *out, uint32_t timeout);
-int fatReadFile(FILE *blkdev, fat32_mbr *mbr, micronDirent *file, uint32_t offset, uint32_t size, void *out, uint32_t timeout);
+int fatReadFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t offset, uint32_t size, void *out, uint32_t timeout);
 int fatGetInfo(FILE *blkdev, uint64_t sector, uint32_t timeout);
+uint64_t fatClusterToSector(fat32_mbr *mbr, uint32_t cluster);
+
+//path.c
+int fatDentryCacheInit(fat32_mbr *mbr, uint16_t size);
+void fatDentryCacheFree(fat32_mbr *mbr);
+void fatDentryInvalidate(fat32_mbr *mbr, uint32_t parent, const char *name);
+void fatDentryInvalidateDir(fat32_mbr *mbr, uint32_t parent);
+void fatDentryInvalidateAll(fat32_mbr *mbr);
+void fatDentryInvalidateEntry(fat32_mbr *mbr, uint64_t entryPos);
+int fatLookup(FILE *blkdev, fat32_mbr *mbr, uint32_t parent, const char *name, size_t len, micronDirent *out, uint32_t timeout);
+int fatLookupPath(FILE *blkdev, fat32_mbr *mbr, const char *path, micronDirent *out, uint32_t timeout);
+int fatLookupParent(FILE *blkdev, fat32_mbr *mbr, const char *path, micronDirent *out, const char **outName, uint32_t timeout);
+int fatOpenPath(FILE *blkdev, fat32_mbr *mbr, const char *path, MicronFatFile *out, uint16_t maxExtents, uint32_t timeout);
+
+//extent.c
+int fatOpenFile(const micronDirent *dirent, MicronFatFile *out, uint16_t maxExtents);
+void fatCloseFile(MicronFatFile *file);
+int fatMapCluster(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t idx, uint32_t *outCluster, uint32_t *outRun, uint32_t timeout);
+int fatMapFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t timeout);
+void fatMapAppend(MicronFatFile *file, uint32_t cluster);
+void fatMapReset(MicronFatFile *file);
+
+//write.c
+int fatCreate(FILE *blkdev, fat32_mbr *mbr, const char *path, uint8_t attributes, MicronFatFile *out, uint16_t maxExtents, uint32_t timeout);
+int fatMkdir(FILE *blkdev, fat32_mbr *mbr, const char *path, uint32_t timeout);
+int fatDelete(FILE *blkdev, fat32_mbr *mbr, const char *path, uint32_t timeout);
+int fatWriteFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t offset, uint32_t size, const void *data, uint32_t timeout);
+int fatAppendFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, const void *data, uint32_t size, uint32_t timeout);
+int fatTruncateFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t size, uint32_t timeout);
+int fatSync(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout);
+
+//view.c
+int fatViewCacheInit(fat32_mbr *mbr, uint16_t size, uint16_t blockSectors);
+void fatViewCacheFree(fat32_mbr *mbr);
+int fatViewFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file, uint32_t offset, uint32_t size, MicronFatView *out, uint32_t timeout);
+void fatViewRelease(fat32_mbr *mbr, MicronFatView *view);
+void fatViewUpdate(fat32_mbr *mbr, uint64_t sector, uint32_t count, const void *data);
+
+//analyze.c
+void fatAnalyzeBegin(MicronFatAnalysis *out, MicronFatAnalyzeCallback callback, void *param);
+int fatAnalyzeStep(FILE *blkdev, fat32_mbr *mbr, MicronFatAnalysis *analysis, uint32_t budget, uint32_t timeout);
+
+#include "filecls.h"
 
 #ifdef __cplusplus
     } //extern "C"
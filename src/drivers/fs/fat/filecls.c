@@ -0,0 +1,247 @@
+//Access to FAT files through the generic file I/O API.
+//Each handle keeps its file's cluster map, so sequential access never
+//walks the chain from the start again, and an optional read-ahead buffer,
+//so that small reads (eg a line or a byte at a time) don't each have to
+//read a sector from the disk.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+int8_t fatFileClsIdx = -1;
+
+int fatFileCls_close(FILE *self) {
+    //if we wrote anything, make sure the FAT and FSInfo are on the disk
+    //too. the handle is freed even if that fails.
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    int err = h->written ? fatSync(h->blkdev, h->mbr, h->timeout) : 0;
+    fatCloseFile(&h->file);
+    if(h->raBuf) free(h->raBuf);
+    free(h);
+    free(self);
+    return err;
+}
+
+int fatFileCls_read(FILE *self, void *dest, size_t len) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    if(self->offset >= h->file.size) return -ENODATA; //end of file
+    uint32_t pos = self->offset;
+    len = MIN(len, h->file.size - pos);
+    if(!dest) { //just skip ahead
+        self->offset += len;
+        return len;
+    }
+
+    uint8_t *out = (uint8_t*)dest;
+    uint32_t done = 0;
+    while(done < len) {
+        uint32_t at = pos + done;
+        uint32_t remain = len - done;
+        if(h->raLen && at >= h->raStart && at < h->raStart + h->raLen) {
+            //it's in the buffer.
+            uint32_t n = MIN(remain, (h->raStart + h->raLen) - at);
+            memcpy(&out[done], &h->raBuf[at - h->raStart], n);
+            done += n;
+            continue;
+        }
+
+        int err;
+        if(!h->raBuf || remain >= h->raSize) {
+            //big enough that buffering won't help; read it directly.
+            err = fatReadFile(h->blkdev, h->mbr, &h->file, at, remain,
+                &out[done], h->timeout);
+            if(err == 0) err = -EIO; //chain is shorter than the file
+            if(err < 0) return done ? (int)done : err;
+            done += err;
+        }
+        else {
+            //fill the buffer, starting at the sector we need.
+            h->raLen   = 0;
+            h->raStart = at - (at % FAT_SECTOR_SIZE);
+            err = fatReadFile(h->blkdev, h->mbr, &h->file, h->raStart,
+                h->raSize, h->raBuf, h->timeout);
+            if(err >= 0 && (uint32_t)err <= at - h->raStart) err = -EIO;
+            if(err < 0) return done ? (int)done : err;
+            h->raLen = err;
+        }
+    }
+    self->offset += done;
+    return done;
+}
+
+int fatFileCls_write(FILE *self, const void *src, size_t len) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    const uint8_t *data = (const uint8_t*)src;
+    if(self->offset > 0xFFFFFFFF - len) return -EFBIG;
+    uint32_t pos = self->offset;
+
+    //forget any buffered data this overlaps.
+    if(h->raLen && pos < h->raStart + h->raLen && pos + len > h->raStart) {
+        h->raLen = 0;
+    }
+
+    int err;
+    h->written = true;
+    if(pos > h->file.size) { //fill the gap with zeros
+        err = fatTruncateFile(h->blkdev, h->mbr, &h->file, pos, h->timeout);
+        if(err < 0) return err;
+    }
+
+    uint32_t done = 0;
+    if(pos < h->file.size) { //overwrite what's there
+        err = fatWriteFile(h->blkdev, h->mbr, &h->file, pos, len, data,
+            h->timeout);
+        if(err < 0) return err;
+        done = err;
+    }
+    if(done < len) { //then add the rest to the end
+        err = fatAppendFile(h->blkdev, h->mbr, &h->file, &data[done],
+            len - done, h->timeout);
+        if(err < 0) {
+            if(!done) return err;
+        }
+        else done += err;
+    }
+    self->offset += done;
+    return done;
+}
+
+int fatFileCls_seek(FILE *self, long int offset, int origin) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    int64_t pos;
+    switch(origin) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = (int64_t)self->offset + offset; break;
+        case SEEK_END: pos = (int64_t)h->file.size + offset; break;
+        default: return -EINVAL;
+    }
+    //seeking past the end is allowed; writing there fills the gap with
+    //zeros, like on other systems.
+    if(pos < 0 || pos > 0xFFFFFFFF) return -ERANGE;
+    self->offset = pos;
+    return 0;
+}
+
+int fatFileCls_peek(FILE *self, void *dest, size_t len) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    if(!dest) {
+        if(self->offset >= h->file.size) return 0;
+        return h->file.size - self->offset;
+    }
+    uint64_t offset = self->offset;
+    int err = fatFileCls_read(self, dest, len);
+    self->offset = offset;
+    return (err == -ENODATA) ? 0 : err;
+}
+
+int fatFileCls_getWriteBuf(FILE *self) {
+    return -ENOSYS; //writes always block
+}
+
+int fatFileCls_sync(FILE *self) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    int err = fatSync(h->blkdev, h->mbr, h->timeout);
+    if(err < 0) return err;
+    return sync(h->blkdev);
+}
+
+int fatFileCls_purge(FILE *self) {
+    MicronFatHandle *h = (MicronFatHandle*)self->udata.ptr;
+    h->raLen = 0;
+    return 0;
+}
+
+
+MicronFileClass fatFileCls = {
+	.close       = fatFileCls_close,
+	.read        = fatFileCls_read,
+	.write       = fatFileCls_write,
+	.seek        = fatFileCls_seek,
+	.peek        = fatFileCls_peek,
+	.getWriteBuf = fatFileCls_getWriteBuf,
+	.sync        = fatFileCls_sync,
+	.purge       = fatFileCls_purge,
+};
+
+static int _openHandle(MicronFatHandle *h, const char *path, uint32_t flags,
+uint32_t readAhead) {
+    //find or create the file, and set up the handle.
+    int err = fatOpenPath(h->blkdev, h->mbr, path, &h->file,
+        FAT_DEFAULT_MAX_EXTENTS, h->timeout);
+    if(err == -ENOENT && (flags & FAT_O_CREATE)) {
+        err = fatCreate(h->blkdev, h->mbr, path, 0, &h->file,
+            FAT_DEFAULT_MAX_EXTENTS, h->timeout);
+    }
+    else if(!err && (flags & FAT_O_TRUNCATE)) {
+        err = fatTruncateFile(h->blkdev, h->mbr, &h->file, 0, h->timeout);
+        if(err) fatCloseFile(&h->file);
+        h->written = true;
+    }
+    if(err) return err;
+
+    if(readAhead) {
+        h->raSize = (readAhead + FAT_SECTOR_SIZE - 1) & ~(FAT_SECTOR_SIZE - 1);
+        h->raBuf  = (uint8_t*)malloc(h->raSize);
+        if(!h->raBuf) {
+            fatCloseFile(&h->file);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+FILE* fatOpen(FILE *blkdev, fat32_mbr *mbr, const char *path, uint32_t flags,
+uint32_t readAhead, uint32_t timeout, int *outErr) {
+    /** Open a file on a FAT filesystem.
+     *  @param blkdev Block device the filesystem is on.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param path The file's path, eg "/config/net.txt".
+     *  @param flags FAT_O_* flags.
+     *  @param readAhead Size of the read-ahead buffer, in bytes; rounded up
+     *   to whole sectors. FAT_DEFAULT_READ_AHEAD is a reasonable choice.
+     *   Can be zero to disable it. Reads at least this large bypass it.
+     *  @param timeout Maximum time to wait for each operation on the file,
+     *   including this one, in milliseconds.
+     *  @param outErr Receives an error code on failure. Can be NULL.
+     *  @return The file, or NULL on failure.
+     *  @note Use read(), write(), fseek() etc on the file, and close() when
+     *   done. The data and directory entry are written directly to the disk
+     *   (see fatWriteFile() and fatAppendFile()), but the FAT sector cache
+     *   and FSInfo may hold changes until the file is closed or sync() is
+     *   called on it, or the volume is unmounted. close() returns an error
+     *   if that fails, but the file is closed anyway.
+     *   fseek() takes a `long`, so on 32-bit systems, only the first 2GB
+     *   of a file can be reached.
+     */
+    int err = 0;
+    if(fatFileClsIdx < 0) {
+        err = osRegisterFileClass(&fatFileCls);
+        if(err < 0) {
+            if(outErr) *outErr = err;
+            return NULL;
+        }
+        fatFileClsIdx = err;
+    }
+
+    MicronFatHandle *h = (MicronFatHandle*)malloc(sizeof(MicronFatHandle));
+    FILE *res = (FILE*)malloc(sizeof(FILE));
+    if(h && res) {
+        memset(h, 0, sizeof(MicronFatHandle));
+        h->blkdev  = blkdev;
+        h->mbr     = mbr;
+        h->timeout = timeout;
+        err = _openHandle(h, path, flags, readAhead);
+    }
+    else err = -ENOMEM;
+    if(err) {
+        if(h) free(h);
+        if(res) free(res);
+        if(outErr) *outErr = err;
+        return NULL;
+    }
+
+    res->fileCls   = fatFileClsIdx;
+    res->udata.ptr = h;
+    res->offset    = (flags & FAT_O_APPEND) ? h->file.size : 0;
+    return res;
+}
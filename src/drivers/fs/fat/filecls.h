@@ -0,0 +1,30 @@
+#ifndef _MICRON_DRIVERS_FS_FAT_FILECLS_H_
+#define _MICRON_DRIVERS_FS_FAT_FILECLS_H_
+
+//flags for fatOpen()
+#define FAT_O_CREATE   BIT(0) //create the file if it doesn't exist
+#define FAT_O_TRUNCATE BIT(1) //discard the file's contents
+#define FAT_O_APPEND   BIT(2) //start at the end of the file
+
+//default read-ahead buffer size for fatOpen(), in bytes.
+#ifndef FAT_DEFAULT_READ_AHEAD
+#define FAT_DEFAULT_READ_AHEAD 2048
+#endif
+
+typedef struct {
+    FILE *blkdev;
+    fat32_mbr *mbr;
+    MicronFatFile file;
+    uint32_t timeout;   //for each operation, in milliseconds
+    bool written;       //whether to sync when closing
+    //read-ahead buffer. it holds `raLen` bytes of the file, from `raStart`.
+    uint8_t *raBuf;
+    uint32_t raSize;    //capacity of raBuf
+    uint32_t raStart;   //file offset of raBuf[0]
+    uint32_t raLen;     //number of valid bytes in raBuf
+} MicronFatHandle;
+
+extern int8_t fatFileClsIdx;
+FILE* fatOpen(FILE *blkdev, fat32_mbr *mbr, const char *path, uint32_t flags, uint32_t readAhead, uint32_t timeout, int *outErr);
+
+#endif //_MICRON_DRIVERS_FS_FAT_FILECLS_H_
@@ -0,0 +1,435 @@
+//Path resolution.
+//Looking up a name means scanning its directory, so the results are kept
+//in a small cache keyed by (directory, name). Repeatedly opening the same
+//files then only scans each directory once.
+//Anything that modifies a directory must invalidate its entries here.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+#define NO_ENTRY 0xFFFF
+#define MAX_NAME 255 //FAT's limit on name length, in characters
+
+static inline char _fold(char c) {
+    //FAT names are case-insensitive. we only fold ASCII, which covers
+    //8.3 names entirely and most long names in practice.
+    if(c >= 'a' && c <= 'z') return c - 0x20;
+    return c;
+}
+
+static bool _nameEquals(const char *name, size_t len, const char *other) {
+    //compare a (not NUL-terminated) name with a NUL-terminated one.
+    for(size_t i=0; i<len; i++) {
+        if(!other[i] || _fold(name[i]) != _fold(other[i])) return false;
+    }
+    return other[len] == '\0';
+}
+
+static uint32_t _hash(uint32_t parent, const char *name, size_t len) {
+    //FNV-1a of the parent cluster and folded name.
+    uint32_t hash = 2166136261UL;
+    for(int i=0; i<4; i++) {
+        hash = (hash ^ ((parent >> (i*8)) & 0xFF)) * 16777619UL;
+    }
+    for(size_t i=0; i<len; i++) {
+        hash = (hash ^ (uint8_t)_fold(name[i])) * 16777619UL;
+    }
+    return hash;
+}
+
+static uint32_t _dirCluster(fat32_mbr *mbr, uint32_t cluster) {
+    //directory entries use 0 to refer to the root directory.
+    return cluster ? cluster : mbr->rootCluster;
+}
+
+
+/* ----------------------------- Dentry cache ----------------------------- */
+
+static void _lruUnlink(MicronFatDentryCache *cache, uint16_t i) {
+    MicronFatDentry *ent = &cache->entries[i];
+    if(ent->prev != NO_ENTRY) cache->entries[ent->prev].next = ent->next;
+    else cache->head = ent->next;
+    if(ent->next != NO_ENTRY) cache->entries[ent->next].prev = ent->prev;
+    else cache->tail = ent->prev;
+    ent->prev = NO_ENTRY;
+    ent->next = NO_ENTRY;
+}
+
+static void _lruPushHead(MicronFatDentryCache *cache, uint16_t i) {
+    MicronFatDentry *ent = &cache->entries[i];
+    ent->prev = NO_ENTRY;
+    ent->next = cache->head;
+    if(cache->head != NO_ENTRY) cache->entries[cache->head].prev = i;
+    cache->head = i;
+    if(cache->tail == NO_ENTRY) cache->tail = i;
+}
+
+static void _lruPushTail(MicronFatDentryCache *cache, uint16_t i) {
+    MicronFatDentry *ent = &cache->entries[i];
+    ent->next = NO_ENTRY;
+    ent->prev = cache->tail;
+    if(cache->tail != NO_ENTRY) cache->entries[cache->tail].next = i;
+    cache->tail = i;
+    if(cache->head == NO_ENTRY) cache->head = i;
+}
+
+static void _remove(MicronFatDentryCache *cache, uint16_t i) {
+    //take an entry out of its hash bucket and make it the next to be reused.
+    MicronFatDentry *ent = &cache->entries[i];
+    if(!ent->parent) return;
+    uint16_t *link = &cache->buckets[ent->hash & (cache->numBuckets - 1)];
+    while(*link != NO_ENTRY) {
+        if(*link == i) {
+            *link = ent->chain;
+            break;
+        }
+        link = &cache->entries[*link].chain;
+    }
+    ent->parent = 0;
+    ent->chain  = NO_ENTRY;
+    _lruUnlink(cache, i);
+    _lruPushTail(cache, i);
+}
+
+static MicronFatDentry* _find(MicronFatDentryCache *cache, uint32_t parent,
+const char *name, size_t len, uint32_t hash) {
+    uint16_t i = cache->buckets[hash & (cache->numBuckets - 1)];
+    while(i != NO_ENTRY) {
+        MicronFatDentry *ent = &cache->entries[i];
+        if(ent->hash == hash && ent->parent == parent
+        && _nameEquals(name, len, ent->name)) {
+            _lruUnlink(cache, i);
+            _lruPushHead(cache, i);
+            return ent;
+        }
+        i = ent->chain;
+    }
+    return NULL;
+}
+
+static void _insert(MicronFatDentryCache *cache, uint32_t parent,
+const char *name, size_t len, uint32_t hash, const micronDirent *dirent) {
+    //replace the least recently used entry.
+    uint16_t i = cache->tail;
+    _remove(cache, i);
+    MicronFatDentry *ent = &cache->entries[i];
+    ent->parent     = parent;
+    ent->hash       = hash;
+    ent->cluster    = dirent->cluster;
+    ent->size       = dirent->size;
+    ent->attributes = dirent->attributes;
+    ent->entryPos   = dirent->entryPos;
+    memcpy(ent->name, name, len);
+    ent->name[len] = '\0';
+
+    uint16_t *bucket = &cache->buckets[hash & (cache->numBuckets - 1)];
+    ent->chain = *bucket;
+    *bucket = i;
+    _lruUnlink(cache, i);
+    _lruPushHead(cache, i);
+}
+
+
+int fatDentryCacheInit(fat32_mbr *mbr, uint16_t size) {
+    /** Set up the dentry (path lookup) cache.
+     *  @param mbr The filesystem's MBR.
+     *  @param size Number of entries to cache. Can be zero to disable it.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by fatMount(). Calling it again replaces the
+     *   existing cache.
+     */
+    fatDentryCacheFree(mbr);
+    if(!size) return 0;
+    if(size >= NO_ENTRY) return -EINVAL;
+
+    //about two entries per bucket.
+    uint16_t numBuckets = 1;
+    while(numBuckets < size / 2) numBuckets <<= 1;
+
+    MicronFatDentryCache *cache = (MicronFatDentryCache*)malloc(
+        sizeof(MicronFatDentryCache));
+    if(!cache) return -ENOMEM;
+    memset(cache, 0, sizeof(MicronFatDentryCache));
+    cache->entries = (MicronFatDentry*)malloc(size * sizeof(MicronFatDentry));
+    cache->buckets = (uint16_t*)malloc(numBuckets * sizeof(uint16_t));
+    if(!(cache->entries && cache->buckets)) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: not enough memory for dentry cache\r\n");
+        #endif
+        if(cache->entries) free(cache->entries);
+        if(cache->buckets) free(cache->buckets);
+        free(cache);
+        return -ENOMEM;
+    }
+
+    cache->size       = size;
+    cache->numBuckets = numBuckets;
+    cache->head       = NO_ENTRY;
+    cache->tail       = NO_ENTRY;
+    for(uint16_t i=0; i<numBuckets; i++) cache->buckets[i] = NO_ENTRY;
+    for(uint16_t i=0; i<size; i++) {
+        cache->entries[i].parent = 0;
+        cache->entries[i].chain  = NO_ENTRY;
+        _lruPushTail(cache, i);
+    }
+    mbr->_micron_dentryCache = cache;
+    return 0;
+}
+
+
+void fatDentryCacheFree(fat32_mbr *mbr) {
+    /** Free the dentry cache.
+     *  @param mbr The filesystem's MBR.
+     *  @note This is called by fatUnmount().
+     */
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    if(!cache) return;
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+    mbr->_micron_dentryCache = NULL;
+}
+
+
+void fatDentryInvalidate(fat32_mbr *mbr, uint32_t parent, const char *name) {
+    /** Forget a cached name.
+     *  @param mbr The filesystem's MBR.
+     *  @param parent First cluster of the directory containing it
+     *   (0 = root directory).
+     *  @param name The name, as it was looked up.
+     *  @note A file can be cached under more than one name (its long name,
+     *   its 8.3 name, and different capitalizations), so when renaming or
+     *   deleting something, use fatDentryInvalidateDir() instead.
+     */
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    if(!cache) return;
+    parent = _dirCluster(mbr, parent);
+    size_t len = strlen(name);
+    MicronFatDentry *ent = _find(cache, parent, name, len,
+        _hash(parent, name, len));
+    if(ent) _remove(cache, ent - cache->entries);
+}
+
+
+void fatDentryInvalidateDir(fat32_mbr *mbr, uint32_t parent) {
+    /** Forget all cached names within a directory.
+     *  @param mbr The filesystem's MBR.
+     *  @param parent The directory's first cluster (0 = root directory).
+     *  @note Call this whenever a directory is modified.
+     */
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    if(!cache) return;
+    parent = _dirCluster(mbr, parent);
+    for(uint16_t i=0; i<cache->size; i++) {
+        if(cache->entries[i].parent == parent) _remove(cache, i);
+    }
+}
+
+
+void fatDentryInvalidateAll(fat32_mbr *mbr) {
+    /** Forget all cached names.
+     *  @param mbr The filesystem's MBR.
+     */
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    if(!cache) return;
+    for(uint16_t i=0; i<cache->size; i++) _remove(cache, i);
+}
+
+
+void fatDentryInvalidateEntry(fat32_mbr *mbr, uint64_t entryPos) {
+    /** Forget all cached names for a directory entry.
+     *  @param mbr The filesystem's MBR.
+     *  @param entryPos The entry's location, as in micronDirent.
+     *  @note Call this whenever a directory entry is modified.
+     */
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    if(!cache) return;
+    for(uint16_t i=0; i<cache->size; i++) {
+        MicronFatDentry *ent = &cache->entries[i];
+        if(ent->parent && ent->entryPos == entryPos) _remove(cache, i);
+    }
+}
+
+
+/* ------------------------------- Lookup --------------------------------- */
+
+static void _setName(micronDirent *out, const char *name, size_t len) {
+    if(len >= sizeof(out->name)) len = sizeof(out->name) - 1;
+    memcpy(out->name, name, len);
+    out->name[len] = '\0';
+}
+
+int fatLookup(FILE *blkdev, fat32_mbr *mbr, uint32_t parent, const char *name,
+size_t len, micronDirent *out, uint32_t timeout) {
+    /** Find a name in a directory.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param parent The directory's first cluster (0 = root directory).
+     *  @param name The name to look for. Doesn't need to be NUL-terminated.
+     *  @param len Length of name, in bytes.
+     *  @param out Receives the directory entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, or negative error code
+     *   on failure.
+     *  @note Names are matched without regard to case, against both the
+     *   long name and the 8.3 name. `out->name` receives `name` as given.
+     *   For directories, `out->cluster` is never 0, even for "..".
+     */
+    if(len == 0) return -ENOENT;
+    if(len > MAX_NAME) return -ENAMETOOLONG;
+    parent = _dirCluster(mbr, parent);
+
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    uint32_t hash = 0;
+    if(cache && len <= FAT_DENTRY_MAX_NAME) {
+        hash = _hash(parent, name, len);
+        MicronFatDentry *ent = _find(cache, parent, name, len, hash);
+        if(ent) {
+            cache->hits++;
+            out->attributes = ent->attributes;
+            out->cluster    = ent->cluster;
+            out->size       = ent->size;
+            out->entryPos   = ent->entryPos;
+            out->createTime = 0;
+            out->accessTime = 0;
+            out->modifyTime = 0;
+            _setName(out, name, len);
+            return 0;
+        }
+        cache->misses++;
+    }
+
+    MicronFatDir dir;
+    int err = fatOpenDir(mbr, parent, &dir);
+    if(err) return err;
+    while(1) {
+        err = fatReadDirNext(blkdev, mbr, &dir, out, timeout);
+        if(err) return err; //including -ENOENT at the end
+        if(out->attributes & FAT_ATTR_VOLUME_LABEL) continue;
+        if(_nameEquals(name, len, out->name)
+        || _nameEquals(name, len, dir.shortName)) break;
+    }
+
+    if(out->attributes & FAT_ATTR_DIRECTORY) {
+        out->cluster = _dirCluster(mbr, out->cluster);
+    }
+    if(cache && len <= FAT_DENTRY_MAX_NAME) {
+        _insert(cache, parent, name, len, hash, out);
+    }
+    _setName(out, name, len);
+    return 0;
+}
+
+
+static int _lookupPath(FILE *blkdev, fat32_mbr *mbr, const char *path,
+const char *pathEnd, micronDirent *out, uint32_t timeout) {
+    //start at the root.
+    out->attributes = FAT_ATTR_DIRECTORY;
+    out->cluster    = mbr->rootCluster;
+    out->size       = 0;
+    out->entryPos   = 0;
+    out->createTime = 0;
+    out->accessTime = 0;
+    out->modifyTime = 0;
+    strcpy(out->name, "/");
+
+    while(path < pathEnd) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        const char *end = path;
+        while(end < pathEnd && *end != '/') end++;
+        size_t len = end - path;
+
+        if(!(out->attributes & FAT_ATTR_DIRECTORY)) return -ENOTDIR;
+        if(len == 1 && path[0] == '.') { //nothing to do
+            path = end;
+            continue;
+        }
+        if(len == 2 && path[0] == '.' && path[1] == '.'
+        && out->cluster == mbr->rootCluster) { //root has no ".."
+            path = end;
+            continue;
+        }
+
+        int err = fatLookup(blkdev, mbr, out->cluster, path, len, out,
+            timeout);
+        if(err) return err;
+        path = end;
+    }
+    return 0;
+}
+
+
+int fatLookupPath(FILE *blkdev, fat32_mbr *mbr, const char *path,
+micronDirent *out, uint32_t timeout) {
+    /** Find a file or directory by its path.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param path The path, eg "/config/net.txt". Paths are always relative
+     *   to the root directory, so the leading "/" is optional.
+     *  @param out Receives the directory entry.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -ENOTDIR if a component
+     *   other than the last isn't a directory, or negative error code on
+     *   failure.
+     *  @note "/" refers to the root directory, which has no directory entry
+     *   of its own; `out` is filled in to describe it.
+     */
+    return _lookupPath(blkdev, mbr, path, path + strlen(path), out, timeout);
+}
+
+
+int fatLookupParent(FILE *blkdev, fat32_mbr *mbr, const char *path,
+micronDirent *out, const char **outName, uint32_t timeout) {
+    /** Find the directory that a path refers to something in.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param path The path, eg "/config/net.txt".
+     *  @param out Receives the directory entry of the parent directory
+     *   (eg "/config").
+     *  @param outName Receives a pointer to the last component of the path
+     *   (eg "net.txt"), which may be followed by a "/".
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if the parent isn't found or the path
+     *   has no last component (eg "/"), -ENOTDIR if the parent isn't a
+     *   directory, or negative error code on failure.
+     */
+    const char *end = path + strlen(path);
+    while(end > path && end[-1] == '/') end--; //ignore trailing slashes
+    const char *name = end;
+    while(name > path && name[-1] != '/') name--;
+    if(name == end) return -ENOENT;
+
+    int err = _lookupPath(blkdev, mbr, path, name, out, timeout);
+    if(err) return err;
+    if(!(out->attributes & FAT_ATTR_DIRECTORY)) return -ENOTDIR;
+    *outName = name;
+    return 0;
+}
+
+
+int fatOpenPath(FILE *blkdev, fat32_mbr *mbr, const char *path,
+MicronFatFile *out, uint16_t maxExtents, uint32_t timeout) {
+    /** Prepare to access a file by its path.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param path The path, eg "/config/net.txt".
+     *  @param out Receives the file state.
+     *  @param maxExtents Maximum number of extents to remember; see
+     *   fatOpenFile(). FAT_DEFAULT_MAX_EXTENTS is a reasonable choice.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -EISDIR if it's a
+     *   directory, or negative error code on failure.
+     *  @note Call fatCloseFile() when done.
+     */
+    micronDirent *dirent = (micronDirent*)malloc(sizeof(micronDirent));
+    if(!dirent) return -ENOMEM;
+    int err = fatLookupPath(blkdev, mbr, path, dirent, timeout);
+    if(!err && (dirent->attributes & FAT_ATTR_DIRECTORY)) err = -EISDIR;
+    if(!err) err = fatOpenFile(dirent, out, maxExtents);
+    free(dirent);
+    return err;
+}
@@ -0,0 +1,205 @@
+//Cache of file data blocks, for reading files in place.
+//fatViewFile() returns a pointer into the cache rather than copying the
+//data out, which saves a copy when parsing small structures (fonts, tables,
+//config files) directly from the card. Each view pins the block it points
+//to, so it can't be replaced until the view is released.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+static void _update(MicronFatViewCache *cache, uint16_t i, uint64_t sector,
+uint32_t count, const uint8_t *src) {
+    //copy the part of a write that overlaps entry i into it, or if src is
+    //NULL, drop the entry. views keep what they had.
+    uint64_t start = cache->blocks.entries[i].block;
+    uint64_t first = MAX(start, sector);
+    uint64_t end = MIN(start + cache->blockSectors, sector + count);
+    if(first >= end) return;
+    if(!src) {
+        blockCacheDiscard(&cache->blocks, i);
+        return;
+    }
+    memcpy(blockCacheData(&cache->blocks, i) +
+            ((first - start) * FAT_SECTOR_SIZE),
+        &src[(first - sector) * FAT_SECTOR_SIZE],
+        (end - first) * FAT_SECTOR_SIZE);
+}
+
+
+int fatViewCacheInit(fat32_mbr *mbr, uint16_t size, uint16_t blockSectors) {
+    /** Set up the cache used by fatViewFile().
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param size Number of blocks to cache. This is also the most views
+     *   that can be held at once, unless they share blocks.
+     *  @param blockSectors Size of each block, in sectors. It's reduced to
+     *   the cluster size or FAT_VIEW_MAX_BLOCK_SECTORS if it's larger, and
+     *   rounded down to a power of 2.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The cache uses size * blockSectors * 512 bytes. It isn't set
+     *   up by fatMount(), since not every program needs it. fatUnmount()
+     *   frees it.
+     */
+    if(!size || !blockSectors) return -EINVAL;
+    if(mbr->_micron_viewCache) return -EALREADY;
+    blockSectors = MIN(blockSectors, (uint16_t)mbr->sectorsPerCluster);
+    blockSectors = MIN(blockSectors, (uint16_t)FAT_VIEW_MAX_BLOCK_SECTORS);
+    while(blockSectors & (blockSectors - 1)) {
+        blockSectors &= blockSectors - 1; //clear lowest bit
+    }
+
+    MicronFatViewCache *cache = (MicronFatViewCache*)malloc(
+        sizeof(MicronFatViewCache));
+    if(!cache) return -ENOMEM;
+    int err = blockCacheInit(&cache->blocks, size,
+        blockSectors * FAT_SECTOR_SIZE);
+    if(err) {
+        #if FAT_DEBUG_PRINT
+            printf("FAT: not enough memory for view cache\r\n");
+        #endif
+        free(cache);
+        return err;
+    }
+    cache->blockSectors = blockSectors;
+    mbr->_micron_viewCache = cache;
+    return 0;
+}
+
+
+void fatViewCacheFree(fat32_mbr *mbr) {
+    /** Free the cache used by fatViewFile().
+     *  @param mbr The filesystem's MBR.
+     *  @note Any views still held become invalid.
+     */
+    MicronFatViewCache *cache = mbr->_micron_viewCache;
+    if(!cache) return;
+    #if FAT_DEBUG_PRINT
+        for(uint16_t i=0; i<cache->blocks.size; i++) {
+            if(cache->blocks.entries[i].pins) {
+                printf("FAT: view cache freed with views still held\r\n");
+                break;
+            }
+        }
+    #endif
+    blockCacheFree(&cache->blocks);
+    free(cache);
+    mbr->_micron_viewCache = NULL;
+}
+
+
+int fatViewFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t offset, uint32_t size, MicronFatView *out, uint32_t timeout) {
+    /** Get a read-only pointer to part of a file, without copying it.
+     *  @param blkdev Block device to read from.
+     *  @param mbr The filesystem's MBR.
+     *  @param file The file, from fatOpenFile().
+     *  @param offset Byte offset of the data.
+     *  @param size Number of bytes wanted.
+     *  @param out Receives the view. `out->data` points to the data and
+     *   `out->size` is how many bytes of it there are.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes in the view, which is less than `size` if
+     *   the range crosses a cache block boundary or the end of the file,
+     *   or negative error code on failure: -ENOSYS if fatViewCacheInit()
+     *   hasn't been called, or -EBUSY if every block is pinned by a view.
+     *  @note If the return value is greater than 0, the view must be
+     *   released with fatViewRelease() when done. Until then, the block
+     *   stays in the cache. A range that doesn't cross a multiple of the
+     *   block size (blockSectors * 512 bytes) is always returned whole.
+     *   Writes to the file through this driver are seen by the view.
+     */
+    MicronFatViewCache *cache = mbr->_micron_viewCache;
+    if(!cache) return -ENOSYS;
+    out->data = NULL;
+    out->size = 0;
+    if(offset >= file->size || !size) return 0;
+    size = MIN(size, file->size - offset);
+
+    uint32_t clusterSize = mbr->sectorsPerCluster * FAT_SECTOR_SIZE;
+    uint32_t blockSize = cache->blockSectors * FAT_SECTOR_SIZE;
+    uint32_t cluster, run;
+    int err = fatMapCluster(blkdev, mbr, file, offset / clusterSize,
+        &cluster, &run, timeout);
+    if(err == -ERANGE) return 0; //chain is shorter than file size
+    if(err < 0) return err;
+
+    //blocks are aligned within clusters, so they never cross one.
+    uint32_t inCluster = offset % clusterSize;
+    uint64_t sector = fatClusterToSector(mbr, cluster) +
+        ((inCluster / blockSize) * cache->blockSectors);
+    uint32_t inBlock = inCluster % blockSize;
+
+    int i = blockCacheFind(&cache->blocks, sector);
+    if(i < 0) {
+        i = blockCacheVictim(&cache->blocks);
+        if(i < 0) return i; //every block is pinned
+        blockCacheAssign(&cache->blocks, i, sector);
+        err = _fatReadSectors(blkdev, sector, cache->blockSectors,
+            blockCacheData(&cache->blocks, i));
+        if(err < 0) {
+            blockCacheDiscard(&cache->blocks, i);
+            return err;
+        }
+    }
+
+    blockCachePin(&cache->blocks, i);
+    out->data  = blockCacheData(&cache->blocks, i) + inBlock;
+    out->size  = MIN(size, blockSize - inBlock);
+    out->block = i;
+    return out->size;
+}
+
+
+void fatViewRelease(fat32_mbr *mbr, MicronFatView *view) {
+    /** Release a view from fatViewFile().
+     *  @param mbr The filesystem's MBR.
+     *  @param view The view. Its pointer mustn't be used afterward.
+     *  @note Releasing an empty view (size 0) does nothing, so it's safe to
+     *   call this for every view.
+     */
+    MicronFatViewCache *cache = mbr->_micron_viewCache;
+    if(!cache || !view->data) return;
+    blockCacheUnpin(&cache->blocks, view->block);
+    view->data = NULL;
+    view->size = 0;
+}
+
+
+void fatViewUpdate(fat32_mbr *mbr, uint64_t sector, uint32_t count,
+const void *data) {
+    /** Update the view cache after writing to the disk.
+     *  @param mbr The filesystem's MBR.
+     *  @param sector First sector that was written.
+     *  @param count Number of sectors written.
+     *  @param data What was written, or NULL if the sectors were discarded.
+     *  @note This is called by the functions in write.c. Cached copies of
+     *   those sectors are updated, including ones that views point to, so
+     *   views see the new data. Discarded sectors are dropped from the
+     *   cache; views of them keep the old data until released.
+     */
+    MicronFatViewCache *cache = mbr->_micron_viewCache;
+    if(!cache) return;
+    const uint8_t *src = (const uint8_t*)data;
+    uint32_t bs = cache->blockSectors;
+    uint64_t dataStart = fatClusterToSector(mbr, 2);
+    if(sector + count <= dataStart) return; //not file data
+
+    //blocks are aligned within clusters, and so relative to dataStart.
+    //look up each block the write covers, unless there are more of those
+    //than entries in the cache.
+    uint64_t first = MAX(sector, dataStart);
+    uint64_t block = dataStart + (((first - dataStart) / bs) * bs);
+    uint64_t numBlocks = ((sector + count) - block + bs - 1) / bs;
+    if(numBlocks > cache->blocks.size) {
+        for(uint16_t i=0; i<cache->blocks.size; i++) {
+            if(cache->blocks.entries[i].flags & BLOCKCACHE_VALID) {
+                _update(cache, i, sector, count, src);
+            }
+        }
+        return;
+    }
+    for(; block < sector + count; block += bs) {
+        int i = blockCachePeek(&cache->blocks, block);
+        if(i >= 0) _update(cache, i, sector, count, src);
+    }
+}
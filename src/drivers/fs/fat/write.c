@@ -0,0 +1,935 @@
+//Creating, modifying and deleting files.
+//Everything here is ordered so that if power is lost between any two
+//sector writes, the filesystem is still consistent. At worst, some clusters
+//are allocated but not used by anything ("lost clusters"), which fsck or
+//chkdsk will reclaim. To that end:
+//- new data is written before anything refers to it;
+//- a cluster is marked as the end of a chain before it's linked to one
+//  (see fatAllocCluster());
+//- a file's directory entry is only updated once its clusters are linked;
+//- a directory entry is removed before the clusters it refers to are freed.
+extern "C" {
+    #include <micron.h>
+    #include "fat.h"
+}
+
+#define ENTRIES_PER_SECTOR (FAT_SECTOR_SIZE / sizeof(fat32_dirent))
+#define MAX_NAME 255 //FAT's limit on name length, in UTF-16 characters
+#define MAX_ENTRIES (FAT_LFN_MAX_ENTRIES + 1) //LFN entries + 8.3 entry
+
+static const uint8_t _zeros[FAT_SECTOR_SIZE] = {0};
+
+static void _now(uint16_t *date, uint16_t *time) {
+    //get the current time in FAT format.
+    uint32_t secs = 0;
+    if(rtcGet(&secs, NULL) < 0) secs = 0; //not set; use 1980-01-01
+    fatEncodeDateTime(secs, date, time);
+}
+
+static int _zeroCluster(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster) {
+    //fill a cluster with zeros, eg before using it as a directory.
+    uint64_t sector = fatClusterToSector(mbr, cluster);
+    for(uint32_t i=0; i<mbr->sectorsPerCluster; i++) {
+        int err = _fatWriteSector(blkdev, sector + i, _zeros);
+        if(err < 0) return err;
+        fatViewUpdate(mbr, sector + i, 1, _zeros);
+    }
+    return 0;
+}
+
+
+/* --------------------------------- Names -------------------------------- */
+
+static bool _validLongChar(uint32_t c) {
+    if(c < 0x20) return false;
+    return c > 0x7F || !strchr("\"*/:<>?\\|", c);
+}
+
+static bool _validShortChar(char c) {
+    if(c >= 'A' && c <= 'Z') return true;
+    if(c >= '0' && c <= '9') return true;
+    return c && strchr("!#$%&'()-@^_`{}~", c);
+}
+
+static int _utf8ToUtf16(const char *name, size_t len, uint16_t *out) {
+    //convert a UTF-8 name to UTF-16 for LFN entries.
+    //returns number of UTF-16 characters, or negative error code.
+    int n = 0;
+    for(size_t i=0; i<len; ) {
+        uint8_t b = name[i];
+        uint32_t c;
+        int extra;
+        if     (b < 0x80) { c = b;        extra = 0; }
+        else if(b < 0xC0) return -EILSEQ; //stray continuation byte
+        else if(b < 0xE0) { c = b & 0x1F; extra = 1; }
+        else if(b < 0xF0) { c = b & 0x0F; extra = 2; }
+        else if(b < 0xF8) { c = b & 0x07; extra = 3; }
+        else return -EILSEQ;
+        if(extra && i + extra >= len) return -EILSEQ; //truncated
+        i++;
+        for(int j=0; j<extra; j++, i++) {
+            if((name[i] & 0xC0) != 0x80) return -EILSEQ;
+            c = (c << 6) | (name[i] & 0x3F);
+        }
+        if(!_validLongChar(c)) return -EINVAL;
+
+        if(c >= 0x10000) { //needs a surrogate pair
+            if(n + 2 > MAX_NAME) return -ENAMETOOLONG;
+            c -= 0x10000;
+            out[n++] = 0xD800 | (c >> 10);
+            out[n++] = 0xDC00 | (c & 0x3FF);
+        }
+        else {
+            if(n + 1 > MAX_NAME) return -ENAMETOOLONG;
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+static bool _fitsShortName(const char *name, size_t len, fat32_dirent *ent) {
+    //if the name is a valid 8.3 name, store it in `ent` and return true.
+    //names that are all lowercase (in base or extension) are also
+    //accepted, using the flags Windows NT uses to mark them.
+    const char *dot = NULL;
+    for(size_t i=0; i<len; i++) {
+        if(name[i] == '.') {
+            if(dot) return false; //more than one
+            dot = &name[i];
+        }
+    }
+    size_t baseLen = dot ? (size_t)(dot - name) : len;
+    size_t extLen  = dot ? len - baseLen - 1 : 0;
+    if(baseLen < 1 || baseLen > 8 || extLen > 3 || (dot && !extLen)) {
+        return false;
+    }
+
+    memset(ent->shortName, ' ', 11);
+    ent->extAttributes = 0;
+    for(int part=0; part<2; part++) {
+        const char *src = part ? dot + 1 : name;
+        size_t n        = part ? extLen : baseLen;
+        char *dest      = part ? ent->shortExt : ent->shortName;
+        bool upper = false, lower = false;
+        for(size_t i=0; i<n; i++) {
+            char c = src[i];
+            if(c >= 'a' && c <= 'z') {
+                lower = true;
+                c -= 0x20;
+            }
+            else if(c >= 'A' && c <= 'Z') upper = true;
+            if(!_validShortChar(c)) return false;
+            dest[i] = c;
+        }
+        if(upper && lower) return false; //mixed case needs a long name
+        if(lower) ent->extAttributes |= part ? 0x10 : 0x08;
+    }
+    return true;
+}
+
+static void _makeBasisName(const char *name, size_t len, char *out) {
+    //generate the basis for an 8.3 alias of a long name, by uppercasing
+    //it, dropping spaces and leading periods, replacing invalid characters
+    //with '_', and truncating the base and extension.
+    memset(out, ' ', 11);
+    const char *dot = NULL;
+    for(size_t i=0; i<len; i++) if(name[i] == '.') dot = &name[i];
+    size_t i = 0;
+    while(i < len && name[i] == '.') i++;
+    if(dot && dot < &name[i]) dot = NULL; //only leading periods
+
+    int n = 0;
+    for(; i<len && &name[i] != dot; i++) {
+        char c = name[i];
+        if(c == ' ' || c == '.') continue;
+        if(c >= 'a' && c <= 'z') c -= 0x20;
+        if((uint8_t)c >= 0x80) {
+            //skip the rest of a multibyte character.
+            while(i+1 < len && (name[i+1] & 0xC0) == 0x80) i++;
+            c = '_';
+        }
+        if(!_validShortChar(c)) c = '_';
+        if(n < 8) out[n++] = c;
+    }
+    if(n == 0) out[n++] = '_';
+
+    if(dot) {
+        n = 0;
+        for(i = (dot - name) + 1; i<len && n<3; i++) {
+            char c = name[i];
+            if(c == ' ') continue;
+            if(c >= 'a' && c <= 'z') c -= 0x20;
+            if((uint8_t)c >= 0x80) {
+                while(i+1 < len && (name[i+1] & 0xC0) == 0x80) i++;
+                c = '_';
+            }
+            if(!_validShortChar(c)) c = '_';
+            out[8 + n++] = c;
+        }
+    }
+}
+
+static int _shortNameExists(FILE *blkdev, fat32_mbr *mbr, uint32_t parent,
+const char *name, uint32_t timeout) {
+    //check whether a directory already has an entry with this 8.3 name.
+    //returns 1 if so, 0 if not, or negative error code.
+    MicronFatDir *dir = (MicronFatDir*)malloc(sizeof(MicronFatDir));
+    if(!dir) return -ENOMEM;
+    int err = fatOpenDir(mbr, parent, dir);
+    while(!err) {
+        const fat32_dirent *ent;
+        err = fatReadDirRaw(blkdev, mbr, dir, &ent, timeout);
+        if(err) break;
+        if(ent->shortName[0] == 0x00) break; //end of directory
+        if(ent->attributes == 0x0F || (uint8_t)ent->shortName[0] == 0xE5) {
+            continue;
+        }
+        if(!memcmp(ent->shortName, name, 11)) {
+            err = 1;
+            break;
+        }
+    }
+    free(dir);
+    return (err == -ENOENT) ? 0 : err;
+}
+
+static int _makeShortAlias(FILE *blkdev, fat32_mbr *mbr, uint32_t parent,
+const char *name, size_t len, char *out, uint32_t timeout) {
+    //generate a unique 8.3 alias for a long name, eg "LONGFI~1.TXT".
+    char basis[11];
+    _makeBasisName(name, len, basis);
+    int baseLen = 8;
+    while(baseLen > 0 && basis[baseLen-1] == ' ') baseLen--;
+
+    for(uint32_t n=1; n<1000000; n++) {
+        char tail[8];
+        int tailLen = sprintf(tail, "~%lu", n);
+        int keep = baseLen;
+        if(keep + tailLen > 8) keep = 8 - tailLen;
+        memcpy(out, basis, 11);
+        memcpy(&out[keep], tail, tailLen);
+        for(int i = keep + tailLen; i<8; i++) out[i] = ' ';
+
+        int err = _shortNameExists(blkdev, mbr, parent, out, timeout);
+        if(err <= 0) return err;
+    }
+    return -EEXIST;
+}
+
+
+/* ---------------------------- Directory entries ------------------------- */
+
+static int _extendDir(FILE *blkdev, fat32_mbr *mbr, uint32_t last,
+uint32_t *out, uint32_t timeout) {
+    //add a cluster to the end of a directory.
+    uint32_t cluster;
+    int err = fatAllocCluster(blkdev, mbr, 0, &cluster, timeout);
+    if(err < 0) return err;
+
+    //zero it before linking it, so it's never seen with junk in it.
+    err = _zeroCluster(blkdev, mbr, cluster);
+    if(!err) err = fatCacheFlush(blkdev, mbr, timeout);
+    if(!err) err = fatSetFatEntry(blkdev, mbr, last, cluster, timeout);
+    if(!err) err = fatCacheFlush(blkdev, mbr, timeout);
+    if(err < 0) {
+        fatFreeChain(blkdev, mbr, cluster, timeout);
+        return err;
+    }
+    *out = cluster;
+    return 0;
+}
+
+static int _findSlots(FILE *blkdev, fat32_mbr *mbr, uint32_t parent,
+int count, uint64_t *positions, uint32_t timeout) {
+    //find `count` consecutive unused entries in a directory, extending it
+    //if needed. `positions` receives their locations, as in micronDirent.
+    MicronFatDir *dir = (MicronFatDir*)malloc(sizeof(MicronFatDir));
+    if(!dir) return -ENOMEM;
+    int err = fatOpenDir(mbr, parent, dir);
+    int run = 0;
+    bool pastEnd = false; //everything after the end marker is unused
+    while(!err) {
+        const fat32_dirent *ent;
+        err = fatReadDirRaw(blkdev, mbr, dir, &ent, timeout);
+        if(err) break;
+        uint8_t first = ent->shortName[0];
+        if(first == 0x00) pastEnd = true;
+        if(pastEnd || first == 0xE5) {
+            positions[run++] = (dir->entSector * FAT_SECTOR_SIZE) +
+                dir->entOffset;
+            if(run == count) break;
+        }
+        else run = 0;
+    }
+
+    //if there isn't enough room, add clusters to the directory.
+    //the run can continue from the end of the last one.
+    uint32_t last = dir->cluster;
+    free(dir);
+    if(err == -ENOENT) err = 0;
+    while(!err && run < count) {
+        err = _extendDir(blkdev, mbr, last, &last, timeout);
+        if(err) break;
+        uint64_t sector = fatClusterToSector(mbr, last);
+        uint32_t num = mbr->sectorsPerCluster * ENTRIES_PER_SECTOR;
+        for(uint32_t i=0; i<num && run < count; i++) {
+            positions[run++] = (sector * FAT_SECTOR_SIZE) +
+                (i * sizeof(fat32_dirent));
+        }
+    }
+    return err;
+}
+
+static int _writeEntries(FILE *blkdev, fat32_mbr *mbr,
+const uint64_t *positions, const fat32_dirent *entries, int count) {
+    //write directory entries, one sector at a time, in order.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    for(int i=0; i<count; ) {
+        uint64_t sector = positions[i] / FAT_SECTOR_SIZE;
+        int err = _fatReadSector(blkdev, sector, buf);
+        if(err < 0) return err;
+        for(; i<count && positions[i] / FAT_SECTOR_SIZE == sector; i++) {
+            memcpy(&buf[positions[i] % FAT_SECTOR_SIZE], &entries[i],
+                sizeof(fat32_dirent));
+        }
+        err = _fatWriteSector(blkdev, sector, buf);
+        if(err < 0) return err;
+        fatViewUpdate(mbr, sector, 1, buf);
+    }
+    return 0;
+}
+
+static int _deleteEntries(FILE *blkdev, fat32_mbr *mbr,
+const uint64_t *positions, int count) {
+    //mark directory entries as deleted, one sector at a time, in order.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    for(int i=0; i<count; ) {
+        uint64_t sector = positions[i] / FAT_SECTOR_SIZE;
+        int err = _fatReadSector(blkdev, sector, buf);
+        if(err < 0) return err;
+        for(; i<count && positions[i] / FAT_SECTOR_SIZE == sector; i++) {
+            buf[positions[i] % FAT_SECTOR_SIZE] = 0xE5;
+        }
+        err = _fatWriteSector(blkdev, sector, buf);
+        if(err < 0) return err;
+        fatViewUpdate(mbr, sector, 1, buf);
+    }
+    return 0;
+}
+
+static int _checkNew(FILE *blkdev, fat32_mbr *mbr, const char *path,
+micronDirent *parent, const char **outName, size_t *outLen,
+uint32_t timeout) {
+    //find the directory a new entry goes in, and check that the name is
+    //valid and not already used there.
+    const char *name;
+    int err = fatLookupParent(blkdev, mbr, path, parent, &name, timeout);
+    if(err) return err;
+    size_t len = 0;
+    while(name[len] && name[len] != '/') len++;
+    if(name[len-1] == '.' || name[len-1] == ' ') {
+        return -EINVAL; //includes "." and ".."
+    }
+
+    uint32_t parentCluster = parent->cluster;
+    err = fatLookup(blkdev, mbr, parentCluster, name, len, parent, timeout);
+    if(err == 0) return -EEXIST;
+    if(err != -ENOENT) return err;
+    parent->cluster = parentCluster; //fatLookup clobbered it
+    *outName = name;
+    *outLen  = len;
+    return 0;
+}
+
+static int _createEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t parent,
+const char *name, size_t len, uint8_t attributes, uint32_t cluster,
+micronDirent *out, uint32_t timeout) {
+    //add an entry to a directory. the name must not already exist.
+    fat32_dirent entries[MAX_ENTRIES];
+    uint64_t positions[MAX_ENTRIES];
+    uint16_t lfn[MAX_NAME];
+    int numLfn = 0, lfnLen = 0;
+
+    fat32_dirent ent;
+    memset(&ent, 0, sizeof(ent));
+    if(!_fitsShortName(name, len, &ent)) {
+        //needs a long name.
+        lfnLen = _utf8ToUtf16(name, len, lfn);
+        if(lfnLen < 0) return lfnLen;
+        numLfn = (lfnLen + 12) / 13;
+        ent.extAttributes = 0;
+        int err = _makeShortAlias(blkdev, mbr, parent, name, len,
+            ent.shortName, timeout);
+        if(err) return err;
+    }
+    else {
+        for(size_t i=0; i<len; i++) {
+            if(!_validLongChar(name[i])) return -EINVAL;
+        }
+    }
+
+    uint16_t date, time;
+    _now(&date, &time);
+    ent.attributes     = attributes;
+    ent.createTime     = time;
+    ent.createDate     = date;
+    ent.accessDate     = date;
+    ent.modifyTime     = time;
+    ent.modifyDate     = date;
+    ent.startClusterHi = cluster >> 16;
+    ent.startClusterLo = cluster & 0xFFFF;
+    ent.size           = 0;
+
+    //LFN entries go first, in reverse order.
+    uint8_t checksum = fatShortNameChecksum(ent.shortName);
+    for(int i=0; i<numLfn; i++) {
+        int seq = numLfn - i;
+        vfat_lfn *l = (vfat_lfn*)&entries[i];
+        memset(l, 0, sizeof(vfat_lfn));
+        l->seq        = seq | (i == 0 ? 0x40 : 0);
+        l->attributes = 0x0F;
+        l->checksum   = checksum;
+        uint16_t chars[13];
+        for(int j=0; j<13; j++) {
+            int c = ((seq - 1) * 13) + j;
+            if(c < lfnLen) chars[j] = lfn[c];
+            else if(c == lfnLen) chars[j] = 0x0000; //terminator
+            else chars[j] = 0xFFFF; //padding
+        }
+        for(int j=0; j<5; j++) l->name0[j] = chars[j];
+        for(int j=0; j<6; j++) l->name1[j] = chars[j+5];
+        for(int j=0; j<2; j++) l->name2[j] = chars[j+11];
+    }
+    entries[numLfn] = ent;
+
+    //the 8.3 entry comes last, so if power is lost partway through, any
+    //LFN entries already written are orphans, which are ignored.
+    int err = _findSlots(blkdev, mbr, parent, numLfn + 1, positions, timeout);
+    if(!err) err = _writeEntries(blkdev, mbr, positions, entries, numLfn + 1);
+    if(err) return err;
+
+    out->attributes = ent.attributes | (ent.extAttributes << 8);
+    out->cluster    = cluster;
+    out->size       = 0;
+    out->createTime = 0;
+    out->accessTime = 0;
+    out->modifyTime = 0;
+    out->entryPos   = positions[numLfn];
+    if(len >= sizeof(out->name)) len = sizeof(out->name) - 1;
+    memcpy(out->name, name, len);
+    out->name[len] = '\0';
+    return 0;
+}
+
+static int _updateEntry(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file) {
+    //write a file's first cluster and size to its directory entry.
+    uint8_t buf[FAT_SECTOR_SIZE];
+    uint64_t sector = file->entryPos / FAT_SECTOR_SIZE;
+    int err = _fatReadSector(blkdev, sector, buf);
+    if(err < 0) return err;
+
+    fat32_dirent *ent = (fat32_dirent*)&buf[file->entryPos % FAT_SECTOR_SIZE];
+    uint16_t date, time;
+    _now(&date, &time);
+    ent->startClusterHi = file->firstCluster >> 16;
+    ent->startClusterLo = file->firstCluster & 0xFFFF;
+    ent->size           = file->size;
+    ent->modifyTime     = time;
+    ent->modifyDate     = date;
+    ent->accessDate     = date;
+    ent->attributes    |= FAT_ATTR_ARCHIVE;
+    err = _fatWriteSector(blkdev, sector, buf);
+    if(err < 0) return err;
+    fatViewUpdate(mbr, sector, 1, buf);
+    fatDentryInvalidateEntry(mbr, file->entryPos);
+    return 0;
+}
+
+
+static int _findEntry(FILE *blkdev, fat32_mbr *mbr, uint32_t parent,
+uint64_t target, MicronFatDir *dir, uint64_t *positions, int *count,
+uint32_t timeout) {
+    //find the locations of a directory entry and its LFN entries. they
+    //come immediately before it, and only count if their checksum matches.
+    uint8_t checksums[FAT_LFN_MAX_ENTRIES];
+    int numLfn = 0;
+    int err = fatOpenDir(mbr, parent, dir);
+    while(!err) {
+        const fat32_dirent *ent;
+        err = fatReadDirRaw(blkdev, mbr, dir, &ent, timeout);
+        if(err) break;
+        uint64_t pos = (dir->entSector * FAT_SECTOR_SIZE) + dir->entOffset;
+        uint8_t first = ent->shortName[0];
+        if(first == 0x00) return -ENOENT;
+        if(first != 0xE5 && ent->attributes == 0x0F) {
+            const vfat_lfn *lfn = (const vfat_lfn*)ent;
+            if(lfn->seq & 0x40) numLfn = 0; //start of a new name
+            if(numLfn < FAT_LFN_MAX_ENTRIES) {
+                checksums[numLfn] = lfn->checksum;
+                positions[numLfn++] = pos;
+            }
+            continue;
+        }
+        if(pos == target) {
+            uint8_t sum = fatShortNameChecksum(ent->shortName);
+            int n = 0;
+            for(int i=0; i<numLfn; i++) {
+                if(checksums[i] == sum) positions[n++] = positions[i];
+            }
+            positions[n++] = pos;
+            *count = n;
+            return 0;
+        }
+        numLfn = 0;
+    }
+    return err;
+}
+
+
+/* ------------------------------ File contents --------------------------- */
+
+static int _getCluster(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t idx, uint32_t *outCluster, uint32_t *outRun, uint32_t timeout) {
+    //find a cluster of a file, allocating it if it's one past the end.
+    int err = fatMapCluster(blkdev, mbr, file, idx, outCluster, outRun,
+        timeout);
+    if(err != -ERANGE) return err;
+
+    uint32_t prev = 0, run;
+    if(idx > 0) {
+        err = fatMapCluster(blkdev, mbr, file, idx - 1, &prev, &run, timeout);
+        if(err) return (err == -ERANGE) ? -EIO : err; //shorter than size
+    }
+    err = fatAllocCluster(blkdev, mbr, prev, outCluster, timeout);
+    if(err) return err;
+    if(idx == 0) file->firstCluster = *outCluster;
+    fatMapAppend(file, *outCluster);
+    *outRun = 1;
+    return 0;
+}
+
+static int _append(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+const uint8_t *data, uint32_t size, uint32_t timeout) {
+    //write data to the end of a file, allocating clusters as needed,
+    //without updating its directory entry. if `data` is NULL, write zeros.
+    uint32_t clusterSize = mbr->sectorsPerCluster * FAT_SECTOR_SIZE;
+    uint32_t done = 0;
+    while(done < size) {
+        uint32_t offset = file->size;
+        uint32_t cluster, run;
+        int err = _getCluster(blkdev, mbr, file, offset / clusterSize,
+            &cluster, &run, timeout);
+        if(err) return err;
+
+        uint32_t within = offset % clusterSize;
+        uint64_t sector = fatClusterToSector(mbr, cluster) +
+            (within / FAT_SECTOR_SIZE);
+        uint32_t secOffs = within % FAT_SECTOR_SIZE;
+        uint32_t remain  = size - done;
+        uint32_t count;
+
+        if(secOffs || remain < FAT_SECTOR_SIZE || !data) {
+            //partial sector (or zeros), so go through a buffer.
+            uint8_t buf[FAT_SECTOR_SIZE];
+            if(secOffs) {
+                err = _fatReadSector(blkdev, sector, buf);
+                if(err < 0) return err;
+            }
+            count = FAT_SECTOR_SIZE - secOffs;
+            if(count > remain) count = remain;
+            if(data) memcpy(&buf[secOffs], &data[done], count);
+            else memset(&buf[secOffs], 0, count);
+            //anything after the end of the file is left as zeros.
+            memset(&buf[secOffs + count], 0,
+                FAT_SECTOR_SIZE - (secOffs + count));
+            err = _fatWriteSector(blkdev, sector, buf);
+            if(err < 0) return err;
+            fatViewUpdate(mbr, sector, 1, buf);
+        }
+        else {
+            //whole sectors, straight from the caller's buffer, up to the
+            //end of the contiguous run we know of.
+            uint32_t avail = (run * mbr->sectorsPerCluster) -
+                (within / FAT_SECTOR_SIZE);
+            uint32_t sectors = remain / FAT_SECTOR_SIZE;
+            if(sectors > avail) sectors = avail;
+            err = _fatWriteSectors(blkdev, sector, sectors, &data[done]);
+            if(err < 0) return err;
+            fatViewUpdate(mbr, sector, sectors, &data[done]);
+            count = sectors * FAT_SECTOR_SIZE;
+        }
+        file->size += count;
+        done       += count;
+    }
+    return 0;
+}
+
+static int _commit(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t timeout) {
+    //make a file's changes permanent: its clusters must be linked on disk
+    //before its directory entry refers to them.
+    int err = fatCacheFlush(blkdev, mbr, timeout);
+    if(err) return err;
+    return _updateEntry(blkdev, mbr, file);
+}
+
+
+/* ---------------------------------- API --------------------------------- */
+
+int fatCreate(FILE *blkdev, fat32_mbr *mbr, const char *path,
+uint8_t attributes, MicronFatFile *out, uint16_t maxExtents,
+uint32_t timeout) {
+    /** Create an empty file.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param path The file's path, eg "/logs/0001.csv".
+     *   The directory must already exist.
+     *  @param attributes FAT_ATTR_* for the file. Only READONLY, HIDDEN,
+     *   SYSTEM and ARCHIVE are allowed.
+     *  @param out Receives the file state; see fatOpenFile().
+     *  @param maxExtents Maximum number of extents to remember.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EEXIST if the name is already used, -EINVAL if
+     *   it's not a valid name, -ENOSPC if the directory can't be extended,
+     *   or other negative error code on failure.
+     *  @note Call fatCloseFile() when done.
+     */
+    if(attributes & ~(FAT_ATTR_READONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM
+    | FAT_ATTR_ARCHIVE)) return -EINVAL;
+    if(!mbr->_micron_alloc) return -EROFS;
+
+    micronDirent *dirent = (micronDirent*)malloc(sizeof(micronDirent));
+    if(!dirent) return -ENOMEM;
+    const char *name;
+    size_t len;
+    int err = _checkNew(blkdev, mbr, path, dirent, &name, &len, timeout);
+    if(!err) err = _createEntry(blkdev, mbr, dirent->cluster, name, len,
+        attributes | FAT_ATTR_ARCHIVE, 0, dirent, timeout);
+    if(!err) err = fatOpenFile(dirent, out, maxExtents);
+    free(dirent);
+    return err;
+}
+
+
+int fatMkdir(FILE *blkdev, fat32_mbr *mbr, const char *path,
+uint32_t timeout) {
+    /** Create a directory.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param path The directory's path. Its parent must already exist.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EEXIST if the name is already used, or other
+     *   negative error code on failure.
+     */
+    if(!mbr->_micron_alloc) return -EROFS;
+    micronDirent *dirent = (micronDirent*)malloc(sizeof(micronDirent));
+    if(!dirent) return -ENOMEM;
+    const char *name;
+    size_t len;
+    int err = _checkNew(blkdev, mbr, path, dirent, &name, &len, timeout);
+    if(err) {
+        free(dirent);
+        return err;
+    }
+    uint32_t parent = dirent->cluster;
+
+    //set up the new directory's cluster first, with "." and "..".
+    uint32_t cluster;
+    err = fatAllocCluster(blkdev, mbr, 0, &cluster, timeout);
+    if(err) {
+        free(dirent);
+        return err;
+    }
+    err = _zeroCluster(blkdev, mbr, cluster);
+    if(!err) {
+        uint16_t date, time;
+        _now(&date, &time);
+        fat32_dirent dots[2];
+        uint64_t positions[2];
+        memset(dots, 0, sizeof(dots));
+        for(int i=0; i<2; i++) {
+            //".." refers to the root directory as cluster 0.
+            uint32_t c = i ? (parent == mbr->rootCluster ? 0 : parent)
+                : cluster;
+            memset(dots[i].shortName, ' ', 11);
+            memset(dots[i].shortName, '.', i+1);
+            dots[i].attributes     = FAT_ATTR_DIRECTORY;
+            dots[i].createTime     = time;
+            dots[i].createDate     = date;
+            dots[i].accessDate     = date;
+            dots[i].modifyTime     = time;
+            dots[i].modifyDate     = date;
+            dots[i].startClusterHi = c >> 16;
+            dots[i].startClusterLo = c & 0xFFFF;
+            positions[i] = (fatClusterToSector(mbr, cluster) *
+                FAT_SECTOR_SIZE) + (i * sizeof(fat32_dirent));
+        }
+        err = _writeEntries(blkdev, mbr, positions, dots, 2);
+    }
+    if(!err) err = fatCacheFlush(blkdev, mbr, timeout);
+
+    //then add it to its parent.
+    if(!err) err = _createEntry(blkdev, mbr, parent, name, len,
+        FAT_ATTR_DIRECTORY, cluster, dirent, timeout);
+    if(err) fatFreeChain(blkdev, mbr, cluster, timeout);
+    free(dirent);
+    if(err) return err;
+    return fatSync(blkdev, mbr, timeout);
+}
+
+
+int fatDelete(FILE *blkdev, fat32_mbr *mbr, const char *path,
+uint32_t timeout) {
+    /** Delete a file or empty directory.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param path The path to delete.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -ENOENT if not found, -ENOTEMPTY if it's a
+     *   directory that isn't empty, or other negative error code on failure.
+     *  @note Don't delete a file that's open.
+     */
+    if(!mbr->_micron_alloc) return -EROFS;
+    micronDirent *dirent = (micronDirent*)malloc(sizeof(micronDirent));
+    MicronFatDir *dir = (MicronFatDir*)malloc(sizeof(MicronFatDir));
+    int err = (dirent && dir) ? 0 : -ENOMEM;
+
+    const char *name;
+    uint32_t parent = 0;
+    if(!err) err = fatLookupParent(blkdev, mbr, path, dirent, &name, timeout);
+    if(!err) {
+        parent = dirent->cluster;
+        size_t len = 0;
+        while(name[len] && name[len] != '/') len++;
+        if(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+            err = -EINVAL;
+        }
+        else err = fatLookup(blkdev, mbr, parent, name, len, dirent, timeout);
+    }
+    if(!err && !dirent->entryPos) err = -EBUSY; //root directory
+
+    uint64_t target = 0;
+    uint32_t cluster = 0;
+    bool isDir = false;
+    if(!err) {
+        target  = dirent->entryPos;
+        cluster = dirent->cluster;
+        isDir   = dirent->attributes & FAT_ATTR_DIRECTORY;
+    }
+
+    //a directory must be empty, apart from "." and "..".
+    if(isDir) {
+        err = fatOpenDir(mbr, cluster, dir);
+        while(!err) {
+            err = fatReadDirNext(blkdev, mbr, dir, dirent, timeout);
+            if(!err && strcmp(dir->shortName, ".")
+            && strcmp(dir->shortName, "..")) err = -ENOTEMPTY;
+        }
+        if(err == -ENOENT) err = 0;
+    }
+
+    uint64_t positions[MAX_ENTRIES];
+    int count = 0;
+    if(!err) err = _findEntry(blkdev, mbr, parent, target, dir, positions,
+        &count, timeout);
+    if(dirent) free(dirent);
+    if(dir) free(dir);
+    if(err) return err;
+
+    //remove the 8.3 entry first, so that it's gone in one write.
+    err = _deleteEntries(blkdev, mbr, &positions[count-1], 1);
+    if(!err && count > 1) err = _deleteEntries(blkdev, mbr, positions, count-1);
+    fatDentryInvalidateDir(mbr, parent);
+    if(isDir) fatDentryInvalidateDir(mbr, cluster);
+    if(err) return err;
+
+    //now nothing refers to its clusters, so they can be freed.
+    if(cluster >= 2) err = fatFreeChain(blkdev, mbr, cluster, timeout);
+    if(!err) err = fatSync(blkdev, mbr, timeout);
+    return err;
+}
+
+
+int fatAppendFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+const void *data, uint32_t size, uint32_t timeout) {
+    /** Write to the end of a file.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param file The file, from fatCreate() or fatOpenFile().
+     *  @param data Data to write.
+     *  @param size Number of bytes to write.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, or negative error code on failure.
+     *   On failure the file is unchanged, apart from possibly some lost
+     *   clusters.
+     *  @note The directory entry is updated before this returns, so the data
+     *   is safe from power loss. Writing in multiples of the sector size
+     *   (512 bytes) is much faster.
+     */
+    if(!file->entryPos || !mbr->_micron_alloc) return -EROFS;
+    if(size > 0xFFFFFFFF - file->size) return -EFBIG;
+    if(!size) return 0;
+
+    uint32_t oldSize = file->size, oldCluster = file->firstCluster;
+    int err = _append(blkdev, mbr, file, (const uint8_t*)data, size, timeout);
+    if(!err) err = _commit(blkdev, mbr, file, timeout);
+    if(err) {
+        //the directory entry still has the old values.
+        file->size         = oldSize;
+        file->firstCluster = oldCluster;
+        fatMapReset(file);
+        return err;
+    }
+    return size;
+}
+
+
+int fatWriteFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t offset, uint32_t size, const void *data, uint32_t timeout) {
+    /** Overwrite part of a file.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR.
+     *  @param file The file, from fatOpenFile().
+     *  @param offset Byte offset to write at.
+     *  @param size Number of bytes to write.
+     *  @param data Data to write.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, which is less than `size` if the end
+     *   of the file is reached, or negative error code on failure.
+     *  @note This never changes the file's size, cluster chain or directory
+     *   entry, nor anything else but the data itself, so it doesn't need
+     *   fatMount() (fatGetMBR() is enough) and is as safe as the device's
+     *   own writes. Use fatAppendFile() to grow a file.
+     *   Whole sectors are written directly from `data`, as many at once as
+     *   are contiguous on the disk, even across clusters. Only a partial
+     *   sector at the start or end is read and rewritten. Calling
+     *   fatMapFile() first avoids reading the FAT during the write.
+     */
+    const uint8_t *src = (const uint8_t*)data;
+    uint32_t spc = mbr->sectorsPerCluster;
+    uint32_t clusterSize = spc * FAT_SECTOR_SIZE;
+    if(offset >= file->size) return 0;
+    size = MIN(size, file->size - offset);
+
+    uint32_t done = 0;
+    while(done < size) {
+        uint32_t pos = offset + done;
+        uint32_t remain = size - done;
+        uint32_t idx = pos / clusterSize;
+        uint32_t cluster, run;
+        int err = fatMapCluster(blkdev, mbr, file, idx, &cluster, &run,
+            timeout);
+        if(err == -ERANGE) break; //chain is shorter than file size
+        if(err < 0) return err;
+
+        uint32_t secInCluster = (pos % clusterSize) / FAT_SECTOR_SIZE;
+        uint64_t sector = fatClusterToSector(mbr, cluster) + secInCluster;
+        uint32_t part = pos % FAT_SECTOR_SIZE;
+
+        if(part || remain < FAT_SECTOR_SIZE) {
+            //partial sector; merge with what's already there.
+            uint32_t len = MIN(remain, FAT_SECTOR_SIZE - part);
+            uint8_t buffer[FAT_SECTOR_SIZE];
+            err = _fatReadSector(blkdev, sector, buffer);
+            if(err < 0) return err;
+            memcpy(&buffer[part], &src[done], len);
+            err = _fatWriteSector(blkdev, sector, buffer);
+            if(err < 0) return err;
+            fatViewUpdate(mbr, sector, 1, buffer);
+            done += len;
+            continue;
+        }
+
+        //extend the run across following contiguous clusters.
+        uint32_t want = remain / FAT_SECTOR_SIZE; //whole sectors needed
+        while((run * spc) - secInCluster < want) {
+            uint32_t next, nextRun;
+            err = fatMapCluster(blkdev, mbr, file, idx + run, &next,
+                &nextRun, timeout);
+            if(err == -ERANGE) break;
+            if(err < 0) return err;
+            if(next != cluster + run) break; //fragmented here
+            run += nextRun;
+        }
+
+        //write all of them straight from the source.
+        uint32_t count = MIN(want, (run * spc) - secInCluster);
+        err = _fatWriteSectors(blkdev, sector, count, &src[done]);
+        if(err < 0) return err;
+        fatViewUpdate(mbr, sector, count, &src[done]);
+        done += count * FAT_SECTOR_SIZE;
+    }
+    return done;
+}
+
+
+int fatTruncateFile(FILE *blkdev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t size, uint32_t timeout) {
+    /** Change the size of a file.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param file The file.
+     *  @param size The new size, in bytes. If it's larger than the current
+     *   size, the file is extended with zeros.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    if(!file->entryPos || !mbr->_micron_alloc) return -EROFS;
+    if(size == file->size) return 0;
+    if(size > file->size) {
+        uint32_t oldSize = file->size, oldCluster = file->firstCluster;
+        int err = _append(blkdev, mbr, file, NULL, size - file->size,
+            timeout);
+        if(!err) err = _commit(blkdev, mbr, file, timeout);
+        if(err) {
+            file->size         = oldSize;
+            file->firstCluster = oldCluster;
+            fatMapReset(file);
+        }
+        return err;
+    }
+
+    //find the chain that's no longer needed.
+    uint32_t clusterSize = mbr->sectorsPerCluster * FAT_SECTOR_SIZE;
+    uint32_t keep = (size + clusterSize - 1) / clusterSize;
+    uint32_t tail = 0, drop = file->firstCluster;
+    if(keep) {
+        uint32_t run;
+        int err = fatMapCluster(blkdev, mbr, file, keep - 1, &tail, &run,
+            timeout);
+        if(err) return (err == -ERANGE) ? -EIO : err;
+        err = fatGetNextCluster(blkdev, mbr, tail, timeout);
+        if(err < 0) return err;
+        drop = err;
+    }
+
+    //shrink the directory entry first; then end the chain at the new last
+    //cluster; then free the rest.
+    file->size = size;
+    if(!keep) file->firstCluster = 0;
+    fatMapReset(file);
+    int err = _updateEntry(blkdev, mbr, file);
+    if(err) return err;
+    if(tail && drop) {
+        err = fatSetFatEntry(blkdev, mbr, tail, FAT_CLUSTER_EOC, timeout);
+        if(!err) err = fatCacheFlush(blkdev, mbr, timeout);
+        if(err) return err;
+    }
+    if(drop >= 2) err = fatFreeChain(blkdev, mbr, drop, timeout);
+    if(!err) err = fatSync(blkdev, mbr, timeout);
+    return err;
+}
+
+
+int fatSync(FILE *blkdev, fat32_mbr *mbr, uint32_t timeout) {
+    /** Write all pending changes to disk.
+     *  @param blkdev Block device to write to.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This is called by fatUnmount().
+     */
+    int err = fatCacheFlush(blkdev, mbr, timeout);
+    if(!err) err = fatSyncFsInfo(blkdev, mbr, timeout);
+    return err;
+}
@@ -0,0 +1,374 @@
+//Record store: a crash-safe log on a raw partition.
+//Records are packed into sectors, which are buffered and written a batch
+//at a time, in order, wrapping around to the start of the partition when
+//the end is reached. Each sector carries its own sequence number and CRC,
+//and sequence number N always goes in sector N % numSectors, so the
+//partition needs no other metadata. At mount, we find where writing left
+//off with a binary search: the newest sectors are at the start of the
+//partition, and their sequence numbers are one "lap" ahead of the older
+//ones after them.
+//Losing power can only damage the batch being written, which is the one
+//right after the newest sector; such sectors fail their CRC check, and
+//are overwritten by the next batch.
+extern "C" {
+    #include <micron.h>
+    #include "recstore.h"
+}
+
+#define HEADER_SIZE sizeof(recstore_header)
+#define SPACE (RECSTORE_SECTOR_SIZE - HEADER_SIZE) //bytes for records
+
+static int _readSector(MicronRecStore *store, uint32_t pos, uint8_t *out) {
+    //read the sector at position `pos` of the partition.
+    int err = fseek(store->blkdev,
+        (store->start + pos) * RECSTORE_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) return err;
+    err = read(store->blkdev, out, RECSTORE_SECTOR_SIZE);
+    return (err < 0) ? err : 0;
+}
+
+static int _writeSectors(MicronRecStore *store, uint32_t pos, uint32_t count,
+const uint8_t *data) {
+    //write several consecutive sectors in one request.
+    int err = fseek(store->blkdev,
+        (store->start + pos) * RECSTORE_SECTOR_SIZE, SEEK_SET);
+    if(err < 0) return err;
+    err = write(store->blkdev, data, count * RECSTORE_SECTOR_SIZE);
+    return (err < 0) ? err : 0;
+}
+
+static uint32_t _sectorCrc(uint8_t *sector) {
+    //compute the CRC of a sector, which is stored in its header.
+    recstore_header *hdr = (recstore_header*)sector;
+    uint32_t saved = hdr->crc;
+    hdr->crc = 0;
+    uint32_t crc = crc32(sector, RECSTORE_SECTOR_SIZE);
+    hdr->crc = saved;
+    return crc;
+}
+
+static bool _isValid(MicronRecStore *store, uint32_t pos, uint8_t *sector) {
+    //check whether a sector was completely written, by us, for position
+    //`pos`.
+    recstore_header *hdr = (recstore_header*)sector;
+    if(hdr->magic != RECSTORE_MAGIC) return false;
+    if(hdr->seq % store->numSectors != pos) return false;
+    if(hdr->used > SPACE || hdr->count > hdr->used / sizeof(uint16_t)) {
+        return false;
+    }
+    return hdr->crc == _sectorCrc(sector);
+}
+
+static int _probe(MicronRecStore *store, uint32_t pos, int step,
+uint8_t *buf, uint32_t *outPos) {
+    //find a valid sector near `pos`, looking in direction `step` (1 or -1)
+    //past at most one batch of damaged ones. returns 1 if found, 0 if not,
+    //or negative error code.
+    for(uint32_t i=0; i <= store->batchSectors; i++) {
+        int err = _readSector(store, pos, buf);
+        if(err) return err;
+        if(_isValid(store, pos, buf)) {
+            *outPos = pos;
+            return 1;
+        }
+        pos += step;
+    }
+    return 0;
+}
+
+static int _findHead(MicronRecStore *store, uint8_t *buf) {
+    //find the newest sector, and set nextSeq to follow it.
+    uint32_t n = store->numSectors;
+    uint32_t posA, posB;
+    int foundA = _probe(store, 0, 1, buf, &posA);
+    if(foundA < 0) return foundA;
+    uint64_t lapA = ((recstore_header*)buf)->seq - posA; //seq of sector 0
+    int foundB = _probe(store, n - 1, -1, buf, &posB);
+    if(foundB < 0) return foundB;
+    uint64_t seqB = ((recstore_header*)buf)->seq;
+
+    if(!foundA && !foundB) { //empty
+        store->nextSeq = 0;
+        return 0;
+    }
+    if(!foundA || (foundB && seqB - posB >= lapA)) {
+        //the end of the partition is as new as the start, so it wrapped
+        //around (or the first batch of a lap was damaged).
+        store->nextSeq = seqB + 1;
+        return 0;
+    }
+
+    //sectors [0, lo] are from the newest lap, and [hi, n) aren't.
+    uint32_t lo = posA;
+    uint32_t hi = foundB ? posB : n;
+    while(hi - lo > 1) {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        int err = _readSector(store, mid, buf);
+        if(err) return err;
+        if(_isValid(store, mid, buf)
+        && ((recstore_header*)buf)->seq == lapA + mid) lo = mid;
+        else hi = mid;
+    }
+    store->nextSeq = lapA + lo + 1;
+    return 0;
+}
+
+static int _findNextRecord(MicronRecStore *store, uint8_t *buf) {
+    //find the number of the next record from the newest sector.
+    //_findHead() only settles on a sector it found intact, so there's no
+    //need to look back past damaged ones here.
+    store->nextRecord = 0;
+    if(store->nextSeq == 0) return 0; //empty
+    uint32_t pos = (store->nextSeq - 1) % store->numSectors;
+    int err = _readSector(store, pos, buf);
+    if(err) return err;
+    recstore_header *hdr = (recstore_header*)buf;
+    if(!_isValid(store, pos, buf) || hdr->seq != store->nextSeq - 1) {
+        return -EILSEQ; //can't happen, unless the card changed under us
+    }
+    store->nextRecord = hdr->firstRecord + hdr->count;
+    return 0;
+}
+
+static int _writeBatch(MicronRecStore *store) {
+    //write out the buffered sectors.
+    if(!store->numBuffered) return 0;
+    for(uint16_t i=0; i < store->numBuffered; i++) {
+        uint8_t *sector = &store->buffer[i * RECSTORE_SECTOR_SIZE];
+        ((recstore_header*)sector)->crc = _sectorCrc(sector);
+    }
+    int err = _writeSectors(store, store->nextSeq % store->numSectors,
+        store->numBuffered, store->buffer);
+    if(err) return err;
+
+    store->nextSeq += store->numBuffered;
+    store->numBuffered = 0;
+    if(store->nextSeq > store->numSectors) {
+        store->oldestSeq = store->nextSeq - store->numSectors;
+    }
+    return 0;
+}
+
+
+int recStoreMount(FILE *blkdev, uint64_t start, uint32_t numSectors,
+uint16_t batchSectors, MicronRecStore *out, uint32_t timeout) {
+    /** Prepare to use a range of sectors as a record store.
+     *  @param blkdev Block device to use.
+     *  @param start First sector to use.
+     *  @param numSectors Number of sectors to use.
+     *  @param batchSectors How many sectors to buffer and write at once;
+     *   0 for RECSTORE_DEFAULT_BATCH.
+     *  @param out Receives the record store state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Any sectors that aren't already part of a record store are
+     *   treated as empty, so there's no need to format. This reads about
+     *   log2(numSectors) sectors. Call recStoreClose() when done.
+     */
+    if(!batchSectors) batchSectors = RECSTORE_DEFAULT_BATCH;
+    if(numSectors < 4 * (uint32_t)batchSectors) return -EINVAL;
+    memset(out, 0, sizeof(MicronRecStore));
+    out->blkdev       = blkdev;
+    out->start        = start;
+    out->numSectors   = numSectors;
+    out->batchSectors = batchSectors;
+    out->buffer = (uint8_t*)malloc(batchSectors * RECSTORE_SECTOR_SIZE);
+    if(!out->buffer) return -ENOMEM;
+
+    uint8_t *buf = out->buffer; //not needed until we append
+    int err = _findHead(out, buf);
+    if(!err) {
+        if(out->nextSeq > numSectors) {
+            out->oldestSeq = out->nextSeq - numSectors;
+        }
+        err = _findNextRecord(out, buf);
+    }
+    if(err) {
+        free(out->buffer);
+        out->buffer = NULL;
+        return err;
+    }
+
+    #if RECSTORE_DEBUG_PRINT
+        printf("recstore: %ld sectors, next seq %lld, next record %lld\r\n",
+            numSectors, out->nextSeq, out->nextRecord);
+    #endif
+    return 0;
+}
+
+
+int recStoreOpen(FILE *blkdev, int partition, uint16_t batchSectors,
+MicronRecStore *out, uint32_t timeout) {
+    /** Prepare to use a partition as a record store.
+     *  @param blkdev Block device to use.
+     *  @param partition Which partition (see ioGetPartition()). Its type
+     *   must be RECSTORE_PARTITION_TYPE.
+     *  @param batchSectors How many sectors to buffer and write at once;
+     *   0 for RECSTORE_DEFAULT_BATCH.
+     *  @param out Receives the record store state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EMEDIUMTYPE if the partition is of another
+     *   type, or other negative error code on failure.
+     */
+    MicronPartition part;
+    int err = ioGetPartition(blkdev, partition, &part);
+    if(err < 0) return err;
+    if(part.type != RECSTORE_PARTITION_TYPE) return -EMEDIUMTYPE;
+    if(part.size > 0xFFFFFFFF) part.size = 0xFFFFFFFF;
+    return recStoreMount(blkdev, part.sector, part.size, batchSectors, out,
+        timeout);
+}
+
+
+int recStoreClose(MicronRecStore *store, uint32_t timeout) {
+    /** Finish using a record store.
+     *  @param store The record store.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Buffered records are written first. The memory is freed even
+     *   if that fails.
+     */
+    int err = recStoreFlush(store, timeout);
+    if(store->buffer) free(store->buffer);
+    store->buffer = NULL;
+    return err;
+}
+
+
+int recStoreAppend(MicronRecStore *store, const void *data, uint16_t size,
+uint32_t timeout) {
+    /** Add a record.
+     *  @param store The record store.
+     *  @param data The record's contents.
+     *  @param size Length of the record, in bytes. At most
+     *   RECSTORE_MAX_RECORD.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, -EMSGSIZE if the record is too large, or other
+     *   negative error code on failure.
+     *  @note The record is buffered, and written once a batch of sectors is
+     *   full or recStoreFlush() is called. The record's number is the
+     *   value of `store->nextRecord` before calling this.
+     */
+    if(size > RECSTORE_MAX_RECORD) return -EMSGSIZE;
+    if(!store->buffer) return -EBADF;
+
+    uint8_t *sector = NULL; //the sector being filled
+    recstore_header *hdr = NULL;
+    if(store->numBuffered) {
+        sector = &store->buffer[
+            (store->numBuffered - 1) * RECSTORE_SECTOR_SIZE];
+        hdr = (recstore_header*)sector;
+    }
+    if(!hdr || hdr->used + sizeof(uint16_t) + size > SPACE) {
+        //start a new sector, writing the batch first if it's full. a
+        //batch never wraps around the end of the partition.
+        uint32_t room = store->numSectors -
+            (store->nextSeq % store->numSectors);
+        if(store->numBuffered >= MIN((uint32_t)store->batchSectors, room)) {
+            int err = _writeBatch(store);
+            if(err) return err;
+        }
+        sector = &store->buffer[store->numBuffered * RECSTORE_SECTOR_SIZE];
+        hdr = (recstore_header*)sector;
+        memset(sector, 0, RECSTORE_SECTOR_SIZE);
+        hdr->magic       = RECSTORE_MAGIC;
+        hdr->seq         = store->nextSeq + store->numBuffered;
+        hdr->firstRecord = store->nextRecord;
+        store->numBuffered++;
+    }
+
+    uint8_t *dest = &sector[HEADER_SIZE + hdr->used];
+    memcpy(dest, &size, sizeof(uint16_t));
+    memcpy(dest + sizeof(uint16_t), data, size);
+    hdr->used += sizeof(uint16_t) + size;
+    hdr->count++;
+    store->nextRecord++;
+    return 0;
+}
+
+
+int recStoreFlush(MicronRecStore *store, uint32_t timeout) {
+    /** Write any buffered records.
+     *  @param store The record store.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Once this returns, the records are safe from power loss. A
+     *   sector is never rewritten, so later records start a new sector;
+     *   flushing after every record uses a whole sector for each.
+     */
+    if(!store->buffer) return -EBADF;
+    return _writeBatch(store);
+}
+
+
+void recStoreRewind(MicronRecStore *store, MicronRecStoreCursor *cursor) {
+    /** Prepare to read a record store from the oldest record.
+     *  @param store The record store.
+     *  @param cursor Receives the read position.
+     */
+    cursor->seq    = store->oldestSeq;
+    cursor->index  = 0;
+    cursor->offset = HEADER_SIZE;
+    cursor->loaded = false;
+}
+
+
+int recStoreRead(MicronRecStore *store, MicronRecStoreCursor *cursor,
+void *out, uint16_t size, uint64_t *outRecord, uint32_t timeout) {
+    /** Read the next record.
+     *  @param store The record store.
+     *  @param cursor The read position, from recStoreRewind().
+     *  @param out Receives the record's contents.
+     *  @param size Size of `out`. Longer records are truncated.
+     *  @param outRecord Receives the record's number, if not NULL. Numbers
+     *   are consecutive, so a gap means records were lost (overwritten,
+     *   or damaged).
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Length of the record, or -ENOENT if there are no more
+     *   records, or other negative error code on failure.
+     *  @note Only records that have been written (see recStoreFlush()) are
+     *   read. The cursor can be used again after more are written.
+     */
+    while(true) {
+        if(cursor->seq < store->oldestSeq) { //overwritten; skip ahead
+            recStoreRewind(store, cursor);
+        }
+        if(cursor->seq >= store->nextSeq) return -ENOENT;
+
+        uint32_t pos = cursor->seq % store->numSectors;
+        recstore_header *hdr = (recstore_header*)cursor->buffer;
+        if(!cursor->loaded) {
+            int err = _readSector(store, pos, cursor->buffer);
+            if(err) return err;
+            if(!(_isValid(store, pos, cursor->buffer)
+            && hdr->seq == cursor->seq)) {
+                #if RECSTORE_DEBUG_PRINT
+                    printf("recstore: sector %lld is damaged\r\n",
+                        cursor->seq);
+                #endif
+                cursor->seq++;
+                continue;
+            }
+            cursor->loaded = true;
+            cursor->index  = 0;
+            cursor->offset = HEADER_SIZE;
+        }
+        if(cursor->index >= hdr->count) { //go to the next sector
+            cursor->seq++;
+            cursor->loaded = false;
+            continue;
+        }
+
+        uint16_t len;
+        memcpy(&len, &cursor->buffer[cursor->offset], sizeof(uint16_t));
+        if(cursor->offset + sizeof(uint16_t) + len > HEADER_SIZE + hdr->used) {
+            return -EILSEQ; //can't happen if the CRC matched
+        }
+        memcpy(out, &cursor->buffer[cursor->offset + sizeof(uint16_t)],
+            MIN(len, size));
+        if(outRecord) *outRecord = hdr->firstRecord + cursor->index;
+        cursor->index++;
+        cursor->offset += sizeof(uint16_t) + len;
+        return len;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _MICRON_DRIVERS_FS_RECSTORE_H_
+#define _MICRON_DRIVERS_FS_RECSTORE_H_
+
+//A log of small records on a partition of its own, for continuous logging
+//that survives power loss. The partition is used as a ring of sectors,
+//each describing itself, so there's no metadata to update.
+
+#ifndef RECSTORE_DEBUG_PRINT
+#define RECSTORE_DEBUG_PRINT 1
+#endif
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define RECSTORE_SECTOR_SIZE 512
+#define RECSTORE_MAGIC 0x3153524D //"MRS1"
+
+//partition type ID that recStoreOpen() expects. 0x7F is reserved for
+//local use, so nothing else should claim it.
+#ifndef RECSTORE_PARTITION_TYPE
+#define RECSTORE_PARTITION_TYPE 0x7F
+#endif
+
+//default number of sectors to buffer and write at once.
+#ifndef RECSTORE_DEFAULT_BATCH
+#define RECSTORE_DEFAULT_BATCH 8
+#endif
+
+typedef struct PACKED {
+    uint32_t magic;       //RECSTORE_MAGIC
+    uint32_t crc;         //CRC32 of the whole sector, with this field 0
+    uint64_t seq;         //sector sequence number
+    uint64_t firstRecord; //number of the first record in this sector
+    uint16_t count;       //number of records in this sector
+    uint16_t used;        //bytes of records, including their lengths
+    uint32_t reserved;    //0
+} recstore_header;
+
+//each record is stored as a uint16_t length followed by its data, and
+//doesn't cross a sector boundary.
+#define RECSTORE_MAX_RECORD (RECSTORE_SECTOR_SIZE - \
+    sizeof(recstore_header) - sizeof(uint16_t))
+
+typedef struct {
+    FILE    *blkdev;
+    uint64_t start;        //first sector of the partition
+    uint32_t numSectors;   //size of the partition, in sectors
+    uint64_t oldestSeq;    //sequence number of the oldest sector kept
+    uint64_t nextSeq;      //sequence number of the next sector to write
+    uint64_t nextRecord;   //number of the next record
+    uint16_t batchSectors; //size of `buffer`, in sectors
+    uint16_t numBuffered;  //number of sectors in `buffer` so far,
+                           //including the one being filled
+    uint8_t *buffer;
+} MicronRecStore;
+
+typedef struct {
+    uint64_t seq;          //sector being read
+    uint16_t index;        //next record within that sector
+    uint16_t offset;       //its byte offset
+    bool     loaded;       //whether `buffer` holds that sector
+    uint8_t  buffer[RECSTORE_SECTOR_SIZE];
+} MicronRecStoreCursor;
+
+//recstore.c
+int recStoreMount(FILE *blkdev, uint64_t start, uint32_t numSectors, uint16_t batchSectors, MicronRecStore *out, uint32_t timeout);
+int recStoreOpen(FILE *blkdev, int partition, uint16_t batchSectors, MicronRecStore *out, uint32_t timeout);
+int recStoreClose(MicronRecStore *store, uint32_t timeout);
+int recStoreAppend(MicronRecStore *store, const void *data, uint16_t size, uint32_t timeout);
+int recStoreFlush(MicronRecStore *store, uint32_t timeout);
+void recStoreRewind(MicronRecStore *store, MicronRecStoreCursor *cursor);
+int recStoreRead(MicronRecStore *store, MicronRecStoreCursor *cursor, void *out, uint16_t size, uint64_t *outRecord, uint32_t timeout);
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#endif //_MICRON_DRIVERS_FS_RECSTORE_H_
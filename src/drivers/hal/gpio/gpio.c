@@ -3,6 +3,12 @@
 #endif
 #include <micron.h>
 
+//handlers set by gpioSetPinInterrupt()
+static struct {
+    MicronPinIsr isr;
+    void *param;
+} _pinIsr[CORE_NUM_DIGITAL + 1];
+
 int gpioSetPinMode(uint32_t pin, PinMode mode) {
     /** Set mode of a GPIO pin.
      *  @param pin Which pin.
@@ -95,6 +101,49 @@ int gpioGetPinInput(uint32_t pin) {
     #endif
 }
 
+int gpioSetPinInterrupt(uint32_t pin, PinInterruptMode mode, MicronPinIsr isr,
+void *param) {
+    /** Set up an interrupt on a GPIO pin.
+     *  @param pin Which pin.
+     *  @param mode What triggers it, or PIN_INTERRUPT_NONE to turn it off.
+     *  @param isr Function to call when it triggers.
+     *  @param param Passed to isr.
+     *  @return 0 on success, or negative error code.
+     *  @note isr runs in interrupt context. It isn't called if the program
+     *   provides its own `isrPin()`. The pin keeps its mode, so this also
+     *   works on pins being used by another peripheral, where the hardware
+     *   allows it.
+     */
+    if(pin > CORE_NUM_DIGITAL) return -ENODEV;
+    #if defined(MCU_BASE_KINETIS)
+        if(mode == PIN_INTERRUPT_NONE) {
+            int err = kinetis_gpioSetPinInterrupt(pin, mode);
+            _pinIsr[pin].isr = NULL;
+            return err;
+        }
+        _pinIsr[pin].isr = isr;
+        _pinIsr[pin].param = param;
+        return kinetis_gpioSetPinInterrupt(pin, mode);
+
+    #elif defined(MCU_BASE_IMX)
+        return -ENOSYS; //XXX
+
+    #else
+        return -ENOSYS;
+    #endif
+}
+
+bool _gpioPinIsr(uint32_t pin) {
+    /** Call the handler set for a pin's interrupt.
+     *  @param pin Which pin.
+     *  @return Whether there was one.
+     *  @note Called by the default `isrPin()`.
+     */
+    if(pin > CORE_NUM_DIGITAL || !_pinIsr[pin].isr) return false;
+    _pinIsr[pin].isr(pin, _pinIsr[pin].param);
+    return true;
+}
+
 #ifdef __cplusplus
 	} //extern "C"
 #endif
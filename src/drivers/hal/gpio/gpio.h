@@ -23,14 +23,29 @@ typedef enum {
     PIN_DRIVE_STRENGTH_HIGH,
 } PinDriveStrength;
 
+typedef enum {
+    PIN_INTERRUPT_NONE,
+    PIN_INTERRUPT_RISING,
+    PIN_INTERRUPT_FALLING,
+    PIN_INTERRUPT_EITHER, //either edge
+    PIN_INTERRUPT_LOW,    //while low
+    PIN_INTERRUPT_HIGH,   //while high
+} PinInterruptMode;
+
+//called from an ISR, with the param given to gpioSetPinInterrupt().
+typedef void (*MicronPinIsr)(uint32_t pin, void *param);
+
 //gpio.c
 int gpioSetPinMode(uint32_t pin, PinMode mode);
 int gpioSetPinSlewRate(uint32_t pin, PinSlewRate rate);
 int gpioSetPinDriveStrength(uint32_t pin, PinDriveStrength strength);
 int gpioSetPinOutput(uint32_t pin, bool high);
 int gpioGetPinInput(uint32_t pin);
+int gpioSetPinInterrupt(uint32_t pin, PinInterruptMode mode, MicronPinIsr isr,
+    void *param);
+bool _gpioPinIsr(uint32_t pin);
 
-//XXX interrupts, analog
+//XXX analog
 
 //compatibility
 #define digitalWrite gpioSetPinOutput
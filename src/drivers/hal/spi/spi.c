@@ -116,6 +116,28 @@ int spiSetSpeed(uint32_t port, uint32_t speed) {
     #endif
 }
 
+int spiGetMaxSpeed(uint32_t port, uint32_t speed, uint32_t *outSpeed) {
+    /** Find the fastest baud rate the port can actually run at, that isn't
+     *  faster than the given rate.
+     *  @param port Which SPI port to use.
+     *  @param speed Maximum baud rate.
+     *  @param outSpeed Receives the baud rate.
+     *  @return 0 on success, or a negative error code on failure.
+     *  @note spiSetSpeed() picks the closest rate, which can be faster than
+     *   requested. Passing it the rate from here avoids that.
+     */
+    if(port > NUM_SPI) return -ENODEV;
+    #if defined(MCU_BASE_KINETIS)
+        return kinetis_spiGetMaxSpeed(port, speed, outSpeed);
+
+    #elif defined(MCU_BASE_IMX)
+        return -ENOSYS; //XXX
+
+    #else
+        return -ENOSYS;
+    #endif
+}
+
 int spiSetFrameSize(uint32_t port, uint32_t size) {
     /** Set the SPI frame size.
      *  @param port Which SPI port to use.
@@ -273,6 +295,27 @@ int spiClear(uint32_t port) {
     #endif
 }
 
+int spiHoldCS(uint32_t port, bool hold) {
+    /** Keep the CS line asserted between transfers.
+     *  @param port Which SPI port to use.
+     *  @param hold Whether to hold it asserted.
+     *  @return 0 on success, or a negative error code on failure.
+     *  @note This is for devices that signal on MISO while selected and
+     *   idle, such as SD cards holding it low while busy. Wait for
+     *   transfers to finish (`spiWaitTxDone`) before changing it.
+     */
+    if(port > NUM_SPI) return -ENODEV;
+    #if defined(MCU_BASE_KINETIS)
+        return kinetis_spiHoldCS(port, hold);
+
+    #elif defined(MCU_BASE_IMX)
+        return -ENOSYS; //XXX
+
+    #else
+        return -ENOSYS;
+    #endif
+}
+
 #ifdef __cplusplus
     } //extern "C"
 #endif
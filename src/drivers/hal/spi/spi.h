@@ -59,6 +59,7 @@ int spiInit(uint32_t port, uint32_t pinCS, uint32_t speed, MicronSpiModeEnum mod
 int spiPause(uint32_t port, bool pause);
 int spiSetMode(uint32_t port, MicronSpiModeEnum mode);
 int spiSetSpeed(uint32_t port, uint32_t speed);
+int spiGetMaxSpeed(uint32_t port, uint32_t speed, uint32_t *outSpeed);
 int spiSetFrameSize(uint32_t port, uint32_t size);
 int spiWriteDummy(uint32_t port, uint32_t data, uint32_t count, bool cs);
 int spiWrite(uint32_t port, const void *data, uint32_t len, bool cont);
@@ -68,6 +69,7 @@ int spiRead(uint32_t port, void *out, uint32_t len, uint32_t timeout);
 int spiReadBlocking(uint32_t port, void *out, uint32_t len, uint32_t timeout);
 int spiWaitTxDone(uint32_t port, uint32_t timeout);
 int spiClear(uint32_t port);
+int spiHoldCS(uint32_t port, bool hold);
 
 #ifdef __cplusplus
     } //extern "C"
@@ -0,0 +1,68 @@
+#ifndef _MICRON_IMX_IRQ_H_
+#define _MICRON_IMX_IRQ_H_
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define SCB_SCR_SLEEPDEEP_MASK    0x4u
+
+static uint8_t irqDisableDepth = 0;
+
+/** Disable all interrupts.
+ *  Nests the same way as the Kinetis version: interrupts stay disabled until
+ *  every `irqDisable()` has been matched by an `irqEnable()`.
+ */
+inline void irqDisable() {
+	__disable_irq();
+	if(irqDisableDepth < 255) irqDisableDepth++;
+}
+
+/** Enable all interrupts, after disabling them with `irqDisable()`.
+ */
+inline void irqEnable() {
+	if(irqDisableDepth >  0) irqDisableDepth--;
+	if(irqDisableDepth == 0) __enable_irq();
+}
+
+/** Return the IRQ disable counter, which is nonzero if interrupts are disabled.
+ */
+inline uint8_t irqEnabled() {
+	return irqDisableDepth == 0;
+}
+
+/** Enable the specified interrupt.
+ */
+inline void irqEnableInterrupt(uint8_t which) {
+	NVIC_ENABLE_IRQ(which);
+}
+
+/** Disable the specified interrupt.
+ */
+inline void irqDisableInterrupt(uint8_t which) {
+	NVIC_DISABLE_IRQ(which);
+}
+
+/** Wait for an interrupt.
+ *  This can be called even when interrupts are disabled (in which case it will
+ *  return, but not call the IRQ handler, when an interrupt occurs).
+ *  There's no systick on this port, so unlike Kinetis this can wait
+ *  indefinitely if nothing else is enabled.
+ */
+INLINE void irqWait() {
+	SCB_SCR &= ~SCB_SCR_SLEEPDEEP_MASK;
+	__asm__ volatile("WFI"); //Wait For Interrupt
+}
+
+/** Return the number of the currently executing ISR. Zero means no ISR is
+ *  executing.
+ */
+INLINE int irqCurrentISR() {
+	return SCB_ICSR & 0x1FF;
+}
+
+#ifdef __cplusplus
+	} //extern "C"
+#endif
+
+#endif //_MICRON_IMX_IRQ_H_
@@ -0,0 +1,8 @@
+#ifndef _MICRON_DRIVERS_IMX_H_
+#define _MICRON_DRIVERS_IMX_H_
+
+#include "imxrt.h"
+#include "interrupts/irq.h"
+#include "time/time.h"
+
+#endif //_MICRON_DRIVERS_IMX_H_
@@ -0,0 +1,117 @@
+#include <micron.h>
+
+#if defined(__IMXRT1062__)
+
+/** Start the timers behind micros() and millis().
+ *  There's no systick interrupt on this port, so instead two of the general
+ *  purpose timers count freely from the 24 MHz crystal: GPT1 at 1 MHz and
+ *  GPT2 at 1 kHz (/8 by the 24M prescaler, then /3 or /3000). Their 32-bit
+ *  counters wrap the same way the Kinetis counters do.
+ */
+static void _timeInit() {
+	CCM_CCGR1 |= CCM_CCGR1_GPT1_BUS(CCM_CCGR_ON) |
+		CCM_CCGR1_GPT1_SERIAL(CCM_CCGR_ON);
+	CCM_CCGR0 |= CCM_CCGR0_GPT2_BUS(CCM_CCGR_ON) |
+		CCM_CCGR0_GPT2_SERIAL(CCM_CCGR_ON);
+
+	//the prescalers can only be changed while the timer is off, and the
+	//24 MHz input has to be enabled before it's selected.
+	GPT1_CR = 0;
+	GPT1_PR = GPT_PR_PRESCALER24M(8 - 1) | GPT_PR_PRESCALER(3 - 1);
+	GPT1_CR = GPT_CR_EN_24M;
+	GPT1_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_FRR | GPT_CR_ENMOD;
+	GPT1_CR |= GPT_CR_EN;
+
+	GPT2_CR = 0;
+	GPT2_PR = GPT_PR_PRESCALER24M(8 - 1) | GPT_PR_PRESCALER(3000 - 1);
+	GPT2_CR = GPT_CR_EN_24M;
+	GPT2_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_FRR | GPT_CR_ENMOD;
+	GPT2_CR |= GPT_CR_EN;
+}
+
+
+/** Returns number of microseconds that have elapsed.
+ *  This overflows approximately once every 71 minutes, like the Kinetis
+ *  version; differences between two readings are still valid across that.
+ *  The first call to this or millis() starts the timers, so time is counted
+ *  from then rather than from reset.
+ */
+volatile uint32_t micros() {
+	if(!(GPT1_CR & GPT_CR_EN)) _timeInit();
+	return GPT1_CNT;
+}
+
+
+/** Returns number of milliseconds that have elapsed.
+ *  The same caveats as micros() apply, except that this counter only
+ *  overflows once every ~49.7 days.
+ */
+volatile uint32_t millis() {
+	if(!(GPT2_CR & GPT_CR_EN)) _timeInit();
+	return GPT2_CNT;
+}
+
+
+/** Delay for (approximately) a number of milliseconds.
+ */
+void delayMS(uint32_t ms) {
+	uint32_t start = micros();
+	while(ms > 0) {
+		if((micros() - start) >= 1000) {
+			ms--;
+			start += 1000;
+		}
+	}
+}
+
+
+/** Initialize the real-time clock.
+ *  The SNVS low power RTC keeps counting on the backup battery. The high
+ *  power RTC is a copy of it that can be read without waiting on the slow
+ *  low power domain, so it's synced from it here.
+ */
+WEAK int rtcInit() {
+	SNVS_LPCR |= SNVS_LPCR_SRTC_ENV;
+	while(!(SNVS_LPCR & SNVS_LPCR_SRTC_ENV));
+	SNVS_HPCR |= SNVS_HPCR_RTC_EN | SNVS_HPCR_HP_TS;
+	while(!(SNVS_HPCR & SNVS_HPCR_RTC_EN));
+	return 0;
+}
+
+/** Read the RTC.
+ */
+WEAK int rtcGet(uint32_t *outSecs, uint32_t *outUsecs) {
+	if(!(SNVS_HPCR & SNVS_HPCR_RTC_EN)) return -ENODATA; //not started
+
+	//the counter is 47 bits of 32768 Hz ticks, in two registers. read it
+	//until we get the same value twice, so it didn't tick between them.
+	uint32_t hi1, lo1, hi2, lo2;
+	do {
+		hi1 = SNVS_HPRTCMR;
+		lo1 = SNVS_HPRTCLR;
+		hi2 = SNVS_HPRTCMR;
+		lo2 = SNVS_HPRTCLR;
+	} while(hi1 != hi2 || lo1 != lo2);
+
+	if(outSecs)  *outSecs  = (hi2 << 17) | (lo2 >> 15);
+	if(outUsecs) *outUsecs = ((lo2 & 0x7FFF) * 15625) >> 9; //* 1000000/32768
+	return 0;
+}
+
+/** Set the RTC.
+ */
+WEAK void rtcSet(unsigned long secs, unsigned int usecs) {
+	//both have to be stopped to set them; the low power one is set, and the
+	//high power one copies it when restarted.
+	SNVS_HPCR &= ~SNVS_HPCR_RTC_EN;
+	while(SNVS_HPCR & SNVS_HPCR_RTC_EN);
+	SNVS_LPCR &= ~SNVS_LPCR_SRTC_ENV;
+	while(SNVS_LPCR & SNVS_LPCR_SRTC_ENV);
+
+	uint32_t frac = ((uint64_t)usecs << 15) / 1000000;
+	SNVS_LPSRTCMR = secs >> 17;
+	SNVS_LPSRTCLR = (secs << 15) | frac;
+	rtcInit();
+}
+
+#endif //__IMXRT1062__
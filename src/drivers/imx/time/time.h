@@ -0,0 +1,20 @@
+#ifndef _MICRON_IMX_TIME_H_
+#define _MICRON_IMX_TIME_H_
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+//time.c
+volatile uint32_t micros();
+volatile uint32_t millis();
+void delayMS(uint32_t ms);
+WEAK int rtcInit();
+WEAK int rtcGet(uint32_t *outSecs, uint32_t *outUsecs);
+WEAK void rtcSet(unsigned long secs, unsigned int usecs);
+
+#ifdef __cplusplus
+	} //extern "C"
+#endif
+
+#endif //_MICRON_IMX_TIME_H_
@@ -0,0 +1,176 @@
+//The card as a FILE, like sdOpenCard()'s, so filesystems can use either.
+extern "C" {
+    #include <micron.h>
+    #include "usdhc.h"
+}
+
+#if USDHC_AVAILABLE
+
+int8_t usdhcFileClsIdx = -1;
+
+int usdhcFileCls_close(FILE *self) {
+    free(self);
+    return 0;
+}
+
+int usdhcFileCls_read(FILE *self, void *dest, size_t len) {
+    MicronUsdhcState *state = (MicronUsdhcState*)self->udata.ptr;
+    uint32_t block = self->offset / SD_BLOCK_SIZE;
+    uint32_t part  = self->offset % SD_BLOCK_SIZE;
+    uint8_t *out = (uint8_t*)dest;
+    int err = 0, count = 0;
+    while((size_t)count < len) {
+        size_t remLen = len - count; //remaining length
+        size_t n;
+        if(!part && remLen >= SD_BLOCK_SIZE) {
+            //read all the whole blocks at once, directly into dest
+            uint32_t numBlocks = remLen / SD_BLOCK_SIZE;
+            err = usdhcReadBlocks(state, block, numBlocks, out, 10000);
+            if(err < 0) return err;
+            n = numBlocks * SD_BLOCK_SIZE;
+            block += numBlocks;
+        }
+        else { //read into buf and copy to dest
+            uint8_t buf[SD_BLOCK_SIZE] __attribute__((aligned(USDHC_DMA_ALIGN)));
+            err = usdhcReadBlocks(state, block, 1, buf, 10000);
+            if(err < 0) return err;
+            n = MIN((size_t)SD_BLOCK_SIZE - part, remLen);
+            memcpy(out, &buf[part], n);
+            block++;
+        }
+        out   += n;
+        count += n;
+        self->offset += n;
+        part = 0;
+    }
+    return count;
+}
+
+int usdhcFileCls_write(FILE *self, const void *src, size_t len) {
+    MicronUsdhcState *state = (MicronUsdhcState*)self->udata.ptr;
+    uint32_t block = self->offset / SD_BLOCK_SIZE;
+    uint32_t part  = self->offset % SD_BLOCK_SIZE;
+    const uint8_t *in = (const uint8_t*)src;
+    int err = 0, count = 0;
+    while((size_t)count < len) {
+        size_t remLen = len - count; //remaining length
+        size_t n;
+        if(!part && remLen >= SD_BLOCK_SIZE) {
+            //write all the whole blocks at once, directly from src
+            uint32_t numBlocks = remLen / SD_BLOCK_SIZE;
+            err = usdhcWriteBlocks(state, block, numBlocks, in, 10000);
+            if(err < 0) return err;
+            n = numBlocks * SD_BLOCK_SIZE;
+            block += numBlocks;
+        }
+        else { //read the block, change part of it, and write it back
+            uint8_t buf[SD_BLOCK_SIZE] __attribute__((aligned(USDHC_DMA_ALIGN)));
+            err = usdhcReadBlocks(state, block, 1, buf, 10000);
+            if(err < 0) return err;
+            n = MIN((size_t)SD_BLOCK_SIZE - part, remLen);
+            memcpy(&buf[part], in, n);
+            err = usdhcWriteBlocks(state, block, 1, buf, 10000);
+            if(err < 0) return err;
+            block++;
+        }
+        in    += n;
+        count += n;
+        self->offset += n;
+        part = 0;
+    }
+    return count;
+}
+
+int usdhcFileCls_seek(FILE *self, long int offset, int origin) {
+    MicronUsdhcState *state = (MicronUsdhcState*)self->udata.ptr;
+    switch(origin) {
+        case 0: //SEEK_SET
+            if((uint64_t)offset >= state->cardSize) return -ERANGE;
+            self->offset = offset;
+            return 0;
+
+        case 1: //SEEK_CUR
+            if((uint64_t)(self->offset + offset) >= state->cardSize) return -ERANGE;
+            self->offset += offset;
+            return 0;
+
+        case 2: //SEEK_END
+            if((uint64_t)offset >= state->cardSize) return -ERANGE;
+            self->offset = state->cardSize - offset;
+            return 0;
+
+        default: return -EINVAL;
+    }
+}
+
+int usdhcFileCls_peek(FILE *self, void *dest, size_t len) {
+    return -ENOSYS; //TODO
+}
+
+int usdhcFileCls_getWriteBuf(FILE *self) {
+    return -ENOSYS; //TODO
+}
+
+int usdhcFileCls_sync(FILE *self) {
+    //writes are done when they return; only an erase may still be going.
+    MicronUsdhcState *state = (MicronUsdhcState*)self->udata.ptr;
+    return _usdhcWaitBusy(state, 10000);
+}
+
+int usdhcFileCls_purge(FILE *self) {
+    return 0; //nothing buffered
+}
+
+int usdhcFileCls_discard(FILE *self, size_t len) {
+    //only whole blocks can go, and usdhcDiscard() only erases whole erase
+    //sectors of those.
+    MicronUsdhcState *state = (MicronUsdhcState*)self->udata.ptr;
+    uint64_t first = (self->offset + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    uint64_t end   = (self->offset + len) / SD_BLOCK_SIZE;
+    if(end <= first) return 0;
+    int err = usdhcDiscard(state, first, end - first, 10000);
+    return (err < 0) ? err : 0;
+}
+
+
+MicronFileClass usdhcFileCls = {
+	.close       = usdhcFileCls_close,
+	.read        = usdhcFileCls_read,
+	.write       = usdhcFileCls_write,
+	.seek        = usdhcFileCls_seek,
+	.peek        = usdhcFileCls_peek,
+	.getWriteBuf = usdhcFileCls_getWriteBuf,
+	.sync        = usdhcFileCls_sync,
+	.purge       = usdhcFileCls_purge,
+	.discard     = usdhcFileCls_discard,
+};
+
+FILE* usdhcOpenCard(MicronUsdhcState *state, int *outErr) {
+    /** Open the card as a block device.
+     *  @param state Card state, set up by usdhcReset().
+     *  @param outErr Where to put the error code on failure.
+     *  @return The card's FILE, or NULL on failure.
+     *  @note Works like sdOpenCard(): reads and writes go straight to the
+     *   card, at the file's offset. Close it with close().
+     */
+    int err = 0;
+    if(usdhcFileClsIdx < 0) {
+        err = osRegisterFileClass(&usdhcFileCls);
+        if(err < 0) {
+            *outErr = err;
+            return NULL;
+        }
+        usdhcFileClsIdx = err;
+    }
+    FILE *res = (FILE*)malloc(sizeof(FILE));
+    if(!res) {
+        *outErr = -ENOMEM;
+        return NULL;
+    }
+    res->fileCls = usdhcFileClsIdx;
+    res->udata.ptr = state;
+    res->offset = 0;
+    return res;
+}
+
+#endif //USDHC_AVAILABLE
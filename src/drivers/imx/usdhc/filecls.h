@@ -0,0 +1,7 @@
+#ifndef _MICRON_DRIVERS_IMX_USDHC_FILECLS_H_
+#define _MICRON_DRIVERS_IMX_USDHC_FILECLS_H_
+
+extern int8_t usdhcFileClsIdx;
+FILE* usdhcOpenCard(MicronUsdhcState *state, int *outErr);
+
+#endif //_MICRON_DRIVERS_IMX_USDHC_FILECLS_H_
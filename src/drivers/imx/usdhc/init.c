@@ -0,0 +1,237 @@
+//Card identification and setup.
+//In SD mode, a card starts out idle and answering to everyone. ACMD41 waits
+//for it to power up, CMD2 and CMD3 give it an address (RCA), and CMD7
+//selects it, after which it can switch to the 4-bit bus and high speed.
+extern "C" {
+    #include <micron.h>
+    #include "usdhc.h"
+}
+
+#if USDHC_AVAILABLE
+
+static void _getLongResponse(MicronUsdhcState *state, uint8_t *out) {
+    //get a 136-bit response (CID or CSD) as 16 big-endian bytes. the
+    //controller leaves out the CRC, and shifts the rest down a byte, so
+    //CMD_RSP3's top byte is empty.
+    uint32_t rsp[4] = {
+        USDHC_REG_READ(state, CMD_RSP[3]), USDHC_REG_READ(state, CMD_RSP[2]),
+        USDHC_REG_READ(state, CMD_RSP[1]), USDHC_REG_READ(state, CMD_RSP[0]),
+    };
+    for(int i=0; i<4; i++) {
+        uint32_t r = rsp[i];
+        for(int b=0; b<4; b++) {
+            int idx = (i * 4) + b - 1; //byte 0 is the empty one
+            if(idx >= 0) out[idx] = r >> (24 - (b * 8));
+        }
+    }
+    out[15] = 0; //CRC
+}
+
+
+static int _readCSD(MicronUsdhcState *state) {
+    //work out the card's size and erase sector from its CSD.
+    uint8_t raw[SD_CSD_SIZE] = {0}; //as the SPI driver receives it
+    memcpy(raw, state->csd, sizeof(state->csd));
+    SD_CSD csd;
+    int err = _sdParseCSD(raw, &csd);
+    if(err) return err;
+    switch(csd.csdVersion) {
+        case 0:
+            state->cardSize = (uint64_t)(csd.cSize + 1) <<
+                (csd.cSizeMult + 2 + csd.readBlLen);
+            break;
+        case 1:
+            state->cardSize = (csd.cSize + 1) * 512ull * 1024ull;
+            break;
+        default: return -ENOSYS;
+    }
+    state->nBlocks = state->cardSize / SD_BLOCK_SIZE;
+    //SECTOR_SIZE is in write blocks, which may be bigger than ours.
+    state->eraseSize = MAX(((csd.sectorSize + 1) << csd.writeBlLen) /
+        SD_BLOCK_SIZE, 1U);
+    state->eraseAny = csd.eraseBlkEn;
+    #if SDCARD_DEBUG_PRINT
+        printf("USDHC: %u blocks, erase sector %u blocks\r\n",
+            state->nBlocks, state->eraseSize);
+    #endif
+    return 0;
+}
+
+
+static int _powerUp(MicronUsdhcState *state, uint32_t timeout) {
+    //send ACMD41 until the card says it's done powering up.
+    uint32_t limit = millis() + timeout;
+    uint32_t arg = SD_OCR_VOLTAGES | ((state->cardVersion >= 2) ? SD_OCR_CCS : 0);
+    int fails = 0;
+    while(1) {
+        int err = _usdhcAppCommand(state, SD_CMD_SDC_INIT, arg, USDHC_RESP_R3,
+            timeout);
+        if(err == -ETIMEDOUT || err == -EIO) {
+            //never an answer means no card; one lost command is just noise.
+            if(++fails > USDHC_RETRIES) {
+                return (err == -ETIMEDOUT) ? -ENODEV : err;
+            }
+        }
+        else if(err) return err;
+        else {
+            fails = 0;
+            state->ocr = USDHC_REG_READ(state, CMD_RSP[0]);
+            if(state->ocr & SD_OCR_BUSY) break;
+        }
+        if(millis() >= limit) return -ETIMEDOUT;
+    }
+    state->highCapacity = (state->ocr & SD_OCR_CCS) ? 1 : 0;
+    return 0;
+}
+
+
+static int _checkVoltage(MicronUsdhcState *state, uint32_t timeout) {
+    //only version 2 cards know CMD8; they echo the check pattern. since
+    //no answer means version 1, make sure it wasn't just lost.
+    int err;
+    for(int tries=0; tries<=USDHC_RETRIES; tries++) {
+        err = _usdhcCommand(state, SD_CMD_SDC_CHECK_VOLTAGE, 0x1AA,
+            USDHC_RESP_R7, timeout);
+        if(!err) {
+            if((USDHC_REG_READ(state, CMD_RSP[0]) & 0xFFF) != 0x1AA) {
+                return -EIO;
+            }
+            state->cardVersion = 2;
+            return 0;
+        }
+        if(err != -ETIMEDOUT && err != -EIO) return err;
+    }
+    if(err == -EIO) return err;
+    state->cardVersion = 1;
+    return 0;
+}
+
+
+static int _identify(MicronUsdhcState *state, uint32_t timeout) {
+    //the whole identification sequence, from CMD0 on.
+    int err = _usdhcSetClock(state, USDHC_INIT_HZ);
+    if(err) return err;
+    USDHC_REG_WRITE(state, PROT_CTRL, (USDHC_REG_READ(state, PROT_CTRL) &
+        ~USDHC_PROT_DTW_MASK) | USDHC_PROT_DTW_1BIT);
+    state->rca = 0;
+    state->busWidth = 1;
+    state->highSpeed = 0;
+
+    err = _usdhcCommand(state, SD_CMD_RESET, 0, USDHC_RESP_NONE, timeout);
+    if(!err) err = _checkVoltage(state, timeout);
+    if(err) return err;
+
+    err = _powerUp(state, timeout);
+    if(err) return err;
+
+    err = _usdhcCommand(state, SD_CMD_ALL_SEND_CID, 0, USDHC_RESP_R2, timeout);
+    if(err) return err;
+    _getLongResponse(state, state->cid);
+
+    err = _usdhcCommand(state, SD_CMD_SEND_RCA, 0, USDHC_RESP_R6, timeout);
+    if(err) return err;
+    state->rca = USDHC_REG_READ(state, CMD_RSP[0]) >> 16;
+
+    err = _usdhcCommand(state, SD_CMD_READ_CSD, (uint32_t)state->rca << 16,
+        USDHC_RESP_R2, timeout);
+    if(err) return err;
+    _getLongResponse(state, state->csd);
+    err = _readCSD(state);
+    if(err) return err;
+
+    err = _usdhcCommand(state, SD_CMD_SELECT_CARD, (uint32_t)state->rca << 16,
+        USDHC_RESP_R1B, timeout);
+    if(!err) err = _usdhcWaitBusy(state, timeout);
+    if(err) return err;
+
+    //every SD card does 4 bits.
+    err = _usdhcAppCommand(state, SD_CMD_SET_BUS_WIDTH, 2, USDHC_RESP_R1,
+        timeout);
+    if(err) return err;
+    USDHC_REG_WRITE(state, PROT_CTRL, (USDHC_REG_READ(state, PROT_CTRL) &
+        ~USDHC_PROT_DTW_MASK) | USDHC_PROT_DTW_4BIT);
+    state->busWidth = 4;
+
+    if(!state->highCapacity) {
+        err = _usdhcCommand(state, SD_CMD_BLOCK_LEN, SD_BLOCK_SIZE,
+            USDHC_RESP_R1, timeout);
+        if(err) return err;
+    }
+    #if SDCARD_DEBUG_PRINT
+        printf("USDHC: version %d card, RCA 0x%04X, OCR 0x%08X\r\n",
+            state->cardVersion, state->rca, state->ocr);
+    #endif
+    return _usdhcSetClock(state, USDHC_DEFAULT_HZ);
+}
+
+
+int usdhcReset(MicronUsdhcState *state, uint32_t timeout) {
+    /** Find the card and get it ready for reading and writing.
+     *  @param state Card state, set up by usdhcInit().
+     *  @param timeout Maximum time to wait, in milliseconds, for the card
+     *   to power up.
+     *  @return 0 on success, or negative error code on failure: -ENODEV if
+     *   there's no card.
+     *  @note This leaves the card selected, on the 4-bit bus, at
+     *   USDHC_DEFAULT_HZ; see usdhcHighSpeed() to go faster. It fills in
+     *   the card's size, version, CID and CSD. A card that's moved on to
+     *   its next state can't repeat a garbled response, so after an error
+     *   this starts over from CMD0, up to USDHC_RETRIES times.
+     */
+    int err;
+    for(int tries=0; ; tries++) {
+        err = _identify(state, timeout);
+        if(!err || err == -ENODEV || tries >= USDHC_RETRIES) break;
+        state->stats.retries++;
+    }
+    if(err) state->nBlocks = 0;
+    return err;
+}
+
+
+static int _switchFunc(MicronUsdhcState *state, uint32_t arg, uint8_t *st,
+uint32_t timeout) {
+    //send CMD6 and get its 64-byte status, which comes on the data lines.
+    //asking again is harmless, so retry like a read.
+    int err;
+    for(int tries=0; ; tries++) {
+        err = _usdhcTransfer(state, SD_CMD_SWITCH_FUNC, arg,
+            SD_SWITCH_STATUS_SIZE, 1, state->bounce, false, timeout);
+        if((err != -EIO && err != -ETIMEDOUT) || tries >= USDHC_RETRIES) {
+            break;
+        }
+        state->stats.retries++;
+    }
+    if(err) return err;
+    memcpy(st, state->bounce, SD_SWITCH_STATUS_SIZE);
+    return 0;
+}
+
+
+int usdhcHighSpeed(MicronUsdhcState *state, uint32_t timeout) {
+    /** Switch to high speed mode, if the card can.
+     *  @param state Card state, set up by usdhcReset().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 1 if the card is now in high speed mode, 0 if it can't do
+     *   that, or negative error code on failure.
+     *  @note High speed doubles the clock to USDHC_HIGH_SPEED_HZ. The
+     *   faster UHS modes need 1.8V signalling, which the Teensy 4.1's slot
+     *   doesn't have.
+     */
+    if(state->cardVersion < 2) return 0; //no CMD6
+
+    //check that function 1 of group 1 (bus speed) is supported, then switch.
+    uint8_t st[SD_SWITCH_STATUS_SIZE];
+    int err = _switchFunc(state, 0x00FFFFF1, st, timeout);
+    if(err) return err;
+    if(!(st[13] & BIT(1))) return 0;
+    err = _switchFunc(state, 0x80FFFFF1, st, timeout);
+    if(err) return err;
+    if((st[16] & 0xF) != 1) return 0;
+
+    state->highSpeed = 1;
+    err = _usdhcSetClock(state, USDHC_HIGH_SPEED_HZ);
+    return err ? err : 1;
+}
+
+#endif //USDHC_AVAILABLE
@@ -0,0 +1,300 @@
+//Reading, writing and erasing.
+//Transfers use ADMA2: a table of descriptors, each giving an address and
+//length, which the controller walks through on its own while the card
+//sends or receives blocks over all four data lines. Multiple block
+//transfers end with the controller sending CMD12 itself (auto CMD12).
+//The DMA doesn't go through the data cache, so buffers are flushed before
+//writes and invalidated around reads; ones that don't start on a cache
+//line go through a bounce buffer, since invalidating would lose whatever
+//shares their first and last lines.
+extern "C" {
+    #include <micron.h>
+    #include "usdhc.h"
+}
+
+#if USDHC_AVAILABLE
+
+static int _buildAdma(MicronUsdhcState *state, uint8_t *buf, uint32_t len,
+uint32_t blockSize) {
+    //fill in the descriptor table for a buffer.
+    //return 0, or -E2BIG if it needs too many descriptors.
+    uint32_t maxLen = USDHC_ADMA_MAX_BLOCKS * blockSize;
+    int i = 0;
+    while(len) {
+        if(i >= USDHC_ADMA_DESCS) return -E2BIG;
+        uint32_t n = MIN(len, maxLen);
+        MicronUsdhcAdmaDesc *desc = &state->adma[i++];
+        desc->attr = USDHC_ADMA_VALID | USDHC_ADMA_ACT_TRAN;
+        desc->len  = n;
+        desc->addr = USDHC_DMA_ADDR(buf, n);
+        buf += n;
+        len -= n;
+    }
+    if(!i) return -EINVAL;
+    state->adma[i - 1].attr |= USDHC_ADMA_END;
+    #if defined(__IMXRT1062__)
+        arm_dcache_flush(state->adma, i * sizeof(MicronUsdhcAdmaDesc));
+    #endif
+    return 0;
+}
+
+
+static void _abort(MicronUsdhcState *state, uint32_t timeout) {
+    //get the card back to the transfer state after a failed transfer,
+    //and clear the errors from its status.
+    _usdhcResetLines(state, USDHC_SYS_RSTD);
+    //if it already stopped, this gets no answer, which is fine.
+    _usdhcCommand(state, SD_CMD_STOP_READ, 0,
+        USDHC_RESP_R1B | USDHC_CMD_CMDTYP_ABORT, timeout);
+    _usdhcWaitBusy(state, timeout);
+    _usdhcWaitStatus(state, timeout);
+}
+
+
+int _usdhcTransfer(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+uint32_t blockSize, uint32_t count, void *buf, bool write, uint32_t timeout) {
+    /** Send a command that transfers data, and wait for the transfer.
+     *  @param state Card state.
+     *  @param cmd Command number.
+     *  @param arg Argument.
+     *  @param blockSize Block size in bytes.
+     *  @param count Number of blocks. If more than 1, the controller sends
+     *   CMD12 after the last one.
+     *  @param buf Data to write, or where to read it to. Must be aligned to
+     *   USDHC_DMA_ALIGN.
+     *  @param write Whether the data goes to the card.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -EIO for a
+     *   CRC error or a block the card couldn't read or write, -ETIMEDOUT if
+     *   the card stopped sending.
+     *  @note After a failure, the card is back in the transfer state, but
+     *   part of a write may have been done.
+     */
+    uint32_t len = blockSize * count;
+    int err = _buildAdma(state, (uint8_t*)buf, len, blockSize);
+    if(err) return err;
+    #if defined(__IMXRT1062__)
+        if(write) arm_dcache_flush(buf, len);
+        else arm_dcache_flush_delete(buf, len);
+    #endif
+
+    err = _usdhcWaitIdle(state, true, timeout);
+    if(err) return err;
+    uint32_t mix = USDHC_MIX_DMAEN;
+    if(count > 1) mix |= USDHC_MIX_BCEN | USDHC_MIX_MSBSEL | USDHC_MIX_AC12EN;
+    if(!write) mix |= USDHC_MIX_DTDSEL;
+    USDHC_REG_WRITE(state, ADMA_SYS_ADDR, USDHC_DMA_ADDR(state->adma,
+        sizeof(state->adma)));
+    USDHC_REG_WRITE(state, BLK_ATT, USDHC_BLK_ATT_BLKSIZE(blockSize) |
+        USDHC_BLK_ATT_BLKCNT(count));
+    USDHC_REG_WRITE(state, MIX_CTRL, (USDHC_REG_READ(state, MIX_CTRL) &
+        ~USDHC_MIX_XFER_MASK) | mix);
+    state->stats.transfers++;
+
+    err = _usdhcCommand(state, cmd, arg, USDHC_RESP_R1 | USDHC_CMD_DPSEL,
+        timeout);
+    if(err) {
+        //if it was only the response that got garbled, the card started.
+        if(err != -ERANGE) _abort(state, timeout);
+        return err;
+    }
+
+    uint32_t limit = millis() + timeout;
+    uint32_t irq;
+    while(1) {
+        irq = USDHC_REG_READ(state, INT_STATUS);
+        if(irq & (USDHC_INT_TC | USDHC_INT_DATA_ERRORS)) break;
+        if(millis() >= limit) {
+            irq = USDHC_INT_DTOE;
+            break;
+        }
+    }
+    USDHC_REG_WRITE(state, INT_STATUS, irq);
+    if(irq & USDHC_INT_DATA_ERRORS) {
+        #if SDCARD_DEBUG_PRINT
+            printf("USDHC: CMD%d transfer failed: status 0x%08X, ADMA 0x%X, "
+                "AC12 0x%X\r\n", cmd, irq,
+                USDHC_REG_READ(state, ADMA_ERR_STATUS),
+                USDHC_REG_READ(state, AUTOCMD12_ERR_STATUS));
+        #endif
+        if(irq & USDHC_INT_DMAE) state->stats.dmaErrors++;
+        else state->stats.dataErrors++;
+        _abort(state, timeout);
+        return (irq & USDHC_INT_DTOE) ? -ETIMEDOUT : -EIO;
+    }
+    #if defined(__IMXRT1062__)
+        if(!write) arm_dcache_delete(buf, len);
+    #endif
+    state->stats.blocks += count;
+
+    //the card may still be programming the last block. if a write went
+    //wrong, its status says so.
+    if(write) {
+        err = _usdhcWaitBusy(state, timeout);
+        if(!err) err = _usdhcWaitStatus(state, timeout);
+        if(err) {
+            state->stats.dataErrors++;
+            return err;
+        }
+    }
+    return 0;
+}
+
+
+static uint32_t _blockAddress(MicronUsdhcState *state, uint32_t block) {
+    //SDSC cards take byte addresses.
+    return state->highCapacity ? block : block * SD_BLOCK_SIZE;
+}
+
+
+static int _readWrite(MicronUsdhcState *state, uint32_t block,
+uint32_t count, uint8_t *buf, bool write, uint32_t timeout) {
+    //read or write blocks, in pieces as big as the descriptors (or the
+    //bounce buffer) allow.
+    if(!state->nBlocks) return -ENODATA;
+    if((uint64_t)block + count > state->nBlocks) return -ERANGE;
+    bool direct = ((uintptr_t)buf % USDHC_DMA_ALIGN) == 0;
+    uint32_t most = direct ? USDHC_ADMA_DESCS * USDHC_ADMA_MAX_BLOCKS :
+        USDHC_BOUNCE_BLOCKS;
+    while(count) {
+        uint32_t n = MIN(count, most);
+        uint8_t *dma = direct ? buf : state->bounce;
+        if(!direct) {
+            state->stats.bounced += n;
+            if(write) memcpy(dma, buf, n * SD_BLOCK_SIZE);
+        }
+        uint8_t cmd = write ?
+            ((n > 1) ? SD_CMD_WRITE_BLOCKS : SD_CMD_WRITE_BLOCK) :
+            ((n > 1) ? SD_CMD_READ_BLOCKS  : SD_CMD_READ_BLOCK);
+        int err;
+        for(int tries=0; ; tries++) {
+            err = _usdhcTransfer(state, cmd, _blockAddress(state, block),
+                SD_BLOCK_SIZE, n, dma, write, timeout);
+            if((err != -EIO && err != -ETIMEDOUT) || tries >= USDHC_RETRIES) {
+                break;
+            }
+            state->stats.retries++;
+        }
+        if(err) return err;
+        if(!direct && !write) memcpy(buf, dma, n * SD_BLOCK_SIZE);
+        block += n;
+        count -= n;
+        buf   += n * SD_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+
+int usdhcReadBlocks(MicronUsdhcState *state, uint32_t firstBlock,
+uint32_t count, void *dest, uint32_t timeout) {
+    /** Read blocks from the card.
+     *  @param state Card state.
+     *  @param firstBlock First block to read.
+     *  @param count Number of blocks.
+     *  @param dest Where to put them. Best aligned to USDHC_DMA_ALIGN;
+     *   otherwise they're copied through the bounce buffer.
+     *  @param timeout Maximum time to wait, in milliseconds, for each
+     *   command and transfer.
+     *  @return 0 on success, or negative error code on failure: -ERANGE if
+     *   the range goes past the end of the card, -ENODATA if usdhcReset()
+     *   hasn't found a card.
+     *  @note Transfers that fail with a CRC error or timeout are retried up
+     *   to USDHC_RETRIES times.
+     */
+    return _readWrite(state, firstBlock, count, (uint8_t*)dest, false,
+        timeout);
+}
+
+
+int usdhcWriteBlocks(MicronUsdhcState *state, uint32_t firstBlock,
+uint32_t count, const void *src, uint32_t timeout) {
+    /** Write blocks to the card.
+     *  @param state Card state.
+     *  @param firstBlock First block to write.
+     *  @param count Number of blocks.
+     *  @param src Data to write. Best aligned to USDHC_DMA_ALIGN.
+     *  @param timeout Maximum time to wait, in milliseconds, for each
+     *   command and transfer.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This returns once the card has finished programming the
+     *   blocks. If it fails, some of them may have been written.
+     */
+    return _readWrite(state, firstBlock, count, (uint8_t*)src, true, timeout);
+}
+
+
+int usdhcEraseBegin(MicronUsdhcState *state, uint32_t firstBlock,
+uint32_t count, uint32_t timeout) {
+    /** Start erasing blocks.
+     *  @param state Card state.
+     *  @param firstBlock First block to erase.
+     *  @param count Number of blocks to erase.
+     *  @param timeout Maximum time to wait, in milliseconds, for each
+     *   command.
+     *  @return 0 on success, or negative error code on failure: -ERANGE if
+     *   the range goes past the end of the card, -EINVAL if it's empty or
+     *   the card can only erase whole erase sectors and it doesn't cover
+     *   them exactly.
+     *  @note This returns while the card is still erasing; the next
+     *   transfer waits for it. Erased blocks read as all 0x00 or all 0xFF,
+     *   depending on the card.
+     */
+    if(!state->nBlocks) return -ENODATA;
+    if(!count) return -EINVAL;
+    if((uint64_t)firstBlock + count > state->nBlocks) return -ERANGE;
+    if(!state->eraseAny && ((firstBlock % state->eraseSize)
+    || (count % state->eraseSize))) return -EINVAL;
+
+    //the card ignores erase commands while it's still programming.
+    int err = _usdhcWaitBusy(state, timeout);
+    if(!err) err = _usdhcCommand(state, SD_CMD_ERASE_START,
+        _blockAddress(state, firstBlock), USDHC_RESP_R1, timeout);
+    if(!err) err = _usdhcCommand(state, SD_CMD_ERASE_END,
+        _blockAddress(state, firstBlock + count - 1), USDHC_RESP_R1, timeout);
+    if(!err) err = _usdhcCommand(state, SD_CMD_ERASE, 0, USDHC_RESP_R1B,
+        timeout);
+    return err;
+}
+
+
+int usdhcErase(MicronUsdhcState *state, uint32_t firstBlock, uint32_t count,
+uint32_t timeout) {
+    /** Erase blocks, and wait until the card is done.
+     *  @param state Card state.
+     *  @param firstBlock First block to erase.
+     *  @param count Number of blocks to erase.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note See usdhcEraseBegin().
+     */
+    int err = usdhcEraseBegin(state, firstBlock, count, timeout);
+    if(!err) err = _usdhcWaitBusy(state, timeout);
+    if(!err) err = _usdhcWaitStatus(state, timeout);
+    return err;
+}
+
+
+int usdhcDiscard(MicronUsdhcState *state, uint32_t firstBlock,
+uint32_t count, uint32_t timeout) {
+    /** Tell the card that blocks' contents are no longer needed.
+     *  @param state Card state.
+     *  @param firstBlock First block.
+     *  @param count Number of blocks.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of blocks erased, starting from the first whole erase
+     *   sector in the range, or negative error code on failure.
+     *  @note Like sdDiscard(), only whole erase sectors are erased, and
+     *   this returns while the card is still erasing.
+     */
+    if(!state->nBlocks) return -ENODATA;
+    if((uint64_t)firstBlock + count > state->nBlocks) return -ERANGE;
+    uint32_t size  = state->eraseSize;
+    uint64_t start = (((uint64_t)firstBlock + size - 1) / size) * size;
+    uint64_t end   = (((uint64_t)firstBlock + count) / size) * size;
+    if(end <= start) return 0;
+    int err = usdhcEraseBegin(state, start, end - start, timeout);
+    if(err) return err;
+    return end - start;
+}
+
+#endif //USDHC_AVAILABLE
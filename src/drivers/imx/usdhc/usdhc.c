@@ -0,0 +1,311 @@
+//uSDHC controller: clocks, pins, reset and sending commands.
+extern "C" {
+    #include <micron.h>
+    #include "usdhc.h"
+}
+
+#if USDHC_AVAILABLE
+
+//wait until (register & mask) == want, or millis() reaches limit.
+//evaluates to 0, or -ETIMEDOUT.
+#define WAIT_REG(state, reg, mask, want, limit) ({                      \
+    int _err = 0;                                                       \
+    while((USDHC_REG_READ(state, reg) & (mask)) != (want)) {            \
+        if(millis() >= (limit)) {                                       \
+            _err = -ETIMEDOUT;                                          \
+            break;                                                      \
+        }                                                               \
+    }                                                                   \
+    _err;                                                               \
+})
+
+
+static void _setupClockAndPins() {
+    //run the controller from PLL2 PFD0 at 396 MHz / 2, and give it the
+    //SD pins. the pins are pulled up, as the card expects.
+    #if defined(__IMXRT1062__)
+        CCM_ANALOG_PFD_528 = (CCM_ANALOG_PFD_528 & ~0xBF) | 24; //528*18/24
+        CCM_CCGR6 |= CCM_CCGR6_USDHC1(CCM_CCGR_ON);
+        CCM_CSCDR1 = (CCM_CSCDR1 & ~CCM_CSCDR1_USDHC1_PODF(7)) |
+            CCM_CSCDR1_USDHC1_PODF(1);
+        CCM_CSCMR1 |= CCM_CSCMR1_USDHC1_CLK_SEL;
+
+        const uint32_t pad = IOMUXC_PAD_PKE | IOMUXC_PAD_PUE |
+            IOMUXC_PAD_PUS(1) | IOMUXC_PAD_SPEED(2) | IOMUXC_PAD_DSE(4) |
+            IOMUXC_PAD_HYS;
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_00 = pad; //CMD
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_01 = IOMUXC_PAD_SPEED(2) |
+            IOMUXC_PAD_DSE(4) | IOMUXC_PAD_HYS;    //CLK
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_02 = pad; //DAT0
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_03 = pad; //DAT1
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_04 = pad; //DAT2
+        IOMUXC_SW_PAD_CTL_PAD_GPIO_SD_B0_05 = pad; //DAT3
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_00 = 0; //ALT0 = USDHC1
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_01 = 0;
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_02 = 0;
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_03 = 0;
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_04 = 0;
+        IOMUXC_SW_MUX_CTL_PAD_GPIO_SD_B0_05 = 0;
+    #endif
+}
+
+
+int usdhcInit(MicronUsdhcState *state) {
+    /** Set up the controller.
+     *  @param state Card state. Set state->port first.
+     *  @return 0 on success, or negative error code on failure: -ENODEV if
+     *   the port isn't 1.
+     *  @note This leaves the card alone; call usdhcReset() next.
+     */
+    if(state->port != 1) return -ENODEV;
+    #if defined(__IMXRT1062__)
+        state->regs = (volatile MicronUsdhcRegs*)IMXRT_USDHC1_ADDRESS;
+    #else
+        state->regs = NULL;
+    #endif
+    state->rca = 0;
+    state->busWidth = 1;
+    state->highSpeed = 0;
+    state->clockHz = 0;
+    state->nBlocks = 0;
+    memset(&state->stats, 0, sizeof(state->stats));
+    _setupClockAndPins();
+
+    //reset the controller, and set it up for ADMA2 and polling.
+    uint32_t limit = millis() + 100;
+    USDHC_REG_WRITE(state, SYS_CTRL, USDHC_REG_READ(state, SYS_CTRL) |
+        USDHC_SYS_RSTA);
+    int err = WAIT_REG(state, SYS_CTRL, USDHC_SYS_RSTA, 0, limit);
+    if(err) return err;
+    USDHC_REG_WRITE(state, PROT_CTRL, USDHC_PROT_EMODE_LITTLE |
+        USDHC_PROT_DMASEL_ADMA2 | USDHC_PROT_DTW_1BIT);
+    USDHC_REG_WRITE(state, WTMK_LVL, USDHC_WTMK_RD_WML(128) |
+        USDHC_WTMK_RD_BRST_LEN(8) | USDHC_WTMK_WR_WML(128) |
+        USDHC_WTMK_WR_BRST_LEN(8));
+    USDHC_REG_WRITE(state, MIX_CTRL, 0);
+    USDHC_REG_WRITE(state, INT_STATUS_EN, USDHC_INT_CC | USDHC_INT_TC |
+        USDHC_INT_DINT | USDHC_INT_CMD_ERRORS | USDHC_INT_DATA_ERRORS);
+    USDHC_REG_WRITE(state, INT_SIGNAL_EN, 0);
+    USDHC_REG_WRITE(state, INT_STATUS, 0xFFFFFFFF);
+
+    err = _usdhcSetClock(state, USDHC_INIT_HZ);
+    if(err) return err;
+
+    //the card wants at least 74 clocks before the first command.
+    USDHC_REG_WRITE(state, SYS_CTRL, USDHC_REG_READ(state, SYS_CTRL) |
+        USDHC_SYS_INITA);
+    return WAIT_REG(state, SYS_CTRL, USDHC_SYS_INITA, 0, limit);
+}
+
+
+int _usdhcSetClock(MicronUsdhcState *state, uint32_t hz) {
+    /** Set the SD clock.
+     *  @param state Card state.
+     *  @param hz Desired clock in Hz.
+     *  @return 0 on success, or negative error code on failure: -ERANGE if
+     *   it's too slow.
+     *  @note This picks the fastest clock that's no faster than hz, and sets
+     *   state->clockHz to it. The clock is the root clock divided by a
+     *   power of two up to 256 (SDCLKFS), then by 1 to 16 (DVS).
+     */
+    uint32_t bestDiv = 0, bestPre = 0, bestDvs = 0;
+    for(uint32_t pre=1; pre<=256; pre<<=1) {
+        for(uint32_t dvs=1; dvs<=16; dvs++) {
+            uint32_t div = pre * dvs;
+            if(USDHC_ROOT_HZ / div > hz) continue;
+            if(!bestDiv || div < bestDiv) {
+                bestDiv = div;
+                bestPre = pre;
+                bestDvs = dvs;
+            }
+            break; //larger dvs only gets slower
+        }
+    }
+    if(!bestDiv) return -ERANGE;
+    state->clockHz = USDHC_ROOT_HZ / bestDiv;
+
+    //the data timeout is 2^(13 + DTOCV) clocks. make it the SD spec's
+    //longest (250 ms for a write), so a card that never answers is noticed
+    //without waiting out the whole command timeout.
+    uint32_t dtocv = 0;
+    uint64_t want = (uint64_t)state->clockHz * USDHC_DATA_TIMEOUT_MS / 1000;
+    while(dtocv < 0xE && (1ull << (13 + dtocv)) < want) dtocv++;
+
+    uint32_t sys = USDHC_REG_READ(state, SYS_CTRL);
+    sys &= ~(USDHC_SYS_CLOCK_MASK | USDHC_SYS_DTOCV_MASK);
+    sys |= USDHC_SYS_SDCLKFS(bestPre >> 1) | USDHC_SYS_DVS(bestDvs - 1) |
+        USDHC_SYS_DTOCV(dtocv);
+    USDHC_REG_WRITE(state, SYS_CTRL, sys);
+    #if SDCARD_DEBUG_PRINT
+        printf("USDHC: clock %u Hz (%u / %u / %u)\r\n", state->clockHz,
+            USDHC_ROOT_HZ, bestPre, bestDvs);
+    #endif
+    uint32_t limit = millis() + 10;
+    return WAIT_REG(state, PRES_STATE, USDHC_PRES_SDSTB, USDHC_PRES_SDSTB,
+        limit);
+}
+
+
+void _usdhcResetLines(MicronUsdhcState *state, uint32_t which) {
+    /** Reset the controller's command and/or data line logic after an error.
+     *  @param state Card state.
+     *  @param which USDHC_SYS_RSTC and/or USDHC_SYS_RSTD.
+     */
+    uint32_t limit = millis() + 10;
+    USDHC_REG_WRITE(state, SYS_CTRL, USDHC_REG_READ(state, SYS_CTRL) | which);
+    WAIT_REG(state, SYS_CTRL, which, 0, limit);
+    USDHC_REG_WRITE(state, INT_STATUS, 0xFFFFFFFF);
+}
+
+
+int _usdhcWaitBusy(MicronUsdhcState *state, uint32_t timeout) {
+    /** Wait until the card isn't busy (holding DAT0 low).
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    uint32_t limit = millis() + timeout;
+    return WAIT_REG(state, PRES_STATE, USDHC_PRES_DAT0, USDHC_PRES_DAT0,
+        limit);
+}
+
+
+int _usdhcWaitIdle(MicronUsdhcState *state, bool data, uint32_t timeout) {
+    /** Wait until the controller can send a command.
+     *  @param state Card state.
+     *  @param data Whether it uses the data lines (data transfer, or busy
+     *   after the response), so they have to be free too.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    uint32_t limit = millis() + timeout;
+    uint32_t mask = USDHC_PRES_CIHB;
+    if(data) mask |= USDHC_PRES_CDIHB | USDHC_PRES_DAT0;
+    return WAIT_REG(state, PRES_STATE, mask, mask & USDHC_PRES_DAT0, limit);
+}
+
+
+static int _statusError(uint32_t status) {
+    //turn an R1 response's error bits into an error code. a command that's
+    //illegal or garbled gets no response, so those two bits are about the
+    //one before.
+    status &= SD_STATUS_ERRORS &
+        ~(SD_STATUS_ILLEGAL_COMMAND | SD_STATUS_COM_CRC_ERROR);
+    if(!status) return 0;
+    if(status & (SD_STATUS_OUT_OF_RANGE | SD_STATUS_ADDRESS_ERROR)) {
+        return -ERANGE;
+    }
+    return -EIO;
+}
+
+
+int _usdhcCommand(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+uint32_t flags, uint32_t timeout) {
+    /** Send a command and wait for its response.
+     *  @param state Card state.
+     *  @param cmd Command number.
+     *  @param arg Argument.
+     *  @param flags Response type (USDHC_RESP_*), and for a command that
+     *   transfers data, USDHC_CMD_DPSEL. MIX_CTRL, BLK_ATT and the DMA must
+     *   be set up first for that.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -ETIMEDOUT
+     *   if there's no response, -EIO if it's garbled or has an error bit
+     *   set (-ERANGE for an address error).
+     *  @note For R1 responses, state->status is set to the card status. For
+     *   R1b, this doesn't wait for the busy phase; see _usdhcWaitBusy().
+     *   Anything else goes in CMD_RSP.
+     */
+    //an abort is sent while the data lines are still in use.
+    bool usesData = ((flags & USDHC_CMD_DPSEL)
+        || (flags & USDHC_CMD_RSPTYP_MASK) == USDHC_CMD_RSPTYP_48_BUSY)
+        && (flags & USDHC_CMD_CMDTYP_ABORT) != USDHC_CMD_CMDTYP_ABORT;
+    int err = _usdhcWaitIdle(state, usesData, timeout);
+    if(err) return err;
+
+    uint32_t limit = millis() + timeout;
+    USDHC_REG_WRITE(state, INT_STATUS, 0xFFFFFFFF);
+    USDHC_REG_WRITE(state, CMD_ARG, arg);
+    USDHC_REG_WRITE(state, CMD_XFR_TYP, USDHC_CMD_CMDINX(cmd) | flags);
+    state->stats.cmds++;
+
+    uint32_t st;
+    while(1) {
+        st = USDHC_REG_READ(state, INT_STATUS);
+        if(st & (USDHC_INT_CC | USDHC_INT_CMD_ERRORS)) break;
+        if(millis() >= limit) {
+            st = USDHC_INT_CTOE;
+            break;
+        }
+    }
+    if(st & USDHC_INT_CMD_ERRORS) {
+        #if SDCARD_DEBUG_PRINT
+            printf("USDHC: CMD%d failed: status 0x%08X\r\n", cmd, st);
+        #endif
+        state->stats.cmdErrors++;
+        _usdhcResetLines(state, USDHC_SYS_RSTC |
+            ((flags & USDHC_CMD_DPSEL) ? USDHC_SYS_RSTD : 0));
+        return (st & USDHC_INT_CTOE) ? -ETIMEDOUT : -EIO;
+    }
+    USDHC_REG_WRITE(state, INT_STATUS, USDHC_INT_CC);
+
+    if(flags & USDHC_CMD_CICEN) { //R1, R1b, R6, R7
+        state->status = USDHC_REG_READ(state, CMD_RSP[0]);
+        //R6 and R7 don't have the status, but their bits in the same
+        //places never have errors.
+        if(cmd == SD_CMD_SEND_RCA || cmd == SD_CMD_SDC_CHECK_VOLTAGE) {
+            return 0;
+        }
+        err = _statusError(state->status);
+        if(err) {
+            #if SDCARD_DEBUG_PRINT
+                printf("USDHC: CMD%d status 0x%08X\r\n", cmd, state->status);
+            #endif
+            //nothing's coming on the data lines.
+            if(flags & USDHC_CMD_DPSEL) _usdhcResetLines(state, USDHC_SYS_RSTD);
+            return err;
+        }
+    }
+    return 0;
+}
+
+
+int _usdhcAppCommand(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+uint32_t flags, uint32_t timeout) {
+    /** Send an application command (ACMD).
+     *  @param state Card state.
+     *  @param cmd Command number.
+     *  @param arg Argument.
+     *  @param flags Response type; see _usdhcCommand().
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    int err = _usdhcCommand(state, SD_CMD_ACMD, (uint32_t)state->rca << 16,
+        USDHC_RESP_R1, timeout);
+    if(err) return err;
+    return _usdhcCommand(state, cmd, arg, flags, timeout);
+}
+
+
+int _usdhcWaitStatus(MicronUsdhcState *state, uint32_t timeout) {
+    /** Ask the card for its status (CMD13) until it's ready for data and
+     *  back in the transfer state.
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -EIO or
+     *   -ERANGE if the status has an error bit set.
+     *  @note The status's error bits are cleared by reading them, so this
+     *   catches (and clears) errors from the last transfer.
+     */
+    uint32_t limit = millis() + timeout;
+    while(1) {
+        int err = _usdhcCommand(state, SD_CMD_SEND_STATUS,
+            (uint32_t)state->rca << 16, USDHC_RESP_R1, timeout);
+        if(err) return err;
+        if((state->status & SD_STATUS_READY_FOR_DATA)
+        && SD_STATUS_STATE(state->status) == SD_STATE_TRAN) return 0;
+        if(millis() >= limit) return -ETIMEDOUT;
+    }
+}
+
+#endif //USDHC_AVAILABLE
@@ -0,0 +1,330 @@
+/** SD card driver for the i.MX RT uSDHC controller.
+ *  Talks to the card in its native SD mode, 4 bits wide, with the
+ *  controller's ADMA2 engine moving the data, rather than over SPI one byte
+ *  at a time. The Teensy 4.1's built-in slot is wired to uSDHC1:
+ *  GPIO_SD_B0_00 = CMD, 01 = CLK, 02-05 = DAT0-3.
+ *  It reads and writes the same way as the SPI driver (drivers/sdcard), and
+ *  usdhcOpenCard() gives a FILE that works in place of sdOpenCard()'s.
+ *  Everything is polled; it doesn't use the controller's interrupt.
+ */
+#ifndef _MICRON_DRIVERS_IMX_USDHC_H_
+#define _MICRON_DRIVERS_IMX_USDHC_H_
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+//for SD_BLOCK_SIZE, SD_CSD and _sdParseCSD()
+#include <drivers/sdcard/sdcard.h>
+
+//whether there's a uSDHC to drive. USDHC_SIM is tools/sdsim's model.
+#if defined(__IMXRT1062__) || defined(USDHC_SIM)
+    #define USDHC_AVAILABLE 1
+#else
+    #define USDHC_AVAILABLE 0
+#endif
+
+//clock going into the controller: PLL2 PFD0 (396 MHz) divided by 2.
+#define USDHC_ROOT_HZ 198000000
+
+//SD clock during identification, normally, and in high speed mode, in Hz.
+#ifndef USDHC_INIT_HZ
+#define USDHC_INIT_HZ 400000
+#endif
+#ifndef USDHC_DEFAULT_HZ
+#define USDHC_DEFAULT_HZ 25000000
+#endif
+#ifndef USDHC_HIGH_SPEED_HZ
+#define USDHC_HIGH_SPEED_HZ 50000000
+#endif
+
+//how many ADMA2 descriptors a transfer can use. each covers up to
+//USDHC_ADMA_MAX_BLOCKS blocks; longer reads and writes are split up.
+#ifndef USDHC_ADMA_DESCS
+#define USDHC_ADMA_DESCS 8
+#endif
+
+//buffers the DMA can't use directly (not aligned to a cache line) are
+//copied through a bounce buffer of this many blocks.
+#ifndef USDHC_BOUNCE_BLOCKS
+#define USDHC_BOUNCE_BLOCKS 8
+#endif
+
+//how many times a transfer is retried after a CRC error or timeout.
+#ifndef USDHC_RETRIES
+#define USDHC_RETRIES 3
+#endif
+
+//how long the controller waits for data from the card, or for it to
+//answer a written block, before giving up, in milliseconds.
+#ifndef USDHC_DATA_TIMEOUT_MS
+#define USDHC_DATA_TIMEOUT_MS 250
+#endif
+
+#define USDHC_DMA_ALIGN 32 //cache line size
+
+//SD mode commands that the SPI driver doesn't use
+#define SD_CMD_ALL_SEND_CID      2
+#define SD_CMD_SEND_RCA          3
+#define SD_CMD_SELECT_CARD       7
+#define SD_CMD_SEND_STATUS      13
+#define SD_CMD_SET_BUS_WIDTH     6 //ACMD6
+
+//card status (R1 response), SD mode
+#define SD_STATUS_OUT_OF_RANGE    BIT(31)
+#define SD_STATUS_ADDRESS_ERROR   BIT(30)
+#define SD_STATUS_BLOCK_LEN_ERROR BIT(29)
+#define SD_STATUS_ERASE_SEQ_ERROR BIT(28)
+#define SD_STATUS_ERASE_PARAM     BIT(27)
+#define SD_STATUS_WP_VIOLATION    BIT(26)
+#define SD_STATUS_COM_CRC_ERROR   BIT(23)
+#define SD_STATUS_ILLEGAL_COMMAND BIT(22)
+#define SD_STATUS_CARD_ECC_FAILED BIT(21)
+#define SD_STATUS_CC_ERROR        BIT(20)
+#define SD_STATUS_ERROR           BIT(19)
+#define SD_STATUS_STATE(s)        (((s) >> 9) & 0xF)
+#define SD_STATUS_READY_FOR_DATA  BIT(8)
+#define SD_STATUS_APP_CMD         BIT(5)
+#define SD_STATUS_ERRORS          0xFDF98008 //all the error bits
+
+//states in SD_STATUS_STATE
+#define SD_STATE_IDLE  0
+#define SD_STATE_READY 1
+#define SD_STATE_IDENT 2
+#define SD_STATE_STBY  3
+#define SD_STATE_TRAN  4
+#define SD_STATE_DATA  5
+#define SD_STATE_RCV   6
+#define SD_STATE_PRG   7
+
+//OCR bits (ACMD41)
+#define SD_OCR_BUSY     BIT(31) //set when initialization is done
+#define SD_OCR_VOLTAGES 0x00FF8000 //2.7-3.6V
+
+typedef struct {
+    //The controller's registers. Reserved ones are padding.
+    uint32_t DS_ADDR;
+    uint32_t BLK_ATT;
+    uint32_t CMD_ARG;
+    uint32_t CMD_XFR_TYP;
+    uint32_t CMD_RSP[4];
+    uint32_t DATA_BUFF_ACC_PORT;
+    uint32_t PRES_STATE;
+    uint32_t PROT_CTRL;
+    uint32_t SYS_CTRL;
+    uint32_t INT_STATUS;
+    uint32_t INT_STATUS_EN;
+    uint32_t INT_SIGNAL_EN;
+    uint32_t AUTOCMD12_ERR_STATUS;
+    uint32_t HOST_CTRL_CAP;
+    uint32_t WTMK_LVL;
+    uint32_t MIX_CTRL;
+    uint32_t _reserved4C;
+    uint32_t FORCE_EVENT;
+    uint32_t ADMA_ERR_STATUS;
+    uint32_t ADMA_SYS_ADDR;
+    uint32_t _reserved5C;
+    uint32_t DLL_CTRL;
+    uint32_t DLL_STATUS;
+    uint32_t CLK_TUNE_CTRL_STATUS;
+    uint32_t _reserved6C[21];
+    uint32_t VEND_SPEC;
+    uint32_t MMC_BOOT;
+    uint32_t VEND_SPEC2;
+    uint32_t TUNING_CTRL;
+} MicronUsdhcRegs;
+
+//BLK_ATT
+#define USDHC_BLK_ATT_BLKSIZE(n)  ((uint32_t)((n) & 0x1FFF))
+#define USDHC_BLK_ATT_BLKCNT(n)   ((uint32_t)((n) & 0xFFFF) << 16)
+
+//CMD_XFR_TYP
+#define USDHC_CMD_CMDINX(n)       ((uint32_t)((n) & 0x3F) << 24)
+#define USDHC_CMD_CMDTYP_ABORT    ((uint32_t)3 << 22)
+#define USDHC_CMD_DPSEL           BIT(21) //data follows
+#define USDHC_CMD_CICEN           BIT(20) //check response's index
+#define USDHC_CMD_CCCEN           BIT(19) //check response's CRC
+#define USDHC_CMD_RSPTYP_NONE     ((uint32_t)0 << 16)
+#define USDHC_CMD_RSPTYP_136      ((uint32_t)1 << 16)
+#define USDHC_CMD_RSPTYP_48       ((uint32_t)2 << 16)
+#define USDHC_CMD_RSPTYP_48_BUSY  ((uint32_t)3 << 16)
+#define USDHC_CMD_RSPTYP_MASK     ((uint32_t)3 << 16)
+
+//response types, as CMD_XFR_TYP bits
+#define USDHC_RESP_NONE USDHC_CMD_RSPTYP_NONE
+#define USDHC_RESP_R1   (USDHC_CMD_RSPTYP_48 | USDHC_CMD_CICEN | USDHC_CMD_CCCEN)
+#define USDHC_RESP_R1B  (USDHC_CMD_RSPTYP_48_BUSY | USDHC_CMD_CICEN | \
+    USDHC_CMD_CCCEN)
+#define USDHC_RESP_R2   (USDHC_CMD_RSPTYP_136 | USDHC_CMD_CCCEN)
+#define USDHC_RESP_R3   USDHC_CMD_RSPTYP_48 //no index or CRC
+#define USDHC_RESP_R6   USDHC_RESP_R1
+#define USDHC_RESP_R7   USDHC_RESP_R1
+
+//PRES_STATE
+#define USDHC_PRES_CIHB           BIT(0)  //command line in use
+#define USDHC_PRES_CDIHB          BIT(1)  //data lines in use
+#define USDHC_PRES_DLA            BIT(2)  //data line active
+#define USDHC_PRES_SDSTB          BIT(3)  //SD clock stable
+#define USDHC_PRES_CINST          BIT(16) //card inserted
+#define USDHC_PRES_DAT0           BIT(24) //DAT0 level (low = card busy)
+
+//PROT_CTRL
+#define USDHC_PROT_DTW_MASK       ((uint32_t)3 << 1)
+#define USDHC_PROT_DTW_1BIT       ((uint32_t)0 << 1)
+#define USDHC_PROT_DTW_4BIT       ((uint32_t)1 << 1)
+#define USDHC_PROT_EMODE_LITTLE   ((uint32_t)2 << 4)
+#define USDHC_PROT_DMASEL_ADMA2   ((uint32_t)2 << 8)
+
+//SYS_CTRL
+#define USDHC_SYS_DVS(n)          ((uint32_t)((n) & 0xF) << 4)
+#define USDHC_SYS_SDCLKFS(n)      ((uint32_t)((n) & 0xFF) << 8)
+#define USDHC_SYS_CLOCK_MASK      ((uint32_t)0xFFF0)
+#define USDHC_SYS_DTOCV(n)        ((uint32_t)((n) & 0xF) << 16)
+#define USDHC_SYS_DTOCV_MASK      ((uint32_t)0xF << 16)
+#define USDHC_SYS_RSTA            BIT(24) //reset everything
+#define USDHC_SYS_RSTC            BIT(25) //reset the command line
+#define USDHC_SYS_RSTD            BIT(26) //reset the data lines
+#define USDHC_SYS_INITA           BIT(27) //send 80 clocks to the card
+
+//INT_STATUS, INT_STATUS_EN, INT_SIGNAL_EN
+#define USDHC_INT_CC              BIT(0)  //command complete
+#define USDHC_INT_TC              BIT(1)  //transfer complete
+#define USDHC_INT_BGE             BIT(2)  //block gap
+#define USDHC_INT_DINT            BIT(3)  //DMA interrupt
+#define USDHC_INT_BWR             BIT(4)  //buffer write ready
+#define USDHC_INT_BRR             BIT(5)  //buffer read ready
+#define USDHC_INT_CTOE            BIT(16) //command timeout
+#define USDHC_INT_CCE             BIT(17) //command CRC error
+#define USDHC_INT_CEBE            BIT(18) //command end bit error
+#define USDHC_INT_CIE             BIT(19) //command index error
+#define USDHC_INT_DTOE            BIT(20) //data timeout
+#define USDHC_INT_DCE             BIT(21) //data CRC error
+#define USDHC_INT_DEBE            BIT(22) //data end bit error
+#define USDHC_INT_AC12E           BIT(24) //auto CMD12 error
+#define USDHC_INT_DMAE            BIT(28) //DMA error
+#define USDHC_INT_CMD_ERRORS      (USDHC_INT_CTOE | USDHC_INT_CCE | \
+    USDHC_INT_CEBE | USDHC_INT_CIE)
+#define USDHC_INT_DATA_ERRORS     (USDHC_INT_DTOE | USDHC_INT_DCE | \
+    USDHC_INT_DEBE | USDHC_INT_AC12E | USDHC_INT_DMAE)
+
+//WTMK_LVL, in words
+#define USDHC_WTMK_RD_WML(n)      ((uint32_t)((n) & 0xFF))
+#define USDHC_WTMK_RD_BRST_LEN(n) ((uint32_t)((n) & 0x1F) << 8)
+#define USDHC_WTMK_WR_WML(n)      ((uint32_t)((n) & 0xFF) << 16)
+#define USDHC_WTMK_WR_BRST_LEN(n) ((uint32_t)((n) & 0x1F) << 24)
+
+//MIX_CTRL
+#define USDHC_MIX_DMAEN           BIT(0)
+#define USDHC_MIX_BCEN            BIT(1) //block count enable
+#define USDHC_MIX_AC12EN          BIT(2) //send CMD12 after the last block
+#define USDHC_MIX_DTDSEL          BIT(4) //card to host
+#define USDHC_MIX_MSBSEL          BIT(5) //multiple blocks
+#define USDHC_MIX_XFER_MASK       ((uint32_t)0x3F)
+
+//ADMA2 descriptor attributes
+#define USDHC_ADMA_VALID          BIT(0)
+#define USDHC_ADMA_END            BIT(1)
+#define USDHC_ADMA_INT            BIT(2)
+#define USDHC_ADMA_ACT_TRAN       (2 << 4)
+#define USDHC_ADMA_ACT_LINK       (3 << 4)
+#define USDHC_ADMA_ACT_MASK       (3 << 4)
+//a descriptor's length is 16 bits; keep it a whole number of blocks.
+#define USDHC_ADMA_MAX_BLOCKS     127
+
+//register access. sdsim replaces these to talk to its model instead.
+#if defined(USDHC_SIM)
+    uint32_t usdhcSimRead(uint32_t offset);
+    void usdhcSimWrite(uint32_t offset, uint32_t value);
+    uint32_t usdhcSimDmaAddr(const void *ptr, uint32_t len);
+    #define USDHC_REG_READ(state, reg) \
+        usdhcSimRead(offsetof(MicronUsdhcRegs, reg))
+    #define USDHC_REG_WRITE(state, reg, val) \
+        usdhcSimWrite(offsetof(MicronUsdhcRegs, reg), (val))
+    #define USDHC_DMA_ADDR(ptr, len) usdhcSimDmaAddr((ptr), (len))
+#else
+    #define USDHC_REG_READ(state, reg) ((state)->regs->reg)
+    #define USDHC_REG_WRITE(state, reg, val) ((state)->regs->reg = (val))
+    #define USDHC_DMA_ADDR(ptr, len) ((uint32_t)(ptr))
+#endif
+
+typedef struct {
+    //An ADMA2 descriptor.
+    uint16_t attr; //USDHC_ADMA_*
+    uint16_t len;  //bytes
+    uint32_t addr;
+} MicronUsdhcAdmaDesc;
+
+typedef struct {
+    //What the driver has seen.
+    uint32_t cmds;       //commands sent
+    uint32_t cmdErrors;  //commands with no response, or a bad one
+    uint32_t dataErrors; //transfers with a CRC error or timeout
+    uint32_t dmaErrors;  //transfers the DMA engine gave up on
+    uint32_t retries;    //transfers retried
+    uint32_t transfers;  //read and write commands
+    uint32_t blocks;     //blocks read and written
+    uint32_t bounced;    //blocks copied through the bounce buffer
+} MicronUsdhcStats;
+
+typedef struct {
+    uint8_t  port;         //which uSDHC (only 1 is wired to anything)
+    uint8_t  cardVersion;  //SD card protocol version (1 or 2)
+    uint8_t  highCapacity; //takes block numbers, not byte addresses (SDHC)
+    uint8_t  busWidth;     //data bits, 1 or 4
+    uint8_t  highSpeed;    //whether the card is in high speed mode
+    uint8_t  eraseAny;     //whether the card can erase part of an erase sector
+    uint16_t rca;          //card's relative address
+    uint32_t ocr;          //from ACMD41
+    uint32_t clockHz;      //SD clock actually set
+    uint32_t status;       //card status from the last R1 response
+    uint64_t cardSize;     //capacity in bytes
+    uint32_t nBlocks;      //capacity in SD_BLOCK_SIZE blocks
+    uint32_t eraseSize;    //erase sector size in blocks
+    uint8_t  cid[16];      //card's CID and CSD registers, without CRC
+    uint8_t  csd[16];
+    volatile MicronUsdhcRegs *regs; //set by usdhcInit
+    MicronUsdhcStats stats;
+    MicronUsdhcAdmaDesc adma[USDHC_ADMA_DESCS]
+        __attribute__((aligned(USDHC_DMA_ALIGN)));
+    uint8_t bounce[USDHC_BOUNCE_BLOCKS * SD_BLOCK_SIZE]
+        __attribute__((aligned(USDHC_DMA_ALIGN)));
+} MicronUsdhcState;
+
+#include "filecls.h"
+
+//init.c
+int usdhcReset(MicronUsdhcState *state, uint32_t timeout);
+int usdhcHighSpeed(MicronUsdhcState *state, uint32_t timeout);
+
+//io.c
+int _usdhcTransfer(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+    uint32_t blockSize, uint32_t count, void *buf, bool write,
+    uint32_t timeout);
+int usdhcReadBlocks(MicronUsdhcState *state, uint32_t firstBlock,
+    uint32_t count, void *dest, uint32_t timeout);
+int usdhcWriteBlocks(MicronUsdhcState *state, uint32_t firstBlock,
+    uint32_t count, const void *src, uint32_t timeout);
+int usdhcEraseBegin(MicronUsdhcState *state, uint32_t firstBlock,
+    uint32_t count, uint32_t timeout);
+int usdhcErase(MicronUsdhcState *state, uint32_t firstBlock, uint32_t count,
+    uint32_t timeout);
+int usdhcDiscard(MicronUsdhcState *state, uint32_t firstBlock,
+    uint32_t count, uint32_t timeout);
+
+//usdhc.c
+int usdhcInit(MicronUsdhcState *state);
+int _usdhcSetClock(MicronUsdhcState *state, uint32_t hz);
+int _usdhcWaitIdle(MicronUsdhcState *state, bool data, uint32_t timeout);
+int _usdhcCommand(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+    uint32_t flags, uint32_t timeout);
+int _usdhcAppCommand(MicronUsdhcState *state, uint8_t cmd, uint32_t arg,
+    uint32_t flags, uint32_t timeout);
+int _usdhcWaitBusy(MicronUsdhcState *state, uint32_t timeout);
+int _usdhcWaitStatus(MicronUsdhcState *state, uint32_t timeout);
+void _usdhcResetLines(MicronUsdhcState *state, uint32_t which);
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif //_MICRON_DRIVERS_IMX_USDHC_H_
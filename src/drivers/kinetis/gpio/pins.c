@@ -55,6 +55,30 @@ volatile uint32_t* const pinConfigAddr[] = {
 #undef _PCR
 
 
+int kinetis_gpioSetPinInterrupt(uint32_t pin, PinInterruptMode mode) {
+	//set the pin's IRQC bits, and enable its port's IRQ. the IRQ stays
+	//enabled, since other pins on the port may be using it.
+	uint32_t irqc;
+	switch(mode) {
+		case PIN_INTERRUPT_NONE:    irqc = PCR_IRQ_NONE;    break;
+		case PIN_INTERRUPT_RISING:  irqc = PCR_IRQ_RISING;  break;
+		case PIN_INTERRUPT_FALLING: irqc = PCR_IRQ_FALLING; break;
+		case PIN_INTERRUPT_EITHER:  irqc = PCR_IRQ_EITHER;  break;
+		case PIN_INTERRUPT_LOW:     irqc = PCR_IRQ_ZERO;    break;
+		case PIN_INTERRUPT_HIGH:    irqc = PCR_IRQ_ONE;     break;
+		default: return -EINVAL;
+	}
+	kinetis_setPinInterrupt(pin, irqc);
+	if(irqc != PCR_IRQ_NONE) {
+		//each port's PCRs are 4K apart, starting with port A's.
+		uint32_t port = ((uint32_t)pinConfigAddr[pin] -
+			(uint32_t)&PORTA_PCR0) >> 12;
+		irqEnableInterrupt(IRQ_PORTA + port);
+	}
+	return 0;
+}
+
+
 #ifdef __cplusplus
 	} //extern "C"
 #endif
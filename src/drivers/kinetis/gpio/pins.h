@@ -205,6 +205,10 @@ INLINE void kinetis_setPinInterrupt(int pin, uint32_t mode) {
 }
 
 
+//pins.c
+int kinetis_gpioSetPinInterrupt(uint32_t pin, PinInterruptMode mode);
+
+
 //Fast digital pin write.
 //Copied from Teensy's digitalWriteFast() (but this version is using
 //bitband registers).
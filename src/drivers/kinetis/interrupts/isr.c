@@ -50,7 +50,10 @@ ISRFUNC void isrDefaultSystick(void) {
 
 
 //GPIO interrupt handlers
-WEAK void isrPin(int pin) { isrUnused(); }
+WEAK void isrPin(int pin) {
+	//call the handler set by gpioSetPinInterrupt(), if any.
+	if(!_gpioPinIsr(pin)) isrUnused();
+}
 
 ISRFUNC void isrDefaultPortA(void) {
 	uint32_t isfr = PORTA_ISFR;
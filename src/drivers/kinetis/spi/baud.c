@@ -159,6 +159,25 @@ uint32_t *outBR, uint32_t *outDBR, uint32_t *outActualBaud) {
     return -ERANGE;
 }
 
+int kinetis_spiGetMaxBaud(uint32_t baud, uint32_t *outBaud) {
+    //find the fastest baud rate we can actually produce that isn't faster
+    //than the given one. unlike kinetis_spiGetParamsForBaud, this never
+    //rounds up, so it's safe for devices with a maximum clock.
+    uint64_t f_sys = 0;
+    int err = osGetClockSpeed(MICRON_CLOCK_BUS, &f_sys);
+    if(err) return err;
+
+    uint32_t best = 0;
+    for(int i=0; _spiBaudLut[i]; i++) {
+        uint32_t pbr, br, dbr, actual;
+        _decodeTableEntry(_spiBaudLut[i], &pbr, &br, &dbr, &actual, f_sys);
+        if(actual <= baud && actual > best) best = actual;
+    }
+    if(!best) return -ERANGE;
+    *outBaud = best;
+    return 0;
+}
+
 #ifdef __cplusplus
     } //extern "C"
 #endif
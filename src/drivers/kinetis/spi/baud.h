@@ -7,6 +7,7 @@
 
 int kinetis_spiGetParamsForBaud(uint32_t baud, uint32_t *outPBR,
 uint32_t *outBR, uint32_t *outDBR, uint32_t *outActualBaud);
+int kinetis_spiGetMaxBaud(uint32_t baud, uint32_t *outBaud);
 
 #ifdef __cplusplus
     } //extern "C"
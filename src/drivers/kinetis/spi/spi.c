@@ -155,6 +155,10 @@ int kinetis_spiSetSpeed(uint32_t port, uint32_t speed) {
     return 0;
 }
 
+int kinetis_spiGetMaxSpeed(uint32_t port, uint32_t speed, uint32_t *outSpeed) {
+    return kinetis_spiGetMaxBaud(speed, outSpeed);
+}
+
 int kinetis_spiSetFrameSize(uint32_t port, uint32_t size) {
     bool paused = kinetis_spiPause(port, true); //required to change other bits
     uint32_t mask = ~SPI_CTAR_FMSZ(15);
@@ -414,6 +418,23 @@ int kinetis_spiClear(uint32_t port) {
     return 0;
 }
 
+int kinetis_spiHoldCS(uint32_t port, bool hold) {
+    //the SPI module only asserts its PCS pins while sending, so to hold one
+    //we take the pin back as a GPIO driven low. other pins are driven
+    //manually and are already low.
+    MicronSpiState *state = _spiState[port];
+    if(!state) return -EBADFD;
+    uint8_t pin = state->pinCS;
+    if(!pcs[port]) return 0;
+    if(hold) {
+        PDOR(pin) = 0;
+        PDDR(pin) = 1;
+        PCR(pin)  = PCR_OUTPUT;
+    }
+    else PCR(pin) = PORT_PCR_MUX(2);
+    return 0;
+}
+
 #ifdef __cplusplus
     } //extern "C"
 #endif
@@ -23,12 +23,14 @@ int kinetis_spiShutdown(uint32_t port);
 int kinetis_spiPause(uint32_t port, bool pause);
 int kinetis_spiSetMode(uint32_t port, MicronSpiModeEnum mode);
 int kinetis_spiSetSpeed(uint32_t port, uint32_t speed);
+int kinetis_spiGetMaxSpeed(uint32_t port, uint32_t speed, uint32_t *outSpeed);
 int kinetis_spiSetFrameSize(uint32_t port, uint32_t size);
 int kinetis_spiWriteDummy(uint32_t port, uint32_t data, uint32_t count, bool cs);
 int kinetis_spiWrite(uint32_t port, const void *data, uint32_t len, bool cont);
 int kinetis_spiRead(uint32_t port, void *out, uint32_t len, uint32_t timeout);
 int kinetis_spiWaitTxDone(uint32_t port, uint32_t timeout);
 int kinetis_spiClear(uint32_t port);
+int kinetis_spiHoldCS(uint32_t port, bool hold);
 
 #ifdef __cplusplus
     } //extern "C"
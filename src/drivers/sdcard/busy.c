@@ -0,0 +1,180 @@
+//Waiting while the card is busy.
+//After a write, CMD12 or an erase, the card holds DO (MISO) low until it's
+//done, which can take many milliseconds. Clocking dummy bytes to watch for
+//that keeps the CPU and the bus busy the whole time, so after a short spin
+//(most busy phases are short) we sleep between polls instead: either once
+//per interrupt, which the systick provides every millisecond, or until a
+//pin interrupt on DO says the card has let go. For the latter, the card has
+//to stay selected, since it only drives DO while CS is asserted.
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+static void _busyIsr(uint32_t pin, void *param) {
+    //DO rose; wake whoever is waiting. one edge is all we need.
+    MicronSdCardState *state = (MicronSdCardState*)param;
+    gpioSetPinInterrupt(pin, PIN_INTERRUPT_NONE, NULL, NULL);
+    state->busyWake = 1;
+    state->busyStats.wakes++;
+}
+
+
+static int _poll(MicronSdCardState *state) {
+    //clock one byte out of the card: 0xFF means it's no longer busy.
+    //return 1 if busy, 0 if not, or negative error code.
+    //anything left over from before would be read in place of the byte
+    //we're sending, which at one poll per millisecond adds up.
+    state->busyStats.polls++;
+    _sdDrainRx(state);
+    int err = _sdSendDummyBytes(state, 1, 10, true);
+    if(err < 0 && err != -ETIMEDOUT) return err;
+    uint8_t r = 0x00;
+    err = spiReadBlocking(state->port, &r, 1, 50);
+    if(err < 0 && err != -ETIMEDOUT) return err;
+    return (err != -ETIMEDOUT && r == 0xFF) ? 0 : 1;
+}
+
+
+static void _disarm(MicronSdCardState *state) {
+    gpioSetPinInterrupt(state->pinBusy, PIN_INTERRUPT_NONE, NULL, NULL);
+    spiHoldCS(state->port, false);
+    state->busyArmed = 0;
+}
+
+
+static void _arm(MicronSdCardState *state) {
+    //keep the card selected and wait for DO to rise.
+    state->busyWake = 0;
+    state->busyNextPoll = millis() + SDCARD_BUSY_PIN_POLL_MS;
+    int err = spiHoldCS(state->port, true);
+    if(!err) err = gpioSetPinInterrupt(state->pinBusy, PIN_INTERRUPT_RISING,
+        _busyIsr, state);
+    if(err) {
+        #if SDCARD_DEBUG_PRINT
+            printf("SD: busy pin interrupt failed (%d), polling\r\n", err);
+        #endif
+        spiHoldCS(state->port, false);
+        state->busyMode = SD_BUSY_POLL;
+        return;
+    }
+    state->busyArmed = 1;
+    //it may have risen before the interrupt was set up.
+    if(gpioGetPinInput(state->pinBusy) == 1) state->busyWake = 1;
+}
+
+
+void _sdBusyBegin(MicronSdCardState *state) {
+    /** Note that the card has just gone busy.
+     *  @param state Card state.
+     *  @note Call before _sdBusyStep(), which uses this to tell how long
+     *   it's been.
+     */
+    state->busySince = micros();
+    state->busyStats.waits++;
+}
+
+
+int _sdBusyStep(MicronSdCardState *state) {
+    /** Check whether the card is still busy, without waiting.
+     *  @param state Card state.
+     *  @return 1 if busy, 0 if not, or negative error code on failure.
+     *  @note This sends at most one byte. While waiting on the pin it only
+     *   sends one once the pin has risen, or every SDCARD_BUSY_PIN_POLL_MS
+     *   in case it never does.
+     */
+    if(state->busyArmed) {
+        if(!state->busyWake && gpioGetPinInput(state->pinBusy) != 1
+        && millis() < state->busyNextPoll) return 1;
+        _disarm(state);
+    }
+    int err = _poll(state);
+    if(err <= 0) return err;
+    if(state->busyMode == SD_BUSY_PIN
+    && micros() - state->busySince >= SDCARD_BUSY_SPIN_US) _arm(state);
+    return 1;
+}
+
+
+void _sdBusySleep(MicronSdCardState *state) {
+    /** Sleep until it's time to check on a busy card again.
+     *  @param state Card state.
+     *  @note Returns at once if it hasn't been busy for SDCARD_BUSY_SPIN_US
+     *   yet, or in SD_BUSY_SPIN mode.
+     */
+    if(state->busyMode == SD_BUSY_SPIN
+    || micros() - state->busySince < SDCARD_BUSY_SPIN_US) return;
+    //with interrupts off, an interrupt that comes after checking still
+    //wakes us, rather than being missed.
+    irqDisable();
+    if(!state->busyWake) irqWait();
+    irqEnable();
+    state->busyStats.sleeps++;
+}
+
+
+void _sdBusyEnd(MicronSdCardState *state) {
+    /** Stop waiting for the card, eg after a timeout.
+     *  @param state Card state.
+     */
+    if(state->busyArmed) _disarm(state);
+}
+
+
+int _sdWaitNotBusy(MicronSdCardState *state, uint32_t timeout) {
+    /** Wait until the card is no longer busy.
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The card holds its output low while busy (eg after CMD12),
+     *   so this waits for a 0xFF byte. How it waits is set by sdBusyInit().
+     */
+    uint32_t limit = millis() + timeout;
+    _sdBusyBegin(state);
+    while(1) {
+        int err = _sdBusyStep(state);
+        if(err <= 0) return err;
+        if(millis() >= limit) {
+            _sdBusyEnd(state);
+            return -ETIMEDOUT;
+        }
+        _sdBusySleep(state);
+    }
+}
+
+
+int sdBusyInit(MicronSdCardState *state, MicronSdBusyMode mode, uint8_t pin) {
+    /** Choose how to wait while the card is busy.
+     *  @param state Card state.
+     *  @param mode How to wait:
+     *   SD_BUSY_SPIN: poll the card continuously.
+     *   SD_BUSY_POLL: poll for SDCARD_BUSY_SPIN_US, then sleep and poll once
+     *    per interrupt (at least every millisecond, from the systick).
+     *    This is the default.
+     *   SD_BUSY_PIN: poll for SDCARD_BUSY_SPIN_US, then sleep until `pin`
+     *    rises, polling every SDCARD_BUSY_PIN_POLL_MS in case it doesn't.
+     *  @param pin For SD_BUSY_PIN, a pin connected to the card's DO (the SPI
+     *   port's MISO pin will do).
+     *  @return 0 on success, or negative error code on failure: -EINVAL if
+     *   the mode is unknown, -ENOSYS if the hardware can't do SD_BUSY_PIN.
+     *  @note This uses the HAL's pin interrupts, so it doesn't work if the
+     *   program has its own isrPin(). If setting up the interrupt fails
+     *   later, it goes back to SD_BUSY_POLL.
+     */
+    if(state->busyArmed) _disarm(state);
+    switch(mode) {
+        case SD_BUSY_SPIN:
+        case SD_BUSY_POLL:
+            break;
+        case SD_BUSY_PIN: {
+            int err = gpioSetPinInterrupt(pin, PIN_INTERRUPT_NONE, NULL, NULL);
+            if(!err) err = spiHoldCS(state->port, false);
+            if(err) return err;
+            break;
+        }
+        default: return -EINVAL;
+    }
+    state->busyMode = mode;
+    state->pinBusy = pin;
+    return 0;
+}
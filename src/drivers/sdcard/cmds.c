@@ -26,6 +26,19 @@ uint8_t *resp, size_t respSize, uint32_t timeout) {
         0, //CRC
     };
     data[5] = sdcardCalcCrc(data, 5);
+
+    //a command ends any transfer read-ahead has going, so end it properly,
+    //and has to wait for an erase to finish. lower the clock if it's been
+    //causing errors. CMD12 is sent in the middle of a transfer, so that's
+    //not the time for any of these.
+    if(cmd != SD_CMD_STOP_READ) {
+        err = sdEraseWait(state);
+        if(err) return err;
+        err = sdReadAheadStop(state);
+        if(err) return err;
+        err = _sdSpeedCheck(state, timeout);
+        if(err) return err;
+    }
     spiClear(state->port);
 
     //Send command.
@@ -64,13 +77,34 @@ uint8_t *resp, size_t respSize, uint32_t timeout) {
         default:                       respType = 0x01; break;
     }
     switch(respType) {
-        case 0x01: return _sdGetRespR1(state, resp, timeout);
+        case 0x01:
+            err = _sdGetRespR1(state, resp, timeout);
+            //bit 7 is never set in a real response, and the CRC error bit
+            //means our command arrived garbled.
+            if(err == -ETIMEDOUT ||
+            (!err && (resp[0] & (SD_RESP_ZERO | SD_RESP_CRC_ERR)))) {
+                _sdSpeedError(state, false);
+            }
+            return err;
         case 0x02: return _sdGetRespR2(state, resp, timeout);
         //XXX how is R7 different from R3?
         case 0x03: return _sdGetRespR7(state, resp, timeout);
         case 0x07: return _sdGetRespR7(state, resp, timeout);
-        case 0x1B: //R1 followed by busy flag (wait until not FF)
-            return _sdGetRespR1(state, resp, timeout);
+        case 0x1B: { //R1 followed by busy flag (wait until not 00)
+            //this is STOP_READ, which is sent while the card is still
+            //sending data, so what we received while sending the command
+            //isn't all 0xFF, and there's a stuff byte before the response.
+            uint8_t junk[12];
+            err = spiReadBlocking(state->port, junk, sizeof(junk), timeout);
+            if(err < 0) return err;
+            err = _sdSendDummyBytes(state, 1, timeout, true);
+            if(err < 0) return err;
+            err = spiReadBlocking(state->port, junk, 1, timeout);
+            if(err < 0) return err;
+            err = _sdGetRespR1(state, resp, timeout);
+            if(err < 0) return err;
+            return _sdWaitNotBusy(state, timeout);
+        }
         default:
             #if SDCARD_DEBUG_PRINT
                 printf("SD: Unknown RespType 0x%02X\r\n", respType);
@@ -97,6 +131,26 @@ bool cs) {
 }
 
 
+uint32_t _sdBlockAddress(MicronSdCardState *state, uint32_t block) {
+    /** Get the address to send in a command for a block.
+     *  @param state Card state.
+     *  @param block Block number.
+     *  @return The address: the block number itself for high capacity
+     *   cards, or its byte offset for standard capacity ones.
+     */
+    return state->byteAddr ? block * SD_BLOCK_SIZE : block;
+}
+
+
+void _sdDrainRx(MicronSdCardState *state) {
+    /** Discard whatever has been received but not read.
+     *  @param state Card state.
+     */
+    uint8_t junk[16];
+    while(spiRead(state->port, junk, sizeof(junk), 0) > 0);
+}
+
+
 int _sdSendCmd0(MicronSdCardState *state, uint32_t timeout) {
     /** Send CMD0, ie RESET.
      *  @param state Card state.
@@ -196,6 +250,60 @@ int _sdSendCmd8(MicronSdCardState *state, uint32_t timeout) {
 }
 
 
+int _sdSendCmd12(MicronSdCardState *state, uint32_t timeout) {
+    /** Send CMD12, ie STOP_READ, and wait until the card isn't busy.
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Ends a CMD18 transfer.
+     */
+    uint8_t resp = 0xFF; //don't care about the value
+    return sdcardSendCommand(state, SD_CMD_STOP_READ, 0, &resp, 1, timeout);
+}
+
+
+int _sdSendCmd18(MicronSdCardState *state, uint32_t block,
+uint32_t timeout) {
+    /** Send CMD18, ie READ_BLOCKS.
+     *  @param state Card state.
+     *  @param block Block number to start at.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note The card then sends blocks until it gets CMD12.
+     */
+    uint32_t limit = millis() + timeout;
+    int ok, err;
+    do {
+        if(millis() >= limit) return -ETIMEDOUT;
+        ok = 0;
+        uint8_t resp = 0xFF; //arbitrary dummy value
+        err = sdcardSendCommand(state, SD_CMD_READ_BLOCKS,
+            _sdBlockAddress(state, block), &resp, 1, timeout);
+        if(err) return err;
+        if(resp == 0x00) ok = 1;
+        if(resp & SD_RESP_PARAM_ERR) return -ERANGE;
+    } while(!ok);
+    return 0;
+}
+
+
+int _sdSendCmd58(MicronSdCardState *state, uint32_t *ocr, uint32_t timeout) {
+    /** Send CMD58, ie READ_OCR.
+     *  @param state Card state.
+     *  @param ocr Receives the OCR register.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Only meaningful for version 2 cards, after CMD41 succeeds.
+     */
+    uint8_t resp[5];
+    int err = sdcardSendCommand(state, SD_CMD_READ_OCR, 0, resp, 5, timeout);
+    if(err) return err;
+    if(resp[0] & ~SD_RESP_IDLE) return -EIO;
+    *ocr = (resp[1] << 24) | (resp[2] << 16) | (resp[3] << 8) | resp[4];
+    return 0;
+}
+
+
 int _sdSendCmd41(MicronSdCardState *state, uint32_t timeout) {
     /** Send CMD41 (aka ACMD41), ie INIT for new cards.
      *  @param state Card state.
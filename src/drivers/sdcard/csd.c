@@ -402,7 +402,8 @@ int sdReadInfo(MicronSdCardState *state, uint32_t timeout) {
      *  @param timeout Maximum time to wait, in milliseconds.
      *  @return 0 on success, or negative error code on failure.
      *  @note fills in state->cardVersion, state->cardSize, state->nSectors,
-     *   state->sectorSize, state->accessSpeed, state->transferRate.
+     *   state->sectorSize, state->eraseSize, state->eraseAny,
+     *   state->accessSpeed, state->transferRate.
      */
     int err;
     uint8_t buf[SD_CSD_SIZE];
@@ -445,6 +446,10 @@ int sdReadInfo(MicronSdCardState *state, uint32_t timeout) {
     state->cardSize = memoryCapacity;
     state->nSectors = blocks;
     state->sectorSize = blockSize;
+    //SECTOR_SIZE is in write blocks, which may be bigger than ours.
+    state->eraseSize = MAX(((csd.sectorSize + 1) << csd.writeBlLen) /
+        SD_BLOCK_SIZE, 1U);
+    state->eraseAny = csd.eraseBlkEn;
     calcSpeeds(state, &csd);
 
     #if SDCARD_DEBUG_PRINT
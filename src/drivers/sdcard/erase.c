@@ -0,0 +1,167 @@
+//Erasing.
+//CMD32 and CMD33 give the first and last block to erase, and CMD38 erases
+//them. Blocks written after being erased are written faster, since the card
+//doesn't have to erase them first. Erasing a big range can keep the card
+//busy for a long time, so sdEraseBegin() returns as soon as the card has
+//started. The busy phase ends with sdEraseStep(), or with the next command,
+//which waits for it.
+//Cards erase in units of the erase sector (from the CSD). Some can only
+//erase whole sectors, and erase all of any sector a range touches.
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+static int _sendEraseCmd(MicronSdCardState *state, uint8_t cmd, uint32_t arg,
+uint32_t timeout) {
+    //send CMD32, CMD33 or CMD38 and check the response.
+    uint8_t resp = 0xFF; //arbitrary dummy value
+    int err = sdcardSendCommand(state, cmd, arg, &resp, 1, timeout);
+    if(err) return err;
+    if(resp & (SD_RESP_PARAM_ERR | SD_RESP_ADDR_ERR)) return -ERANGE;
+    if(resp & ~SD_RESP_IDLE) return -EIO;
+    return 0;
+}
+
+
+static void _uncache(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count) {
+    //remove erased blocks from the cache. the range may be much bigger
+    //than the cache, so go through the entries rather than the blocks.
+    MicronBlockCache *cache = &state->blockCache;
+    for(uint16_t i=0; i<cache->size; i++) {
+        MicronBlockCacheEntry *ent = &cache->entries[i];
+        if((ent->flags & BLOCKCACHE_VALID) && ent->block >= firstBlock
+        && ent->block - firstBlock < count) {
+            blockCacheDiscard(cache, i);
+        }
+    }
+}
+
+
+int sdEraseBegin(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, uint32_t timeout) {
+    /** Start erasing blocks.
+     *  @param state Card state.
+     *  @param firstBlock First block to erase.
+     *  @param count Number of blocks to erase.
+     *  @param timeout Maximum time to wait, in milliseconds, for the
+     *   commands and then for the card to finish erasing.
+     *  @return 0 on success, or negative error code on failure: -ERANGE if
+     *   the range goes past the end of the card, -EINVAL if it's empty or
+     *   the card can only erase whole erase sectors and it doesn't cover
+     *   them exactly, -ENODATA if sdReadInfo() hasn't been called.
+     *  @note This returns while the card is still erasing. Call
+     *   sdEraseStep() to see when it's done; any other command waits for
+     *   it first. Erased blocks read as all 0x00 or all 0xFF, depending on
+     *   the card. Anything queued (see sdQueueStep()) should be finished
+     *   first, since writes queued before this would land after it.
+     */
+    if(!state->eraseSize) return -ENODATA;
+    if(!count) return -EINVAL;
+    uint64_t nBlocks = state->cardSize / SD_BLOCK_SIZE;
+    if((uint64_t)firstBlock + count > nBlocks) return -ERANGE;
+    if(!state->eraseAny && ((firstBlock % state->eraseSize)
+    || (count % state->eraseSize))) return -EINVAL;
+
+    //drop cached copies first, so they're gone even if this fails partway.
+    _uncache(state, firstBlock, count);
+
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: Erase 0x%X x %d\r\n", firstBlock, count);
+    #endif
+    int err = _sendEraseCmd(state, SD_CMD_ERASE_START,
+        _sdBlockAddress(state, firstBlock), timeout);
+    if(!err) err = _sendEraseCmd(state, SD_CMD_ERASE_END,
+        _sdBlockAddress(state, firstBlock + count - 1), timeout);
+    if(err) return err;
+
+    //the busy phase starts right after the R1, so count the timeout from
+    //here, before sending.
+    state->eraseLimit = millis() + timeout;
+    err = _sendEraseCmd(state, SD_CMD_ERASE, 0, timeout);
+    if(err) return err;
+    _sdBusyBegin(state);
+    state->erasing = 1;
+    return 0;
+}
+
+
+int sdEraseStep(MicronSdCardState *state) {
+    /** Check whether an erase has finished.
+     *  @param state Card state.
+     *  @return 1 if the card is still erasing, 0 if it's done (or nothing
+     *   was being erased), or negative error code on failure: -ETIMEDOUT
+     *   if it took longer than the timeout given to sdEraseBegin().
+     *  @note This sends at most one byte to the card, so it returns
+     *   quickly. See _sdBusyStep().
+     */
+    if(!state->erasing) return 0;
+    int err = _sdBusyStep(state);
+    if(err < 0) return err;
+    if(!err) {
+        state->erasing = 0;
+        return 0;
+    }
+    if(millis() >= state->eraseLimit) {
+        _sdBusyEnd(state);
+        state->erasing = 0;
+        return -ETIMEDOUT;
+    }
+    return 1;
+}
+
+
+int sdEraseWait(MicronSdCardState *state) {
+    /** Wait for an erase to finish.
+     *  @param state Card state.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note sdcardSendCommand() calls this, so commands wait for the card.
+     *   It sleeps between checks, as set by sdBusyInit().
+     */
+    int err;
+    while((err = sdEraseStep(state)) > 0) _sdBusySleep(state);
+    return err;
+}
+
+
+int sdErase(MicronSdCardState *state, uint32_t firstBlock, uint32_t count,
+uint32_t timeout) {
+    /** Erase blocks, and wait until the card is done.
+     *  @param state Card state.
+     *  @param firstBlock First block to erase.
+     *  @param count Number of blocks to erase.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note See sdEraseBegin().
+     */
+    int err = sdEraseBegin(state, firstBlock, count, timeout);
+    if(err) return err;
+    return sdEraseWait(state);
+}
+
+
+int sdDiscard(MicronSdCardState *state, uint32_t firstBlock, uint32_t count,
+uint32_t timeout) {
+    /** Tell the card that blocks' contents are no longer needed.
+     *  @param state Card state.
+     *  @param firstBlock First block.
+     *  @param count Number of blocks.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of blocks erased, starting from the first whole erase
+     *   sector in the range, or negative error code on failure.
+     *  @note Only whole erase sectors are erased, since those are what
+     *   makes later writes faster; the blocks around them are left alone.
+     *   Like sdEraseBegin(), this returns while the card is still erasing.
+     */
+    if(!state->eraseSize) return -ENODATA;
+    uint64_t nBlocks = state->cardSize / SD_BLOCK_SIZE;
+    if((uint64_t)firstBlock + count > nBlocks) return -ERANGE;
+    uint32_t size  = state->eraseSize;
+    uint64_t start = (((uint64_t)firstBlock + size - 1) / size) * size;
+    uint64_t end   = (((uint64_t)firstBlock + count) / size) * size;
+    if(end <= start) return 0;
+    int err = sdEraseBegin(state, start, end - start, timeout);
+    if(err) return err;
+    return end - start;
+}
@@ -16,35 +16,78 @@ int sdFileCls_read(FILE *self, void *dest, size_t len) {
     uint32_t part  = self->offset % SD_BLOCK_SIZE;
     uint8_t *out = (uint8_t*)dest;
     int err = 0, count = 0;
-    for(size_t i=0; i<len; i += SD_BLOCK_SIZE) {
-        //XXX use sdReadBlocks for large sizes; allow setting timeout?
-        size_t remLen = len - i; //remaining length
+    while((size_t)count < len) {
+        //XXX allow setting timeout?
+        size_t remLen = len - count; //remaining length
+        size_t n;
         if(!part && remLen >= SD_BLOCK_SIZE) {
-            //read directly into dest
-            for(int tries=0; tries<5; tries++) {
-                err = sdReadBlock(state, block, out, 10000, true);
-                if(err != -EIO) break; //retry if CRC error
-            }
+            //read all the whole blocks at once, directly into dest
+            uint32_t numBlocks = remLen / SD_BLOCK_SIZE;
+            err = sdReadMultiple(state, block, numBlocks, out, 10000, true);
+            if(err < 0) return err;
+            n = numBlocks * SD_BLOCK_SIZE;
+            block += numBlocks;
         }
         else { //read into buf and copy to dest
             //XXX do some cards allow to read partial blocks?
             uint8_t buf[SD_BLOCK_SIZE];
-            for(int tries=0; tries<5; tries++) {
+            for(int tries=0; tries<SDCARD_READ_RETRIES; tries++) {
                 err = sdReadBlock(state, block, buf, 10000, true);
                 if(err != -EIO) break; //retry if CRC error
             }
-            if(!err) memcpy(out, &buf[part], MIN((size_t)SD_BLOCK_SIZE, remLen));
+            if(err < 0) return err;
+            n = MIN((size_t)SD_BLOCK_SIZE - part, remLen);
+            memcpy(out, &buf[part], n);
+            block++;
         }
-        if(err) return err;
-        count += SD_BLOCK_SIZE - part;
-        self->offset += SD_BLOCK_SIZE - part;
+        out   += n;
+        count += n;
+        self->offset += n;
         part = 0;
     }
     return count;
 }
 
 int sdFileCls_write(FILE *self, const void *src, size_t len) {
-    return -ENOSYS; //TODO
+    MicronSdCardState *state = (MicronSdCardState*)self->udata.ptr;
+    uint32_t block = self->offset / SD_BLOCK_SIZE;
+    uint32_t part  = self->offset % SD_BLOCK_SIZE;
+    const uint8_t *in = (const uint8_t*)src;
+    int err = 0, count = 0;
+    while((size_t)count < len) {
+        //XXX allow setting timeout?
+        size_t remLen = len - count; //remaining length
+        size_t n;
+        if(!part && remLen >= SD_BLOCK_SIZE) {
+            //write all the whole blocks at once, directly from src
+            uint32_t numBlocks = remLen / SD_BLOCK_SIZE;
+            err = sdWriteMultiple(state, block, numBlocks, in, 10000);
+            if(err < 0) return err;
+            n = numBlocks * SD_BLOCK_SIZE;
+            block += numBlocks;
+        }
+        else { //read the block, change part of it, and write it back
+            uint8_t buf[SD_BLOCK_SIZE];
+            for(int tries=0; tries<SDCARD_READ_RETRIES; tries++) {
+                err = sdReadBlock(state, block, buf, 10000, true);
+                if(err != -EIO) break; //retry if CRC error
+            }
+            if(err < 0) return err;
+            n = MIN((size_t)SD_BLOCK_SIZE - part, remLen);
+            memcpy(&buf[part], in, n);
+            for(int tries=0; tries<SDCARD_WRITE_RETRIES; tries++) {
+                err = sdWriteBlock(state, block, buf, 10000);
+                if(err != -EIO) break; //retry if CRC error
+            }
+            if(err < 0) return err;
+            block++;
+        }
+        in    += n;
+        count += n;
+        self->offset += n;
+        part = 0;
+    }
+    return count;
 }
 
 int sdFileCls_seek(FILE *self, long int offset, int origin) {
@@ -83,6 +126,8 @@ int sdFileCls_getWriteBuf(FILE *self) {
 
 int sdFileCls_sync(FILE *self) {
     MicronSdCardState *state = (MicronSdCardState*)self->udata.ptr;
+    int err = sdEraseWait(state);
+    if(err < 0) return err;
     return spiWaitTxDone(state->port, 10000);
 }
 
@@ -91,6 +136,17 @@ int sdFileCls_purge(FILE *self) {
     return spiClear(state->port);
 }
 
+int sdFileCls_discard(FILE *self, size_t len) {
+    //only whole blocks can go, and sdDiscard() only erases whole erase
+    //sectors of those.
+    MicronSdCardState *state = (MicronSdCardState*)self->udata.ptr;
+    uint64_t first = (self->offset + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    uint64_t end   = (self->offset + len) / SD_BLOCK_SIZE;
+    if(end <= first) return 0;
+    int err = sdDiscard(state, first, end - first, 10000);
+    return (err < 0) ? err : 0;
+}
+
 
 MicronFileClass sdFileCls = {
 	.close       = sdFileCls_close,
@@ -101,6 +157,7 @@ MicronFileClass sdFileCls = {
 	.getWriteBuf = sdFileCls_getWriteBuf,
 	.sync        = sdFileCls_sync,
 	.purge       = sdFileCls_purge,
+	.discard     = sdFileCls_discard,
 };
 
 FILE* sdOpenCard(MicronSdCardState *state, int *outErr) {
@@ -38,7 +38,10 @@ uint32_t timeout) {
     uint32_t limit = millis() + timeout;
     int err, ok = 0;
     do {
-        if(millis() >= limit) return -ETIMEDOUT;
+        if(millis() >= limit) {
+            _sdSpeedError(state, false);
+            return -ETIMEDOUT;
+        }
         uint8_t resp = 0x00; //arbitrary dummy value
         err = _sdGetRespR1(state, &resp, timeout);
         if(err) return err;
@@ -85,59 +88,47 @@ bool checkCrc) {
                 printf("SD: Block CRC mismatch (0x%04X, expected 0x%04X)\r\n",
                     crc2, crc);
             #endif
+            _sdSpeedError(state, true);
             return -EIO;
         }
     }
 
+    _sdSpeedOk(state);
     return 0;
 }
 
 int _getBlockFromCache(MicronSdCardState *state, uint32_t block, void *dest) {
-    //return cache entry index, or 0 if not found
-    uint32_t *cache = (uint32_t*)state->blockCache;
-    if(!cache) return 0; //no cache
-    for(int i=0; i<state->blockCacheSize; i++) {
-        //first "block" is the block ID array,
-        //so the actual cache index is 1 + this array index.
-        if(cache[i] == block) {
-            void *src = state->blockCache + (SD_BLOCK_SIZE * (i+1));
-            memcpy(dest, src, SD_BLOCK_SIZE);
-            return i+1;
-        }
-    }
-    return 0; //not found
+    //return cache entry index + 1, or 0 if not found
+    MicronBlockCache *cache = &state->blockCache;
+    if(!cache->size) return 0; //no cache
+    int i = blockCacheFind(cache, block);
+    if(i < 0) return 0; //not found
+    memcpy(dest, blockCacheData(cache, i), SD_BLOCK_SIZE);
+    return i+1;
 }
 
 int _addBlockToCache(MicronSdCardState *state, uint32_t block, void *data) {
-    //return new cache entry index, or 0 if not added
-    uint32_t *cache = (uint32_t*)state->blockCache;
-    if(!cache) return 0; //no cache
-    int i;
-    for(i=0; i<state->blockCacheSize; i++) {
-        if(cache[i] == block) return i+1; //already in cache
-        if(cache[i] == 0xFFFFFFFF) break; //empty slot
-    }
-    if(i >= state->blockCacheSize) { //no empty slot
-        //XXX implement something smarter like LRU
-        //for now, pick at random. (this isn't purely random as the modulo
-        //introduces some bias, but it's good enough for now.)
-        i = rand() % state->blockCacheSize;
+    //return new cache entry index + 1, or 0 if not added
+    MicronBlockCache *cache = &state->blockCache;
+    if(!cache->size) return 0; //no cache
+    int i = blockCachePeek(cache, block);
+    if(i < 0) { //replace the least recently used block
+        i = blockCacheVictim(cache);
+        if(i < 0) return 0;
+        if(cache->entries[i].flags & BLOCKCACHE_AHEAD) {
+            _sdReadAheadWasted(state, cache->entries[i].block);
+        }
+        blockCacheAssign(cache, i, block);
     }
-    cache[i] = block;
-    void *dest = state->blockCache + (SD_BLOCK_SIZE * (i+1));
-    memcpy(dest, data, SD_BLOCK_SIZE);
+    memcpy(blockCacheData(cache, i), data, SD_BLOCK_SIZE);
     return i+1;
 }
 
-int sdReadBlock(MicronSdCardState *state, uint32_t block, void *dest,
+int _sdReadBlock(MicronSdCardState *state, uint32_t block, void *dest,
 uint32_t timeout, bool checkCrc) {
-    /** Read one block from SD card.
-     *  @param state Card state.
-     *  @param block Block number to read.
-     *  @param dest Destination buffer. Must be at least SD_BLOCK_SIZE bytes.
-     *  @param timeout Maximum time to wait, in milliseconds.
-     *  @param checkCrc Whether to verify the data CRC or ignore it.
-     *  @return 0 on success, or negative error code on failure.
+    /** Read one block from SD card, without involving read-ahead.
+     *  @note Used for reading a block again after a CRC error; otherwise
+     *   the same as sdReadBlock().
      */
     uint32_t limit = millis() + timeout;
     int ok, err, len;
@@ -155,7 +146,8 @@ uint32_t timeout, bool checkCrc) {
         if(millis() >= limit) return -ETIMEDOUT;
         ok = 0;
         uint8_t resp = 0xFF; //arbitrary dummy value
-        err = sdcardSendCommand(state, SD_CMD_READ_BLOCK, block, &resp, 1, timeout);
+        err = sdcardSendCommand(state, SD_CMD_READ_BLOCK,
+            _sdBlockAddress(state, block), &resp, 1, timeout);
         if(err) return err;
         if(resp == 0x00) ok = 1;
         //printf("ReadBlock resp %02X\r\n", resp);
@@ -175,79 +167,101 @@ uint32_t timeout, bool checkCrc) {
     return len;
 }
 
-
-int sdReadBlocks(MicronSdCardState *state, uint32_t firstBlock,
-MicronSdCardReadBlocksCb callback, uint32_t timeout, bool checkCrc) {
-    /** Read multiple blocks from SD card.
+int sdReadBlock(MicronSdCardState *state, uint32_t block, void *dest,
+uint32_t timeout, bool checkCrc) {
+    /** Read one block from SD card.
      *  @param state Card state.
-     *  @param firstBlock Block number to start at.
-     *  @param callback Callback to receive blocks.
+     *  @param block Block number to read.
+     *  @param dest Destination buffer. Must be at least SD_BLOCK_SIZE bytes.
      *  @param timeout Maximum time to wait, in milliseconds.
+     *  @param checkCrc Whether to verify the data CRC or ignore it.
      *  @return 0 on success, or negative error code on failure.
-     *  @note Reads until last block or until callback returns true.
      */
-    uint32_t limit = millis() + timeout;
-    int ok, err;
+    _sdReadAheadAccess(state, block, 1);
+    int err = _sdReadBlock(state, block, dest, timeout, checkCrc);
+    if(err >= 0) _sdReadAheadStart(state); //its errors aren't this read's
+    return err;
+}
 
-    //Send CMD16 to set read block size
-    //We can actually do less than 512, but I think not all cards support that.
-    do {
-        if(millis() >= limit) return -ETIMEDOUT;
-        ok = 0;
-        uint8_t resp = 0xBB; //arbitrary dummy value
-        err = sdcardSendCommand(state, SD_CMD_BLOCK_LEN,
-            SD_BLOCK_SIZE, &resp, 1, timeout);
-        if(err) return err;
-        if(resp == 0x00) ok = 1;
-    } while(!ok);
 
-    //Send CMD18 and wait for 0x00 response
-    do {
-        if(millis() >= limit) return -ETIMEDOUT;
-        ok = 0;
-        uint8_t resp = 0xBB; //arbitrary dummy value
-        err = sdcardSendCommand(state, SD_CMD_READ_BLOCKS,
-            firstBlock, &resp, 1, timeout);
-        if(err) return err;
-        if(resp == 0x00) ok = 1;
-        if(resp & SD_RESP_PARAM_ERR) return -ERANGE;
-    } while(!ok);
+static int _streamBlocks(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, uint8_t *dest, uint32_t *bad, uint32_t *numBad,
+uint32_t timeout, bool checkCrc) {
+    //read up to `count` blocks with CMD18, stopping early if `bad` fills up.
+    //the indices of blocks whose CRC doesn't match are put in `bad`.
+    //return number of blocks read (including bad ones), or negative error.
+    int err = _sdSendCmd18(state, firstBlock, timeout);
+    if(err) return err;
 
-    //receive data
-    while(1) {
-        uint32_t r = 0xDEADBEEF;
-
-        //wait for 0xFE response
-        while(1) {
-            gpioSetPinOutput(state->pinCS, 0);
-            //SPI0_SR = SPI_SR_EOQF;
-            SPI0_PUSHR = 0xFF;
-            int err = spiRead(state->port, &r, sizeof(uint32_t), timeout);
-            if(err) return err;
-            if((r & 0xFF) == 0xFE) break;
-        }
+    //each block is a 0xFE token, the data, and 2 bytes CRC.
+    uint32_t n;
+    for(n=0; n<count && *numBad < SDCARD_READ_MAX_BAD; n++) {
+        uint8_t *d = &dest[n * SD_BLOCK_SIZE];
+        err = _sdWaitForData(state, d, SD_BLOCK_SIZE, timeout);
+        if(!err) err = _getBlockCrc(state, d, timeout, checkCrc);
+        if(err == -EIO) bad[(*numBad)++] = n;
+        else if(err < 0) break;
+    }
 
-        //data followed by 2 byte CRC
-        //not sure what we can do if the CRC is wrong...
-        uint8_t data[SD_BLOCK_SIZE+2];
-        int err = spiRead(state->port, data, sizeof(data), timeout);
-
-        /* for(int i=0; i<SD_BLOCK_SIZE+2; i++)  {
-            //_sdSendDummyBytes(state, 1, 1, true);
-            //too slow, use this instead...
-            gpioSetPinOutput(state->pinCS, 0);
-            SPI0_SR = SPI_SR_EOQF;
-            SPI0_PUSHR = 0xFF;
-            int err = spiRead(state->port, &r, timeout);
-            if(err) return err;
-            data[i] = r & 0xFF;
-        } */
+    //the card keeps sending until told to stop, even after an error.
+    int stopErr = _sdSendCmd12(state, timeout);
+    if(err < 0 && err != -EIO) return err;
+    if(stopErr < 0) return stopErr;
+    return n;
+}
 
-        if(err) return err;
-        int stop = callback(state, data);
-        if(stop) break;
+
+int sdReadMultiple(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, void *dest, uint32_t timeout, bool checkCrc) {
+    /** Read consecutive blocks from SD card directly into a buffer.
+     *  @param state Card state.
+     *  @param firstBlock Block number to start at.
+     *  @param count Number of blocks to read.
+     *  @param dest Destination buffer. Must be at least
+     *   count * SD_BLOCK_SIZE bytes.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @param checkCrc Whether to verify the data CRC or ignore it.
+     *  @return Number of bytes read, or negative error code on failure.
+     *  @note The blocks are streamed with one CMD18 instead of a command
+     *   per block. If a block's CRC doesn't match, only that block is read
+     *   again, up to SDCARD_READ_RETRIES times. Blocks read this way aren't
+     *   added to the cache, so a large read doesn't push out everything
+     *   else, but cached blocks at the start of the range aren't read again.
+     */
+    uint8_t *d = (uint8_t*)dest;
+    uint32_t bad[SDCARD_READ_MAX_BAD];
+    int err;
+    if(state->nSectors && (uint64_t)firstBlock + count > state->nSectors) {
+        return -ERANGE;
     }
+    _sdReadAheadAccess(state, firstBlock, count);
 
-    uint8_t resp=0; //don't care about the value
-    return sdcardSendCommand(state, SD_CMD_STOP_READ, 0, &resp, 1, timeout);
+    uint32_t done = 0;
+    while(done < count) {
+        uint8_t *out = &d[done * SD_BLOCK_SIZE];
+        if(_getBlockFromCache(state, firstBlock + done, out)) {
+            done++;
+            continue;
+        }
+
+        uint32_t numBad = 0;
+        int n = _streamBlocks(state, firstBlock + done, count - done, out,
+            bad, &numBad, timeout, checkCrc);
+        if(n < 0) return n;
+
+        for(uint32_t i=0; i<numBad; i++) {
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: Retrying block 0x%X\r\n", firstBlock + done + bad[i]);
+            #endif
+            for(int tries=0; tries<SDCARD_READ_RETRIES; tries++) {
+                err = _sdReadBlock(state, firstBlock + done + bad[i],
+                    &out[bad[i] * SD_BLOCK_SIZE], timeout, checkCrc);
+                if(err != -EIO) break; //retry if CRC error
+            }
+            if(err < 0) return err;
+        }
+        done += n;
+    }
+    _sdReadAheadStart(state);
+    return count * SD_BLOCK_SIZE;
 }
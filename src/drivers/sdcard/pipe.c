@@ -0,0 +1,252 @@
+//Pipelined multi-block reads.
+//The SPI driver clocks bytes in the background from its interrupt, so as
+//long as dummy bytes are queued, the card keeps sending while we do other
+//things. sdPipeStep() keeps a window of them queued, then checks the CRC of
+//the last block received and hands it to the callback, then takes whatever
+//has arrived of the next block. There are two buffers: one being filled
+//from the card, and one being delivered.
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+//how many dummy bytes to keep queued while receiving. this is how much
+//the bus can do while we're busy with a block; it's limited by the size
+//of the SPI driver's Tx buffer.
+#ifndef SDCARD_PIPE_WINDOW
+#define SDCARD_PIPE_WINDOW (SPI_TX_BUFSIZE - 1)
+#endif
+
+#define PIPE_BLOCK_SIZE (SD_BLOCK_SIZE + 2) //data and CRC
+
+static int _pipeStop(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    //end the transfer. whatever was queued has to go out first, and
+    //whatever was received is no longer wanted.
+    int err = spiWaitTxDone(state->port, pipe->timeout);
+    _sdDrainRx(state);
+    pipe->inFlight = 0;
+    pipe->phase = SD_PIPE_DONE;
+    int err2 = _sdSendCmd12(state, pipe->timeout);
+    return (err < 0) ? err : err2;
+}
+
+static int _pipeStart(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    //start receiving at the next block to be delivered.
+    pipe->next     = pipe->block;
+    pipe->pos      = 0;
+    pipe->inFlight = 0;
+    pipe->access   = 0;
+    pipe->first    = true;
+    pipe->phase    = SD_PIPE_TOKEN;
+    pipe->limit    = millis() + pipe->timeout;
+    int err = _sdSendCmd18(state, pipe->block, pipe->timeout);
+    if(err) pipe->phase = SD_PIPE_DONE;
+    return err;
+}
+
+static int _pipeFail(MicronSdCardState *state, MicronSdReadPipe *pipe,
+int err) {
+    //give up after an error.
+    if(pipe->phase != SD_PIPE_DONE) _pipeStop(state, pipe);
+    pipe->ready = 0;
+    return err;
+}
+
+
+static int _deliver(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    //check the block that was received and pass it to the callback.
+    //return 1 if the callback wants to stop, 0 if not, or negative error.
+    uint8_t *b = pipe->buf[pipe->fill ^ 1];
+    bool restart = false;
+    pipe->ready = 0;
+    if(pipe->checkCrc) {
+        uint16_t crc = (b[SD_BLOCK_SIZE] << 8) | b[SD_BLOCK_SIZE + 1];
+        if(crc == sdcardCalcCrc16(0, b, SD_BLOCK_SIZE)) _sdSpeedOk(state);
+        else {
+            //stop the stream and read this block again by itself.
+            _sdSpeedError(state, true);
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: Retrying block 0x%X\r\n", pipe->block);
+            #endif
+            int err = 0;
+            if(pipe->phase != SD_PIPE_DONE) err = _pipeStop(state, pipe);
+            if(err) return err;
+            for(int tries=0; tries<SDCARD_READ_RETRIES; tries++) {
+                err = _sdReadBlock(state, pipe->block, b, pipe->timeout, true);
+                if(err != -EIO) break; //retry if CRC error
+            }
+            if(err < 0) return err;
+            restart = true;
+        }
+    }
+
+    int stop = pipe->callback(state, b);
+    pipe->block++;
+    if(stop) {
+        int err = 0;
+        if(pipe->phase != SD_PIPE_DONE) err = _pipeStop(state, pipe);
+        return err ? err : 1;
+    }
+    if(restart && pipe->block < pipe->end) {
+        int err = _pipeStart(state, pipe);
+        if(err) return err;
+    }
+    return 0;
+}
+
+
+static int _receive(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    //take whatever has arrived. stops after finishing a block, since there's
+    //nowhere to put the next one until that's delivered.
+    while(pipe->phase != SD_PIPE_DONE) {
+        int got;
+        if(pipe->phase == SD_PIPE_TOKEN) {
+            uint8_t r;
+            got = spiRead(state->port, &r, 1, 0);
+            if(got <= 0) return got;
+            if(r == 0xFE) {
+                pipe->phase = SD_PIPE_DATA;
+                pipe->pos = 0;
+            }
+            //0xFF is a gap; anything else is an error token.
+            else if(r != 0xFF) return -EIO;
+            else if(pipe->first) pipe->access++;
+        }
+        else {
+            got = spiRead(state->port, &pipe->buf[pipe->fill][pipe->pos],
+                PIPE_BLOCK_SIZE - pipe->pos, 0);
+            if(got <= 0) return got;
+            pipe->pos += got;
+        }
+        pipe->inFlight -= MIN(pipe->inFlight, (uint32_t)got);
+
+        if(pipe->pos == PIPE_BLOCK_SIZE) {
+            pipe->pos    = 0;
+            pipe->phase  = SD_PIPE_TOKEN;
+            pipe->fill  ^= 1;
+            pipe->ready  = 1;
+            pipe->first  = false;
+            pipe->next++;
+            pipe->limit  = millis() + pipe->timeout;
+            if(pipe->next >= pipe->end) return _pipeStop(state, pipe);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+int sdPipeBegin(MicronSdCardState *state, MicronSdReadPipe *pipe,
+uint32_t firstBlock, uint32_t count, MicronSdCardReadBlocksCb callback,
+uint32_t timeout, bool checkCrc) {
+    /** Start a pipelined read of consecutive blocks.
+     *  @param state Card state.
+     *  @param pipe Receives the transfer state.
+     *  @param firstBlock Block number to start at.
+     *  @param count Number of blocks to read.
+     *  @param callback Function to call with each block.
+     *  @param timeout Maximum time to wait for each block, in milliseconds.
+     *  @param checkCrc Whether to verify the data CRC or ignore it.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Call sdPipeStep() until it returns 0. Nothing else may use the
+     *   card until then, unless sdPipeCancel() is called.
+     */
+    memset(pipe, 0, sizeof(MicronSdReadPipe));
+    pipe->callback = callback;
+    pipe->block    = firstBlock;
+    pipe->end      = firstBlock + count;
+    pipe->timeout  = timeout;
+    pipe->checkCrc = checkCrc;
+    pipe->phase    = SD_PIPE_DONE;
+    if(state->nSectors && (uint64_t)firstBlock + count > state->nSectors) {
+        return -ERANGE;
+    }
+    if(!count) return 0;
+    return _pipeStart(state, pipe);
+}
+
+
+int sdPipeStep(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    /** Continue a pipelined read.
+     *  @param state Card state.
+     *  @param pipe The transfer, from sdPipeBegin().
+     *  @return Number of blocks not yet delivered, 0 if finished, or
+     *   negative error code on failure.
+     *  @note Each call delivers at most one block. The callback is called
+     *   while the next block is arriving, so the longer it takes (up to
+     *   about SDCARD_PIPE_WINDOW bytes' worth of bus time), the less time
+     *   this spends waiting. If it returns nonzero, the transfer stops.
+     *   A block whose CRC doesn't match is read again by itself.
+     */
+    int err;
+
+    //keep the bus busy while we deal with the last block.
+    if(pipe->phase != SD_PIPE_DONE && pipe->inFlight < SDCARD_PIPE_WINDOW) {
+        err = spiWriteDummy(state->port, 0xFF,
+            SDCARD_PIPE_WINDOW - pipe->inFlight, true);
+        if(err < 0) return _pipeFail(state, pipe, err);
+        pipe->inFlight += err;
+    }
+
+    if(pipe->ready) {
+        err = _deliver(state, pipe);
+        if(err < 0) return _pipeFail(state, pipe, err);
+        if(err) { //callback wants to stop
+            pipe->end = pipe->block;
+            return 0;
+        }
+    }
+
+    if(pipe->phase != SD_PIPE_DONE) {
+        err = _receive(state, pipe);
+        if(err < 0) return _pipeFail(state, pipe, err);
+        if(!pipe->ready && millis() >= pipe->limit) {
+            return _pipeFail(state, pipe, -ETIMEDOUT);
+        }
+    }
+    return pipe->end - pipe->block;
+}
+
+
+int sdPipeCancel(MicronSdCardState *state, MicronSdReadPipe *pipe) {
+    /** Stop a pipelined read early.
+     *  @param state Card state.
+     *  @param pipe The transfer, from sdPipeBegin().
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Blocks not yet delivered are dropped.
+     */
+    pipe->ready = 0;
+    pipe->end = pipe->block;
+    if(pipe->phase == SD_PIPE_DONE) return 0;
+    return _pipeStop(state, pipe);
+}
+
+
+int sdReadBlocks(MicronSdCardState *state, uint32_t firstBlock,
+MicronSdCardReadBlocksCb callback, uint32_t timeout, bool checkCrc) {
+    /** Read multiple blocks from SD card.
+     *  @param state Card state.
+     *  @param firstBlock Block number to start at.
+     *  @param callback Callback to receive blocks.
+     *  @param timeout Maximum time to wait for each block, in milliseconds.
+     *  @param checkCrc Whether to verify the data CRC or ignore it.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Reads until last block or until callback returns true.
+     *   This uses sdPipeStep(), so the callback runs while the next block
+     *   is arriving.
+     */
+    MicronSdReadPipe *pipe = (MicronSdReadPipe*)malloc(
+        sizeof(MicronSdReadPipe));
+    if(!pipe) return -ENOMEM;
+    uint32_t count = 1;
+    if(state->nSectors > firstBlock) count = state->nSectors - firstBlock;
+    int err = sdPipeBegin(state, pipe, firstBlock, count, callback, timeout,
+        checkCrc);
+    if(!err) {
+        do {
+            err = sdPipeStep(state, pipe);
+        } while(err > 0);
+    }
+    free(pipe);
+    return err;
+}
@@ -0,0 +1,336 @@
+//Request queue.
+//Requests are collected, then sdQueueStep() picks one and merges it with
+//any others that carry on where it ends, so they go to the card as one
+//CMD18 or CMD25. Metadata reads go first. Otherwise requests are taken in
+//block order, going upward from where the last transfer ended and then
+//wrapping around, but only from the oldest SDCARD_QUEUE_WINDOW, so nothing
+//waits forever. A request is never moved ahead of an older one that
+//overlaps it if either of them is a write.
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+static bool _isWrite(const MicronSdRequest *r) {
+    return (r->flags & SD_REQ_WRITE) != 0;
+}
+
+
+static bool _blocked(MicronSdQueue *q, int i) {
+    //whether request i has to wait for an older one.
+    MicronSdRequest *r = &q->req[i];
+    for(int j=0; j<SDCARD_QUEUE_SIZE; j++) {
+        MicronSdRequest *o = &q->req[j];
+        if(o->status != SD_REQ_PENDING || o->seq >= r->seq) continue;
+        if(!_isWrite(r) && !_isWrite(o)) continue; //reads can pass reads
+        if(o->block < r->block + r->count && r->block < o->block + o->count) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool _inWindow(MicronSdQueue *q, int i) {
+    //whether request i is one of the oldest SDCARD_QUEUE_WINDOW pending.
+    int older = 0;
+    for(int j=0; j<SDCARD_QUEUE_SIZE; j++) {
+        if(q->req[j].status == SD_REQ_PENDING && q->req[j].seq < q->req[i].seq) {
+            older++;
+        }
+    }
+    return older < SDCARD_QUEUE_WINDOW;
+}
+
+
+static int _pick(MicronSdQueue *q) {
+    //choose the next request to start a transfer with, or -1 if none.
+    int meta = -1, up = -1, low = -1;
+    for(int i=0; i<SDCARD_QUEUE_SIZE; i++) {
+        MicronSdRequest *r = &q->req[i];
+        if(r->status != SD_REQ_PENDING || _blocked(q, i)) continue;
+        if((r->flags & SD_REQ_META) && !_isWrite(r)) {
+            if(meta < 0 || r->seq < q->req[meta].seq) meta = i;
+        }
+        if(meta >= 0 || !_inWindow(q, i)) continue;
+        if(r->block >= q->head) {
+            if(up < 0 || r->block < q->req[up].block) up = i;
+        }
+        else if(low < 0 || r->block < q->req[low].block) low = i;
+    }
+    if(meta >= 0) return meta;
+    return (up >= 0) ? up : low;
+}
+
+
+static void _gather(MicronSdQueue *q, int first) {
+    //put the request and any that continue it into the run.
+    q->nRun = 0;
+    int i = first;
+    uint32_t end;
+    do {
+        MicronSdRequest *r = &q->req[i];
+        r->status = SD_REQ_ACTIVE;
+        q->run[q->nRun++] = i;
+        end = r->block + r->count;
+        i = -1;
+        for(int j=0; j<SDCARD_QUEUE_SIZE; j++) {
+            MicronSdRequest *o = &q->req[j];
+            if(o->status == SD_REQ_PENDING && o->block == end
+            && _isWrite(o) == _isWrite(r) && !_blocked(q, j)) {
+                i = j;
+                break;
+            }
+        }
+    } while(i >= 0);
+    q->runPos = 0;
+    q->runOffset = 0;
+    q->head = end;
+    q->transfers++;
+    q->merged += q->nRun - 1;
+}
+
+
+static uint32_t _runBlocks(MicronSdQueue *q) {
+    uint32_t n = 0;
+    for(int i=0; i<q->nRun; i++) n += q->req[q->run[i]].count;
+    return n;
+}
+
+
+static void _complete(MicronSdCardState *state, MicronSdQueue *q, int i,
+int result) {
+    //finish a request. the slot is freed first so the callback can reuse it.
+    MicronSdRequest *r = &q->req[i];
+    MicronSdRequestCb callback = r->callback;
+    void *udata = r->udata;
+    r->status = SD_REQ_FREE;
+    if(callback) callback(state, udata, result);
+}
+
+
+static void _finishRun(MicronSdCardState *state, MicronSdQueue *q,
+int result) {
+    //finish whatever's left of the run.
+    uint8_t pos = q->runPos;
+    q->runPos = q->nRun;
+    for(int i=pos; i<q->nRun; i++) _complete(state, q, q->run[i], result);
+}
+
+
+static bool _readFromCache(MicronSdCardState *state, MicronSdRequest *r) {
+    //serve a read from the block cache if it's all there.
+    MicronBlockCache *cache = &state->blockCache;
+    if(!cache->size) return false;
+    for(uint32_t i=0; i<r->count; i++) {
+        if(blockCachePeek(cache, r->block + i) < 0) return false;
+    }
+    uint8_t *d = (uint8_t*)r->buf;
+    for(uint32_t i=0; i<r->count; i++) {
+        _getBlockFromCache(state, r->block + i, &d[i * SD_BLOCK_SIZE]);
+    }
+    return true;
+}
+
+
+static int _receiveBlock(MicronSdCardState *state, const void *data) {
+    //pipe callback: hand the block to whichever request it belongs to.
+    MicronSdQueue *q = state->queue;
+    int i = q->run[q->runPos];
+    MicronSdRequest *r = &q->req[i];
+    memcpy((uint8_t*)r->buf + (q->runOffset * SD_BLOCK_SIZE), data,
+        SD_BLOCK_SIZE);
+    if(r->flags & SD_REQ_META) {
+        //likely to be wanted again soon.
+        _addBlockToCache(state, r->block + q->runOffset, (void*)data);
+    }
+    if(++q->runOffset == r->count) {
+        q->runPos++;
+        q->runOffset = 0;
+        _complete(state, q, i, 0);
+    }
+    return 0;
+}
+
+
+static const void* _runSrc(void *ctx, uint32_t index) {
+    //_sdWriteGather callback: find the data for a block of the run.
+    MicronSdQueue *q = (MicronSdQueue*)ctx;
+    for(int i=0; i<q->nRun; i++) {
+        MicronSdRequest *r = &q->req[q->run[i]];
+        if(index < r->count) {
+            return (const uint8_t*)r->buf + (index * SD_BLOCK_SIZE);
+        }
+        index -= r->count;
+    }
+    return NULL; //can't happen
+}
+
+
+static int _pending(MicronSdQueue *q) {
+    int n = 0;
+    for(int i=0; i<SDCARD_QUEUE_SIZE; i++) {
+        if(q->req[i].status != SD_REQ_FREE) n++;
+    }
+    return n;
+}
+
+
+static int _submit(MicronSdCardState *state, uint32_t block, uint32_t count,
+void *buf, uint8_t flags, MicronSdRequestCb callback, void *udata) {
+    MicronSdQueue *q = state->queue;
+    if(!q) return -ENODEV;
+    if(!count) return -EINVAL;
+    if(state->nSectors && (uint64_t)block + count > state->nSectors) {
+        return -ERANGE;
+    }
+    for(int i=0; i<SDCARD_QUEUE_SIZE; i++) {
+        MicronSdRequest *r = &q->req[i];
+        if(r->status != SD_REQ_FREE) continue;
+        r->buf      = buf;
+        r->callback = callback;
+        r->udata    = udata;
+        r->block    = block;
+        r->count    = count;
+        r->seq      = q->nextSeq++;
+        r->flags    = flags;
+        r->status   = SD_REQ_PENDING;
+        return i;
+    }
+    return -ENOBUFS;
+}
+
+
+int sdQueueInit(MicronSdCardState *state, MicronSdQueue *queue,
+uint32_t timeout, bool checkCrc) {
+    /** Set up the request queue.
+     *  @param state Card state.
+     *  @param queue Queue state. Must stay valid while the card is in use.
+     *  @param timeout Maximum time to wait for each block, in milliseconds.
+     *  @param checkCrc Whether to verify the CRC of data read.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    memset(queue, 0, sizeof(MicronSdQueue));
+    queue->timeout  = timeout;
+    queue->checkCrc = checkCrc;
+    state->queue    = queue;
+    return 0;
+}
+
+
+int sdQueueRead(MicronSdCardState *state, uint32_t block, uint32_t count,
+void *dest, uint8_t flags, MicronSdRequestCb callback, void *udata) {
+    /** Queue a read.
+     *  @param state Card state.
+     *  @param block Block number to start at.
+     *  @param count Number of blocks to read.
+     *  @param dest Destination buffer. Must be count * SD_BLOCK_SIZE bytes,
+     *   and stay valid until the callback.
+     *  @param flags SD_REQ_META for filesystem metadata, which is read
+     *   before other requests and kept in the block cache; otherwise 0.
+     *  @param callback Function to call when done, with 0 or a negative
+     *   error code. May be NULL.
+     *  @param udata Passed to callback.
+     *  @return 0 or more on success, or negative error code on failure:
+     *   -ENOBUFS if the queue is full.
+     *  @note Nothing happens until sdQueueStep() or sdQueueFlush().
+     */
+    return _submit(state, block, count, dest, flags & SD_REQ_META, callback,
+        udata);
+}
+
+
+int sdQueueWrite(MicronSdCardState *state, uint32_t block, uint32_t count,
+const void *src, MicronSdRequestCb callback, void *udata) {
+    /** Queue a write.
+     *  @param state Card state.
+     *  @param block Block number to start at.
+     *  @param count Number of blocks to write.
+     *  @param src Data to write. Must be count * SD_BLOCK_SIZE bytes, and
+     *   stay valid and unchanged until the callback.
+     *  @param callback Function to call when done, with 0 or a negative
+     *   error code. May be NULL.
+     *  @param udata Passed to callback.
+     *  @return 0 or more on success, or negative error code on failure:
+     *   -ENOBUFS if the queue is full.
+     *  @note If a write merged with others fails, they all report the error,
+     *   even if some of them were written.
+     */
+    return _submit(state, block, count, (void*)src, SD_REQ_WRITE, callback,
+        udata);
+}
+
+
+int sdQueueStep(MicronSdCardState *state) {
+    /** Work on the queued requests.
+     *  @param state Card state.
+     *  @return Number of requests not yet finished, 0 if the queue is empty,
+     *   or negative error code on failure.
+     *  @note Reads are done a little at a time with sdPipeStep(), so this
+     *   returns quickly while they're in progress; writes are done all at
+     *   once. Callbacks are called from here, and may queue more requests,
+     *   but mustn't call this.
+     *   Nothing else may use the card while a read is in progress.
+     */
+    MicronSdQueue *q = state->queue;
+    if(!q) return -ENODEV;
+
+    if(q->reading) {
+        int err = sdPipeStep(state, &q->pipe);
+        if(err > 0) return _pending(q);
+        q->reading = false;
+        if(err < 0) {
+            //the request being received fails. the ones after it go back
+            //in the queue, since they had nothing to do with it.
+            for(int i=q->runPos+1; i<q->nRun; i++) {
+                q->req[q->run[i]].status = SD_REQ_PENDING;
+            }
+            q->nRun = MIN(q->nRun, q->runPos + 1);
+            _finishRun(state, q, err);
+        }
+        return _pending(q);
+    }
+
+    int first = _pick(q);
+    if(first < 0) return 0;
+    MicronSdRequest *r = &q->req[first];
+    if(!_isWrite(r) && _readFromCache(state, r)) {
+        q->cacheHits++;
+        _complete(state, q, first, 0);
+        return _pending(q);
+    }
+
+    _gather(q, first);
+    uint32_t start = q->req[q->run[0]].block;
+    uint32_t count = _runBlocks(q);
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: Queue %s 0x%X x %d (%d requests)\r\n",
+            _isWrite(r) ? "write" : "read", start, count, q->nRun);
+    #endif
+
+    if(_isWrite(r)) {
+        int err = _sdWriteGather(state, start, count, _runSrc, q, q->timeout);
+        _finishRun(state, q, (err < 0) ? err : 0);
+        return _pending(q);
+    }
+
+    int err = sdPipeBegin(state, &q->pipe, start, count, _receiveBlock,
+        q->timeout, q->checkCrc);
+    if(err) _finishRun(state, q, err);
+    else q->reading = true;
+    return _pending(q);
+}
+
+
+int sdQueueFlush(MicronSdCardState *state) {
+    /** Finish all queued requests.
+     *  @param state Card state.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Errors in individual requests go to their callbacks.
+     */
+    int err;
+    do {
+        err = sdQueueStep(state);
+    } while(err > 0);
+    return err;
+}
@@ -0,0 +1,369 @@
+//Read-ahead.
+//Each read through sdReadBlock() or sdReadMultiple() is matched against a
+//few streams: readers going forward through the card, either sequentially
+//or skipping the same number of blocks each time (eg one field of a table
+//of fixed-size records). This is per card, but file handles reading
+//different places just look like separate streams. Once a stream has kept
+//to its pattern for a few reads, the blocks it should want next are read
+//into the block cache with the read pipeline. That's started after each
+//read, and kept going by sdReadAheadStep() or by the next read that wants
+//them. The window of blocks read ahead doubles whenever a read finds all
+//its blocks there, and halves when blocks read ahead leave the cache
+//without being used. Small gaps are read through rather than skipped, if
+//the card takes longer to start a transfer than to send them; the pipe
+//measures how long that is.
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+static uint32_t _period(const MicronSdReadStream *s) {
+    return s->len + s->gap;
+}
+
+
+static uint32_t _offset(const MicronSdReadStream *s, uint32_t block) {
+    //where a block is in the stream's pattern: 0 to len-1 is in a read,
+    //len and up is in a gap.
+    uint32_t p = _period(s);
+    return (block + p - (s->next % p)) % p;
+}
+
+
+static uint16_t _maxWindow(MicronSdCardState *state) {
+    return MIN(SDCARD_RA_MAX_WINDOW, state->blockCache.size / 2);
+}
+
+
+static bool _allCached(MicronSdCardState *state, uint32_t block,
+uint32_t count) {
+    for(uint32_t i=0; i<count; i++) {
+        if(blockCachePeek(&state->blockCache, block + i) < 0) return false;
+    }
+    return true;
+}
+
+
+static bool _older(const MicronSdReadStream *a, const MicronSdReadStream *b) {
+    //whether stream a is a better one to replace than b. streams being
+    //followed are kept over ones that aren't, so a few stray reads
+    //don't push them out.
+    if(!b->seen) return false;
+    if(!a->seen) return true;
+    if(!a->window != !b->window) return !a->window;
+    return a->used < b->used;
+}
+
+
+static int _receiveBlock(MicronSdCardState *state, const void *data) {
+    //pipe callback: put the block in the cache, unless it's in a gap or
+    //already there.
+    MicronSdReadAhead *ra = state->readAhead;
+    MicronSdReadStream *s = &ra->stream[ra->active];
+    MicronBlockCache *cache = &state->blockCache;
+    uint32_t block = ra->pipe.block;
+    if(_offset(s, block) >= s->len) return 0;
+    if(blockCachePeek(cache, block) >= 0) return 0;
+    int i = _addBlockToCache(state, block, (void*)data);
+    if(i) {
+        cache->entries[i-1].flags |= BLOCKCACHE_AHEAD;
+        ra->stats.issued++;
+    }
+    return 0;
+}
+
+
+static void _endRun(MicronSdReadAhead *ra) {
+    //note where the transfer got to, and how long it took to start.
+    MicronSdReadPipe *p = &ra->pipe;
+    ra->stream[ra->active].fetched = p->block;
+    if(!p->first) {
+        ra->access = ra->access ? ((ra->access * 3) + p->access) / 4 :
+            p->access;
+    }
+    ra->active = -1;
+}
+
+
+static int _step(MicronSdCardState *state) {
+    //deliver the next block read ahead.
+    //return number of blocks left, 0 if done, or negative error code.
+    MicronSdReadAhead *ra = state->readAhead;
+    MicronSdReadStream *s = &ra->stream[ra->active];
+    ra->busy = true;
+    int err = sdPipeStep(state, &ra->pipe);
+    ra->busy = false;
+    if(err > 0) return err;
+    if(err < 0) {
+        //stop following it. if the reader gets there, it'll get the error.
+        s->window = 0;
+        s->seen = 0;
+    }
+    _endRun(ra);
+    return err;
+}
+
+
+static bool _nextRun(MicronSdCardState *state, MicronSdReadStream *s,
+uint32_t *outFirst, uint32_t *outEnd) {
+    //work out which blocks to read ahead next for a stream.
+    //return false if it has enough already.
+    uint32_t reads = MAX(1, s->window / s->len);
+    uint64_t end = (uint64_t)s->next + ((uint64_t)reads * _period(s)) - s->gap;
+    if(state->nSectors) end = MIN(end, state->nSectors);
+
+    uint32_t from = MAX(s->fetched, s->next);
+    while(from < end) {
+        uint32_t off = _offset(s, from);
+        if(off >= s->len) from += _period(s) - off; //skip the gap
+        else if(blockCachePeek(&state->blockCache, from) >= 0) from++;
+        else break;
+    }
+    if(from >= end) return false;
+
+    //read through the gaps if that's quicker than starting another
+    //transfer after each one; otherwise just the rest of this read.
+    MicronSdReadAhead *ra = state->readAhead;
+    if(s->gap > SDCARD_RA_MAX_GAP
+    || s->gap * (SD_BLOCK_SIZE + 3) >= ra->access) {
+        end = MIN(end, (uint64_t)from - _offset(s, from) + s->len);
+    }
+    *outFirst = from;
+    *outEnd   = (uint32_t)end;
+    return true;
+}
+
+
+static MicronSdReadStream* _match(MicronSdCardState *state, uint32_t block,
+uint32_t count) {
+    //find which stream a read belongs to, or start a new one.
+    //return NULL if it's the same blocks as a stream's last read.
+    //a read that starts just past one that isn't being followed yet sets
+    //the gap for it; once a stream is being followed, only its next read
+    //counts, so a stray read nearby doesn't break it.
+    MicronSdReadAhead *ra = state->readAhead;
+    MicronSdReadStream *s = NULL, *near = NULL, *old = &ra->stream[0];
+    for(int i=0; i<SDCARD_RA_STREAMS; i++) {
+        MicronSdReadStream *t = &ra->stream[i];
+        if(_older(t, old)) old = t;
+        if(!t->seen) continue;
+        if(block >= t->last && block + count <= t->last + t->len) {
+            t->used = ra->clock;
+            return NULL;
+        }
+        if(block == t->next) return t;
+        if(!near && !t->window && block >= t->last + t->len
+        && block - (t->last + t->len) <= SDCARD_RA_MAX_STRIDE) near = t;
+    }
+
+    s = near ? near : old;
+    if(ra->active == s - ra->stream) sdReadAheadStop(state);
+    if(near) {
+        s->gap = block - (s->last + s->len);
+        s->seen = 1; //the one it continues; this read makes 2
+    }
+    else {
+        s->gap = 0;
+        s->seen = 0;
+        s->window = 0;
+    }
+    return s;
+}
+
+
+void _sdReadAheadAccess(MicronSdCardState *state, uint32_t block,
+uint32_t count) {
+    /** Note a read, and get read-ahead out of its way.
+     *  @param state Card state.
+     *  @param block First block being read.
+     *  @param count Number of blocks.
+     *  @note If read-ahead is bringing in any of the blocks, this waits for
+     *   them to arrive. Then if the read still needs the card, read-ahead
+     *   stops if it was for this reader, which has got ahead of it, or
+     *   finishes if it was for another, which will want them soon.
+     */
+    MicronSdReadAhead *ra = state->readAhead;
+    MicronBlockCache *cache = &state->blockCache;
+    if(!ra || ra->busy) return;
+    ra->clock++;
+
+    if(ra->active >= 0) {
+        MicronSdReadPipe *p = &ra->pipe;
+        uint32_t until = MIN(block + count, p->end);
+        if(block < p->end && until > p->block) {
+            ra->stats.waits++;
+            while(ra->active >= 0 && p->block < until) {
+                if(_step(state) <= 0) break;
+            }
+        }
+    }
+
+    //count the blocks that were read ahead for this.
+    uint32_t hits = 0;
+    for(uint32_t i=0; i<count; i++) {
+        int idx = blockCachePeek(cache, block + i);
+        if(idx >= 0 && (cache->entries[idx].flags & BLOCKCACHE_AHEAD)) {
+            cache->entries[idx].flags &= ~BLOCKCACHE_AHEAD;
+            hits++;
+        }
+    }
+    ra->stats.hits += hits;
+
+    MicronSdReadStream *s = _match(state, block, count);
+    if(ra->active >= 0 && !_allCached(state, block, count)) {
+        if(!s || ra->active == s - ra->stream) sdReadAheadStop(state);
+        else while(ra->active >= 0 && _step(state) > 0);
+    }
+    if(!s) return;
+
+    if(s->seen < 255) s->seen++;
+    s->last   = block;
+    s->len    = MIN(count, 0xFFFF);
+    s->next   = block + count + s->gap;
+    s->used   = ra->clock;
+    s->shrunk = false;
+
+    //sequential reads are a pattern after two; strided ones after three,
+    //since any two reads have some gap between them.
+    bool stream = (s->seen >= 3) || (s->seen >= 2 && !s->gap);
+    if(!stream || count > _maxWindow(state)) s->window = 0;
+    else if(!s->window) {
+        s->window  = MIN(MAX(SDCARD_RA_MIN_WINDOW, count), _maxWindow(state));
+        s->fetched = s->next;
+        ra->stats.streams++;
+        #if SDCARD_DEBUG_PRINT
+            printf("SD: Reading ahead from 0x%X, %d blocks every %d\r\n",
+                s->next, s->len, _period(s));
+        #endif
+    }
+    else if(hits == count) {
+        s->window = MIN(s->window * 2, _maxWindow(state));
+    }
+}
+
+
+int _sdReadAheadStart(MicronSdCardState *state) {
+    /** Start reading ahead for the most recent stream that wants it.
+     *  @param state Card state.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Does nothing if read-ahead is already running.
+     */
+    MicronSdReadAhead *ra = state->readAhead;
+    if(!ra || ra->busy || ra->active >= 0) return 0;
+
+    int best = -1;
+    uint32_t first = 0, end = 0;
+    for(int i=0; i<SDCARD_RA_STREAMS; i++) {
+        MicronSdReadStream *s = &ra->stream[i];
+        if(!s->window) continue;
+        if(best >= 0 && s->used < ra->stream[best].used) continue;
+        uint32_t f, e;
+        if(_nextRun(state, s, &f, &e)) {
+            best  = i;
+            first = f;
+            end   = e;
+        }
+    }
+    if(best < 0) return 0;
+
+    MicronSdReadStream *s = &ra->stream[best];
+    ra->busy = true;
+    int err = sdPipeBegin(state, &ra->pipe, first, end - first,
+        _receiveBlock, ra->timeout, ra->checkCrc);
+    ra->busy = false;
+    if(err) {
+        s->window = 0;
+        s->seen = 0;
+        return err;
+    }
+    ra->active = best;
+    s->fetched = end;
+    return 0;
+}
+
+
+void _sdReadAheadWasted(MicronSdCardState *state, uint32_t block) {
+    /** Note that a block read ahead is leaving the cache unused.
+     *  @param state Card state.
+     *  @param block The block.
+     *  @note The window of the stream it was read for is halved, but only
+     *   once between reads, since the rest of what it read ahead is
+     *   probably about to go the same way.
+     */
+    MicronSdReadAhead *ra = state->readAhead;
+    if(!ra) return;
+    ra->stats.wasted++;
+    for(int i=0; i<SDCARD_RA_STREAMS; i++) {
+        MicronSdReadStream *s = &ra->stream[i];
+        if(!s->window || s->shrunk) continue;
+        if(block < s->last || block >= s->fetched) continue;
+        s->window = MAX(SDCARD_RA_MIN_WINDOW, s->window / 2);
+        s->shrunk = true;
+    }
+}
+
+
+int sdReadAheadInit(MicronSdCardState *state, MicronSdReadAhead *ra,
+uint32_t timeout, bool checkCrc) {
+    /** Set up read-ahead.
+     *  @param state Card state.
+     *  @param ra Read-ahead state. Must stay valid while the card is in use.
+     *  @param timeout Maximum time to wait for each block, in milliseconds.
+     *  @param checkCrc Whether to verify the CRC of data read.
+     *  @return 0 on success, or negative error code on failure: -EINVAL if
+     *   there's no block cache.
+     *  @note Blocks are read ahead into the block cache, and the window is
+     *   at most half of it, so it needs a cache of at least a few blocks.
+     *   Reads with sdReadBlock() and sdReadMultiple(), including through
+     *   the FILE interface, are followed from then on.
+     *   state->readAhead->stats tells how well it's doing.
+     */
+    if(!state->blockCache.size) return -EINVAL;
+    memset(ra, 0, sizeof(MicronSdReadAhead));
+    ra->active      = -1;
+    ra->timeout     = timeout;
+    ra->checkCrc    = checkCrc;
+    state->readAhead = ra;
+    return 0;
+}
+
+
+int sdReadAheadStep(MicronSdCardState *state) {
+    /** Keep reading ahead in the background.
+     *  @param state Card state.
+     *  @return Number of blocks left in the current transfer, 0 if it's
+     *   finished or there's nothing to read ahead, or negative error code
+     *   on failure.
+     *  @note Reads only start the transfer and take what's arrived by the
+     *   time they finish; call this when there's nothing else to do, eg
+     *   from the main loop, to keep the bus busy between reads. Each call
+     *   delivers at most one block. Don't call this while sdQueueStep()
+     *   has a read in progress.
+     */
+    MicronSdReadAhead *ra = state->readAhead;
+    if(!ra) return -ENODEV;
+    if(ra->active < 0) {
+        int err = _sdReadAheadStart(state);
+        if(err) return err;
+        if(ra->active < 0) return 0;
+    }
+    return _step(state);
+}
+
+
+int sdReadAheadStop(MicronSdCardState *state) {
+    /** Stop reading ahead for now.
+     *  @param state Card state.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Every command sent to the card calls this first, so it's only
+     *   needed before using the SPI port for something else. Reading ahead
+     *   starts again after the next read.
+     */
+    MicronSdReadAhead *ra = state->readAhead;
+    if(!ra || ra->busy || ra->active < 0) return 0;
+    ra->busy = true;
+    int err = sdPipeCancel(state, &ra->pipe);
+    ra->busy = false;
+    _endRun(ra);
+    return err;
+}
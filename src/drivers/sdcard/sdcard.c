@@ -18,17 +18,26 @@ int sdcardInit(MicronSdCardState *state) {
     err = spiPause(state->port, false);
     if(err < 0) return err;
 
+    state->spiSpeed = 0;
+    state->highSpeed = 0;
+    state->errorsInRow = 0;
+    memset(&state->speedStats, 0, sizeof(MicronSdSpeedStats));
+    state->eraseSize = 0;
+    state->erasing = 0;
+    state->busyMode = SD_BUSY_POLL;
+    state->busyArmed = 0;
+    state->busyWake = 0;
+    memset(&state->busyStats, 0, sizeof(MicronSdBusyStats));
+    state->queue = NULL;
+    state->readAhead = NULL;
+
     //init block cache
-    //XXX handle case where blockCacheSize > SD_BLOCK_SIZE / sizeof(uint32_t)
+    memset(&state->blockCache, 0, sizeof(MicronBlockCache));
     if(state->blockCacheSize > 0) {
-        //first "block" of cache is uint32_t blockId[] telling which block
-        //is in each cache entry (0xFFFFFFFF = none; this block is not included)
-        size_t cacheSize = SD_BLOCK_SIZE * (state->blockCacheSize + 1);
-        state->blockCache = malloc(cacheSize);
-        if(state->blockCache) {
-            memset(state->blockCache, 0xFF, cacheSize);
-        }
-        else {
+        err = blockCacheInit(&state->blockCache,
+            MIN(state->blockCacheSize, (uint32_t)BLOCKCACHE_MAX_SIZE),
+            SD_BLOCK_SIZE);
+        if(err) {
             #if SDCARD_DEBUG_PRINT
                 printf("SD: not enough memory for block cache\r\n");
             #endif
@@ -68,6 +77,7 @@ int sdcardReset(MicronSdCardState *state, uint32_t timeout) {
      */
     int err = sdcardUpdateSpeed(state, timeout);
     if(err < 0) return err;
+    state->highSpeed = 0; //CMD0 puts the card back in default speed mode
 
     //send CMD0
     #if SDCARD_DEBUG_PRINT
@@ -124,6 +134,24 @@ int sdcardReset(MicronSdCardState *state, uint32_t timeout) {
         return err;
     }
 
+    //find out how the card is addressed. version 1 cards are all standard
+    //capacity; for version 2, CMD58 says whether it's high capacity.
+    state->byteAddr = 1;
+    if(state->cardVersion >= 2) {
+        uint32_t ocr;
+        err = _sdSendCmd58(state, &ocr, timeout);
+        if(err) {
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: CMD58 err %d\r\n", err);
+            #endif
+            return err;
+        }
+        state->byteAddr = !(ocr & SD_OCR_CCS);
+    }
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: %s addressing\r\n", state->byteAddr ? "byte" : "block");
+    #endif
+
     //Required for some cards
     #if SDCARD_DEBUG_PRINT
         printf("SD: set block size...\r\n");
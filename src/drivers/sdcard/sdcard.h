@@ -14,17 +14,101 @@
 	extern "C" {
 #endif
 
+#ifndef SDCARD_DEBUG_PRINT
 #define SDCARD_DEBUG_PRINT 1
+#endif
 #include <drivers/kinetis/spi/spi.h>
 
 //some cards allow to change this, others don't.
 #define SD_BLOCK_SIZE 512
 
+//sdcardCalcCrc16() uses the hardware CRC module for at least this many
+//bytes (0 = never). for less, setting it up takes longer than the table.
+#ifndef SDCARD_CRC_HW_MIN
+    #if defined(MCU_BASE_KINETIS)
+        #define SDCARD_CRC_HW_MIN 64
+    #else
+        #define SDCARD_CRC_HW_MIN 0
+    #endif
+#endif
+
+//how many times sdReadMultiple() retries a block with a bad CRC.
+#ifndef SDCARD_READ_RETRIES
+#define SDCARD_READ_RETRIES 5
+#endif
+
+//how many times sdWriteMultiple() retries a block the card received wrong.
+#ifndef SDCARD_WRITE_RETRIES
+#define SDCARD_WRITE_RETRIES 5
+#endif
+
+//how many bad blocks sdReadMultiple() collects before stopping the
+//transfer to retry them.
+#ifndef SDCARD_READ_MAX_BAD
+#define SDCARD_READ_MAX_BAD 8
+#endif
+
+//SPI clock limits for sdNegotiateSpeed(), in Hz. it never goes below the
+//minimum when lowering the clock after errors, nor above the maximum
+//whatever the card claims to support.
+#ifndef SDCARD_SPEED_MIN
+#define SDCARD_SPEED_MIN 400000
+#endif
+#ifndef SDCARD_SPEED_MAX
+#define SDCARD_SPEED_MAX 50000000
+#endif
+
+//how many CRC or response errors in a row before the clock is lowered.
+#ifndef SDCARD_SPEED_MAX_ERRORS
+#define SDCARD_SPEED_MAX_ERRORS 3
+#endif
+
+//how many requests the queue holds, and how many of the oldest ones it
+//chooses from when going in block order. at most 255.
+#ifndef SDCARD_QUEUE_SIZE
+#define SDCARD_QUEUE_SIZE 16
+#endif
+#ifndef SDCARD_QUEUE_WINDOW
+#define SDCARD_QUEUE_WINDOW 8
+#endif
+
+//read-ahead: how many readers it follows at once, the range its window
+//moves in (in blocks; it also never goes over half the block cache), the
+//largest gap between one read and the next that still counts as a pattern,
+//and the largest gap it reads through instead of starting a new transfer.
+#ifndef SDCARD_RA_STREAMS
+#define SDCARD_RA_STREAMS 4
+#endif
+#ifndef SDCARD_RA_MIN_WINDOW
+#define SDCARD_RA_MIN_WINDOW 4
+#endif
+#ifndef SDCARD_RA_MAX_WINDOW
+#define SDCARD_RA_MAX_WINDOW 64
+#endif
+#ifndef SDCARD_RA_MAX_STRIDE
+#define SDCARD_RA_MAX_STRIDE 64
+#endif
+#ifndef SDCARD_RA_MAX_GAP
+#define SDCARD_RA_MAX_GAP 4
+#endif
+
+//busy waits: how long to poll the card before sleeping between polls, in
+//microseconds, and when waiting on a pin interrupt, how often to poll
+//anyway, in milliseconds. see sdBusyInit().
+#ifndef SDCARD_BUSY_SPIN_US
+#define SDCARD_BUSY_SPIN_US 1000
+#endif
+#ifndef SDCARD_BUSY_PIN_POLL_MS
+#define SDCARD_BUSY_PIN_POLL_MS 10
+#endif
+
 #define SD_CSD_SIZE 17 //size of CSD structure
+#define SD_SWITCH_STATUS_SIZE 64 //size of CMD6 status block
 
 //SD card commands (in decimal, lol specs)
 #define SD_CMD_RESET             0
 #define SD_CMD_INIT              1
+#define SD_CMD_SWITCH_FUNC       6
 #define SD_CMD_SDC_INIT         41
 #define SD_CMD_SDC_CHECK_VOLTAGE 8
 #define SD_CMD_READ_CSD          9
@@ -36,6 +120,9 @@
 #define SD_CMD_NUM_BLOCKS       23 //different between MMC and SDC
 #define SD_CMD_WRITE_BLOCK      24
 #define SD_CMD_WRITE_BLOCKS     25
+#define SD_CMD_ERASE_START      32 //first block to erase
+#define SD_CMD_ERASE_END        33 //last block to erase
+#define SD_CMD_ERASE            38
 #define SD_CMD_ACMD             55 //prefix for cmds 41, 23(SDC)
 #define SD_CMD_READ_OCR         58
 
@@ -49,6 +136,9 @@
 #define SD_RESP_ERASE_RESET   BIT(1)
 #define SD_RESP_IDLE          BIT(0)
 
+//bits of OCR register (CMD58)
+#define SD_OCR_CCS BIT(30) //card capacity status: high capacity (SDHC/SDXC)
+
 typedef struct {
     //Mainly for internal use.
     //fields common to both v1 and v2
@@ -86,32 +176,192 @@ typedef struct {
     unsigned int writeBlkMisalign;          //Write Block Misalignment
 } SD_CSD;
 
+typedef struct {
+    //Error counts kept for sdNegotiateSpeed().
+    uint32_t crcErrors;   //data blocks with a bad CRC, either direction
+    uint32_t respErrors;  //command responses that were garbled or missing
+    uint32_t stepDowns;   //times the clock was lowered because of errors
+    uint32_t verifyFails; //speeds that didn't work while negotiating
+} MicronSdSpeedStats;
+
+typedef enum {
+    SD_BUSY_SPIN, //poll the card continuously
+    SD_BUSY_POLL, //after a short spin, poll once per interrupt
+    SD_BUSY_PIN,  //after a short spin, sleep until a pin interrupt on DO
+} MicronSdBusyMode;
+
+typedef struct {
+    //Busy wait statistics.
+    uint32_t waits;  //busy phases waited for
+    uint32_t polls;  //bytes sent to see if the card was still busy
+    uint32_t sleeps; //times the CPU slept while waiting
+    uint32_t wakes;  //pin interrupts that ended a wait
+} MicronSdBusyStats;
+
 typedef struct {
     uint8_t port; //which SPI port to use
     uint8_t pinCS; //which pin is card's CS/SS
     uint8_t cardVersion; //SD card protocol version
+    uint8_t byteAddr; //card takes byte addresses, not block numbers (SDSC)
     uint64_t cardSize; //capacity in bytes
     uint64_t nSectors; //number of blocks
     uint16_t sectorSize; //size in bytes
     uint64_t accessSpeed; //in nanoseconds
     uint64_t transferRate; //in bytes/sec
-    void *blockCache; // -> 0x512 * (n+1) bytes; first "block" is u32 blockId[]
-    uint32_t blockCacheSize; //number of blocks
+    MicronBlockCache blockCache; //set up by sdcardInit
+    uint32_t blockCacheSize; //number of blocks to cache (0 = none, 16 for FAT)
+    uint32_t spiSpeed; //SPI clock in Hz, set by sdNegotiateSpeed (0 = not set)
+    uint8_t highSpeed; //whether the card is in high speed mode
+    uint8_t errorsInRow; //errors since the last successful transfer
+    MicronSdSpeedStats speedStats;
+    uint32_t eraseSize; //erase sector size in blocks, set by sdReadInfo
+    uint8_t eraseAny; //whether the card can erase part of an erase sector
+    uint8_t erasing; //whether an erase is in progress (see sdEraseStep)
+    uint32_t eraseLimit; //millis() when the erase times out
+    uint8_t busyMode; //MicronSdBusyMode, set by sdBusyInit
+    uint8_t pinBusy; //pin connected to DO, for SD_BUSY_PIN
+    uint8_t busyArmed; //holding CS and waiting for the pin interrupt
+    volatile uint8_t busyWake; //set by the pin interrupt
+    uint32_t busySince; //micros() when the card went busy
+    uint32_t busyNextPoll; //millis() to poll while waiting on the pin
+    MicronSdBusyStats busyStats;
+    struct MicronSdQueue *queue; //set up by sdQueueInit
+    struct MicronSdReadAhead *readAhead; //set up by sdReadAheadInit
 } MicronSdCardState;
 
 #include "filecls.h"
 
 typedef int(*MicronSdCardReadBlocksCb)(MicronSdCardState *state, const void *data);
 
+typedef enum {
+    SD_PIPE_TOKEN, //waiting for a block's data token
+    SD_PIPE_DATA,  //receiving a block
+    SD_PIPE_DONE,  //transfer stopped
+} MicronSdPipePhase;
+
+typedef struct {
+    //State of a pipelined read. See sdPipeBegin().
+    uint8_t buf[2][SD_BLOCK_SIZE + 2]; //data and CRC; one filling, one ready
+    MicronSdCardReadBlocksCb callback;
+    uint32_t block;    //next block to deliver
+    uint32_t next;     //next block to receive
+    uint32_t end;      //one past the last block
+    uint32_t inFlight; //dummy bytes queued but not yet received
+    uint32_t timeout;  //maximum time to wait for a block, in milliseconds
+    uint32_t limit;    //when the current block times out
+    uint32_t access;   //gap bytes before the first block arrived
+    uint16_t pos;      //bytes received into the buffer being filled
+    uint8_t  fill;     //which buffer is being filled
+    uint8_t  ready;    //whether the other buffer holds a block to deliver
+    uint8_t  phase;    //MicronSdPipePhase
+    bool     checkCrc;
+    bool     first;    //waiting for the first block since CMD18
+} MicronSdReadPipe;
+
+typedef const void* (*MicronSdWriteSrcCb)(void *ctx, uint32_t index);
+
+//flags for queued requests
+#define SD_REQ_WRITE BIT(0) //write instead of read
+#define SD_REQ_META  BIT(1) //filesystem metadata; read before other requests
+
+typedef void (*MicronSdRequestCb)(MicronSdCardState *state, void *udata,
+    int result);
+
+typedef enum {
+    SD_REQ_FREE,    //slot is unused
+    SD_REQ_PENDING, //waiting
+    SD_REQ_ACTIVE,  //part of the transfer in progress
+} MicronSdRequestStatus;
+
+typedef struct {
+    //A queued request. See sdQueueRead().
+    void *buf;                  //data to write, or where to read it to
+    MicronSdRequestCb callback; //called when done; may be NULL
+    void *udata;                //passed to callback
+    uint32_t block;             //first block
+    uint32_t count;             //number of blocks
+    uint32_t seq;               //order submitted
+    uint8_t  flags;             //SD_REQ_*
+    uint8_t  status;            //MicronSdRequestStatus
+} MicronSdRequest;
+
+typedef struct MicronSdQueue {
+    //State of the request queue. See sdQueueInit().
+    MicronSdRequest req[SDCARD_QUEUE_SIZE];
+    MicronSdReadPipe pipe;          //for reads
+    uint8_t  run[SDCARD_QUEUE_SIZE]; //requests in this transfer, in order
+    uint8_t  nRun;                  //how many
+    uint8_t  runPos;                //which one is receiving
+    uint32_t runOffset;             //how many blocks it's received
+    uint32_t nextSeq;               //seq of next request submitted
+    uint32_t head;                  //block after the last transfer
+    uint32_t timeout;               //maximum time to wait for each block
+    bool     checkCrc;
+    bool     reading;               //whether the pipe is running
+    //statistics
+    uint32_t transfers;  //transfers sent to the card
+    uint32_t merged;     //requests that joined another one's transfer
+    uint32_t cacheHits;  //reads that came from the block cache
+} MicronSdQueue;
+
+typedef struct {
+    //A reader being followed by read-ahead. Its reads are len blocks
+    //with gap blocks between them; gap is 0 for sequential reads.
+    uint32_t last;    //first block of its last read
+    uint32_t next;    //where its next read should start
+    uint32_t fetched; //where read-ahead has got up to
+    uint32_t gap;     //blocks skipped between reads
+    uint32_t used;    //MicronSdReadAhead.clock when last read from
+    uint16_t len;     //blocks in its last read
+    uint16_t window;  //blocks to read ahead (0 = not following it yet)
+    uint8_t  seen;    //reads in a row that fit the pattern
+    bool     shrunk;  //window was shrunk since its last read
+} MicronSdReadStream;
+
+typedef struct {
+    //Read-ahead statistics.
+    uint32_t streams; //readers it started following
+    uint32_t issued;  //blocks read ahead into the cache
+    uint32_t hits;    //blocks read ahead that were then read
+    uint32_t wasted;  //blocks read ahead that left the cache unread
+    uint32_t waits;   //reads that waited for read-ahead to bring a block
+} MicronSdReadAheadStats;
+
+typedef struct MicronSdReadAhead {
+    //State of read-ahead. See sdReadAheadInit().
+    MicronSdReadStream stream[SDCARD_RA_STREAMS];
+    MicronSdReadPipe pipe;  //reads ahead for one stream at a time
+    uint32_t clock;         //counts reads, to find the least recent stream
+    uint32_t timeout;       //maximum time to wait for each block
+    uint32_t access;        //average gap bytes before a transfer's first block
+    int8_t   active;        //stream the pipe is reading for (-1 = none)
+    bool     busy;          //the pipe is using the card; don't stop it
+    bool     checkCrc;
+    MicronSdReadAheadStats stats;
+} MicronSdReadAhead;
+
+//busy.c
+void _sdBusyBegin(MicronSdCardState *state);
+int _sdBusyStep(MicronSdCardState *state);
+void _sdBusySleep(MicronSdCardState *state);
+void _sdBusyEnd(MicronSdCardState *state);
+int _sdWaitNotBusy(MicronSdCardState *state, uint32_t timeout);
+int sdBusyInit(MicronSdCardState *state, MicronSdBusyMode mode, uint8_t pin);
+
 //cmds.c
 int sdcardSendCommand(MicronSdCardState *state, uint8_t cmd, uint32_t param,
     uint8_t *resp, size_t respSize, uint32_t timeout);
 int _sdSendDummyBytes(MicronSdCardState *state, int count, uint32_t timeout, bool cs);
+void _sdDrainRx(MicronSdCardState *state);
+uint32_t _sdBlockAddress(MicronSdCardState *state, uint32_t block);
 int _sdSendCmd0(MicronSdCardState *state, uint32_t timeout);
 int _sdSendCmd1(MicronSdCardState *state, uint32_t timeout);
 int _sdSendCmd8(MicronSdCardState *state, uint32_t timeout);
+int _sdSendCmd12(MicronSdCardState *state, uint32_t timeout);
+int _sdSendCmd18(MicronSdCardState *state, uint32_t block, uint32_t timeout);
 int _sdSendCmd41(MicronSdCardState *state, uint32_t timeout);
 int _sdSendCmd55(MicronSdCardState *state, uint32_t timeout);
+int _sdSendCmd58(MicronSdCardState *state, uint32_t *ocr, uint32_t timeout);
 
 //crc.c
 uint8_t sdcardCalcCrc(const void *data, size_t len);
@@ -125,21 +375,83 @@ int sdReadInfo(MicronSdCardState *state, uint32_t timeout);
 //debug.c
 void _sdPrintStatus(uint8_t stat);
 
+//erase.c
+int sdEraseBegin(MicronSdCardState *state, uint32_t firstBlock,
+    uint32_t count, uint32_t timeout);
+int sdEraseStep(MicronSdCardState *state);
+int sdEraseWait(MicronSdCardState *state);
+int sdErase(MicronSdCardState *state, uint32_t firstBlock, uint32_t count,
+    uint32_t timeout);
+int sdDiscard(MicronSdCardState *state, uint32_t firstBlock, uint32_t count,
+    uint32_t timeout);
+
 //io.c
+int _getBlockFromCache(MicronSdCardState *state, uint32_t block, void *dest);
+int _addBlockToCache(MicronSdCardState *state, uint32_t block, void *data);
 int _sdSetBlockSize(MicronSdCardState *state, uint32_t size, uint32_t timeout);
 int _sdWaitForData(MicronSdCardState *state, void *dest, size_t size,
     uint32_t timeout);
+int _sdReadBlock(MicronSdCardState *state, uint32_t block, void *dest,
+    uint32_t timeout, bool checkCrc);
 int sdReadBlock(MicronSdCardState *state, uint32_t block, void *dest,
     uint32_t timeout, bool checkCrc);
+int sdReadMultiple(MicronSdCardState *state, uint32_t firstBlock,
+    uint32_t count, void *dest, uint32_t timeout, bool checkCrc);
+
+//pipe.c
+int sdPipeBegin(MicronSdCardState *state, MicronSdReadPipe *pipe,
+    uint32_t firstBlock, uint32_t count, MicronSdCardReadBlocksCb callback,
+    uint32_t timeout, bool checkCrc);
+int sdPipeStep(MicronSdCardState *state, MicronSdReadPipe *pipe);
+int sdPipeCancel(MicronSdCardState *state, MicronSdReadPipe *pipe);
 int sdReadBlocks(MicronSdCardState *state, uint32_t firstBlock,
     MicronSdCardReadBlocksCb callback, uint32_t timeout, bool checkCrc);
 
+//queue.c
+int sdQueueInit(MicronSdCardState *state, MicronSdQueue *queue,
+    uint32_t timeout, bool checkCrc);
+int sdQueueRead(MicronSdCardState *state, uint32_t block, uint32_t count,
+    void *dest, uint8_t flags, MicronSdRequestCb callback, void *udata);
+int sdQueueWrite(MicronSdCardState *state, uint32_t block, uint32_t count,
+    const void *src, MicronSdRequestCb callback, void *udata);
+int sdQueueStep(MicronSdCardState *state);
+int sdQueueFlush(MicronSdCardState *state);
+
+//readahead.c
+void _sdReadAheadAccess(MicronSdCardState *state, uint32_t block,
+    uint32_t count);
+int _sdReadAheadStart(MicronSdCardState *state);
+void _sdReadAheadWasted(MicronSdCardState *state, uint32_t block);
+int sdReadAheadInit(MicronSdCardState *state, MicronSdReadAhead *ra,
+    uint32_t timeout, bool checkCrc);
+int sdReadAheadStep(MicronSdCardState *state);
+int sdReadAheadStop(MicronSdCardState *state);
+
 //response.c
 int _sdWaitForResponse(MicronSdCardState *state, uint32_t timeout);
 int _sdGetRespR1(MicronSdCardState *state, uint8_t *resp, uint32_t timeout);
 int _sdGetRespR2(MicronSdCardState *state, uint8_t *resp, uint32_t timeout);
 int _sdGetRespR7(MicronSdCardState *state, uint8_t *resp, uint32_t timeout);
 
+//speed.c
+int _sdSendCmd6(MicronSdCardState *state, uint32_t arg, uint8_t *status,
+    uint32_t timeout);
+void _sdSpeedError(MicronSdCardState *state, bool crc);
+void _sdSpeedOk(MicronSdCardState *state);
+int _sdSpeedCheck(MicronSdCardState *state, uint32_t timeout);
+int sdSetHighSpeed(MicronSdCardState *state, uint32_t timeout);
+int sdNegotiateSpeed(MicronSdCardState *state, bool highSpeed,
+    uint32_t timeout);
+
+//write.c
+int _sdSendAcmd23(MicronSdCardState *state, uint32_t count, uint32_t timeout);
+int _sdWriteGather(MicronSdCardState *state, uint32_t firstBlock,
+    uint32_t count, MicronSdWriteSrcCb getSrc, void *ctx, uint32_t timeout);
+int sdWriteBlock(MicronSdCardState *state, uint32_t block, const void *src,
+    uint32_t timeout);
+int sdWriteMultiple(MicronSdCardState *state, uint32_t firstBlock,
+    uint32_t count, const void *src, uint32_t timeout);
+
 //sdcard.c
 int sdcardInit(MicronSdCardState *state);
 int sdcardUpdateSpeed(MicronSdCardState *state, uint32_t timeout);
@@ -0,0 +1,236 @@
+//SPI clock negotiation.
+//The card's CSD says how fast it can go; the SPI divider decides what we can
+//actually produce. sdNegotiateSpeed() picks the fastest clock both allow and
+//checks it works. After that, CRC and response errors are counted as they
+//happen, and if too many come in a row, the clock is lowered one step the
+//next time a command is sent (which is always between transfers).
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+//arguments for CMD6: mode in bit 31, then one nibble per function group.
+//0xF leaves a group as it is. group 1 is the bus speed, function 1 is
+//high speed.
+#define SWITCH_CHECK 0x00FFFFF1 //ask whether we could switch
+#define SWITCH_SET   0x80FFFFF1 //switch
+
+#define SD_SPEED_DEFAULT 25000000 //max clock in default speed mode
+
+int _sdSendCmd6(MicronSdCardState *state, uint32_t arg, uint8_t *status,
+uint32_t timeout) {
+    /** Send CMD6, ie SWITCH_FUNC, and receive its status block.
+     *  @param state Card state.
+     *  @param arg Command argument.
+     *  @param status Buffer to receive the status. Must be at least
+     *   SD_SWITCH_STATUS_SIZE bytes.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -EOPNOTSUPP
+     *   if the card doesn't understand this command.
+     */
+    uint32_t limit = millis() + timeout;
+    int ok, err;
+    do {
+        if(millis() >= limit) return -ETIMEDOUT;
+        ok = 0;
+        uint8_t resp = 0xFF; //arbitrary dummy value
+        err = sdcardSendCommand(state, SD_CMD_SWITCH_FUNC, arg, &resp, 1,
+            timeout);
+        if(err) return err;
+        if(resp == 0x00) ok = 1;
+        else if(resp & SD_RESP_BAD_CMD) return -EOPNOTSUPP; //old card
+    } while(!ok);
+
+    //the status comes like a data block, with its own CRC.
+    err = _sdWaitForData(state, status, SD_SWITCH_STATUS_SIZE, timeout);
+    if(err < 0) return err;
+    uint8_t crc[2];
+    err = _sdSendDummyBytes(state, 2, 100, true);
+    if(err < 0) return err;
+    err = spiReadBlocking(state->port, crc, 2, timeout);
+    if(err < 0) return err;
+    if(((crc[0] << 8) | crc[1]) !=
+    sdcardCalcCrc16(0, status, SD_SWITCH_STATUS_SIZE)) {
+        _sdSpeedError(state, true);
+        return -EIO;
+    }
+    return 0;
+}
+
+
+void _sdSpeedError(MicronSdCardState *state, bool crc) {
+    /** Count an error that may mean the clock is too fast.
+     *  @param state Card state.
+     *  @param crc Whether it was a data CRC error, rather than a bad or
+     *   missing response.
+     */
+    if(crc) state->speedStats.crcErrors++;
+    else state->speedStats.respErrors++;
+    if(state->errorsInRow < 255) state->errorsInRow++;
+}
+
+
+void _sdSpeedOk(MicronSdCardState *state) {
+    /** Note that a transfer went through without errors.
+     *  @param state Card state.
+     */
+    state->errorsInRow = 0;
+}
+
+
+int _sdSpeedCheck(MicronSdCardState *state, uint32_t timeout) {
+    /** Lower the clock if there have been too many errors in a row.
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Only call this between transfers. Does nothing unless the
+     *   speed was set by sdNegotiateSpeed().
+     */
+    if(!state->spiSpeed) return 0;
+    if(state->errorsInRow < SDCARD_SPEED_MAX_ERRORS) return 0;
+    state->errorsInRow = 0;
+
+    uint32_t speed;
+    if(state->spiSpeed <= SDCARD_SPEED_MIN) return 0;
+    int err = spiGetMaxSpeed(state->port, state->spiSpeed - 1, &speed);
+    if(err || speed < SDCARD_SPEED_MIN) return 0; //can't go any slower
+    err = spiSetSpeed(state->port, speed);
+    if(err) return err;
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: Too many errors; lowering clock from %ld to %ld Hz\r\n",
+            state->spiSpeed, speed);
+    #endif
+    state->spiSpeed = speed;
+    state->speedStats.stepDowns++;
+    return sdcardUpdateSpeed(state, timeout);
+}
+
+
+int sdSetHighSpeed(MicronSdCardState *state, uint32_t timeout) {
+    /** Switch the card to high speed mode.
+     *  @param state Card state.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -EOPNOTSUPP
+     *   if the card doesn't support it.
+     *  @note This lets the card run at up to 50 MHz instead of 25, but
+     *   doesn't change the SPI clock; sdNegotiateSpeed() does that.
+     *   The card's CSD is read again, since it now reports the new speed.
+     */
+    uint8_t status[SD_SWITCH_STATUS_SIZE];
+    int err = _sdSendCmd6(state, SWITCH_CHECK, status, timeout);
+    if(err) return err;
+
+    //byte 13 bit 1: group 1 supports function 1.
+    //byte 16 low nibble: what group 1 would be set to (0xF = can't).
+    if(!(status[13] & BIT(1)) || (status[16] & 0x0F) != 1) return -EOPNOTSUPP;
+
+    err = _sdSendCmd6(state, SWITCH_SET, status, timeout);
+    if(err) return err;
+    if((status[16] & 0x0F) != 1) return -EOPNOTSUPP;
+    state->highSpeed = 1;
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: High speed mode enabled\r\n");
+    #endif
+
+    //the switch happens 8 clocks after the status, which the next
+    //command's leading dummy bytes take care of.
+    return sdReadInfo(state, timeout);
+}
+
+
+static int _trySpeed(MicronSdCardState *state, uint32_t speed,
+const uint8_t *csd, uint32_t timeout) {
+    //set the clock, and check that the CSD reads the same as it did at
+    //low speed. return 0 if it does, -EIO if not, or negative error code.
+    int err = spiSetSpeed(state->port, speed);
+    if(err) return err;
+    err = sdcardUpdateSpeed(state, timeout);
+    if(err) return err;
+
+    uint8_t buf[SD_CSD_SIZE];
+    memset(buf, 0, sizeof(buf));
+    err = _sdGetCSD(state, timeout, buf);
+    if(err == -ETIMEDOUT) {
+        //garbled beyond recognition. the card may still be sending the
+        //CSD we gave up on; clock it out, or the next try takes it for
+        //its own response.
+        _sdSendDummyBytes(state, SD_CSD_SIZE + 8, timeout, true);
+        return -EIO;
+    }
+    if(err) return err;
+    return memcmp(buf, csd, SD_CSD_SIZE) ? -EIO : 0;
+}
+
+
+int sdNegotiateSpeed(MicronSdCardState *state, bool highSpeed,
+uint32_t timeout) {
+    /** Run the SPI clock as fast as the card allows.
+     *  @param state Card state.
+     *  @param highSpeed Whether to try switching the card to high speed
+     *   mode first, which allows up to 50 MHz instead of 25.
+     *  @param timeout Maximum time to wait for each step, in milliseconds.
+     *  @return The new clock in Hz, or negative error code on failure.
+     *  @note Call this after sdcardReset(). It starts from SDCARD_SPEED_MIN
+     *   and tries the fastest clock the SPI port can produce within the
+     *   card's rated transfer speed and SDCARD_SPEED_MAX. If the CSD doesn't
+     *   read back the same at that speed, the next slower one is tried,
+     *   and so on.
+     *   Afterward, if SDCARD_SPEED_MAX_ERRORS CRC or response errors happen
+     *   in a row, the clock is lowered a step. state->speedStats counts
+     *   these. If you change the clock yourself, set state->spiSpeed to 0
+     *   to stop this.
+     */
+    uint32_t speed, slow;
+    state->spiSpeed = 0; //don't step down while we're doing this
+    int err = spiGetMaxSpeed(state->port, SDCARD_SPEED_MIN, &slow);
+    if(!err) err = spiSetSpeed(state->port, slow);
+    if(!err) err = sdcardUpdateSpeed(state, timeout);
+    if(err) return err;
+
+    if(highSpeed && !state->highSpeed) {
+        err = sdSetHighSpeed(state, timeout);
+        #if SDCARD_DEBUG_PRINT
+            if(err) printf("SD: Can't use high speed mode: %d\r\n", err);
+        #endif
+        //not fatal; we'll just be slower.
+    }
+    if(!state->transferRate) {
+        err = sdReadInfo(state, timeout);
+        if(err) return err;
+    }
+
+    uint8_t csd[SD_CSD_SIZE];
+    err = _sdGetCSD(state, timeout, csd);
+    if(err) return err;
+
+    //transferRate is really in bits/sec, ie the clock rate.
+    uint64_t rate = state->transferRate ? state->transferRate :
+        SD_SPEED_DEFAULT;
+    err = spiGetMaxSpeed(state->port, MIN(rate, (uint64_t)SDCARD_SPEED_MAX),
+        &speed);
+    if(err) return err;
+
+    while(1) {
+        err = _trySpeed(state, speed, csd, timeout);
+        if(!err) break;
+        if(err != -EIO) return err;
+        #if SDCARD_DEBUG_PRINT
+            printf("SD: %ld Hz doesn't work\r\n", speed);
+        #endif
+        state->speedStats.verifyFails++;
+        if(speed <= slow || spiGetMaxSpeed(state->port, speed - 1, &speed)
+        || speed < slow) {
+            //nothing works; leave it where it was working.
+            spiSetSpeed(state->port, slow);
+            sdcardUpdateSpeed(state, timeout);
+            return -EIO;
+        }
+    }
+
+    #if SDCARD_DEBUG_PRINT
+        printf("SD: Clock set to %ld Hz\r\n", speed);
+    #endif
+    state->spiSpeed = speed;
+    state->errorsInRow = 0;
+    return speed;
+}
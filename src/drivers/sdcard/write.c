@@ -0,0 +1,269 @@
+extern "C" {
+    #include <micron.h>
+    #include "sdcard.h"
+}
+
+//data tokens sent before each block, and the one that ends CMD25.
+#define TOKEN_SINGLE_BLOCK 0xFE //CMD24
+#define TOKEN_MULTI_BLOCK  0xFC //CMD25
+#define TOKEN_STOP_TRAN    0xFD //CMD25
+
+//data response token, sent by the card after each block.
+#define DATA_RESP_MASK     0x1F
+#define DATA_RESP_ACCEPTED 0x05
+#define DATA_RESP_CRC_ERR  0x0B
+#define DATA_RESP_WRITE_ERR 0x0D
+
+static int _sendBytes(MicronSdCardState *state, const void *data, size_t size,
+uint32_t timeout) {
+    //send some bytes, discarding what the card sends back meanwhile.
+    //we go in chunks so the receive buffer doesn't overflow.
+    const uint8_t *d = (const uint8_t*)data;
+    uint32_t limit = millis() + timeout;
+    for(size_t i=0; i<size; ) {
+        if(millis() >= limit) return -ETIMEDOUT;
+        int err = spiWrite(state->port, &d[i], MIN(SPI_RX_BUFSIZE, size-i),
+            false);
+        if(err < 0) return err;
+        int err2 = spiWaitTxDone(state->port, timeout);
+        if(err2 < 0) return err2;
+        _sdDrainRx(state);
+        i += err;
+    }
+    return 0;
+}
+
+
+static int _sendDataBlock(MicronSdCardState *state, uint8_t token,
+const void *src, uint32_t timeout) {
+    //send one block of data, and wait until the card has written it.
+    //return 0 on success, -EIO if the card says the CRC was wrong,
+    //-EFAULT if the card couldn't write it, or another negative error code.
+    const uint8_t *s = (const uint8_t*)src;
+    uint16_t crc = sdcardCalcCrc16(0, s, SD_BLOCK_SIZE);
+    uint8_t head[2] = {0xFF, token}; //one byte gap before the token
+    uint8_t tail[2] = {(uint8_t)(crc >> 8), (uint8_t)(crc & 0xFF)};
+
+    _sdDrainRx(state);
+    int err = _sendBytes(state, head, sizeof(head), timeout);
+    if(!err) err = _sendBytes(state, s, SD_BLOCK_SIZE, timeout);
+    if(!err) err = _sendBytes(state, tail, sizeof(tail), timeout);
+    if(err < 0) return err;
+
+    //the card answers immediately with a data response token, then holds
+    //the line low until it's done writing.
+    err = _sdWaitForResponse(state, timeout);
+    if(err < 0) return err;
+    int resp = err & DATA_RESP_MASK;
+    err = _sdWaitNotBusy(state, timeout);
+    switch(resp) {
+        case DATA_RESP_ACCEPTED:
+            _sdSpeedOk(state);
+            return err;
+        case DATA_RESP_CRC_ERR:
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: Write CRC error\r\n");
+            #endif
+            _sdSpeedError(state, true);
+            return -EIO;
+        default:
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: Write error, response 0x%02X\r\n", resp);
+            #endif
+            return -EFAULT;
+    }
+}
+
+
+static void _updateCache(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, const void *src) {
+    //update cached copies of blocks that were written. if src is NULL,
+    //remove them instead, since we don't know what's on the card now.
+    MicronBlockCache *cache = &state->blockCache;
+    if(!cache->size) return;
+    const uint8_t *s = (const uint8_t*)src;
+    for(uint32_t i=0; i<count; i++) {
+        int idx = blockCachePeek(cache, firstBlock + i);
+        if(idx < 0) continue;
+        if(s) memcpy(blockCacheData(cache, idx), &s[i * SD_BLOCK_SIZE],
+            SD_BLOCK_SIZE);
+        else blockCacheDiscard(cache, idx);
+    }
+}
+
+
+static int _sendWriteCmd(MicronSdCardState *state, uint8_t cmd, uint32_t block,
+uint32_t timeout) {
+    //send CMD24 or CMD25 and wait for 0x00 response.
+    uint32_t limit = millis() + timeout;
+    int ok, err;
+    do {
+        if(millis() >= limit) return -ETIMEDOUT;
+        ok = 0;
+        uint8_t resp = 0xFF; //arbitrary dummy value
+        err = sdcardSendCommand(state, cmd, _sdBlockAddress(state, block),
+            &resp, 1, timeout);
+        if(err) return err;
+        if(resp == 0x00) ok = 1;
+        if(resp & (SD_RESP_PARAM_ERR | SD_RESP_ADDR_ERR)) return -ERANGE;
+    } while(!ok);
+    return 0;
+}
+
+
+int _sdSendAcmd23(MicronSdCardState *state, uint32_t count, uint32_t timeout) {
+    /** Send ACMD23, ie SET_WR_BLK_ERASE_COUNT.
+     *  @param state Card state.
+     *  @param count Number of blocks about to be written.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note This tells the card to erase the blocks ahead of a CMD25, which
+     *   can make the write faster. It's only a hint; the card may ignore it.
+     */
+    int err = _sdSendCmd55(state, timeout);
+    if(err) return err;
+    uint8_t resp = 0xFF; //arbitrary dummy value
+    err = sdcardSendCommand(state, SD_CMD_NUM_BLOCKS, MIN(count, (uint32_t)0x7FFFFF),
+        &resp, 1, timeout);
+    if(err) return err;
+    return (resp & ~SD_RESP_IDLE) ? -EIO : 0;
+}
+
+
+int sdWriteBlock(MicronSdCardState *state, uint32_t block, const void *src,
+uint32_t timeout) {
+    /** Write one block to SD card.
+     *  @param state Card state.
+     *  @param block Block number to write.
+     *  @param src Data to write. Must be SD_BLOCK_SIZE bytes.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return 0 on success, or negative error code on failure: -EIO if
+     *   the card received the data wrong (it's safe to try again), or
+     *   -EFAULT if the card couldn't write it.
+     *  @note The block cache is updated.
+     */
+    if(state->nSectors && block >= state->nSectors) return -ERANGE;
+    int err = _sendWriteCmd(state, SD_CMD_WRITE_BLOCK, block, timeout);
+    if(err) return err;
+
+    err = _sendDataBlock(state, TOKEN_SINGLE_BLOCK, src, timeout);
+    if(err < 0) {
+        _updateCache(state, block, 1, NULL);
+        return err;
+    }
+    _updateCache(state, block, 1, src);
+    return 0;
+}
+
+
+static int _streamWrite(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, MicronSdWriteSrcCb getSrc, void *ctx, uint32_t index,
+int *outErr, uint32_t timeout) {
+    //write blocks with CMD25, taking them from getSrc starting at index.
+    //return number of blocks written, and put the error that stopped it
+    //(or 0) in outErr; or return negative error code if the card won't start.
+    int err = _sdSendAcmd23(state, count, timeout);
+    #if SDCARD_DEBUG_PRINT
+        if(err) printf("SD: ACMD23 failed: %d\r\n", err);
+    #endif
+    //not fatal; it's only a hint.
+
+    err = _sendWriteCmd(state, SD_CMD_WRITE_BLOCKS, firstBlock, timeout);
+    if(err) return err;
+
+    uint32_t n;
+    for(n=0; n<count; n++) {
+        const void *src = getSrc(ctx, index + n);
+        err = _sendDataBlock(state, TOKEN_MULTI_BLOCK, src, timeout);
+        if(err < 0) break;
+        _updateCache(state, firstBlock + n, 1, src);
+    }
+
+    //the card keeps accepting blocks until told to stop, even after an
+    //error. it starts being busy one byte after the stop token.
+    uint8_t stop[2] = {TOKEN_STOP_TRAN, 0xFF};
+    int stopErr = _sendBytes(state, stop, sizeof(stop), timeout);
+    if(!stopErr) stopErr = _sdWaitNotBusy(state, timeout);
+    if(err < 0) {
+        //we don't know what the card did to the block that failed.
+        _updateCache(state, firstBlock + n, 1, NULL);
+        *outErr = err;
+    }
+    else *outErr = stopErr;
+    return n;
+}
+
+
+int _sdWriteGather(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, MicronSdWriteSrcCb getSrc, void *ctx, uint32_t timeout) {
+    /** Write consecutive blocks whose data isn't contiguous in memory.
+     *  @param state Card state.
+     *  @param firstBlock Block number to start at.
+     *  @param count Number of blocks to write.
+     *  @param getSrc Function which returns the data for the given block,
+     *   numbered from 0. It may be asked for the same block more than once.
+     *  @param ctx Passed to getSrc.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, or negative error code on failure.
+     *  @note Otherwise the same as sdWriteMultiple().
+     */
+    if(state->nSectors && (uint64_t)firstBlock + count > state->nSectors) {
+        return -ERANGE;
+    }
+    if(count == 1) {
+        int err;
+        for(int tries=0; tries<SDCARD_WRITE_RETRIES; tries++) {
+            err = sdWriteBlock(state, firstBlock, getSrc(ctx, 0), timeout);
+            if(err != -EIO) break; //retry if CRC error
+        }
+        return (err < 0) ? err : SD_BLOCK_SIZE;
+    }
+
+    uint32_t done = 0;
+    int tries = 0;
+    while(done < count) {
+        int err = 0;
+        int n = _streamWrite(state, firstBlock + done, count - done,
+            getSrc, ctx, done, &err, timeout);
+        if(n < 0) return n;
+        done += n;
+        if(n) tries = 0;
+        if(err == -EIO && ++tries < SDCARD_WRITE_RETRIES) {
+            #if SDCARD_DEBUG_PRINT
+                printf("SD: Retrying write at block 0x%X\r\n",
+                    firstBlock + done);
+            #endif
+            continue;
+        }
+        if(err < 0) return err;
+    }
+    return count * SD_BLOCK_SIZE;
+}
+
+
+static const void* _contiguousSrc(void *ctx, uint32_t index) {
+    return (const uint8_t*)ctx + (index * SD_BLOCK_SIZE);
+}
+
+
+int sdWriteMultiple(MicronSdCardState *state, uint32_t firstBlock,
+uint32_t count, const void *src, uint32_t timeout) {
+    /** Write consecutive blocks to SD card.
+     *  @param state Card state.
+     *  @param firstBlock Block number to start at.
+     *  @param count Number of blocks to write.
+     *  @param src Data to write. Must be count * SD_BLOCK_SIZE bytes.
+     *  @param timeout Maximum time to wait, in milliseconds.
+     *  @return Number of bytes written, or negative error code on failure:
+     *   -EIO if the card kept receiving a block wrong, or -EFAULT if the
+     *   card couldn't write it.
+     *  @note The blocks are streamed with one CMD25 instead of a command
+     *   per block, after telling the card how many are coming with ACMD23
+     *   so it can erase them first. This is much faster for large writes.
+     *   If the card receives a block wrong, the transfer is stopped and
+     *   restarted at that block, up to SDCARD_WRITE_RETRIES times.
+     *   The block cache is updated.
+     */
+    return _sdWriteGather(state, firstBlock, count, _contiguousSrc,
+        (void*)src, timeout);
+}
@@ -0,0 +1,244 @@
+/** Generic cache of fixed-size blocks.
+ *  Entries are found by hashing the block number, and replaced in least
+ *  recently used order. An entry can be pinned to keep it in the cache,
+ *  eg while something holds a pointer to its data; pinned entries are taken
+ *  out of the LRU list, so the tail is always an entry that can be replaced.
+ *  The cache doesn't do any I/O itself. To read a block through it:
+ *      int i = blockCacheFind(cache, block);
+ *      if(i < 0) {
+ *          i = blockCacheVictim(cache); //-EBUSY if all are pinned
+ *          //write back blockCacheData(cache, i) here if it's dirty
+ *          blockCacheAssign(cache, i, block);
+ *          //read the block into blockCacheData(cache, i); if that fails,
+ *          //call blockCacheDiscard(cache, i)
+ *      }
+ */
+#ifdef __cplusplus
+	extern "C" {
+#endif
+#include <micron.h>
+
+static uint16_t _hash(MicronBlockCache *cache, uint64_t block) {
+    uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32);
+    h *= 0x9E3779B1; //golden ratio; mixes low bits into high bits
+    return (h >> 16) & (cache->numBuckets - 1);
+}
+
+static void _unlink(MicronBlockCache *cache, uint16_t i) {
+    MicronBlockCacheEntry *ent = &cache->entries[i];
+    if(ent->prev != BLOCKCACHE_NONE) cache->entries[ent->prev].next = ent->next;
+    else cache->head = ent->next;
+    if(ent->next != BLOCKCACHE_NONE) cache->entries[ent->next].prev = ent->prev;
+    else cache->tail = ent->prev;
+    ent->prev = BLOCKCACHE_NONE;
+    ent->next = BLOCKCACHE_NONE;
+}
+
+static void _pushHead(MicronBlockCache *cache, uint16_t i) {
+    MicronBlockCacheEntry *ent = &cache->entries[i];
+    ent->prev = BLOCKCACHE_NONE;
+    ent->next = cache->head;
+    if(cache->head != BLOCKCACHE_NONE) cache->entries[cache->head].prev = i;
+    cache->head = i;
+    if(cache->tail == BLOCKCACHE_NONE) cache->tail = i;
+}
+
+static void _pushTail(MicronBlockCache *cache, uint16_t i) {
+    MicronBlockCacheEntry *ent = &cache->entries[i];
+    ent->next = BLOCKCACHE_NONE;
+    ent->prev = cache->tail;
+    if(cache->tail != BLOCKCACHE_NONE) cache->entries[cache->tail].next = i;
+    cache->tail = i;
+    if(cache->head == BLOCKCACHE_NONE) cache->head = i;
+}
+
+static void _unhash(MicronBlockCache *cache, uint16_t i) {
+    //remove an entry from its hash bucket.
+    uint16_t *link = &cache->buckets[_hash(cache, cache->entries[i].block)];
+    while(*link != BLOCKCACHE_NONE) {
+        if(*link == i) {
+            *link = cache->entries[i].chain;
+            break;
+        }
+        link = &cache->entries[*link].chain;
+    }
+    cache->entries[i].chain = BLOCKCACHE_NONE;
+}
+
+
+int blockCacheInit(MicronBlockCache *cache, uint16_t size, uint16_t blockSize) {
+    /** Set up a block cache.
+     *  @param cache The cache to set up.
+     *  @param size Number of blocks to cache, up to BLOCKCACHE_MAX_SIZE.
+     *  @param blockSize Size of each block, in bytes.
+     *  @return 0 on success, -EINVAL if size or blockSize is 0 or size is
+     *   too big, or other negative error code on failure.
+     *  @note Uses about size * (blockSize + 24) bytes. Call blockCacheFree()
+     *   when done.
+     */
+    memset(cache, 0, sizeof(MicronBlockCache));
+    //the bucket count is the next power of 2, which must fit in 16 bits.
+    if(!size || size > BLOCKCACHE_MAX_SIZE || !blockSize) return -EINVAL;
+
+    uint16_t numBuckets = 1;
+    while(numBuckets < size) numBuckets <<= 1;
+    cache->entries = (MicronBlockCacheEntry*)malloc(
+        size * sizeof(MicronBlockCacheEntry));
+    cache->buckets = (uint16_t*)malloc(numBuckets * sizeof(uint16_t));
+    cache->data = (uint8_t*)malloc((uint32_t)size * blockSize);
+    if(!(cache->entries && cache->buckets && cache->data)) {
+        blockCacheFree(cache);
+        return -ENOMEM;
+    }
+
+    cache->size       = size;
+    cache->blockSize  = blockSize;
+    cache->numBuckets = numBuckets;
+    cache->head       = BLOCKCACHE_NONE;
+    cache->tail       = BLOCKCACHE_NONE;
+    for(uint16_t i=0; i<numBuckets; i++) cache->buckets[i] = BLOCKCACHE_NONE;
+    for(uint16_t i=0; i<size; i++) {
+        MicronBlockCacheEntry *ent = &cache->entries[i];
+        ent->block = 0;
+        ent->chain = BLOCKCACHE_NONE;
+        ent->pins  = 0;
+        ent->flags = 0;
+        _pushHead(cache, i);
+    }
+    return 0;
+}
+
+
+void blockCacheFree(MicronBlockCache *cache) {
+    /** Free a block cache's memory.
+     *  @param cache The cache.
+     *  @note Dirty entries are discarded; write them back first.
+     */
+    if(cache->entries) free(cache->entries);
+    if(cache->buckets) free(cache->buckets);
+    if(cache->data) free(cache->data);
+    memset(cache, 0, sizeof(MicronBlockCache));
+}
+
+
+int blockCachePeek(MicronBlockCache *cache, uint64_t block) {
+    /** Find a block in the cache, without counting it as a use.
+     *  @param cache The cache.
+     *  @param block The block number.
+     *  @return Index of the entry holding it, or -ENOENT if not found.
+     */
+    if(!cache->size) return -ENOENT;
+    uint16_t i = cache->buckets[_hash(cache, block)];
+    while(i != BLOCKCACHE_NONE) {
+        MicronBlockCacheEntry *ent = &cache->entries[i];
+        if(ent->block == block && (ent->flags & BLOCKCACHE_VALID)) return i;
+        i = ent->chain;
+    }
+    return -ENOENT;
+}
+
+
+int blockCacheFind(MicronBlockCache *cache, uint64_t block) {
+    /** Find a block in the cache.
+     *  @param cache The cache.
+     *  @param block The block number.
+     *  @return Index of the entry holding it, or -ENOENT if not found.
+     *  @note This updates the statistics, and makes the entry the most
+     *   recently used.
+     */
+    int i = blockCachePeek(cache, block);
+    if(i < 0) {
+        cache->misses++;
+        return i;
+    }
+    cache->hits++;
+    if(!cache->entries[i].pins) {
+        _unlink(cache, i);
+        _pushHead(cache, i);
+    }
+    return i;
+}
+
+
+int blockCacheVictim(MicronBlockCache *cache) {
+    /** Choose an entry to hold a new block.
+     *  @param cache The cache.
+     *  @return Index of the least recently used entry that isn't pinned,
+     *   or -EBUSY if they're all pinned.
+     *  @note Empty entries are always chosen first. The entry isn't
+     *   changed; if it's dirty, write it back, then call blockCacheAssign().
+     */
+    if(cache->tail == BLOCKCACHE_NONE) return -EBUSY;
+    return cache->tail;
+}
+
+
+void blockCacheAssign(MicronBlockCache *cache, uint16_t idx, uint64_t block) {
+    /** Make an entry hold a different block.
+     *  @param cache The cache.
+     *  @param idx The entry, usually from blockCacheVictim().
+     *  @param block The block number.
+     *  @note The caller fills in the data. The entry becomes valid, not
+     *   dirty, and the most recently used.
+     */
+    MicronBlockCacheEntry *ent = &cache->entries[idx];
+    if(ent->flags & BLOCKCACHE_VALID) {
+        cache->evictions++;
+        _unhash(cache, idx);
+    }
+    uint16_t bucket = _hash(cache, block);
+    ent->block = block;
+    ent->flags = BLOCKCACHE_VALID;
+    ent->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+    if(!ent->pins) {
+        _unlink(cache, idx);
+        _pushHead(cache, idx);
+    }
+}
+
+
+void blockCacheDiscard(MicronBlockCache *cache, uint16_t idx) {
+    /** Empty an entry, eg because reading its block failed.
+     *  @param cache The cache.
+     *  @param idx The entry.
+     *  @note The entry will be the next to be replaced.
+     */
+    MicronBlockCacheEntry *ent = &cache->entries[idx];
+    if(ent->flags & BLOCKCACHE_VALID) _unhash(cache, idx);
+    ent->flags = 0;
+    if(!ent->pins) {
+        _unlink(cache, idx);
+        _pushTail(cache, idx);
+    }
+}
+
+
+void blockCachePin(MicronBlockCache *cache, uint16_t idx) {
+    /** Keep an entry in the cache until blockCacheUnpin() is called.
+     *  @param cache The cache.
+     *  @param idx The entry.
+     *  @note Pins are counted, so an entry can be pinned more than once.
+     */
+    if(!cache->entries[idx].pins) _unlink(cache, idx);
+    cache->entries[idx].pins++;
+}
+
+
+void blockCacheUnpin(MicronBlockCache *cache, uint16_t idx) {
+    /** Undo blockCachePin().
+     *  @param cache The cache.
+     *  @param idx The entry.
+     *  @note When the last pin is removed, the entry becomes the most
+     *   recently used, or the next to be replaced if it was discarded.
+     */
+    MicronBlockCacheEntry *ent = &cache->entries[idx];
+    if(!ent->pins || --ent->pins) return;
+    if(ent->flags & BLOCKCACHE_VALID) _pushHead(cache, idx);
+    else _pushTail(cache, idx); //was discarded while pinned
+}
+
+
+#ifdef __cplusplus
+	} //extern "C"
+#endif
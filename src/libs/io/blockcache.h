@@ -0,0 +1,52 @@
+//Generic cache of fixed-size blocks, for block devices and filesystems.
+#ifndef _MICRON_LIBS_IO_BLOCKCACHE_H_
+#define _MICRON_LIBS_IO_BLOCKCACHE_H_
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define BLOCKCACHE_NONE  0xFFFF //no entry
+#define BLOCKCACHE_MAX_SIZE 32768 //most entries; so the buckets fit too
+#define BLOCKCACHE_VALID BIT(0) //entry holds a block
+#define BLOCKCACHE_DIRTY BIT(1) //entry was modified (for the user to manage)
+#define BLOCKCACHE_AHEAD BIT(2) //entry was read ahead and not used yet (ditto)
+
+typedef struct {
+    uint64_t block;      //block number
+    uint16_t prev, next; //links in LRU list (only while not pinned)
+    uint16_t chain;      //next entry in the same hash bucket
+    uint16_t pins;       //number of users holding it in the cache
+    uint8_t  flags;      //BLOCKCACHE_*
+} MicronBlockCacheEntry;
+
+typedef struct {
+    uint16_t size;       //number of entries
+    uint16_t blockSize;  //size of each block, in bytes
+    uint16_t numBuckets; //number of hash buckets (power of 2)
+    uint16_t head, tail; //most/least recently used unpinned entry
+    uint32_t hits, misses, evictions; //statistics
+    uint16_t *buckets;   //first entry in each bucket
+    MicronBlockCacheEntry *entries;
+    uint8_t *data;       //blockSize * size bytes
+} MicronBlockCache;
+
+//get a pointer to an entry's data.
+#define blockCacheData(cache, idx) \
+    (&(cache)->data[(uint32_t)(idx) * (cache)->blockSize])
+
+int blockCacheInit(MicronBlockCache *cache, uint16_t size, uint16_t blockSize);
+void blockCacheFree(MicronBlockCache *cache);
+int blockCacheFind(MicronBlockCache *cache, uint64_t block);
+int blockCachePeek(MicronBlockCache *cache, uint64_t block);
+int blockCacheVictim(MicronBlockCache *cache);
+void blockCacheAssign(MicronBlockCache *cache, uint16_t idx, uint64_t block);
+void blockCacheDiscard(MicronBlockCache *cache, uint16_t idx);
+void blockCachePin(MicronBlockCache *cache, uint16_t idx);
+void blockCacheUnpin(MicronBlockCache *cache, uint16_t idx);
+
+#ifdef __cplusplus
+	} //extern "C"
+#endif
+
+#endif //_MICRON_LIBS_IO_BLOCKCACHE_H_
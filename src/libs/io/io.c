@@ -32,6 +32,7 @@ int read(FILE *self, void *dest, size_t len) {
 	char *destp = (char*)dest;
 	while(count < len) {
 		int r = cls->read(self, destp, len - count);
+		if(r == -ENODATA && count) break; //end of file
 		if(r < 0) return r;
 		count += r;
 		//if(r == 0) irqWait(); //XXX use a semaphore?
@@ -93,6 +94,12 @@ int purge(FILE *self) {
 	return cls->purge(self);
 }
 
+int discard(FILE *self, size_t len) {
+    MicronFileClass *cls = osGetFileClass(self->fileCls);
+	if(!cls->discard) return -ENOSYS;
+	return cls->discard(self, len);
+}
+
 
 int readUntil(FILE *self, void *buf, size_t len, const char *chrs) {
     MicronFileClass *cls = osGetFileClass(self->fileCls);
@@ -13,6 +13,7 @@
 //#define MAX_FD 8 //max files that can be open at once.
 #include "private.h"
 #include "partition.h"
+#include "blockcache.h"
 
 /** Open a serial UART as a file. The port must have been previously configured
  *  by calling serialInit().
@@ -51,6 +52,9 @@ int close(FILE *self);
  *   -This function blocks until the read completes or an error occurs.
  *   -dest can be NULL; in that case, it will just block until `len` bytes
  *    are available to read.
+ *   -For files that have an end (eg on a filesystem), reading stops there;
+ *    the return value is then less than `len`, or -ENODATA if nothing was
+ *    left to read.
  */
 int read(FILE *self, void *dest, size_t len);
 
@@ -122,6 +126,20 @@ int sync(FILE *self);
  */
 int purge(FILE *self);
 
+/** Tell a block device that data is no longer needed.
+ *  self: file to discard from.
+ *  len:  number of bytes, starting at the current position.
+ *  On success, returns zero.
+ *  On failure, returns a negative error code; -ENOSYS if the file doesn't
+ *  support this.
+ *  Notes:
+ *   -Afterward the data may read back as anything. The device may also keep
+ *    some or all of it; this is only a hint, eg so an SD card can erase
+ *    blocks ahead of writing them.
+ *   -The position doesn't change.
+ */
+int discard(FILE *self, size_t len);
+
 /** Read from a file until one of the specified characters.
  *  self: file to read.
  *  buf:  buffer to read into.
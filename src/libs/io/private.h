@@ -19,6 +19,7 @@ typedef struct {
 	int (*getWriteBuf)(FILE *self);
 	int (*sync)       (FILE *self);
 	int (*purge)      (FILE *self);
+	int (*discard)    (FILE *self, size_t len); //may be NULL
 } MicronFileClass;
 
 #define MAX_FILE_CLASSES 8
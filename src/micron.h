@@ -56,7 +56,7 @@ extern unsigned long _estack;
 #include "libs/math.h"
 #include "drivers/hal/main.h"
 #if defined(__IMXRT1062__)
-    #include "drivers/imx/imxrt.h"
+    #include "drivers/imx/main.h"
 #elif defined(__MK20DX128__) || defined(__MK20DX256__)
     #include "drivers/kinetis/main.h"
 #endif
@@ -0,0 +1,339 @@
+/** The fragmentation analyzer (analyze.c), on fragmented volumes.
+ *  Files are written a cluster at a time in turn, so they're fragmented,
+ *  some are left empty, and some are deleted to leave holes in the free
+ *  space. The root directory, a directory in it and one in that are each
+ *  filled to the end of their cluster with files, the last entry being the
+ *  next directory down, so the analyzer has to go back up out of a
+ *  directory whose entries end where its cluster does, three times over.
+ *  What it finds, stepping with no time budget and with plenty, must match
+ *  the FAT as read directly: free clusters and runs, the largest run, and
+ *  each file's clusters and extents, which must also be what the callback
+ *  is given.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 4096
+#define ROUNDS 3        //clusters appended to each file, in turn
+#define MAX_FILES 64
+#define MAX_CLUSTERS 16 //per file
+#define ENTRY_SIZE 32
+
+//directories, each the last entry of the one before.
+static const char *dirs[] = {"", "/D", "/D/LAST", "/D/LAST/END"};
+#define NUM_DIRS (sizeof(dirs) / sizeof(dirs[0]))
+
+typedef struct {
+    char     path[FSTEST_MAX_PATH];
+    bool     deleted;
+    uint32_t dirCluster; //directory it's in
+    uint32_t cluster;  //first cluster (0 if empty)
+    uint32_t clusters; //expected, from the FAT
+    uint32_t extents;
+    uint32_t seen;     //times the callback reported it
+} File;
+
+typedef struct {
+    File    *files;
+    uint32_t numFiles;
+    uint32_t problems;
+    int      verbose;
+} Expected;
+
+
+static uint32_t usedEntries(FsTestVol *vol, uint32_t dir, uint32_t *outSlots) {
+    //count the entries a directory uses, and how many its clusters have
+    //room for.
+    uint32_t chain[8];
+    uint32_t numClusters = volChain(vol, dir, chain, 8);
+    uint32_t perCluster = (vol->spc * FSTEST_SECTOR_SIZE) / ENTRY_SIZE;
+    *outSlots = numClusters * perCluster;
+    for(uint32_t i=0; i<*outSlots; i++) {
+        uint8_t *ent = volCluster(vol, chain[i / perCluster]) +
+            ((i % perCluster) * ENTRY_SIZE);
+        if(!ent[0]) return i;
+    }
+    return *outSlots;
+}
+
+
+static int fillDir(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+Expected *exp, const char *dir, uint32_t dirCluster) {
+    //add empty files to a directory until one entry is left in its
+    //cluster. the driver writes through, so the entries are on the disk.
+    FsTestVol vol;
+    int err = volOpen(dev, START_SECTOR, &vol);
+    uint32_t slots;
+    while(!err && usedEntries(&vol, dirCluster, &slots) < slots - 1) {
+        if(exp->numFiles >= MAX_FILES) return -ENOSPC;
+        File *file = &exp->files[exp->numFiles];
+        snprintf(file->path, sizeof(file->path), "%s/F%02u.BIN", dir,
+            exp->numFiles);
+        file->dirCluster = dirCluster;
+        err = fsTestAppend(dev, mbr, model, file->path, 0, 0);
+        exp->numFiles++;
+    }
+    return err;
+}
+
+
+static int build(FsTestDev *dev, FsTestTree *model, Expected *exp) {
+    //make the files and directories, through the driver.
+    fat32_mbr mbr;
+    int err = mkfsFat(dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = fatMount(&dev->file, START_SECTOR, &mbr, 0,
+        FSTEST_TIMEOUT);
+    if(err) return err;
+
+    uint32_t dirCluster = 2; //root
+    for(uint32_t d=0; d<NUM_DIRS && !err; d++) {
+        if(d) {
+            err = fatMkdir(&dev->file, &mbr, dirs[d], FSTEST_TIMEOUT);
+            if(!err) err = treeSet(model, dirs[d], true, NULL, 0);
+            micronDirent ent;
+            if(!err) err = fatLookupPath(&dev->file, &mbr, dirs[d], &ent,
+                FSTEST_TIMEOUT);
+            dirCluster = ent.cluster;
+        }
+        //the last directory isn't filled, so it ends normally.
+        if(!err && d + 1 < NUM_DIRS) err = fillDir(dev, &mbr, model, exp,
+            dirs[d], dirCluster);
+    }
+
+    //fragment them, leaving every fifth empty, and delete every seventh.
+    for(uint32_t r=0; r<ROUNDS && !err; r++) {
+        for(uint32_t i=0; i<exp->numFiles && !err; i++) {
+            if(i % 5 == 4) continue;
+            err = fsTestAppend(dev, &mbr, model, exp->files[i].path,
+                FSTEST_SECTOR_SIZE, (r * MAX_FILES) + i);
+        }
+    }
+    for(uint32_t i=6; i<exp->numFiles && !err; i += 7) {
+        err = fatDelete(&dev->file, &mbr, exp->files[i].path,
+            FSTEST_TIMEOUT);
+        treeRemove(model, exp->files[i].path);
+        exp->files[i].deleted = true;
+    }
+    int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    return err ? err : err2;
+}
+
+
+static void onFile(const micronDirent *dirent, const MicronFatDir *dir,
+uint32_t depth, uint32_t extents, void *param) {
+    //the callback: the file must be one we made, with the extents the FAT
+    //says it has.
+    Expected *exp = (Expected*)param;
+    for(uint32_t i=0; i<exp->numFiles; i++) {
+        File *file = &exp->files[i];
+        const char *name = strrchr(file->path, '/') + 1;
+        if(file->deleted || strcmp(name, dirent->name)
+        || file->cluster != dirent->cluster) continue;
+        file->seen++;
+        if(extents != file->extents) {
+            if(exp->verbose) printf("%s: %u extents, not %u\n", file->path,
+                extents, file->extents);
+            exp->problems++;
+        }
+        return;
+    }
+    if(exp->verbose) printf("unexpected file %s\n", dirent->name);
+    exp->problems++;
+}
+
+
+static uint32_t compare(const char *what, uint64_t found, uint64_t expect,
+int verbose) {
+    if(found == expect) return 0;
+    if(verbose) printf("%s: %" PRIu64 ", not %" PRIu64 "\n", what, found,
+        expect);
+    return 1;
+}
+
+
+static uint32_t analyze(FsTestDev *dev, Expected *exp, uint32_t budget,
+const MicronFatAnalysis *expect, int verbose) {
+    //run the analyzer and check what it finds.
+    fat32_mbr mbr;
+    int err = fatMount(&dev->file, START_SECTOR, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    if(err) {
+        printf("  can't mount: %d\n", err);
+        return 1;
+    }
+    for(uint32_t i=0; i<exp->numFiles; i++) exp->files[i].seen = 0;
+    exp->problems = 0;
+    MicronFatAnalysis *a = (MicronFatAnalysis*)malloc(
+        sizeof(MicronFatAnalysis));
+    fatAnalyzeBegin(a, onFile, exp);
+    uint32_t steps = 0;
+    uint64_t writes = dev->writes;
+    do {
+        err = fatAnalyzeStep(&dev->file, &mbr, a, budget, FSTEST_TIMEOUT);
+        steps++;
+    } while(err >= 0 && err < 100 && steps < 100000);
+
+    uint32_t problems = exp->problems;
+    if(err != 100) {
+        if(verbose) printf("analyzing stopped at %d\n", err);
+        problems++;
+    }
+    else {
+        problems += compare("free clusters", a->freeClusters,
+            expect->freeClusters, verbose);
+        problems += compare("free runs", a->numFreeRuns,
+            expect->numFreeRuns, verbose);
+        problems += compare("largest free run", a->largestFree,
+            expect->largestFree, verbose);
+        problems += compare("largest free run at", a->largestFreeAt,
+            expect->largestFreeAt, verbose);
+        problems += compare("files", a->numFiles, expect->numFiles, verbose);
+        problems += compare("directories", a->numDirs, expect->numDirs,
+            verbose);
+        problems += compare("fragmented files", a->numFragmented,
+            expect->numFragmented, verbose);
+        problems += compare("empty files", a->numEmpty, expect->numEmpty,
+            verbose);
+        problems += compare("file clusters", a->fileClusters,
+            expect->fileClusters, verbose);
+        problems += compare("file extents", a->fileExtents,
+            expect->fileExtents, verbose);
+        problems += compare("most extents", a->worstExtents,
+            expect->worstExtents, verbose);
+        for(uint32_t i=0; i<exp->numFiles; i++) {
+            File *file = &exp->files[i];
+            if(file->seen != (file->deleted ? 0 : 1)) {
+                if(verbose) printf("%s: reported %u times\n", file->path,
+                    file->seen);
+                problems++;
+            }
+        }
+    }
+    problems += compare("sectors written", dev->writes, writes, verbose);
+    printf("  %s budget: %u steps, %u files in %" PRIu64 " extents, "
+        "%u free runs: %s\n", budget ? "plenty of" : "no", steps,
+        a->numFiles, a->fileExtents, a->numFreeRuns,
+        problems ? "FAILED" : "ok");
+    free(a);
+    fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    return problems;
+}
+
+
+static void expectFromFat(FsTestDev *dev, Expected *exp,
+MicronFatAnalysis *out) {
+    //work out what the analyzer should find, from the FAT and the
+    //directory entries as they are on the disk.
+    FsTestVol vol;
+    volOpen(dev, START_SECTOR, &vol);
+    memset(out, 0, sizeof(MicronFatAnalysis));
+    uint32_t run = 0;
+    for(uint32_t c=2; c<vol.numClusters + 3; c++) {
+        if(c < vol.numClusters + 2 && !volGetFat(&vol, c)) {
+            out->freeClusters++;
+            run++;
+            continue;
+        }
+        if(run) {
+            out->numFreeRuns++;
+            if(run > out->largestFree) {
+                out->largestFree   = run;
+                out->largestFreeAt = c - run;
+            }
+        }
+        run = 0;
+    }
+
+    out->numDirs = NUM_DIRS - 1;
+    for(uint32_t i=0; i<exp->numFiles; i++) {
+        File *file = &exp->files[i];
+        if(file->deleted) continue;
+        //find its entry, by its 8.3 name.
+        const char *base = strrchr(file->path, '/') + 1;
+        const char *dot = strchr(base, '.');
+        char name[12];
+        memset(name, ' ', 11);
+        name[11] = 0;
+        memcpy(name, base, dot - base);
+        memcpy(&name[8], dot + 1, strlen(dot + 1));
+        uint8_t *ent = volFindEntry(&vol, file->dirCluster, name);
+        file->cluster = ent ? volEntryCluster(ent) : 0;
+
+        uint32_t chain[MAX_CLUSTERS];
+        file->clusters = file->cluster ?
+            volChain(&vol, file->cluster, chain, MAX_CLUSTERS) : 0;
+        file->extents = file->clusters ? 1 : 0;
+        for(uint32_t j=1; j<file->clusters; j++) {
+            if(chain[j] != chain[j-1] + 1) file->extents++;
+        }
+        out->numFiles++;
+        if(!file->clusters) out->numEmpty++;
+        if(file->extents > 1) out->numFragmented++;
+        out->fileClusters += file->clusters;
+        out->fileExtents  += file->extents;
+        out->worstExtents = MAX(out->worstExtents, file->extents);
+    }
+}
+
+
+uint32_t testAnalyze(int verbose) {
+    FsTestDev dev;
+    devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0);
+    FsTestTree model, found;
+    treeInit(&model);
+    treeInit(&found);
+    Expected exp;
+    memset(&exp, 0, sizeof(exp));
+    exp.files = (File*)calloc(MAX_FILES, sizeof(File));
+    exp.verbose = verbose;
+
+    uint32_t failures = 0;
+    int err = build(&dev, &model, &exp);
+    FsckResult result;
+    if(err) {
+        printf("  can't make the volume: %d\n", err);
+        failures++;
+    }
+    else if(fsTestVerify(&dev, START_SECTOR, &found, &result, verbose)
+    || treeCompare(&found, &model, NULL, false, verbose)) {
+        printf("  the volume isn't as made\n");
+        failures++;
+    }
+
+    //each directory but the last must end where its cluster does, with
+    //the next one down.
+    FsTestVol vol;
+    volOpen(&dev, START_SECTOR, &vol);
+    uint32_t dirCluster = 2;
+    for(uint32_t d=0; d+1<NUM_DIRS && !failures; d++) {
+        uint32_t slots;
+        uint32_t used = usedEntries(&vol, dirCluster, &slots);
+        uint32_t perCluster = (vol.spc * FSTEST_SECTOR_SIZE) / ENTRY_SIZE;
+        uint32_t chain[8];
+        volChain(&vol, dirCluster, chain, 8);
+        uint8_t *last = volCluster(&vol, chain[(slots - 1) / perCluster]) +
+            (((slots - 1) % perCluster) * ENTRY_SIZE);
+        if(used != slots || !(last[11] & FAT_ATTR_DIRECTORY)) {
+            printf("  %s doesn't end with a directory at the end of its "
+                "cluster\n", d ? dirs[d] : "/");
+            failures++;
+        }
+        dirCluster = volEntryCluster(last);
+    }
+
+    MicronFatAnalysis expect;
+    if(!failures) {
+        expectFromFat(&dev, &exp, &expect);
+        failures += analyze(&dev, &exp, 0, &expect, verbose);
+        failures += analyze(&dev, &exp, 1000000, &expect, verbose);
+    }
+
+    free(exp.files);
+    treeFree(&model);
+    treeFree(&found);
+    devFree(&dev);
+    return failures;
+}
@@ -0,0 +1,351 @@
+/** Benchmarks. First, hit rates of the LRU block cache in
+ *  libs/io/blockcache.c against the random replacement the SD driver used
+ *  before it, replaying the sectors the FAT driver reads.
+ *  Two volumes are made: one of files written a cluster at a time in turn,
+ *  so they're all fragmented, and one with directories of small files and
+ *  some large contiguous ones as well. Each file is read through twice in
+ *  100- and 512-byte pieces, with the FAT cache off, as it would be if the
+ *  block cache under it were all there was. The sectors read are replayed
+ *  as the SD driver's single block reads use its cache: each one is looked
+ *  up, and added if it's not there.
+ *  Second, reading files through the FAT file class (filecls.c) with read
+ *  buffers of each size, on the same volumes or an image file. Each file is
+ *  read from start to end in pieces of a few sizes, counting the requests
+ *  to the device and the sectors they read.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 16384
+#define SECTORS_PER_CLUSTER 4
+#define TRACE_SIZE (1 << 20) //sectors
+#define RANDOM_RUNS 8        //random replacement is averaged over this many
+
+static const uint16_t cacheSizes[] = {4, 16, 64};
+#define NUM_CACHE_SIZES (sizeof(cacheSizes) / sizeof(cacheSizes[0]))
+static const uint32_t readSizes[] = {100, 512};
+#define NUM_READ_SIZES (sizeof(readSizes) / sizeof(readSizes[0]))
+static const uint32_t fileReadSizes[] = {16, 100, 512, 4096};
+#define NUM_FILE_READ_SIZES (sizeof(fileReadSizes) / sizeof(fileReadSizes[0]))
+static const uint32_t readAheads[] = {0, 512, FAT_DEFAULT_READ_AHEAD, 8192};
+#define NUM_READ_AHEADS (sizeof(readAheads) / sizeof(readAheads[0]))
+
+
+
+static int makeFragmented(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model) {
+    //sixteen files in two directories, written a cluster at a time in turn.
+    char path[FSTEST_MAX_PATH];
+    int err = fatMkdir(&dev->file, mbr, "/LOGS", FSTEST_TIMEOUT);
+    if(!err) err = fatMkdir(&dev->file, mbr, "/DATA", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(model, "/LOGS", true, NULL, 0);
+    if(!err) err = treeSet(model, "/DATA", true, NULL, 0);
+    for(uint32_t r=0; r<24 && !err; r++) {
+        for(uint32_t i=0; i<16 && !err; i++) {
+            snprintf(path, sizeof(path), "/%s/FILE%u.BIN",
+                (i % 2) ? "DATA" : "LOGS", i);
+            err = fsTestAppend(dev, mbr, model, path,
+                SECTORS_PER_CLUSTER * FSTEST_SECTOR_SIZE, (r * 16) + i);
+        }
+    }
+    return err;
+}
+
+
+static int makeMixed(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model) {
+    //small config files, a few fonts, and big files, some fragmented.
+    char path[FSTEST_MAX_PATH];
+    int err = fatMkdir(&dev->file, mbr, "/CFG", FSTEST_TIMEOUT);
+    if(!err) err = fatMkdir(&dev->file, mbr, "/FONTS", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(model, "/CFG", true, NULL, 0);
+    if(!err) err = treeSet(model, "/FONTS", true, NULL, 0);
+    for(uint32_t i=0; i<40 && !err; i++) {
+        snprintf(path, sizeof(path), "/CFG/SETTING%u.INI", i);
+        err = fsTestAppend(dev, mbr, model, path, 200 + ((i * 337) % 1300),
+            i);
+    }
+    for(uint32_t i=0; i<6 && !err; i++) {
+        snprintf(path, sizeof(path), "/FONTS/FONT%u.BIN", i);
+        err = fsTestAppend(dev, mbr, model, path, 20000, 100 + i);
+    }
+    for(uint32_t i=0; i<4 && !err; i++) {
+        snprintf(path, sizeof(path), "/IMAGE%u.RAW", i);
+        err = fsTestAppend(dev, mbr, model, path, 65536, 200 + i);
+    }
+    for(uint32_t r=0; r<16 && !err; r++) {
+        for(uint32_t i=0; i<4 && !err; i++) {
+            snprintf(path, sizeof(path), "/TRACK%u.LOG", i);
+            err = fsTestAppend(dev, mbr, model, path, 3000, 300 + (r * 4) + i);
+        }
+    }
+    return err;
+}
+
+
+static const struct {
+    const char *name;
+    int (*make)(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model);
+} volumes[] = {
+    {"fragmented", makeFragmented},
+    {"mixed", makeMixed},
+};
+#define NUM_VOLUMES (sizeof(volumes) / sizeof(volumes[0]))
+
+
+static int makeVolume(FsTestDev *dev, size_t v, FsTestTree *model) {
+    //format the device, and fill it with one of the volumes.
+    fat32_mbr mbr;
+    treeInit(model);
+    int err = mkfsFat(dev, START_SECTOR, VOLUME_SECTORS, SECTORS_PER_CLUSTER,
+        2);
+    if(!err) err = fatMount(&dev->file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(!err) {
+        err = volumes[v].make(dev, &mbr, model);
+        int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+        if(!err) err = err2;
+    }
+    return err;
+}
+
+
+static int record(FsTestDev *dev, const FsTestTree *model, uint32_t readSize) {
+    //read every file twice, recording the sectors read.
+    fat32_mbr mbr;
+    uint8_t buf[512];
+    int err = fatMount(&dev->file, START_SECTOR, &mbr, 0, FSTEST_TIMEOUT);
+    if(err) return err;
+    dev->traceLen = 0;
+    dev->traceSize = TRACE_SIZE;
+    for(int pass=0; pass<2 && !err; pass++) {
+        for(uint32_t i=0; i<model->count && !err; i++) {
+            const FsTestNode *node = &model->nodes[i];
+            if(node->isDir) continue;
+            MicronFatFile file;
+            err = fatOpenPath(&dev->file, &mbr, node->path, &file,
+                FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+            for(uint32_t offset=0; !err && offset < node->size;
+            offset += readSize) {
+                uint32_t n = MIN(readSize, node->size - offset);
+                err = fatReadFile(&dev->file, &mbr, &file, offset, n, buf,
+                    FSTEST_TIMEOUT);
+                if(err >= 0) err = memcmp(buf, &node->data[offset], n) ?
+                    -EIO : 0;
+            }
+            fatCloseFile(&file);
+        }
+    }
+    dev->traceSize = 0;
+    if(!err && dev->traceLen >= TRACE_SIZE) err = -ENOSPC;
+    int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    return err ? err : err2;
+}
+
+
+static int replayLru(const uint32_t *trace, uint32_t len, uint16_t size,
+uint32_t *outHits) {
+    //replay a trace through the block cache.
+    MicronBlockCache cache;
+    int err = blockCacheInit(&cache, size, FSTEST_SECTOR_SIZE);
+    if(err) return err;
+    for(uint32_t i=0; i<len; i++) {
+        if(blockCacheFind(&cache, trace[i]) >= 0) continue;
+        int idx = blockCacheVictim(&cache);
+        if(idx < 0) break; //nothing is pinned, so can't happen
+        blockCacheAssign(&cache, idx, trace[i]);
+    }
+    *outHits = cache.hits;
+    blockCacheFree(&cache);
+    return 0;
+}
+
+
+static uint32_t replayRandom(const uint32_t *trace, uint32_t len,
+uint16_t size, uint32_t seed) {
+    //replay a trace through what the SD driver had before: a list of
+    //blocks, filled in order, then a random one replaced on each miss.
+    uint32_t *blocks = (uint32_t*)malloc(size * sizeof(uint32_t));
+    if(!blocks) return 0;
+    uint32_t used = 0, hits = 0, state = seed;
+    for(uint32_t i=0; i<len; i++) {
+        uint32_t j;
+        for(j=0; j<used && blocks[j] != trace[i]; j++);
+        if(j < used) hits++;
+        else if(used < size) blocks[used++] = trace[i];
+        else blocks[fsTestRandom(&state) % size] = trace[i];
+    }
+    free(blocks);
+    return hits;
+}
+
+
+int cacheBench(int verbose) {
+    /** Compare the block cache's hit rates with random replacement.
+     *  @param verbose Whether to print more detail.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    FsTestDev dev;
+    FsTestTree model;
+    int err = devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0);
+    if(err) return err;
+    dev.trace = (uint32_t*)malloc(TRACE_SIZE * sizeof(uint32_t));
+    if(!dev.trace) {
+        devFree(&dev);
+        return -ENOMEM;
+    }
+
+    printf("hit rates, LRU/random, with blocks cached:\n");
+    printf("%-10s %5s %7s", "volume", "reads", "sectors");
+    for(size_t c=0; c<NUM_CACHE_SIZES; c++) {
+        printf(" %13u", cacheSizes[c]);
+    }
+    printf("\n");
+    for(size_t v=0; v<NUM_VOLUMES && !err; v++) {
+        err = makeVolume(&dev, v, &model);
+        if(verbose && !err) {
+            uint32_t files = 0;
+            for(uint32_t i=0; i<model.count; i++) {
+                files += !model.nodes[i].isDir;
+            }
+            printf("%s: %u files\n", volumes[v].name, files);
+        }
+        for(size_t r=0; r<NUM_READ_SIZES && !err; r++) {
+            err = record(&dev, &model, readSizes[r]);
+            if(err) break;
+            printf("%-10s %5u %7u", volumes[v].name, readSizes[r],
+                dev.traceLen);
+            for(size_t c=0; c<NUM_CACHE_SIZES && !err; c++) {
+                uint32_t lru;
+                uint64_t random = 0;
+                err = replayLru(dev.trace, dev.traceLen, cacheSizes[c],
+                    &lru);
+                for(uint32_t seed=1; seed<=RANDOM_RUNS; seed++) {
+                    random += replayRandom(dev.trace, dev.traceLen,
+                        cacheSizes[c], seed);
+                }
+                printf("  %5.1f/%5.1f%%",
+                    (lru * 100.0) / dev.traceLen,
+                    (random * 100.0) / ((uint64_t)dev.traceLen * RANDOM_RUNS));
+            }
+            printf("\n");
+        }
+        treeFree(&model);
+    }
+
+    free(dev.trace);
+    dev.trace = NULL;
+    devFree(&dev);
+    if(err) printf("benchmark failed: %s\n", strerror(-err));
+    return err;
+}
+
+
+static int readFiles(FsTestDev *dev, uint64_t start, const FsTestTree *model,
+uint32_t readSize, uint32_t readAhead) {
+    //read every file through the file class, checking what's read.
+    fat32_mbr mbr;
+    uint8_t *buf = (uint8_t*)malloc(readSize);
+    if(!buf) return -ENOMEM;
+    int err = fatMount(&dev->file, start, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    for(uint32_t i=0; i<model->count && !err; i++) {
+        const FsTestNode *node = &model->nodes[i];
+        if(node->isDir) continue;
+        FILE *f = fatOpen(&dev->file, &mbr, node->path, 0, readAhead,
+            FSTEST_TIMEOUT, &err);
+        for(uint32_t offset=0; f && !err && offset < node->size;
+        offset += readSize) {
+            uint32_t n = MIN(readSize, node->size - offset);
+            err = read(f, buf, n);
+            if(err >= 0) err = (err != (int)n
+                || memcmp(buf, &node->data[offset], n)) ? -EIO : 0;
+        }
+        if(f) micronClose(f);
+    }
+    int err2 = err ? 0 : fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    free(buf);
+    return err ? err : err2;
+}
+
+
+static void readAheadHeader() {
+    printf("device reads (requests/sectors) reading whole files, with "
+        "read-ahead of:\n");
+    printf("%-10s %5s", "volume", "reads");
+    for(size_t a=0; a<NUM_READ_AHEADS; a++) printf(" %15u", readAheads[a]);
+    printf("\n");
+}
+
+
+static int readAheadRows(FsTestDev *dev, uint64_t start, const char *name,
+const FsTestTree *model) {
+    //a row of the table for each read size.
+    for(size_t r=0; r<NUM_FILE_READ_SIZES; r++) {
+        printf("%-10s %5u", name, fileReadSizes[r]);
+        for(size_t a=0; a<NUM_READ_AHEADS; a++) {
+            uint64_t requests = dev->readRequests, sectors = dev->reads;
+            int err = readFiles(dev, start, model, fileReadSizes[r],
+                readAheads[a]);
+            if(err) {
+                printf("\n");
+                return err;
+            }
+            char cell[32];
+            snprintf(cell, sizeof(cell), "%llu/%llu",
+                (unsigned long long)(dev->readRequests - requests),
+                (unsigned long long)(dev->reads - sectors));
+            printf(" %15s", cell);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+
+int readAheadBench(const char *image, uint64_t start, int verbose) {
+    /** Count the device reads made reading files through the file class,
+     *  with read-ahead buffers of each size.
+     *  @param image Image file to read the files of, or NULL to use the
+     *   volumes cacheBench() does.
+     *  @param start Sector the image's volume begins at.
+     *  @param verbose Whether to print more detail.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    FsTestDev dev;
+    FsTestTree model;
+    int err = image ? devLoad(&dev, image) :
+        devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0);
+    if(err) {
+        printf("can't load %s: %s\n", image, strerror(-err));
+        return err;
+    }
+
+    if(image) {
+        fat32_mbr mbr;
+        treeInit(&model);
+        err = fatMount(&dev.file, start, &mbr, FAT_DEFAULT_CACHE_SIZE,
+            FSTEST_TIMEOUT);
+        if(!err) {
+            err = fsTestList(&dev.file, &mbr, &model);
+            int err2 = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+            if(!err) err = err2;
+        }
+        if(verbose && !err) printf("%s: %u files and directories\n", image,
+            model.count);
+        if(!err) readAheadHeader();
+        if(!err) err = readAheadRows(&dev, start, "image", &model);
+        treeFree(&model);
+    }
+    else readAheadHeader();
+    for(size_t v=0; v<NUM_VOLUMES && !image && !err; v++) {
+        err = makeVolume(&dev, v, &model);
+        if(!err) err = readAheadRows(&dev, START_SECTOR, volumes[v].name,
+            &model);
+        treeFree(&model);
+    }
+    devFree(&dev);
+    if(err) printf("benchmark failed: %s\n", strerror(-err));
+    return err;
+}
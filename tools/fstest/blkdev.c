@@ -0,0 +1,304 @@
+/** Block device in memory for fstest, standing in for an SD card.
+ *  It implements the few Micron I/O functions the filesystem drivers use
+ *  (read(), write(), fseek() and discard(), renamed by micron.h), and can
+ *  lose power after any number of sectors written. Those functions go
+ *  through a table of file classes, as in libs/io, so the FAT driver's
+ *  file class (filecls.c) works too.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include "fstest.h"
+}
+
+//simulated time, for the drivers' time budgets: each sector read or
+//written takes 125 us, about what a slow SD card manages.
+static uint64_t _sectorsMoved = 0;
+
+
+uint32_t millis() {
+    return _sectorsMoved / 8;
+}
+
+
+int rtcGet(uint32_t *outSecs, uint32_t *outUsecs) {
+    //a fixed time, so images come out the same every run.
+    if(outSecs)  *outSecs  = 1700000000; //2023-11-14 22:13:20
+    if(outUsecs) *outUsecs = 0;
+    return 0;
+}
+
+
+uint32_t fsTestRandom(uint32_t *state) {
+    //xorshift32; the state must not be 0.
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+void fsTestFill(uint8_t *buf, uint32_t len, uint32_t seed) {
+    //fill a buffer with data that's different for every seed and offset.
+    uint32_t state = seed * 2654435761UL + 1;
+    if(!state) state = 1;
+    for(uint32_t i=0; i<len; i++) buf[i] = fsTestRandom(&state) >> 24;
+}
+
+
+static void _junk(FsTestDev *dev, uint32_t sector) {
+    //what a sector holds when nothing has been written to it: not zeros,
+    //so that a driver that expects zeros there gets caught.
+    fsTestFill(&dev->data[(uint64_t)sector * FSTEST_SECTOR_SIZE],
+        FSTEST_SECTOR_SIZE, (sector + dev->seed) ^ 0x5EC70000);
+}
+
+
+int devInit(FsTestDev *dev, uint32_t numSectors, uint32_t seed) {
+    /** Set up a block device.
+     *  @param dev The device.
+     *  @param numSectors Its size.
+     *  @param seed Changes the junk it's filled with.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    memset(dev, 0, sizeof(FsTestDev));
+    dev->data = (uint8_t*)malloc((size_t)numSectors * FSTEST_SECTOR_SIZE);
+    dev->discarded = (uint8_t*)calloc(numSectors, 1);
+    if(!dev->data || !dev->discarded) {
+        devFree(dev);
+        return -ENOMEM;
+    }
+    dev->numSectors = numSectors;
+    dev->seed = seed;
+    dev->cutAt = FSTEST_NEVER;
+    for(uint32_t i=0; i<numSectors; i++) _junk(dev, i);
+    dev->file.udata.ptr = dev;
+    return 0;
+}
+
+
+void devFree(FsTestDev *dev) {
+    if(dev->data) free(dev->data);
+    if(dev->discarded) free(dev->discarded);
+    dev->data = NULL;
+    dev->discarded = NULL;
+}
+
+
+void devPower(FsTestDev *dev, uint64_t cutAfter) {
+    /** Turn the power on, and say when it'll be lost.
+     *  @param dev The device.
+     *  @param cutAfter How many more sectors can be written (or discards
+     *   done) before power is lost, or FSTEST_NEVER.
+     */
+    dev->cut = false;
+    dev->cutAt = (cutAfter == FSTEST_NEVER) ? FSTEST_NEVER :
+        dev->writes + cutAfter;
+}
+
+
+int devLoad(FsTestDev *dev, const char *path) {
+    /** Set up a block device holding an image file.
+     *  @param dev The device.
+     *  @param path The image.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -errno;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < FSTEST_SECTOR_SIZE) {
+        close(fd);
+        return -EINVAL;
+    }
+    int err = devInit(dev, st.st_size / FSTEST_SECTOR_SIZE, 0);
+    if(!err) {
+        size_t len = (size_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+        if(pread(fd, dev->data, len, 0) != (ssize_t)len) {
+            devFree(dev);
+            err = -EIO;
+        }
+    }
+    close(fd);
+    return err;
+}
+
+
+int devSave(FsTestDev *dev, const char *path) {
+    /** Write a block device's contents to an image file.
+     *  @param dev The device.
+     *  @param path The image.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -errno;
+    size_t len = (size_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    int err = (pwrite(fd, dev->data, len, 0) == (ssize_t)len) ? 0 : -EIO;
+    close(fd);
+    return err;
+}
+
+
+/* ----------------------------- Block device ----------------------------- */
+
+static int _devSeek(FILE *self, long int offset, int origin) {
+    FsTestDev *dev = (FsTestDev*)self->udata.ptr;
+    uint64_t size = (uint64_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    uint64_t pos;
+    switch(origin) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = self->offset + offset; break;
+        case SEEK_END: pos = size - offset; break;
+        default: return -EINVAL;
+    }
+    if(pos >= size) return -ERANGE;
+    self->offset = pos;
+    return 0;
+}
+
+
+static int _devRead(FILE *self, void *dest, size_t len) {
+    //a read running off the end of the device gets what there is, as
+    //Micron's read() does when the file class runs out of data.
+    FsTestDev *dev = (FsTestDev*)self->udata.ptr;
+    uint64_t size = (uint64_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    if(self->offset >= size) return -ENODATA;
+    if(self->offset + len > size) len = size - self->offset;
+    dev->readRequests++;
+    uint32_t first = self->offset / FSTEST_SECTOR_SIZE;
+    for(uint32_t i=0; dev->trace && i < len / FSTEST_SECTOR_SIZE
+    && dev->traceLen < dev->traceSize; i++) {
+        dev->trace[dev->traceLen++] = first + i;
+    }
+    memcpy(dest, &dev->data[self->offset], len);
+    self->offset += len;
+    dev->reads += len / FSTEST_SECTOR_SIZE;
+    _sectorsMoved += len / FSTEST_SECTOR_SIZE;
+    return len;
+}
+
+
+static int _devWrite(FILE *self, const void *src, size_t len) {
+    //sectors are written in order, so if power is lost partway through,
+    //the ones before that point are written and the rest aren't, as with
+    //a multiple block write to an SD card.
+    FsTestDev *dev = (FsTestDev*)self->udata.ptr;
+    uint64_t size = (uint64_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    if((self->offset | len) % FSTEST_SECTOR_SIZE) return -EINVAL;
+    if(self->offset + len > size) return -ERANGE;
+    dev->writeRequests++;
+    const uint8_t *in = (const uint8_t*)src;
+    for(size_t done=0; done<len; done += FSTEST_SECTOR_SIZE) {
+        if(dev->writes >= dev->cutAt) {
+            dev->cut = true;
+            return -EIO;
+        }
+        memcpy(&dev->data[self->offset], &in[done], FSTEST_SECTOR_SIZE);
+        dev->discarded[self->offset / FSTEST_SECTOR_SIZE] = 0;
+        self->offset += FSTEST_SECTOR_SIZE;
+        dev->writes++;
+        _sectorsMoved++;
+    }
+    return len;
+}
+
+
+static int _devDiscard(FILE *self, size_t len) {
+    //discarded sectors read back as junk, since a card may return
+    //anything for them.
+    FsTestDev *dev = (FsTestDev*)self->udata.ptr;
+    uint64_t size = (uint64_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    if((self->offset | len) % FSTEST_SECTOR_SIZE) return -EINVAL;
+    if(self->offset + len > size) return -ERANGE;
+    if(dev->writes >= dev->cutAt) {
+        dev->cut = true;
+        return -EIO;
+    }
+    dev->writes++;
+    uint32_t first = self->offset / FSTEST_SECTOR_SIZE;
+    for(uint32_t i=0; i<len / FSTEST_SECTOR_SIZE; i++) {
+        _junk(dev, first + i);
+        dev->discarded[first + i] = 1;
+    }
+    dev->discards += len / FSTEST_SECTOR_SIZE;
+    return 0;
+}
+
+
+static int _devSync(FILE *self) {
+    return 0; //nothing is buffered
+}
+
+
+static int _devClose(FILE *self) {
+    return 0; //the test owns it
+}
+
+
+static MicronFileClass _devFileCls = {
+    .close   = _devClose,
+    .read    = _devRead,
+    .write   = _devWrite,
+    .seek    = _devSeek,
+    .sync    = _devSync,
+    .discard = _devDiscard,
+};
+
+
+/* ---------------------------- Micron I/O API ---------------------------- */
+
+//file classes. the block device is 0, since its FILE is zeroed by
+//devInit(); the FAT driver's file class registers itself.
+#define MAX_FILE_CLASSES 4
+static MicronFileClass *_fileClasses[MAX_FILE_CLASSES] = {&_devFileCls};
+static int _numFileClasses = 1;
+
+int osRegisterFileClass(MicronFileClass *cls) {
+    if(_numFileClasses >= MAX_FILE_CLASSES) return -ENFILE;
+    _fileClasses[_numFileClasses] = cls;
+    return _numFileClasses++;
+}
+
+
+int micronClose(FILE *self) {
+    return _fileClasses[self->fileCls]->close(self);
+}
+
+
+int micronRead(FILE *self, void *dest, size_t len) {
+    //like libs/io's read(): keep going until `len` bytes or the end.
+    MicronFileClass *cls = _fileClasses[self->fileCls];
+    uint8_t *out = (uint8_t*)dest;
+    size_t count = 0;
+    while(count < len) {
+        int r = cls->read(self, out, len - count);
+        if(r == -ENODATA && count) break; //end of file
+        if(r < 0) return r;
+        if(r == 0) return -EIO; //nothing here blocks, so it never will
+        count += r;
+        if(out) out += r;
+    }
+    return count;
+}
+
+
+int micronWrite(FILE *self, const void *src, size_t len) {
+    return _fileClasses[self->fileCls]->write(self, src, len);
+}
+
+
+int micronSeek(FILE *self, long int offset, int origin) {
+    return _fileClasses[self->fileCls]->seek(self, offset, origin);
+}
+
+
+int micronDiscard(FILE *self, size_t len) {
+    MicronFileClass *cls = _fileClasses[self->fileCls];
+    return cls->discard ? cls->discard(self, len) : -ENOSYS;
+}
+
+
+int micronSync(FILE *self) {
+    return _fileClasses[self->fileCls]->sync(self);
+}
@@ -0,0 +1,341 @@
+/** Reading and writing with every cluster size.
+ *  For each cluster size from 512 bytes to 64 KiB, a volume gets a file
+ *  written in one go, so its clusters are contiguous, and two written a
+ *  piece at a time in turn, so theirs are interleaved. Then they're read
+ *  and overwritten at offsets and lengths that start and end in the middle
+ *  of sectors and clusters, on both sides of the boundaries, and past the
+ *  end of the file. Each read must return what was written, without
+ *  touching the buffer beyond what it returns; a read or write of whole
+ *  contiguous sectors must be a single request to the device; overwriting
+ *  must leave the boot sector, FATs and directory exactly as they were;
+ *  and a device that runs out partway through a read must make it fail,
+ *  rather than return what was in the buffer before.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_CLUSTERS 48
+#define GUARD 16 //bytes after each read's buffer that must be left alone
+#define GUARD_BYTE 0xA5
+#define RANDOM_CASES 64
+
+static const char *files[] = {"/contig.bin", "/frag a.bin", "/frag b.bin"};
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+
+static uint32_t checkRead(FsTestDev *dev, fat32_mbr *mbr,
+const FsTestNode *node, uint32_t offset, uint32_t size, int verbose) {
+    //read part of a file, and check it against the model.
+    MicronFatFile file;
+    uint8_t *buf = (uint8_t*)malloc(size + GUARD);
+    if(!buf) return 1;
+    memset(buf, GUARD_BYTE, size + GUARD);
+    int err = fatOpenPath(&dev->file, mbr, node->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!err) {
+        err = fatReadFile(&dev->file, mbr, &file, offset, size, buf,
+            FSTEST_TIMEOUT);
+        fatCloseFile(&file);
+    }
+
+    uint32_t expect = (offset >= node->size) ? 0 :
+        MIN(size, node->size - offset);
+    uint32_t problems = 0;
+    if(err < 0 || (uint32_t)err != expect) {
+        if(verbose) printf("%s: read %u at %u returned %d, not %u\n",
+            node->path, size, offset, err, expect);
+        problems++;
+    }
+    else if(memcmp(buf, &node->data[offset], expect)) {
+        if(verbose) printf("%s: read %u at %u got the wrong data\n",
+            node->path, size, offset);
+        problems++;
+    }
+    else for(uint32_t i=expect; i<size + GUARD; i++) {
+        if(buf[i] == GUARD_BYTE) continue;
+        if(verbose) printf("%s: read %u at %u wrote past what it returned\n",
+            node->path, size, offset);
+        problems++;
+        break;
+    }
+    free(buf);
+    return problems;
+}
+
+
+static uint32_t checkReads(FsTestDev *dev, fat32_mbr *mbr,
+const FsTestTree *model, uint32_t clusterSize, int verbose) {
+    //read each file at offsets around the sector and cluster boundaries,
+    //and at random.
+    uint32_t problems = 0;
+    uint32_t rand = clusterSize;
+    for(size_t f=0; f<NUM_FILES; f++) {
+        const FsTestNode *node = treeFind(model, files[f]);
+        if(!node) return 1;
+        uint32_t size = node->size, cs = clusterSize;
+        const uint32_t cases[][2] = { //offset, size
+            {0, size}, {1, size}, {0, 1}, {0, 511}, {0, 512}, {511, 2},
+            {512, 512}, {300, 1000}, {cs - 1, 2}, {cs - 512, 1024},
+            {cs, cs}, {cs + 17, 2 * cs}, {3, (3 * cs) - 5},
+            {size - 1, 10}, {size, 5}, {size + 100, 5},
+        };
+        for(size_t i=0; i<sizeof(cases) / sizeof(cases[0]); i++) {
+            problems += checkRead(dev, mbr, node, cases[i][0], cases[i][1],
+                verbose);
+        }
+        for(int i=0; i<RANDOM_CASES; i++) {
+            uint32_t offset = fsTestRandom(&rand) % (size + 1);
+            uint32_t len = 1 + (fsTestRandom(&rand) % (size - offset + 1));
+            problems += checkRead(dev, mbr, node, offset, len, verbose);
+        }
+    }
+    return problems;
+}
+
+
+static uint8_t* metadata(FsTestDev *dev, uint32_t *outLen) {
+    //copy the reserved sectors, both FATs and the root directory, where
+    //all of the files are.
+    FsTestVol vol;
+    if(volOpen(dev, START_SECTOR, &vol)) return NULL;
+    uint32_t chain[VOLUME_CLUSTERS];
+    uint32_t numDir = volChain(&vol, vol.rootCluster, chain, VOLUME_CLUSTERS);
+    uint32_t clusterSize = vol.spc * FSTEST_SECTOR_SIZE;
+    uint32_t head = (vol.dataStart - START_SECTOR) * FSTEST_SECTOR_SIZE;
+    *outLen = head + (numDir * clusterSize);
+    uint8_t *out = (uint8_t*)malloc(*outLen);
+    if(!out) return NULL;
+    memcpy(out, &dev->data[START_SECTOR * FSTEST_SECTOR_SIZE], head);
+    for(uint32_t i=0; i<numDir; i++) {
+        memcpy(&out[head + (i * clusterSize)], volCluster(&vol, chain[i]),
+            clusterSize);
+    }
+    return out;
+}
+
+
+static int overwrite(FsTestDev *dev, fat32_mbr *mbr, FsTestNode *node,
+uint32_t offset, uint32_t size, uint32_t seed, uint64_t *outRequests) {
+    //overwrite part of a file, and the model, counting the write requests.
+    fsTestFill(&node->data[offset], size, seed);
+    MicronFatFile file;
+    int err = fatOpenPath(&dev->file, mbr, node->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!err) {
+        uint64_t before = dev->writeRequests;
+        err = fatWriteFile(&dev->file, mbr, &file, offset, size,
+            &node->data[offset], FSTEST_TIMEOUT);
+        if(err >= 0) err = (err == (int)size) ? 0 : -EIO;
+        if(outRequests) *outRequests = dev->writeRequests - before;
+        fatCloseFile(&file);
+    }
+    return err;
+}
+
+
+static uint32_t checkWrites(FsTestDev *dev, fat32_mbr *mbr,
+FsTestTree *model, uint32_t clusterSize, int verbose) {
+    //overwrite parts of every file across sector and cluster boundaries,
+    //and the whole of each one's first extent. none of it may change a
+    //byte of the metadata, even once the driver has synced.
+    uint32_t cs = clusterSize;
+    const uint32_t cases[][2] = { //offset, size
+        {cs - 3, 7}, {1, (2 * cs) + 5}, {cs + 511, 514}, {0, 512},
+    };
+    uint32_t problems = 0, len, lenAfter;
+    int err = fatSync(&dev->file, mbr, FSTEST_TIMEOUT);
+    uint8_t *before = err ? NULL : metadata(dev, &len);
+    if(!before) {
+        if(verbose) printf("can't sync before overwriting: %d\n", err);
+        return 1;
+    }
+    for(size_t f=0; f<NUM_FILES && !err; f++) {
+        FsTestNode *node = treeFind(model, files[f]);
+        for(size_t i=0; i<sizeof(cases) / sizeof(cases[0]) && !err; i++) {
+            uint32_t offset = cases[i][0];
+            if(offset >= node->size) continue;
+            uint32_t size = MIN(cases[i][1], node->size - offset);
+            err = overwrite(dev, mbr, node, offset, size, (f << 8) + i + 1,
+                NULL);
+            if(err && verbose) printf("%s: write %u at %u failed: %d\n",
+                node->path, size, offset, err);
+        }
+
+        //whole sectors of one extent are a single write.
+        FsTestVol vol;
+        uint32_t chain[VOLUME_CLUSTERS], run = 1;
+        MicronFatFile file;
+        if(!err) err = volOpen(dev, START_SECTOR, &vol);
+        if(!err) err = fatOpenPath(&dev->file, mbr, node->path, &file,
+            FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+        if(!err) {
+            uint32_t n = volChain(&vol, file.firstCluster, chain,
+                VOLUME_CLUSTERS);
+            while(run < n && chain[run] == chain[0] + run) run++;
+            fatCloseFile(&file);
+        }
+        uint32_t size = MIN(run * cs,
+            node->size - (node->size % FSTEST_SECTOR_SIZE));
+        uint64_t requests = 0;
+        if(!err) err = overwrite(dev, mbr, node, 0, size, (f << 8) + 99,
+            &requests);
+        if(err) {
+            if(verbose) printf("%s: write of the first extent failed: %d\n",
+                node->path, err);
+        }
+        else if(requests != 1) {
+            if(verbose) printf("%s: write of %u bytes in one extent took "
+                "%llu requests\n", node->path, size,
+                (unsigned long long)requests);
+            problems++;
+        }
+    }
+    if(err) problems++;
+
+    if(!err) err = fatSync(&dev->file, mbr, FSTEST_TIMEOUT);
+    uint8_t *after = err ? NULL : metadata(dev, &lenAfter);
+    if(!after || lenAfter != len || memcmp(before, after, len)) {
+        if(verbose) printf("overwriting changed the metadata\n");
+        problems++;
+    }
+    free(before);
+    free(after);
+    return problems;
+}
+
+
+static uint32_t checkRequests(FsTestDev *dev, fat32_mbr *mbr,
+const FsTestNode *node, uint32_t clusterSize, int verbose) {
+    //reading whole sectors of a contiguous file should take one request,
+    //once the FAT is cached; and if the device can't provide them all,
+    //the read should fail.
+    MicronFatFile file;
+    uint32_t size = node->size - (node->size % clusterSize);
+    uint8_t *buf = (uint8_t*)malloc(size);
+    if(!buf) return 1;
+    uint32_t problems = 0;
+    int err = fatOpenPath(&dev->file, mbr, node->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(err) {
+        free(buf);
+        return 1;
+    }
+    err = fatReadFile(&dev->file, mbr, &file, 0, size, buf, FSTEST_TIMEOUT);
+    uint64_t before = dev->readRequests;
+    if(err >= 0) err = fatReadFile(&dev->file, mbr, &file, 0, size, buf,
+        FSTEST_TIMEOUT);
+    if(err != (int)size) {
+        if(verbose) printf("%s: read %u returned %d\n", node->path, size,
+            err);
+        problems++;
+    }
+    else if(dev->readRequests - before != 1) {
+        if(verbose) printf("%s: read of %u contiguous bytes took %llu "
+            "requests\n", node->path, size,
+            (unsigned long long)(dev->readRequests - before));
+        problems++;
+    }
+
+    //cut the device off in the middle of the file.
+    if(!problems) {
+        uint32_t numSectors = dev->numSectors;
+        uint32_t spc = clusterSize / FSTEST_SECTOR_SIZE;
+        dev->numSectors = fatClusterToSector(mbr, file.firstCluster) +
+            spc + (spc / 2) + 1;
+        err = fatReadFile(&dev->file, mbr, &file, 0, size, buf,
+            FSTEST_TIMEOUT);
+        dev->numSectors = numSectors;
+        if(err != -EIO) {
+            if(verbose) printf("%s: read beyond the end of the device "
+                "returned %d, not -EIO\n", node->path, err);
+            problems++;
+        }
+    }
+    fatCloseFile(&file);
+    free(buf);
+    return problems;
+}
+
+
+static uint32_t runSize(uint8_t spc, int verbose) {
+    uint32_t clusterSize = spc * FSTEST_SECTOR_SIZE;
+    uint32_t numSectors = (VOLUME_CLUSTERS * spc) + 64;
+    FsTestDev dev;
+    FsTestTree model, actual;
+    FsckResult result;
+    fat32_mbr mbr;
+    if(devInit(&dev, START_SECTOR + numSectors, spc)) return 1;
+    treeInit(&model);
+    treeInit(&actual);
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, numSectors, spc, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't format and mount: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    //one file written at once, and two written a bit at a time, in turn,
+    //so that their clusters are interleaved. the pieces aren't multiples
+    //of the cluster size, so appends start partway through clusters.
+    err = fsTestAppend(&dev, &mbr, &model, files[0], (6 * clusterSize) + 300,
+        1);
+    for(int i=0; i<4 && !err; i++) {
+        err = fsTestAppend(&dev, &mbr, &model, files[1],
+            (clusterSize * (i + 2) / 2) + 37, 10 + i);
+        if(!err) err = fsTestAppend(&dev, &mbr, &model, files[2],
+            (clusterSize / 3) + 1 + i, 20 + i);
+    }
+    if(err) {
+        if(verbose) printf("can't write the files: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    problems += checkReads(&dev, &mbr, &model, clusterSize, verbose);
+    problems += checkWrites(&dev, &mbr, &model, clusterSize, verbose);
+    problems += checkReads(&dev, &mbr, &model, clusterSize, verbose);
+    problems += checkRequests(&dev, &mbr, treeFind(&model, files[0]),
+        clusterSize, verbose);
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't unmount: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    //and fsck must agree.
+    problems += fsTestVerify(&dev, START_SECTOR, &actual, &result, verbose);
+    if(treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&actual);
+    devFree(&dev);
+    return problems;
+}
+
+
+uint32_t testClusters(int verbose) {
+    /** Run the test with every cluster size.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of cluster sizes it failed with.
+     */
+    uint32_t failures = 0;
+    for(uint32_t spc=1; spc<=128; spc *= 2) {
+        uint32_t problems = runSize(spc, verbose);
+        printf("%6u bytes per cluster: %s\n", spc * FSTEST_SECTOR_SIZE,
+            problems ? "FAILED" : "ok");
+        if(problems) failures++;
+    }
+    return failures;
+}
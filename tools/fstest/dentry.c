@@ -0,0 +1,346 @@
+/** The dentry cache (path.c).
+ *  A directory of a thousand files is made, and names in it are looked up
+ *  again and again: a repeated lookup must not read the disk, and must
+ *  match names regardless of case, by long name or 8.3 alias. Then each
+ *  way the driver can change a directory entry is tried on a cached name -
+ *  appending, truncating, deleting and recreating the file, and deleting
+ *  and remaking the directory it's in - and each lookup after must see the
+ *  change, under every name it was cached by. A change made behind the
+ *  driver's back must be seen after fatDentryInvalidateAll(). Cycling
+ *  through one more name than the cache holds must miss every time, and
+ *  one fewer must hit after the first round. Finally fsck must find what
+ *  the driver was told to make, and it prints how many sectors repeated
+ *  lookups in the big directory read with each size of cache.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 8192
+#define NUM_FILLERS 1000
+#define BENCH_NAMES 8
+#define BENCH_ROUNDS 50
+
+typedef enum {
+    ANY,  //may or may not read the disk
+    HIT,  //mustn't read the disk
+    MISS, //must read the disk
+} Expect;
+
+static const char *longPath  = "/sub/Long File Name.txt";
+static const char *shortPath = "/sub/short.txt";
+static const uint16_t benchSizes[] = {0, BENCH_NAMES / 2, 16};
+#define NUM_BENCH_SIZES (sizeof(benchSizes) / sizeof(benchSizes[0]))
+
+
+static uint32_t check(FsTestDev *dev, fat32_mbr *mbr, const char *path,
+int expectErr, int64_t expectSize, Expect expect, int verbose) {
+    //look up a path, and check the result. expectSize -1 means any.
+    micronDirent ent;
+    uint64_t reads = dev->reads;
+    int err = fatLookupPath(&dev->file, mbr, path, &ent, FSTEST_TIMEOUT);
+    reads = dev->reads - reads;
+    if(err != expectErr) {
+        if(verbose) printf("%s: lookup returned %d, not %d\n", path, err,
+            expectErr);
+        return 1;
+    }
+    if(!err && expectSize >= 0 && ent.size != (uint64_t)expectSize) {
+        if(verbose) printf("%s: size is %llu, not %lld\n", path,
+            (unsigned long long)ent.size, (long long)expectSize);
+        return 1;
+    }
+    if((expect == HIT && reads) || (expect == MISS && !reads)) {
+        if(verbose) printf("%s: lookup read %llu sectors\n", path,
+            (unsigned long long)reads);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int modify(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+const char *path, uint32_t size) {
+    //truncate a file through the driver, and in the model.
+    MicronFatFile file;
+    int err = fatOpenPath(&dev->file, mbr, path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(err) return err;
+    err = fatTruncateFile(&dev->file, mbr, &file, size, FSTEST_TIMEOUT);
+    fatCloseFile(&file);
+    FsTestNode *node = treeFind(model, path);
+    if(!err && node) node->size = size;
+    return err;
+}
+
+
+static int removeFile(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+const char *path) {
+    //delete a file or directory through the driver, and from the model.
+    int err = fatDelete(&dev->file, mbr, path, FSTEST_TIMEOUT);
+    if(!err) treeRemove(model, path);
+    return err;
+}
+
+
+static uint32_t checkChanges(FsTestDev *dev, fat32_mbr *mbr,
+FsTestTree *model, int verbose) {
+    //each kind of change to a cached name must be seen.
+    uint32_t p = 0;
+    uint32_t size = treeFind(model, longPath)->size;
+
+    //by long name, in any case, and by 8.3 alias.
+    p += check(dev, mbr, longPath, 0, size, MISS, verbose);
+    p += check(dev, mbr, longPath, 0, size, HIT, verbose);
+    p += check(dev, mbr, "/SUB/long FILE name.TXT", 0, size, HIT, verbose);
+    p += check(dev, mbr, "/sub/LONGFI~1.TXT", 0, size, MISS, verbose);
+    p += check(dev, mbr, "/Sub/longfi~1.txt", 0, size, HIT, verbose);
+    p += check(dev, mbr, "/sub/Long File Name.txt/x", -ENOTDIR, -1, HIT,
+        verbose);
+
+    //appending and truncating change the size, under both names.
+    int err = fsTestAppend(dev, mbr, model, longPath, 1000, 1);
+    if(!err) p += check(dev, mbr, "/sub/longfi~1.txt", 0, size + 1000, ANY,
+        verbose);
+    if(!err) p += check(dev, mbr, longPath, 0, size + 1000, ANY, verbose);
+    if(!err) err = modify(dev, mbr, model, longPath, 10);
+    if(!err) p += check(dev, mbr, "/sub/LONGFI~1.TXT", 0, 10, ANY, verbose);
+    if(!err) p += check(dev, mbr, "/sub/long file name.txt", 0, 10, ANY,
+        verbose);
+
+    //deleting and recreating it.
+    if(!err) err = removeFile(dev, mbr, model, longPath);
+    if(!err) {
+        p += check(dev, mbr, longPath, -ENOENT, -1, ANY, verbose);
+        p += check(dev, mbr, "/sub/longfi~1.txt", -ENOENT, -1, ANY, verbose);
+        p += check(dev, mbr, "/sub/LONG FILE NAME.TXT", -ENOENT, -1, ANY,
+            verbose);
+        err = fsTestAppend(dev, mbr, model, longPath, 3000, 2);
+    }
+    if(!err) p += check(dev, mbr, "/sub/long file name.txt", 0, 3000, ANY,
+        verbose);
+
+    //deleting a directory, and making another elsewhere, in the cluster it
+    //had: names cached in the old one mustn't be found in the new one.
+    micronDirent d, e;
+    if(!err) err = fatMkdir(&dev->file, mbr, "/sub/d", FSTEST_TIMEOUT);
+    if(!err) err = fsTestAppend(dev, mbr, model, "/sub/d/x", 500, 3);
+    if(!err) {
+        p += check(dev, mbr, "/sub/d/x", 0, 500, ANY, verbose);
+        p += check(dev, mbr, "/sub/d/X", 0, 500, HIT, verbose);
+        err = removeFile(dev, mbr, model, "/sub/d/x");
+    }
+    if(!err) err = fatLookupPath(&dev->file, mbr, "/sub/d/..", &d,
+        FSTEST_TIMEOUT);
+    if(!err) err = fatLookupPath(&dev->file, mbr, "/sub/d", &d,
+        FSTEST_TIMEOUT);
+    if(!err) err = fatDelete(&dev->file, mbr, "/sub/d", FSTEST_TIMEOUT);
+    if(!err) p += check(dev, mbr, "/sub/d", -ENOENT, -1, ANY, verbose);
+    if(!err) err = fatMkdir(&dev->file, mbr, "/e", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(model, "/e", true, NULL, 0);
+    if(!err) err = fatLookupPath(&dev->file, mbr, "/e", &e, FSTEST_TIMEOUT);
+    if(!err && e.cluster != d.cluster) {
+        if(verbose) printf("/e is in cluster %llu, not %llu where /sub/d "
+            "was\n", (unsigned long long)e.cluster,
+            (unsigned long long)d.cluster);
+        p++;
+    }
+    if(!err) err = fatLookupPath(&dev->file, mbr, "/e/..", &e,
+        FSTEST_TIMEOUT);
+    if(!err && e.cluster != mbr->rootCluster) {
+        if(verbose) printf("/e/.. is cluster %llu, not the root\n",
+            (unsigned long long)e.cluster);
+        p++;
+    }
+    if(!err) err = fatMkdir(&dev->file, mbr, "/sub/d", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(model, "/sub/d", true, NULL, 0);
+    if(!err) p += check(dev, mbr, "/sub/d/x", -ENOENT, -1, ANY, verbose);
+
+    //a name that wasn't found, then is created.
+    if(!err) p += check(dev, mbr, "/sub/new.txt", -ENOENT, -1, ANY, verbose);
+    if(!err) err = fsTestAppend(dev, mbr, model, "/sub/new.txt", 5, 4);
+    if(!err) p += check(dev, mbr, "/sub/NEW.TXT", 0, 5, ANY, verbose);
+    if(err) {
+        if(verbose) printf("changing files failed: %d\n", err);
+        p++;
+    }
+    return p;
+}
+
+
+static uint32_t checkRaw(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+int verbose) {
+    //a change the driver doesn't know about, made directly on the disk.
+    FsTestVol vol;
+    micronDirent ent;
+    uint32_t size = treeFind(model, shortPath)->size;
+    uint32_t p = check(dev, mbr, shortPath, 0, size, ANY, verbose);
+    int err = fatLookupPath(&dev->file, mbr, "/sub", &ent, FSTEST_TIMEOUT);
+    if(!err) err = fatSync(&dev->file, mbr, FSTEST_TIMEOUT);
+    if(!err) err = volOpen(dev, START_SECTOR, &vol);
+    uint8_t *raw = err ? NULL : volFindEntry(&vol, ent.cluster,
+        "SHORT   TXT");
+    if(!raw) {
+        if(verbose) printf("can't find %s on the disk\n", shortPath);
+        return p + 1;
+    }
+    raw[28] = 1; //size
+    raw[29] = raw[30] = raw[31] = 0;
+    fatDentryInvalidateAll(mbr);
+    p += check(dev, mbr, shortPath, 0, 1, MISS, verbose);
+
+    //put it back.
+    raw[28] = size;
+    raw[29] = size >> 8;
+    raw[30] = size >> 16;
+    raw[31] = size >> 24;
+    fatDentryInvalidateAll(mbr);
+    p += check(dev, mbr, "/sub/SHORT.TXT", 0, size, MISS, verbose);
+    return p;
+}
+
+
+static bool lookupFiller(FsTestDev *dev, fat32_mbr *mbr, uint32_t parent,
+uint32_t i) {
+    //look up the i'th filler from the end of the directory, so misses are
+    //expensive. returns whether it was a hit.
+    MicronFatDentryCache *cache = mbr->_micron_dentryCache;
+    uint32_t hits = cache ? cache->hits : 0;
+    char name[32];
+    micronDirent ent;
+    sprintf(name, "%04u filler.dat", NUM_FILLERS - 1 - i);
+    fatLookup(&dev->file, mbr, parent, name, strlen(name), &ent,
+        FSTEST_TIMEOUT);
+    return cache && cache->hits != hits;
+}
+
+
+static uint32_t cycle(FsTestDev *dev, fat32_mbr *mbr, uint32_t parent,
+uint32_t names, uint32_t rounds) {
+    //look up `names` names in turn, `rounds` times. returns the hits.
+    uint32_t hits = 0;
+    for(uint32_t r=0; r<rounds; r++) {
+        for(uint32_t i=0; i<names; i++) {
+            if(lookupFiller(dev, mbr, parent, i)) hits++;
+        }
+    }
+    return hits;
+}
+
+
+static uint32_t checkLru(FsTestDev *dev, fat32_mbr *mbr, uint32_t parent,
+int verbose) {
+    //one more name than fits must miss every time; one fewer must hit
+    //after the first round.
+    const uint16_t size = 4;
+    uint32_t p = 0;
+    if(fatDentryCacheInit(mbr, size)) return 1;
+    uint32_t hits = cycle(dev, mbr, parent, size + 1, 3);
+    if(hits) {
+        if(verbose) printf("cycling %u names through %u entries hit %u "
+            "times\n", size + 1, size, hits);
+        p++;
+    }
+    hits = cycle(dev, mbr, parent, size - 1, 3);
+    if(hits != (size - 1) * 2) {
+        if(verbose) printf("cycling %u names through %u entries hit %u "
+            "times, not %u\n", size - 1, size, hits, (size - 1) * 2);
+        p++;
+    }
+
+    //a hit makes a name the most recently used: after 0 1 2 3 0 4, the
+    //entry for 1 is the one replaced, not 0.
+    fatDentryInvalidateAll(mbr);
+    cycle(dev, mbr, parent, size, 1);
+    lookupFiller(dev, mbr, parent, 0);
+    lookupFiller(dev, mbr, parent, size);
+    bool hit0 = lookupFiller(dev, mbr, parent, 0);
+    bool hit1 = lookupFiller(dev, mbr, parent, 1);
+    if(!hit0 || hit1) {
+        if(verbose) printf("after a hit on the oldest name, the next lookup "
+            "replaced it\n");
+        p++;
+    }
+    if(fatDentryCacheInit(mbr, FAT_DEFAULT_DENTRY_CACHE_SIZE)) p++;
+    return p;
+}
+
+
+uint32_t testDentry(int verbose) {
+    /** Check the dentry cache.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    FsTestDev dev;
+    FsTestTree model, actual;
+    FsckResult result;
+    fat32_mbr mbr;
+    micronDirent sub;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    treeInit(&actual);
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(!err) err = fatMkdir(&dev.file, &mbr, "/sub", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(&model, "/sub", true, NULL, 0);
+    for(uint32_t i=0; i<NUM_FILLERS && !err; i++) {
+        char path[FSTEST_MAX_PATH];
+        sprintf(path, "/sub/%04u filler.dat", i);
+        err = fsTestAppend(&dev, &mbr, &model, path, 0, i);
+    }
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, longPath, 700, 5);
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, shortPath, 300, 6);
+    if(!err) err = fatLookupPath(&dev.file, &mbr, "/sub", &sub,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+    fatDentryInvalidateAll(&mbr);
+
+    uint32_t changes, raw, lru;
+    changes = checkChanges(&dev, &mbr, &model, verbose);
+    printf("  changes to cached names: %s\n", changes ? "FAILED" : "ok");
+    raw = checkRaw(&dev, &mbr, &model, verbose);
+    printf("  changes on the disk: %s\n", raw ? "FAILED" : "ok");
+    lru = checkLru(&dev, &mbr, sub.cluster, verbose);
+    printf("  least recently used: %s\n", lru ? "FAILED" : "ok");
+    problems += changes + raw + lru;
+
+    //what the cache saves.
+    printf("  sectors read by %u lookups of %u names in a directory of "
+        "%u files,\n  with a cache of:", BENCH_NAMES * BENCH_ROUNDS,
+        BENCH_NAMES, NUM_FILLERS);
+    for(size_t i=0; i<NUM_BENCH_SIZES; i++) {
+        if(fatDentryCacheInit(&mbr, benchSizes[i])) continue;
+        uint64_t reads = dev.reads;
+        cycle(&dev, &mbr, sub.cluster, BENCH_NAMES, BENCH_ROUNDS);
+        printf(" %u: %llu%s", benchSizes[i],
+            (unsigned long long)(dev.reads - reads),
+            (i + 1 < NUM_BENCH_SIZES) ? "," : "\n");
+    }
+
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't unmount: %d\n", err);
+        problems++;
+        goto done;
+    }
+    problems += fsTestVerify(&dev, START_SECTOR, &actual, &result, verbose);
+    if(treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&actual);
+    devFree(&dev);
+    return problems;
+}
@@ -0,0 +1,353 @@
+/** Reading directories (dir.c).
+ *  First, a root directory is built entry by entry, without the driver, in
+ *  four clusters that aren't in order on the disk. It holds long names
+ *  with accented letters, CJK and a character outside the BMP (which takes
+ *  a surrogate pair), one that exactly fills its LFN entry, ones whose LFN
+ *  entries straddle a sector and a cluster boundary, 8.3 names with the
+ *  lowercase flags, and ones that are broken in the ways a crash or another
+ *  OS can leave them: a wrong checksum, a missing LFN entry, LFN entries
+ *  with no 8.3 entry after them, and deleted entries. After the end marker
+ *  there's an entry that mustn't be seen. The driver must list exactly the
+ *  expected names, in order, reading each sector of the directory once, and
+ *  fsck must agree.
+ *  Then the driver creates a directory of 2000 files with long names, some
+ *  with data so the directory's clusters are fragmented, and must list them
+ *  all, reading each sector once, as fsck does.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 8192
+#define BIG_FILES 2000
+#define ENTRIES_PER_SECTOR (FSTEST_SECTOR_SIZE / 32)
+
+typedef enum {
+    FLAW_NONE,
+    FLAW_CHECKSUM, //LFN entries have the wrong checksum
+    FLAW_MIXED,    //the middle LFN entry's checksum differs from the rest
+    FLAW_MISSING,  //the middle LFN entry is missing
+    FLAW_DELETED,  //the whole thing is deleted
+    FLAW_ORPHAN,   //LFN entries with no 8.3 entry
+    FLAW_REPLACED, //the 8.3 entry is deleted, and then a new one made
+                   //with the same name but no LFN entries
+} Flaw;
+
+typedef struct {
+    const char *longName;  //NULL for none
+    const char *shortName; //as stored
+    uint8_t     ntFlags;   //0x08: base is lowercase, 0x10: extension is
+    Flaw        flaw;
+    uint32_t    at;        //entry to start at (0 = after the last one)
+    const char *expect;    //name the driver should give (NULL = none)
+} Entry;
+
+static const Entry entries[] = {
+    {"Grüße, 日本.txt", "GRE~1   TXT", 0, FLAW_NONE, 0,
+        "Grüße, 日本.txt"},
+    {"\xF0\x9F\x8E\xB5 music.mp3", "MUSIC~1 MP3", 0, FLAW_NONE, 0,
+        "\xF0\x9F\x8E\xB5 music.mp3"},
+    {"exactly13char", "EXACTL~1   ", 0, FLAW_NONE, 0, "exactly13char"},
+    {NULL, "README  TXT", 0x18, FLAW_NONE, 0, "readme.txt"},
+    {NULL, "MIXED   TXT", 0x08, FLAW_NONE, 0, "mixed.TXT"},
+    //entries 14-17 are LFN, and the first sector ends after 15.
+    {"A name long enough to need four LFN entries.dat", "ANAMEL~1DAT", 0,
+        FLAW_NONE, 14, "A name long enough to need four LFN entries.dat"},
+    {"Bad checksum.txt", "BADSUM  TXT", 0, FLAW_CHECKSUM, 0, "BADSUM.TXT"},
+    {"Missing the middle entry of three.txt", "MISSIN~1TXT", 0,
+        FLAW_MISSING, 0, "MISSIN~1.TXT"},
+    {"Checksums that disagree.txt", "CHECKS~1TXT", 0, FLAW_MIXED, 0,
+        "CHECKS~1.TXT"},
+    {"Deleted file.txt", "DELETE~1TXT", 0, FLAW_DELETED, 0, NULL},
+    {"Orphaned name.txt", "ORPHAN~1TXT", 0, FLAW_ORPHAN, 0, NULL},
+    {NULL, "PLAIN   TXT", 0, FLAW_NONE, 0, "PLAIN.TXT"},
+    {"Replaced.txt", "REPLAC~1TXT", 0, FLAW_REPLACED, 0, "REPLAC~1.TXT"},
+    //entries 46-48 are LFN, and the third cluster ends after 47.
+    {"Crossing into the fourth cluster.bin", "CROSSI~1BIN", 0, FLAW_NONE, 46,
+        "Crossing into the fourth cluster.bin"},
+    {"Last one.txt", "LASTON~1TXT", 0, FLAW_NONE, 0, "Last one.txt"},
+};
+#define NUM_ENTRIES (sizeof(entries) / sizeof(entries[0]))
+
+//the root directory's clusters, in order. with one sector per cluster,
+//each holds 16 entries.
+static const uint32_t rootClusters[] = {2, 10, 5, 7};
+#define ROOT_CLUSTERS (sizeof(rootClusters) / sizeof(rootClusters[0]))
+
+
+static int toUtf16(const char *in, uint16_t *out, int max) {
+    //convert UTF-8 to UTF-16, for LFN entries.
+    const uint8_t *s = (const uint8_t*)in;
+    int len = 0;
+    while(*s && len < max) {
+        uint32_t c = *s++;
+        int extra = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+        if(extra) c &= 0x3F >> extra;
+        while(extra-- && *s) c = (c << 6) | (*s++ & 0x3F);
+        if(c >= 0x10000) {
+            out[len++] = 0xD800 + ((c - 0x10000) >> 10);
+            c = 0xDC00 + ((c - 0x10000) & 0x3FF);
+        }
+        out[len++] = c;
+    }
+    return len;
+}
+
+
+static uint8_t checksum(const char *shortName) {
+    uint8_t sum = 0;
+    for(int i=0; i<11; i++) {
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (uint8_t)shortName[i];
+    }
+    return sum;
+}
+
+
+static uint8_t* entryAt(FsTestVol *vol, uint32_t idx) {
+    //where entry `idx` of the root directory is.
+    uint32_t perCluster = vol->spc * ENTRIES_PER_SECTOR;
+    return volCluster(vol, rootClusters[idx / perCluster]) +
+        ((idx % perCluster) * 32);
+}
+
+
+static int putEntry(FsTestVol *vol, uint32_t idx, const Entry *e) {
+    //write an entry and its LFN entries, starting at `idx`. returns the
+    //index after them, or -EINVAL if the flaw can't be made.
+    if(e->longName) {
+        uint16_t name[260];
+        int len = toUtf16(e->longName, name, 260);
+        int count = (len + 12) / 13;
+        for(int i=len; i<count * 13; i++) {
+            name[i] = (i == len) ? 0x0000 : 0xFFFF; //terminator, padding
+        }
+        uint8_t sum = checksum(e->shortName);
+        if(e->flaw == FLAW_CHECKSUM) sum++;
+        if(e->flaw == FLAW_MIXED && count < 3) return -EINVAL;
+        static const uint8_t offsets[13] =
+            {1,3,5,7,9, 14,16,18,20,22,24, 28,30};
+        for(int seq=count; seq>=1; seq--) {
+            if(e->flaw == FLAW_MISSING && seq == 2) continue;
+            uint8_t *ent = entryAt(vol, idx++);
+            memset(ent, 0, 32);
+            ent[0]  = seq | ((seq == count) ? 0x40 : 0);
+            ent[11] = 0x0F;
+            ent[13] = sum + ((e->flaw == FLAW_MIXED && seq == 2) ? 1 : 0);
+            for(int i=0; i<13; i++) {
+                uint16_t c = name[((seq - 1) * 13) + i];
+                ent[offsets[i]]     = c;
+                ent[offsets[i] + 1] = c >> 8;
+            }
+            if(e->flaw == FLAW_DELETED) ent[0] = 0xE5;
+        }
+    }
+    if(e->flaw == FLAW_ORPHAN) return idx;
+
+    uint8_t *ent = entryAt(vol, idx++);
+    memset(ent, 0, 32);
+    memcpy(ent, e->shortName, 11);
+    ent[11] = FAT_ATTR_ARCHIVE;
+    ent[12] = e->ntFlags;
+    if(e->flaw == FLAW_DELETED || e->flaw == FLAW_REPLACED) ent[0] = 0xE5;
+    if(e->flaw == FLAW_REPLACED) {
+        Entry plain = {NULL, e->shortName, 0, FLAW_NONE, 0, NULL};
+        idx = putEntry(vol, idx, &plain);
+    }
+    return idx;
+}
+
+
+static int buildRoot(FsTestVol *vol, uint32_t *outSectors) {
+    //build the root directory. returns how many sectors of it the driver
+    //needs to read, up to the end marker.
+    for(size_t i=0; i<ROOT_CLUSTERS; i++) {
+        memset(volCluster(vol, rootClusters[i]), 0,
+            vol->spc * FSTEST_SECTOR_SIZE);
+        volSetFat(vol, rootClusters[i], (i + 1 < ROOT_CLUSTERS) ?
+            rootClusters[i+1] : FAT_CLUSTER_EOC);
+    }
+    uint32_t idx = 0;
+    for(size_t i=0; i<NUM_ENTRIES; i++) {
+        const Entry *e = &entries[i];
+        if(e->at) {
+            if(e->at < idx) return -EINVAL;
+            while(idx < e->at) entryAt(vol, idx++)[0] = 0xE5; //unused
+        }
+        int next = putEntry(vol, idx, e);
+        if(next < 0) return next;
+        idx = next;
+    }
+    //the end marker (already 0), then an entry that shouldn't be seen.
+    Entry hidden = {NULL, "HIDDEN  TXT", 0, FLAW_NONE, 0, NULL};
+    putEntry(vol, idx + 1, &hidden);
+    *outSectors = (idx / ENTRIES_PER_SECTOR) + 1;
+    return 0;
+}
+
+
+static uint32_t listDir(FsTestDev *dev, fat32_mbr *mbr, uint32_t cluster,
+const char **expect, uint32_t numExpect, uint32_t sectors, int verbose) {
+    //list a directory through the driver, checking the names if given,
+    //and that it reads each sector once.
+    MicronFatDir dir;
+    micronDirent ent;
+    uint32_t problems = 0, count = 0;
+    MicronFatCache *cache = mbr->_micron_fatCache;
+    uint32_t misses = cache->blocks.misses;
+    uint64_t reads = dev->reads;
+    int err = fatOpenDir(mbr, cluster, &dir);
+    while(!err) {
+        err = fatReadDirNext(&dev->file, mbr, &dir, &ent, FSTEST_TIMEOUT);
+        if(err) break;
+        if(!strcmp(ent.name, ".") || !strcmp(ent.name, "..")) continue;
+        if(expect && (count >= numExpect || strcmp(ent.name, expect[count]))) {
+            if(verbose) printf("entry %u is \"%s\", not \"%s\"\n", count,
+                ent.name, count < numExpect ? expect[count] : "(none)");
+            problems++;
+        }
+        count++;
+    }
+    if(err != -ENOENT || count != numExpect) {
+        if(verbose) printf("listing returned %d after %u entries, not %u\n",
+            err, count, numExpect);
+        problems++;
+    }
+    uint64_t dirReads = (dev->reads - reads) - (cache->blocks.misses - misses);
+    if(dirReads != sectors) {
+        if(verbose) printf("listing %u sectors of directory read %llu\n",
+            sectors, (unsigned long long)dirReads);
+        problems++;
+    }
+    return problems;
+}
+
+
+static uint32_t checkNames(int verbose) {
+    //the hand-built root directory.
+    FsTestDev dev;
+    FsTestVol vol;
+    FsTestTree tree;
+    FsckResult result;
+    fat32_mbr mbr;
+    const char *expect[NUM_ENTRIES];
+    uint32_t numExpect = 0, sectors = 0, problems = 0;
+    for(size_t i=0; i<NUM_ENTRIES; i++) {
+        if(entries[i].expect) expect[numExpect++] = entries[i].expect;
+    }
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&tree);
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = volOpen(&dev, START_SECTOR, &vol);
+    if(!err) err = buildRoot(&vol, &sectors);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+    problems += listDir(&dev, &mbr, 0, expect, numExpect, sectors, verbose);
+    fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+
+    //fsck should see the same, and only the leftovers that were put there.
+    problems += fsTestVerify(&dev, START_SECTOR, &tree, &result, verbose);
+    for(uint32_t i=0; i<numExpect; i++) {
+        char path[FSTEST_MAX_PATH];
+        snprintf(path, sizeof(path), "/%s", expect[i]);
+        if(treeFind(&tree, path)) continue;
+        if(verbose) printf("fsck didn't find %s\n", path);
+        problems++;
+    }
+    if(tree.count != numExpect) {
+        if(verbose) printf("fsck found %u entries, not %u\n", tree.count,
+            numExpect);
+        problems++;
+    }
+
+done:
+    treeFree(&tree);
+    devFree(&dev);
+    return problems;
+}
+
+
+static uint32_t checkBig(int verbose) {
+    //a big directory made by the driver.
+    FsTestDev dev;
+    FsTestVol vol;
+    FsTestTree model, tree;
+    FsckResult result;
+    fat32_mbr mbr;
+    micronDirent ent;
+    uint32_t problems = 0;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    treeInit(&tree);
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 2, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(!err) err = fatMkdir(&dev.file, &mbr, "/big", FSTEST_TIMEOUT);
+    if(!err) err = treeSet(&model, "/big", true, NULL, 0);
+    for(uint32_t i=0; i<BIG_FILES && !err; i++) {
+        //names that differ at the start get 8.3 aliases quickly.
+        char path[FSTEST_MAX_PATH];
+        sprintf(path, "/big/%04u Entry with a Long Name.txt", i);
+        err = fsTestAppend(&dev, &mbr, &model, path,
+            (i % 50 == 0) ? 100 : 0, i);
+    }
+    if(!err) err = fatLookupPath(&dev.file, &mbr, "/big", &ent,
+        FSTEST_TIMEOUT);
+    if(!err) err = volOpen(&dev, START_SECTOR, &vol);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    {
+        //every sector of every cluster, except that the last may end early.
+        uint32_t chain[1024];
+        uint32_t clusters = volChain(&vol, ent.cluster, chain, 1024);
+        uint32_t used = (BIG_FILES * 4) + 2; //3 LFN entries each, ".", ".."
+        uint32_t sectors = (used / ENTRIES_PER_SECTOR) + 1;
+        sectors = MIN(sectors, clusters * vol.spc);
+        uint32_t extents = 1;
+        for(uint32_t i=1; i<clusters; i++) {
+            if(chain[i] != chain[i-1] + 1) extents++;
+        }
+        if(extents < 10) {
+            if(verbose) printf("/big is only in %u pieces\n", extents);
+            problems++;
+        }
+        problems += listDir(&dev, &mbr, ent.cluster, NULL, BIG_FILES,
+            sectors, verbose);
+    }
+    fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    problems += fsTestVerify(&dev, START_SECTOR, &tree, &result, verbose);
+    if(treeCompare(&tree, &model, NULL, false, verbose) || result.orphanLfns) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&tree);
+    devFree(&dev);
+    return problems;
+}
+
+
+uint32_t testDirs(int verbose) {
+    /** Check reading directories.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    uint32_t names = checkNames(verbose);
+    printf("  long names and broken entries: %s\n", names ? "FAILED" : "ok");
+    uint32_t big = checkBig(verbose);
+    printf("  %u files in one directory: %s\n", BIG_FILES,
+        big ? "FAILED" : "ok");
+    return (names ? 1 : 0) + (big ? 1 : 0);
+}
@@ -0,0 +1,573 @@
+/** exFAT: the driver against volumes from mkexfat.c, checked by exfsck.c.
+ *  There was no mkfs.exfat to make real images with, so volumes come from
+ *  mkexfat.c, in several layouts: packed and aligned, the bitmap and
+ *  up-case table in either order, behind a volume label entry, a
+ *  compressed and an uncompressed up-case table, and a FAT left full of
+ *  junk where it's unused. On each, a list of operations (making and
+ *  deleting directories, files with long and non-ASCII names, appending
+ *  until a file has to leave its run and use a FAT chain, overwriting,
+ *  growing a file past its valid size and writing there, truncating,
+ *  enough files to extend a directory) is run once to count the sectors it
+ *  writes, then again for each of those writes with the power lost there.
+ *  Each time, exfsck.c must find no errors, the driver must read the same
+ *  files it does, and they must be as before or after the interrupted
+ *  operation. Then the driver must mount the volume, report the free space
+ *  exfsck finds, write another file and leave the volume clean. Finally,
+ *  names must be found whatever their case, using the volume's up-case
+ *  table, including characters beyond the part of it the driver keeps in
+ *  memory.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <drivers/fs/exfat/exfat.h>
+    #include "fstest.h"
+}
+
+#define MAX_OPS 96
+#define START_SECTOR 2048 //where the volume starts, as on an SD card
+#define VOLUME_SECTORS 8192
+
+typedef enum {
+    OP_MKDIR,
+    OP_CREATE,
+    OP_APPEND,    //`size` bytes
+    OP_WRITE,     //overwrite `size` bytes at `offset`
+    OP_TRUNCATE,  //to `size` bytes
+    OP_DELETE,
+} OpType;
+
+typedef struct {
+    OpType   type;
+    char     path[FSTEST_MAX_PATH];
+    uint32_t offset, size;
+    uint32_t seed; //for the data written
+} Op;
+
+typedef struct {
+    const char *name;
+    ExfatFormat format;
+    uint16_t cacheSize; //FAT sectors cached (0 = none)
+} Config;
+
+static const Config configs[] = {
+    {"packed",     {1, 0,   false, false, false, NULL},     2},
+    {"aligned",    {8, 512, true,  false, false, "MICRON"},
+        FAT_DEFAULT_CACHE_SIZE},
+    {"full table", {4, 64,  false, true,  true,  NULL},     0},
+};
+
+#define LONG_NAME "/A Long File Name, Three Name Entries.dat"
+
+//what the volumes went through, to show that the interesting cases came up.
+static uint32_t sawLost, sawExcess, sawOrphans, sawDirty, sawMixed;
+
+
+static int addOp(Op *ops, int n, OpType type, const char *path,
+uint32_t offset, uint32_t size) {
+    ops[n].type   = type;
+    ops[n].offset = offset;
+    ops[n].size   = size;
+    ops[n].seed   = n + 1;
+    strcpy(ops[n].path, path);
+    return n + 1;
+}
+
+static int buildOps(Op *ops) {
+    int n = 0;
+    n = addOp(ops, n, OP_MKDIR,    "/logs", 0, 0);
+    n = addOp(ops, n, OP_CREATE,   "/logs/a.txt", 0, 0);
+    n = addOp(ops, n, OP_APPEND,   "/logs/a.txt", 0, 700);
+    n = addOp(ops, n, OP_APPEND,   "/logs/a.txt", 0, 3000);
+    n = addOp(ops, n, OP_CREATE,   LONG_NAME, 0, 0);
+    n = addOp(ops, n, OP_APPEND,   LONG_NAME, 0, 5120);
+    //the long-named file is right after a.txt now, so this has to go
+    //elsewhere, and a.txt needs a FAT chain.
+    n = addOp(ops, n, OP_APPEND,   "/logs/a.txt", 0, 5000);
+    n = addOp(ops, n, OP_CREATE,   "/Привет мир.txt", 0, 0);
+    n = addOp(ops, n, OP_APPEND,   "/Привет мир.txt", 0, 10);
+    n = addOp(ops, n, OP_CREATE,   "/Ωμέγα.txt", 0, 0);
+    n = addOp(ops, n, OP_CREATE,   "/ｆｕｌｌｗｉｄｔｈ.txt", 0, 0);
+    n = addOp(ops, n, OP_APPEND,   "/ｆｕｌｌｗｉｄｔｈ.txt", 0, 600);
+    n = addOp(ops, n, OP_WRITE,    "/logs/a.txt", 100, 1500);
+    n = addOp(ops, n, OP_TRUNCATE, "/logs/a.txt", 0, 1200);
+    n = addOp(ops, n, OP_TRUNCATE, LONG_NAME, 0, 9000);
+    n = addOp(ops, n, OP_WRITE,    LONG_NAME, 8000, 500);
+    //enough files to need more than a cluster for the directory, even
+    //with 8 sectors per cluster, which has to be chained since the files'
+    //clusters follow it.
+    n = addOp(ops, n, OP_MKDIR,    "/logs/old", 0, 0);
+    //a set of 5 entries first, so that the records' sets of 4 don't all
+    //line up with sectors, and deleting one can leave orphan entries.
+    n = addOp(ops, n, OP_CREATE,
+        "/logs/old/Summary of all the records so far.txt", 0, 0);
+    for(int i=0; i<40; i++) {
+        char path[FSTEST_MAX_PATH];
+        sprintf(path, "/logs/old/Record number %02d.csv", i);
+        n = addOp(ops, n, OP_CREATE, path, 0, 0);
+        if(i % 8 == 0) n = addOp(ops, n, OP_APPEND, path, 0, 100 + i);
+    }
+    n = addOp(ops, n, OP_DELETE,   "/logs/old/Record number 02.csv", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/logs/old/Record number 08.csv", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/logs/a.txt", 0, 0);
+    n = addOp(ops, n, OP_CREATE,   "/logs/b.txt", 0, 0); //reuses a.txt's slot
+    n = addOp(ops, n, OP_APPEND,   "/logs/b.txt", 0, 2000);
+    n = addOp(ops, n, OP_TRUNCATE, "/logs/b.txt", 0, 0);
+    n = addOp(ops, n, OP_MKDIR,    "/tmp", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/tmp", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   LONG_NAME, 0, 0);
+    return n;
+}
+
+
+static int runOp(FsTestDev *dev, exfat_boot *boot, const Op *op) {
+    //do an operation through the driver.
+    FILE *blkdev = &dev->file;
+    if(op->type == OP_MKDIR) return exfatMkdir(blkdev, boot, op->path,
+        FSTEST_TIMEOUT);
+    if(op->type == OP_DELETE) return exfatDelete(blkdev, boot, op->path,
+        FSTEST_TIMEOUT);
+
+    MicronExfatFile file;
+    int err;
+    if(op->type == OP_CREATE) err = exfatCreate(blkdev, boot, op->path, 0,
+        &file, FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    else err = exfatOpenPath(blkdev, boot, op->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(err) return err;
+
+    uint8_t *data = (uint8_t*)malloc(op->size ? op->size : 1);
+    fsTestFill(data, op->size, op->seed);
+    switch(op->type) {
+        case OP_APPEND:
+            err = exfatAppendFile(blkdev, boot, &file, data, op->size,
+                FSTEST_TIMEOUT);
+            if(err >= 0) err = (err == (int)op->size) ? 0 : -EIO;
+            break;
+        case OP_WRITE:
+            err = exfatWriteFile(blkdev, boot, &file, op->offset, op->size,
+                data, FSTEST_TIMEOUT);
+            if(err >= 0) err = (err == (int)op->size) ? 0 : -EIO;
+            break;
+        case OP_TRUNCATE:
+            err = exfatTruncateFile(blkdev, boot, &file, op->size,
+                FSTEST_TIMEOUT);
+            break;
+        default: break;
+    }
+    free(data);
+    exfatCloseFile(&file);
+    return err;
+}
+
+static void modelOp(FsTestTree *tree, const Op *op) {
+    //do the same operation to the model of what the volume should contain.
+    if(op->type == OP_MKDIR) {
+        treeSet(tree, op->path, true, NULL, 0);
+        return;
+    }
+    if(op->type == OP_CREATE) {
+        treeSet(tree, op->path, false, NULL, 0);
+        return;
+    }
+    if(op->type == OP_DELETE) {
+        treeRemove(tree, op->path);
+        return;
+    }
+
+    FsTestNode *node = treeFind(tree, op->path);
+    uint32_t size = node->size;
+    if(op->type == OP_APPEND) size += op->size;
+    if(op->type == OP_TRUNCATE) size = op->size;
+    uint8_t *data = (uint8_t*)calloc(size ? size : 1, 1);
+    memcpy(data, node->data, MIN(size, node->size));
+    if(op->type == OP_APPEND) fsTestFill(&data[node->size], op->size,
+        op->seed);
+    if(op->type == OP_WRITE) fsTestFill(&data[op->offset], op->size,
+        op->seed);
+    treeSet(tree, op->path, false, data, size);
+    free(data);
+}
+
+
+static int listDir(FsTestDev *dev, exfat_boot *boot,
+const MicronExfatDirent *parent, const char *path, FsTestTree *tree,
+int depth) {
+    //read a directory and everything in it through the driver.
+    MicronExfatDir *dir = (MicronExfatDir*)malloc(sizeof(MicronExfatDir));
+    MicronExfatDirent *ent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    int err = (dir && ent) ? 0 : -ENOMEM;
+    if(!err) err = exfatOpenDir(boot, parent, dir);
+    while(!err) {
+        err = exfatReadDirNext(&dev->file, boot, dir, ent, FSTEST_TIMEOUT);
+        if(err) break;
+        char sub[FSTEST_MAX_PATH];
+        if(snprintf(sub, sizeof(sub), "%s/%s", path, ent->name)
+        >= (int)sizeof(sub)) {
+            err = -ENAMETOOLONG;
+            break;
+        }
+        if(ent->attributes & FAT_ATTR_DIRECTORY) {
+            err = treeSet(tree, sub, true, NULL, 0);
+            if(!err && depth >= 32) err = -ELOOP;
+            if(!err) err = listDir(dev, boot, ent, sub, tree, depth + 1);
+            continue;
+        }
+
+        MicronExfatFile file;
+        uint8_t *data = (uint8_t*)malloc(ent->size ? ent->size : 1);
+        if(!data) err = -ENOMEM;
+        if(!err) err = exfatOpenFile(boot, ent, &file,
+            FAT_DEFAULT_MAX_EXTENTS);
+        if(!err) {
+            err = exfatReadFile(&dev->file, boot, &file, 0, ent->size, data,
+                FSTEST_TIMEOUT);
+            if(err >= 0 && (uint64_t)err != ent->size) err = -EIO;
+            if(err >= 0) err = treeSet(tree, sub, false, data, ent->size);
+            exfatCloseFile(&file);
+        }
+        if(data) free(data);
+    }
+    if(dir) free(dir);
+    if(ent) free(ent);
+    return (err == -ENOENT) ? 0 : err;
+}
+
+static uint32_t verify(FsTestDev *dev, FsTestTree *outTree,
+FsckResult *outResult, int verbose) {
+    //check the volume with exfsck, then read everything through the
+    //driver, which must find the same. as fsTestVerify().
+    int err = fsckExfat(dev, START_SECTOR, outResult, outTree, verbose);
+    if(err) return 1;
+    if(outResult->errors) return outResult->errors;
+
+    exfat_boot boot;
+    FsTestTree listed;
+    treeInit(&listed);
+    uint32_t problems = 0;
+    err = exfatMount(&dev->file, START_SECTOR, &boot, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    if(!err) {
+        err = listDir(dev, &boot, NULL, "", &listed, 0);
+        int err2 = exfatUnmount(&dev->file, &boot, FSTEST_TIMEOUT);
+        if(!err) err = err2;
+    }
+    if(err) {
+        if(verbose) printf("driver couldn't read the volume: %d\n", err);
+        problems++;
+    }
+    else if(treeCompare(&listed, outTree, NULL, false, verbose)) {
+        if(verbose) printf("driver and exfsck see different files\n");
+        problems++;
+    }
+    treeFree(&listed);
+    return problems;
+}
+
+
+static int runOps(FsTestDev *dev, const Config *cfg, const Op *ops,
+int numOps, uint64_t cutAfter, int verbose) {
+    //mount the volume and run the operations, with power lost after
+    //`cutAfter` sector writes. returns the index of the operation it was
+    //lost during (numOps if during unmount, or if it wasn't), or negative
+    //error code if the driver failed for some other reason.
+    exfat_boot boot;
+    devPower(dev, cutAfter);
+    int err = exfatMount(&dev->file, START_SECTOR, &boot, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) return err; //mounting doesn't write
+
+    int i;
+    for(i=0; i<numOps; i++) {
+        err = runOp(dev, &boot, &ops[i]);
+        if(dev->cut) break;
+        if(err) break;
+    }
+    int err2 = exfatUnmount(&dev->file, &boot, FSTEST_TIMEOUT);
+    if(dev->cut) return i;
+    if(err) {
+        if(verbose) printf("%s failed: %d\n", ops[i].path, err);
+        return err;
+    }
+    return err2 ? err2 : numOps;
+}
+
+
+static uint32_t recover(FsTestDev *dev, const Config *cfg,
+const FsTestTree *found, const FsckResult *before, int verbose) {
+    //after power loss, the driver must see the free space exfsck does, be
+    //able to carry on using the volume, and leave it clean.
+    exfat_boot boot;
+    uint32_t problems = 0;
+    int err = exfatMount(&dev->file, START_SECTOR, &boot, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("remount failed: %d\n", err);
+        return 1;
+    }
+    int64_t expect = (int64_t)before->freeClusters * exfatClusterSize(&boot);
+    if(exfatGetFreeSpace(&boot) != expect) {
+        if(verbose) printf("driver says %" PRId64 " bytes are free, not %"
+            PRId64 "\n", exfatGetFreeSpace(&boot), expect);
+        problems++;
+    }
+
+    MicronExfatFile file;
+    uint8_t data[1000];
+    fsTestFill(data, sizeof(data), 999);
+    err = exfatCreate(&dev->file, &boot, "/after.txt", 0, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!err) {
+        err = exfatAppendFile(&dev->file, &boot, &file, data, sizeof(data),
+            FSTEST_TIMEOUT);
+        if(err >= 0) err = (err == sizeof(data)) ? 0 : -EIO;
+        exfatCloseFile(&file);
+    }
+    int err2 = exfatUnmount(&dev->file, &boot, FSTEST_TIMEOUT);
+    if(!err) err = err2;
+    if(err) {
+        if(verbose) printf("using the volume after power loss failed: %d\n",
+            err);
+        return problems + 1;
+    }
+
+    FsTestTree expected, after;
+    treeInit(&expected);
+    treeInit(&after);
+    treeCopy(&expected, found);
+    treeSet(&expected, "/after.txt", false, data, sizeof(data));
+    FsckResult result;
+    problems += verify(dev, &after, &result, verbose);
+    if(treeCompare(&after, &expected, NULL, false, verbose)) {
+        if(verbose) printf("files changed after power loss\n");
+        problems++;
+    }
+    if(result.dirty) {
+        if(verbose) printf("volume left dirty\n");
+        problems++;
+    }
+    treeFree(&expected);
+    treeFree(&after);
+    return problems;
+}
+
+
+static uint32_t checkCut(FsTestDev *dev, const Config *cfg, const Op *ops,
+int numOps, const FsTestTree *models, int opIdx, int verbose) {
+    //check the volume after power was lost during ops[opIdx].
+    devPower(dev, FSTEST_NEVER);
+    FsTestTree found;
+    treeInit(&found);
+    FsckResult result;
+    uint32_t problems = verify(dev, &found, &result, verbose);
+
+    //it's as it was before the operation, or after it.
+    const FsTestTree *after = (opIdx < numOps) ? &models[opIdx + 1] : NULL;
+    bool mix = (opIdx < numOps) && ops[opIdx].type == OP_WRITE;
+    if(treeCompare(&found, &models[opIdx], after, mix, verbose)) {
+        if(verbose) printf("files aren't as before or after the operation\n");
+        problems++;
+    }
+    else if(mix && treeCompare(&found, &models[opIdx], after, false, 0)) {
+        sawMixed++;
+    }
+
+    if(result.lostClusters)   sawLost++;
+    if(result.excessClusters) sawExcess++;
+    if(result.orphanLfns)     sawOrphans++;
+    if(result.dirty)          sawDirty++;
+    if(!problems) problems += recover(dev, cfg, &found, &result, verbose);
+    treeFree(&found);
+    return problems;
+}
+
+
+static uint32_t checkFresh(FsTestDev *dev, const Config *cfg) {
+    //a new volume must pass exfsck, and mounting and unmounting it must
+    //see all but the system clusters free, and write nothing.
+    FsckResult result;
+    uint32_t failures = 0;
+    if(fsckExfat(dev, START_SECTOR, &result, NULL, 1) || result.errors
+    || result.lostClusters || result.dirty) {
+        printf("  %s: new volume isn't right\n", cfg->name);
+        return 1;
+    }
+    exfat_boot boot;
+    dev->writes = 0;
+    int err = exfatMount(&dev->file, START_SECTOR, &boot, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) {
+        printf("  %s: mount failed: %d\n", cfg->name, err);
+        return 1;
+    }
+    int64_t expect = (int64_t)result.freeClusters * exfatClusterSize(&boot);
+    if(exfatGetFreeSpace(&boot) != expect) {
+        printf("  %s: driver says %" PRId64 " bytes are free, not %" PRId64
+            "\n", cfg->name, exfatGetFreeSpace(&boot), expect);
+        failures++;
+    }
+    exfatUnmount(&dev->file, &boot, FSTEST_TIMEOUT);
+    if(dev->writes) {
+        printf("  %s: mounting wrote %" PRIu64 " sectors\n", cfg->name,
+            dev->writes);
+        failures++;
+    }
+    return failures;
+}
+
+
+static uint32_t checkNames(FsTestDev *dev, const Config *cfg,
+const FsTestTree *model) {
+    //every name must be found in any case, with the volume's up-case
+    //table, and can't be used again in another case.
+    static const struct {
+        const char *path, *is;
+    } names[] = {
+        {"/LOGS/OLD/record NUMBER 00.CSV", "/logs/old/Record number 00.csv"},
+        {"/ПРИВЕТ МИР.TXT",         "/Привет мир.txt"},
+        {"/привет МИР.txt",         "/Привет мир.txt"},
+        {"/ΩΜΈΓΑ.TXT",              "/Ωμέγα.txt"},
+        {"/ＦＵＬＬＷＩＤＴＨ.TXT", "/ｆｕｌｌｗｉｄｔｈ.txt"},
+        {"/fullwidth.txt",          NULL}, //not the same letters
+        {"/ΩΜΕΓΑ.TXT",              NULL}, //no accent
+    };
+    exfat_boot boot;
+    int err = exfatMount(&dev->file, START_SECTOR, &boot, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) {
+        printf("  %s: mount failed: %d\n", cfg->name, err);
+        return 1;
+    }
+    uint32_t failures = 0;
+    MicronExfatDirent *ent = (MicronExfatDirent*)malloc(
+        sizeof(MicronExfatDirent));
+    for(size_t i=0; i<sizeof(names) / sizeof(names[0]); i++) {
+        err = exfatLookupPath(&dev->file, &boot, names[i].path, ent,
+            FSTEST_TIMEOUT);
+        const char *want = names[i].is ? strrchr(names[i].is, '/') + 1 :
+            NULL;
+        const FsTestNode *node = names[i].is ? treeFind(model, names[i].is) :
+            NULL;
+        if(want ? (err || strcmp(ent->name, want) || !node
+        || ent->size != node->size) : err != -ENOENT) {
+            printf("  %s: looking up %s gave %d (%s)\n", cfg->name,
+                names[i].path, err, err ? "-" : ent->name);
+            failures++;
+        }
+        if(!want) continue;
+
+        MicronExfatFile file;
+        err = exfatCreate(&dev->file, &boot, names[i].path, 0, &file, 0,
+            FSTEST_TIMEOUT);
+        if(err != -EEXIST) {
+            printf("  %s: creating %s gave %d, not -EEXIST\n", cfg->name,
+                names[i].path, err);
+            if(!err) exfatCloseFile(&file);
+            failures++;
+        }
+    }
+    free(ent);
+    exfatUnmount(&dev->file, &boot, FSTEST_TIMEOUT);
+
+    //and none of that changed anything.
+    FsTestTree found;
+    FsckResult result;
+    treeInit(&found);
+    if(verify(dev, &found, &result, 1)
+    || treeCompare(&found, model, NULL, false, 1) || result.lostClusters) {
+        printf("  %s: looking up names changed the volume\n", cfg->name);
+        failures++;
+    }
+    treeFree(&found);
+    return failures;
+}
+
+
+static uint32_t testConfig(const Config *cfg, int verbose) {
+    Op *ops = (Op*)malloc(MAX_OPS * sizeof(Op));
+    int numOps = buildOps(ops);
+    FsTestTree *models = (FsTestTree*)malloc((numOps + 1) *
+        sizeof(FsTestTree));
+    treeInit(&models[0]);
+    for(int i=0; i<numOps; i++) {
+        treeInit(&models[i+1]);
+        treeCopy(&models[i+1], &models[i]);
+        modelOp(&models[i+1], &ops[i]);
+    }
+
+    FsTestDev dev;
+    devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0);
+    uint32_t failures = 0;
+    if(mkfsExfat(&dev, START_SECTOR, VOLUME_SECTORS, &cfg->format)) {
+        printf("  %s: can't format\n", cfg->name);
+        failures++;
+    }
+    else failures += checkFresh(&dev, cfg);
+    size_t size = (size_t)dev.numSectors * FSTEST_SECTOR_SIZE;
+    uint8_t *pristine = (uint8_t*)malloc(size);
+    memcpy(pristine, dev.data, size);
+
+    //without power loss, to count the writes, and make sure it all works,
+    //leaving nothing behind.
+    uint64_t numWrites = 0;
+    if(!failures) {
+        dev.writes = 0;
+        int done = runOps(&dev, cfg, ops, numOps, FSTEST_NEVER, verbose);
+        numWrites = dev.writes;
+        FsTestTree found;
+        FsckResult result;
+        treeInit(&found);
+        if(done != numOps) {
+            printf("  %s: failed without power loss\n", cfg->name);
+            failures++;
+        }
+        else if(verify(&dev, &found, &result, verbose)
+        || treeCompare(&found, &models[numOps], NULL, false, verbose)
+        || result.lostClusters || result.excessClusters || result.orphanLfns
+        || result.dirty) {
+            printf("  %s: wrong without power loss: %u lost clusters, %u "
+                "excess, %u orphan entries, %s\n", cfg->name,
+                result.lostClusters, result.excessClusters,
+                result.orphanLfns, result.dirty ? "dirty" : "clean");
+            failures++;
+        }
+        else failures += checkNames(&dev, cfg, &models[numOps]);
+        treeFree(&found);
+    }
+
+    sawLost = sawExcess = sawOrphans = sawDirty = sawMixed = 0;
+    for(uint64_t cut=0; cut<numWrites && !failures; cut++) {
+        memcpy(dev.data, pristine, size);
+        dev.writes = 0;
+        int opIdx = runOps(&dev, cfg, ops, numOps, cut, verbose);
+        uint32_t problems = (opIdx < 0) ? 1 :
+            checkCut(&dev, cfg, ops, numOps, models, opIdx, verbose);
+        if(problems) {
+            printf("  %s: power lost at write %" PRIu64 " (during op %d, "
+                "%s): %u problems\n", cfg->name, cut, opIdx,
+                (opIdx >= 0 && opIdx < numOps) ? ops[opIdx].path : "-",
+                problems);
+            failures++;
+        }
+    }
+    printf("  %s: %d ops, %" PRIu64 " writes, each cut: %u lost clusters, "
+        "%u excess, %u orphan entries, %u dirty, %u mixed writes\n",
+        cfg->name, numOps, numWrites, sawLost, sawExcess, sawOrphans,
+        sawDirty, sawMixed);
+
+    free(pristine);
+    devFree(&dev);
+    for(int i=0; i<=numOps; i++) treeFree(&models[i]);
+    free(models);
+    free(ops);
+    return failures;
+}
+
+
+uint32_t testExfat(int verbose) {
+    uint32_t failures = 0;
+    for(size_t i=0; i<sizeof(configs) / sizeof(configs[0]); i++) {
+        failures += testConfig(&configs[i], verbose);
+    }
+    return failures;
+}
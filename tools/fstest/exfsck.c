@@ -0,0 +1,656 @@
+/** Checks an exFAT volume, independently of the driver.
+ *  Like fsck.c, everything is read straight from the device's memory and
+ *  parsed the way the exFAT specification describes it, without the
+ *  driver's structures or functions. Names are up-cased with the table on
+ *  the volume, decompressed here, to check their hashes and find
+ *  duplicates.
+ *  Problems that would lose or corrupt data count as errors, including a
+ *  cluster that's in use but free in the allocation bitmap. Leftovers that
+ *  an interrupted operation is allowed to leave are only counted: clusters
+ *  marked as used that nothing refers to (lostClusters), a FAT chain longer
+ *  than its file (excessClusters), and secondary entries whose file entry
+ *  is gone (orphanLfns).
+ */
+extern "C" {
+    #include <micron.h>
+    #include <stdarg.h>
+    #include "fstest.h"
+}
+
+#define ENTRY_SIZE   32
+#define BOOT_SECTORS 12
+#define MAX_DEPTH    32
+#define MAX_SET      19  //file, stream and 17 name entries
+#define MAX_NAME     255 //in UTF-16 characters
+#define FAT_BAD      0xFFFFFFF7
+#define FAT_EOC      0xFFFFFFFF
+#define FLAG_ALLOC_POSSIBLE 0x01
+#define FLAG_NO_FAT_CHAIN   0x02
+#define ATTR_DIRECTORY      0x10
+
+typedef struct {
+    FsTestDev  *dev;
+    FsckResult *out;
+    FsTestTree *tree;
+    int         verbose;
+    uint32_t    spc;          //sectors per cluster
+    uint32_t    clusterSize;
+    uint32_t    numClusters;
+    uint64_t    fatStart;
+    uint64_t    heapStart;    //first sector of cluster 2
+    uint32_t   *owner;        //first cluster of the file each one is in
+    uint16_t   *upcase;       //the up-case table, for every character
+    bool        sawBitmap, sawUpcase;
+    uint32_t    bitmapCluster, bitmapSize;
+} Exfsck;
+
+typedef struct {
+    //up-cased names already seen in a directory, to find duplicates.
+    uint16_t (*names)[MAX_NAME + 1]; //[0] is the length
+    uint32_t count, capacity;
+} NameList;
+
+
+static uint16_t _get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t _get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _get64(const uint8_t *p) {
+    return _get32(p) | ((uint64_t)_get32(&p[4]) << 32);
+}
+
+static uint8_t* _sector(Exfsck *ck, uint64_t sector) {
+    return &ck->dev->data[sector * FSTEST_SECTOR_SIZE];
+}
+
+static uint8_t* _cluster(Exfsck *ck, uint32_t cluster) {
+    return _sector(ck, ck->heapStart + ((uint64_t)(cluster - 2) * ck->spc));
+}
+
+static uint32_t _fat(Exfsck *ck, uint32_t cluster) {
+    return _get32(_sector(ck, ck->fatStart) + ((uint64_t)cluster * 4));
+}
+
+static void _error(Exfsck *ck, const char *fmt, ...) {
+    ck->out->errors++;
+    if(!ck->verbose) return;
+    va_list args;
+    va_start(args, fmt);
+    printf("exfsck: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+static uint32_t _checksum32(uint32_t sum, const uint8_t *data, uint32_t len,
+bool boot) {
+    for(uint32_t i=0; i<len; i++) {
+        if(boot && (i == 106 || i == 107 || i == 112)) continue;
+        sum = ((sum & 1) ? 0x80000000UL : 0) + (sum >> 1) + data[i];
+    }
+    return sum;
+}
+
+
+/* -------------------------------- Clusters ------------------------------ */
+
+static uint32_t _clusters(Exfsck *ck, const char *path, uint32_t first,
+uint8_t flags, uint64_t size, uint32_t **outList) {
+    //find and claim a file's clusters: `size` bytes' worth in a row if it
+    //has no FAT chain, or else its whole chain. returns how many there are,
+    //up to where they go wrong; `outList` receives them, to be freed by
+    //the caller.
+    uint32_t need = (size + ck->clusterSize - 1) / ck->clusterSize;
+    uint32_t *list = (uint32_t*)malloc((ck->numClusters + 1) *
+        sizeof(uint32_t));
+    uint32_t count = 0, cluster = first;
+    while(1) {
+        if(flags & FLAG_NO_FAT_CHAIN) {
+            if(count == need) break;
+            cluster = first + count;
+        }
+        if(cluster < 2 || cluster >= ck->numClusters + 2) {
+            _error(ck, "%s: cluster %u out of range", path, cluster);
+            break;
+        }
+        if(ck->owner[cluster]) {
+            _error(ck, "%s: cluster %u is also in the file at %u", path,
+                cluster, ck->owner[cluster]);
+            break;
+        }
+        ck->owner[cluster] = first;
+        list[count++] = cluster;
+        if(flags & FLAG_NO_FAT_CHAIN) continue;
+
+        uint32_t next = _fat(ck, cluster);
+        if(next == FAT_EOC) break;
+        if(next == FAT_BAD) {
+            _error(ck, "%s: chain runs into bad cluster %u", path, cluster);
+            break;
+        }
+        cluster = next;
+    }
+    *outList = list;
+    return count;
+}
+
+
+/* --------------------------------- Names -------------------------------- */
+
+static bool _validChar(uint16_t c) {
+    return c >= 0x20 && !(c < 0x80 && strchr("\"*/:<>?\\|", c));
+}
+
+static uint16_t _nameHash(const uint16_t *upper, int len) {
+    uint16_t hash = 0;
+    for(int i=0; i<len; i++) {
+        for(int b=0; b<2; b++) {
+            uint8_t byte = b ? (upper[i] >> 8) : (upper[i] & 0xFF);
+            hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + byte;
+        }
+    }
+    return hash;
+}
+
+static void _utf16ToUtf8(const uint16_t *in, int len, char *out) {
+    int pos = 0;
+    for(int i=0; i<len; i++) {
+        uint32_t c = in[i];
+        if(c >= 0xD800 && c <= 0xDBFF && i+1 < len
+        && in[i+1] >= 0xDC00 && in[i+1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+        }
+        if(c < 0x80) out[pos++] = c;
+        else if(c < 0x800) {
+            out[pos++] = 0xC0 | (c >> 6);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+        else if(c < 0x10000) {
+            out[pos++] = 0xE0 | (c >> 12);
+            out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+        else {
+            out[pos++] = 0xF0 | (c >> 18);
+            out[pos++] = 0x80 | ((c >> 12) & 0x3F);
+            out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[pos] = '\0';
+}
+
+static bool _addName(NameList *names, const uint16_t *upper, int len) {
+    //remember an up-cased name. returns false if it's already used.
+    for(uint32_t i=0; i<names->count; i++) {
+        if(names->names[i][0] == len
+        && !memcmp(&names->names[i][1], upper, len * 2)) return false;
+    }
+    if(names->count == names->capacity) {
+        names->capacity = names->capacity ? names->capacity * 2 : 16;
+        names->names = (uint16_t(*)[MAX_NAME + 1])realloc(names->names,
+            names->capacity * sizeof(names->names[0]));
+    }
+    names->names[names->count][0] = len;
+    memcpy(&names->names[names->count][1], upper, len * 2);
+    names->count++;
+    return true;
+}
+
+
+/* ------------------------------ System files ---------------------------- */
+
+static void _loadUpcase(Exfsck *ck, const uint8_t *ent) {
+    //check the up-case table's checksum, and decompress it: 0xFFFF
+    //followed by N means the next N characters map to themselves.
+    uint32_t first = _get32(&ent[20]);
+    uint64_t size  = _get64(&ent[24]);
+    uint32_t *list;
+    uint32_t count = _clusters(ck, "up-case table", first, 0, size, &list);
+    if((uint64_t)count * ck->clusterSize < size || size < 2 || (size & 1)
+    || size > 0x20000 + 4) {
+        _error(ck, "up-case table of %" PRIu64 " bytes in %u clusters",
+            size, count);
+        free(list);
+        return;
+    }
+    uint8_t *table = (uint8_t*)malloc(size);
+    for(uint32_t i=0; i<count && (uint64_t)i * ck->clusterSize < size; i++) {
+        memcpy(&table[i * ck->clusterSize], _cluster(ck, list[i]),
+            MIN((uint64_t)ck->clusterSize, size - (i * ck->clusterSize)));
+    }
+    free(list);
+    if(_checksum32(0, table, size, false) != _get32(&ent[4])) {
+        _error(ck, "up-case table checksum is wrong");
+    }
+
+    uint32_t c = 0;
+    for(uint32_t i=0; i<size && c < 0x10000; i += 2) {
+        uint16_t val = _get16(&table[i]);
+        if(val == 0xFFFF && i + 2 < size) {
+            uint32_t run = _get16(&table[i + 2]);
+            for(uint32_t j=0; j<run && c < 0x10000; j++, c++) {
+                ck->upcase[c] = c;
+            }
+            i += 2;
+        }
+        else ck->upcase[c++] = val;
+    }
+    free(table);
+    for(; c<0x10000; c++) ck->upcase[c] = c;
+    ck->sawUpcase = true;
+}
+
+static void _loadBitmap(Exfsck *ck, const uint8_t *ent) {
+    ck->bitmapCluster = _get32(&ent[20]);
+    uint64_t size = _get64(&ent[24]);
+    uint32_t *list;
+    uint32_t count = _clusters(ck, "allocation bitmap", ck->bitmapCluster, 0,
+        size, &list);
+    if(size < (ck->numClusters + 7) / 8
+    || (uint64_t)count * ck->clusterSize < size) {
+        _error(ck, "allocation bitmap of %" PRIu64 " bytes in %u clusters "
+            "for %u clusters", size, count, ck->numClusters);
+    }
+    //we read it by sector number, so check that it's in a row.
+    for(uint32_t i=1; i<count; i++) {
+        if(list[i] != list[0] + i) {
+            _error(ck, "allocation bitmap isn't contiguous");
+            break;
+        }
+    }
+    free(list);
+    ck->bitmapSize = size;
+    ck->sawBitmap = true;
+}
+
+
+/* ------------------------------ Directories ----------------------------- */
+
+static void _checkDir(Exfsck *ck, const char *path, uint32_t cluster,
+uint8_t flags, uint64_t size, int depth);
+
+static void _checkData(Exfsck *ck, const char *path, const uint8_t *stream,
+bool isDir, int depth) {
+    //check a file's or directory's clusters, and read its contents.
+    uint8_t  flags     = stream[1];
+    uint64_t validSize = _get64(&stream[8]);
+    uint32_t first     = _get32(&stream[20]);
+    uint64_t size      = _get64(&stream[24]);
+
+    if(validSize > size) {
+        _error(ck, "%s: valid size %" PRIu64 " is beyond its size %" PRIu64,
+            path, validSize, size);
+    }
+    if(!first) {
+        if(size) _error(ck, "%s: %" PRIu64 " bytes but no clusters", path,
+            size);
+        if(isDir) _error(ck, "%s: directory without a cluster", path);
+        if(ck->tree && !isDir) treeSet(ck->tree, path, false, NULL, 0);
+        if(!isDir) ck->out->numFiles++;
+        return;
+    }
+    if(!(flags & FLAG_ALLOC_POSSIBLE)) {
+        _error(ck, "%s: has clusters, but AllocationPossible is clear", path);
+    }
+    if(!size) {
+        //nothing would ever free it.
+        _error(ck, "%s: cluster %u, but no size", path, first);
+        return;
+    }
+    if(isDir) {
+        if(size % ck->clusterSize || validSize != size) {
+            _error(ck, "%s: directory of %" PRIu64 " bytes (%" PRIu64
+                " valid)", path, size, validSize);
+        }
+        if(depth >= MAX_DEPTH) _error(ck, "%s: too deep", path);
+        else _checkDir(ck, path, first, flags, size, depth + 1);
+        return;
+    }
+
+    uint32_t *list;
+    uint32_t count = _clusters(ck, path, first, flags, size, &list);
+    uint32_t need = (size + ck->clusterSize - 1) / ck->clusterSize;
+    if(count < need) {
+        _error(ck, "%s: %u clusters, but %" PRIu64 " bytes needs %u", path,
+            count, size, need);
+    }
+    else ck->out->excessClusters += count - need;
+    if(size > UINT32_MAX) _error(ck, "%s: too big for fstest", path);
+    else if(ck->tree && count >= need) {
+        //beyond the valid size, it reads as zeros.
+        uint8_t *data = (uint8_t*)calloc(size, 1);
+        uint64_t valid = MIN(validSize, size);
+        for(uint32_t i=0; (uint64_t)i * ck->clusterSize < valid; i++) {
+            memcpy(&data[(uint64_t)i * ck->clusterSize],
+                _cluster(ck, list[i]), MIN((uint64_t)ck->clusterSize,
+                valid - ((uint64_t)i * ck->clusterSize)));
+        }
+        treeSet(ck->tree, path, false, data, size);
+        free(data);
+    }
+    free(list);
+    ck->out->numFiles++;
+}
+
+static void _checkSet(Exfsck *ck, const char *dirPath, NameList *names,
+const uint8_t *set, int count, int depth) {
+    //check a file's entry set: its file entry, stream extension and names.
+    //the set's checksum is 16 bits, and skips its own field.
+    uint16_t sum = 0;
+    for(int i=0; i < count * ENTRY_SIZE; i++) {
+        if(i == 2 || i == 3) continue;
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i];
+    }
+    if(sum != _get16(&set[2])) {
+        _error(ck, "%s: entry set with a wrong checksum", dirPath);
+        return;
+    }
+    const uint8_t *stream = &set[ENTRY_SIZE];
+    if(stream[0] != 0xC0) {
+        _error(ck, "%s: file entry without a stream extension", dirPath);
+        return;
+    }
+    int len = stream[3];
+    if(!len || count < 2 + ((len + 14) / 15)) {
+        _error(ck, "%s: name of %d characters in a set of %d entries",
+            dirPath, len, count);
+        return;
+    }
+
+    uint16_t name[MAX_NAME], upper[MAX_NAME];
+    bool valid = true;
+    for(int i=0; i<len; i++) {
+        const uint8_t *ent = &set[(2 + (i / 15)) * ENTRY_SIZE];
+        if(ent[0] != 0xC1) valid = false;
+        name[i] = _get16(&ent[2 + ((i % 15) * 2)]);
+        if(!_validChar(name[i])) valid = false;
+        upper[i] = ck->upcase[name[i]];
+    }
+    for(int i=2 + ((len + 14) / 15); i<count; i++) {
+        //anything else has to be a benign secondary entry, which we can
+        //ignore.
+        if(set[i * ENTRY_SIZE] < 0xE0) valid = false;
+    }
+    char utf8[(MAX_NAME * 3) + 1];
+    _utf16ToUtf8(name, len, utf8);
+    char path[FSTEST_MAX_PATH];
+    if(snprintf(path, sizeof(path), "%s/%s", depth ? dirPath : "", utf8)
+    >= (int)sizeof(path)) {
+        _error(ck, "%s/%s: path too long for fstest", dirPath, utf8);
+        return;
+    }
+    if(!valid) {
+        _error(ck, "%s: invalid name entries", path);
+        return;
+    }
+    if(_nameHash(upper, len) != _get16(&stream[4])) {
+        _error(ck, "%s: name hash 0x%04X, should be 0x%04X", path,
+            _get16(&stream[4]), _nameHash(upper, len));
+    }
+    if(!_addName(names, upper, len)) _error(ck, "%s: duplicate name", path);
+
+    bool isDir = _get16(&set[4]) & ATTR_DIRECTORY;
+    if(isDir) {
+        ck->out->numDirs++;
+        if(ck->tree) treeSet(ck->tree, path, true, NULL, 0);
+    }
+    _checkData(ck, path, stream, isDir, depth);
+}
+
+static void _checkDir(Exfsck *ck, const char *path, uint32_t cluster,
+uint8_t flags, uint64_t size, int depth) {
+    uint32_t *list;
+    uint32_t count = _clusters(ck, path, cluster, flags, size, &list);
+    bool isRoot = (depth == 0);
+    if(!isRoot) {
+        //only its size counts; a longer chain is left over from extending
+        //it.
+        uint32_t need = size / ck->clusterSize;
+        if(count < need) _error(ck, "%s: %u clusters for %" PRIu64
+            " bytes", path, count, size);
+        else {
+            ck->out->excessClusters += count - need;
+            count = need;
+        }
+    }
+
+    NameList names;
+    memset(&names, 0, sizeof(names));
+    uint32_t perCluster = ck->clusterSize / ENTRY_SIZE;
+    uint32_t num = count * perCluster;
+    uint8_t set[MAX_SET * ENTRY_SIZE];
+    for(uint32_t i=0; i<num; i++) {
+        const uint8_t *ent = _cluster(ck, list[i / perCluster]) +
+            ((i % perCluster) * ENTRY_SIZE);
+        uint8_t type = ent[0];
+        if(type == 0x00) break; //end of directory
+        if(!(type & 0x80)) continue; //unused
+        if(type >= 0xC0) { //secondary entry, without its primary
+            ck->out->orphanLfns++;
+            continue;
+        }
+        if(type == 0x81 || type == 0x82 || type == 0x83 || type == 0xA0) {
+            //found by fsckExfat(), and only allowed in the root.
+            if(!isRoot) {
+                _error(ck, "%s: entry of type 0x%02X in a subdirectory",
+                    path, type);
+            }
+            continue;
+        }
+        if(type != 0x85) {
+            //benign primary entries can be skipped; critical ones can't.
+            if(type < 0xA0) _error(ck, "%s: unknown entry type 0x%02X",
+                path, type);
+            continue;
+        }
+
+        //a file: gather its set, which must all be there.
+        int setCount = ent[1] + 1;
+        if(setCount < 3 || setCount > MAX_SET || i + setCount > num) {
+            _error(ck, "%s: file entry with %d secondary entries", path,
+                ent[1]);
+            continue;
+        }
+        bool complete = true;
+        for(int j=0; j<setCount; j++) {
+            const uint8_t *e = _cluster(ck, list[(i + j) / perCluster]) +
+                (((i + j) % perCluster) * ENTRY_SIZE);
+            if(j && (e[0] & 0xC0) != 0xC0) complete = false;
+            memcpy(&set[j * ENTRY_SIZE], e, ENTRY_SIZE);
+        }
+        if(!complete) {
+            _error(ck, "%s: file entry without all its secondary entries",
+                path);
+            continue;
+        }
+        _checkSet(ck, path, &names, set, setCount, depth);
+        i += setCount - 1;
+    }
+    if(names.names) free(names.names);
+    free(list);
+}
+
+
+/* ---------------------------------- API --------------------------------- */
+
+int fsckExfat(FsTestDev *dev, uint64_t start, FsckResult *out,
+FsTestTree *tree, int verbose) {
+    /** Check an exFAT volume.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param out Receives what was found. fsInfoFree and fsInfoNext are
+     *   0xFFFFFFFF, since exFAT has no FSInfo; `dirty` is whether the
+     *   volume is marked as not cleanly unmounted.
+     *  @param tree If not NULL, receives the files and directories found.
+     *   It should be empty.
+     *  @param verbose Whether to print each problem (2 for a summary too).
+     *  @return 0 if the volume was checked (even if there are errors), or
+     *   negative error code if it couldn't be, eg -EILSEQ if it's not
+     *   exFAT.
+     */
+    memset(out, 0, sizeof(FsckResult));
+    out->fsInfoFree = out->fsInfoNext = 0xFFFFFFFF;
+    if(start + (2 * BOOT_SECTORS) > dev->numSectors) return -ERANGE;
+    const uint8_t *boot = &dev->data[start * FSTEST_SECTOR_SIZE];
+    uint64_t length     = _get64(&boot[72]);
+    uint32_t fatOffset  = _get32(&boot[80]);
+    uint32_t fatLength  = _get32(&boot[84]);
+    uint32_t heapOffset = _get32(&boot[88]);
+    uint32_t clusters   = _get32(&boot[92]);
+    uint32_t root       = _get32(&boot[96]);
+    uint32_t shift      = boot[109];
+    if(memcmp(&boot[3], "EXFAT   ", 8) || boot[510] != 0x55
+    || boot[511] != 0xAA || boot[108] != 9 || shift > 25 - 9
+    || start + length > dev->numSectors || length < 2 * BOOT_SECTORS) {
+        if(verbose) printf("exfsck: not an exFAT volume\n");
+        return -EILSEQ;
+    }
+
+    Exfsck ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.dev         = dev;
+    ck.out         = out;
+    ck.tree        = tree;
+    ck.verbose     = verbose;
+    ck.spc         = 1 << shift;
+    ck.clusterSize = ck.spc * FSTEST_SECTOR_SIZE;
+    ck.fatStart    = start + fatOffset;
+    ck.heapStart   = start + heapOffset;
+    ck.numClusters = clusters;
+    out->sectorsPerCluster = ck.spc;
+    out->numClusters       = clusters;
+    out->dirty             = _get16(&boot[106]) & 0x02;
+
+    //the layout has to make sense before anything else can be checked.
+    for(int i=11; i<64; i++) {
+        if(boot[i]) {
+            _error(&ck, "boot sector byte %d isn't zero", i);
+            break;
+        }
+    }
+    if(fatOffset < 2 * BOOT_SECTORS || boot[110] != 1
+    || (uint64_t)fatLength * (FSTEST_SECTOR_SIZE / 4) < clusters + 2
+    || heapOffset < fatOffset + fatLength
+    || heapOffset + ((uint64_t)clusters << shift) > length
+    || root < 2 || root >= clusters + 2) {
+        _error(&ck, "layout doesn't fit: FAT at %u (%u sectors, %u FATs), "
+            "heap at %u, %u clusters, root %u, length %" PRIu64, fatOffset,
+            fatLength, boot[110], heapOffset, clusters, root, length);
+        return 0;
+    }
+    if(_get16(&boot[104]) >> 8 != 1) {
+        _error(&ck, "revision 0x%04X", _get16(&boot[104]));
+    }
+
+    //both copies of the boot region have to match their checksums, and
+    //each other, apart from the fields the checksum skips.
+    for(int copy=0; copy<2; copy++) {
+        const uint8_t *region = &boot[copy * BOOT_SECTORS *
+            FSTEST_SECTOR_SIZE];
+        uint32_t sum = _checksum32(0, region,
+            (BOOT_SECTORS - 1) * FSTEST_SECTOR_SIZE, true);
+        const uint8_t *sums = &region[(BOOT_SECTORS - 1) *
+            FSTEST_SECTOR_SIZE];
+        for(int i=0; i<FSTEST_SECTOR_SIZE; i += 4) {
+            if(_get32(&sums[i]) != sum) {
+                _error(&ck, "%s boot region checksum is wrong",
+                    copy ? "backup" : "main");
+                break;
+            }
+        }
+        for(int s=1; s<=8; s++) {
+            const uint8_t *ext = &region[s * FSTEST_SECTOR_SIZE];
+            if(ext[510] != 0x55 || ext[511] != 0xAA) {
+                _error(&ck, "%s extended boot sector %d has no signature",
+                    copy ? "backup" : "main", s);
+            }
+        }
+    }
+    for(int i=0; i<BOOT_SECTORS * FSTEST_SECTOR_SIZE; i++) {
+        if(i == 106 || i == 107 || i == 112) continue;
+        if(boot[i] != boot[(BOOT_SECTORS * FSTEST_SECTOR_SIZE) + i]) {
+            _error(&ck, "backup boot region differs at byte %d", i);
+            break;
+        }
+    }
+    if(_fat(&ck, 0) != 0xFFFFFFF8 || _fat(&ck, 1) != 0xFFFFFFFF) {
+        _error(&ck, "FAT[0] and FAT[1] are 0x%08X 0x%08X", _fat(&ck, 0),
+            _fat(&ck, 1));
+    }
+
+    ck.owner  = (uint32_t*)calloc(clusters + 2, sizeof(uint32_t));
+    ck.upcase = (uint16_t*)malloc(0x10000 * sizeof(uint16_t));
+    if(!ck.owner || !ck.upcase) {
+        if(ck.owner) free(ck.owner);
+        if(ck.upcase) free(ck.upcase);
+        return -ENOMEM;
+    }
+
+    //the allocation bitmap and up-case table are found through entries in
+    //the root directory. find them first, since names can't be checked
+    //without the table.
+    uint32_t *list;
+    uint32_t count = _clusters(&ck, "/", root, 0, 0, &list);
+    uint32_t perCluster = ck.clusterSize / ENTRY_SIZE;
+    for(uint32_t c=0; c<0x10000; c++) ck.upcase[c] = c;
+    for(uint32_t i=0; i<count * perCluster; i++) {
+        const uint8_t *ent = _cluster(&ck, list[i / perCluster]) +
+            ((i % perCluster) * ENTRY_SIZE);
+        if(ent[0] == 0x00) break;
+        if(ent[0] == 0x81) {
+            if(ck.sawBitmap) _error(&ck, "two allocation bitmaps");
+            else _loadBitmap(&ck, ent);
+        }
+        if(ent[0] == 0x82) {
+            if(ck.sawUpcase) _error(&ck, "two up-case tables");
+            else _loadUpcase(&ck, ent);
+        }
+    }
+    for(uint32_t i=0; i<count; i++) ck.owner[list[i]] = 0; //claimed below
+    free(list);
+
+    _checkDir(&ck, "/", root, 0, 0, 0);
+    if(!ck.sawBitmap) _error(&ck, "no allocation bitmap");
+    if(!ck.sawUpcase) _error(&ck, "no up-case table");
+
+    //every cluster in use has to be marked in the bitmap. ones that are
+    //marked but not in use are lost.
+    uint32_t used = 0;
+    if(ck.sawBitmap) {
+        const uint8_t *bitmap = _cluster(&ck, ck.bitmapCluster);
+        for(uint32_t c=2; c<clusters + 2; c++) {
+            bool set = bitmap[(c - 2) / 8] & (1 << ((c - 2) % 8));
+            if(set) used++;
+            if(set && !ck.owner[c]) out->lostClusters++;
+            if(!set && ck.owner[c]) {
+                _error(&ck, "cluster %u is in use but free in the bitmap",
+                    c);
+            }
+        }
+        out->freeClusters = clusters - used;
+    }
+
+    //PercentInUse is only kept up to date while the volume is clean.
+    uint8_t percent = boot[112];
+    if(ck.sawBitmap && !out->dirty && percent != 0xFF
+    && percent != (uint64_t)used * 100 / clusters) {
+        _error(&ck, "PercentInUse is %u, but %u of %u clusters are used",
+            percent, used, clusters);
+    }
+
+    if(verbose > 1) {
+        printf("exfsck: %u files, %u dirs, %u/%u clusters free, %u lost, "
+            "%u excess, %u orphan entries, %s, %u errors\n", out->numFiles,
+            out->numDirs, out->freeClusters, clusters, out->lostClusters,
+            out->excessClusters, out->orphanLfns,
+            out->dirty ? "dirty" : "clean", out->errors);
+    }
+    free(ck.owner);
+    free(ck.upcase);
+    return 0;
+}
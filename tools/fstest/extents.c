@@ -0,0 +1,263 @@
+/** The cluster map of an open file (extent.c).
+ *  A file is written in runs of 1 to 8 clusters, with another file's
+ *  clusters between them, so it's fragmented in a known way. Then it's
+ *  opened with maps of various sizes, smaller and larger than the number of
+ *  extents it has, and each cluster of it is looked up in order, backward,
+ *  and at random. Every lookup must give the cluster the FAT says (read
+ *  directly, not by the driver), and must not claim a run of contiguous
+ *  clusters longer than there is; the map must never hold more extents than
+ *  it has room for; and once the whole file is mapped, a lookup must not
+ *  read the disk at all. Reads through small maps are checked against the
+ *  data too. Then it prints how many sectors a hundred random seeks read
+ *  with each size of map, without the FAT cache, to show what it saves.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 2048
+#define MAX_RUN 8     //longest run of the fragmented file, in clusters
+#define SEEKS 100
+#define MAX_CLUSTERS 256
+
+static const char *fragPath = "/FRAG.BIN";
+static const char *contigPath = "/CONTIG.BIN";
+static const uint16_t mapSizes[] = {0, 1, 3, MAX_RUN, MAX_RUN * 2};
+#define NUM_MAP_SIZES (sizeof(mapSizes) / sizeof(mapSizes[0]))
+
+
+static uint32_t countExtents(const uint32_t *chain, uint32_t count) {
+    uint32_t extents = count ? 1 : 0;
+    for(uint32_t i=1; i<count; i++) {
+        if(chain[i] != chain[i-1] + 1) extents++;
+    }
+    return extents;
+}
+
+
+static uint32_t checkLookups(FsTestDev *dev, fat32_mbr *mbr,
+const char *path, const uint32_t *chain, uint32_t count, uint16_t maxExtents,
+int verbose) {
+    //look up every cluster of a file, in various orders.
+    MicronFatFile file;
+    int err = fatOpenPath(&dev->file, mbr, path, &file, maxExtents,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("%s: can't open: %d\n", path, err);
+        return 1;
+    }
+
+    uint32_t problems = 0;
+    uint32_t rand = maxExtents + 1;
+    for(uint32_t i=0; i<count * 3 && !problems; i++) {
+        uint32_t idx;
+        if(i < count) idx = i;                        //forward
+        else if(i < count * 2) idx = (count * 2) - i - 1; //backward
+        else idx = fsTestRandom(&rand) % count;       //at random
+
+        uint32_t cluster = 0, run = 0;
+        err = fatMapCluster(&dev->file, mbr, &file, idx, &cluster, &run,
+            FSTEST_TIMEOUT);
+        if(err || cluster != chain[idx]) {
+            if(verbose) printf("%s: map of %u: cluster %u is %u (err %d), "
+                "not %u\n", path, maxExtents, idx, cluster, err, chain[idx]);
+            problems++;
+            break;
+        }
+        for(uint32_t j=1; j<run; j++) {
+            if(idx + j < count && chain[idx + j] == cluster + j) continue;
+            if(verbose) printf("%s: map of %u: cluster %u has a run of %u, "
+                "but it ends after %u\n", path, maxExtents, idx, run, j);
+            problems++;
+            break;
+        }
+        if(file.numExtents > maxExtents) {
+            if(verbose) printf("%s: map of %u holds %u extents\n", path,
+                maxExtents, file.numExtents);
+            problems++;
+        }
+    }
+
+    //past the end.
+    uint32_t cluster, run;
+    err = fatMapCluster(&dev->file, mbr, &file, count, &cluster, &run,
+        FSTEST_TIMEOUT);
+    if(err != -ERANGE) {
+        if(verbose) printf("%s: map of %u: cluster %u, past the end, "
+            "returned %d\n", path, maxExtents, count, err);
+        problems++;
+    }
+
+    //if it all fits, it should be mapped now, and stay that way.
+    uint32_t extents = countExtents(chain, count);
+    err = fatMapFile(&dev->file, mbr, &file, FSTEST_TIMEOUT);
+    int expect = (extents <= maxExtents) ? (int)extents : -E2BIG;
+    if(err != expect) {
+        if(verbose) printf("%s: fatMapFile() with a map of %u returned %d, "
+            "not %d\n", path, maxExtents, err, expect);
+        problems++;
+    }
+    if(err >= 0) {
+        uint64_t reads = dev->reads;
+        for(uint32_t i=0; i<count; i++) {
+            fatMapCluster(&dev->file, mbr, &file, fsTestRandom(&rand) % count,
+                &cluster, &run, FSTEST_TIMEOUT);
+        }
+        if(dev->reads != reads) {
+            if(verbose) printf("%s: lookups in a complete map read %llu "
+                "sectors\n", path, (unsigned long long)(dev->reads - reads));
+            problems++;
+        }
+    }
+    fatCloseFile(&file);
+    return problems;
+}
+
+
+static uint32_t checkData(FsTestDev *dev, fat32_mbr *mbr,
+const FsTestNode *node, uint16_t maxExtents, int verbose) {
+    //read the file at random through a map of this size.
+    MicronFatFile file;
+    uint8_t *buf = (uint8_t*)malloc(node->size);
+    if(!buf) return 1;
+    int err = fatOpenPath(&dev->file, mbr, node->path, &file, maxExtents,
+        FSTEST_TIMEOUT);
+    if(err) {
+        free(buf);
+        return 1;
+    }
+    uint32_t problems = 0;
+    uint32_t rand = maxExtents + 100;
+    for(int i=0; i<SEEKS && !problems; i++) {
+        uint32_t offset = fsTestRandom(&rand) % node->size;
+        uint32_t size = 1 + (fsTestRandom(&rand) % (node->size - offset));
+        err = fatReadFile(&dev->file, mbr, &file, offset, size, buf,
+            FSTEST_TIMEOUT);
+        if(err != (int)size || memcmp(buf, &node->data[offset], size)) {
+            if(verbose) printf("%s: map of %u: read %u at %u returned %d "
+                "or the wrong data\n", node->path, maxExtents, size, offset,
+                err);
+            problems++;
+        }
+    }
+    fatCloseFile(&file);
+    free(buf);
+    return problems;
+}
+
+
+static uint64_t seekCost(FsTestDev *dev, fat32_mbr *mbr, const char *path,
+uint32_t count, uint16_t maxExtents) {
+    //sectors read by random seeks, including mapping the file as needed.
+    MicronFatFile file;
+    if(fatOpenPath(&dev->file, mbr, path, &file, maxExtents, FSTEST_TIMEOUT)) {
+        return 0;
+    }
+    uint64_t reads = dev->reads;
+    uint32_t rand = 12345;
+    for(int i=0; i<SEEKS; i++) {
+        uint32_t cluster, run;
+        fatMapCluster(&dev->file, mbr, &file, fsTestRandom(&rand) % count,
+            &cluster, &run, FSTEST_TIMEOUT);
+    }
+    fatCloseFile(&file);
+    return dev->reads - reads;
+}
+
+
+uint32_t testExtents(int verbose) {
+    /** Check the cluster map.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    FsTestDev dev;
+    FsTestTree model;
+    FsTestVol vol;
+    fat32_mbr mbr;
+    uint32_t frag[MAX_CLUSTERS], contig[MAX_CLUSTERS];
+    uint32_t numFrag = 0, numContig = 0;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+
+    //runs of 1 to MAX_RUN clusters, each followed by a cluster of filler,
+    //then a file in one piece.
+    for(uint32_t run=1; run<=MAX_RUN && !err; run++) {
+        err = fsTestAppend(&dev, &mbr, &model, fragPath,
+            run * FSTEST_SECTOR_SIZE, run);
+        if(!err) err = fsTestAppend(&dev, &mbr, &model, "/FILLER.BIN",
+            FSTEST_SECTOR_SIZE, 100 + run);
+    }
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, contigPath,
+        (MAX_RUN * 4 * FSTEST_SECTOR_SIZE) - 100, 200);
+    if(!err) err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(!err) err = volOpen(&dev, START_SECTOR, &vol);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    //find the chains without the driver.
+    uint8_t *ent;
+    ent = volFindEntry(&vol, vol.rootCluster, "FRAG    BIN");
+    if(ent) numFrag = volChain(&vol, volEntryCluster(ent), frag,
+        MAX_CLUSTERS);
+    ent = volFindEntry(&vol, vol.rootCluster, "CONTIG  BIN");
+    if(ent) numContig = volChain(&vol, volEntryCluster(ent), contig,
+        MAX_CLUSTERS);
+    if(countExtents(frag, numFrag) != MAX_RUN || numFrag !=
+    MAX_RUN * (MAX_RUN + 1) / 2 || countExtents(contig, numContig) != 1) {
+        if(verbose) printf("files aren't laid out as intended: %u clusters "
+            "in %u extents, and %u in %u\n", numFrag,
+            countExtents(frag, numFrag), numContig,
+            countExtents(contig, numContig));
+        problems++;
+        goto done;
+    }
+
+    err = fatMount(&dev.file, START_SECTOR, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't mount: %d\n", err);
+        problems++;
+        goto done;
+    }
+    for(size_t i=0; i<NUM_MAP_SIZES; i++) {
+        problems += checkLookups(&dev, &mbr, fragPath, frag, numFrag,
+            mapSizes[i], verbose);
+        problems += checkLookups(&dev, &mbr, contigPath, contig, numContig,
+            mapSizes[i], verbose);
+        problems += checkData(&dev, &mbr, treeFind(&model, fragPath),
+            mapSizes[i], verbose);
+    }
+    fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+
+    //what the map saves, with nothing else to help.
+    if(!fatMount(&dev.file, START_SECTOR, &mbr, 0, FSTEST_TIMEOUT)) {
+        printf("  sectors read by %d random seeks, with a map of:\n", SEEKS);
+        printf("    %-26s", "");
+        for(size_t i=0; i<NUM_MAP_SIZES; i++) printf("%6u", mapSizes[i]);
+        printf("\n    %-26s", "fragmented (8 extents)");
+        for(size_t i=0; i<NUM_MAP_SIZES; i++) printf("%6llu",
+            (unsigned long long)seekCost(&dev, &mbr, fragPath, numFrag,
+                mapSizes[i]));
+        printf("\n    %-26s", "contiguous (1 extent)");
+        for(size_t i=0; i<NUM_MAP_SIZES; i++) printf("%6llu",
+            (unsigned long long)seekCost(&dev, &mbr, contigPath, numContig,
+                mapSizes[i]));
+        printf("\n");
+        fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    }
+
+done:
+    treeFree(&model);
+    devFree(&dev);
+    return problems;
+}
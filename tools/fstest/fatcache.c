@@ -0,0 +1,358 @@
+/** The FAT sector cache (cache.c).
+ *  First, a 1000-cluster chain is followed with and without the cache, to
+ *  check that each FAT sector is read only once, and that the hit and miss
+ *  counts add up; and a sequence of sectors is looked up in a cache of two,
+ *  to check that the least recently used one is replaced. Block caches
+ *  bigger than BLOCKCACHE_MAX_SIZE must be refused, not hang.
+ *  Then, on volumes with one, two and three copies of the FAT, and with
+ *  mirroring turned off so only the second copy is used, FAT entries are
+ *  read and changed through caches of various sizes. Reads must come from
+ *  the copy in use. Changes must not be written until they're flushed or
+ *  evicted, and then to every copy in use and no other, one write per
+ *  sector per copy; a second flush must write nothing. Finally fsck must
+ *  find the copies the same, where they're mirrored.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 1536
+#define CHAIN_CLUSTERS 1000
+#define ENTRIES_PER_SECTOR (FSTEST_SECTOR_SIZE / 4)
+
+typedef struct {
+    uint8_t  numFats;
+    uint16_t flags;     //for the boot sector; 0x81 = only FAT 1 in use
+    uint16_t cacheSize; //FAT sectors cached (0 = none)
+} Config;
+
+static const Config configs[] = {
+    {1, 0,    0}, {1, 0,    2},
+    {2, 0,    0}, {2, 0,    1}, {2, 0,    FAT_DEFAULT_CACHE_SIZE},
+    {3, 0,    2},
+    {2, 0x81, 0}, {2, 0x81, FAT_DEFAULT_CACHE_SIZE},
+};
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+//entries changed by the test, in three different sectors of the FAT.
+static const uint32_t changed[][2] = { //cluster, new entry
+    {130, 131}, {131, FAT_CLUSTER_EOC}, {260, FAT_CLUSTER_EOC},
+    {900, FAT_CLUSTER_EOC},
+};
+#define NUM_CHANGED (sizeof(changed) / sizeof(changed[0]))
+#define CHANGED_SECTORS 3
+
+
+static uint32_t getCopy(FsTestVol *vol, uint32_t fat, uint32_t cluster) {
+    const uint8_t *p = volFatEntry(vol, fat, cluster);
+    return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) &
+        0x0FFFFFFF;
+}
+
+static void setCopy(FsTestVol *vol, uint32_t fat, uint32_t cluster,
+uint32_t value) {
+    uint8_t *p = volFatEntry(vol, fat, cluster);
+    for(int i=0; i<4; i++) p[i] = value >> (i * 8);
+}
+
+
+static uint32_t checkWalk(int verbose) {
+    //follow a long chain with and without the cache, and check the LRU
+    //order.
+    FsTestDev dev;
+    FsTestTree model;
+    fat32_mbr mbr;
+    uint32_t problems = 0;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr, 0,
+        FSTEST_TIMEOUT);
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, "/CHAIN.BIN",
+        CHAIN_CLUSTERS * FSTEST_SECTOR_SIZE, 1);
+    if(!err) err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    micronDirent ent;
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr, 0,
+        FSTEST_TIMEOUT);
+    if(!err) err = fatLookupPath(&dev.file, &mbr, "/CHAIN.BIN", &ent,
+        FSTEST_TIMEOUT);
+    if(!err) err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        treeFree(&model);
+        devFree(&dev);
+        return 1;
+    }
+
+    uint32_t first = ent.cluster, last = first + CHAIN_CLUSTERS - 1;
+    uint32_t sectors = (last / ENTRIES_PER_SECTOR) -
+        (first / ENTRIES_PER_SECTOR) + 1;
+    uint64_t reads[2];
+    for(int cached=0; cached<2; cached++) {
+        err = fatMount(&dev.file, START_SECTOR, &mbr,
+            cached ? FAT_DEFAULT_CACHE_SIZE : 0, FSTEST_TIMEOUT);
+        if(err) {
+            problems++;
+            break;
+        }
+        MicronFatCache *cache = mbr._micron_fatCache;
+        uint32_t hits = cache ? cache->blocks.hits : 0;
+        uint32_t misses = cache ? cache->blocks.misses : 0;
+        uint64_t before = dev.reads;
+        uint32_t length = 1;
+        for(int c=first; c > 0 && length <= CHAIN_CLUSTERS; length++) {
+            c = fatGetNextCluster(&dev.file, &mbr, c, FSTEST_TIMEOUT);
+            if(!c) break;
+        }
+        reads[cached] = dev.reads - before;
+        if(length != CHAIN_CLUSTERS) {
+            if(verbose) printf("chain is %u clusters, not %u\n", length,
+                CHAIN_CLUSTERS);
+            problems++;
+        }
+        if(cache && (reads[1] != sectors
+        || cache->blocks.misses - misses != sectors
+        || cache->blocks.hits - hits != CHAIN_CLUSTERS - sectors)) {
+            if(verbose) printf("following %u clusters in %u FAT sectors "
+                "read %llu sectors, with %u hits and %u misses\n",
+                CHAIN_CLUSTERS, sectors, (unsigned long long)reads[1],
+                cache->blocks.hits - hits, cache->blocks.misses - misses);
+            problems++;
+        }
+
+        //A, B, A, C (replacing B), A, B (replacing C)
+        if(cache) {
+            static const uint32_t order[] = {0, 1, 0, 2, 0, 1};
+            fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+            fatMount(&dev.file, START_SECTOR, &mbr, 2, FSTEST_TIMEOUT);
+            cache = mbr._micron_fatCache;
+            for(int i=0; i<2; i++) { //push out whatever mount read
+                uint8_t *data;
+                fatCacheGetSector(&dev.file, &mbr, 10 + i, &data,
+                    FSTEST_TIMEOUT);
+            }
+            hits   = cache->blocks.hits;
+            misses = cache->blocks.misses;
+            before = dev.reads;
+            for(size_t i=0; i<sizeof(order) / sizeof(order[0]); i++) {
+                uint8_t *data;
+                fatCacheGetSector(&dev.file, &mbr, order[i], &data,
+                    FSTEST_TIMEOUT);
+            }
+            if(cache->blocks.hits - hits != 2
+            || cache->blocks.misses - misses != 4 || dev.reads - before != 4) {
+                if(verbose) printf("cache of 2, sectors A B A C A B: %u "
+                    "hits, %u misses, %llu reads, not 2, 4, 4\n",
+                    cache->blocks.hits - hits, cache->blocks.misses - misses,
+                    (unsigned long long)(dev.reads - before));
+                problems++;
+            }
+        }
+        fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    }
+    printf("  following %u clusters read %llu FAT sectors with the cache, "
+        "%llu without\n", CHAIN_CLUSTERS, (unsigned long long)reads[1],
+        (unsigned long long)reads[0]);
+    treeFree(&model);
+    devFree(&dev);
+    return problems;
+}
+
+
+static uint32_t checkSizes(int verbose) {
+    static const uint16_t sizes[] = {0, 1, 3, BLOCKCACHE_MAX_SIZE,
+        BLOCKCACHE_MAX_SIZE + 1, BLOCKCACHE_NONE - 1, BLOCKCACHE_NONE};
+    uint32_t problems = 0;
+    for(size_t i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++) {
+        MicronBlockCache cache;
+        bool valid = sizes[i] && sizes[i] <= BLOCKCACHE_MAX_SIZE;
+        int err = blockCacheInit(&cache, sizes[i], 1);
+        if(err != (valid ? 0 : -EINVAL)) {
+            if(verbose) printf("block cache of %u: error %d, expected %d\n",
+                sizes[i], err, valid ? 0 : -EINVAL);
+            problems++;
+        }
+        if(!err) blockCacheFree(&cache);
+    }
+    return problems;
+}
+
+
+static uint32_t checkCopies(FsTestVol *vol, uint32_t active, bool mirrored,
+const char *when, int verbose) {
+    //check that the changed entries are in every copy in use, and no other.
+    uint32_t problems = 0;
+    for(uint32_t f=0; f<vol->numFats; f++) {
+        bool used = mirrored || f == active;
+        for(size_t i=0; i<NUM_CHANGED; i++) {
+            uint32_t expect = used ? changed[i][1] : FAT_CLUSTER_FREE;
+            uint32_t got = getCopy(vol, f, changed[i][0]);
+            if(got == expect) continue;
+            if(verbose) printf("%s, FAT %u, cluster %u is 0x%X, not 0x%X\n",
+                when, f, changed[i][0], got, expect);
+            problems++;
+        }
+    }
+    return problems;
+}
+
+
+static uint32_t runConfig(const Config *cfg, int verbose) {
+    FsTestDev dev;
+    FsTestVol vol;
+    FsckResult result;
+    fat32_mbr mbr;
+    bool mirrored = !(cfg->flags & 0x80);
+    uint32_t active = mirrored ? 0 : (cfg->flags & 0x0F);
+    uint32_t copies = mirrored ? cfg->numFats : 1;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, 1, cfg->numFats);
+    if(!err) err = volOpen(&dev, START_SECTOR, &vol);
+    if(err) {
+        devFree(&dev);
+        return 1;
+    }
+    for(int s=0; s<7; s += 6) { //boot sector and its backup
+        uint8_t *boot = &dev.data[(START_SECTOR + s) * FSTEST_SECTOR_SIZE];
+        boot[40] = cfg->flags;
+        boot[41] = cfg->flags >> 8;
+    }
+
+    //a chain that's only in the copy in use, so reading any other gives
+    //the wrong answer.
+    for(uint32_t f=0; f<cfg->numFats; f++) {
+        if(!mirrored && f != active) continue;
+        setCopy(&vol, f, 500, 501);
+        setCopy(&vol, f, 501, FAT_CLUSTER_EOC);
+    }
+
+    err = fatMount(&dev.file, START_SECTOR, &mbr, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't mount: %d\n", err);
+        devFree(&dev);
+        return 1;
+    }
+    uint32_t entry = 0;
+    int next = fatGetNextCluster(&dev.file, &mbr, 500, FSTEST_TIMEOUT);
+    err = fatGetFatEntry(&dev.file, &mbr, 501, &entry, FSTEST_TIMEOUT);
+    if(next != 501 || err || entry < 0x0FFFFFF8) {
+        if(verbose) printf("read the wrong FAT: cluster 500 -> %d, 501 -> "
+            "0x%X (err %d)\n", next, entry, err);
+        problems++;
+    }
+
+    //change entries in three sectors. with a cache big enough, nothing
+    //should be written yet.
+    MicronFatCache *cache = mbr._micron_fatCache;
+    uint32_t writebacks = cache ? cache->writebacks : 0;
+    uint64_t writes = dev.writes;
+    for(size_t i=0; i<NUM_CHANGED && !err; i++) {
+        err = fatSetFatEntry(&dev.file, &mbr, changed[i][0], changed[i][1],
+            FSTEST_TIMEOUT);
+    }
+    for(size_t i=0; i<NUM_CHANGED && !err; i++) {
+        err = fatGetFatEntry(&dev.file, &mbr, changed[i][0], &entry,
+            FSTEST_TIMEOUT);
+        if(!err && entry != changed[i][1]) {
+            if(verbose) printf("cluster %u reads back as 0x%X, not 0x%X\n",
+                changed[i][0], entry, changed[i][1]);
+            problems++;
+        }
+    }
+    if(err) {
+        if(verbose) printf("can't change the FAT: %d\n", err);
+        problems++;
+    }
+    uint64_t expect = (uint64_t)NUM_CHANGED * copies; //without a cache
+    if(cache) expect = (uint64_t)(cache->writebacks - writebacks) * copies;
+    if(cfg->cacheSize > CHANGED_SECTORS) expect = 0;
+    if(dev.writes - writes != expect) {
+        if(verbose) printf("changes wrote %llu sectors before flushing, "
+            "not %llu\n", (unsigned long long)(dev.writes - writes),
+            (unsigned long long)expect);
+        problems++;
+    }
+
+    //flushing writes each dirty sector to each copy in use, once.
+    writes = dev.writes;
+    writebacks = cache ? cache->writebacks : 0;
+    err = fatCacheFlush(&dev.file, &mbr, FSTEST_TIMEOUT);
+    expect = cache ? (uint64_t)(cache->writebacks - writebacks) * copies : 0;
+    if(err || dev.writes - writes != expect) {
+        if(verbose) printf("flush returned %d, and wrote %llu sectors, not "
+            "%llu\n", err, (unsigned long long)(dev.writes - writes),
+            (unsigned long long)expect);
+        problems++;
+    }
+    if(cfg->cacheSize > CHANGED_SECTORS
+    && cache->writebacks - writebacks != CHANGED_SECTORS) {
+        if(verbose) printf("flush wrote back %u sectors, not %u\n",
+            cache->writebacks - writebacks, CHANGED_SECTORS);
+        problems++;
+    }
+    problems += checkCopies(&vol, active, mirrored, "after flushing",
+        verbose);
+    writes = dev.writes;
+    fatCacheFlush(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(dev.writes != writes) {
+        if(verbose) printf("second flush wrote %llu sectors\n",
+            (unsigned long long)(dev.writes - writes));
+        problems++;
+    }
+
+    //a dirty sector pushed out by reading others is written then. (the
+    //others are past any that were used so far.)
+    if(cache) {
+        writes = dev.writes;
+        err = fatSetFatEntry(&dev.file, &mbr, 132, FAT_CLUSTER_EOC,
+            FSTEST_TIMEOUT);
+        for(uint32_t i=0; i<cfg->cacheSize && !err; i++) {
+            err = fatGetFatEntry(&dev.file, &mbr,
+                (i + 8) * ENTRIES_PER_SECTOR, &entry, FSTEST_TIMEOUT);
+        }
+        if(err || dev.writes - writes != copies
+        || getCopy(&vol, active, 132) != FAT_CLUSTER_EOC) {
+            if(verbose) printf("evicting a dirty sector wrote %llu sectors, "
+                "not %u (err %d)\n", (unsigned long long)(dev.writes - writes),
+                copies, err);
+            problems++;
+        }
+    }
+
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(!err) err = fsckFat(&dev, START_SECTOR, &result, NULL, verbose);
+    if(err || result.errors || result.fatDiffSectors) {
+        if(verbose) printf("unmount or fsck failed (%d): %u errors, %u FAT "
+            "sectors differ\n", err, result.errors, result.fatDiffSectors);
+        problems++;
+    }
+    devFree(&dev);
+    return problems;
+}
+
+
+uint32_t testFatCache(int verbose) {
+    /** Check the FAT sector cache.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    uint32_t failures = checkWalk(verbose) ? 1 : 0;
+    if(checkSizes(verbose)) {
+        printf("  block cache sizes: FAILED\n");
+        failures++;
+    }
+    for(size_t i=0; i<NUM_CONFIGS; i++) {
+        const Config *cfg = &configs[i];
+        uint32_t problems = runConfig(cfg, verbose);
+        printf("  %u FATs%s, cache=%u: %s\n", cfg->numFats,
+            (cfg->flags & 0x80) ? " (not mirrored)" : "", cfg->cacheSize,
+            problems ? "FAILED" : "ok");
+        if(problems) failures++;
+    }
+    return failures;
+}
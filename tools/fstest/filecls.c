@@ -0,0 +1,341 @@
+/** FAT files through the file class (filecls.c), as read(), write(),
+ *  fseek() and close() see them.
+ *  A file is written in pieces, in turn with another, so it's fragmented.
+ *  It's read a few bytes at a time to the end, with a read-ahead buffer and
+ *  without: each read must return the right data, and with the buffer,
+ *  each sector must be read from the disk only once, in a request per
+ *  buffer or extent. Then it's read after seeks from the start, the current
+ *  position and the end, back into what's buffered, which mustn't read the
+ *  disk, and past the end; and in a piece bigger than the buffer, which
+ *  must go straight to the caller. A write over what's buffered must be
+ *  seen by the next read.
+ *  The open flags: a file that doesn't exist can't be opened without
+ *  FAT_O_CREATE; FAT_O_CREATE leaves an existing file alone; FAT_O_TRUNCATE
+ *  empties one; FAT_O_APPEND starts at the end; and writing past the end
+ *  fills the gap with zeros. Once every file is closed, before unmounting,
+ *  fsck must find the right files, and FSInfo's free count up to date.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 4096
+#define SECTORS_PER_CLUSTER 4
+#define READ_AHEAD FAT_DEFAULT_READ_AHEAD
+#define SMALL_READ 100
+
+static const char *path = "/data.bin";
+static const char *otherPath = "/other.bin";
+static const char *newPath = "/new.txt";
+
+
+static FILE* openFile(FsTestDev *dev, fat32_mbr *mbr, const char *name,
+uint32_t flags, uint32_t readAhead, int verbose) {
+    int err = 0;
+    FILE *f = fatOpen(&dev->file, mbr, name, flags, readAhead,
+        FSTEST_TIMEOUT, &err);
+    if(!f && verbose) printf("%s: can't open: %d\n", name, err);
+    return f;
+}
+
+
+static uint32_t readAt(FILE *f, const FsTestNode *node, uint32_t offset,
+uint32_t size, const char *what, int verbose) {
+    //read from the current position, which should be `offset`.
+    uint8_t *buf = (uint8_t*)malloc(size);
+    if(!buf) return 1;
+    uint32_t expect = (offset >= node->size) ? 0 :
+        MIN(size, node->size - offset);
+    int n = read(f, buf, size);
+    uint32_t problems = 0;
+    if(expect ? (n != (int)expect) : (n != -ENODATA)) {
+        if(verbose) printf("%s: read %u at %u returned %d, not %u\n", what,
+            size, offset, n, expect);
+        problems++;
+    }
+    else if(memcmp(buf, &node->data[offset], expect)) {
+        if(verbose) printf("%s: read %u at %u got the wrong data\n", what,
+            size, offset);
+        problems++;
+    }
+    else if(f->offset != offset + expect) {
+        if(verbose) printf("%s: read %u at %u left the position at %llu\n",
+            what, size, offset, (unsigned long long)f->offset);
+        problems++;
+    }
+    free(buf);
+    return problems;
+}
+
+
+static uint32_t checkSequential(FsTestDev *dev, fat32_mbr *mbr,
+const FsTestNode *node, uint32_t readAhead, int verbose) {
+    //read the whole file a few bytes at a time.
+    FILE *f = openFile(dev, mbr, node->path, 0, readAhead, verbose);
+    if(!f) return 1;
+    uint32_t problems = 0;
+    uint64_t reads = dev->reads, requests = dev->readRequests;
+    for(uint32_t offset=0; offset < node->size && !problems;
+    offset += SMALL_READ) {
+        problems += readAt(f, node, offset, SMALL_READ, "sequential",
+            verbose);
+    }
+    problems += readAt(f, node, node->size, 1, "at the end", verbose);
+    reads = dev->reads - reads;
+    requests = dev->readRequests - requests;
+    micronClose(f);
+
+    //each sector once (and the FAT, which isn't in the FAT cache yet), in
+    //a request per buffer, plus one where it crosses into another extent.
+    MicronFatFile file;
+    int extents = fatOpenPath(&dev->file, mbr, node->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!extents) {
+        extents = fatMapFile(&dev->file, mbr, &file, FSTEST_TIMEOUT);
+        fatCloseFile(&file);
+    }
+    uint32_t sectors = (node->size + FSTEST_SECTOR_SIZE - 1) /
+        FSTEST_SECTOR_SIZE;
+    uint32_t buffers = (node->size + READ_AHEAD - 1) / READ_AHEAD;
+    if(verbose > 1) printf("read-ahead of %u: %llu sectors in %llu "
+        "requests\n", readAhead, (unsigned long long)reads,
+        (unsigned long long)requests);
+    if(readAhead && (extents < 0 || reads > sectors + 2
+    || requests > buffers + extents + 2)) {
+        if(verbose) printf("reading %u sectors %u bytes at a time read %llu "
+            "sectors in %llu requests\n", sectors, SMALL_READ,
+            (unsigned long long)reads, (unsigned long long)requests);
+        problems++;
+    }
+    return problems;
+}
+
+
+static uint32_t checkSeeks(FsTestDev *dev, fat32_mbr *mbr,
+FsTestNode *node, int verbose) {
+    //seek around, and read and write.
+    FILE *f = openFile(dev, mbr, node->path, 0, READ_AHEAD, verbose);
+    if(!f) return 1;
+    uint32_t problems = 0, size = node->size;
+    const struct {
+        int origin;
+        long offset;
+        uint32_t at;   //where it should end up
+        uint32_t read; //then read this much
+    } seeks[] = {
+        {SEEK_SET, 4000, 4000, 50},
+        {SEEK_CUR, -30, 4020, 20},  //back into the buffer
+        {SEEK_CUR, 1000, 5040, 10},
+        {SEEK_END, -10, size - 10, 50},
+        {SEEK_SET, 1, 1, READ_AHEAD + 700}, //bigger than the buffer
+        {SEEK_END, 100, size + 100, 1},     //past the end
+        {SEEK_SET, size, size, 1},
+    };
+    for(size_t i=0; i<sizeof(seeks) / sizeof(seeks[0]); i++) {
+        int err = fseek(f, seeks[i].offset, seeks[i].origin);
+        if(err || f->offset != seeks[i].at) {
+            if(verbose) printf("seek %d of %ld went to %llu, returning %d\n",
+                seeks[i].origin, seeks[i].offset,
+                (unsigned long long)f->offset, err);
+            problems++;
+            continue;
+        }
+        uint64_t reads = dev->reads;
+        problems += readAt(f, node, seeks[i].at, seeks[i].read, "seek",
+            verbose);
+        if(i == 1 && dev->reads != reads) {
+            if(verbose) printf("read of what's buffered read the disk\n");
+            problems++;
+        }
+    }
+    if(fseek(f, -1, SEEK_SET) != -ERANGE) {
+        if(verbose) printf("seek before the start didn't fail\n");
+        problems++;
+    }
+
+    //a write over what's buffered.
+    uint8_t buf[40];
+    fsTestFill(&node->data[4010], 20, 77);
+    if(fseek(f, 4000, SEEK_SET) || read(f, buf, 10) != 10
+    || write(f, &node->data[4010], 20) != 20 || fseek(f, 4000, SEEK_SET)) {
+        if(verbose) printf("can't write over the buffer\n");
+        problems++;
+    }
+    else problems += readAt(f, node, 4000, sizeof(buf), "rewritten",
+        verbose);
+    int err = micronClose(f);
+    if(err) {
+        if(verbose) printf("close failed: %d\n", err);
+        problems++;
+    }
+    return problems;
+}
+
+
+static int writeNew(FILE *f, FsTestTree *model, const char *name,
+uint32_t size, uint32_t seed) {
+    //write to a file at its position, in pieces, and the same to the model.
+    FsTestNode *node = treeFind(model, name);
+    uint32_t oldSize = node ? node->size : 0;
+    uint32_t at = f->offset;
+    uint32_t newSize = MAX(oldSize, at + size);
+    uint8_t *data = (uint8_t*)calloc(newSize + 1, 1);
+    if(!data) return -ENOMEM;
+    if(oldSize) memcpy(data, node->data, oldSize);
+    fsTestFill(&data[at], size, seed);
+    int err = 0;
+    for(uint32_t done=0; done<size && !err; done += 700) {
+        uint32_t n = MIN(size - done, 700U);
+        err = write(f, &data[at + done], n);
+        err = (err == (int)n) ? 0 : ((err < 0) ? err : -EIO);
+    }
+    if(!err) err = treeSet(model, name, false, data, newSize);
+    free(data);
+    return err;
+}
+
+
+static uint32_t checkFlags(FsTestDev *dev, fat32_mbr *mbr,
+FsTestTree *model, int verbose) {
+    //open with each flag.
+    uint32_t problems = 0;
+    int err = 0;
+    FILE *f = fatOpen(&dev->file, mbr, newPath, 0, READ_AHEAD,
+        FSTEST_TIMEOUT, &err);
+    if(f || err != -ENOENT) {
+        if(verbose) printf("opening a file that isn't there gave %d\n", err);
+        problems++;
+        if(f) micronClose(f);
+    }
+
+    //create one, then append to it.
+    f = openFile(dev, mbr, newPath, FAT_O_CREATE, READ_AHEAD, verbose);
+    err = f ? writeNew(f, model, newPath, 3000, 5) : -ENOENT;
+    if(f) {
+        int err2 = micronClose(f);
+        if(!err) err = err2;
+    }
+    if(!err) {
+        f = openFile(dev, mbr, newPath, FAT_O_APPEND, READ_AHEAD, verbose);
+        if(f && f->offset != 3000) err = -ESPIPE;
+        else if(f) err = writeNew(f, model, newPath, 500, 6);
+        else err = -ENOENT;
+        if(f) {
+            int err2 = micronClose(f);
+            if(!err) err = err2;
+        }
+    }
+    if(err) {
+        if(verbose) printf("can't create and append to %s: %d\n", newPath,
+            err);
+        problems++;
+    }
+
+    //creating one that's there keeps it.
+    const FsTestNode *other = treeFind(model, otherPath);
+    f = openFile(dev, mbr, otherPath, FAT_O_CREATE, READ_AHEAD, verbose);
+    if(!f) problems++;
+    else {
+        problems += readAt(f, other, 0, other->size + 1, "created again",
+            verbose);
+        micronClose(f);
+    }
+
+    //truncating one empties it, and writing past the end fills the gap.
+    f = openFile(dev, mbr, otherPath, FAT_O_TRUNCATE, READ_AHEAD, verbose);
+    err = f ? 0 : -ENOENT;
+    if(!err) err = treeSet(model, otherPath, false, NULL, 0);
+    if(!err) {
+        problems += readAt(f, treeFind(model, otherPath), 0, 1, "truncated",
+            verbose);
+        err = writeNew(f, model, otherPath, 1000, 7);
+    }
+    if(!err) err = fseek(f, 1234, SEEK_CUR);
+    if(!err) err = writeNew(f, model, otherPath, 10, 8);
+    if(f) {
+        int err2 = micronClose(f);
+        if(!err) err = err2;
+    }
+    if(err) {
+        if(verbose) printf("can't truncate and write %s: %d\n", otherPath,
+            err);
+        problems++;
+    }
+    return problems;
+}
+
+
+uint32_t testFileCls(int verbose) {
+    /** Check FAT files through the file class.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    FsTestDev dev;
+    FsTestTree model, actual;
+    FsckResult result;
+    fat32_mbr mbr;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    treeInit(&actual);
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS,
+        SECTORS_PER_CLUSTER, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    for(uint32_t i=0; i<8 && !err; i++) {
+        err = fsTestAppend(&dev, &mbr, &model, path, 2500 + (i * 300), i);
+        if(!err) err = fsTestAppend(&dev, &mbr, &model, otherPath, 1500,
+            100 + i);
+    }
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    uint32_t reads, seeks, flags;
+    reads = checkSequential(&dev, &mbr, treeFind(&model, path), READ_AHEAD,
+        verbose);
+    reads += checkSequential(&dev, &mbr, treeFind(&model, path), 0,
+        verbose);
+    printf("  reads with and without read-ahead: %s\n",
+        reads ? "FAILED" : "ok");
+    seeks = checkSeeks(&dev, &mbr, treeFind(&model, path), verbose);
+    printf("  seeks, and writes over the buffer: %s\n",
+        seeks ? "FAILED" : "ok");
+    flags = checkFlags(&dev, &mbr, &model, verbose);
+    printf("  create, truncate and append: %s\n", flags ? "FAILED" : "ok");
+    problems += reads + seeks + flags;
+
+    //closing the files must have left everything on the disk.
+    if(fsckFat(&dev, START_SECTOR, &result, &actual, verbose)
+    || result.errors || result.fsInfoFree != result.freeClusters
+    || treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("closed files aren't all on the disk (FSInfo: %u "
+            "free, really %u)\n", result.fsInfoFree, result.freeClusters);
+        problems++;
+    }
+    treeFree(&actual);
+    treeInit(&actual);
+
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't unmount: %d\n", err);
+        problems++;
+        goto done;
+    }
+    problems += fsTestVerify(&dev, START_SECTOR, &actual, &result, verbose);
+    if(treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&actual);
+    devFree(&dev);
+    return problems;
+}
@@ -0,0 +1,559 @@
+/** Checks a FAT32 volume, independently of the driver.
+ *  Everything is read straight from the device's memory and parsed the way
+ *  the FAT specification describes it, without the driver's structures or
+ *  functions, so that a mistake in the driver doesn't hide itself.
+ *  Problems that would lose or corrupt data count as errors. Leftovers that
+ *  an interrupted operation is allowed to leave behind (lost clusters, a
+ *  chain longer than its file, orphaned LFN entries, and the copies of the
+ *  FAT differing where a write was cut short) are only counted.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <stdarg.h>
+    #include "fstest.h"
+}
+
+#define ENTRY_SIZE   32
+#define MAX_DEPTH    32
+#define MAX_LFN      20   //LFN entries per name
+#define MAX_NAME     (MAX_LFN * 13 * 3 + 1) //in UTF-8
+#define FAT_EOC      0x0FFFFFF8 //this and above end a chain
+#define FAT_BAD      0x0FFFFFF7
+
+typedef struct {
+    FsTestDev  *dev;
+    FsckResult *out;
+    FsTestTree *tree;
+    int         verbose;
+    uint32_t    spc;          //sectors per cluster
+    uint32_t    numClusters;
+    uint32_t    rootCluster;
+    uint64_t    dataStart;    //first sector of cluster 2
+    uint32_t   *fat;          //the active FAT
+    uint32_t   *owner;        //first cluster of the chain each one is in
+} Fsck;
+
+typedef struct {
+    //names already seen in a directory, to find duplicates.
+    char   (*shortNames)[11];
+    char   (*longNames)[MAX_NAME];
+    uint32_t count, capacity;
+} NameList;
+
+
+static uint16_t _get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t _get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t* _sector(Fsck *ck, uint64_t sector) {
+    return &ck->dev->data[sector * FSTEST_SECTOR_SIZE];
+}
+
+static uint8_t* _cluster(Fsck *ck, uint32_t cluster) {
+    return _sector(ck, ck->dataStart + ((uint64_t)(cluster - 2) * ck->spc));
+}
+
+static void _error(Fsck *ck, const char *fmt, ...) {
+    ck->out->errors++;
+    if(!ck->verbose) return;
+    va_list args;
+    va_start(args, fmt);
+    printf("fsck: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+
+/* -------------------------------- Chains -------------------------------- */
+
+static uint32_t _walkChain(Fsck *ck, const char *path, uint32_t first,
+uint32_t **outList) {
+    //follow a cluster chain, claiming its clusters. returns its length, up
+    //to where it goes wrong. if `outList` isn't NULL, it receives the
+    //clusters (to be freed by the caller).
+    uint32_t count = 0, capacity = 0;
+    uint32_t *list = NULL;
+    uint32_t cluster = first;
+    while(1) {
+        if(cluster < 2 || cluster >= ck->numClusters + 2) {
+            _error(ck, "%s: cluster %u out of range", path, cluster);
+            break;
+        }
+        if(ck->owner[cluster]) {
+            _error(ck, "%s: cluster %u is also in the chain at %u",
+                path, cluster, ck->owner[cluster]);
+            break;
+        }
+        uint32_t next = ck->fat[cluster];
+        if(next == 0) {
+            _error(ck, "%s: chain runs into free cluster %u", path, cluster);
+            break;
+        }
+        if(next == FAT_BAD) {
+            _error(ck, "%s: chain runs into bad cluster %u", path, cluster);
+            break;
+        }
+        ck->owner[cluster] = first;
+        if(outList) {
+            if(count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                list = (uint32_t*)realloc(list, capacity * sizeof(uint32_t));
+            }
+            list[count] = cluster;
+        }
+        count++;
+        if(next >= FAT_EOC) break;
+        cluster = next;
+    }
+    if(outList) *outList = list;
+    return count;
+}
+
+
+/* -------------------------------- Names --------------------------------- */
+
+static bool _validShortChar(uint8_t c) {
+    if(c >= 'A' && c <= 'Z') return true;
+    if(c >= '0' && c <= '9') return true;
+    if(c >= 0x80) return true;
+    return c == ' ' || (c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+static uint8_t _checksum(const uint8_t *name) {
+    uint8_t sum = 0;
+    for(int i=0; i<11; i++) sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + name[i];
+    return sum;
+}
+
+static void _shortName(const uint8_t *ent, char *out) {
+    //"FOO     TXT" to "FOO.TXT", applying the lowercase flags that Windows
+    //NT keeps in byte 12.
+    int len = 0;
+    for(int i=0; i<8 && ent[i] != ' '; i++) {
+        char c = (i == 0 && ent[i] == 0x05) ? 0xE5 : ent[i];
+        if((ent[12] & 0x08) && c >= 'A' && c <= 'Z') c += 0x20;
+        out[len++] = c;
+    }
+    if(ent[8] != ' ') {
+        out[len++] = '.';
+        for(int i=8; i<11 && ent[i] != ' '; i++) {
+            char c = ent[i];
+            if((ent[12] & 0x10) && c >= 'A' && c <= 'Z') c += 0x20;
+            out[len++] = c;
+        }
+    }
+    out[len] = '\0';
+}
+
+static void _utf16ToUtf8(const uint16_t *in, int len, char *out) {
+    int pos = 0;
+    for(int i=0; i<len; i++) {
+        uint32_t c = in[i];
+        if(c >= 0xD800 && c <= 0xDBFF && i+1 < len
+        && in[i+1] >= 0xDC00 && in[i+1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+        }
+        if(c < 0x80) out[pos++] = c;
+        else if(c < 0x800) {
+            out[pos++] = 0xC0 | (c >> 6);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+        else if(c < 0x10000) {
+            out[pos++] = 0xE0 | (c >> 12);
+            out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+        else {
+            out[pos++] = 0xF0 | (c >> 18);
+            out[pos++] = 0x80 | ((c >> 12) & 0x3F);
+            out[pos++] = 0x80 | ((c >> 6) & 0x3F);
+            out[pos++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[pos] = '\0';
+}
+
+static bool _addName(NameList *names, const uint8_t *shortName,
+const char *longName) {
+    //remember a directory entry's names. returns false if either is
+    //already used in the directory. long names are compared without
+    //regard to ASCII case, as Windows does.
+    for(uint32_t i=0; i<names->count; i++) {
+        if(!memcmp(names->shortNames[i], shortName, 11)) return false;
+        if(!strcasecmp(names->longNames[i], longName)) return false;
+    }
+    if(names->count == names->capacity) {
+        names->capacity = names->capacity ? names->capacity * 2 : 16;
+        names->shortNames = (char(*)[11])realloc(names->shortNames,
+            names->capacity * 11);
+        names->longNames = (char(*)[MAX_NAME])realloc(names->longNames,
+            names->capacity * MAX_NAME);
+    }
+    memcpy(names->shortNames[names->count], shortName, 11);
+    strcpy(names->longNames[names->count], longName);
+    names->count++;
+    return true;
+}
+
+
+/* ------------------------------ Directories ----------------------------- */
+
+typedef struct {
+    //long name being assembled.
+    bool     active;
+    uint8_t  checksum;
+    int      next;     //sequence number expected next (1 = last one)
+    int      count;    //entries seen
+    int      length;   //characters, up to the terminator
+    uint16_t chars[MAX_LFN * 13];
+} LongName;
+
+static void _dropLfn(Fsck *ck, LongName *lfn) {
+    //LFN entries that don't belong to an 8.3 entry are ignored, so they're
+    //harmless, but they do take up space.
+    if(lfn->active) ck->out->orphanLfns += lfn->count;
+    lfn->active = false;
+}
+
+static void _addLfn(Fsck *ck, const char *path, LongName *lfn,
+const uint8_t *ent) {
+    int seq = ent[0] & 0x1F;
+    if(ent[12] != 0 || _get16(&ent[26]) != 0) {
+        _error(ck, "%s: LFN entry with type or cluster set", path);
+    }
+    if(ent[0] & 0x40) { //last part of the name, stored first
+        _dropLfn(ck, lfn);
+        if(seq < 1 || seq > MAX_LFN) {
+            ck->out->orphanLfns++;
+            return;
+        }
+        lfn->active   = true;
+        lfn->checksum = ent[13];
+        lfn->next     = seq;
+        lfn->count    = 0;
+        lfn->length   = seq * 13;
+    }
+    else if(!lfn->active || seq != lfn->next || ent[13] != lfn->checksum) {
+        _dropLfn(ck, lfn);
+        ck->out->orphanLfns++;
+        return;
+    }
+
+    static const uint8_t offsets[13] = {1,3,5,7,9, 14,16,18,20,22,24, 28,30};
+    uint16_t *chars = &lfn->chars[(seq - 1) * 13];
+    for(int i=0; i<13; i++) chars[i] = _get16(&ent[offsets[i]]);
+    if(ent[0] & 0x40) {
+        //the name ends with 0x0000, unless it fills the entry, and the
+        //rest is padded with 0xFFFF.
+        int i = 0;
+        while(i < 13 && chars[i] != 0x0000) i++;
+        lfn->length = ((seq - 1) * 13) + i;
+        for(i++; i<13; i++) {
+            if(chars[i] != 0xFFFF) {
+                _error(ck, "%s: LFN entry not padded with 0xFFFF", path);
+                break;
+            }
+        }
+    }
+    else {
+        for(int i=0; i<13; i++) {
+            if(chars[i] == 0x0000 || chars[i] == 0xFFFF) {
+                _error(ck, "%s: LFN terminator in a middle entry", path);
+                break;
+            }
+        }
+    }
+    lfn->next = seq - 1;
+    lfn->count++;
+}
+
+static void _checkDir(Fsck *ck, const char *path, uint32_t cluster,
+uint32_t parent, int depth);
+
+static void _checkFile(Fsck *ck, const char *path, uint32_t cluster,
+uint32_t size) {
+    //a file's chain has to cover its size. it may be longer, if writing
+    //it was interrupted; those clusters are wasted, not lost.
+    uint32_t clusterSize = ck->spc * FSTEST_SECTOR_SIZE;
+    uint32_t need = (uint32_t)(((uint64_t)size + clusterSize - 1) /
+        clusterSize);
+    uint32_t *list = NULL, count = 0;
+    if(cluster) count = _walkChain(ck, path, cluster, &list);
+    else if(size) _error(ck, "%s: %u bytes but no clusters", path, size);
+
+    if(count < need) {
+        _error(ck, "%s: %u clusters, but %u bytes needs %u", path, count,
+            size, need);
+    }
+    else ck->out->excessClusters += count - need;
+
+    if(ck->tree && count >= need) {
+        uint8_t *data = (uint8_t*)malloc(size ? size : 1);
+        for(uint32_t i=0; i<need; i++) {
+            uint32_t len = MIN(clusterSize, size - (i * clusterSize));
+            memcpy(&data[i * clusterSize], _cluster(ck, list[i]), len);
+        }
+        treeSet(ck->tree, path, false, data, size);
+        free(data);
+    }
+    if(list) free(list);
+    ck->out->numFiles++;
+}
+
+static void _checkEntry(Fsck *ck, const char *dirPath, uint32_t dirCluster,
+NameList *names, LongName *lfn, const uint8_t *ent, uint32_t index,
+int depth) {
+    //check a directory entry that isn't free or an LFN entry.
+    uint8_t attr = ent[11];
+    uint32_t cluster = _get16(&ent[26]) | (_get16(&ent[20]) << 16);
+    uint32_t size = _get32(&ent[28]);
+    bool isRoot = (dirCluster == ck->rootCluster);
+    bool dot    = !memcmp(ent, ".          ", 11);
+    bool dotdot = !memcmp(ent, "..         ", 11);
+
+    if(attr & 0x08) { //volume label
+        _dropLfn(ck, lfn);
+        if(!isRoot) _error(ck, "%s: volume label in a subdirectory", dirPath);
+        return;
+    }
+    if(dot || dotdot) {
+        _dropLfn(ck, lfn);
+        if(isRoot) _error(ck, "%s: \"%s\" in root directory", dirPath,
+            dot ? "." : "..");
+        else if(index != (dot ? 0 : 1) || !(attr & 0x10)) {
+            _error(ck, "%s: misplaced \"%s\" entry", dirPath,
+                dot ? "." : "..");
+        }
+        return; //the entries they point to are checked by _checkDir()
+    }
+
+    //the 8.3 name has to be valid, even if there's a long name.
+    char name[MAX_NAME];
+    _shortName(ent, name);
+    bool valid = ent[0] != ' ';
+    for(int i=0; i<11; i++) {
+        if(!_validShortChar(ent[i]) && !(i == 0 && ent[i] == 0x05)) {
+            valid = false;
+        }
+    }
+    if(!valid) _error(ck, "%s: invalid 8.3 name \"%.11s\"", dirPath, ent);
+
+    if(lfn->active && lfn->next == 0 && lfn->checksum == _checksum(ent)) {
+        _utf16ToUtf8(lfn->chars, lfn->length, name);
+        lfn->active = false;
+    }
+    else _dropLfn(ck, lfn);
+
+    char path[FSTEST_MAX_PATH];
+    if(snprintf(path, sizeof(path), "%s/%s", isRoot ? "" : dirPath, name)
+    >= (int)sizeof(path)) {
+        _error(ck, "%s/%s: path too long for fstest", dirPath, name);
+        return;
+    }
+    if(!_addName(names, ent, name)) _error(ck, "%s: duplicate name", path);
+
+    if(attr & 0x10) {
+        if(size) _error(ck, "%s: directory with size %u", path, size);
+        if(cluster < 2) _error(ck, "%s: directory without a cluster", path);
+        else if(depth >= MAX_DEPTH) _error(ck, "%s: too deep", path);
+        else _checkDir(ck, path, cluster, dirCluster, depth + 1);
+    }
+    else _checkFile(ck, path, cluster, size);
+}
+
+static void _checkDir(Fsck *ck, const char *path, uint32_t cluster,
+uint32_t parent, int depth) {
+    uint32_t *list = NULL;
+    uint32_t count = _walkChain(ck, path, cluster, &list);
+    if(!count) return;
+    bool isRoot = (cluster == ck->rootCluster);
+    if(!isRoot) {
+        ck->out->numDirs++;
+        if(ck->tree) treeSet(ck->tree, path, true, NULL, 0);
+    }
+
+    NameList names;
+    memset(&names, 0, sizeof(names));
+    LongName *lfn = (LongName*)malloc(sizeof(LongName));
+    lfn->active = false;
+    uint32_t perCluster = ck->spc * FSTEST_SECTOR_SIZE / ENTRY_SIZE;
+    uint32_t num = count * perCluster;
+    bool sawDot = false, sawDotDot = false;
+
+    for(uint32_t i=0; i<num; i++) {
+        const uint8_t *ent = _cluster(ck, list[i / perCluster]) +
+            ((i % perCluster) * ENTRY_SIZE);
+        if(ent[0] == 0x00) break; //end of directory
+        if(ent[0] == 0xE5) { //deleted
+            _dropLfn(ck, lfn);
+            continue;
+        }
+        if((ent[11] & 0x3F) == 0x0F) {
+            _addLfn(ck, path, lfn, ent);
+            continue;
+        }
+        if(!isRoot && i < 2) {
+            //"." refers to this directory, and ".." to its parent, or 0
+            //for the root.
+            uint32_t target = _get16(&ent[26]) | (_get16(&ent[20]) << 16);
+            uint32_t expect = i ? (parent == ck->rootCluster ? 0 : parent)
+                : cluster;
+            const char *want = i ? "..         " : ".          ";
+            if(memcmp(ent, want, 11)) continue; //reported below
+            if(target != expect) {
+                _error(ck, "%s: \"%s\" refers to cluster %u, not %u", path,
+                    i ? ".." : ".", target, expect);
+            }
+            if(i) sawDotDot = true;
+            else  sawDot    = true;
+        }
+        _checkEntry(ck, path, cluster, &names, lfn, ent, i, depth);
+    }
+    _dropLfn(ck, lfn);
+    if(!isRoot && !(sawDot && sawDotDot)) {
+        _error(ck, "%s: no \".\" and \"..\" entries", path);
+    }
+
+    free(lfn);
+    free(list);
+    if(names.shortNames) free(names.shortNames);
+    if(names.longNames) free(names.longNames);
+}
+
+
+/* ---------------------------------- API --------------------------------- */
+
+int fsckFat(FsTestDev *dev, uint64_t start, FsckResult *out,
+FsTestTree *tree, int verbose) {
+    /** Check a FAT32 volume.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param out Receives the results.
+     *  @param tree If not NULL, receives the volume's files and directories.
+     *   It should be empty.
+     *  @param verbose Whether to print each problem found.
+     *  @return 0 if the volume was checked (even if there are errors), or
+     *   negative error code if it couldn't be, eg -EILSEQ if it's not FAT32.
+     */
+    memset(out, 0, sizeof(FsckResult));
+    if(start >= dev->numSectors) return -ERANGE;
+    const uint8_t *boot = &dev->data[start * FSTEST_SECTOR_SIZE];
+    uint32_t spc      = boot[13];
+    uint32_t reserved = _get16(&boot[14]);
+    uint32_t numFats  = boot[16];
+    uint32_t total    = _get16(&boot[19]) ? _get16(&boot[19]) :
+        _get32(&boot[32]);
+    uint32_t spf      = _get32(&boot[36]);
+    uint16_t flags    = _get16(&boot[40]);
+    if(boot[510] != 0x55 || boot[511] != 0xAA
+    || _get16(&boot[11]) != FSTEST_SECTOR_SIZE || !spc || (spc & (spc - 1))
+    || !reserved || !numFats || _get16(&boot[17]) || _get16(&boot[22])
+    || !spf || start + total > dev->numSectors
+    || reserved + (numFats * spf) + spc > total) {
+        if(verbose) printf("fsck: not a FAT32 volume\n");
+        return -EILSEQ;
+    }
+
+    Fsck ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.dev         = dev;
+    ck.out         = out;
+    ck.tree        = tree;
+    ck.verbose     = verbose;
+    ck.spc         = spc;
+    ck.rootCluster = _get32(&boot[44]);
+    ck.dataStart   = start + reserved + (numFats * spf);
+    ck.numClusters = (total - reserved - (numFats * spf)) / spc;
+    if(ck.numClusters + 2 > spf * (FSTEST_SECTOR_SIZE / 4)) {
+        ck.numClusters = (spf * (FSTEST_SECTOR_SIZE / 4)) - 2;
+    }
+    out->sectorsPerCluster = spc;
+    out->numClusters       = ck.numClusters;
+
+    //the copies of the FAT should be the same, unless mirroring is off.
+    uint64_t fatStart = start + reserved;
+    uint32_t active = (flags & 0x80) ? (flags & 0x0F) : 0;
+    if(active >= numFats) {
+        _error(&ck, "active FAT %u doesn't exist", active);
+        active = 0;
+    }
+    if(!(flags & 0x80)) {
+        for(uint32_t f=1; f<numFats; f++) {
+            for(uint32_t i=0; i<spf; i++) {
+                if(memcmp(_sector(&ck, fatStart + i),
+                _sector(&ck, fatStart + ((uint64_t)f * spf) + i),
+                FSTEST_SECTOR_SIZE)) {
+                    out->fatDiffSectors++;
+                    if(verbose > 1) {
+                        printf("fsck: FAT %u differs in sector %u\n", f, i);
+                    }
+                }
+            }
+        }
+    }
+
+    ck.fat   = (uint32_t*)malloc((ck.numClusters + 2) * sizeof(uint32_t));
+    ck.owner = (uint32_t*)calloc(ck.numClusters + 2, sizeof(uint32_t));
+    if(!ck.fat || !ck.owner) {
+        if(ck.fat) free(ck.fat);
+        if(ck.owner) free(ck.owner);
+        return -ENOMEM;
+    }
+    const uint8_t *fat = _sector(&ck, fatStart + ((uint64_t)active * spf));
+    for(uint32_t i=0; i<ck.numClusters + 2; i++) {
+        ck.fat[i] = _get32(&fat[i * 4]) & 0x0FFFFFFF;
+    }
+    if((ck.fat[0] & 0xFF) != boot[21] || (ck.fat[0] | 0xFF) != 0x0FFFFFFF) {
+        _error(&ck, "FAT[0] is 0x%08X, media 0x%02X", ck.fat[0], boot[21]);
+    }
+
+    //walk the tree, claiming clusters; anything allocated that isn't
+    //claimed is lost.
+    _checkDir(&ck, "/", ck.rootCluster, 0, 0);
+    for(uint32_t c=2; c<ck.numClusters + 2; c++) {
+        if(ck.fat[c] == 0) out->freeClusters++;
+        else if(ck.fat[c] != FAT_BAD && !ck.owner[c]) out->lostClusters++;
+    }
+
+    //FSInfo only holds hints, but they have to be valid ones.
+    uint32_t infoSector = _get16(&boot[48]);
+    out->fsInfoFree = out->fsInfoNext = 0xFFFFFFFF;
+    if(infoSector && infoSector < reserved) {
+        const uint8_t *info = _sector(&ck, start + infoSector);
+        if(_get32(&info[0]) != 0x41615252 || _get32(&info[484]) != 0x61417272
+        || _get32(&info[508]) != 0xAA550000) {
+            _error(&ck, "FSInfo signatures are wrong");
+        }
+        else {
+            out->fsInfoFree = _get32(&info[488]);
+            out->fsInfoNext = _get32(&info[492]);
+            if(out->fsInfoFree != 0xFFFFFFFF
+            && out->fsInfoFree > ck.numClusters) {
+                _error(&ck, "FSInfo says %u free of %u clusters",
+                    out->fsInfoFree, ck.numClusters);
+            }
+        }
+    }
+    uint32_t backup = _get16(&boot[50]);
+    if(backup && backup < reserved
+    && memcmp(boot, _sector(&ck, start + backup), FSTEST_SECTOR_SIZE)) {
+        _error(&ck, "backup boot sector differs");
+    }
+
+    if(verbose > 1) {
+        printf("fsck: %u files, %u dirs, %u/%u clusters free (FSInfo %u), "
+            "%u lost, %u excess, %u orphan LFNs, %u FAT sectors differ, "
+            "%u errors\n", out->numFiles, out->numDirs, out->freeClusters,
+            ck.numClusters, out->fsInfoFree, out->lostClusters,
+            out->excessClusters, out->orphanLfns, out->fatDiffSectors,
+            out->errors);
+    }
+    free(ck.fat);
+    free(ck.owner);
+    return 0;
+}
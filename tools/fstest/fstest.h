@@ -0,0 +1,185 @@
+/** fstest: run the filesystem drivers on a PC, against a block device in
+ *  memory, and check what they leave on it.
+ *  blkdev.c is the block device. It can lose power after any number of
+ *  sector writes, after which it drops everything written to it, so a test
+ *  can stop a driver at every point it could be interrupted on a real card.
+ *  mkfs.c formats it, and fsck.c checks it; mkexfat.c and exfsck.c do the
+ *  same for exFAT. None of them uses the drivers' code or structures; they
+ *  read and write the bytes the way the specifications describe, so they
+ *  don't share the drivers' mistakes.
+ *  tree.c keeps track of what a volume should contain, and raw.c lets tests
+ *  look at or change a volume's structures directly.
+ */
+#ifndef _MICRON_FSTEST_H_
+#define _MICRON_FSTEST_H_
+
+#include <drivers/fs/fat/fat.h>
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define FSTEST_SECTOR_SIZE 512
+#define FSTEST_NEVER UINT64_MAX //for FsTestDev.cutAt
+#define FSTEST_MAX_PATH 160
+#define FSTEST_TIMEOUT 1000 //ms, for driver calls
+
+typedef struct {
+    //A block device in memory. `file` is what the drivers are given.
+    MicronFILE file;
+    uint8_t *data;
+    uint32_t numSectors;
+    uint32_t seed;        //changes the junk in unwritten sectors
+    //power loss: once `cutAt` sectors have been written (counting each
+    //discard as one), every write and discard fails with -EIO and changes
+    //nothing, until the test turns the power back on.
+    uint64_t cutAt;
+    bool     cut;         //whether power was lost
+    uint64_t writes;      //sectors written (and discards) so far
+    uint64_t reads;       //sectors read so far
+    uint64_t readRequests; //and the number of read() calls
+    uint64_t writeRequests; //and of write() calls
+    uint64_t discards;    //sectors discarded so far
+    uint8_t *discarded;   //byte per sector: discarded, not written since
+    //if not NULL, each sector read is recorded here, until it's full.
+    uint32_t *trace;
+    uint32_t traceLen, traceSize;
+} FsTestDev;
+
+typedef struct {
+    //What fsckFat() found.
+    //problems that mean data is wrong, lost or unreadable:
+    uint32_t errors;
+    //leftovers that an interrupted write may leave behind, which a real
+    //fsck cleans up without losing anything:
+    uint32_t lostClusters;   //allocated, but not in any chain
+    uint32_t excessClusters; //in a file's chain, beyond its size
+    uint32_t orphanLfns;     //LFN entries without their 8.3 entry
+    uint32_t fatDiffSectors; //sectors in which the copies of the FAT differ
+    //the volume:
+    uint32_t sectorsPerCluster;
+    uint32_t numClusters;
+    uint32_t freeClusters;
+    uint32_t fsInfoFree;     //FSInfo's free cluster count (a hint)
+    uint32_t fsInfoNext;     //and next free cluster hint
+    uint32_t numFiles, numDirs;
+    bool     dirty;          //exFAT: marked as not cleanly unmounted
+} FsckResult;
+
+typedef struct {
+    char     path[FSTEST_MAX_PATH]; //eg "/logs/a.txt"
+    bool     isDir;
+    uint32_t size;
+    uint8_t *data;       //size bytes (NULL for directories)
+} FsTestNode;
+
+typedef struct {
+    //A FAT32 volume's layout, from volOpen().
+    FsTestDev *dev;
+    uint64_t start;          //sector it begins at
+    uint32_t spc;            //sectors per cluster
+    uint32_t reserved;       //reserved sectors
+    uint32_t numFats;
+    uint32_t sectorsPerFat;
+    uint32_t rootCluster;
+    uint64_t dataStart;      //first sector of cluster 2
+    uint32_t numClusters;
+} FsTestVol;
+
+typedef struct {
+    //How mkfsExfat() lays out a volume. Formatters differ in these, and
+    //the driver mustn't depend on any of them.
+    uint8_t  sectorsPerCluster;
+    uint32_t align;          //start the FAT and the cluster heap on a
+                             //multiple of this many sectors (0 = packed)
+    bool     upcaseFirst;    //up-case table before the allocation bitmap,
+                             //on the disk and in the root directory
+    bool     fullUpcase;     //up-case table uncompressed (128 KiB)
+    bool     sparseFat;      //only write the FAT sectors that are used,
+                             //leaving junk in the rest
+    const char *label;       //volume label entry before the others, or NULL
+} ExfatFormat;
+
+typedef struct {
+    //A directory tree and the contents of its files.
+    FsTestNode *nodes;
+    uint32_t count, capacity;
+} FsTestTree;
+
+//blkdev.c
+int devInit(FsTestDev *dev, uint32_t numSectors, uint32_t seed);
+void devFree(FsTestDev *dev);
+void devPower(FsTestDev *dev, uint64_t cutAfter);
+int devLoad(FsTestDev *dev, const char *path);
+int devSave(FsTestDev *dev, const char *path);
+uint32_t fsTestRandom(uint32_t *state);
+void fsTestFill(uint8_t *buf, uint32_t len, uint32_t seed);
+
+//mkfs.c
+int mkfsFat(FsTestDev *dev, uint64_t start, uint32_t numSectors,
+    uint8_t sectorsPerCluster, uint8_t numFats);
+
+//fsck.c
+int fsckFat(FsTestDev *dev, uint64_t start, FsckResult *out,
+    FsTestTree *tree, int verbose);
+
+//mkexfat.c
+int mkfsExfat(FsTestDev *dev, uint64_t start, uint32_t numSectors,
+    const ExfatFormat *fmt);
+
+//exfsck.c
+int fsckExfat(FsTestDev *dev, uint64_t start, FsckResult *out,
+    FsTestTree *tree, int verbose);
+
+//tree.c
+void treeInit(FsTestTree *tree);
+void treeFree(FsTestTree *tree);
+int treeCopy(FsTestTree *dest, const FsTestTree *src);
+FsTestNode* treeFind(const FsTestTree *tree, const char *path);
+int treeSet(FsTestTree *tree, const char *path, bool isDir,
+    const void *data, uint32_t size);
+void treeRemove(FsTestTree *tree, const char *path);
+uint32_t treeCompare(const FsTestTree *actual, const FsTestTree *expected,
+    const FsTestTree *orExpected, bool sectorMix, int verbose);
+
+//raw.c
+int volOpen(FsTestDev *dev, uint64_t start, FsTestVol *out);
+uint8_t* volFatEntry(FsTestVol *vol, uint32_t fat, uint32_t cluster);
+uint32_t volGetFat(FsTestVol *vol, uint32_t cluster);
+void volSetFat(FsTestVol *vol, uint32_t cluster, uint32_t value);
+uint8_t* volCluster(FsTestVol *vol, uint32_t cluster);
+uint32_t volChain(FsTestVol *vol, uint32_t first, uint32_t *out,
+    uint32_t max);
+uint8_t* volFindEntry(FsTestVol *vol, uint32_t dir, const char *name);
+uint32_t volEntryCluster(const uint8_t *ent);
+
+//fsutil.c
+int fsTestAppend(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+    const char *path, uint32_t size, uint32_t seed);
+int fsTestList(FILE *blkdev, fat32_mbr *mbr, FsTestTree *tree);
+uint32_t fsTestVerify(FsTestDev *dev, uint64_t start, FsTestTree *outTree,
+    FsckResult *outResult, int verbose);
+
+//tests. each returns the number of failures.
+uint32_t testPowerLoss(int verbose); //powerloss.c
+uint32_t testClusters(int verbose); //clusters.c
+uint32_t testExtents(int verbose); //extents.c
+uint32_t testFatCache(int verbose); //fatcache.c
+uint32_t testDirs(int verbose); //dirs.c
+uint32_t testDentry(int verbose); //dentry.c
+uint32_t testScan(int verbose); //scan.c
+uint32_t testExfat(int verbose); //exfat.c
+uint32_t testRecStore(int verbose); //recstore.c
+uint32_t testAnalyze(int verbose); //analyze.c
+uint32_t testViews(int verbose); //views.c
+uint32_t testFileCls(int verbose); //filecls.c
+
+//bench.c
+int cacheBench(int verbose);
+int readAheadBench(const char *image, uint64_t start, int verbose);
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#endif //_MICRON_FSTEST_H_
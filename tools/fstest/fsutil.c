@@ -0,0 +1,146 @@
+/** Helpers for the tests: reading a whole volume through the driver, and
+ *  checking it against fsck.c.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <drivers/fs/fat/fat.h>
+    #include "fstest.h"
+}
+
+static int _listDir(FILE *blkdev, fat32_mbr *mbr, uint32_t cluster,
+const char *path, FsTestTree *tree, int depth) {
+    MicronFatDir *dir = (MicronFatDir*)malloc(sizeof(MicronFatDir));
+    micronDirent *ent = (micronDirent*)malloc(sizeof(micronDirent));
+    int err = (dir && ent) ? 0 : -ENOMEM;
+    if(!err) err = fatOpenDir(mbr, cluster, dir);
+    while(!err) {
+        err = fatReadDirNext(blkdev, mbr, dir, ent, FSTEST_TIMEOUT);
+        if(err) break;
+        if(ent->attributes & FAT_ATTR_VOLUME_LABEL) continue;
+        if(!strcmp(ent->name, ".") || !strcmp(ent->name, "..")) continue;
+
+        char sub[FSTEST_MAX_PATH];
+        if(snprintf(sub, sizeof(sub), "%s/%s", path, ent->name)
+        >= (int)sizeof(sub)) {
+            err = -ENAMETOOLONG;
+            break;
+        }
+        if(ent->attributes & FAT_ATTR_DIRECTORY) {
+            //a corrupt volume may have directories in a loop.
+            err = treeSet(tree, sub, true, NULL, 0);
+            if(!err && (depth >= 32 || tree->count > 100000)) err = -ELOOP;
+            if(!err) err = _listDir(blkdev, mbr, ent->cluster, sub, tree,
+                depth + 1);
+            continue;
+        }
+
+        MicronFatFile file;
+        uint8_t *data = (uint8_t*)malloc(ent->size ? ent->size : 1);
+        if(!data) err = -ENOMEM;
+        if(!err) err = fatOpenFile(ent, &file, FAT_DEFAULT_MAX_EXTENTS);
+        if(!err) {
+            err = fatReadFile(blkdev, mbr, &file, 0, ent->size, data,
+                FSTEST_TIMEOUT);
+            if(err >= 0 && (uint32_t)err != ent->size) err = -EIO;
+            if(err >= 0) err = treeSet(tree, sub, false, data, ent->size);
+            fatCloseFile(&file);
+        }
+        if(data) free(data);
+    }
+    if(dir) free(dir);
+    if(ent) free(ent);
+    return (err == -ENOENT) ? 0 : err;
+}
+
+
+int fsTestAppend(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+const char *path, uint32_t size, uint32_t seed) {
+    /** Append to a file through the driver, creating it if it's not in
+     *  the model, and do the same to the model.
+     *  @param dev The block device.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param model What the volume should contain.
+     *  @param path The file.
+     *  @param size Number of bytes to append.
+     *  @param seed For fsTestFill(), to make the data.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    MicronFatFile file;
+    FsTestNode *node = treeFind(model, path);
+    int err = node ?
+        fatOpenPath(&dev->file, mbr, path, &file, FAT_DEFAULT_MAX_EXTENTS,
+            FSTEST_TIMEOUT) :
+        fatCreate(&dev->file, mbr, path, 0, &file, FAT_DEFAULT_MAX_EXTENTS,
+            FSTEST_TIMEOUT);
+    if(err) return err;
+
+    uint32_t oldSize = node ? node->size : 0;
+    uint8_t *data = (uint8_t*)malloc(oldSize + size + 1);
+    if(!data) err = -ENOMEM;
+    if(!err) {
+        if(oldSize) memcpy(data, node->data, oldSize);
+        fsTestFill(&data[oldSize], size, seed);
+        err = fatAppendFile(&dev->file, mbr, &file, &data[oldSize], size,
+            FSTEST_TIMEOUT);
+        if(err >= 0) err = (err == (int)size) ? 0 : -EIO;
+    }
+    if(!err) err = treeSet(model, path, false, data, oldSize + size);
+    if(data) free(data);
+    fatCloseFile(&file);
+    return err;
+}
+
+
+int fsTestList(FILE *blkdev, fat32_mbr *mbr, FsTestTree *tree) {
+    /** Read every file and directory on a volume, through the driver.
+     *  @param blkdev Block device.
+     *  @param mbr The filesystem's MBR, from fatMount().
+     *  @param tree Receives the files and directories. It should be empty.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    return _listDir(blkdev, mbr, 0, "", tree, 0);
+}
+
+
+uint32_t fsTestVerify(FsTestDev *dev, uint64_t start, FsTestTree *outTree,
+FsckResult *outResult, int verbose) {
+    /** Check a volume with fsck, then mount it and read everything through
+     *  the driver, which must find the same files with the same contents.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param outTree Receives the volume's files and directories. It
+     *   should be empty.
+     *  @param outResult Receives fsck's results.
+     *  @param verbose Whether to print problems.
+     *  @return Number of problems found: fsck's errors (in which case the
+     *   driver isn't tried), or one if the driver couldn't read the volume
+     *   or saw something different.
+     *  @note The volume is unmounted again afterward, so the driver may
+     *   update FSInfo, as it would on any mount.
+     */
+    uint32_t problems = 0;
+    int err = fsckFat(dev, start, outResult, outTree, verbose);
+    if(err) return 1;
+    if(outResult->errors) return outResult->errors; //no point going on
+
+    fat32_mbr mbr;
+    FsTestTree listed;
+    treeInit(&listed);
+    err = fatMount(&dev->file, start, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    if(!err) {
+        err = fsTestList(&dev->file, &mbr, &listed);
+        int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+        if(!err) err = err2;
+    }
+    if(err) {
+        if(verbose) printf("driver couldn't read the volume: %d\n", err);
+        problems++;
+    }
+    else if(treeCompare(&listed, outTree, NULL, false, verbose)) {
+        if(verbose) printf("driver and fsck see different files\n");
+        problems++;
+    }
+    treeFree(&listed);
+    return problems;
+}
@@ -0,0 +1,159 @@
+/** fstest: run the filesystem drivers on a PC and check what they do.
+ *  fstest [-v] check [test...]
+ *  fstest [-v] fsck image [start]
+ *  fstest [-v] bench [image [start]]
+ *  See README.md.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <unistd.h>
+    #include "fstest.h"
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*run)(int verbose);
+    const char *description;
+} tests[] = {
+    {"powerloss", testPowerLoss,
+        "FAT: power lost at every sector write of a list of operations"},
+    {"clusters", testClusters,
+        "FAT: reads and writes across boundaries with every cluster size"},
+    {"extents", testExtents,
+        "FAT: cluster lookups in fragmented files, with maps of each size"},
+    {"fatcache", testFatCache,
+        "FAT: sector cache hits, LRU order, and writing back to each FAT"},
+    {"dirs", testDirs,
+        "FAT: long names, broken entries, and a directory of 2000 files"},
+    {"dentry", testDentry,
+        "FAT: path lookup cache hits, invalidation, and LRU order"},
+    {"scan", testScan,
+        "FAT: free cluster scan with changes mid-scan, and FSInfo"},
+    {"analyze", testAnalyze,
+        "FAT: fragmentation analysis, against the FAT on the disk"},
+    {"views", testViews,
+        "FAT: views with every cache block pinned, and writes under them"},
+    {"filecls", testFileCls,
+        "FAT: files through read(), fseek() and write(), and open flags"},
+    {"exfat", testExfat,
+        "exFAT: power loss at every write, on several layouts, and names"},
+    {"recstore", testRecStore,
+        "record store: power lost at every sector, cleanly or not"},
+};
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static void usage() {
+    printf(
+        "usage: fstest [-v] check [test...]\n"
+        "       fstest [-v] fsck image [start]\n"
+        "       fstest [-v] bench [image [start]]\n"
+        "  check  run the tests (default: all); exits 1 if any fail\n"
+        "  fsck   check a FAT32 or exFAT image, whose volume begins at sector\n"
+        "         `start` (default 0); exits 1 if there are errors\n"
+        "  bench  compare the block cache's hit rates with random\n"
+        "         replacement, and count the reads made through files with\n"
+        "         read-ahead; or just the latter, on the files of an image\n"
+        "options:\n"
+        "  -v     show each problem; twice for more detail\n"
+        "tests:\n");
+    for(size_t i=0; i<NUM_TESTS; i++) {
+        printf("  %-10s %s\n", tests[i].name, tests[i].description);
+    }
+}
+
+
+static int cmdCheck(int argc, char **argv, int verbose) {
+    uint32_t failures = 0;
+    for(size_t i=0; i<NUM_TESTS; i++) {
+        bool wanted = !argc;
+        for(int j=0; j<argc; j++) wanted |= !strcmp(argv[j], tests[i].name);
+        if(!wanted) continue;
+        printf("%s:\n", tests[i].name);
+        uint32_t n = tests[i].run(verbose);
+        printf("%s: %s\n", tests[i].name, n ? "FAILED" : "ok");
+        failures += n;
+    }
+    for(int j=0; j<argc; j++) {
+        bool found = false;
+        for(size_t i=0; i<NUM_TESTS; i++) found |= !strcmp(argv[j],
+            tests[i].name);
+        if(!found) {
+            printf("no test named %s\n", argv[j]);
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
+
+
+static int cmdFsck(const char *path, uint64_t start, int verbose) {
+    FsTestDev dev;
+    int err = devLoad(&dev, path);
+    if(err) {
+        printf("can't load %s: %s\n", path, strerror(-err));
+        return 2;
+    }
+    FsckResult result;
+    bool exfat = start < dev.numSectors && !memcmp(
+        &dev.data[(start * FSTEST_SECTOR_SIZE) + 3], "EXFAT   ", 8);
+    if(exfat) err = fsckExfat(&dev, start, &result, NULL,
+        verbose ? verbose : 1);
+    else err = fsckFat(&dev, start, &result, NULL, verbose ? verbose : 1);
+    devFree(&dev);
+    if(err) return 2;
+    if(exfat) {
+        printf("exFAT: %u files, %u directories, %u/%u clusters free, %s, "
+            "%u errors\n", result.numFiles, result.numDirs,
+            result.freeClusters, result.numClusters,
+            result.dirty ? "dirty" : "clean", result.errors);
+        printf("%u lost clusters, %u excess, %u orphan entries\n",
+            result.lostClusters, result.excessClusters, result.orphanLfns);
+        return result.errors ? 1 : 0;
+    }
+    printf("%u files, %u directories, %u/%u clusters free (FSInfo: %u), "
+        "%u errors\n", result.numFiles, result.numDirs, result.freeClusters,
+        result.numClusters, result.fsInfoFree, result.errors);
+    printf("%u lost clusters, %u excess, %u orphan LFN entries, "
+        "%u FAT sectors differ\n", result.lostClusters,
+        result.excessClusters, result.orphanLfns, result.fatDiffSectors);
+    return result.errors ? 1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "vh")) != -1) {
+        switch(opt) {
+            case 'v': verbose++; break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if(optind >= argc) {
+        usage();
+        return 2;
+    }
+    const char *cmd = argv[optind];
+    if(!strcmp(cmd, "check")) {
+        return cmdCheck(argc - optind - 1, &argv[optind + 1], verbose);
+    }
+    if(!strcmp(cmd, "bench")) {
+        if(optind + 1 < argc) {
+            uint64_t start = (optind + 2 < argc) ?
+                strtoull(argv[optind + 2], NULL, 0) : 0;
+            return readAheadBench(argv[optind + 1], start, verbose) ? 2 : 0;
+        }
+        int err = cacheBench(verbose);
+        if(!err) err = readAheadBench(NULL, 0, verbose);
+        return err ? 2 : 0;
+    }
+    if(!strcmp(cmd, "fsck") && optind + 1 < argc) {
+        uint64_t start = (optind + 2 < argc) ?
+            strtoull(argv[optind + 2], NULL, 0) : 0;
+        return cmdFsck(argv[optind + 1], start, verbose);
+    }
+    usage();
+    return 2;
+}
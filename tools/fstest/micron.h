@@ -0,0 +1,89 @@
+/** Stand-in for micron.h when building the filesystem drivers on a PC with
+ *  fstest. Provides just what they need, on top of the host's C library.
+ *  Micron's FILE and its I/O functions clash with the host's, so they're
+ *  renamed here; the block device in blkdev.c implements them.
+ */
+#ifndef _MICRON_H_
+#define _MICRON_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h> //same codes as errors.h
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define BIT(n) (1 << (n))
+#define PACKED __attribute__((packed))
+#define WEAK __attribute__((weak))
+#define INLINE static inline __attribute__((always_inline))
+#define MIN(a, b) ({         \
+	__typeof__ (a) _a = (a); \
+	__typeof__ (b) _b = (b); \
+	_a < _b ? _a : _b;       \
+})
+#define MAX(a, b) ({         \
+	__typeof__ (a) _a = (a); \
+	__typeof__ (b) _b = (b); \
+	_a > _b ? _a : _b;       \
+})
+
+//libs/io, renamed. blkdev.c provides the functions the drivers use, and
+//passes them on to the file class, as libs/io does; the block device
+//itself is class 0.
+#define FILE    MicronFILE
+#define read    micronRead
+#define write   micronWrite
+#define fseek   micronSeek
+#define discard micronDiscard
+#define sync    micronSync
+struct MicronFILE;
+typedef struct {
+	int (*close)      (FILE *self);
+	int (*read)       (FILE *self, void *dest, size_t len);
+	int (*write)      (FILE *self, const void *src, size_t len);
+	int (*seek)       (FILE *self, long int offset, int origin);
+	int (*peek)       (FILE *self, void *dest, size_t len);
+	int (*getWriteBuf)(FILE *self);
+	int (*sync)       (FILE *self);
+	int (*purge)      (FILE *self);
+	int (*discard)    (FILE *self, size_t len);
+} MicronFileClass;
+typedef struct MicronFILE {
+	uint8_t fileCls;
+	uint64_t offset;
+	union {
+		void*    ptr;
+		uint32_t u32;
+	} udata;
+} MicronFILE;
+int osRegisterFileClass(MicronFileClass *cls);
+int micronClose(FILE *self); //not close(), which blkdev.c uses for images
+int micronRead(FILE *self, void *dest, size_t len);
+int micronWrite(FILE *self, const void *src, size_t len);
+int micronSeek(FILE *self, long int offset, int origin);
+int micronDiscard(FILE *self, size_t len);
+int micronSync(FILE *self);
+
+//time is simulated; see blkdev.c. each sector read or written takes
+//125 us, so the drivers' time budgets (eg fatScanStep()) work out the same
+//on every PC.
+uint32_t millis();
+int rtcGet(uint32_t *outSecs, uint32_t *outUsecs);
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#include "libs/io/blockcache.h"
+#include "libs/io/partition.h"
+#include "drivers/hal/crc/crc.h"
+
+#endif //_MICRON_H_
@@ -0,0 +1,253 @@
+/** Formats an exFAT volume, independently of the driver.
+ *  No mkfs.exfat was available to make test images with, so this writes
+ *  one the way the exFAT specification describes: the boot region and its
+ *  backup with their checksum, the FAT, and in the cluster heap the
+ *  allocation bitmap, the up-case table and the root directory, each with
+ *  its chain in the FAT and found through entries in the root directory.
+ *  Formatters differ in where they put things, so ExfatFormat chooses
+ *  between the arrangements the specification allows; the driver mustn't
+ *  depend on any one of them.
+ *  The up-case table is made from a few ranges of Unicode (ASCII, Latin-1,
+ *  Latin Extended-A, Greek, Cyrillic and fullwidth Latin) rather than the
+ *  specification's full table, which is plenty to show that names are
+ *  compared with the table on the volume, and not some built-in one.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define BOOT_SECTORS 12 //in each copy of the boot region
+#define UPCASE_CHARS 0x10000
+
+static void _put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void _put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void _put64(uint8_t *p, uint64_t v) {
+    _put32(p, v);
+    _put32(&p[4], v >> 32);
+}
+
+static uint8_t* _sector(FsTestDev *dev, uint64_t sector) {
+    return &dev->data[sector * FSTEST_SECTOR_SIZE];
+}
+
+static uint32_t _roundUp(uint32_t n, uint32_t align) {
+    return ((n + align - 1) / align) * align;
+}
+
+
+static uint16_t _upper(uint16_t c) {
+    //the uppercase form of a character, for the ranges we cover.
+    if(c >= 'a' && c <= 'z') return c - 0x20;
+    if(c >= 0xE0 && c <= 0xFE && c != 0xF7) return c - 0x20;
+    if(c == 0xFF) return 0x178;
+    if(c >= 0x100 && c <= 0x137 && (c & 1)) return c - 1;
+    if(c >= 0x139 && c <= 0x148 && !(c & 1)) return c - 1;
+    if(c >= 0x14A && c <= 0x177 && (c & 1)) return c - 1;
+    if(c >= 0x179 && c <= 0x17E && !(c & 1)) return c - 1;
+    if(c == 0x3AC) return 0x386;
+    if(c >= 0x3AD && c <= 0x3AF) return c - 0x25;
+    if(c == 0x3C2) return 0x3A3; //final sigma
+    if(c >= 0x3B1 && c <= 0x3CB) return c - 0x20;
+    if(c == 0x3CC) return 0x38C;
+    if(c >= 0x3CD && c <= 0x3CE) return c - 0x3F;
+    if(c >= 0x430 && c <= 0x44F) return c - 0x20;
+    if(c >= 0x450 && c <= 0x45F) return c - 0x50;
+    if(c >= 0xFF41 && c <= 0xFF5A) return c - 0x20;
+    return c;
+}
+
+static uint32_t _makeUpcase(uint8_t *out, bool compress) {
+    //write the up-case table. compressed, a run of characters that map to
+    //themselves is 0xFFFF followed by its length. returns its size.
+    uint32_t len = 0;
+    for(uint32_t c=0; c<UPCASE_CHARS; ) {
+        uint32_t run = 0;
+        while(compress && c + run < UPCASE_CHARS && run < 0xFFFF
+        && _upper(c + run) == c + run) run++;
+        if(run > 2) {
+            _put16(&out[len], 0xFFFF);
+            _put16(&out[len + 2], run);
+            len += 4;
+            c += run;
+            continue;
+        }
+        _put16(&out[len], _upper(c));
+        len += 2;
+        c++;
+    }
+    return len;
+}
+
+static uint32_t _checksum(uint32_t sum, const uint8_t *data, uint32_t len,
+bool boot) {
+    //the boot region's and up-case table's checksum. the boot region's
+    //skips VolumeFlags and PercentInUse.
+    for(uint32_t i=0; i<len; i++) {
+        if(boot && (i == 106 || i == 107 || i == 112)) continue;
+        sum = ((sum & 1) ? 0x80000000UL : 0) + (sum >> 1) + data[i];
+    }
+    return sum;
+}
+
+
+int mkfsExfat(FsTestDev *dev, uint64_t start, uint32_t numSectors,
+const ExfatFormat *fmt) {
+    /** Format an exFAT volume.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param numSectors Size of the volume.
+     *  @param fmt How to lay it out.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Only the boot regions, the FAT (or with `fmt->sparseFat`, the
+     *   sectors of it that are used) and the system clusters are written.
+     *   The rest of the cluster heap is left as it was, which with
+     *   devInit() is junk, as on a used card.
+     */
+    uint32_t spc = fmt->sectorsPerCluster;
+    uint32_t align = fmt->align ? fmt->align : 1;
+    if(!spc || (spc & (spc - 1)) || spc > 128) return -EINVAL;
+    if(start + numSectors > dev->numSectors) return -ERANGE;
+    uint32_t shift = 0;
+    while((1U << shift) < spc) shift++;
+    uint32_t clusterSize = spc * FSTEST_SECTOR_SIZE;
+
+    //the FAT has to cover the clusters that are left after it, so find
+    //its size by trying until it fits.
+    uint32_t fatOffset = _roundUp(2 * BOOT_SECTORS, align);
+    uint32_t fatLength = 1, heapOffset, clusters;
+    while(1) {
+        heapOffset = _roundUp(fatOffset + fatLength, align);
+        if(heapOffset + (4 * spc) > numSectors) return -ENOSPC;
+        clusters = (numSectors - heapOffset) / spc;
+        uint32_t need = (((clusters + 2) * 4) + FSTEST_SECTOR_SIZE - 1) /
+            FSTEST_SECTOR_SIZE;
+        if(need <= fatLength) break;
+        fatLength = need;
+    }
+
+    //the system files, in order from cluster 2.
+    uint8_t *upcase = (uint8_t*)malloc(UPCASE_CHARS * 2);
+    if(!upcase) return -ENOMEM;
+    uint32_t upcaseSize = _makeUpcase(upcase, !fmt->fullUpcase);
+    uint32_t upcaseSum  = _checksum(0, upcase, upcaseSize, false);
+    uint32_t bitmapSize = (clusters + 7) / 8;
+    uint32_t bitmapClusters = (bitmapSize + clusterSize - 1) / clusterSize;
+    uint32_t upcaseClusters = (upcaseSize + clusterSize - 1) / clusterSize;
+    uint32_t bitmapCluster = fmt->upcaseFirst ? 2 + upcaseClusters : 2;
+    uint32_t upcaseCluster = fmt->upcaseFirst ? 2 : 2 + bitmapClusters;
+    uint32_t rootCluster   = 2 + bitmapClusters + upcaseClusters;
+    uint32_t used = bitmapClusters + upcaseClusters + 1;
+    if(used > clusters) {
+        free(upcase);
+        return -ENOSPC;
+    }
+    uint64_t fat  = start + fatOffset;
+    uint64_t heap = start + heapOffset;
+
+    //the FAT: the two reserved entries, then a chain for each file.
+    uint32_t *entries = (uint32_t*)malloc((used + 2) * sizeof(uint32_t));
+    if(!entries) {
+        free(upcase);
+        return -ENOMEM;
+    }
+    entries[0] = 0xFFFFFFF8; //media type
+    entries[1] = 0xFFFFFFFF;
+    const uint32_t firsts[3] = {bitmapCluster, upcaseCluster, rootCluster};
+    const uint32_t counts[3] = {bitmapClusters, upcaseClusters, 1};
+    for(int f=0; f<3; f++) {
+        for(uint32_t i=0; i<counts[f]; i++) {
+            entries[firsts[f] + i] = (i + 1 < counts[f]) ?
+                firsts[f] + i + 1 : 0xFFFFFFFF;
+        }
+    }
+    uint32_t perSector = FSTEST_SECTOR_SIZE / 4;
+    for(uint32_t s=0; s<fatLength; s++) {
+        if(fmt->sparseFat && s * perSector >= used + 2) break;
+        uint8_t *p = _sector(dev, fat + s);
+        memset(p, 0, FSTEST_SECTOR_SIZE);
+        for(uint32_t i=0; i<perSector && (s * perSector) + i < used + 2;
+        i++) {
+            _put32(&p[i * 4], entries[(s * perSector) + i]);
+        }
+    }
+    free(entries);
+
+    //the allocation bitmap, with the system clusters in use.
+    uint8_t *p = _sector(dev, heap + ((uint64_t)(bitmapCluster - 2) * spc));
+    memset(p, 0, bitmapClusters * clusterSize);
+    for(uint32_t i=0; i<used; i++) p[i / 8] |= 1 << (i % 8);
+
+    //the up-case table.
+    p = _sector(dev, heap + ((uint64_t)(upcaseCluster - 2) * spc));
+    memset(p, 0, upcaseClusters * clusterSize);
+    memcpy(p, upcase, upcaseSize);
+    free(upcase);
+
+    //the root directory, with entries for them.
+    uint8_t *root = _sector(dev, heap + ((uint64_t)(rootCluster - 2) * spc));
+    memset(root, 0, clusterSize);
+    uint8_t *ent = root;
+    if(fmt->label) {
+        ent[0] = 0x83;
+        ent[1] = strlen(fmt->label);
+        for(int i=0; i<ent[1] && i < 11; i++) {
+            _put16(&ent[2 + (i * 2)], fmt->label[i]);
+        }
+        ent += 32;
+    }
+    for(int t=0; t<2; t++) {
+        bool isUpcase = (t == 0) == fmt->upcaseFirst;
+        ent[0] = isUpcase ? 0x82 : 0x81;
+        if(isUpcase) _put32(&ent[4], upcaseSum);
+        _put32(&ent[20], isUpcase ? upcaseCluster : bitmapCluster);
+        _put64(&ent[24], isUpcase ? upcaseSize : bitmapSize);
+        ent += 32;
+    }
+
+    //the boot region: boot sector, 8 extended boot sectors, OEM
+    //parameters, a reserved sector, and the checksum of them all.
+    uint8_t *region = _sector(dev, start);
+    memset(region, 0, BOOT_SECTORS * FSTEST_SECTOR_SIZE);
+    uint8_t *boot = region;
+    boot[0] = 0xEB; boot[1] = 0x76; boot[2] = 0x90;
+    memcpy(&boot[3], "EXFAT   ", 8);
+    _put64(&boot[64], start);           //partition offset
+    _put64(&boot[72], numSectors);
+    _put32(&boot[80], fatOffset);
+    _put32(&boot[84], fatLength);
+    _put32(&boot[88], heapOffset);
+    _put32(&boot[92], clusters);
+    _put32(&boot[96], rootCluster);
+    _put32(&boot[100], 0x4D494352);     //serial
+    _put16(&boot[104], 0x0100);         //revision 1.00
+    _put16(&boot[106], 0);              //volume flags
+    boot[108] = 9;                      //log2(bytes per sector)
+    boot[109] = shift;                  //log2(sectors per cluster)
+    boot[110] = 1;                      //number of FATs
+    boot[111] = 0x80;                   //drive select
+    boot[112] = (used * 100) / clusters; //percent in use
+    boot[510] = 0x55; boot[511] = 0xAA;
+    for(int s=1; s<=8; s++) {
+        uint8_t *ext = &region[s * FSTEST_SECTOR_SIZE];
+        ext[510] = 0x55; ext[511] = 0xAA;
+    }
+    uint32_t sum = _checksum(0, region,
+        (BOOT_SECTORS - 1) * FSTEST_SECTOR_SIZE, true);
+    for(int i=0; i<FSTEST_SECTOR_SIZE; i += 4) {
+        _put32(&region[((BOOT_SECTORS - 1) * FSTEST_SECTOR_SIZE) + i], sum);
+    }
+    memcpy(_sector(dev, start + BOOT_SECTORS), region,
+        BOOT_SECTORS * FSTEST_SECTOR_SIZE);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/** Formats a FAT32 volume, independently of the driver.
+ *  The layout is the usual one: 32 reserved sectors with FSInfo at 1 and
+ *  backups of both at 6 and 7, then the FATs, then the data area with the
+ *  root directory in cluster 2. Volumes are allowed to have fewer than the
+ *  65525 clusters that the specification asks of FAT32, so that test images
+ *  stay small; the driver doesn't care, and neither does fsck.c.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define RESERVED_SECTORS 32
+
+static void _put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void _put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint8_t* _sector(FsTestDev *dev, uint64_t sector) {
+    return &dev->data[sector * FSTEST_SECTOR_SIZE];
+}
+
+
+int mkfsFat(FsTestDev *dev, uint64_t start, uint32_t numSectors,
+uint8_t sectorsPerCluster, uint8_t numFats) {
+    /** Format a FAT32 volume.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param numSectors Size of the volume.
+     *  @param sectorsPerCluster Cluster size, a power of 2 up to 128.
+     *  @param numFats Number of copies of the FAT, usually 2.
+     *  @return 0 on success, or negative error code on failure.
+     *  @note Only the reserved sectors, the FATs and the root directory are
+     *   written. The rest of the data area is left as it was, which with
+     *   devInit() is junk, as on a used card.
+     */
+    uint32_t spc = sectorsPerCluster;
+    if(!spc || (spc & (spc - 1)) || !numFats) return -EINVAL;
+    if(start + numSectors > dev->numSectors) return -ERANGE;
+
+    //the FAT has to cover the clusters that are left after it, so find
+    //its size by trying until it fits.
+    uint32_t spf = 1, clusters = 0;
+    while(1) {
+        uint32_t overhead = RESERVED_SECTORS + (numFats * spf);
+        if(overhead + spc >= numSectors) return -ENOSPC;
+        clusters = (numSectors - overhead) / spc;
+        uint32_t need = (((clusters + 2) * 4) + FSTEST_SECTOR_SIZE - 1) /
+            FSTEST_SECTOR_SIZE;
+        if(need <= spf) break;
+        spf = need;
+    }
+    if(clusters > 0x0FFFFFF5) return -EFBIG;
+
+    //boot sector, with the fields at their offsets in the specification.
+    uint8_t boot[FSTEST_SECTOR_SIZE];
+    memset(boot, 0, sizeof(boot));
+    boot[0] = 0xEB; boot[1] = 0x58; boot[2] = 0x90;
+    memcpy(&boot[3], "MICRON  ", 8);
+    _put16(&boot[11], FSTEST_SECTOR_SIZE);
+    boot[13] = spc;
+    _put16(&boot[14], RESERVED_SECTORS);
+    boot[16] = numFats;
+    boot[21] = 0xF8;                //fixed disk
+    _put16(&boot[24], 63);          //sectors per track
+    _put16(&boot[26], 255);         //heads
+    _put32(&boot[28], start);       //hidden sectors
+    _put32(&boot[32], numSectors);
+    _put32(&boot[36], spf);
+    _put32(&boot[44], 2);           //root directory cluster
+    _put16(&boot[48], 1);           //FSInfo sector
+    _put16(&boot[50], 6);           //backup boot sector
+    boot[64] = 0x80;                //drive number
+    boot[66] = 0x29;                //extended boot signature
+    _put32(&boot[67], 0x12345678);  //serial number
+    memcpy(&boot[71], "NO NAME    ", 11);
+    memcpy(&boot[82], "FAT32   ", 8);
+    boot[510] = 0x55; boot[511] = 0xAA;
+
+    //FSInfo. the root directory is the only cluster in use.
+    uint8_t info[FSTEST_SECTOR_SIZE];
+    memset(info, 0, sizeof(info));
+    _put32(&info[0], 0x41615252);
+    _put32(&info[484], 0x61417272);
+    _put32(&info[488], clusters - 1); //free clusters
+    _put32(&info[492], 3);            //next free cluster
+    _put32(&info[508], 0xAA550000);
+
+    for(uint32_t i=0; i<RESERVED_SECTORS; i++) {
+        memset(_sector(dev, start + i), 0, FSTEST_SECTOR_SIZE);
+        dev->discarded[start + i] = 0;
+    }
+    memcpy(_sector(dev, start + 0), boot, FSTEST_SECTOR_SIZE);
+    memcpy(_sector(dev, start + 1), info, FSTEST_SECTOR_SIZE);
+    memcpy(_sector(dev, start + 6), boot, FSTEST_SECTOR_SIZE);
+    memcpy(_sector(dev, start + 7), info, FSTEST_SECTOR_SIZE);
+
+    //FATs: media type, end of chain marker, and the root directory.
+    for(uint32_t f=0; f<numFats; f++) {
+        uint64_t fat = start + RESERVED_SECTORS + ((uint64_t)f * spf);
+        for(uint32_t i=0; i<spf; i++) {
+            memset(_sector(dev, fat + i), 0, FSTEST_SECTOR_SIZE);
+            dev->discarded[fat + i] = 0;
+        }
+        uint8_t *first = _sector(dev, fat);
+        _put32(&first[0], 0x0FFFFFF8);
+        _put32(&first[4], 0x0FFFFFFF);
+        _put32(&first[8], 0x0FFFFFFF);
+    }
+
+    //empty root directory.
+    uint64_t root = start + RESERVED_SECTORS + ((uint64_t)numFats * spf);
+    for(uint32_t i=0; i<spc; i++) {
+        memset(_sector(dev, root + i), 0, FSTEST_SECTOR_SIZE);
+        dev->discarded[root + i] = 0;
+    }
+    return 0;
+}
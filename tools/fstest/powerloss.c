@@ -0,0 +1,367 @@
+/** Power loss at every sector write.
+ *  A fixed list of operations (making directories, creating files with
+ *  short and long names, appending, overwriting, truncating and deleting)
+ *  is run once to count the sectors it writes. Then, for every one of those
+ *  writes, it's run again on a freshly formatted volume, with the power lost
+ *  at that write. Each time, the volume must pass fsck with nothing worse
+ *  than lost clusters and the like, the driver must read the same files as
+ *  fsck does, and those must be as they were before the operation that was
+ *  interrupted, or as they would be after it. (An interrupted overwrite may
+ *  leave each sector old or new.) Finally the driver must be able to mount
+ *  the volume and carry on using it.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define MAX_OPS 64
+#define START_SECTOR 63 //where the volume starts, as after an old-style MBR
+#define VOLUME_SECTORS 4096
+
+typedef enum {
+    OP_MKDIR,
+    OP_CREATE,
+    OP_APPEND,    //`size` bytes
+    OP_WRITE,     //overwrite `size` bytes at `offset`
+    OP_TRUNCATE,  //to `size` bytes
+    OP_DELETE,
+} OpType;
+
+typedef struct {
+    OpType   type;
+    char     path[FSTEST_MAX_PATH];
+    uint32_t offset, size;
+    uint32_t seed; //for the data written
+} Op;
+
+typedef struct {
+    uint8_t  sectorsPerCluster;
+    uint16_t cacheSize; //FAT sectors cached (0 = none)
+} Config;
+
+static const Config configs[] = {
+    {1, 2},
+    {4, FAT_DEFAULT_CACHE_SIZE},
+    {2, 0},
+};
+
+//what the volumes went through, to show that the interesting cases came up.
+static uint32_t sawLost, sawExcess, sawOrphans, sawFatDiff, sawMixed;
+
+
+static int addOp(Op *ops, int n, OpType type, const char *path,
+uint32_t offset, uint32_t size) {
+    ops[n].type   = type;
+    ops[n].offset = offset;
+    ops[n].size   = size;
+    ops[n].seed   = n + 1;
+    strcpy(ops[n].path, path);
+    return n + 1;
+}
+
+static int buildOps(Op *ops) {
+    int n = 0;
+    n = addOp(ops, n, OP_MKDIR,    "/logs", 0, 0);
+    n = addOp(ops, n, OP_CREATE,   "/logs/a.txt", 0, 0);
+    n = addOp(ops, n, OP_APPEND,   "/logs/a.txt", 0, 700);
+    n = addOp(ops, n, OP_APPEND,   "/logs/a.txt", 0, 3000);
+    n = addOp(ops, n, OP_CREATE,   "/Long File Name.dat", 0, 0);
+    n = addOp(ops, n, OP_APPEND,   "/Long File Name.dat", 0, 5120);
+    n = addOp(ops, n, OP_CREATE,   "/readme.txt", 0, 0); //lowercase 8.3
+    n = addOp(ops, n, OP_APPEND,   "/readme.txt", 0, 10);
+    n = addOp(ops, n, OP_WRITE,    "/logs/a.txt", 100, 1500);
+    n = addOp(ops, n, OP_TRUNCATE, "/logs/a.txt", 0, 1200);
+    n = addOp(ops, n, OP_TRUNCATE, "/Long File Name.dat", 0, 6000);
+    n = addOp(ops, n, OP_WRITE,    "/Long File Name.dat", 512, 4096);
+    //enough long names to need a second cluster for the directory, even
+    //with 4 sectors per cluster.
+    n = addOp(ops, n, OP_MKDIR,    "/logs/old", 0, 0);
+    for(int i=0; i<24; i++) {
+        char path[FSTEST_MAX_PATH];
+        sprintf(path, "/logs/old/Record number %02d.csv", i);
+        n = addOp(ops, n, OP_CREATE, path, 0, 0);
+        if(i % 6 == 0) n = addOp(ops, n, OP_APPEND, path, 0, 100 + i);
+    }
+    n = addOp(ops, n, OP_DELETE,   "/logs/old/Record number 06.csv", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/logs/a.txt", 0, 0);
+    n = addOp(ops, n, OP_CREATE,   "/logs/b.txt", 0, 0); //reuses a.txt's slot
+    n = addOp(ops, n, OP_APPEND,   "/logs/b.txt", 0, 2000);
+    n = addOp(ops, n, OP_TRUNCATE, "/logs/b.txt", 0, 0);
+    n = addOp(ops, n, OP_MKDIR,    "/tmp", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/tmp", 0, 0);
+    n = addOp(ops, n, OP_DELETE,   "/Long File Name.dat", 0, 0);
+    return n;
+}
+
+
+static int runOp(FsTestDev *dev, fat32_mbr *mbr, const Op *op) {
+    //do an operation through the driver.
+    FILE *blkdev = &dev->file;
+    if(op->type == OP_MKDIR) return fatMkdir(blkdev, mbr, op->path,
+        FSTEST_TIMEOUT);
+    if(op->type == OP_DELETE) return fatDelete(blkdev, mbr, op->path,
+        FSTEST_TIMEOUT);
+
+    MicronFatFile file;
+    int err;
+    if(op->type == OP_CREATE) err = fatCreate(blkdev, mbr, op->path, 0,
+        &file, FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    else err = fatOpenPath(blkdev, mbr, op->path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(err) return err;
+
+    uint8_t *data = (uint8_t*)malloc(op->size ? op->size : 1);
+    fsTestFill(data, op->size, op->seed);
+    switch(op->type) {
+        case OP_APPEND:
+            err = fatAppendFile(blkdev, mbr, &file, data, op->size,
+                FSTEST_TIMEOUT);
+            if(err >= 0) err = (err == (int)op->size) ? 0 : -EIO;
+            break;
+        case OP_WRITE:
+            err = fatWriteFile(blkdev, mbr, &file, op->offset, op->size,
+                data, FSTEST_TIMEOUT);
+            if(err >= 0) err = (err == (int)op->size) ? 0 : -EIO;
+            break;
+        case OP_TRUNCATE:
+            err = fatTruncateFile(blkdev, mbr, &file, op->size,
+                FSTEST_TIMEOUT);
+            break;
+        default: break;
+    }
+    free(data);
+    fatCloseFile(&file);
+    return err;
+}
+
+static void modelOp(FsTestTree *tree, const Op *op) {
+    //do the same operation to the model of what the volume should contain.
+    if(op->type == OP_MKDIR) {
+        treeSet(tree, op->path, true, NULL, 0);
+        return;
+    }
+    if(op->type == OP_CREATE) {
+        treeSet(tree, op->path, false, NULL, 0);
+        return;
+    }
+    if(op->type == OP_DELETE) {
+        treeRemove(tree, op->path);
+        return;
+    }
+
+    FsTestNode *node = treeFind(tree, op->path);
+    uint32_t size = node->size;
+    if(op->type == OP_APPEND) size += op->size;
+    if(op->type == OP_TRUNCATE) size = op->size;
+    uint8_t *data = (uint8_t*)calloc(size ? size : 1, 1);
+    memcpy(data, node->data, MIN(size, node->size));
+    if(op->type == OP_APPEND) fsTestFill(&data[node->size], op->size,
+        op->seed);
+    if(op->type == OP_WRITE) fsTestFill(&data[op->offset], op->size,
+        op->seed);
+    treeSet(tree, op->path, false, data, size);
+    free(data);
+}
+
+
+static int runOps(FsTestDev *dev, const Config *cfg, const Op *ops,
+int numOps, uint64_t cutAfter, int verbose) {
+    //mount the volume and run the operations, with power lost after
+    //`cutAfter` sector writes. returns the index of the operation it was
+    //lost during (numOps if during unmount, or if it wasn't), or negative
+    //error code if the driver failed for some other reason.
+    fat32_mbr mbr;
+    devPower(dev, cutAfter);
+    int err = fatMount(&dev->file, START_SECTOR, &mbr, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) return err; //mounting doesn't write
+
+    int i;
+    for(i=0; i<numOps; i++) {
+        //if FAT_SCAN_AT_MOUNT is 0, scan the FAT a bit at a time in
+        //between, as an application would when idle.
+        if(fatScanProgress(&mbr) < 100) {
+            err = fatScanStep(&dev->file, &mbr, 1, FSTEST_TIMEOUT);
+            if(dev->cut) break;
+            if(err < 0) break;
+        }
+        err = runOp(dev, &mbr, &ops[i]);
+        if(dev->cut) break;
+        if(err) break;
+    }
+    int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    if(dev->cut) return i;
+    if(err) {
+        if(verbose) printf("%s failed: %d\n", ops[i].path, err);
+        return err;
+    }
+    return err2 ? err2 : numOps;
+}
+
+
+static uint32_t recover(FsTestDev *dev, const Config *cfg,
+const FsTestTree *found, int verbose) {
+    //after power loss, the driver must be able to carry on using the
+    //volume, and leave it consistent, with FSInfo corrected.
+    fat32_mbr mbr;
+    int err = fatMount(&dev->file, START_SECTOR, &mbr, cfg->cacheSize,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("remount failed: %d\n", err);
+        return 1;
+    }
+    while(!err && fatScanProgress(&mbr) < 100) {
+        err = fatScanStep(&dev->file, &mbr, 100, FSTEST_TIMEOUT);
+        if(err > 0) err = 0;
+    }
+    MicronFatFile file;
+    uint8_t data[1000];
+    fsTestFill(data, sizeof(data), 999);
+    if(!err) err = fatCreate(&dev->file, &mbr, "/after.txt", 0, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!err) {
+        err = fatAppendFile(&dev->file, &mbr, &file, data, sizeof(data),
+            FSTEST_TIMEOUT);
+        if(err >= 0) err = (err == sizeof(data)) ? 0 : -EIO;
+        fatCloseFile(&file);
+    }
+    int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    if(!err) err = err2;
+    if(err) {
+        if(verbose) printf("using the volume after power loss failed: %d\n",
+            err);
+        return 1;
+    }
+
+    FsTestTree expected, after;
+    treeInit(&expected);
+    treeInit(&after);
+    treeCopy(&expected, found);
+    treeSet(&expected, "/after.txt", false, data, sizeof(data));
+    FsckResult result;
+    uint32_t problems = fsTestVerify(dev, START_SECTOR, &after, &result,
+        verbose);
+    if(treeCompare(&after, &expected, NULL, false, verbose)) {
+        if(verbose) printf("files changed after power loss\n");
+        problems++;
+    }
+    if(result.fatDiffSectors > 1) {
+        if(verbose) printf("%u FAT sectors differ\n", result.fatDiffSectors);
+        problems++;
+    }
+    if(result.fsInfoFree != result.freeClusters) {
+        if(verbose) printf("FSInfo says %u clusters are free, not %u\n",
+            result.fsInfoFree, result.freeClusters);
+        problems++;
+    }
+    treeFree(&expected);
+    treeFree(&after);
+    return problems;
+}
+
+
+static uint32_t checkCut(FsTestDev *dev, const Config *cfg, const Op *ops,
+int numOps, const FsTestTree *models, int opIdx, int verbose) {
+    //check the volume after power was lost during ops[opIdx].
+    devPower(dev, FSTEST_NEVER);
+    FsTestTree found;
+    treeInit(&found);
+    FsckResult result;
+    uint32_t problems = fsTestVerify(dev, START_SECTOR, &found, &result,
+        verbose);
+    if(result.fatDiffSectors > 1) {
+        if(verbose) printf("%u FAT sectors differ\n", result.fatDiffSectors);
+        problems++;
+    }
+
+    //it's as it was before the operation, or after it.
+    const FsTestTree *after = (opIdx < numOps) ? &models[opIdx + 1] : NULL;
+    bool mix = (opIdx < numOps) && ops[opIdx].type == OP_WRITE;
+    if(treeCompare(&found, &models[opIdx], after, mix, verbose)) {
+        if(verbose) printf("files aren't as before or after the operation\n");
+        problems++;
+    }
+    else if(mix && treeCompare(&found, &models[opIdx], after, false, 0)) {
+        sawMixed++;
+    }
+
+    if(result.lostClusters)   sawLost++;
+    if(result.excessClusters) sawExcess++;
+    if(result.orphanLfns)     sawOrphans++;
+    if(result.fatDiffSectors) sawFatDiff++;
+    if(!problems) problems += recover(dev, cfg, &found, verbose);
+    treeFree(&found);
+    return problems;
+}
+
+
+static uint32_t testConfig(const Config *cfg, int verbose) {
+    Op *ops = (Op*)malloc(MAX_OPS * sizeof(Op));
+    int numOps = buildOps(ops);
+    FsTestTree *models = (FsTestTree*)malloc((numOps + 1) *
+        sizeof(FsTestTree));
+    treeInit(&models[0]);
+    for(int i=0; i<numOps; i++) {
+        treeInit(&models[i+1]);
+        treeCopy(&models[i+1], &models[i]);
+        modelOp(&models[i+1], &ops[i]);
+    }
+
+    FsTestDev dev;
+    devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0);
+    mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS, cfg->sectorsPerCluster, 2);
+    size_t size = (size_t)dev.numSectors * FSTEST_SECTOR_SIZE;
+    uint8_t *pristine = (uint8_t*)malloc(size);
+    memcpy(pristine, dev.data, size);
+
+    //without power loss, to count the writes, and make sure it all works.
+    uint32_t failures = 0;
+    int done = runOps(&dev, cfg, ops, numOps, FSTEST_NEVER, verbose);
+    uint64_t numWrites = dev.writes;
+    if(done != numOps) {
+        printf("  spc=%u cache=%u: failed without power loss\n",
+            cfg->sectorsPerCluster, cfg->cacheSize);
+        failures++;
+    }
+    else failures += checkCut(&dev, cfg, ops, numOps, models, numOps,
+        verbose);
+
+    sawLost = sawExcess = sawOrphans = sawFatDiff = sawMixed = 0;
+    for(uint64_t cut=0; cut<numWrites && !failures; cut++) {
+        memcpy(dev.data, pristine, size);
+        memset(dev.discarded, 0, dev.numSectors);
+        dev.writes = 0;
+        int opIdx = runOps(&dev, cfg, ops, numOps, cut, verbose);
+        uint32_t problems = (opIdx < 0) ? 1 :
+            checkCut(&dev, cfg, ops, numOps, models, opIdx, verbose);
+        if(problems) {
+            printf("  spc=%u cache=%u: power lost at write %" PRIu64
+                " (during op %d, %s): %u problems\n",
+                cfg->sectorsPerCluster, cfg->cacheSize, cut, opIdx,
+                (opIdx >= 0 && opIdx < numOps) ? ops[opIdx].path : "-",
+                problems);
+            failures++;
+        }
+    }
+    printf("  spc=%u cache=%u: %d ops, %" PRIu64 " writes, each cut: "
+        "%u lost clusters, %u excess, %u orphan LFNs, %u FAT differs, "
+        "%u mixed writes\n", cfg->sectorsPerCluster, cfg->cacheSize, numOps,
+        numWrites, sawLost, sawExcess, sawOrphans, sawFatDiff, sawMixed);
+
+    free(pristine);
+    devFree(&dev);
+    for(int i=0; i<=numOps; i++) treeFree(&models[i]);
+    free(models);
+    free(ops);
+    return failures;
+}
+
+
+uint32_t testPowerLoss(int verbose) {
+    uint32_t failures = 0;
+    for(size_t i=0; i<sizeof(configs) / sizeof(configs[0]); i++) {
+        failures += testConfig(&configs[i], verbose);
+    }
+    return failures;
+}
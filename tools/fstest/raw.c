@@ -0,0 +1,156 @@
+/** Direct access to a FAT32 volume's structures, for tests that need to
+ *  check what the driver did, or set up something it wouldn't, without
+ *  going through the driver. Like fsck.c, this works on the bytes in the
+ *  device's memory, at the offsets the FAT specification gives, and doesn't
+ *  count as reading or writing the device.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+static uint32_t _get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void _put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+
+int volOpen(FsTestDev *dev, uint64_t start, FsTestVol *out) {
+    /** Find a volume's layout from its boot sector.
+     *  @param dev The block device.
+     *  @param start Sector the volume begins at.
+     *  @param out Receives the layout.
+     *  @return 0 on success, or -EILSEQ if it's not a FAT32 volume that
+     *   fits on the device.
+     */
+    if(start >= dev->numSectors) return -EILSEQ;
+    const uint8_t *boot = &dev->data[start * FSTEST_SECTOR_SIZE];
+    memset(out, 0, sizeof(FsTestVol));
+    out->dev            = dev;
+    out->start          = start;
+    out->spc            = boot[13];
+    out->reserved       = boot[14] | (boot[15] << 8);
+    out->numFats        = boot[16];
+    out->sectorsPerFat  = _get32(&boot[36]);
+    out->rootCluster    = _get32(&boot[44]);
+    out->dataStart      = start + out->reserved +
+        ((uint64_t)out->numFats * out->sectorsPerFat);
+    uint32_t total      = _get32(&boot[32]);
+    if(!out->spc || !out->numFats || boot[510] != 0x55 || boot[511] != 0xAA
+    || out->dataStart - start + out->spc > total
+    || start + total > dev->numSectors) return -EILSEQ;
+    out->numClusters = (total - (out->dataStart - start)) / out->spc;
+    out->numClusters = MIN(out->numClusters,
+        (out->sectorsPerFat * (FSTEST_SECTOR_SIZE / 4)) - 2);
+    return 0;
+}
+
+
+uint8_t* volFatEntry(FsTestVol *vol, uint32_t fat, uint32_t cluster) {
+    /** Get a pointer to a cluster's entry in one copy of the FAT.
+     *  @param vol The volume.
+     *  @param fat Which copy.
+     *  @param cluster The cluster.
+     *  @return Pointer to the entry, in the device's memory.
+     */
+    uint64_t sector = vol->start + vol->reserved +
+        ((uint64_t)fat * vol->sectorsPerFat);
+    return &vol->dev->data[(sector * FSTEST_SECTOR_SIZE) + (cluster * 4)];
+}
+
+
+uint32_t volGetFat(FsTestVol *vol, uint32_t cluster) {
+    /** Read a cluster's entry in the first FAT.
+     *  @param vol The volume.
+     *  @param cluster The cluster.
+     *  @return The entry, without its reserved top 4 bits.
+     */
+    return _get32(volFatEntry(vol, 0, cluster)) & 0x0FFFFFFF;
+}
+
+
+void volSetFat(FsTestVol *vol, uint32_t cluster, uint32_t value) {
+    /** Set a cluster's entry in every FAT.
+     *  @param vol The volume.
+     *  @param cluster The cluster.
+     *  @param value The new entry.
+     */
+    for(uint32_t f=0; f<vol->numFats; f++) {
+        _put32(volFatEntry(vol, f, cluster), value);
+    }
+}
+
+
+uint8_t* volCluster(FsTestVol *vol, uint32_t cluster) {
+    /** Get a pointer to a cluster's data.
+     *  @param vol The volume.
+     *  @param cluster The cluster.
+     *  @return Pointer to its first byte, in the device's memory.
+     */
+    uint64_t sector = vol->dataStart + ((uint64_t)(cluster - 2) * vol->spc);
+    return &vol->dev->data[sector * FSTEST_SECTOR_SIZE];
+}
+
+
+uint32_t volChain(FsTestVol *vol, uint32_t first, uint32_t *out,
+uint32_t max) {
+    /** Follow a cluster chain.
+     *  @param vol The volume.
+     *  @param first Its first cluster.
+     *  @param out Receives the clusters. Can be NULL.
+     *  @param max Most clusters to follow.
+     *  @return Number of clusters in the chain, up to `max`, or up to where
+     *   it leaves the volume or runs into a free cluster.
+     */
+    uint32_t count = 0, cluster = first;
+    while(count < max && cluster >= 2 && cluster < vol->numClusters + 2) {
+        uint32_t next = volGetFat(vol, cluster);
+        if(!next) break;
+        if(out) out[count] = cluster;
+        count++;
+        if(next >= 0x0FFFFFF7) break; //end of chain, or bad cluster
+        cluster = next;
+    }
+    return count;
+}
+
+
+uint8_t* volFindEntry(FsTestVol *vol, uint32_t dir, const char *name) {
+    /** Find a directory entry by its 8.3 name.
+     *  @param vol The volume.
+     *  @param dir The directory's first cluster.
+     *  @param name The name as it's stored, eg "FOO     TXT".
+     *  @return Pointer to the 32-byte entry, in the device's memory, or
+     *   NULL if it's not found.
+     */
+    uint32_t cluster = dir;
+    uint32_t perCluster = vol->spc * FSTEST_SECTOR_SIZE / 32;
+    for(uint32_t n=0; n<vol->numClusters; n++) {
+        uint8_t *ent = volCluster(vol, cluster);
+        for(uint32_t i=0; i<perCluster; i++, ent += 32) {
+            if(!ent[0]) return NULL; //end of directory
+            if(ent[0] != 0xE5 && ent[11] != 0x0F && !memcmp(ent, name, 11)) {
+                return ent;
+            }
+        }
+        cluster = volGetFat(vol, cluster);
+        if(cluster < 2 || cluster >= vol->numClusters + 2) break;
+    }
+    return NULL;
+}
+
+
+uint32_t volEntryCluster(const uint8_t *ent) {
+    /** Get a directory entry's first cluster.
+     *  @param ent The entry, eg from volFindEntry().
+     *  @return The cluster.
+     */
+    return ent[26] | (ent[27] << 8) | (ent[20] << 16) | (ent[21] << 24);
+}
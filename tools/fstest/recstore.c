@@ -0,0 +1,329 @@
+/** The record store (drivers/fs/recstore), with power lost at every sector.
+ *  A partition, found through an MBR, gets several laps' worth of records
+ *  of assorted sizes appended to it, flushed now and then. That's run once
+ *  to count the sectors it writes, then again for each of those writes with
+ *  the power lost there, in three ways: cleanly between sectors; with the
+ *  sector being written left half written; and with every sector of the
+ *  interrupted batch garbled, as a card that hadn't finished with them
+ *  might leave them. Each time the store is opened again, which finds the
+ *  newest sector by binary search wherever in the partition it is, and
+ *  must read back consecutively numbered records with the right contents,
+ *  including every record that was written before the interrupted batch
+ *  and not in the sectors it was overwriting. It must carry on numbering
+ *  from the last record it reads, and records appended then must be read
+ *  back after opening it once more. Nothing outside the partition may be
+ *  written.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <drivers/fs/recstore/recstore.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 8   //where the partition starts
+#define NUM_RECORDS 800  //enough for several laps of each partition
+#define FLUSH_EVERY 13   //records between flushes
+#define MORE_RECORDS 10  //appended after opening again
+#define RESUMED 0x10000  //seeds for those, so their data differs
+
+typedef struct {
+    uint32_t numSectors;
+    uint16_t batch;
+} Config;
+
+static const Config configs[] = {
+    {48, 4},
+    {37, 3}, //batches cut short at the end of the partition
+    {16, 1},
+};
+
+typedef enum {
+    CUT_CLEAN, //between sectors
+    CUT_TORN,  //the sector being written is half written
+    CUT_LOST,  //the whole interrupted batch is garbled
+    NUM_CUT_MODES
+} CutMode;
+
+static const char *cutModeNames[] = {"clean", "torn", "lost"};
+
+typedef struct {
+    //the store's state when the power was lost.
+    uint32_t appended;    //records appended, including those buffered
+    uint64_t nextSeq;     //first sector of the interrupted batch
+    uint16_t numBuffered; //and its length
+    uint64_t recordSeq[NUM_RECORDS]; //sector each record went in
+} CutState;
+
+static uint32_t sawKept; //cuts where part of the batch survived
+
+
+static uint16_t recordSize(uint32_t record) {
+    //assorted sizes, from empty to the largest.
+    if(record % 50 == 49) return RECSTORE_MAX_RECORD;
+    return ((record * 2654435761UL) >> 24) % 161;
+}
+
+
+static void writeMbr(FsTestDev *dev, uint32_t numSectors, uint8_t type) {
+    uint8_t *mbr = dev->data;
+    memset(mbr, 0, FSTEST_SECTOR_SIZE);
+    DosPartitionTableEntry *ent = (DosPartitionTableEntry*)&mbr[0x1BE];
+    ent->type        = type;
+    ent->startSector = START_SECTOR;
+    ent->numSectors  = numSectors;
+    mbr[0x1FE] = 0x55;
+    mbr[0x1FF] = 0xAA;
+}
+
+
+static void spoil(FsTestDev *dev, const Config *cfg, const CutState *state,
+const uint8_t *batch, uint16_t written, CutMode mode) {
+    //spoil the sectors of the interrupted batch, of which `written` made
+    //it to the disk.
+    for(uint16_t i=0; i<state->numBuffered; i++) {
+        uint32_t pos = (state->nextSeq + i) % cfg->numSectors;
+        uint8_t *sector = &dev->data[(uint64_t)(START_SECTOR + pos) *
+            FSTEST_SECTOR_SIZE];
+        if(mode == CUT_TORN && i == written) {
+            memcpy(sector, &batch[i * RECSTORE_SECTOR_SIZE],
+                RECSTORE_SECTOR_SIZE / 2);
+        }
+        else if(mode == CUT_LOST && i <= written) {
+            fsTestFill(sector, FSTEST_SECTOR_SIZE, 0xBAD00000 + pos);
+        }
+    }
+}
+
+
+static int runRecords(FsTestDev *dev, const Config *cfg, uint64_t cutAfter,
+CutMode mode, CutState *state) {
+    //open the store and append the records, with power lost after
+    //`cutAfter` sector writes, as `mode` says. returns 1 if the power was
+    //lost, 0 if not, or negative error code if the store failed for some
+    //other reason.
+    MicronRecStore store;
+    devPower(dev, cutAfter);
+    int err = recStoreOpen(&dev->file, 0, cfg->batch, &store, FSTEST_TIMEOUT);
+    if(err) return err; //opening doesn't write
+
+    uint8_t data[RECSTORE_MAX_RECORD];
+    uint64_t before = dev->writes; //when the last call began
+    for(uint32_t i=0; i<NUM_RECORDS && !err; i++) {
+        uint16_t size = recordSize(i);
+        fsTestFill(data, size, i);
+        before = dev->writes;
+        err = recStoreAppend(&store, data, size, FSTEST_TIMEOUT);
+        if(err) break;
+        state->recordSeq[i] = store.nextSeq + store.numBuffered - 1;
+        if(i % FLUSH_EVERY == FLUSH_EVERY - 1) {
+            before = dev->writes;
+            err = recStoreFlush(&store, FSTEST_TIMEOUT);
+        }
+    }
+    if(!err) {
+        before = dev->writes;
+        err = recStoreFlush(&store, FSTEST_TIMEOUT);
+    }
+    state->appended    = store.nextRecord;
+    state->nextSeq     = store.nextSeq;
+    state->numBuffered = store.numBuffered;
+    if(dev->cut) {
+        //the batch is still in the buffer, which a torn sector needs.
+        spoil(dev, cfg, state, store.buffer, dev->writes - before, mode);
+    }
+    recStoreClose(&store, FSTEST_TIMEOUT);
+    if(dev->cut) return 1;
+    return err;
+}
+
+
+static uint32_t readBack(MicronRecStore *store, const CutState *state,
+uint32_t resumedAt, int verbose, uint64_t *outFirst, uint64_t *outEnd) {
+    //read all the records, which must be consecutive and as they were
+    //written: records from `resumedAt` on were appended after opening
+    //again. sets the range read, which is empty if `outFirst` == `outEnd`.
+    //returns the number of problems.
+    MicronRecStoreCursor cursor;
+    recStoreRewind(store, &cursor);
+    uint8_t data[RECSTORE_MAX_RECORD], expect[RECSTORE_MAX_RECORD];
+    uint64_t record, first = 0, end = 0;
+    uint32_t problems = 0;
+    int len;
+    while((len = recStoreRead(store, &cursor, data, sizeof(data), &record,
+    FSTEST_TIMEOUT)) >= 0) {
+        if(end == first) first = end = record;
+        if(record != end) {
+            if(verbose) printf("read record %" PRIu64 " after %" PRIu64
+                "\n", record, end - 1);
+            problems++;
+        }
+        end = record + 1;
+        bool resumed = record >= resumedAt;
+        if(record >= (resumed ? resumedAt + MORE_RECORDS : state->appended)) {
+            if(verbose) printf("read record %" PRIu64 ", which wasn't "
+                "written\n", record);
+            problems++;
+            continue;
+        }
+        uint16_t size = recordSize(record);
+        fsTestFill(expect, size, resumed ? RESUMED + record : record);
+        if(len != size || memcmp(data, expect, size)) {
+            if(verbose) printf("record %" PRIu64 " is wrong\n", record);
+            problems++;
+        }
+    }
+    if(len != -ENOENT) {
+        if(verbose) printf("reading failed: %d\n", len);
+        problems++;
+    }
+    if(store->nextRecord != end) {
+        if(verbose) printf("next record is %" PRIu64 ", not %" PRIu64 "\n",
+            store->nextRecord, end);
+        problems++;
+    }
+    *outFirst = first;
+    *outEnd   = end;
+    return problems;
+}
+
+
+static uint32_t checkCut(FsTestDev *dev, const Config *cfg,
+const CutState *state, int verbose) {
+    //open the store after power was lost, and check what it reads.
+    devPower(dev, FSTEST_NEVER);
+    MicronRecStore store;
+    int err = recStoreOpen(&dev->file, 0, cfg->batch, &store, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("opening failed: %d\n", err);
+        return 1;
+    }
+
+    //records before the interrupted batch must all be there, except in
+    //the sectors it was overwriting. those in it may be, or not.
+    uint32_t mustFrom = 0, written = 0;
+    int64_t oldest = (int64_t)(state->nextSeq + state->numBuffered) -
+        cfg->numSectors;
+    while(mustFrom < state->appended
+    && (int64_t)state->recordSeq[mustFrom] < oldest) mustFrom++;
+    while(written < state->appended
+    && state->recordSeq[written] < state->nextSeq) written++;
+    uint64_t first, end;
+    uint32_t problems = readBack(&store, state, NUM_RECORDS, verbose, &first,
+        &end);
+    if(mustFrom < written && (first > mustFrom || end < written)) {
+        if(verbose) printf("read records %" PRIu64 " to %" PRIu64 ", not %u "
+            "to %u\n", first, end, mustFrom, written);
+        problems++;
+    }
+    if(end > written) sawKept++;
+
+    //carry on, and open it again.
+    uint32_t resumedAt = store.nextRecord;
+    uint8_t data[RECSTORE_MAX_RECORD];
+    for(uint32_t i=0; i<MORE_RECORDS && !err; i++) {
+        uint16_t size = recordSize(resumedAt + i);
+        fsTestFill(data, size, RESUMED + resumedAt + i);
+        err = recStoreAppend(&store, data, size, FSTEST_TIMEOUT);
+    }
+    int err2 = recStoreClose(&store, FSTEST_TIMEOUT);
+    if(!err) err = err2;
+    if(!err) err = recStoreOpen(&dev->file, 0, cfg->batch, &store,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("carrying on failed: %d\n", err);
+        return problems + 1;
+    }
+    problems += readBack(&store, state, resumedAt, verbose, &first, &end);
+    if(end != resumedAt + MORE_RECORDS) {
+        if(verbose) printf("records appended after power loss are "
+            "missing\n");
+        problems++;
+    }
+    recStoreClose(&store, FSTEST_TIMEOUT);
+    return problems;
+}
+
+
+static uint32_t checkOutside(FsTestDev *dev, const Config *cfg,
+const uint8_t *pristine) {
+    //nothing outside the partition may change.
+    uint64_t start = (uint64_t)START_SECTOR * FSTEST_SECTOR_SIZE;
+    uint64_t end = (uint64_t)(START_SECTOR + cfg->numSectors) *
+        FSTEST_SECTOR_SIZE;
+    uint64_t size = (uint64_t)dev->numSectors * FSTEST_SECTOR_SIZE;
+    return (memcmp(dev->data, pristine, start)
+        || memcmp(&dev->data[end], &pristine[end], size - end)) ? 1 : 0;
+}
+
+
+static uint32_t testConfig(const Config *cfg, int verbose) {
+    FsTestDev dev;
+    devInit(&dev, START_SECTOR + cfg->numSectors + 8, 0);
+    writeMbr(&dev, cfg->numSectors, RECSTORE_PARTITION_TYPE);
+    size_t size = (size_t)dev.numSectors * FSTEST_SECTOR_SIZE;
+    uint8_t *pristine = (uint8_t*)malloc(size);
+    memcpy(pristine, dev.data, size);
+    CutState *state = (CutState*)malloc(sizeof(CutState));
+
+    //without power loss, to count the writes, and make sure it all works.
+    uint32_t failures = 0;
+    dev.writes = 0;
+    int err = runRecords(&dev, cfg, FSTEST_NEVER, CUT_CLEAN, state);
+    uint64_t numWrites = dev.writes;
+    if(err || checkCut(&dev, cfg, state, verbose)
+    || checkOutside(&dev, cfg, pristine)) {
+        printf("  %u sectors, batch %u: failed without power loss\n",
+            cfg->numSectors, cfg->batch);
+        failures++;
+    }
+
+    sawKept = 0;
+    for(uint64_t cut=0; cut<numWrites && !failures; cut++) {
+        for(int mode=0; mode<NUM_CUT_MODES; mode++) {
+            memcpy(dev.data, pristine, size);
+            dev.writes = 0;
+            err = runRecords(&dev, cfg, cut, (CutMode)mode, state);
+            uint32_t problems = (err != 1) ? 1 :
+                checkCut(&dev, cfg, state, verbose);
+            problems += checkOutside(&dev, cfg, pristine);
+            if(problems) {
+                printf("  %u sectors, batch %u: power lost at write %"
+                    PRIu64 " (%s): %u problems\n", cfg->numSectors,
+                    cfg->batch, cut, cutModeNames[mode], problems);
+                failures++;
+            }
+        }
+    }
+    printf("  %u sectors, batch %u: %" PRIu64 " writes (%" PRIu64 " laps), "
+        "each cut 3 ways: %u kept part of the interrupted batch\n",
+        cfg->numSectors, cfg->batch, numWrites, numWrites / cfg->numSectors,
+        sawKept);
+
+    free(state);
+    free(pristine);
+    devFree(&dev);
+    return failures;
+}
+
+
+uint32_t testRecStore(int verbose) {
+    uint32_t failures = 0;
+
+    //it only takes a partition of its own type.
+    FsTestDev dev;
+    MicronRecStore store;
+    devInit(&dev, START_SECTOR + 64, 0);
+    writeMbr(&dev, 64, 0x0C); //FAT32
+    int err = recStoreOpen(&dev.file, 0, 0, &store, FSTEST_TIMEOUT);
+    if(err != -EMEDIUMTYPE) {
+        printf("  opening a FAT32 partition gave %d\n", err);
+        if(!err) recStoreClose(&store, FSTEST_TIMEOUT);
+        failures++;
+    }
+    devFree(&dev);
+
+    for(size_t i=0; i<sizeof(configs) / sizeof(configs[0]); i++) {
+        failures += testConfig(&configs[i], verbose);
+    }
+    return failures;
+}
@@ -0,0 +1,300 @@
+/** The free cluster scan (alloc.c), and reconciling FSInfo with it.
+ *  A volume of 40000 clusters gets files written across the first half of
+ *  it, one of which is deleted, and then FSInfo's free count and next free
+ *  hint are made wrong, as another system or a lost write could leave them.
+ *  The driver mounts it and scans the FAT a step at a time (or all at once,
+ *  if FAT_SCAN_AT_MOUNT is 1). Each step must make progress, reading only a
+ *  few sectors. When the scan has passed one file but not the next, the
+ *  first is deleted and another written in its place, below the part
+ *  scanned, and the second deleted and a third extended, above it, and a
+ *  cluster is allocated and left in the FAT cache. When it's done, the
+ *  bitmap must match the FAT on the disk, cluster for cluster, and the free
+ *  space must match it. After unmounting, FSInfo must be right. Then it's
+ *  spoiled again, and just mounting and scanning must put it right. Finally
+ *  fsck must find the expected files.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 40000
+#define CHUNK_CLUSTERS 256 //clusters written per append, to keep within
+                           //the timeout
+#define MAX_STEP_READS 16  //sectors a step of fatScanStep(1) may read
+#define BAD_FREE 12345     //made-up free count for FSInfo
+
+static const struct {
+    const char *path;
+    uint32_t clusters;
+} files[] = {
+    {"/big.bin",   15000}, //deleted before the scan
+    {"/below.bin", 2000},  //deleted once the scan has passed it
+    {"/gap.bin",   3000},  //more than a step of the scan
+    {"/above.bin", 2000},  //deleted before the scan reaches it
+    {"/tail.bin",  1000},  //extended before the scan reaches its end
+};
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+static int appendClusters(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+const char *path, uint32_t clusters, uint32_t seed) {
+    //append a number of clusters' worth of data, in pieces.
+    int err = 0;
+    for(uint32_t done=0; done<clusters && !err; done += CHUNK_CLUSTERS) {
+        uint32_t count = MIN(clusters - done, (uint32_t)CHUNK_CLUSTERS);
+        err = fsTestAppend(dev, mbr, model, path,
+            count * FSTEST_SECTOR_SIZE, seed + done);
+    }
+    return err;
+}
+
+
+static uint32_t firstCluster(FsTestVol *vol, const char *name) {
+    //a file's first cluster, found without the driver, or 0.
+    uint8_t *ent = volFindEntry(vol, vol->rootCluster, name);
+    return ent ? volEntryCluster(ent) : 0;
+}
+
+
+static void spoilFsInfo(FsTestVol *vol, uint32_t next) {
+    //make the free count wrong, and the hint point into a file.
+    uint8_t *info = &vol->dev->data[(vol->start + 1) * FSTEST_SECTOR_SIZE];
+    put32(&info[488], BAD_FREE);
+    put32(&info[492], next);
+}
+
+
+static uint32_t checkFsInfo(FsTestDev *dev, int verbose) {
+    //FSInfo must be right, after unmounting.
+    FsckResult result;
+    if(fsckFat(dev, START_SECTOR, &result, NULL, verbose)
+    || result.fsInfoFree != result.freeClusters || result.fsInfoNext < 2
+    || result.fsInfoNext >= result.numClusters + 2) {
+        if(verbose) printf("FSInfo says %u free from %u; there are %u\n",
+            result.fsInfoFree, result.fsInfoNext, result.freeClusters);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int setup(FsTestDev *dev, FsTestTree *model) {
+    //write the files, delete the first, and spoil FSInfo.
+    fat32_mbr mbr;
+    int err = mkfsFat(dev, START_SECTOR, VOLUME_SECTORS, 1, 2);
+    if(!err) err = fatMount(&dev->file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(err) return err;
+    for(size_t i=0; i<NUM_FILES && !err; i++) {
+        err = appendClusters(dev, &mbr, model, files[i].path,
+            files[i].clusters, i * 100000);
+    }
+    if(!err) err = fatDelete(&dev->file, &mbr, files[0].path, FSTEST_TIMEOUT);
+    if(!err) treeRemove(model, files[0].path);
+    int err2 = fatUnmount(&dev->file, &mbr, FSTEST_TIMEOUT);
+    if(err) return err;
+    if(err2) return err2;
+
+    FsTestVol vol;
+    err = volOpen(dev, START_SECTOR, &vol);
+    if(!err) spoilFsInfo(&vol, firstCluster(&vol, "ABOVE   BIN") + 10);
+    return err;
+}
+
+
+static uint32_t midScan(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+FsTestVol *vol, uint32_t *outLoose, int verbose) {
+    //change things on both sides of where the scan has got to.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint32_t scanned = alloc->scanCluster;
+    bool scanning = scanned < alloc->numClusters + 2;
+    uint32_t problems = 0;
+    uint32_t below = firstCluster(vol, "BELOW   BIN");
+    uint32_t above = firstCluster(vol, "ABOVE   BIN");
+    if(scanning && (below + files[1].clusters > scanned || above < scanned)) {
+        if(verbose) printf("scan is at %u, not between %u and %u\n",
+            scanned, below + files[1].clusters, above);
+        problems++;
+    }
+
+    int err = fatDelete(&dev->file, mbr, files[1].path, FSTEST_TIMEOUT);
+    if(!err) treeRemove(model, files[1].path);
+    if(!err) err = appendClusters(dev, mbr, model, "/new.bin", 1000, 500000);
+    if(!err) err = fatDelete(&dev->file, mbr, files[3].path, FSTEST_TIMEOUT);
+    if(!err) treeRemove(model, files[3].path);
+    if(!err) err = appendClusters(dev, mbr, model, files[4].path, 500,
+        600000);
+    //and a cluster allocated but left in the FAT cache, not yet on the
+    //disk: the scan must still see it's used.
+    if(!err) err = fatAllocCluster(&dev->file, mbr, 0, outLoose,
+        FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("changing files mid-scan failed: %d\n", err);
+        return problems + 1;
+    }
+
+    //the new file should have gone where the deleted one was, below the
+    //scan, and the extended one continued above it.
+    uint32_t tail[8192];
+    uint32_t tailLength = volChain(vol, firstCluster(vol, "TAIL    BIN"), tail,
+        8192);
+    if(scanning && firstCluster(vol, "NEW     BIN") != below) {
+        if(verbose) printf("/new.bin is at %u, not %u\n",
+            firstCluster(vol, "NEW     BIN"), below);
+        problems++;
+    }
+    if(scanning && (!tailLength || tail[tailLength - 1] < scanned
+    || *outLoose < scanned)) {
+        if(verbose) printf("/tail.bin and cluster %u aren't above cluster "
+            "%u\n", *outLoose, scanned);
+        problems++;
+    }
+    return problems;
+}
+
+
+static uint32_t checkBitmap(FsTestDev *dev, fat32_mbr *mbr, FsTestVol *vol,
+int verbose) {
+    //the bitmap and free count must match the FAT on the disk.
+    MicronFatAlloc *alloc = mbr->_micron_alloc;
+    uint32_t problems = 0, numFree = 0, wrong = 0;
+    if(fatCacheFlush(&dev->file, mbr, FSTEST_TIMEOUT)) return 1;
+    for(uint32_t c=2; c<alloc->numClusters + 2; c++) {
+        bool used = volGetFat(vol, c) != 0;
+        if(!used) numFree++;
+        uint32_t bit = c - 2;
+        bool marked = alloc->bitmap[bit / 32] & (1UL << (bit % 32));
+        if(marked != used) {
+            if(verbose && !wrong) printf("cluster %u is %s, but the bitmap "
+                "says it isn't\n", c, used ? "used" : "free");
+            wrong++;
+        }
+    }
+    if(wrong) problems++;
+    int64_t space = fatGetFreeSpace(mbr);
+    if(space != (int64_t)numFree * FSTEST_SECTOR_SIZE) {
+        if(verbose) printf("free space is %lld, not %llu\n", (long long)space,
+            (unsigned long long)numFree * FSTEST_SECTOR_SIZE);
+        problems++;
+    }
+    return problems;
+}
+
+
+uint32_t testScan(int verbose) {
+    /** Check the free cluster scan and FSInfo.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    FsTestDev dev;
+    FsTestVol vol;
+    FsTestTree model, actual;
+    FsckResult result;
+    fat32_mbr mbr;
+    uint32_t problems = 0, steps = 0, mostReads = 0, loose = 0;
+    bool changed = false;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    treeInit(&actual);
+
+    int err = setup(&dev, &model);
+    if(!err) err = volOpen(&dev, START_SECTOR, &vol);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    {
+        //until the scan is done, the free space is FSInfo's word for it.
+        MicronFatAlloc *alloc = mbr._micron_alloc;
+        bool atMount = fatScanProgress(&mbr) == 100;
+        if(!atMount && fatGetFreeSpace(&mbr) !=
+        (int64_t)BAD_FREE * FSTEST_SECTOR_SIZE) {
+            if(verbose) printf("free space before the scan is %lld, not "
+                "FSInfo's\n", (long long)fatGetFreeSpace(&mbr));
+            problems++;
+        }
+
+        uint32_t belowEnd = firstCluster(&vol, "BELOW   BIN") +
+            files[1].clusters;
+        int progress = fatScanProgress(&mbr);
+        while(progress < 100) {
+            uint32_t scanned = alloc->scanCluster;
+            uint64_t reads = dev.reads;
+            int next = fatScanStep(&dev.file, &mbr, 1, FSTEST_TIMEOUT);
+            mostReads = MAX(mostReads, (uint32_t)(dev.reads - reads));
+            steps++;
+            if(next < progress || alloc->scanCluster <= scanned
+            || dev.reads - reads > MAX_STEP_READS) {
+                if(verbose) printf("step %u went from %d%% to %d%% (cluster "
+                    "%u to %u), reading %llu sectors\n", steps, progress,
+                    next, scanned, alloc->scanCluster,
+                    (unsigned long long)(dev.reads - reads));
+                problems++;
+                break;
+            }
+            progress = next;
+            if(!changed && alloc->scanCluster >= belowEnd) {
+                problems += midScan(&dev, &mbr, &model, &vol, &loose,
+                    verbose);
+                changed = true;
+            }
+        }
+        if(!changed) problems += midScan(&dev, &mbr, &model, &vol, &loose,
+            verbose);
+        problems += checkBitmap(&dev, &mbr, &vol, verbose);
+        if(loose) fatFreeChain(&dev.file, &mbr, loose, FSTEST_TIMEOUT);
+        if(atMount) printf("  scanned at mount\n");
+        else printf("  scanned in %u steps of at most %u sectors\n", steps,
+            mostReads);
+    }
+
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't unmount: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    problems += checkFsInfo(&dev, verbose);
+
+    //and it must be put right by just mounting and scanning, even if
+    //nothing else is written.
+    spoilFsInfo(&vol, firstCluster(&vol, "GAP     BIN") + 10);
+    err = fatMount(&dev.file, START_SECTOR, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        FSTEST_TIMEOUT);
+    while(!err && fatScanProgress(&mbr) < 100) {
+        err = fatScanStep(&dev.file, &mbr, 100, FSTEST_TIMEOUT);
+        if(err > 0) err = 0;
+    }
+    if(!err) err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't mount and scan again: %d\n", err);
+        problems++;
+    }
+    else problems += checkFsInfo(&dev, verbose);
+    problems += fsTestVerify(&dev, START_SECTOR, &actual, &result, verbose);
+    if(treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&actual);
+    devFree(&dev);
+    return problems;
+}
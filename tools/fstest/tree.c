@@ -0,0 +1,174 @@
+/** A directory tree and its files' contents, for fstest to compare what's
+ *  on a volume with what should be.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+
+void treeInit(FsTestTree *tree) {
+    memset(tree, 0, sizeof(FsTestTree));
+}
+
+
+void treeFree(FsTestTree *tree) {
+    for(uint32_t i=0; i<tree->count; i++) {
+        if(tree->nodes[i].data) free(tree->nodes[i].data);
+    }
+    if(tree->nodes) free(tree->nodes);
+    treeInit(tree);
+}
+
+
+int treeCopy(FsTestTree *dest, const FsTestTree *src) {
+    /** Copy a tree.
+     *  @param dest Receives the copy. Whatever it held is freed.
+     *  @param src The tree to copy.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    treeFree(dest);
+    for(uint32_t i=0; i<src->count; i++) {
+        const FsTestNode *node = &src->nodes[i];
+        int err = treeSet(dest, node->path, node->isDir, node->data,
+            node->size);
+        if(err) return err;
+    }
+    return 0;
+}
+
+
+FsTestNode* treeFind(const FsTestTree *tree, const char *path) {
+    for(uint32_t i=0; i<tree->count; i++) {
+        if(!strcmp(tree->nodes[i].path, path)) return &tree->nodes[i];
+    }
+    return NULL;
+}
+
+
+int treeSet(FsTestTree *tree, const char *path, bool isDir,
+const void *data, uint32_t size) {
+    /** Add a file or directory to a tree, or replace it.
+     *  @param tree The tree.
+     *  @param path Its path, eg "/logs/a.txt".
+     *  @param isDir Whether it's a directory.
+     *  @param data The file's contents, which are copied.
+     *  @param size Number of bytes at `data`.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    if(strlen(path) >= FSTEST_MAX_PATH) return -ENAMETOOLONG;
+    FsTestNode *node = treeFind(tree, path);
+    if(!node) {
+        if(tree->count == tree->capacity) {
+            uint32_t capacity = tree->capacity ? tree->capacity * 2 : 32;
+            FsTestNode *nodes = (FsTestNode*)realloc(tree->nodes,
+                capacity * sizeof(FsTestNode));
+            if(!nodes) return -ENOMEM;
+            tree->nodes    = nodes;
+            tree->capacity = capacity;
+        }
+        node = &tree->nodes[tree->count++];
+        memset(node, 0, sizeof(FsTestNode));
+        strcpy(node->path, path);
+    }
+    if(node->data) free(node->data);
+    node->isDir = isDir;
+    node->size  = isDir ? 0 : size;
+    node->data  = NULL;
+    if(!isDir) {
+        node->data = (uint8_t*)malloc(size ? size : 1);
+        if(!node->data) return -ENOMEM;
+        if(size) memcpy(node->data, data, size);
+    }
+    return 0;
+}
+
+
+void treeRemove(FsTestTree *tree, const char *path) {
+    FsTestNode *node = treeFind(tree, path);
+    if(!node) return;
+    if(node->data) free(node->data);
+    *node = tree->nodes[--tree->count];
+}
+
+
+static bool _sameNode(const FsTestNode *a, const FsTestNode *b) {
+    if(!a || !b) return a == b;
+    if(a->isDir != b->isDir || a->size != b->size) return false;
+    return a->isDir || !memcmp(a->data, b->data, a->size);
+}
+
+static bool _mixedNode(const FsTestNode *a, const FsTestNode *b,
+const FsTestNode *c) {
+    //whether every sector of `a` is that sector of `b` or of `c`, as it
+    //would be if overwriting `b` with `c` was cut short.
+    if(!a || !b || !c || a->isDir || b->isDir || c->isDir) return false;
+    if(a->size != b->size || a->size != c->size) return false;
+    for(uint32_t i=0; i<a->size; i += FSTEST_SECTOR_SIZE) {
+        uint32_t len = MIN((uint32_t)FSTEST_SECTOR_SIZE, a->size - i);
+        if(memcmp(&a->data[i], &b->data[i], len)
+        && memcmp(&a->data[i], &c->data[i], len)) return false;
+    }
+    return true;
+}
+
+static void _describe(const char *what, const FsTestNode *node) {
+    if(!node) printf("  %-8s missing\n", what);
+    else if(node->isDir) printf("  %-8s directory\n", what);
+    else {
+        printf("  %-8s %u bytes:", what, node->size);
+        for(uint32_t i=0; i<MIN(node->size, 8u); i++) {
+            printf(" %02X", node->data[i]);
+        }
+        printf("%s\n", node->size > 8 ? " ..." : "");
+    }
+}
+
+static bool _checkPath(const FsTestTree *actual, const FsTestTree *expected,
+const FsTestTree *orExpected, bool sectorMix, const char *path, int verbose) {
+    const FsTestNode *a = treeFind(actual, path);
+    const FsTestNode *b = treeFind(expected, path);
+    const FsTestNode *c = orExpected ? treeFind(orExpected, path) : NULL;
+    if(_sameNode(a, b)) return true;
+    if(orExpected && _sameNode(a, c)) return true;
+    if(sectorMix && _mixedNode(a, b, c)) return true;
+    if(verbose) {
+        printf("%s:\n", path);
+        _describe("found", a);
+        _describe("expected", b);
+        if(orExpected) _describe("or", c);
+    }
+    return false;
+}
+
+
+uint32_t treeCompare(const FsTestTree *actual, const FsTestTree *expected,
+const FsTestTree *orExpected, bool sectorMix, int verbose) {
+    /** Compare a tree with what it should be.
+     *  @param actual The tree found.
+     *  @param expected The tree it should be.
+     *  @param orExpected If not NULL, each path may instead be as it is in
+     *   this tree, eg for the state after an operation that was interrupted.
+     *  @param sectorMix Whether a file that's the same size in both
+     *   `expected` and `orExpected` may have each sector from either.
+     *  @param verbose Whether to print the differences.
+     *  @return Number of paths that differ.
+     */
+    uint32_t diffs = 0;
+    const FsTestTree *trees[3] = {actual, expected, orExpected};
+    for(int t=0; t<3; t++) {
+        if(!trees[t]) continue;
+        for(uint32_t i=0; i<trees[t]->count; i++) {
+            const char *path = trees[t]->nodes[i].path;
+            //only check each path once.
+            bool seen = false;
+            for(int u=0; u<t && !seen; u++) {
+                seen = trees[u] && treeFind(trees[u], path);
+            }
+            if(seen) continue;
+            if(!_checkPath(actual, expected, orExpected, sectorMix, path,
+            verbose)) diffs++;
+        }
+    }
+    return diffs;
+}
@@ -0,0 +1,280 @@
+/** Views of file data (view.c), and the block cache under them
+ *  (libs/io/blockcache.c), with fewer blocks than views want.
+ *  Views are taken of a file until every block of the cache is pinned:
+ *  then a view of another block must fail with -EBUSY, while one of a
+ *  block already held must share it without reading the disk. Releasing
+ *  one view of a block held twice mustn't free it; releasing the last
+ *  must, and the block taken next must be that one, leaving the data of
+ *  the views still held as it was. Then the file is written, in a part of
+ *  a block and across more blocks than the cache has: views held must see
+ *  the new data in place, and views taken after must not read the disk.
+ *  Finally a file with a view held is deleted: the view must keep its
+ *  data, and once released, its block must be dropped, and be the next
+ *  one replaced.
+ */
+extern "C" {
+    #include <micron.h>
+    #include "fstest.h"
+}
+
+#define START_SECTOR 63
+#define VOLUME_SECTORS 2048
+#define SECTORS_PER_CLUSTER 4
+#define CACHE_BLOCKS 4
+#define BLOCK_SECTORS 2
+#define BLOCK (BLOCK_SECTORS * FSTEST_SECTOR_SIZE) //bytes
+#define FILE_BLOCKS 40
+
+static const char *path = "/VIEW.BIN";
+static const char *gonePath = "/GONE.BIN";
+
+
+static int take(FsTestDev *dev, fat32_mbr *mbr, MicronFatFile *file,
+uint32_t offset, uint32_t size, MicronFatView *out, uint64_t *outReads) {
+    //take a view, counting the sectors it reads.
+    uint64_t reads = dev->reads;
+    int err = fatViewFile(&dev->file, mbr, file, offset, size, out,
+        FSTEST_TIMEOUT);
+    if(outReads) *outReads = dev->reads - reads;
+    return err;
+}
+
+
+static uint32_t same(const MicronFatView *view, const uint8_t *data,
+uint32_t offset, const char *what, int verbose) {
+    //check that a view holds the data it should.
+    if(view->data && !memcmp(view->data, &data[offset], view->size)) {
+        return 0;
+    }
+    if(verbose) printf("%s: view of %u has the wrong data\n", what, offset);
+    return 1;
+}
+
+
+static uint32_t checkPins(FsTestDev *dev, fat32_mbr *mbr,
+MicronFatFile *file, const uint8_t *data, int verbose) {
+    //pin every block, and see what happens to views of others.
+    MicronFatView views[CACHE_BLOCKS], shared, extra;
+    uint32_t problems = 0;
+    uint64_t reads;
+    for(int i=0; i<CACHE_BLOCKS; i++) {
+        int n = take(dev, mbr, file, (i * BLOCK) + 10, 100, &views[i], NULL);
+        if(n != 100) {
+            if(verbose) printf("view of block %d gave %d\n", i, n);
+            return problems + 1;
+        }
+        problems += same(&views[i], data, (i * BLOCK) + 10, "pinned",
+            verbose);
+    }
+
+    //every block is pinned.
+    int n = take(dev, mbr, file, CACHE_BLOCKS * BLOCK, 100, &extra, &reads);
+    if(n != -EBUSY || reads) {
+        if(verbose) printf("view with every block pinned gave %d, and read "
+            "%" PRIu64 " sectors\n", n, reads);
+        problems++;
+        if(n > 0) fatViewRelease(mbr, &extra);
+    }
+    n = take(dev, mbr, file, (2 * BLOCK) + 500, 100, &shared, &reads);
+    if(n != 100 || reads) {
+        if(verbose) printf("view of a pinned block gave %d, and read %"
+            PRIu64 " sectors\n", n, reads);
+        return problems + 1;
+    }
+    problems += same(&shared, data, (2 * BLOCK) + 500, "shared", verbose);
+
+    //releasing one of two views of a block keeps it pinned.
+    fatViewRelease(mbr, &shared);
+    n = take(dev, mbr, file, CACHE_BLOCKS * BLOCK, 100, &extra, &reads);
+    if(n != -EBUSY) {
+        if(verbose) printf("view after releasing a shared block gave %d\n",
+            n);
+        problems++;
+        if(n > 0) fatViewRelease(mbr, &extra);
+    }
+
+    //releasing the last one frees it, for the next block.
+    fatViewRelease(mbr, &views[1]);
+    n = take(dev, mbr, file, CACHE_BLOCKS * BLOCK, 100, &extra, &reads);
+    if(n != 100 || reads != BLOCK_SECTORS || extra.block != views[1].block) {
+        if(verbose) printf("view after releasing a block gave %d, read %"
+            PRIu64 " sectors, in block %u\n", n, reads, extra.block);
+        problems++;
+    }
+    problems += same(&extra, data, CACHE_BLOCKS * BLOCK, "replaced",
+        verbose);
+    for(int i=0; i<CACHE_BLOCKS; i++) {
+        if(i == 1) continue;
+        problems += same(&views[i], data, (i * BLOCK) + 10, "still pinned",
+            verbose);
+    }
+
+    //ranges are cut at the end of a block, and of the file.
+    fatViewRelease(mbr, &extra);
+    n = take(dev, mbr, file, (3 * BLOCK) - 10, 100, &extra, NULL);
+    if(n != 10) {
+        if(verbose) printf("view across a block boundary gave %d\n", n);
+        problems++;
+    }
+    fatViewRelease(mbr, &extra);
+    n = take(dev, mbr, file, file->size, 100, &extra, NULL);
+    if(n != 0) {
+        if(verbose) printf("view past the end gave %d\n", n);
+        problems++;
+    }
+    fatViewRelease(mbr, &extra);
+    for(int i=0; i<CACHE_BLOCKS; i++) fatViewRelease(mbr, &views[i]);
+    return problems;
+}
+
+
+static uint32_t checkWrites(FsTestDev *dev, fat32_mbr *mbr,
+MicronFatFile *file, uint8_t *data, int verbose) {
+    //write to blocks with views held, which must see the changes.
+    MicronFatView held[3], view;
+    const uint32_t heldAt[3] = {6 * BLOCK, 8 * BLOCK, 20 * BLOCK};
+    uint32_t problems = 0;
+    for(int i=0; i<3; i++) {
+        if(take(dev, mbr, file, heldAt[i], BLOCK, &held[i], NULL) != BLOCK) {
+            if(verbose) printf("can't take a view of %u\n", heldAt[i]);
+            return 1;
+        }
+    }
+    const struct {
+        uint32_t offset, size;
+    } writes[] = {
+        {(6 * BLOCK) + 100, 300},               //within a block
+        {(7 * BLOCK) + 5, (16 * BLOCK) - 10},   //more blocks than cached
+    };
+    for(size_t w=0; w<sizeof(writes) / sizeof(writes[0]); w++) {
+        fsTestFill(&data[writes[w].offset], writes[w].size, 70 + w);
+        int err = fatWriteFile(&dev->file, mbr, file, writes[w].offset,
+            writes[w].size, &data[writes[w].offset], FSTEST_TIMEOUT);
+        if(err != (int)writes[w].size) {
+            if(verbose) printf("write of %u gave %d\n", writes[w].size, err);
+            problems++;
+        }
+        for(int i=0; i<3; i++) {
+            problems += same(&held[i], data, heldAt[i], "written", verbose);
+        }
+    }
+
+    //the cached blocks are up to date, so views of them don't read.
+    for(int i=0; i<3; i++) {
+        uint64_t reads;
+        int n = take(dev, mbr, file, heldAt[i] + 1, 50, &view, &reads);
+        if(n != 50 || reads) {
+            if(verbose) printf("view of a written block gave %d, and read %"
+                PRIu64 " sectors\n", n, reads);
+            problems++;
+        }
+        problems += same(&view, data, heldAt[i] + 1, "rewritten", verbose);
+        fatViewRelease(mbr, &view);
+        fatViewRelease(mbr, &held[i]);
+    }
+    return problems;
+}
+
+
+static uint32_t checkFreed(FsTestDev *dev, fat32_mbr *mbr, FsTestTree *model,
+int verbose) {
+    //delete a file while a view of it is held.
+    MicronFatFile file;
+    MicronFatView view;
+    uint32_t problems = 0;
+    int err = fatOpenPath(&dev->file, mbr, gonePath, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(!err && take(dev, mbr, &file, 0, BLOCK, &view, NULL) != BLOCK) {
+        err = -EIO;
+    }
+    if(err) {
+        if(verbose) printf("can't take a view of %s: %d\n", gonePath, err);
+        return 1;
+    }
+    fatCloseFile(&file);
+    uint8_t *copy = (uint8_t*)malloc(BLOCK);
+    memcpy(copy, treeFind(model, gonePath)->data, BLOCK);
+    err = fatDelete(&dev->file, mbr, gonePath, FSTEST_TIMEOUT);
+    treeRemove(model, gonePath);
+    if(err) {
+        if(verbose) printf("can't delete %s: %d\n", gonePath, err);
+        problems++;
+    }
+    problems += same(&view, copy, 0, "deleted", verbose);
+
+    //once released, its block is dropped, and replaced first.
+    MicronBlockCache *blocks = &mbr->_micron_viewCache->blocks;
+    uint16_t block = view.block;
+    uint64_t sector = blocks->entries[block].block;
+    fatViewRelease(mbr, &view);
+    if(blockCachePeek(blocks, sector) >= 0
+    || blockCacheVictim(blocks) != block) {
+        if(verbose) printf("freed block is still cached\n");
+        problems++;
+    }
+    free(copy);
+    return problems;
+}
+
+
+uint32_t testViews(int verbose) {
+    /** Check views and the block cache under them.
+     *  @param verbose Whether to print each problem.
+     *  @return Number of problems found.
+     */
+    FsTestDev dev;
+    FsTestTree model, actual;
+    FsckResult result;
+    fat32_mbr mbr;
+    MicronFatFile file;
+    if(devInit(&dev, START_SECTOR + VOLUME_SECTORS, 0)) return 1;
+    treeInit(&model);
+    treeInit(&actual);
+
+    uint32_t problems = 0;
+    int err = mkfsFat(&dev, START_SECTOR, VOLUME_SECTORS,
+        SECTORS_PER_CLUSTER, 2);
+    if(!err) err = fatMount(&dev.file, START_SECTOR, &mbr,
+        FAT_DEFAULT_CACHE_SIZE, FSTEST_TIMEOUT);
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, path,
+        FILE_BLOCKS * BLOCK, 1);
+    if(!err) err = fsTestAppend(&dev, &mbr, &model, gonePath, BLOCK, 2);
+    if(!err) err = fatViewCacheInit(&mbr, CACHE_BLOCKS, BLOCK_SECTORS);
+    if(!err) err = fatOpenPath(&dev.file, &mbr, path, &file,
+        FAT_DEFAULT_MAX_EXTENTS, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't set up the volume: %d\n", err);
+        problems++;
+        goto done;
+    }
+
+    uint32_t pins, writes, freed;
+    pins = checkPins(&dev, &mbr, &file, treeFind(&model, path)->data,
+        verbose);
+    printf("  every block pinned: %s\n", pins ? "FAILED" : "ok");
+    writes = checkWrites(&dev, &mbr, &file, treeFind(&model, path)->data,
+        verbose);
+    printf("  writes under views: %s\n", writes ? "FAILED" : "ok");
+    freed = checkFreed(&dev, &mbr, &model, verbose);
+    printf("  deleted under a view: %s\n", freed ? "FAILED" : "ok");
+    problems += pins + writes + freed;
+    fatCloseFile(&file);
+
+    err = fatUnmount(&dev.file, &mbr, FSTEST_TIMEOUT);
+    if(err) {
+        if(verbose) printf("can't unmount: %d\n", err);
+        problems++;
+        goto done;
+    }
+    problems += fsTestVerify(&dev, START_SECTOR, &actual, &result, verbose);
+    if(treeCompare(&actual, &model, NULL, false, verbose)) {
+        if(verbose) printf("fsck found different files\n");
+        problems++;
+    }
+
+done:
+    treeFree(&model);
+    treeFree(&actual);
+    devFree(&dev);
+    return problems;
+}
@@ -0,0 +1,1235 @@
+//Simulated SD card: SPI and SD mode protocols, and disk image.
+//This is deliberately written from the SD spec rather than from the
+//drivers, so it has its own CRC code and doesn't include sdcard.h.
+//SPI mode goes a byte at a time through sdSimTransfer(). SD mode is for a
+//host controller model (usdhc.c), which moves whole commands and blocks:
+//sdSimCommand(), sdSimReadData() and sdSimWriteData().
+extern "C" {
+    #include <micron.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include "sdsim.h"
+}
+
+//bits of the R1 response
+#define R1_IDLE      BIT(0)
+#define R1_ILLEGAL   BIT(2)
+#define R1_CRC       BIT(3)
+#define R1_ERASE_SEQ BIT(4)
+#define R1_ADDR      BIT(5)
+#define R1_PARAM     BIT(6)
+
+//bits of the second byte of R2
+#define R2_ERROR     BIT(2)
+#define R2_RANGE     BIT(7)
+
+//card status, SD mode
+#define ST_OUT_OF_RANGE    BIT(31)
+#define ST_ADDRESS_ERROR   BIT(30)
+#define ST_BLOCK_LEN_ERROR BIT(29)
+#define ST_ERASE_SEQ_ERROR BIT(28)
+#define ST_ERASE_PARAM     BIT(27)
+#define ST_COM_CRC_ERROR   BIT(23)
+#define ST_ILLEGAL_COMMAND BIT(22)
+#define ST_CARD_ECC_FAILED BIT(21)
+#define ST_ERROR           BIT(19)
+#define ST_READY_FOR_DATA  BIT(8)
+#define ST_APP_CMD         BIT(5)
+
+//card states, SD mode
+#define STATE_IDLE  0
+#define STATE_READY 1
+#define STATE_IDENT 2
+#define STATE_STBY  3
+#define STATE_TRAN  4
+#define STATE_DATA  5
+#define STATE_RCV   6
+#define STATE_PRG   7
+
+#define SDSIM_RCA 0xB368 //address it gives itself (CMD3)
+
+//tokens
+#define TOKEN_START      0xFE //single block read/write, and CMD18 blocks
+#define TOKEN_START_MULTI 0xFC //CMD25 blocks
+#define TOKEN_STOP_TRAN  0xFD //end of CMD25
+#define TOKEN_ERROR      0x01 //read failed
+#define TOKEN_RANGE      0x08 //read went past the end
+#define DATA_ACCEPTED    0xE5 //write data responses
+#define DATA_CRC_ERROR   0xEB
+#define DATA_WRITE_ERROR 0xED
+
+static uint8_t _crc7(const uint8_t *data, size_t len) {
+    uint8_t crc = 0;
+    for(size_t i=0; i<len; i++) {
+        uint8_t d = data[i];
+        for(int b=0; b<8; b++) {
+            crc <<= 1;
+            if((d ^ crc) & 0x80) crc ^= 0x09;
+            d <<= 1;
+        }
+    }
+    return crc & 0x7F;
+}
+
+
+static uint16_t _crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0;
+    for(size_t i=0; i<len; i++) {
+        crc ^= data[i] << 8;
+        for(int b=0; b<8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+static uint32_t _random(MicronSdSim *sim) {
+    //xorshift32
+    uint32_t x = sim->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rng = x;
+    return x;
+}
+
+
+static bool _chance(MicronSdSim *sim, uint32_t ppm) {
+    return ppm && (_random(sim) % 1000000) < ppm;
+}
+
+
+static bool _isBad(MicronSdSim *sim, uint32_t block) {
+    for(int i=0; i<sim->cfg.nBadBlocks; i++) {
+        if(sim->cfg.badBlock[i] == block) return true;
+    }
+    return false;
+}
+
+
+static bool _isErased(MicronSdSim *sim, uint32_t block) {
+    return sim->erased[block / 8] & BIT(block % 8);
+}
+
+
+static void _setErased(MicronSdSim *sim, uint32_t block, uint32_t count,
+bool erased) {
+    for(uint32_t b=block; b<block+count; b++) {
+        if(erased) sim->erased[b / 8] |= BIT(b % 8);
+        else sim->erased[b / 8] &= ~BIT(b % 8);
+    }
+}
+
+
+static void _setBits(uint8_t *reg, int msb, int width, uint32_t value) {
+    //put a field into a 128-bit register, where bit 127 is the top of
+    //byte 0.
+    for(int i=0; i<width; i++) {
+        int bit = msb - i;
+        int byte = 15 - (bit / 8);
+        uint8_t mask = 1 << (bit % 8);
+        if(value & (1 << (width - 1 - i))) reg[byte] |= mask;
+        else reg[byte] &= ~mask;
+    }
+}
+
+
+static int _makeCSD(MicronSdSim *sim, uint8_t *csd) {
+    //build the CSD for the card's size. return 0, or -EFBIG if it's too
+    //big for the card type.
+    memset(csd, 0, 16);
+    bool hc = (sim->cfg.type == SDSIM_SDHC);
+    _setBits(csd, 127,  2, hc ? 1 : 0);      //CSD_STRUCTURE
+    _setBits(csd, 119,  8, hc ? 0x0E : 0x26); //TAAC: 1 ms / 1.5 ms
+    _setBits(csd, 111,  8, 0);                //NSAC
+    _setBits(csd, 103,  8, sim->cfg.tranSpeed ? sim->cfg.tranSpeed :
+        (sim->hs ? 0x5A : 0x32)); //TRAN_SPEED: 50/25 MHz
+    _setBits(csd,  95, 12, (sim->cfg.type == SDSIM_SDSC_V1) ? 0x1F5 : 0x5B5);
+    //version 2 CSDs always say 64K erase sectors, and that any block can be
+    //erased.
+    _setBits(csd,  46,  1, hc ? 1 : sim->cfg.eraseAny);   //ERASE_BLK_EN
+    _setBits(csd,  45,  7, hc ? 0x7F : sim->cfg.eraseSector - 1); //SECTOR_SIZE
+    _setBits(csd,  28,  3, 2);                //R2W_FACTOR
+    _setBits(csd,  25,  4, 9);                //WRITE_BL_LEN
+    if(hc) {
+        if(sim->nBlocks < 1024 || sim->nBlocks / 1024 > BIT(22)) return -EFBIG;
+        _setBits(csd, 83,  4, 9);                     //READ_BL_LEN
+        _setBits(csd, 69, 22, sim->nBlocks / 1024 - 1); //C_SIZE
+    }
+    else {
+        //capacity = (C_SIZE + 1) << (C_SIZE_MULT + 2 + READ_BL_LEN).
+        //2 GB cards say their blocks are 1024 bytes.
+        uint32_t blLen = (sim->nBlocks > BIT(21)) ? 10 : 9;
+        uint32_t units = sim->nBlocks >> (blLen - 9);
+        uint32_t mult = 0;
+        while(mult < 7 && units / (4 << mult) > 4096) mult++;
+        if(units / (4 << mult) > 4096 || units < 4) return -EFBIG;
+        _setBits(csd, 83,  4, blLen);
+        _setBits(csd, 79,  1, 1);                         //READ_BL_PARTIAL
+        _setBits(csd, 73, 12, units / (4 << mult) - 1);   //C_SIZE
+        _setBits(csd, 61,  3, 5); _setBits(csd, 58, 3, 5); //VDD currents
+        _setBits(csd, 55,  3, 5); _setBits(csd, 52, 3, 5);
+        _setBits(csd, 49,  3, mult);                      //C_SIZE_MULT
+    }
+    csd[15] = (_crc7(csd, 15) << 1) | 1;
+    return 0;
+}
+
+
+static void _makeCID(uint8_t *cid) {
+    memset(cid, 0, 16);
+    _setBits(cid, 127,  8, 0x5A);       //MID
+    _setBits(cid, 119, 16, 0x534D);     //OID "SM"
+    memcpy(&cid[3], "SDSIM", 5);        //PNM
+    _setBits(cid,  63,  8, 0x10);       //PRV 1.0
+    _setBits(cid,  55, 32, 0x12345678); //PSN
+    _setBits(cid,  19, 12, 0x15A);      //MDT: 2021-10
+    cid[15] = (_crc7(cid, 15) << 1) | 1;
+}
+
+
+static int _imageIO(MicronSdSim *sim, uint32_t block, uint32_t count,
+void *buf, bool write) {
+    size_t len = (size_t)count * SDSIM_BLOCK_SIZE;
+    off_t offset = (off_t)block * SDSIM_BLOCK_SIZE;
+    if(sim->fd < 0) {
+        if(write) memcpy(&sim->mem[offset], buf, len);
+        else memcpy(buf, &sim->mem[offset], len);
+        return 0;
+    }
+    uint8_t *d = (uint8_t*)buf;
+    while(len) {
+        ssize_t n = write ? pwrite(sim->fd, d, len, offset) :
+            pread(sim->fd, d, len, offset);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return (n < 0) ? -errno : -EIO;
+        d += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int _fill(MicronSdSim *sim, uint32_t block, uint32_t count,
+uint8_t value) {
+    uint8_t buf[64 * SDSIM_BLOCK_SIZE];
+    memset(buf, value, sizeof(buf));
+    while(count) {
+        uint32_t n = MIN(count, (uint32_t)64);
+        int err = _imageIO(sim, block, n, buf, true);
+        if(err) return err;
+        block += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+static void _put(MicronSdSim *sim, uint8_t b) {
+    if(sim->outLen >= SDSIM_OUT_SIZE) return; //can't happen
+    sim->out[(sim->outHead + sim->outLen) % SDSIM_OUT_SIZE] = b;
+    sim->outLen++;
+}
+
+
+static void _respond(MicronSdSim *sim, uint8_t r1) {
+    //queue an R1 response, after the NCR time.
+    for(int i=0; i<sim->cfg.ncr; i++) _put(sim, 0xFF);
+    _put(sim, r1 | (sim->idle ? R1_IDLE : 0));
+}
+
+
+static void _sendRegister(MicronSdSim *sim, const uint8_t *data, int len) {
+    //queue a register (CSD, CID, CMD6 status) as a data block.
+    uint16_t crc = _crc16(data, len);
+    _put(sim, 0xFF);
+    _put(sim, TOKEN_START);
+    for(int i=0; i<len; i++) _put(sim, data[i]);
+    _put(sim, crc >> 8);
+    _put(sim, crc & 0xFF);
+}
+
+
+static void _busy(MicronSdSim *sim, uint64_t us, uint8_t after) {
+    //hold the output low for a while, after what's queued.
+    sim->phase = SDSIM_BUSY;
+    sim->until = sim->now + (us * 1000);
+    sim->after = after;
+}
+
+
+static void _reset(MicronSdSim *sim) {
+    sim->phase      = SDSIM_IDLE;
+    sim->outLen     = 0;
+    sim->idle       = true;
+    sim->acmd       = false;
+    sim->multi      = false;
+    sim->hs         = false;
+    sim->crc        = sim->cfg.crc;
+    sim->readyAt    = 0;
+    sim->status     = 0;
+    sim->eraseStart = UINT32_MAX;
+    sim->eraseEnd   = UINT32_MAX;
+    sim->busState   = STATE_IDLE;
+    sim->rca        = 0;
+    sim->wide       = false;
+    sim->busStatus  = 0;
+    sim->regLen     = 0;
+}
+
+
+static uint8_t _address(MicronSdSim *sim, uint32_t arg, uint32_t *block) {
+    //convert a command's address to a block number. return 0, or the R1
+    //error bits.
+    if(sim->cfg.type == SDSIM_SDHC) *block = arg;
+    else {
+        if(arg % SDSIM_BLOCK_SIZE) return R1_ADDR;
+        *block = arg / SDSIM_BLOCK_SIZE;
+    }
+    return (*block >= sim->nBlocks) ? R1_PARAM : 0;
+}
+
+
+static void _powerUp(MicronSdSim *sim, bool hcs) {
+    //CMD1 or ACMD41: start initializing, or finish if it's time.
+    //a high capacity card stays idle if the host doesn't support it.
+    if(sim->idle && !(sim->cfg.type == SDSIM_SDHC && !hcs)) {
+        if(!sim->readyAt) sim->readyAt = sim->now + (sim->cfg.initUs * 1000ull);
+        if(sim->now >= sim->readyAt) sim->idle = false;
+    }
+}
+
+
+static void _init(MicronSdSim *sim, bool hcs) {
+    //CMD1 or ACMD41 in SPI mode: say whether initialization is done yet.
+    _powerUp(sim, hcs);
+    _respond(sim, 0);
+}
+
+
+static void _switchStatus(MicronSdSim *sim, uint32_t arg, uint8_t *st) {
+    //CMD6: only group 1 (bus speed) does anything; the others only have
+    //their default function. st gets the 64-byte status.
+    memset(st, 0, 64);
+    st[1] = 100; //max current, mA
+    for(int g=2; g<=6; g++) st[13 - ((g - 1) * 2)] = 0x01;
+    st[13] = 0x01 | (sim->cfg.highSpeed ? 0x02 : 0);
+
+    bool ok = true;
+    uint8_t fn[6];
+    for(int g=0; g<6; g++) {
+        uint8_t want = (arg >> (g * 4)) & 0xF;
+        if(want == 0xF) fn[g] = (g == 0 && sim->hs) ? 1 : 0;
+        else if(want == 0 || (g == 0 && want == 1 && sim->cfg.highSpeed)) {
+            fn[g] = want;
+        }
+        else {
+            fn[g] = 0xF;
+            ok = false;
+        }
+    }
+    st[14] = (fn[5] << 4) | fn[4];
+    st[15] = (fn[3] << 4) | fn[2];
+    st[16] = (fn[1] << 4) | fn[0];
+    if(ok && (arg & BIT(31)) && (arg & 0xF) != 0xF) sim->hs = (fn[0] == 1);
+}
+
+
+static void _switchFunc(MicronSdSim *sim, uint32_t arg) {
+    //CMD6 in SPI mode: the status comes as a data block.
+    uint8_t st[64];
+    _switchStatus(sim, arg, st);
+    _respond(sim, 0);
+    _sendRegister(sim, st, sizeof(st));
+}
+
+
+static uint8_t _eraseBlocks(MicronSdSim *sim, uint32_t arg, uint32_t *count) {
+    //CMD38. arg 1 is discard, which leaves the contents undefined; we
+    //leave them as they are. a card that can't erase part of a sector
+    //erases all of every sector the range touches. return 0 and the number
+    //of blocks erased, or R1 error bits.
+    if(sim->eraseStart == UINT32_MAX || sim->eraseEnd == UINT32_MAX
+    || sim->eraseEnd < sim->eraseStart) return R1_ERASE_SEQ;
+    if(arg > 1) return R1_PARAM;
+    if(sim->cfg.type != SDSIM_SDHC && !sim->cfg.eraseAny) {
+        uint32_t size = sim->cfg.eraseSector;
+        sim->eraseStart -= sim->eraseStart % size;
+        sim->eraseEnd = MIN(sim->eraseEnd - (sim->eraseEnd % size) + size,
+            sim->nBlocks) - 1;
+    }
+    *count = sim->eraseEnd - sim->eraseStart + 1;
+    if(arg == 0) {
+        if(_fill(sim, sim->eraseStart, *count, sim->cfg.erased)) {
+            sim->status |= R2_ERROR;
+        }
+        else _setErased(sim, sim->eraseStart, *count, true);
+    }
+    sim->stats.blocksErased += *count;
+    sim->eraseStart = UINT32_MAX;
+    sim->eraseEnd   = UINT32_MAX;
+    return 0;
+}
+
+
+static void _erase(MicronSdSim *sim, uint32_t arg) {
+    //CMD38 in SPI mode: busy while erasing.
+    uint32_t count = 0;
+    uint8_t err = _eraseBlocks(sim, arg, &count);
+    _respond(sim, err);
+    if(!err) _busy(sim, (uint64_t)sim->cfg.eraseUs * count, SDSIM_IDLE);
+}
+
+
+static void _command(MicronSdSim *sim) {
+    uint8_t  c   = sim->cmd[0] & 0x3F;
+    uint32_t arg = (sim->cmd[1] << 24) | (sim->cmd[2] << 16) |
+        (sim->cmd[3] << 8) | sim->cmd[4];
+    bool acmd = sim->acmd;
+    sim->acmd = false;
+    sim->stats.cmds[c]++;
+
+    if(sim->phase == SDSIM_READ_WAIT || sim->phase == SDSIM_READ_SEND
+    || sim->phase == SDSIM_READ_STOPPED) {
+        //in a multiple block read, only CMD12 is listened to. the rest of
+        //the block is dropped; a stuff byte comes before the response.
+        if(c != 12) return;
+        sim->outLen = 0;
+        _put(sim, _random(sim) & 0xFF);
+        _put(sim, 0);
+        _busy(sim, sim->cfg.stopUs, SDSIM_IDLE);
+        return;
+    }
+    if(sim->phase == SDSIM_WRITE_TOKEN) sim->phase = SDSIM_IDLE; //abandoned
+    sim->outLen = 0; //whatever's left of the last response
+
+    //CMD0 and CMD8 are always checked, since CRC checking can be on
+    //before CMD59 can turn it off.
+    if(sim->crc || c == 0 || c == 8) {
+        if(((_crc7(sim->cmd, 5) << 1) | 1) != sim->cmd[5]
+        || _chance(sim, sim->cfg.cmdCrcPpm)) {
+            sim->stats.badCmds++;
+            _respond(sim, R1_CRC);
+            return;
+        }
+    }
+
+    //before initialization, only these work.
+    if(sim->idle && c != 0 && c != 1 && c != 8 && c != 41 && c != 55
+    && c != 58 && c != 59) {
+        _respond(sim, R1_ILLEGAL);
+        return;
+    }
+
+    uint8_t err;
+    uint32_t block = 0;
+    switch(c) {
+        case 0:
+            _reset(sim);
+            _respond(sim, 0);
+            break;
+
+        case 1:
+            _init(sim, false);
+            break;
+
+        case 6:
+            if(sim->cfg.type == SDSIM_SDSC_V1) _respond(sim, R1_ILLEGAL);
+            else _switchFunc(sim, arg);
+            break;
+
+        case 8:
+            if(sim->cfg.type == SDSIM_SDSC_V1) {
+                _respond(sim, R1_ILLEGAL);
+                break;
+            }
+            //echo the check pattern, and accept 2.7-3.6V only.
+            _respond(sim, 0);
+            _put(sim, 0);
+            _put(sim, 0);
+            _put(sim, (((arg >> 8) & 0xF) == 1) ? 1 : 0);
+            _put(sim, arg & 0xFF);
+            break;
+
+        case 9:
+        case 10: {
+            uint8_t reg[16];
+            if(c == 9) _makeCSD(sim, reg);
+            else _makeCID(reg);
+            _respond(sim, 0);
+            _sendRegister(sim, reg, sizeof(reg));
+            break;
+        }
+
+        case 12:
+            _respond(sim, R1_ILLEGAL); //not reading
+            break;
+
+        case 13:
+            _respond(sim, 0);
+            _put(sim, sim->status);
+            sim->status = 0;
+            break;
+
+        case 16:
+            _respond(sim, (arg == SDSIM_BLOCK_SIZE) ? 0 : R1_PARAM);
+            break;
+
+        case 17:
+        case 18:
+        case 24:
+        case 25:
+            err = _address(sim, arg, &block);
+            _respond(sim, err);
+            if(err) break;
+            sim->block = block;
+            sim->multi = (c == 18 || c == 25);
+            if(c == 17 || c == 18) {
+                sim->phase = SDSIM_READ_WAIT;
+                sim->until = sim->now + (sim->cfg.readUs * 1000ull);
+            }
+            else sim->phase = SDSIM_WRITE_TOKEN;
+            break;
+
+        case 23: //ACMD23, pre-erase count: just a hint
+        case 41:
+            if(!acmd) _respond(sim, R1_ILLEGAL);
+            else if(c == 41) _init(sim, (arg & BIT(30)) != 0);
+            else _respond(sim, 0);
+            break;
+
+        case 32:
+        case 33:
+            err = _address(sim, arg, &block);
+            _respond(sim, err);
+            if(err) break;
+            if(c == 32) sim->eraseStart = block;
+            else sim->eraseEnd = block;
+            break;
+
+        case 38:
+            _erase(sim, arg);
+            break;
+
+        case 55:
+            _respond(sim, 0);
+            sim->acmd = true;
+            break;
+
+        case 58: {
+            //OCR: powered up, capacity, 2.7-3.6V.
+            bool hc = (sim->cfg.type == SDSIM_SDHC);
+            _respond(sim, 0);
+            _put(sim, sim->idle ? 0 : (0x80 | (hc ? 0x40 : 0)));
+            _put(sim, 0xFF);
+            _put(sim, 0x80);
+            _put(sim, 0x00);
+            break;
+        }
+
+        case 59:
+            sim->crc = arg & 1;
+            _respond(sim, 0);
+            break;
+
+        default:
+            _respond(sim, R1_ILLEGAL);
+            break;
+    }
+}
+
+
+static uint8_t _fetchBlock(MicronSdSim *sim) {
+    //the access time is over; get the next block into sim->buf. return 0,
+    //or an error token, after which a multiple block read stops.
+    uint32_t b = sim->block;
+    uint8_t token = 0;
+    if(b >= sim->nBlocks) {
+        token = TOKEN_RANGE;
+        sim->status |= R2_RANGE;
+    }
+    else if(_isBad(sim, b) || _chance(sim, sim->cfg.readErrPpm)
+    || _imageIO(sim, b, 1, sim->buf, false)) {
+        token = TOKEN_ERROR;
+        sim->status |= R2_ERROR;
+        sim->stats.readErrors++;
+    }
+    if(token) {
+        sim->phase = sim->multi ? SDSIM_READ_STOPPED : SDSIM_IDLE;
+        return token;
+    }
+    sim->stats.blocksRead++;
+    sim->block++;
+    return 0;
+}
+
+
+static bool _corruptRead(MicronSdSim *sim, uint8_t *data) {
+    //flip a bit in a block being sent now and then.
+    if(!_chance(sim, sim->cfg.readCrcPpm)) return false;
+    data[_random(sim) % SDSIM_BLOCK_SIZE] ^= BIT(_random(sim) % 8);
+    sim->stats.readCrcErrors++;
+    return true;
+}
+
+
+static void _sendBlock(MicronSdSim *sim) {
+    //queue the next block, or an error token.
+    uint8_t token = _fetchBlock(sim);
+    if(token) {
+        _put(sim, token);
+        return;
+    }
+    uint16_t crc = _crc16(sim->buf, SDSIM_BLOCK_SIZE);
+    _corruptRead(sim, sim->buf);
+    _put(sim, TOKEN_START);
+    for(int i=0; i<SDSIM_BLOCK_SIZE; i++) _put(sim, sim->buf[i]);
+    _put(sim, crc >> 8);
+    _put(sim, crc & 0xFF);
+    sim->phase = SDSIM_READ_SEND;
+}
+
+
+static uint8_t _storeBlock(MicronSdSim *sim, bool checkCrc, uint32_t *busy) {
+    //a written block and its CRC are in sim->buf; store it, and say how
+    //long the card is busy afterward. return the data response token.
+    if(_chance(sim, sim->cfg.writeCrcPpm)) {
+        sim->buf[_random(sim) % SDSIM_BLOCK_SIZE] ^= BIT(_random(sim) % 8);
+    }
+    uint16_t crc = (sim->buf[SDSIM_BLOCK_SIZE] << 8) |
+        sim->buf[SDSIM_BLOCK_SIZE + 1];
+    uint32_t b = sim->block;
+    *busy = sim->cfg.writeUs;
+    if(checkCrc && crc != _crc16(sim->buf, SDSIM_BLOCK_SIZE)) {
+        sim->stats.writeCrcErrors++;
+        return DATA_CRC_ERROR;
+    }
+    if(b >= sim->nBlocks || _isBad(sim, b)
+    || _chance(sim, sim->cfg.writeErrPpm)
+    || _imageIO(sim, b, 1, sim->buf, true)) {
+        sim->stats.writeErrors++;
+        sim->status |= (b >= sim->nBlocks) ? R2_RANGE : R2_ERROR;
+        return DATA_WRITE_ERROR;
+    }
+    //blocks that were erased are written faster.
+    if(_isErased(sim, b)) {
+        *busy = sim->cfg.erasedWriteUs;
+        sim->stats.erasedWrites++;
+        _setErased(sim, b, 1, false);
+    }
+    sim->stats.blocksWritten++;
+    sim->block++;
+    return DATA_ACCEPTED;
+}
+
+
+static void _receiveBlock(MicronSdSim *sim) {
+    //a written block and its CRC are in; answer and go busy.
+    uint32_t busy;
+    _put(sim, _storeBlock(sim, sim->crc, &busy));
+    _busy(sim, busy, sim->multi ? SDSIM_WRITE_TOKEN : SDSIM_IDLE);
+}
+
+
+static uint8_t _output(MicronSdSim *sim) {
+    //what the card sends for this byte.
+    if(sim->outLen) {
+        uint8_t b = sim->out[sim->outHead];
+        sim->outHead = (sim->outHead + 1) % SDSIM_OUT_SIZE;
+        sim->outLen--;
+        if(!sim->outLen && sim->phase == SDSIM_READ_SEND) {
+            //block sent; a multiple block read goes on to the next.
+            if(sim->multi) {
+                sim->phase = SDSIM_READ_WAIT;
+                sim->until = sim->now + (sim->cfg.gapUs * 1000ull);
+            }
+            else sim->phase = SDSIM_IDLE;
+        }
+        return b;
+    }
+    switch(sim->phase) {
+        case SDSIM_READ_WAIT:
+            if(sim->now < sim->until) return 0xFF;
+            _sendBlock(sim);
+            return _output(sim);
+        case SDSIM_BUSY:
+            if(sim->now < sim->until) return 0x00;
+            sim->phase = sim->after;
+            return 0xFF;
+        default:
+            return 0xFF;
+    }
+}
+
+
+static void _input(MicronSdSim *sim, uint8_t in) {
+    //what the card does with a received byte.
+    switch(sim->phase) {
+        case SDSIM_WRITE_DATA:
+            sim->buf[sim->pos++] = in;
+            if(sim->pos == SDSIM_BLOCK_SIZE + 2) _receiveBlock(sim);
+            return;
+
+        case SDSIM_WRITE_TOKEN:
+            if(in == (sim->multi ? TOKEN_START_MULTI : TOKEN_START)) {
+                sim->phase = SDSIM_WRITE_DATA;
+                sim->pos = 0;
+                return;
+            }
+            if(in == TOKEN_STOP_TRAN && sim->multi) {
+                _put(sim, 0xFF); //stuff byte
+                _busy(sim, sim->cfg.stopUs, SDSIM_IDLE);
+                return;
+            }
+            break; //maybe a command
+
+        case SDSIM_BUSY:
+            return;
+
+        case SDSIM_READ_WAIT:
+        case SDSIM_READ_SEND:
+            if(!sim->multi) return;
+            break;
+
+        default: break;
+    }
+    if(!sim->cmdLen && (in & 0xC0) != 0x40) return;
+    sim->cmd[sim->cmdLen++] = in;
+    if(sim->cmdLen < sizeof(sim->cmd)) return;
+    sim->cmdLen = 0;
+    _command(sim);
+}
+
+
+static bool _overclocked(MicronSdSim *sim) {
+    //whether to garble something: now and then, if the clock is too fast.
+    uint32_t limit = sim->cfg.maxHz * (sim->hs ? 2 : 1);
+    if(sim->spiHz <= limit || !_chance(sim, sim->cfg.overclockPpm)) return false;
+    sim->stats.flips++;
+    return true;
+}
+
+
+static uint8_t _garble(MicronSdSim *sim, uint8_t b) {
+    return _overclocked(sim) ? b ^ BIT(_random(sim) % 8) : b;
+}
+
+
+static uint8_t _busState(MicronSdSim *sim) {
+    //SD mode: the card's state, as its status reports it.
+    if(sim->phase == SDSIM_BUSY && sim->now >= sim->until) {
+        sim->phase = sim->after;
+    }
+    switch(sim->phase) {
+        case SDSIM_READ_WAIT:
+        case SDSIM_READ_SEND:
+        case SDSIM_READ_STOPPED:  return STATE_DATA;
+        case SDSIM_WRITE_TOKEN:
+        case SDSIM_WRITE_STOPPED: return STATE_RCV;
+        case SDSIM_BUSY:          return STATE_PRG;
+        default:                  return sim->busState;
+    }
+}
+
+
+static uint32_t _takeStatus(MicronSdSim *sim, uint8_t state, uint32_t bits) {
+    //the card status for a response: state is the one the command found
+    //the card in. error bits are cleared once reported.
+    uint32_t st = sim->busStatus | bits | (state << 9);
+    if(sim->status & R2_RANGE) st |= ST_OUT_OF_RANGE;
+    if(sim->status & R2_ERROR) st |= ST_ERROR;
+    if(state != STATE_PRG) st |= ST_READY_FOR_DATA;
+    sim->busStatus = 0;
+    sim->status = 0;
+    return st;
+}
+
+
+static int _shortResponse(MicronSdSim *sim, uint8_t idx, uint32_t value,
+uint8_t *resp) {
+    //a 48-bit response: index, 32 bits, CRC7 and end bit.
+    resp[0] = idx & 0x3F;
+    resp[1] = value >> 24;
+    resp[2] = value >> 16;
+    resp[3] = value >> 8;
+    resp[4] = value;
+    resp[5] = (_crc7(resp, 5) << 1) | 1;
+    if(_overclocked(sim)) resp[1 + (_random(sim) % 4)] ^= BIT(_random(sim) % 8);
+    return 6;
+}
+
+
+static int _longResponse(MicronSdSim *sim, const uint8_t *reg, uint8_t *resp) {
+    //a 136-bit response: a CID or CSD, whose last byte is its own CRC7.
+    resp[0] = 0x3F;
+    memcpy(resp + 1, reg, 16);
+    if(_overclocked(sim)) resp[1 + (_random(sim) % 16)] ^= BIT(_random(sim) % 8);
+    return 17;
+}
+
+
+static int _r1(MicronSdSim *sim, uint8_t idx, uint8_t state, uint32_t bits,
+uint8_t *resp) {
+    return _shortResponse(sim, idx, _takeStatus(sim, state, bits), resp);
+}
+
+
+static int _illegal(MicronSdSim *sim) {
+    //SD mode doesn't answer commands it won't take.
+    sim->busStatus |= ST_ILLEGAL_COMMAND;
+    return 0;
+}
+
+
+static uint32_t _addressStatus(uint8_t err) {
+    //_address()'s R1 bits as card status.
+    return ((err & R1_ADDR) ? ST_ADDRESS_ERROR : 0) |
+        ((err & R1_PARAM) ? ST_OUT_OF_RANGE : 0);
+}
+
+
+static int _appCommand(MicronSdSim *sim, uint8_t c, uint32_t arg,
+uint8_t state, uint8_t *resp) {
+    //SD mode ACMD6, ACMD23 and ACMD41.
+    switch(c) {
+        case 6:
+            if(state != STATE_TRAN) return _illegal(sim);
+            if((arg & 3) == 1 || (arg & 3) == 3) {
+                return _r1(sim, c, state, ST_APP_CMD | ST_ERROR, resp);
+            }
+            sim->wide = (arg & 3) == 2;
+            return _r1(sim, c, state, ST_APP_CMD, resp);
+
+        case 23: //pre-erase count: just a hint
+            if(state != STATE_TRAN) return _illegal(sim);
+            return _r1(sim, c, state, ST_APP_CMD, resp);
+
+        default: { //41
+            if(state != STATE_IDLE) return _illegal(sim);
+            _powerUp(sim, (arg & BIT(30)) != 0);
+            uint32_t ocr = 0x00FF8000; //2.7-3.6V
+            if(!sim->idle) {
+                sim->busState = STATE_READY;
+                ocr |= BIT(31) | ((sim->cfg.type == SDSIM_SDHC) ? BIT(30) : 0);
+            }
+            //R3 has no index or CRC: those bits are all 1.
+            _shortResponse(sim, 0x3F, ocr, resp);
+            resp[5] = 0xFF;
+            return 6;
+        }
+    }
+}
+
+
+int sdSimCommand(MicronSdSim *sim, uint8_t cmd, uint32_t arg, uint8_t *resp) {
+    /** Send a command to the card in SD mode.
+     *  @param sim Card state.
+     *  @param cmd Command number.
+     *  @param arg Argument.
+     *  @param resp Buffer for the response, 17 bytes.
+     *  @return Response length in bytes: 6 (R1, R3, R6, R7), 17 (R2), or 0
+     *   if the card doesn't answer.
+     *  @note The response is as it goes over the wire, from the start bit
+     *   to the end bit. A card doesn't answer a command it won't take, or
+     *   one with a bad CRC; it sets a status bit, which the next R1 reports.
+     *   Set sim->now and sim->spiHz first.
+     */
+    uint8_t c = cmd & 0x3F;
+    bool acmd = sim->acmd;
+    sim->acmd = false;
+    sim->stats.cmds[c]++;
+    uint8_t state = _busState(sim);
+    if(_chance(sim, sim->cfg.cmdCrcPpm)) {
+        sim->stats.badCmds++;
+        sim->busStatus |= ST_COM_CRC_ERROR;
+        return 0;
+    }
+    //while transferring or busy, only these are listened to.
+    if(state >= STATE_DATA && c != 0 && c != 12 && c != 13) {
+        return _illegal(sim);
+    }
+    if(acmd && (c == 6 || c == 23 || c == 41)) {
+        return _appCommand(sim, c, arg, state, resp);
+    }
+    bool addressed = ((arg >> 16) == sim->rca);
+    uint8_t reg[16];
+    uint32_t block = 0;
+    uint8_t err;
+    switch(c) {
+        case 0:
+            _reset(sim);
+            return 0;
+
+        case 2:
+            if(state != STATE_READY) return _illegal(sim);
+            sim->busState = STATE_IDENT;
+            _makeCID(reg);
+            return _longResponse(sim, reg, resp);
+
+        case 3: {
+            if(state != STATE_IDENT && state != STATE_STBY) return _illegal(sim);
+            sim->rca = SDSIM_RCA;
+            sim->busState = STATE_STBY;
+            //R6: the address, and a few of the status bits.
+            uint32_t st = _takeStatus(sim, state, 0);
+            return _shortResponse(sim, c, (sim->rca << 16) |
+                ((st >> 8) & 0xC000) | ((st >> 6) & 0x2000) | (st & 0x1FFF),
+                resp);
+        }
+
+        case 6:
+            if(state != STATE_TRAN || sim->cfg.type == SDSIM_SDSC_V1) {
+                return _illegal(sim);
+            }
+            //the status comes on the data lines.
+            _switchStatus(sim, arg, sim->buf);
+            sim->regLen = 64;
+            sim->multi = false;
+            sim->phase = SDSIM_READ_WAIT;
+            sim->until = sim->now + (sim->cfg.gapUs * 1000ull);
+            return _r1(sim, c, state, 0, resp);
+
+        case 7:
+            //selecting another card (or none) deselects this one.
+            if(!addressed) {
+                if(state == STATE_TRAN) sim->busState = STATE_STBY;
+                return 0;
+            }
+            if(state != STATE_STBY && state != STATE_TRAN) return _illegal(sim);
+            sim->busState = STATE_TRAN;
+            return _r1(sim, c, state, 0, resp);
+
+        case 8:
+            if(sim->cfg.type == SDSIM_SDSC_V1 || state != STATE_IDLE) {
+                return _illegal(sim);
+            }
+            //echo the check pattern, and accept 2.7-3.6V only.
+            if(((arg >> 8) & 0xF) != 1) return 0;
+            return _shortResponse(sim, c, arg & 0xFFF, resp);
+
+        case 9:
+        case 10:
+            if(state != STATE_STBY) return _illegal(sim);
+            if(!addressed) return 0;
+            if(c == 9) _makeCSD(sim, reg);
+            else _makeCID(reg);
+            return _longResponse(sim, reg, resp);
+
+        case 12: {
+            //stop a transfer, even between the blocks of a write.
+            if(state != STATE_DATA && state != STATE_RCV
+            && !(state == STATE_PRG && sim->after != SDSIM_IDLE)) {
+                return _illegal(sim);
+            }
+            int len = _r1(sim, c, state, 0, resp);
+            uint64_t from = (state == STATE_PRG) ? sim->until : sim->now;
+            sim->regLen = 0;
+            sim->phase = SDSIM_BUSY;
+            sim->until = from + (sim->cfg.stopUs * 1000ull);
+            sim->after = SDSIM_IDLE;
+            return len;
+        }
+
+        case 13:
+            if(state < STATE_STBY) return _illegal(sim);
+            if(!addressed) return 0;
+            return _r1(sim, c, state, acmd ? ST_APP_CMD : 0, resp);
+
+        case 16:
+            if(state != STATE_TRAN) return _illegal(sim);
+            return _r1(sim, c, state,
+                (arg == SDSIM_BLOCK_SIZE) ? 0 : ST_BLOCK_LEN_ERROR, resp);
+
+        case 17:
+        case 18:
+        case 24:
+        case 25:
+            if(state != STATE_TRAN) return _illegal(sim);
+            err = _address(sim, arg, &block);
+            if(err) return _r1(sim, c, state, _addressStatus(err), resp);
+            sim->block = block;
+            sim->multi = (c == 18 || c == 25);
+            if(c == 17 || c == 18) {
+                sim->phase = SDSIM_READ_WAIT;
+                sim->until = sim->now + (sim->cfg.readUs * 1000ull);
+            }
+            else sim->phase = SDSIM_WRITE_TOKEN;
+            return _r1(sim, c, state, 0, resp);
+
+        case 32:
+        case 33:
+            if(state != STATE_TRAN) return _illegal(sim);
+            err = _address(sim, arg, &block);
+            if(err) return _r1(sim, c, state, _addressStatus(err), resp);
+            if(c == 32) sim->eraseStart = block;
+            else sim->eraseEnd = block;
+            return _r1(sim, c, state, 0, resp);
+
+        case 38: {
+            if(state != STATE_TRAN) return _illegal(sim);
+            uint32_t count = 0;
+            err = _eraseBlocks(sim, arg, &count);
+            int len = _r1(sim, c, state,
+                ((err & R1_ERASE_SEQ) ? ST_ERASE_SEQ_ERROR : 0) |
+                ((err & R1_PARAM) ? ST_ERASE_PARAM : 0), resp);
+            if(!err) _busy(sim, (uint64_t)sim->cfg.eraseUs * count, SDSIM_IDLE);
+            return len;
+        }
+
+        case 55:
+            if(state >= STATE_STBY && !addressed) return 0;
+            sim->acmd = true;
+            return _r1(sim, c, state, ST_APP_CMD, resp);
+
+        default:
+            return _illegal(sim);
+    }
+}
+
+
+int sdSimReadData(MicronSdSim *sim, uint8_t *dest, uint32_t len, bool wide,
+uint64_t *start) {
+    /** Get the next block the card sends on the data lines, in SD mode.
+     *  @param sim Card state.
+     *  @param dest Buffer for the data.
+     *  @param len Bytes the host expects: SDSIM_BLOCK_SIZE, or 64 for CMD6.
+     *  @param wide Whether the host is using the 4-bit bus.
+     *  @param start Set to when the card starts sending it.
+     *  @return 0 on success, 1 if it arrives with a bad CRC, or -EIO if the
+     *   card sends nothing (eg a read error), which the host sees as a
+     *   timeout.
+     *  @note Set sim->now to when the host is ready for it. In a CMD18,
+     *   each block after the first comes sim->cfg.gapUs after the host has
+     *   the one before.
+     */
+    if(_busState(sim) != STATE_DATA || sim->phase == SDSIM_READ_STOPPED) {
+        return -EIO;
+    }
+    uint64_t at = (sim->phase == SDSIM_READ_SEND) ?
+        sim->now + (sim->cfg.gapUs * 1000ull) : MAX(sim->now, sim->until);
+    if(sim->regLen) {
+        if(len != sim->regLen) return -EIO;
+        sim->regLen = 0;
+        sim->phase = SDSIM_IDLE;
+    }
+    else {
+        if(len != SDSIM_BLOCK_SIZE || _fetchBlock(sim)) return -EIO;
+        sim->phase = sim->multi ? SDSIM_READ_SEND : SDSIM_IDLE;
+    }
+    memcpy(dest, sim->buf, len);
+    *start = at;
+    //with the wrong bus width, what arrives is nonsense.
+    if(wide != sim->wide) return 1;
+    if(len == SDSIM_BLOCK_SIZE && _corruptRead(sim, dest)) return 1;
+    if(_overclocked(sim)) {
+        dest[_random(sim) % len] ^= BIT(_random(sim) % 8);
+        return 1;
+    }
+    return 0;
+}
+
+
+int sdSimWriteData(MicronSdSim *sim, const uint8_t *src, bool wide,
+uint64_t *busyUntil) {
+    /** Send a block to the card on the data lines, in SD mode.
+     *  @param sim Card state.
+     *  @param src The block, SDSIM_BLOCK_SIZE bytes.
+     *  @param wide Whether the host is using the 4-bit bus.
+     *  @param busyUntil Set to when the card stops being busy with it.
+     *  @return 0 if the card took it, -EILSEQ if it arrived with a bad CRC,
+     *   -EIO if the card couldn't write it, or -ENODATA if the card isn't
+     *   expecting data (so the host gets no CRC status).
+     *  @note Set sim->now to when the block has arrived. The card is busy
+     *   (holding DAT0 low) afterward, even after an error; after an error
+     *   in a CMD25 it takes no more blocks.
+     */
+    if(_busState(sim) != STATE_RCV || sim->phase != SDSIM_WRITE_TOKEN) {
+        return -ENODATA;
+    }
+    memcpy(sim->buf, src, SDSIM_BLOCK_SIZE);
+    uint16_t crc = _crc16(src, SDSIM_BLOCK_SIZE);
+    if(wide != sim->wide || _overclocked(sim)) crc ^= 1;
+    sim->buf[SDSIM_BLOCK_SIZE] = crc >> 8;
+    sim->buf[SDSIM_BLOCK_SIZE + 1] = crc & 0xFF;
+    uint32_t busy;
+    uint8_t token = _storeBlock(sim, true, &busy);
+    uint8_t after = SDSIM_IDLE;
+    if(sim->multi) {
+        after = (token == DATA_ACCEPTED) ? SDSIM_WRITE_TOKEN : SDSIM_WRITE_STOPPED;
+    }
+    _busy(sim, busy, after);
+    *busyUntil = sim->until;
+    if(token == DATA_CRC_ERROR) return -EILSEQ;
+    return (token == DATA_ACCEPTED) ? 0 : -EIO;
+}
+
+
+void sdSimDefaults(MicronSdSimConfig *cfg) {
+    /** Fill in a typical configuration.
+     *  @param cfg Configuration to fill in.
+     *  @note An SDHC card that supports high speed, with CRC checking on,
+     *   and no errors.
+     */
+    memset(cfg, 0, sizeof(MicronSdSimConfig));
+    cfg->type      = SDSIM_SDHC;
+    cfg->ncr       = 1;
+    cfg->erased    = 0x00;
+    cfg->highSpeed = true;
+    cfg->crc       = true;
+    cfg->initUs    = 100000;
+    cfg->maxHz     = 25000000;
+    cfg->readUs    = 100;
+    cfg->gapUs     = 10;
+    cfg->writeUs   = 250;
+    cfg->erasedWriteUs = 100;
+    cfg->stopUs    = 20;
+    cfg->eraseUs   = 1;
+    cfg->eraseSector = 128;
+    cfg->eraseAny  = true;
+    cfg->overclockPpm = 20000;
+    cfg->overclockIn = true;
+    cfg->seed      = 1;
+}
+
+
+int sdSimOpen(MicronSdSim *sim, const MicronSdSimConfig *cfg,
+const char *path, uint64_t size) {
+    /** Set up a simulated card.
+     *  @param sim Card state.
+     *  @param cfg How it behaves.
+     *  @param path Image file to hold its contents, or NULL to keep them in
+     *   memory.
+     *  @param size Capacity in bytes. A file shorter than this is extended;
+     *   0 means use the file's size.
+     *  @return 0 on success, or negative error code on failure: -EFBIG if
+     *   the card type can't be that size (SDSC is at most 2 GB, SDHC at
+     *   least 512 KB).
+     *  @note The card starts out as if just powered on. Contents of a new
+     *   file or memory image read as cfg->erased.
+     */
+    memset(sim, 0, sizeof(MicronSdSim));
+    sim->cfg = *cfg;
+    sim->cfg.ncr = MIN(MAX(sim->cfg.ncr, (uint8_t)1), (uint8_t)8);
+    sim->cfg.eraseSector = MIN(MAX(sim->cfg.eraseSector, (uint8_t)1),
+        (uint8_t)128);
+    sim->rng = cfg->seed ? cfg->seed : 1;
+    sim->fd = -1;
+    uint64_t erasedFrom = 0; //new space starts out erased
+
+    if(path) {
+        sim->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(sim->fd < 0) return -errno;
+        struct stat st;
+        if(fstat(sim->fd, &st)) return -errno;
+        uint64_t have = st.st_size;
+        if(!size) size = have;
+        erasedFrom = have / SDSIM_BLOCK_SIZE;
+        if(have < size) {
+            //new space reads as erased.
+            sim->nBlocks = size / SDSIM_BLOCK_SIZE;
+            uint32_t first = have / SDSIM_BLOCK_SIZE;
+            int err = _fill(sim, first, sim->nBlocks - first, cfg->erased);
+            if(err) return err;
+        }
+    }
+    else {
+        sim->mem = (uint8_t*)malloc(size);
+        if(!sim->mem) return -ENOMEM;
+        memset(sim->mem, cfg->erased, size);
+    }
+    if(size / SDSIM_BLOCK_SIZE > UINT32_MAX) return -EFBIG;
+    sim->nBlocks = size / SDSIM_BLOCK_SIZE;
+    sim->erased = (uint8_t*)calloc((sim->nBlocks + 7) / 8, 1);
+    if(!sim->erased) return -ENOMEM;
+    if(erasedFrom < sim->nBlocks) {
+        _setErased(sim, erasedFrom, sim->nBlocks - erasedFrom, true);
+    }
+
+    uint8_t csd[16];
+    int err = _makeCSD(sim, csd);
+    if(err) return err;
+    _reset(sim);
+    return 0;
+}
+
+
+void sdSimClose(MicronSdSim *sim) {
+    /** Close a simulated card's image.
+     *  @param sim Card state.
+     */
+    if(sim->fd >= 0) close(sim->fd);
+    free(sim->mem);
+    free(sim->erased);
+    sim->fd = -1;
+    sim->mem = NULL;
+    sim->erased = NULL;
+}
+
+
+int sdSimReadImage(MicronSdSim *sim, uint32_t block, void *dest) {
+    /** Read a block straight from the image, eg to check what was written.
+     *  @param sim Card state.
+     *  @param block Block number.
+     *  @param dest Destination buffer, SDSIM_BLOCK_SIZE bytes.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    if(block >= sim->nBlocks) return -ERANGE;
+    return _imageIO(sim, block, 1, dest, false);
+}
+
+
+int sdSimWriteImage(MicronSdSim *sim, uint32_t block, const void *src) {
+    /** Write a block straight to the image, eg to set up a test.
+     *  @param sim Card state.
+     *  @param block Block number.
+     *  @param src Data to write, SDSIM_BLOCK_SIZE bytes.
+     *  @return 0 on success, or negative error code on failure.
+     */
+    if(block >= sim->nBlocks) return -ERANGE;
+    _setErased(sim, block, 1, false);
+    return _imageIO(sim, block, 1, (void*)src, true);
+}
+
+
+uint8_t sdSimTransfer(MicronSdSim *sim, uint8_t in, bool cs) {
+    /** Clock one byte through the card.
+     *  @param sim Card state.
+     *  @param in Byte the host sends.
+     *  @param cs Whether the card is selected.
+     *  @return Byte the card sends.
+     *  @note spi.c sets sim->now and sim->spiHz first.
+     */
+    if(!cs) return 0xFF; //not listening, and the output floats high
+    sim->stats.bytes++;
+    uint8_t out = _output(sim);
+    _input(sim, sim->cfg.overclockIn ? _garble(sim, in) : in);
+    return _garble(sim, out);
+}
+
+
+uint64_t sdSimBusyUntil(MicronSdSim *sim) {
+    /** Find out when the card stops holding its output low.
+     *  @param sim Card state.
+     *  @return Time (as in sim->now) it stops being busy, or 0 if it isn't.
+     *  @note Like a real card, it goes on being busy without being clocked,
+     *   and drives its output while selected.
+     */
+    if(sim->phase != SDSIM_BUSY || sim->outLen || sim->now >= sim->until) {
+        return 0;
+    }
+    return sim->until;
+}
+
+
+uint16_t sdSimCrc16(const uint8_t *data, size_t len) {
+    /** Compute the CRC16 of a data block the way the card checks it, a bit
+     *  at a time, for the crc command to compare the driver's with.
+     *  @param data Data to compute.
+     *  @param len Length of data.
+     *  @return The CRC16.
+     */
+    return _crc16(data, len);
+}
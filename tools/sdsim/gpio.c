@@ -0,0 +1,110 @@
+//HAL GPIO functions for sdsim, and irqWait(). A pin can be wired to an SPI
+//port's MISO, so it reads the card's output. Pin interrupts are raised from
+//irqWait(), since that's the only place a program waits for one: it lets
+//time pass until the next millisecond (when the systick would wake it), or
+//until a wired pin changes the way its interrupt is waiting for, and then
+//calls the handler, as the ISR would. Bytes sent but not yet read wake it
+//at once, as the SPI receive interrupt would.
+extern "C" {
+    #include <micron.h>
+    #include "sdsim.h"
+}
+
+#define SDSIM_NUM_PINS 64
+
+typedef struct {
+    int port;             //SPI port whose MISO it's wired to, or -1
+    PinInterruptMode mode;
+    MicronPinIsr isr;
+    void *param;
+} MicronSdSimPin;
+
+static MicronSdSimPin _pins[SDSIM_NUM_PINS];
+static bool _wired = false;
+static uint64_t _slept = 0; //nanoseconds spent in irqWait()
+
+static void _initPins() {
+    //pins aren't wired to anything until sdSimWirePin().
+    if(_wired) return;
+    for(int i=0; i<SDSIM_NUM_PINS; i++) _pins[i].port = -1;
+    _wired = true;
+}
+
+
+static int _level(uint32_t pin, uint64_t *changeAt) {
+    //unwired pins read low and never change.
+    if(_pins[pin].port < 0) return 0;
+    return sdSimMisoLevel(_pins[pin].port, changeAt);
+}
+
+
+void sdSimWirePin(uint32_t pin, int port) {
+    /** Connect a pin to an SPI port's MISO line.
+     *  @param pin Which pin.
+     *  @param port Which SPI port, or -1 to disconnect it.
+     */
+    _initPins();
+    if(pin < SDSIM_NUM_PINS) _pins[pin].port = port;
+}
+
+
+uint64_t sdSimSleepTime() {
+    /** Get how long the program has spent in irqWait().
+     *  @return Time in nanoseconds.
+     */
+    return _slept;
+}
+
+
+void irqWait() {
+    _initPins();
+    if(sdSimTakeIrq()) return;
+    uint64_t now = sdSimTime();
+    uint64_t wake = ((now / 1000000) + 1) * 1000000; //next systick
+    int fire = -1;
+    for(int i=0; i<SDSIM_NUM_PINS; i++) {
+        MicronSdSimPin *p = &_pins[i];
+        if(p->mode == PIN_INTERRUPT_NONE || !p->isr) continue;
+        uint64_t changeAt = 0;
+        int level = _level(i, &changeAt);
+        if((p->mode == PIN_INTERRUPT_HIGH && level)
+        || (p->mode == PIN_INTERRUPT_LOW && !level)) {
+            wake = now;
+            fire = i;
+            break;
+        }
+        //the only change the card makes without being clocked is rising
+        //at the end of a busy phase.
+        bool rising = (p->mode == PIN_INTERRUPT_RISING
+            || p->mode == PIN_INTERRUPT_EITHER);
+        if(rising && !level && changeAt && changeAt < wake) {
+            wake = changeAt;
+            fire = i;
+        }
+    }
+    _slept += wake - now;
+    sdSimAdvance(wake - now);
+    if(fire >= 0) _pins[fire].isr(fire, _pins[fire].param);
+}
+
+
+int gpioSetPinMode(uint32_t pin, PinMode mode) {
+    return (pin < SDSIM_NUM_PINS) ? 0 : -ENODEV;
+}
+
+
+int gpioGetPinInput(uint32_t pin) {
+    _initPins();
+    if(pin >= SDSIM_NUM_PINS) return -ENODEV;
+    return _level(pin, NULL);
+}
+
+
+int gpioSetPinInterrupt(uint32_t pin, PinInterruptMode mode, MicronPinIsr isr,
+void *param) {
+    if(pin >= SDSIM_NUM_PINS) return -ENODEV;
+    _pins[pin].mode = mode;
+    _pins[pin].isr = (mode == PIN_INTERRUPT_NONE) ? NULL : isr;
+    _pins[pin].param = param;
+    return 0;
+}
@@ -0,0 +1,1403 @@
+/** sdsim: run the SD card drivers on a PC, against a simulated card.
+ *  sdsim [options] info|check|bench|fat|crc|speed|queue [image]
+ *  See README.md.
+ */
+extern "C" {
+    #include <micron.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <drivers/sdcard/sdcard.h>
+    #include <drivers/imx/usdhc/usdhc.h>
+    #include <drivers/fs/fat/fat.h>
+    #include "sdsim.h"
+}
+
+#define TIMEOUT 1000 //ms, for driver calls
+
+static MicronSdSim card;
+static MicronSdCardState sdcard;
+static MicronSdReadAhead readAhead;
+static MicronSdQueue queue;
+static bool useReadAhead = false, useHighSpeed = true;
+static MicronSdBusyMode busyMode = SD_BUSY_POLL;
+static uint8_t busyPin = 12; //wired to MISO
+//-U: the uSDHC driver instead, with the card in SD mode.
+static bool useUsdhc = false;
+static const char *tracePath = "queue.trace"; //for the queue command
+static MicronUsdhcState usdhc;
+//what the driver in use says about the card.
+static uint32_t devBlocks, devEraseSize;
+static bool devEraseAny;
+
+static void usage() {
+    printf(
+        "usage: sdsim [options] info|check|bench|fat|crc|speed|queue [image]\n"
+        "  info   initialize the card and show what the driver sees\n"
+        "  check  write and read back through the driver, and compare with\n"
+        "         the image (OVERWRITES the image); exits 1 on bad data\n"
+        "  bench  time reads and writes, in simulated time (also writes)\n"
+        "  fat    delete files on a FAT volume (also writes); exits 1 unless\n"
+        "         exactly their clusters were erased\n"
+        "  crc    check the driver's CRC16 against the card's; exits 1 if\n"
+        "         they differ\n"
+        "  speed  check the clock chosen for cards with various CSD speeds,\n"
+        "         and lowered after CRC errors; exits 1 if wrong\n"
+        "  queue  replay a trace through the request queue (also writes);\n"
+        "         exits 1 if it takes the wrong number of commands, or reads\n"
+        "         the wrong data\n"
+        "  image  disk image file; if none, the card is in memory\n"
+        "options:\n"
+        "  -t sdsc1|sdsc|sdhc  card type (default sdhc)\n"
+        "  -s size   capacity, eg 64M (default: image size, or 64M)\n"
+        "  -c n      driver block cache size in blocks (default 16)\n"
+        "  -U        use the uSDHC (SD mode, 4-bit) driver instead of SPI;\n"
+        "            -c, -a, -B and -P don't apply\n"
+        "  -a        use read-ahead\n"
+        "  -n        don't switch to high speed mode\n"
+        "  -m hz     fastest clock the card works at (default 25000000)\n"
+        "  -T byte   TRAN_SPEED in the CSD, eg 0x32 (default: 25 or 50 MHz)\n"
+        "  -r us     read access time (default 100)\n"
+        "  -g us     gap between blocks of a multiple block read (default 10)\n"
+        "  -w us     busy time after writing a block (default 250)\n"
+        "  -E us     the same, for a block that was erased (default 100)\n"
+        "  -z n      erase sector size in blocks, for SDSC (default 128)\n"
+        "  -Z        SDSC card can only erase whole erase sectors\n"
+        "  -B spin|poll|pin  how the driver waits while the card is busy\n"
+        "            (default poll)\n"
+        "  -P pin    pin for -B pin (default 12, which is wired to MISO;\n"
+        "            others aren't, so it has to fall back to polling)\n"
+        "  -e what=ppm  inject errors, per million: cmd (command CRC),\n"
+        "         rcrc, wcrc (data CRC), rerr, werr (error responses),\n"
+        "         clock (bytes garbled when overclocked; default 20000)\n"
+        "  -b block  block that always fails (up to %d)\n"
+        "  -q file   trace for queue (default queue.trace)\n"
+        "  -x seed   for error injection and the tests\n",
+        SDSIM_MAX_BAD_BLOCKS);
+}
+
+
+static uint64_t parseSize(const char *s) {
+    char *end;
+    uint64_t n = strtoull(s, &end, 0);
+    switch(*end) {
+        case 'G': case 'g': n <<= 30; break;
+        case 'M': case 'm': n <<= 20; break;
+        case 'K': case 'k': n <<= 10; break;
+    }
+    return n;
+}
+
+
+static int setError(MicronSdSimConfig *cfg, const char *spec) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } kinds[] = {
+        {"cmd",   offsetof(MicronSdSimConfig, cmdCrcPpm)},
+        {"rcrc",  offsetof(MicronSdSimConfig, readCrcPpm)},
+        {"wcrc",  offsetof(MicronSdSimConfig, writeCrcPpm)},
+        {"rerr",  offsetof(MicronSdSimConfig, readErrPpm)},
+        {"werr",  offsetof(MicronSdSimConfig, writeErrPpm)},
+        {"clock", offsetof(MicronSdSimConfig, overclockPpm)},
+    };
+    const char *eq = strchr(spec, '=');
+    if(!eq) return -EINVAL;
+    for(size_t i=0; i<sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if(strlen(kinds[i].name) == (size_t)(eq - spec)
+        && !strncmp(kinds[i].name, spec, eq - spec)) {
+            *(uint32_t*)((uint8_t*)cfg + kinds[i].offset) = atoi(eq + 1);
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+
+static uint32_t rng = 1;
+static uint32_t rnd() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+
+static uint32_t countCmds() {
+    uint32_t n = 0;
+    for(int i=0; i<64; i++) n += card.stats.cmds[i];
+    return n;
+}
+
+
+//the driver calls check and bench make, for whichever driver is in use.
+static int devRead(uint32_t block, uint32_t count, void *buf) {
+    if(useUsdhc) return usdhcReadBlocks(&usdhc, block, count, buf, TIMEOUT);
+    if(count == 1) return sdReadBlock(&sdcard, block, buf, TIMEOUT, true);
+    return sdReadMultiple(&sdcard, block, count, buf, TIMEOUT, true);
+}
+
+
+static int devWrite(uint32_t block, uint32_t count, const void *buf) {
+    if(useUsdhc) return usdhcWriteBlocks(&usdhc, block, count, buf, TIMEOUT);
+    if(count == 1) return sdWriteBlock(&sdcard, block, buf, TIMEOUT);
+    return sdWriteMultiple(&sdcard, block, count, buf, TIMEOUT);
+}
+
+
+static int devEraseBegin(uint32_t block, uint32_t count) {
+    if(useUsdhc) return usdhcEraseBegin(&usdhc, block, count, TIMEOUT);
+    return sdEraseBegin(&sdcard, block, count, TIMEOUT);
+}
+
+
+static int devErase(uint32_t block, uint32_t count) {
+    if(useUsdhc) return usdhcErase(&usdhc, block, count, TIMEOUT);
+    return sdErase(&sdcard, block, count, TIMEOUT);
+}
+
+
+static int devDiscard(uint32_t block, uint32_t count) {
+    if(useUsdhc) return usdhcDiscard(&usdhc, block, count, TIMEOUT);
+    return sdDiscard(&sdcard, block, count, TIMEOUT);
+}
+
+
+static uint32_t devPolls() {
+    //busy polls, or for uSDHC, register reads.
+    return useUsdhc ? usdhcSimStats()->reads : sdcard.busyStats.polls;
+}
+
+
+static int initUsdhc() {
+    usdhc.port = 1;
+    usdhcSimAttach(&card);
+    int err = usdhcInit(&usdhc);
+    if(!err) err = usdhcReset(&usdhc, 5000);
+    if(!err && useHighSpeed) err = usdhcHighSpeed(&usdhc, TIMEOUT);
+    if(err < 0) {
+        printf("uSDHC init failed: %d\n", err);
+        return err;
+    }
+    devBlocks = usdhc.nBlocks;
+    devEraseSize = usdhc.eraseSize;
+    devEraseAny = usdhc.eraseAny;
+    return 0;
+}
+
+
+static int initSD() {
+    sdcard.port = 0;
+    sdcard.pinCS = 10;
+    int err = sdcardInit(&sdcard);
+    if(!err) err = sdcardReset(&sdcard, 5000);
+    if(!err) err = sdReadInfo(&sdcard, 5000);
+    if(err) {
+        printf("SD init failed: %d\n", err);
+        return err;
+    }
+    devBlocks = sdcard.nSectors;
+    devEraseSize = sdcard.eraseSize;
+    devEraseAny = sdcard.eraseAny;
+    err = sdNegotiateSpeed(&sdcard, useHighSpeed, TIMEOUT);
+    if(err < 0) {
+        printf("SD speed negotiation failed: %d\n", err);
+        return err;
+    }
+    err = sdBusyInit(&sdcard, busyMode, busyPin);
+    if(err) {
+        printf("SD busy wait init failed: %d\n", err);
+        return err;
+    }
+    if(useReadAhead) {
+        err = sdReadAheadInit(&sdcard, &readAhead, TIMEOUT, true);
+        if(err) {
+            printf("SD read-ahead init failed: %d\n", err);
+            return err;
+        }
+    }
+    return sdQueueInit(&sdcard, &queue, TIMEOUT, true);
+}
+
+
+static int cmdInfo() {
+    static const char *types[] = {"SDSC v1", "SDSC", "SDHC"};
+    printf("card:    %s, %u blocks\n", types[card.cfg.type], card.nBlocks);
+    if(useUsdhc) {
+        printf("driver:  uSDHC, version %d, %u blocks, %" PRIu64 " bytes, "
+            "RCA 0x%04X\n", usdhc.cardVersion, usdhc.nBlocks, usdhc.cardSize,
+            usdhc.rca);
+        printf("clock:   %u Hz, %d-bit bus%s\n", usdhc.clockHz, usdhc.busWidth,
+            usdhc.highSpeed ? " (high speed mode)" : "");
+        printf("init:    %.3f ms, %u commands\n", sdSimTime() / 1e6,
+            countCmds());
+        printf("errors:  %u command, %u data\n", usdhc.stats.cmdErrors,
+            usdhc.stats.dataErrors);
+        return 0;
+    }
+    printf("driver:  version %d, %" PRIu64 " blocks of %d bytes, %"
+        PRIu64 " bytes\n", sdcard.cardVersion, sdcard.nSectors,
+        sdcard.sectorSize, sdcard.cardSize);
+    printf("clock:   %u Hz%s\n", sdcard.spiSpeed,
+        sdcard.highSpeed ? " (high speed mode)" : "");
+    printf("init:    %.3f ms, %u commands\n", sdSimTime() / 1e6, countCmds());
+    printf("errors:  %u CRC, %u response, %u speed steps down\n",
+        sdcard.speedStats.crcErrors, sdcard.speedStats.respErrors,
+        sdcard.speedStats.stepDowns);
+    return 0;
+}
+
+
+//check: a copy of what the card should hold, and counts of what went wrong.
+static uint8_t *model;
+static uint32_t nCheck, readErrs, writeErrs, mismatches;
+
+static void fillRandom(uint8_t *buf, uint32_t count) {
+    for(uint32_t i=0; i<count * SD_BLOCK_SIZE; i += 4) {
+        uint32_t r = rnd();
+        memcpy(&buf[i], &r, 4);
+    }
+}
+
+
+static void checkWrite(uint32_t block, uint32_t count, int err) {
+    //after a write: a failed one may have written some of it, so whatever
+    //the card holds now is what it should hold.
+    if(err >= 0) return;
+    writeErrs++;
+    for(uint32_t i=0; i<count; i++) {
+        sdSimReadImage(&card, block + i, &model[(block + i) * SD_BLOCK_SIZE]);
+    }
+}
+
+
+static void checkRead(const char *how, uint32_t block, uint32_t count,
+const uint8_t *buf, int err) {
+    //after a read: it may fail, but mustn't return wrong data.
+    if(err < 0) {
+        readErrs++;
+        return;
+    }
+    for(uint32_t i=0; i<count; i++) {
+        if(memcmp(&buf[i * SD_BLOCK_SIZE], &model[(block + i) * SD_BLOCK_SIZE],
+        SD_BLOCK_SIZE)) {
+            if(mismatches++ < 10) printf("bad data from %s at block %u\n",
+                how, block + i);
+        }
+    }
+}
+
+
+static void checkErase(uint32_t block, uint32_t count, int err) {
+    //after an erase: the blocks read as erased, unless it failed, in which
+    //case whatever the card holds now is what it should hold.
+    if(err >= 0) {
+        memset(&model[block * SD_BLOCK_SIZE], card.cfg.erased,
+            count * SD_BLOCK_SIZE);
+        return;
+    }
+    writeErrs++;
+    for(uint32_t i=0; i<count; i++) {
+        sdSimReadImage(&card, block + i, &model[(block + i) * SD_BLOCK_SIZE]);
+    }
+}
+
+
+static void queueDone(MicronSdCardState *state, void *udata, int result) {
+    *(int*)udata = result;
+}
+
+
+static int cmdCheck() {
+    nCheck = MIN(devBlocks, (uint32_t)8192);
+    model = (uint8_t*)malloc(nCheck * SD_BLOCK_SIZE);
+    //room to be misaligned, for the uSDHC driver's bounce buffer.
+    uint8_t *buf = (uint8_t*)aligned_alloc(32, 65 * SD_BLOCK_SIZE);
+    uint8_t *buf2 = (uint8_t*)malloc(64 * SD_BLOCK_SIZE);
+    if(!model || !buf || !buf2) return -ENOMEM;
+
+    //fill it, in pieces of random size.
+    for(uint32_t b=0; b<nCheck; ) {
+        uint32_t n = MIN(1 + (rnd() % 32), nCheck - b);
+        fillRandom(&model[b * SD_BLOCK_SIZE], n);
+        int err = devWrite(b, n, &model[b * SD_BLOCK_SIZE]);
+        checkWrite(b, n, err);
+        b += n;
+    }
+
+    //then a mix of everything, partly sequential.
+    uint32_t seq = 0;
+    for(int op=0; op<4000; op++) {
+        uint32_t n = 1 + (rnd() % ((rnd() % 4) ? 4 : 64));
+        uint32_t b = rnd() % (nCheck - n);
+        if(op % 100 < 30) {
+            b = (seq + n <= nCheck) ? seq : 0;
+            seq = b + n;
+        }
+        int err = 0, e1 = 1, e2 = 1;
+        uint8_t *p = buf + ((useUsdhc && (rnd() & 1)) ? 4 : 0);
+        uint32_t what = rnd() % 10;
+        //the queue and read-ahead are the SPI driver's.
+        if(useUsdhc && what >= 5 && what <= 7) what = 1;
+        switch(what) {
+            case 0:
+                err = devRead(b, 1, buf);
+                checkRead("single read", b, 1, buf, err);
+                break;
+            case 1: case 2:
+                err = devRead(b, n, p);
+                checkRead("multiple read", b, n, p, err);
+                break;
+            case 3:
+                fillRandom(buf, 1);
+                err = devWrite(b, 1, buf);
+                if(err >= 0) memcpy(&model[b * SD_BLOCK_SIZE], buf,
+                    SD_BLOCK_SIZE);
+                checkWrite(b, 1, err);
+                break;
+            case 4:
+                fillRandom(p, n);
+                err = devWrite(b, n, p);
+                if(err >= 0) memcpy(&model[b * SD_BLOCK_SIZE], p,
+                    n * SD_BLOCK_SIZE);
+                checkWrite(b, n, err);
+                break;
+            case 5: {
+                //two queued reads of adjacent ranges, which get merged.
+                uint32_t n2 = MIN(n, (uint32_t)64 - n);
+                if(!n2 || b + n + n2 > nCheck) break;
+                sdQueueRead(&sdcard, b, n, buf, 0, queueDone, &e1);
+                sdQueueRead(&sdcard, b + n, n2, buf2, 0, queueDone, &e2);
+                err = sdQueueFlush(&sdcard);
+                checkRead("queued read", b, n, buf, err ? err : e1);
+                checkRead("queued read", b + n, n2, buf2, err ? err : e2);
+                break;
+            }
+            case 6:
+                //a queued write, and a read of the same range behind it.
+                fillRandom(buf, n);
+                sdQueueWrite(&sdcard, b, n, buf, queueDone, &e1);
+                sdQueueRead(&sdcard, b, n, buf2, 0, queueDone, &e2);
+                err = sdQueueFlush(&sdcard);
+                if(!err && !e1) memcpy(&model[b * SD_BLOCK_SIZE], buf,
+                    n * SD_BLOCK_SIZE);
+                checkWrite(b, n, err ? err : e1);
+                checkRead("read after queued write", b, n, buf2,
+                    err ? err : e2);
+                break;
+            case 7:
+                if(useReadAhead) for(int i=0; i<8; i++) sdReadAheadStep(&sdcard);
+                break;
+            case 8: {
+                //erase, in whole erase sectors if the card needs that, and
+                //read back a block that was cached. the read waits for the
+                //erase to finish.
+                uint32_t size = devEraseAny ? 1 : devEraseSize;
+                uint32_t first = b - (b % size);
+                uint32_t count = ((n + size - 1) / size) * size;
+                if(first + count > nCheck) break;
+                devRead(first, 1, buf);
+                err = devEraseBegin(first, count);
+                checkErase(first, count, err);
+                err = devRead(first, 1, buf);
+                checkRead("read after erase", first, 1, buf, err);
+                break;
+            }
+            case 9: {
+                //discard a range around a few erase sectors; only whole
+                //sectors in it are erased.
+                uint32_t size = devEraseSize;
+                uint32_t count = 1 + (rnd() % (size * 3));
+                uint32_t first = rnd() % (nCheck - MIN(count, nCheck - 1));
+                if(first + count > nCheck) break;
+                err = devDiscard(first, count);
+                if(err > 0) {
+                    uint32_t start = ((first + size - 1) / size) * size;
+                    checkErase(start, err, 0);
+                }
+                else if(err < 0) checkErase(first, count, err);
+                break;
+            }
+        }
+    }
+
+    //finally the card must hold what it was told to.
+    uint32_t wrong = 0;
+    for(uint32_t b=0; b<nCheck; b++) {
+        sdSimReadImage(&card, b, buf);
+        if(memcmp(buf, &model[b * SD_BLOCK_SIZE], SD_BLOCK_SIZE)) wrong++;
+    }
+    printf("checked %u blocks: %u read errors, %u write errors, %u bad reads, "
+        "%u bad blocks on card\n", nCheck, readErrs, writeErrs, mismatches,
+        wrong);
+    printf("card: %u blocks read, %u written (%u erased first), %u erased; "
+        "%u bad commands, %u CRC errors sent, %u received, %u garbled bytes; "
+        "%u bytes lost by SPI\n",
+        card.stats.blocksRead, card.stats.blocksWritten,
+        card.stats.erasedWrites, card.stats.blocksErased, card.stats.badCmds,
+        card.stats.readCrcErrors, card.stats.writeCrcErrors,
+        card.stats.flips, sdSimOverflows(0));
+    uint32_t violations = 0;
+    if(useUsdhc) {
+        MicronUsdhcStats *st = &usdhc.stats;
+        MicronUsdhcSimStats *sim = usdhcSimStats();
+        violations = sim->violations;
+        printf("uSDHC: %u commands, %u transfers, %u blocks (%u bounced), "
+            "%u retries, %u command errors, %u data errors, %u DMA errors; "
+            "model: %u descriptors, %u register accesses, %u violations; "
+            "%.1f ms\n", st->cmds, st->transfers, st->blocks, st->bounced,
+            st->retries, st->cmdErrors, st->dataErrors, st->dmaErrors,
+            sim->descriptors, sim->reads + sim->writes, violations,
+            sdSimTime() / 1e6);
+    }
+    else printf("busy: %u waits, %u polls, %u sleeps, %u pin wakes; slept "
+        "%.1f of %.1f ms\n", sdcard.busyStats.waits, sdcard.busyStats.polls,
+        sdcard.busyStats.sleeps, sdcard.busyStats.wakes,
+        sdSimSleepTime() / 1e6, sdSimTime() / 1e6);
+    free(model);
+    free(buf);
+    free(buf2);
+    return (mismatches || wrong || violations) ? 1 : 0;
+}
+
+
+//bench: counters at the start of a row.
+static uint64_t benchT0, benchSlept0;
+static uint32_t benchCmds0, benchPolls0;
+
+static void benchStart() {
+    benchT0 = sdSimTime();
+    benchSlept0 = sdSimSleepTime();
+    benchCmds0 = countCmds();
+    benchPolls0 = devPolls();
+}
+
+
+static void benchRow(const char *name, uint32_t blocks, uint32_t ops) {
+    double us = (sdSimTime() - benchT0) / 1e3;
+    printf("%-13s %8.0f %9.2f %9.1f %8u %8u %7.0f%%\n", name, us / 1e3,
+        (blocks * (double)SD_BLOCK_SIZE) / us, us / ops,
+        countCmds() - benchCmds0, devPolls() - benchPolls0,
+        100 * ((sdSimSleepTime() - benchSlept0) / 1e3) / us);
+}
+
+
+//bench: read patterns run with and without read-ahead. each reads
+//RA_BLOCKS blocks within RA_SPAN of its base.
+#define RA_BLOCKS 1024
+#define RA_SPAN   (RA_BLOCKS * 4)
+#define RA_WORK   200000 //ns of work between reads for "x1 with work"
+static const char *raPatterns[] = {"x1 sequential", "x8 sequential",
+    "x1 stride 4", "x1 two files", "x1 with work"};
+
+static void raReads(int pattern, uint32_t base, uint8_t *buf) {
+    for(uint32_t i=0; i<RA_BLOCKS; ) {
+        uint32_t block = base + i, n = 1;
+        if(pattern == 1) n = 8;
+        else if(pattern == 2) block = base + (i * 4);
+        else if(pattern == 3) block = base + (i / 2) + ((i & 1) * RA_SPAN / 2);
+        int err = devRead(block, n, buf);
+        if(err < 0) printf("read error %d at %u\n", err, block);
+        if(pattern == 4) {
+            //the program works on the block, and read-ahead gets what
+            //time it can from the main loop meanwhile.
+            uint64_t until = sdSimTime() + RA_WORK;
+            while(sdcard.readAhead && sdSimTime() < until
+            && sdReadAheadStep(&sdcard) > 0) {}
+            if(sdSimTime() < until) sdSimAdvance(until - sdSimTime());
+        }
+        i += n;
+    }
+}
+
+
+static void raSet(bool on) {
+    //turn read-ahead on or off between bench patterns.
+    sdReadAheadStop(&sdcard);
+    if(on) sdReadAheadInit(&sdcard, &readAhead, TIMEOUT, true);
+    else sdcard.readAhead = NULL;
+}
+
+
+static void benchReadAhead(uint32_t base, uint8_t *buf) {
+    //time each pattern without read-ahead, then with it, on fresh blocks
+    //so that neither finds the other's in the block cache.
+    printf("\n%-13s %8s %8s %9s %9s %6s %6s %6s\n", "read-ahead", "ms off",
+        "ms on", "cmds off", "cmds on", "issued", "hits", "wasted");
+    for(int p=0; p<5; p++) {
+        double ms[2];
+        uint32_t cmds[2];
+        for(int on=0; on<2; on++) {
+            raSet(on); //which clears the stats
+            benchStart();
+            raReads(p, base + (((p * 2) + on) * RA_SPAN), buf);
+            ms[on] = (sdSimTime() - benchT0) / 1e6;
+            cmds[on] = countCmds() - benchCmds0;
+        }
+        MicronSdReadAheadStats *st = &readAhead.stats;
+        printf("%-13s %8.1f %8.1f %9u %9u %6u %6u %6u\n", raPatterns[p],
+            ms[0], ms[1], cmds[0], cmds[1], st->issued, st->hits,
+            st->wasted);
+        raSet(useReadAhead);
+    }
+}
+
+
+static int cmdBench() {
+    const uint32_t len = 2048; //1 MB per test
+    uint32_t nBlocks = devBlocks, need = (len * 8) + (RA_SPAN * 10);
+    if(nBlocks < need) {
+        printf("card too small; need %u blocks\n", need);
+        return 1;
+    }
+    uint8_t *buf = (uint8_t*)aligned_alloc(32, 64 * SD_BLOCK_SIZE);
+    if(!buf) return -ENOMEM;
+    fillRandom(buf, 64);
+    static const char *busyModes[] = {"spin", "poll", "pin"};
+    if(useUsdhc) printf("uSDHC, clock %u Hz, %d-bit bus, read access %u us, "
+        "write busy %u us (%u erased)\n", usdhc.clockHz, usdhc.busWidth,
+        card.cfg.readUs, card.cfg.writeUs, card.cfg.erasedWriteUs);
+    else printf("clock %u Hz, read access %u us, write busy %u us (%u "
+        "erased), busy wait %s%s\n", sdcard.spiSpeed, card.cfg.readUs,
+        card.cfg.writeUs, card.cfg.erasedWriteUs, busyModes[sdcard.busyMode],
+        useReadAhead ? ", read-ahead" : "");
+    printf("%-13s %8s %9s %9s %8s %8s %8s\n", "test", "ms", "MB/s", "us/op",
+        "commands", useUsdhc ? "reg rds" : "polls", "asleep");
+
+    static const uint32_t sizes[] = {1, 8, 64};
+    for(int i=0; i<3; i++) {
+        uint32_t n = sizes[i], base = i * len;
+        benchStart();
+        for(uint32_t b=0; b<len; b+=n) {
+            int err = devRead(base + b, n, buf);
+            if(err < 0) printf("read error %d at %u\n", err, base + b);
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "read x%u", n);
+        benchRow(name, len, len / n);
+    }
+
+    benchStart();
+    for(int i=0; i<500; i++) {
+        int err = devRead(rnd() % nBlocks, 1, buf);
+        if(err < 0) printf("read error %d\n", err);
+    }
+    benchRow("random read", 500, 500);
+
+    for(int i=0; i<3; i++) {
+        uint32_t n = sizes[i], base = (i + 3) * len;
+        benchStart();
+        for(uint32_t b=0; b<len; b+=n) {
+            int err = devWrite(base + b, n, buf);
+            if(err < 0) printf("write error %d at %u\n", err, base + b);
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "write x%u", n);
+        benchRow(name, len, len / n);
+    }
+
+    benchStart();
+    for(int i=0; i<500; i++) {
+        int err = devWrite(rnd() % nBlocks, 1, buf);
+        if(err < 0) printf("write error %d\n", err);
+    }
+    benchRow("random write", 500, 500);
+
+    //writing over old data, then erasing it and writing again.
+    uint32_t base = 6 * len;
+    for(int pass=0; pass<2; pass++) {
+        benchStart();
+        for(uint32_t b=0; b<len; b+=64) {
+            int err = devWrite(base + b, 64, buf);
+            if(err < 0) printf("write error %d at %u\n", err, base + b);
+        }
+        if(pass) benchRow("overwrite x64", len, len / 64);
+    }
+    benchStart();
+    int err = devErase(base, len);
+    if(err < 0) printf("erase error %d\n", err);
+    benchRow("erase", len, 1);
+    benchStart();
+    for(uint32_t b=0; b<len; b+=64) {
+        err = devWrite(base + b, 64, buf);
+        if(err < 0) printf("write error %d at %u\n", err, base + b);
+    }
+    benchRow("erased x64", len, len / 64);
+    if(!useUsdhc) {
+        if(sdcard.blockCacheSize) benchReadAhead(8 * len, buf);
+        else printf("\nno block cache, so no read-ahead to compare\n");
+    }
+    free(buf);
+    return 0;
+}
+
+
+//fat: a FAT32 volume, starting at a block that isn't a multiple of any
+//erase sector size, so that clusters straddle erase sectors.
+#define FAT_START    2049
+#define FAT_BLOCKS   16384
+#define FAT_SPC      4  //blocks per cluster
+#define FAT_RESERVED 32 //blocks before the FATs
+#define FAT_FILES    16
+#define FAT_MAX_RUNS 256 //of contiguous clusters in the deleted files
+
+typedef struct {
+    char     path[16];
+    uint8_t *data;
+    uint32_t size;
+    uint32_t *chain; //its clusters, in order
+    uint32_t numClusters;
+    bool     deleted;
+} FatCheckFile;
+
+typedef struct {
+    uint64_t first;  //first block
+    uint32_t blocks; //number of blocks
+} FatCheckRun;
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+static int formatFat() {
+    //format a FAT32 volume through the driver: boot sector and FSInfo
+    //(and their backups), two FATs, and an empty root directory in
+    //cluster 2. the data area keeps whatever was there.
+    uint32_t spf = 1, clusters = 0;
+    while(1) {
+        clusters = (FAT_BLOCKS - FAT_RESERVED - (2 * spf)) / FAT_SPC;
+        uint32_t need = (((clusters + 2) * 4) + SD_BLOCK_SIZE - 1) /
+            SD_BLOCK_SIZE;
+        if(need <= spf) break;
+        spf = need;
+    }
+    uint8_t *zero = (uint8_t*)calloc(64, SD_BLOCK_SIZE);
+    uint8_t boot[SD_BLOCK_SIZE], info[SD_BLOCK_SIZE];
+    if(!zero) return -ENOMEM;
+    memset(boot, 0, sizeof(boot));
+    boot[0] = 0xEB; boot[1] = 0x58; boot[2] = 0x90;
+    memcpy(&boot[3], "MICRON  ", 8);
+    boot[11] = SD_BLOCK_SIZE & 0xFF; boot[12] = SD_BLOCK_SIZE >> 8;
+    boot[13] = FAT_SPC;
+    boot[14] = FAT_RESERVED;
+    boot[16] = 2;                     //number of FATs
+    boot[21] = 0xF8;                  //fixed disk
+    put32(&boot[28], FAT_START);      //hidden sectors
+    put32(&boot[32], FAT_BLOCKS);
+    put32(&boot[36], spf);
+    put32(&boot[44], 2);              //root directory cluster
+    boot[48] = 1;                     //FSInfo sector
+    boot[50] = 6;                     //backup boot sector
+    boot[66] = 0x29;                  //extended boot signature
+    memcpy(&boot[82], "FAT32   ", 8);
+    boot[510] = 0x55; boot[511] = 0xAA;
+    memset(info, 0, sizeof(info));
+    put32(&info[0], 0x41615252);
+    put32(&info[484], 0x61417272);
+    put32(&info[488], clusters - 1);  //free clusters
+    put32(&info[492], 3);             //next free cluster
+    put32(&info[508], 0xAA550000);
+
+    //the reserved sectors, FATs and root directory are contiguous, so
+    //zero them all, then fill in the few sectors that aren't zeros.
+    uint32_t end = FAT_START + FAT_RESERVED + (2 * spf) + FAT_SPC;
+    int err = 0;
+    for(uint32_t b=FAT_START; b<end && err >= 0; b += 64) {
+        err = devWrite(b, MIN((uint32_t)64, end - b), zero);
+    }
+    uint8_t fat[SD_BLOCK_SIZE];
+    memset(fat, 0, sizeof(fat));
+    put32(&fat[0], 0x0FFFFFF8);
+    put32(&fat[4], 0x0FFFFFFF);
+    put32(&fat[8], 0x0FFFFFFF);       //root directory
+    if(err >= 0) err = devWrite(FAT_START, 1, boot);
+    if(err >= 0) err = devWrite(FAT_START + 1, 1, info);
+    if(err >= 0) err = devWrite(FAT_START + 6, 1, boot);
+    if(err >= 0) err = devWrite(FAT_START + 7, 1, info);
+    for(int f=0; f<2 && err >= 0; f++) {
+        err = devWrite(FAT_START + FAT_RESERVED + (f * spf), 1, fat);
+    }
+    free(zero);
+    return (err < 0) ? err : 0;
+}
+
+
+static int writeFatFiles(FILE *blkdev, fat32_mbr *mbr, FatCheckFile *files) {
+    //append to each file in turn, a few clusters at a time, so their
+    //chains are made of runs of assorted lengths.
+    const uint32_t clusterSize = FAT_SPC * SD_BLOCK_SIZE;
+    for(int round=0; round<4; round++) {
+        for(int i=0; i<FAT_FILES; i++) {
+            FatCheckFile *f = &files[i];
+            uint32_t n = ((1 + (rnd() % 80)) * clusterSize) -
+                (rnd() % clusterSize);
+            uint8_t *data = (uint8_t*)realloc(f->data, f->size + n);
+            if(!data) return -ENOMEM;
+            f->data = data;
+            for(uint32_t j=0; j<n; j++) data[f->size + j] = rnd();
+
+            MicronFatFile file;
+            int err = round ?
+                fatOpenPath(blkdev, mbr, f->path, &file,
+                    FAT_DEFAULT_MAX_EXTENTS, TIMEOUT) :
+                fatCreate(blkdev, mbr, f->path, 0, &file,
+                    FAT_DEFAULT_MAX_EXTENTS, TIMEOUT);
+            if(err) return err;
+            err = fatAppendFile(blkdev, mbr, &file, &data[f->size], n,
+                TIMEOUT);
+            fatCloseFile(&file);
+            if(err < 0) return err;
+            f->size += n;
+        }
+    }
+
+    //note which clusters each one has.
+    for(int i=0; i<FAT_FILES; i++) {
+        FatCheckFile *f = &files[i];
+        micronDirent ent;
+        int err = fatLookupPath(blkdev, mbr, f->path, &ent, TIMEOUT);
+        if(err) return err;
+        f->chain = (uint32_t*)malloc(
+            ((f->size / clusterSize) + 1) * sizeof(uint32_t));
+        if(!f->chain) return -ENOMEM;
+        for(int c = ent.cluster; c > 0 && f->numClusters <=
+        f->size / clusterSize; c = fatGetNextCluster(blkdev, mbr, c,
+        TIMEOUT)) {
+            f->chain[f->numClusters++] = c;
+        }
+    }
+    return 0;
+}
+
+
+static int readFatFiles(FILE *blkdev, fat32_mbr *mbr, FatCheckFile *files) {
+    //read back the files that haven't been deleted.
+    //returns how many were wrong, or negative error code.
+    int wrong = 0;
+    for(int i=0; i<FAT_FILES; i++) {
+        FatCheckFile *f = &files[i];
+        if(f->deleted) continue;
+        MicronFatFile file;
+        uint8_t *data = (uint8_t*)malloc(f->size);
+        if(!data) return -ENOMEM;
+        int err = fatOpenPath(blkdev, mbr, f->path, &file,
+            FAT_DEFAULT_MAX_EXTENTS, TIMEOUT);
+        if(!err) {
+            int n = fatReadFile(blkdev, mbr, &file, 0, f->size, data,
+                TIMEOUT);
+            if(n != (int)f->size || memcmp(data, f->data, f->size)) wrong++;
+            fatCloseFile(&file);
+        }
+        free(data);
+        if(err) return err;
+    }
+    return wrong;
+}
+
+
+static uint32_t listRuns(const FatCheckFile *files, uint64_t dataStart,
+FatCheckRun *out) {
+    //find the runs of contiguous clusters in the files to be deleted (the
+    //odd ones), as the blocks they're in. returns how many there are.
+    uint32_t n = 0;
+    for(int i=1; i<FAT_FILES; i += 2) {
+        const FatCheckFile *f = &files[i];
+        for(uint32_t c=0; c < f->numClusters && n < FAT_MAX_RUNS; n++) {
+            uint32_t len = 1;
+            while(c + len < f->numClusters &&
+                f->chain[c + len] == f->chain[c] + len) len++;
+            out[n].first  = dataStart + ((f->chain[c] - 2) * FAT_SPC);
+            out[n].blocks = len * FAT_SPC;
+            c += len;
+        }
+    }
+    return n;
+}
+
+
+static void freeFatFiles(FatCheckFile *files) {
+    for(int i=0; i<FAT_FILES; i++) {
+        free(files[i].data);
+        free(files[i].chain);
+    }
+}
+
+
+static bool isErased(uint32_t block) {
+    return card.erased[block / 8] & BIT(block % 8);
+}
+
+
+static int cmdFat() {
+    //format a FAT volume, write files, delete half of them, and check that
+    //their clusters were discarded, and nothing else was.
+    if(!devEraseSize || devBlocks < FAT_START + FAT_BLOCKS) {
+        printf("card too small or can't erase\n");
+        return 1;
+    }
+    FatCheckFile files[FAT_FILES];
+    memset(files, 0, sizeof(files));
+    for(int i=0; i<FAT_FILES; i++) {
+        snprintf(files[i].path, sizeof(files[i].path), "/FILE%d.BIN", i);
+    }
+
+    //nothing in the volume starts out erased, as on a used card.
+    uint8_t buf[SD_BLOCK_SIZE];
+    for(uint32_t b=FAT_START; b<FAT_START + FAT_BLOCKS; b++) {
+        fillRandom(buf, 1);
+        sdSimWriteImage(&card, b, buf);
+    }
+
+    int err = formatFat();
+    FILE *blkdev = NULL;
+    if(!err) blkdev = useUsdhc ? usdhcOpenCard(&usdhc, &err) :
+        sdOpenCard(&sdcard, &err);
+    fat32_mbr mbr;
+    if(!err) err = fatMount(blkdev, FAT_START, &mbr, FAT_DEFAULT_CACHE_SIZE,
+        TIMEOUT);
+    if(!err) err = writeFatFiles(blkdev, &mbr, files);
+    int wrongFiles = err ? 0 : readFatFiles(blkdev, &mbr, files);
+    if(wrongFiles < 0) err = wrongFiles;
+    //a single block read of the middle of each run that's about to be
+    //freed brings it into the driver's cache, which discarding must drop.
+    static FatCheckRun runs[FAT_MAX_RUNS];
+    uint64_t dataStart = err ? 0 : fatClusterToSector(&mbr, 2);
+    uint32_t numRuns = err ? 0 : listRuns(files, dataStart, runs);
+    for(uint32_t r=0; r<numRuns; r++) {
+        devRead(runs[r].first + (runs[r].blocks / 2), 1, buf);
+    }
+    uint32_t erased0 = card.stats.blocksErased;
+    for(int i=1; i<FAT_FILES && !err; i += 2) {
+        err = fatDelete(blkdev, &mbr, files[i].path, TIMEOUT);
+        files[i].deleted = true;
+    }
+    if(!err) err = fatUnmount(blkdev, &mbr, TIMEOUT);
+    if(err) {
+        printf("FAT error: %d\n", err);
+        if(blkdev) micronClose(blkdev);
+        freeFatFiles(files);
+        return 1;
+    }
+
+    //each whole erase sector in a run of freed clusters must be erased,
+    //and read back as erased. those are the only blocks erased. the
+    //blocks that were cached are read first, newest first, so that
+    //reading one that isn't cached any more doesn't push out the others.
+    uint32_t expected = 0, notErased = 0, badReads = 0, staleReads = 0;
+    uint8_t erasedData[SD_BLOCK_SIZE];
+    memset(erasedData, card.cfg.erased, sizeof(erasedData));
+    uint8_t *blocks = (uint8_t*)aligned_alloc(32, 64 * SD_BLOCK_SIZE);
+    if(!blocks) {
+        printf("out of memory\n");
+        micronClose(blkdev);
+        freeFatFiles(files);
+        return 1;
+    }
+    for(int pass=0; pass<2; pass++) {
+        for(uint32_t i=0; i<numRuns; i++) {
+            FatCheckRun *run = &runs[pass ? i : numRuns - 1 - i];
+            uint64_t start = ((run->first + devEraseSize - 1) /
+                devEraseSize) * devEraseSize;
+            uint64_t end = ((run->first + run->blocks) / devEraseSize) *
+                devEraseSize;
+            uint64_t middle = run->first + (run->blocks / 2);
+            if(!pass) {
+                if(middle < start || middle >= end) continue;
+                int n = devRead(middle, 1, buf);
+                if(n < 0 || memcmp(buf, erasedData, sizeof(buf))) {
+                    staleReads++;
+                }
+                continue;
+            }
+            for(uint64_t b=start; b<end; b += 64) {
+                uint32_t count = MIN((uint64_t)64, end - b);
+                int n = devRead(b, count, blocks);
+                for(uint32_t j=0; j<count; j++) {
+                    expected++;
+                    if(!isErased(b + j)) notErased++;
+                    if(n < 0 || memcmp(&blocks[j * SD_BLOCK_SIZE], erasedData,
+                    SD_BLOCK_SIZE)) badReads++;
+                }
+            }
+        }
+    }
+    int extra = card.stats.blocksErased - erased0 - expected;
+
+    //nothing still in use may be erased: the reserved sectors, the FATs,
+    //the root directory, and the files that are left, which must read back
+    //as they were written.
+    uint32_t usedErased = 0;
+    for(uint64_t b=FAT_START; b<dataStart + FAT_SPC; b++) {
+        usedErased += isErased(b);
+    }
+    for(int i=0; i<FAT_FILES; i++) {
+        for(uint32_t c=0; !files[i].deleted && c < files[i].numClusters;
+        c++) {
+            uint64_t first = dataStart + ((files[i].chain[c] - 2) * FAT_SPC);
+            for(uint32_t b=0; b<FAT_SPC; b++) usedErased += isErased(first + b);
+        }
+    }
+    err = fatMount(blkdev, FAT_START, &mbr, FAT_DEFAULT_CACHE_SIZE, TIMEOUT);
+    if(!err) {
+        int n = readFatFiles(blkdev, &mbr, files);
+        if(n < 0) err = n;
+        else wrongFiles += n;
+    }
+    if(!err) err = fatUnmount(blkdev, &mbr, TIMEOUT);
+    if(err) printf("FAT error reading back: %d\n", err);
+    micronClose(blkdev);
+    freeFatFiles(files);
+    free(blocks);
+
+    printf("freed %u runs of clusters: %u blocks to erase, %u weren't, %u "
+        "read back wrong, %d others erased\n", numRuns, expected, notErased,
+        badReads, extra);
+    printf("%u blocks cached before they were freed read back wrong\n",
+        staleReads);
+    printf("in use: %u blocks erased, %d files read back wrong\n",
+        usedErased, wrongFiles);
+    return (err || numRuns >= FAT_MAX_RUNS || !expected || notErased ||
+        badReads || staleReads || extra || usedErased || wrongFiles) ? 1 : 0;
+}
+
+
+//crc: how long a piece of data to check the driver's CRC16 on.
+#define CRC_MAX_LEN 1024
+
+static bool crcMatches(const uint8_t *data, uint32_t first, uint32_t second) {
+    //CRC data in one piece, or in two, carrying the CRC over, and compare
+    //with the card's bitwise CRC of the whole.
+    uint16_t expect = sdSimCrc16(data, first + second);
+    uint16_t crc = sdcardCalcCrc16(0, data, first);
+    if(second) crc = sdcardCalcCrc16(crc, &data[first], second);
+    if(crc == expect) return true;
+    printf("CRC16 of %u+%u bytes at offset %u: 0x%04X, not 0x%04X\n", first,
+        second, (uint32_t)((uintptr_t)data & 3), crc, expect);
+    return false;
+}
+
+
+static int cmdCrc() {
+    //every length up to CRC_MAX_LEN, from each alignment; then pieces just
+    //under, at and over SDCARD_CRC_HW_MIN (or 64, where Kinetis has it)
+    //one after another, so the CRC is carried between the hardware and the
+    //table; then a block of 0xFF, whose CRC is known.
+    static uint32_t buf32[(CRC_MAX_LEN + 4) / 4];
+    uint8_t *buf = (uint8_t*)buf32;
+    for(uint32_t i=0; i<CRC_MAX_LEN + 4; i++) buf[i] = rnd();
+    uint32_t wrong = 0, checked = 0;
+    for(uint32_t off=0; off<4; off++) {
+        for(uint32_t len=0; len<=CRC_MAX_LEN; len++, checked++) {
+            if(!crcMatches(&buf[off], len, 0) && ++wrong >= 10) return 1;
+        }
+    }
+
+    const uint32_t hwMin = SDCARD_CRC_HW_MIN ? SDCARD_CRC_HW_MIN : 64;
+    const uint32_t pieces[] = {1, 3, hwMin - 1, hwMin, hwMin + 1,
+        SD_BLOCK_SIZE};
+    const uint32_t nPieces = sizeof(pieces) / sizeof(pieces[0]);
+    uint32_t splits = 0;
+    for(uint32_t off=0; off<4; off++) {
+        for(uint32_t i=0; i<nPieces; i++) {
+            for(uint32_t j=0; j<nPieces; j++, splits++) {
+                if(!crcMatches(&buf[off], pieces[i], pieces[j])
+                && ++wrong >= 10) return 1;
+            }
+        }
+    }
+
+    memset(buf, 0xFF, SD_BLOCK_SIZE);
+    uint16_t crc = sdcardCalcCrc16(0, buf, SD_BLOCK_SIZE);
+    if(crc != 0x7FA1) {
+        printf("CRC16 of a block of 0xFF: 0x%04X, not 0x7FA1\n", crc);
+        wrong++;
+    }
+    printf("crc: %u lengths up to %u bytes, %u split around %u bytes, "
+        "%s: %u wrong\n", checked, CRC_MAX_LEN, splits, hwMin,
+        SDCARD_CRC_HW_MIN ? "hardware over that" : "all by table", wrong);
+    return wrong ? 1 : 0;
+}
+
+//speed: cards claiming various speeds in their CSD, and how fast they really
+//go (overclocking them always garbles what they send). the clocks expected are
+//the fastest spi.c's dividers give (60 MHz bus) within both limits.
+typedef struct {
+    uint8_t  tranSpeed;   //CSD TRAN_SPEED (0 = the card's own)
+    bool     highSpeed;   //whether to switch to high speed mode
+    uint32_t maxHz;       //fastest the card really goes (x2 in high speed)
+    uint32_t expect;      //clock sdNegotiateSpeed() should pick
+    uint32_t verifyFails; //clocks it should try first and find don't work
+    const char *what;
+} SpeedCase;
+
+static const SpeedCase speedCases[] = {
+    {0x32, false, 25000000, 20000000, 0, "25 MHz"},
+    {0,    true,  25000000, 30000000, 0, "25 MHz, 50 in high speed"},
+    {0x2A, false, 25000000, 20000000, 0, "20 MHz"},
+    {0x1A, false, 25000000, 12000000, 0, "13 MHz"},
+    {0x0B, false, 25000000, 20000000, 1, "100 MHz, really 25"},
+    {0x32, false, 10000000, 10000000, 3, "25 MHz, really 10"},
+};
+#define NUM_SPEED_CASES (sizeof(speedCases) / sizeof(speedCases[0]))
+#define SPEED_CARD_SIZE (4 << 20)
+
+static int speedCard(const SpeedCase *sc) {
+    //set up a card for this case, and the driver on it as far as choosing
+    //the clock. return the clock, or negative error code.
+    MicronSdSimConfig cfg;
+    sdSimDefaults(&cfg);
+    cfg.tranSpeed = sc->tranSpeed;
+    cfg.maxHz = sc->maxHz;
+    cfg.overclockPpm = 1000000;
+    cfg.overclockIn = false; //1 in 128 garbled commands would pass the CRC7
+    sdSimClose(&card);
+    int err = sdSimOpen(&card, &cfg, NULL, SPEED_CARD_SIZE);
+    if(err) return err;
+    sdSimAttach(0, &card);
+    blockCacheFree(&sdcard.blockCache);
+    sdcard.blockCacheSize = 0; //every read goes to the card
+    err = sdcardInit(&sdcard);
+    if(!err) err = sdcardReset(&sdcard, 5000);
+    if(!err) err = sdReadInfo(&sdcard, 5000);
+    if(!err) err = sdNegotiateSpeed(&sdcard, sc->highSpeed, TIMEOUT);
+    return err;
+}
+
+
+static uint32_t checkStepDown() {
+    //make every block read have a CRC error, and read until the clock stops
+    //going down. it must go one divider at a time, after every
+    //SDCARD_SPEED_MAX_ERRORS errors, to the slowest at or above
+    //SDCARD_SPEED_MIN; then with the errors gone, reads must work there.
+    static const uint32_t first[] = {15000000, 12000000, 10000000};
+    int err = speedCard(&speedCases[0]);
+    if(err < 0) {
+        printf("  CRC errors: can't set up the card: %d\n", err);
+        return 1;
+    }
+    uint32_t problems = 0, steps = 0, speed = sdcard.spiSpeed;
+    uint32_t start = speed, stepErrors = 0;
+    uint8_t buf[SD_BLOCK_SIZE];
+    card.cfg.readCrcPpm = 1000000;
+    for(int i=0; i<500; i++) {
+        sdReadBlock(&sdcard, i % 8, buf, TIMEOUT, true);
+        if(sdcard.spiSpeed == speed) continue;
+        uint32_t next = 0;
+        spiGetMaxSpeed(sdcard.port, speed - 1, &next);
+        if(steps < sizeof(first) / sizeof(first[0])) next = first[steps];
+        if(sdcard.spiSpeed != next) {
+            printf("  CRC errors: stepped from %u to %u Hz, not %u\n",
+                speed, sdcard.spiSpeed, next);
+            problems++;
+        }
+        //the first step comes with the read after the errors, so it has
+        //one more behind it.
+        uint32_t errors = sdcard.speedStats.crcErrors - stepErrors;
+        if(steps && errors != SDCARD_SPEED_MAX_ERRORS) {
+            printf("  CRC errors: stepped down to %u Hz after %u errors, not "
+                "%u\n", sdcard.spiSpeed, errors, SDCARD_SPEED_MAX_ERRORS);
+            problems++;
+        }
+        stepErrors = sdcard.speedStats.crcErrors;
+        speed = sdcard.spiSpeed;
+        steps++;
+    }
+    uint32_t below = 0;
+    spiGetMaxSpeed(sdcard.port, speed - 1, &below);
+    if(speed < SDCARD_SPEED_MIN || below >= SDCARD_SPEED_MIN) {
+        printf("  CRC errors: stopped at %u Hz, not the slowest clock over "
+            "%u\n", speed, SDCARD_SPEED_MIN);
+        problems++;
+    }
+    if(sdcard.speedStats.stepDowns != steps) {
+        printf("  CRC errors: %u steps down counted, %u seen\n",
+            sdcard.speedStats.stepDowns, steps);
+        problems++;
+    }
+
+    card.cfg.readCrcPpm = 0;
+    uint8_t expect[SD_BLOCK_SIZE];
+    memset(expect, 0x5A, sizeof(expect));
+    sdSimWriteImage(&card, 3, expect);
+    err = sdReadBlock(&sdcard, 3, buf, TIMEOUT, true);
+    if(err < 0 || memcmp(buf, expect, sizeof(buf))
+    || sdcard.spiSpeed != speed) {
+        printf("  CRC errors: reading without them at %u Hz: error %d, "
+            "%s data, now at %u Hz\n", speed, err,
+            (err < 0 || memcmp(buf, expect, sizeof(buf))) ? "wrong" : "right",
+            sdcard.spiSpeed);
+        problems++;
+    }
+    printf("  CRC errors: %u steps from %u to %u Hz after %u errors: %s\n",
+        steps, start, speed, sdcard.speedStats.crcErrors,
+        problems ? "FAILED" : "ok");
+    return problems;
+}
+
+
+static int cmdSpeed() {
+    //each case on a new card, with the defaults rather than the options.
+    if(useUsdhc) {
+        printf("speed is for the SPI driver; uSDHC doesn't step down\n");
+        return 2;
+    }
+    uint32_t failures = 0;
+    for(size_t i=0; i<NUM_SPEED_CASES; i++) {
+        const SpeedCase *sc = &speedCases[i];
+        int err = speedCard(sc);
+        bool ok = err >= 0 && sdcard.spiSpeed == sc->expect
+            && sdcard.speedStats.verifyFails == sc->verifyFails
+            && sdcard.highSpeed == sc->highSpeed;
+        printf("  TRAN_SPEED 0x%02X (%s): %d Hz after %u failed, expected "
+            "%u after %u: %s\n", card.cfg.tranSpeed ? card.cfg.tranSpeed :
+            (sc->highSpeed ? 0x5A : 0x32), sc->what, err,
+            sdcard.speedStats.verifyFails, sc->expect, sc->verifyFails,
+            ok ? "ok" : "FAILED");
+        if(!ok) failures++;
+    }
+    if(checkStepDown()) failures++;
+    return failures ? 1 : 0;
+}
+
+//queue: a request from the trace, while it's queued.
+typedef struct {
+    uint8_t *buf;
+    uint8_t *expect;  //what a read should get; NULL for writes
+    uint32_t block, count;
+    int      result;  //from the callback; 1 until then
+    uint32_t line;
+} QueueReq;
+
+static uint32_t dataCmds() {
+    return card.stats.cmds[17] + card.stats.cmds[18] + card.stats.cmds[24]
+        + card.stats.cmds[25];
+}
+
+
+static uint32_t flushTrace(QueueReq *reqs, uint32_t nReq, uint32_t line,
+uint32_t expectCmds) {
+    //send the queued requests, and check how many commands they took, and
+    //what the reads got. return the number of problems.
+    uint32_t problems = 0, before = dataCmds();
+    int err = sdQueueFlush(&sdcard);
+    uint32_t cmds = dataCmds() - before;
+    if(err || cmds != expectCmds) {
+        printf("line %u: flush took %u commands, expected %u (error %d)\n",
+            line, cmds, expectCmds, err);
+        problems++;
+    }
+    for(uint32_t i=0; i<nReq; i++) {
+        QueueReq *q = &reqs[i];
+        if(q->result) {
+            printf("line %u: request failed: %d\n", q->line, q->result);
+            problems++;
+        }
+        else if(q->expect && memcmp(q->buf, q->expect,
+        q->count * SD_BLOCK_SIZE)) {
+            printf("line %u: read the wrong data\n", q->line);
+            problems++;
+        }
+        free(q->buf);
+        free(q->expect);
+    }
+    return problems;
+}
+
+
+static int cmdQueue() {
+    //replay the trace through the request queue. the card starts out full
+    //of random data, and model follows what's queued, in order.
+    if(useUsdhc) {
+        printf("queue is for the SPI driver\n");
+        return 2;
+    }
+    //FILE is Micron's here, so read it whole.
+    int fd = open(tracePath, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)) {
+        printf("can't open %s: %s\n", tracePath, strerror(errno));
+        return 2;
+    }
+    char *trace = (char*)malloc(st.st_size + 1);
+    if(!trace) return -ENOMEM;
+    trace[MAX(pread(fd, trace, st.st_size, 0), (ssize_t)0)] = 0;
+    close(fd);
+
+    nCheck = MIN(devBlocks, (uint32_t)16384);
+    model = (uint8_t*)malloc(nCheck * SD_BLOCK_SIZE);
+    if(!model) return -ENOMEM;
+    fillRandom(model, nCheck);
+    for(uint32_t b=0; b<nCheck; b++) {
+        sdSimWriteImage(&card, b, &model[b * SD_BLOCK_SIZE]);
+    }
+
+    QueueReq reqs[SDCARD_QUEUE_SIZE];
+    uint32_t nReq = 0, total = 0, flushes = 0, cmds = 0, expectCmds = 0;
+    uint32_t problems = 0, line = 0, merged = queue.merged;
+    uint32_t before = dataCmds();
+    char op[8];
+    for(char *text=trace, *next; *text; text=next) {
+        next = strchr(text, '\n');
+        next = next ? next + 1 : text + strlen(text);
+        line++;
+        uint32_t block, count;
+        int n = sscanf(text, "%7s %u %u", op, &block, &count);
+        if(n <= 0 || op[0] == '#') continue;
+        if(n == 2 && !strcmp(op, "flush")) {
+            problems += flushTrace(reqs, nReq, line, block);
+            expectCmds += block;
+            flushes++;
+            nReq = 0;
+            continue;
+        }
+        if(n != 3 || !strchr("rmw", op[0]) || op[1] || !count
+        || block + count > nCheck || nReq >= SDCARD_QUEUE_SIZE) {
+            printf("%s:%u: can't replay: %.*s", tracePath, line,
+                (int)(next - text), text);
+            problems++;
+            break;
+        }
+        QueueReq *q = &reqs[nReq++];
+        uint32_t bytes = count * SD_BLOCK_SIZE;
+        uint8_t *m = &model[block * SD_BLOCK_SIZE];
+        q->buf    = (uint8_t*)malloc(bytes);
+        q->expect = NULL;
+        q->block  = block;
+        q->count  = count;
+        q->result = 1;
+        q->line   = line;
+        if(op[0] == 'w') {
+            fillRandom(q->buf, count);
+            memcpy(m, q->buf, bytes);
+            sdQueueWrite(&sdcard, block, count, q->buf, queueDone,
+                &q->result);
+        }
+        else {
+            q->expect = (uint8_t*)malloc(bytes);
+            memcpy(q->expect, m, bytes);
+            sdQueueRead(&sdcard, block, count, q->buf,
+                (op[0] == 'm') ? SD_REQ_META : 0, queueDone, &q->result);
+        }
+        total++;
+    }
+    free(trace);
+    if(nReq) problems += flushTrace(reqs, nReq, line, 0);
+    cmds = dataCmds() - before;
+
+    //and the card must hold what was written.
+    uint8_t buf[SD_BLOCK_SIZE];
+    uint32_t wrong = 0;
+    for(uint32_t b=0; b<nCheck; b++) {
+        sdSimReadImage(&card, b, buf);
+        if(memcmp(buf, &model[b * SD_BLOCK_SIZE], SD_BLOCK_SIZE)) wrong++;
+    }
+    if(wrong) {
+        printf("%u blocks on the card are wrong\n", wrong);
+        problems++;
+    }
+    printf("queue: %u requests in %u flushes took %u commands (expected %u), "
+        "%u merged; %u problems\n", total, flushes, cmds, expectCmds,
+        queue.merged - merged, problems);
+    free(model);
+    return problems ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    MicronSdSimConfig cfg;
+    sdSimDefaults(&cfg);
+    uint64_t size = 0;
+    sdcard.blockCacheSize = 16;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:s:c:Uanm:T:q:r:g:w:E:z:ZB:P:e:b:x:h")) != -1) {
+        switch(opt) {
+            case 't':
+                if(!strcmp(optarg, "sdsc1")) cfg.type = SDSIM_SDSC_V1;
+                else if(!strcmp(optarg, "sdsc")) cfg.type = SDSIM_SDSC;
+                else if(!strcmp(optarg, "sdhc")) cfg.type = SDSIM_SDHC;
+                else {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 's': size = parseSize(optarg); break;
+            case 'c': sdcard.blockCacheSize = atoi(optarg); break;
+            case 'U': useUsdhc = true; break;
+            case 'a': useReadAhead = true; break;
+            case 'n': useHighSpeed = false; break;
+            case 'm': cfg.maxHz = atoi(optarg); break;
+            case 'T': cfg.tranSpeed = strtoul(optarg, NULL, 0); break;
+            case 'q': tracePath = optarg; break;
+            case 'r': cfg.readUs = atoi(optarg); break;
+            case 'g': cfg.gapUs = atoi(optarg); break;
+            case 'w': cfg.writeUs = atoi(optarg); break;
+            case 'E': cfg.erasedWriteUs = atoi(optarg); break;
+            case 'z': cfg.eraseSector = atoi(optarg); break;
+            case 'Z': cfg.eraseAny = false; break;
+            case 'B':
+                if(!strcmp(optarg, "spin")) busyMode = SD_BUSY_SPIN;
+                else if(!strcmp(optarg, "poll")) busyMode = SD_BUSY_POLL;
+                else if(!strcmp(optarg, "pin")) busyMode = SD_BUSY_PIN;
+                else {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'P': busyPin = atoi(optarg); break;
+            case 'e':
+                if(setError(&cfg, optarg)) {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'b':
+                if(cfg.nBadBlocks < SDSIM_MAX_BAD_BLOCKS) {
+                    cfg.badBlock[cfg.nBadBlocks++] = atoi(optarg);
+                }
+                break;
+            case 'x': cfg.seed = rng = atoi(optarg) | 1; break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if(optind >= argc) {
+        usage();
+        return 2;
+    }
+    const char *cmd = argv[optind];
+    const char *path = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+    if(!path && !size) size = 64 << 20;
+
+    int err = sdSimOpen(&card, &cfg, path, size);
+    if(err) {
+        printf("can't set up card: %s\n", strerror(-err));
+        return 2;
+    }
+    if(useUsdhc) {
+        if(initUsdhc()) return 2;
+    }
+    else {
+        sdSimAttach(0, &card);
+        sdSimWirePin(12, 0);
+        if(initSD()) return 2;
+    }
+
+    if(!strcmp(cmd, "info")) err = cmdInfo();
+    else if(!strcmp(cmd, "check")) err = cmdCheck();
+    else if(!strcmp(cmd, "bench")) err = cmdBench();
+    else if(!strcmp(cmd, "fat")) err = cmdFat();
+    else if(!strcmp(cmd, "crc")) err = cmdCrc();
+    else if(!strcmp(cmd, "speed")) err = cmdSpeed();
+    else if(!strcmp(cmd, "queue")) err = cmdQueue();
+    else {
+        usage();
+        err = 2;
+    }
+    sdSimClose(&card);
+    return err;
+}
@@ -0,0 +1,93 @@
+/** Stand-in for micron.h when building drivers on a PC with sdsim.
+ *  Provides just what the sdcard driver, the block cache and the FAT driver
+ *  need, on top of the host's C library. Micron's own FILE and its I/O
+ *  functions are renamed here, so they don't clash with the host's; spi.c
+ *  passes them to the file class, as libs/io does.
+ */
+#ifndef _MICRON_H_
+#define _MICRON_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h> //same codes as errors.h
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define BIT(n) (1 << (n))
+#define PACKED __attribute__((packed))
+#define WEAK __attribute__((weak))
+#define INLINE static inline __attribute__((always_inline))
+#define MIN(a, b) ({         \
+	__typeof__ (a) _a = (a); \
+	__typeof__ (b) _b = (b); \
+	_a < _b ? _a : _b;       \
+})
+#define MAX(a, b) ({         \
+	__typeof__ (a) _a = (a); \
+	__typeof__ (b) _b = (b); \
+	_a > _b ? _a : _b;       \
+})
+
+#define NUM_SPI 3
+
+//libs/io/private.h, renamed
+#define FILE    MicronFILE
+#define read    micronRead
+#define write   micronWrite
+#define fseek   micronSeek
+#define discard micronDiscard
+#define sync    micronSync
+struct MicronFILE;
+typedef struct {
+	int (*close)      (FILE *self);
+	int (*read)       (FILE *self, void *dest, size_t len);
+	int (*write)      (FILE *self, const void *src, size_t len);
+	int (*seek)       (FILE *self, long int offset, int origin);
+	int (*peek)       (FILE *self, void *dest, size_t len);
+	int (*getWriteBuf)(FILE *self);
+	int (*sync)       (FILE *self);
+	int (*purge)      (FILE *self);
+	int (*discard)    (FILE *self, size_t len);
+} MicronFileClass;
+typedef struct MicronFILE {
+	uint8_t fileCls;
+	uint64_t offset;
+	union {
+		void*    ptr;
+		uint32_t u32;
+	} udata;
+} MicronFILE;
+int osRegisterFileClass(MicronFileClass *cls);
+int micronClose(FILE *self); //not close(), which sdsim uses for its image
+int micronRead(FILE *self, void *dest, size_t len);
+int micronWrite(FILE *self, const void *src, size_t len);
+int micronSeek(FILE *self, long int offset, int origin);
+int micronDiscard(FILE *self, size_t len);
+int micronSync(FILE *self);
+
+//time runs on sdsim's clock. irqWait() sleeps until the next millisecond
+//(the systick) or a pin interrupt; see gpio.c.
+uint32_t millis();
+uint32_t micros();
+void irqWait();
+INLINE void irqDisable() {}
+INLINE void irqEnable() {}
+int rtcGet(uint32_t *outSecs, uint32_t *outUsecs);
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#include "drivers/hal/gpio/gpio.h"
+#include "drivers/hal/spi/spi.h"
+#include "libs/io/blockcache.h"
+
+#endif //_MICRON_H_
@@ -0,0 +1,184 @@
+/** Simulated SD card, for running the sdcard driver on a PC.
+ *  The card speaks SPI mode, byte by byte, the way a real one does: it
+ *  parses commands and checks their CRC, answers with R1/R3/R7 responses,
+ *  sends data blocks with tokens and CRC16 after an access time, takes
+ *  written blocks and goes busy afterward. Its contents come from a disk
+ *  image file (or memory). Timing uses a virtual clock which advances as
+ *  bytes go over the bus, so benchmarks don't depend on the PC's speed.
+ *  spi.c provides the HAL SPI functions, talking to the card attached to
+ *  each port with sdSimAttach(), and gpio.c the GPIO ones, with pins that
+ *  can be wired to a port's MISO to watch the card's output.
+ *  The card also speaks SD mode, a command or block at a time, for
+ *  usdhc.c: a register-level model of the i.MX RT uSDHC controller, which
+ *  runs the usdhc driver the way spi.c runs the sdcard one.
+ */
+#ifndef _MICRON_SDSIM_H_
+#define _MICRON_SDSIM_H_
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define SDSIM_BLOCK_SIZE 512
+#define SDSIM_MAX_BAD_BLOCKS 16
+
+typedef enum {
+    SDSIM_SDSC_V1, //version 1 card: no CMD8 or CMD6, byte addresses
+    SDSIM_SDSC,    //version 2 standard capacity: byte addresses
+    SDSIM_SDHC,    //high capacity: block addresses
+} MicronSdSimType;
+
+typedef struct {
+    //How the card behaves. sdSimDefaults() fills in something typical.
+    uint8_t  type;         //MicronSdSimType
+    uint8_t  ncr;          //0xFF bytes before each response (1 to 8)
+    uint8_t  erased;       //what erased blocks read as (0x00 or 0xFF)
+    bool     highSpeed;    //whether CMD6 can switch to high speed mode
+    bool     crc;          //whether CRCs are checked after CMD0 (see CMD59)
+    uint32_t maxHz;        //fastest clock that works (twice this in high speed)
+    uint8_t  tranSpeed;    //CSD TRAN_SPEED (0 = 25 MHz, or 50 in high speed)
+    uint8_t  eraseSector;  //erase sector size in blocks, 1 to 128 (SDSC only)
+    bool     eraseAny;     //whether part of an erase sector can be erased
+                           //(SDSC only; if not, the whole sector is)
+    //timing, in microseconds
+    uint32_t initUs;       //from the first ACMD41 until it's ready
+    uint32_t readUs;       //access time before a read's first block
+    uint32_t gapUs;        //between blocks of a multiple block read
+    uint32_t writeUs;      //busy after each block written
+    uint32_t erasedWriteUs; //the same, for a block that was erased
+    uint32_t stopUs;       //busy after CMD12 or a stop tran token
+    uint32_t eraseUs;      //busy per block erased
+    //error injection, in errors per million
+    uint32_t cmdCrcPpm;    //commands received garbled (CRC error response)
+    uint32_t readCrcPpm;   //blocks sent with a flipped bit
+    uint32_t writeCrcPpm;  //blocks received with a flipped bit
+    uint32_t readErrPpm;   //reads answered with an error token
+    uint32_t writeErrPpm;  //writes answered with a write error
+    uint32_t overclockPpm; //bytes garbled when the clock is above maxHz
+    bool     overclockIn;  //whether that includes bytes the card receives
+    uint32_t seed;         //for the above
+    //blocks that always fail: reads get an error token, writes a write error
+    uint32_t badBlock[SDSIM_MAX_BAD_BLOCKS];
+    uint8_t  nBadBlocks;
+} MicronSdSimConfig;
+
+typedef struct {
+    //What the card has seen.
+    uint32_t cmds[64];      //commands received, by number (ACMDs included)
+    uint32_t badCmds;       //commands rejected for a bad CRC
+    uint32_t blocksRead;    //blocks sent
+    uint32_t blocksWritten; //blocks written to the image
+    uint32_t blocksErased;  //blocks erased
+    uint32_t erasedWrites;  //blocks written that had been erased
+    uint32_t readCrcErrors; //injected: blocks sent with a bad CRC
+    uint32_t readErrors;    //injected: error tokens sent
+    uint32_t writeCrcErrors; //blocks refused for a bad CRC
+    uint32_t writeErrors;   //blocks refused with a write error
+    uint32_t flips;         //injected: bytes garbled by overclocking
+    uint64_t bytes;         //bytes clocked while selected
+} MicronSdSimStats;
+
+typedef enum {
+    SDSIM_IDLE,        //waiting for a command
+    SDSIM_READ_WAIT,   //access time before a block
+    SDSIM_READ_SEND,   //sending a block
+    SDSIM_READ_STOPPED, //multiple block read failed; waiting for CMD12
+    SDSIM_WRITE_STOPPED, //SD mode: multiple block write failed; ditto
+    SDSIM_WRITE_TOKEN, //waiting for a data token
+    SDSIM_WRITE_DATA,  //receiving a block
+    SDSIM_BUSY,        //holding the output low
+} MicronSdSimPhase;
+
+typedef struct {
+    //What the uSDHC model has seen.
+    uint32_t cmds;        //commands sent
+    uint32_t blocks;      //blocks transferred
+    uint32_t descriptors; //ADMA2 descriptors read
+    uint32_t dmaErrors;   //transfers stopped by a bad descriptor
+    uint32_t reads;       //register reads
+    uint32_t writes;      //register writes
+    uint32_t violations;  //things the driver did that the hardware wouldn't
+                          //like (printed as they happen)
+} MicronUsdhcSimStats;
+
+#define SDSIM_OUT_SIZE 600 //token, block, CRC and response bytes
+
+typedef struct {
+    //State of a simulated card. See sdSimOpen().
+    MicronSdSimConfig cfg;
+    MicronSdSimStats stats;
+    int      fd;        //image file, or -1 for memory
+    uint8_t *mem;       //image in memory, if no file
+    uint8_t *erased;    //bit per block: erased, and not written since
+    uint32_t nBlocks;   //capacity
+    uint32_t rng;       //error injection state
+    uint32_t spiHz;     //current clock, set by spi.c or usdhc.c
+    uint64_t now;       //current time in nanoseconds, set by spi.c or usdhc.c
+    uint64_t until;     //end of the access time or busy time
+    //output, sent before anything the phase sends
+    uint8_t  out[SDSIM_OUT_SIZE];
+    uint16_t outHead, outLen;
+    //command being received
+    uint8_t  cmd[6];
+    uint8_t  cmdLen;
+    uint8_t  phase;     //MicronSdSimPhase
+    uint8_t  after;     //phase to go to when busy ends
+    uint8_t  status;    //second byte of R2 (CMD13)
+    bool     idle;      //not initialized yet
+    bool     acmd;      //last command was CMD55
+    bool     multi;     //transfer is CMD18 or CMD25
+    bool     hs;        //high speed mode
+    bool     crc;       //checking CRCs
+    uint64_t readyAt;   //when initialization finishes (0 = not started)
+    uint32_t block;     //next block to send or receive
+    uint32_t eraseStart, eraseEnd; //from CMD32/CMD33 (UINT32_MAX = unset)
+    uint16_t pos;       //bytes of a written block received
+    uint8_t  buf[SDSIM_BLOCK_SIZE + 2];
+    //SD mode
+    uint8_t  busState;  //idle, ready, ident, stby or tran (the others
+                        //come from the phase)
+    bool     wide;      //4-bit bus (ACMD6)
+    uint16_t rca;       //address (CMD3)
+    uint32_t busStatus; //status bits for the next R1
+    uint8_t  regLen;    //bytes of CMD6 status waiting in buf
+} MicronSdSim;
+
+//card.c
+void sdSimDefaults(MicronSdSimConfig *cfg);
+int sdSimOpen(MicronSdSim *sim, const MicronSdSimConfig *cfg,
+    const char *path, uint64_t size);
+void sdSimClose(MicronSdSim *sim);
+int sdSimReadImage(MicronSdSim *sim, uint32_t block, void *dest);
+int sdSimWriteImage(MicronSdSim *sim, uint32_t block, const void *src);
+uint8_t sdSimTransfer(MicronSdSim *sim, uint8_t in, bool cs);
+uint64_t sdSimBusyUntil(MicronSdSim *sim);
+int sdSimCommand(MicronSdSim *sim, uint8_t cmd, uint32_t arg, uint8_t *resp);
+int sdSimReadData(MicronSdSim *sim, uint8_t *dest, uint32_t len, bool wide,
+    uint64_t *start);
+int sdSimWriteData(MicronSdSim *sim, const uint8_t *src, bool wide,
+    uint64_t *busyUntil);
+uint16_t sdSimCrc16(const uint8_t *data, size_t len);
+
+//gpio.c
+void sdSimWirePin(uint32_t pin, int port);
+uint64_t sdSimSleepTime();
+
+//spi.c
+void sdSimAttach(uint32_t port, MicronSdSim *sim);
+uint64_t sdSimTime();
+void sdSimAdvance(uint64_t ns);
+void sdSimSetCallTime(uint32_t ns);
+uint32_t sdSimOverflows(uint32_t port);
+int sdSimMisoLevel(uint32_t port, uint64_t *changeAt);
+bool sdSimTakeIrq();
+
+//usdhc.c (and usdhcSimRead(), usdhcSimWrite() and usdhcSimDmaAddr(), which
+//drivers/imx/usdhc/usdhc.h declares)
+void usdhcSimAttach(MicronSdSim *card);
+MicronUsdhcSimStats *usdhcSimStats();
+
+#ifdef __cplusplus
+    } //extern "C"
+#endif
+
+#endif //_MICRON_SDSIM_H_
@@ -0,0 +1,322 @@
+//HAL SPI functions for sdsim, plus the few other things micron.h promises.
+//Bytes go through the card as soon as they're written, and the clock
+//advances by the time they'd take on the bus; each call also costs a little
+//time, so polling loops see time pass. Received bytes wait in a buffer the
+//size of the real driver's, and are lost if it overflows, like on the real
+//thing.
+extern "C" {
+    #include <micron.h>
+    #include "sdsim.h"
+}
+
+//clock dividers like the Kinetis DSPI: f_bus * (1 + DBR) / (PBR * BR),
+//where DBR is only allowed with BR <= 8.
+#define SDSIM_BUS_HZ 60000000
+static const uint8_t _pbr[] = {2, 3, 5, 7};
+static const uint16_t _br[] = {2, 4, 6, 8, 16, 32, 64, 128, 256, 512, 1024,
+    2048, 4096, 8192, 16384, 32768};
+
+typedef struct {
+    MicronSdSim *card;
+    uint32_t speed;
+    uint32_t overflows;
+    uint8_t  rx[SPI_RX_BUFSIZE];
+    uint16_t rxHead, rxLen;
+    bool     hold;  //CS held asserted (spiHoldCS)
+} MicronSdSimPort;
+
+static MicronSdSimPort _ports[NUM_SPI];
+static uint64_t _now = 0;      //nanoseconds
+static uint32_t _callNs = 200; //time each call takes
+static bool _irqPending = false; //bytes arrived that nobody has read yet
+
+static int _pickSpeed(uint32_t speed, bool roundUp, uint32_t *out) {
+    //find the fastest rate <= speed, or if roundUp, the closest one.
+    uint32_t best = 0;
+    for(size_t p=0; p<sizeof(_pbr); p++) {
+        for(size_t b=0; b<sizeof(_br) / sizeof(_br[0]); b++) {
+            for(int dbr=0; dbr<2; dbr++) {
+                if(dbr && _br[b] > 8) continue;
+                uint32_t r = (uint64_t)SDSIM_BUS_HZ * (1 + dbr) /
+                    (_pbr[p] * _br[b]);
+                bool better = roundUp ?
+                    (!best || labs((long)r - (long)speed) <
+                        labs((long)best - (long)speed)) :
+                    (r <= speed && r > best);
+                if(better) best = r;
+            }
+        }
+    }
+    if(!best) return -ERANGE;
+    *out = best;
+    return 0;
+}
+
+
+static int _transfer(uint32_t port, const uint8_t *data, uint32_t fill,
+uint32_t count, bool cs) {
+    //clock bytes through the card. returns how many fit in the transmit
+    //buffer, like the real thing.
+    if(port >= NUM_SPI) return -ENODEV;
+    MicronSdSimPort *p = &_ports[port];
+    _now += _callNs;
+    uint32_t n = MIN(count, (uint32_t)SPI_TX_BUFSIZE - 1);
+    uint64_t byteNs = 8000000000ull / p->speed;
+    if(n) _irqPending = true;
+    for(uint32_t i=0; i<n; i++) {
+        uint8_t in = data ? data[i] : fill, out = 0xFF;
+        if(p->card) {
+            p->card->now = _now;
+            p->card->spiHz = p->speed;
+            out = sdSimTransfer(p->card, in, cs || p->hold);
+        }
+        _now += byteNs;
+        if(p->rxLen >= SPI_RX_BUFSIZE) p->overflows++;
+        else {
+            p->rx[(p->rxHead + p->rxLen) % SPI_RX_BUFSIZE] = out;
+            p->rxLen++;
+        }
+    }
+    return n;
+}
+
+
+void sdSimAttach(uint32_t port, MicronSdSim *sim) {
+    /** Connect a simulated card to an SPI port.
+     *  @param port Which SPI port.
+     *  @param sim Card, or NULL to disconnect it.
+     */
+    if(port < NUM_SPI) _ports[port].card = sim;
+}
+
+
+uint64_t sdSimTime() {
+    /** Get the simulated time.
+     *  @return Nanoseconds since the program started.
+     */
+    return _now;
+}
+
+
+void sdSimAdvance(uint64_t ns) {
+    /** Let simulated time pass, eg to stand for work the program does.
+     *  @param ns How long, in nanoseconds.
+     */
+    _now += ns;
+}
+
+
+void sdSimSetCallTime(uint32_t ns) {
+    /** Set how long each SPI function call takes.
+     *  @param ns Time in nanoseconds. Default is 200, about what the
+     *   Teensy 3 takes. Must not be 0, or timeouts won't work.
+     */
+    _callNs = MAX(ns, (uint32_t)1);
+}
+
+
+uint32_t sdSimOverflows(uint32_t port) {
+    /** Get how many received bytes were lost because nobody read them.
+     *  @param port Which SPI port.
+     *  @return Number of bytes lost.
+     */
+    return (port < NUM_SPI) ? _ports[port].overflows : 0;
+}
+
+
+int sdSimMisoLevel(uint32_t port, uint64_t *changeAt) {
+    /** Get the level of a port's MISO line between transfers.
+     *  @param port Which SPI port.
+     *  @param changeAt Where to put when it rises, if it's low; may be NULL.
+     *  @return 0 or 1.
+     *  @note The card only drives it while selected, so it's low only
+     *   while CS is held and the card is busy. Otherwise it floats high.
+     */
+    if(port >= NUM_SPI || !_ports[port].card || !_ports[port].hold) return 1;
+    MicronSdSim *card = _ports[port].card;
+    card->now = _now;
+    uint64_t until = sdSimBusyUntil(card);
+    if(!until) return 1;
+    if(changeAt) *changeAt = until;
+    return 0;
+}
+
+
+bool sdSimTakeIrq() {
+    /** Check for an SPI interrupt that would wake irqWait().
+     *  @return Whether bytes were sent since the program last read any,
+     *   whose receive interrupt it hasn't seen yet. Clears that.
+     */
+    bool pending = _irqPending;
+    _irqPending = false;
+    return pending;
+}
+
+
+uint32_t millis() {
+    return _now / 1000000;
+}
+
+
+uint32_t micros() {
+    return _now / 1000;
+}
+
+
+//file classes, for the I/O functions the FAT driver calls.
+#define MAX_FILE_CLASSES 4
+static MicronFileClass *_fileClasses[MAX_FILE_CLASSES];
+static int _numFileClasses = 0;
+
+int osRegisterFileClass(MicronFileClass *cls) {
+    if(_numFileClasses >= MAX_FILE_CLASSES) return -ENFILE;
+    _fileClasses[_numFileClasses] = cls;
+    return _numFileClasses++;
+}
+
+
+int micronClose(FILE *self) {
+    return _fileClasses[self->fileCls]->close(self);
+}
+
+
+int micronRead(FILE *self, void *dest, size_t len) {
+    return _fileClasses[self->fileCls]->read(self, dest, len);
+}
+
+
+int micronWrite(FILE *self, const void *src, size_t len) {
+    return _fileClasses[self->fileCls]->write(self, src, len);
+}
+
+
+int micronSeek(FILE *self, long int offset, int origin) {
+    return _fileClasses[self->fileCls]->seek(self, offset, origin);
+}
+
+
+int micronDiscard(FILE *self, size_t len) {
+    MicronFileClass *cls = _fileClasses[self->fileCls];
+    return cls->discard ? cls->discard(self, len) : -ENOSYS;
+}
+
+
+int micronSync(FILE *self) {
+    return _fileClasses[self->fileCls]->sync(self);
+}
+
+
+int rtcGet(uint32_t *outSecs, uint32_t *outUsecs) {
+    //a fixed time, so images come out the same every run.
+    if(outSecs)  *outSecs  = 1700000000; //2023-11-14 22:13:20
+    if(outUsecs) *outUsecs = 0;
+    return 0;
+}
+
+
+int spiInit(uint32_t port, uint32_t pinCS, uint32_t speed,
+MicronSpiModeEnum mode) {
+    if(port >= NUM_SPI) return -ENODEV;
+    _ports[port].rxLen = 0;
+    return spiSetSpeed(port, speed);
+}
+
+
+int spiPause(uint32_t port, bool pause) {
+    return (port < NUM_SPI) ? 0 : -ENODEV;
+}
+
+
+int spiSetMode(uint32_t port, MicronSpiModeEnum mode) {
+    return (port < NUM_SPI) ? 0 : -ENODEV;
+}
+
+
+int spiSetSpeed(uint32_t port, uint32_t speed) {
+    //like the real one, this takes the closest rate, which may be faster.
+    if(port >= NUM_SPI) return -ENODEV;
+    return _pickSpeed(speed, true, &_ports[port].speed);
+}
+
+
+int spiGetMaxSpeed(uint32_t port, uint32_t speed, uint32_t *outSpeed) {
+    if(port >= NUM_SPI) return -ENODEV;
+    return _pickSpeed(speed, false, outSpeed);
+}
+
+
+int spiSetFrameSize(uint32_t port, uint32_t size) {
+    if(port >= NUM_SPI) return -ENODEV;
+    return (size == 8) ? 0 : -ENOSYS;
+}
+
+
+int spiWriteDummy(uint32_t port, uint32_t data, uint32_t count, bool cs) {
+    return _transfer(port, NULL, data, count, cs);
+}
+
+
+int spiWrite(uint32_t port, const void *data, uint32_t len, bool cont) {
+    return _transfer(port, (const uint8_t*)data, 0, len, true);
+}
+
+
+int spiWriteBlocking(uint32_t port, const void *data, uint32_t len, bool cont,
+uint32_t timeout) {
+    const uint8_t *d = (const uint8_t*)data;
+    while(len) {
+        int n = spiWrite(port, d, len, cont);
+        if(n < 0) return n;
+        d += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int spiRead(uint32_t port, void *out, uint32_t len, uint32_t timeout) {
+    if(port >= NUM_SPI) return -ENODEV;
+    MicronSdSimPort *p = &_ports[port];
+    _now += _callNs;
+    _irqPending = false;
+    uint8_t *d = (uint8_t*)out;
+    uint32_t n = 0;
+    while(n < len && p->rxLen) {
+        d[n++] = p->rx[p->rxHead];
+        p->rxHead = (p->rxHead + 1) % SPI_RX_BUFSIZE;
+        p->rxLen--;
+    }
+    return n;
+}
+
+
+int spiReadBlocking(uint32_t port, void *out, uint32_t len, uint32_t timeout) {
+    //nothing more arrives without writing, so if it's not here, it's a
+    //timeout; let the time pass so callers see it.
+    int n = spiRead(port, out, len, timeout);
+    if(n < 0 || (uint32_t)n == len) return n;
+    _now += timeout * 1000000ull;
+    return -ETIMEDOUT;
+}
+
+
+int spiWaitTxDone(uint32_t port, uint32_t timeout) {
+    if(port >= NUM_SPI) return -ENODEV;
+    _now += _callNs;
+    return 0;
+}
+
+
+int spiClear(uint32_t port) {
+    if(port >= NUM_SPI) return -ENODEV;
+    _ports[port].rxLen = 0;
+    return 0;
+}
+
+
+int spiHoldCS(uint32_t port, bool hold) {
+    if(port >= NUM_SPI) return -ENODEV;
+    _now += _callNs;
+    _ports[port].hold = hold;
+    return 0;
+}
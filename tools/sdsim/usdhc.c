@@ -0,0 +1,502 @@
+//Register-level model of the i.MX RT uSDHC controller, for running the
+//usdhc driver (drivers/imx/usdhc) against the simulated card in SD mode.
+//The driver's register accesses come here instead of to the hardware (see
+//USDHC_SIM in usdhc.h). Writing CMD_XFR_TYP does the whole command, and any
+//data transfer, at once, working out when each part would finish on the
+//bus; the interrupt status bits then turn on as the clock passes those
+//times. Each register access costs a little time, so polling loops see
+//time pass. DMA addresses are 32 bits, so the driver's buffers are handed
+//out as windows of a made-up address space by usdhcSimDmaAddr().
+extern "C" {
+    #include <micron.h>
+    #include <drivers/imx/usdhc/usdhc.h>
+    #include "sdsim.h"
+}
+
+#define ACCESS_NS    50 //each register access (the peripheral bus is slow)
+#define DMA_BASE     0x20000000
+#define DMA_WINDOWS  64
+#define DMA_WINDOW   0x10000 //bytes per window
+#define MAX_SEGMENTS 256     //descriptors walked per transfer, at most
+
+//ADMA_ERR_STATUS
+#define ADMA_ERR_LENGTH BIT(2) //descriptors don't cover the transfer
+#define ADMA_ERR_DESC   BIT(3) //invalid descriptor
+
+//AUTOCMD12_ERR_STATUS
+#define AC12_TIMEOUT    BIT(1)
+#define AC12_CRC        BIT(2)
+
+typedef struct {
+    uint8_t *ptr;
+    uint32_t len;
+} Segment;
+
+static MicronUsdhcRegs _regs;
+static MicronSdSim *_card = NULL;
+static MicronUsdhcSimStats _stats;
+static Segment _window[DMA_WINDOWS];
+static uint32_t _nextWindow = 0;
+//what's going on the lines: status bits to set once it's over (0 to wait
+//for a reset), and when that is.
+static bool _cmdBusy = false, _dataBusy = false;
+static uint32_t _cmdBits = 0, _dataBits = 0;
+static uint64_t _cmdDoneAt = 0, _dataDoneAt = 0;
+
+static uint32_t _clockHz() {
+    //the SD clock, from SYS_CTRL's dividers.
+    uint32_t pre = (_regs.SYS_CTRL >> 8) & 0xFF;
+    uint32_t dvs = ((_regs.SYS_CTRL >> 4) & 0xF) + 1;
+    return USDHC_ROOT_HZ / ((pre ? pre * 2 : 1) * dvs);
+}
+
+
+static uint64_t _clocks(uint64_t n) {
+    //time for n SD clocks, in nanoseconds.
+    return (n * 1000000000ull) / _clockHz();
+}
+
+
+static void _violation(const char *what) {
+    //the driver did something the hardware wouldn't like.
+    _stats.violations++;
+    printf("uSDHC: %s\n", what);
+}
+
+
+static void _update() {
+    //let time pass, and turn on whatever status bits are due.
+    sdSimAdvance(ACCESS_NS);
+    uint64_t now = sdSimTime();
+    if(_cmdBusy && now >= _cmdDoneAt) {
+        _cmdBusy = false;
+        _regs.INT_STATUS |= _cmdBits & _regs.INT_STATUS_EN;
+    }
+    if(_dataBusy && _dataBits && now >= _dataDoneAt) {
+        _dataBusy = false;
+        _regs.INT_STATUS |= _dataBits & _regs.INT_STATUS_EN;
+    }
+}
+
+
+static void _cardTime(uint64_t t) {
+    _card->now = t;
+    _card->spiHz = _clockHz();
+}
+
+
+static uint8_t *_dmaPtr(uint32_t addr, uint32_t len) {
+    //the memory at a DMA address, or NULL if it isn't one we handed out.
+    if(addr < DMA_BASE) return NULL;
+    uint32_t w = (addr - DMA_BASE) / DMA_WINDOW;
+    uint32_t offset = (addr - DMA_BASE) % DMA_WINDOW;
+    if(w >= DMA_WINDOWS || !_window[w].ptr
+    || offset + len > _window[w].len) return NULL;
+    return _window[w].ptr + offset;
+}
+
+
+static int _walkAdma(uint32_t len, Segment *seg) {
+    //follow the descriptor table for a transfer of len bytes. return the
+    //number of pieces, or 0 after setting ADMA_ERR_STATUS.
+    uint32_t addr = _regs.ADMA_SYS_ADDR, have = 0;
+    int n = 0;
+    for(int i=0; i<MAX_SEGMENTS && have < len; i++) {
+        MicronUsdhcAdmaDesc desc;
+        uint8_t *p = _dmaPtr(addr, sizeof(desc));
+        if(!p || (addr % 4)) {
+            _regs.ADMA_ERR_STATUS = ADMA_ERR_DESC;
+            return 0;
+        }
+        memcpy(&desc, p, sizeof(desc));
+        _stats.descriptors++;
+        if(!(desc.attr & USDHC_ADMA_VALID)) {
+            _regs.ADMA_ERR_STATUS = ADMA_ERR_DESC;
+            return 0;
+        }
+        switch(desc.attr & USDHC_ADMA_ACT_MASK) {
+            case USDHC_ADMA_ACT_TRAN: {
+                uint32_t dlen = desc.len ? desc.len : 65536;
+                seg[n].ptr = _dmaPtr(desc.addr, dlen);
+                seg[n].len = dlen;
+                if(!seg[n].ptr) {
+                    _regs.ADMA_ERR_STATUS = ADMA_ERR_DESC;
+                    return 0;
+                }
+                have += dlen;
+                n++;
+                addr += sizeof(desc);
+                break;
+            }
+            case USDHC_ADMA_ACT_LINK:
+                addr = desc.addr;
+                break;
+            default: //nop
+                addr += sizeof(desc);
+                break;
+        }
+        if((desc.attr & USDHC_ADMA_END) && have < len) break;
+    }
+    if(have < len) {
+        _regs.ADMA_ERR_STATUS = ADMA_ERR_LENGTH;
+        return 0;
+    }
+    return n;
+}
+
+
+static void _dmaCopy(Segment *seg, uint32_t offset, uint8_t *buf, uint32_t len,
+bool toMemory) {
+    //move bytes between a buffer and the pieces, starting offset bytes in.
+    for(int i=0; len; i++) {
+        if(offset >= seg[i].len) {
+            offset -= seg[i].len;
+            continue;
+        }
+        uint32_t n = MIN(len, seg[i].len - offset);
+        if(toMemory) memcpy(seg[i].ptr + offset, buf, n);
+        else memcpy(buf, seg[i].ptr + offset, n);
+        buf += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+
+static uint32_t _be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static uint32_t _checkResponse(const uint8_t *resp, int len, uint8_t cmd,
+uint32_t xfr) {
+    //check a response as the controller would. return 0, or INT_STATUS
+    //error bits.
+    uint32_t type = xfr & USDHC_CMD_RSPTYP_MASK;
+    if(len != ((type == USDHC_CMD_RSPTYP_136) ? 17 : 6)) {
+        return USDHC_INT_CEBE;
+    }
+    if(xfr & USDHC_CMD_CCCEN) {
+        //the same CRC7 the card uses, computed bit by bit.
+        const uint8_t *data = (len == 17) ? resp + 1 : resp;
+        int n = (len == 17) ? 15 : 5;
+        uint8_t crc = 0;
+        for(int i=0; i<n; i++) {
+            for(int b=7; b>=0; b--) {
+                uint8_t in = ((data[i] >> b) & 1) ^ ((crc >> 6) & 1);
+                crc = ((crc << 1) & 0x7F) ^ (in ? 0x09 : 0);
+            }
+        }
+        if(((crc << 1) | 1) != resp[len - 1]) return USDHC_INT_CCE;
+    }
+    if((xfr & USDHC_CMD_CICEN) && (resp[0] & 0x3F) != cmd) {
+        return USDHC_INT_CIE;
+    }
+    return 0;
+}
+
+
+static void _setResponse(const uint8_t *resp, int len) {
+    //CMD_RSP holds the response without its first byte or CRC. a 136-bit
+    //one is shifted down a byte, so CMD_RSP3's top byte is empty.
+    if(len == 6) {
+        _regs.CMD_RSP[0] = _be32(resp + 1);
+        return;
+    }
+    _regs.CMD_RSP[3] = _be32(resp) & 0xFFFFFF;
+    _regs.CMD_RSP[2] = _be32(resp + 4);
+    _regs.CMD_RSP[1] = _be32(resp + 8);
+    _regs.CMD_RSP[0] = _be32(resp + 12);
+}
+
+
+static uint64_t _autoStop(uint64_t t) {
+    //send CMD12 after the last block. return when it's over.
+    uint8_t resp[17];
+    _cardTime(t + _clocks(48));
+    int len = sdSimCommand(_card, SD_CMD_STOP_READ, 0, resp);
+    t += _clocks(48 + (_card->cfg.ncr * 8));
+    if(!len) {
+        _regs.AUTOCMD12_ERR_STATUS = AC12_TIMEOUT;
+        return t + _clocks(64);
+    }
+    t += _clocks(48);
+    if(_checkResponse(resp, len, SD_CMD_STOP_READ, USDHC_RESP_R1)) {
+        _regs.AUTOCMD12_ERR_STATUS = AC12_CRC;
+        return t;
+    }
+    _regs.CMD_RSP[3] = _be32(resp + 1);
+    _cardTime(t);
+    uint64_t busy = sdSimBusyUntil(_card);
+    return MAX(t, busy);
+}
+
+
+static uint32_t _transfer(uint64_t *t) {
+    //move the data for a command that has it. return TC, or error bits;
+    //*t is when it's done.
+    uint32_t size  = _regs.BLK_ATT & 0x1FFF;
+    uint32_t mix   = _regs.MIX_CTRL;
+    uint32_t count = (mix & USDHC_MIX_MSBSEL) ? (_regs.BLK_ATT >> 16) : 1;
+    bool read = (mix & USDHC_MIX_DTDSEL) != 0;
+    bool wide = (_regs.PROT_CTRL & USDHC_PROT_DTW_MASK) == USDHC_PROT_DTW_4BIT;
+    if(!(mix & USDHC_MIX_DMAEN)
+    || (_regs.PROT_CTRL & (3 << 8)) != USDHC_PROT_DMASEL_ADMA2) {
+        _violation("data transfer without ADMA2");
+        return 0;
+    }
+    if((mix & USDHC_MIX_MSBSEL) && !(mix & USDHC_MIX_BCEN)) {
+        _violation("multiple block transfer without a block count");
+        return 0;
+    }
+    if(!size || size > SDSIM_BLOCK_SIZE || !count) {
+        _violation("bad block size or count");
+        return 0;
+    }
+    static Segment seg[MAX_SEGMENTS];
+    if(!_walkAdma(size * count, seg)) {
+        _stats.dmaErrors++;
+        return USDHC_INT_DMAE;
+    }
+
+    //start bit, data, CRC16 on each line, end bit.
+    uint64_t blockNs = _clocks((size * 8 / (wide ? 4 : 1)) + 18);
+    uint64_t timeoutNs = _clocks(1ull << (13 + ((_regs.SYS_CTRL >> 16) & 0xF)));
+    uint8_t buf[SDSIM_BLOCK_SIZE];
+    for(uint32_t i=0; i<count; i++) {
+        if(read) {
+            uint64_t start;
+            _cardTime(*t);
+            int err = sdSimReadData(_card, buf, size, wide, &start);
+            if(err < 0) {
+                *t += timeoutNs;
+                return USDHC_INT_DTOE;
+            }
+            if(start - *t > timeoutNs) {
+                *t += timeoutNs;
+                return USDHC_INT_DTOE;
+            }
+            *t = start + blockNs;
+            if(err) return USDHC_INT_DCE;
+            _dmaCopy(seg, i * size, buf, size, true);
+        }
+        else {
+            //the card only takes the next block once it isn't busy.
+            _dmaCopy(seg, i * size, buf, size, false);
+            *t += blockNs;
+            _cardTime(*t);
+            uint64_t busyUntil = 0;
+            int err = sdSimWriteData(_card, buf, wide, &busyUntil);
+            *t += _clocks(8); //CRC status
+            if(err == -ENODATA) {
+                *t += timeoutNs;
+                return USDHC_INT_DTOE;
+            }
+            if(err) return USDHC_INT_DCE;
+            *t = MAX(*t, busyUntil);
+        }
+        _stats.blocks++;
+    }
+    if(count > 1 && (mix & USDHC_MIX_AC12EN)) {
+        *t = _autoStop(*t);
+        if(_regs.AUTOCMD12_ERR_STATUS) return USDHC_INT_AC12E;
+    }
+    return USDHC_INT_TC;
+}
+
+
+static void _command() {
+    //CMD_XFR_TYP was written: send the command, and transfer its data.
+    uint32_t xfr = _regs.CMD_XFR_TYP;
+    uint8_t  cmd = (xfr >> 24) & 0x3F;
+    uint32_t type = xfr & USDHC_CMD_RSPTYP_MASK;
+    bool abort = (xfr & USDHC_CMD_CMDTYP_ABORT) == USDHC_CMD_CMDTYP_ABORT;
+    bool data  = (xfr & USDHC_CMD_DPSEL) != 0;
+    bool busy  = type == USDHC_CMD_RSPTYP_48_BUSY;
+    if(_cmdBusy) {
+        _violation("command sent while CIHB is set");
+        return;
+    }
+    if((data || busy) && _dataBusy && !abort) {
+        _violation("command using the data lines sent while CDIHB is set");
+        return;
+    }
+    if(!_card) {
+        _cmdBusy = true;
+        _cmdBits = USDHC_INT_CTOE;
+        _cmdDoneAt = sdSimTime() + _clocks(112);
+        return;
+    }
+    _stats.cmds++;
+    _regs.AUTOCMD12_ERR_STATUS = 0;
+    _regs.ADMA_ERR_STATUS = 0;
+
+    //command (48 bits), then the card's NCR, then its response.
+    uint64_t t = sdSimTime() + _clocks(48);
+    uint8_t resp[17];
+    _cardTime(t);
+    int len = sdSimCommand(_card, cmd, _regs.CMD_ARG, resp);
+    t += _clocks(_card->cfg.ncr * 8);
+    _cmdBusy = true;
+    _cmdBits = USDHC_INT_CC;
+    if(type == USDHC_CMD_RSPTYP_NONE) {
+        _cmdDoneAt = t;
+        return;
+    }
+    if(!len) {
+        //nothing within 64 clocks.
+        _cmdBits = USDHC_INT_CTOE;
+        _cmdDoneAt = t + _clocks(64);
+        if(data) {
+            _dataBusy = true; //until the driver resets it
+            _dataBits = 0;
+        }
+        return;
+    }
+    t += _clocks((len == 17) ? 136 : 48);
+    _cmdDoneAt = t;
+    _cmdBits = _checkResponse(resp, len, cmd, xfr);
+    if(_cmdBits) {
+        if(data) {
+            _dataBusy = true;
+            _dataBits = 0;
+        }
+        return;
+    }
+    _cmdBits = USDHC_INT_CC;
+    _setResponse(resp, len);
+
+    if(data) {
+        //a card that returned an error in its response doesn't send data.
+        uint32_t st = (len == 6) ? _regs.CMD_RSP[0] : 0;
+        _dataBusy = true;
+        if(st & 0xC0000000) {
+            _dataBits = 0;
+            return;
+        }
+        _dataBits = _transfer(&t);
+        _dataDoneAt = t;
+    }
+    else if(busy) {
+        //TC once the card lets go of DAT0.
+        _cardTime(t);
+        _dataBusy = true;
+        _dataBits = USDHC_INT_TC;
+        _dataDoneAt = MAX(t, sdSimBusyUntil(_card));
+    }
+}
+
+
+static void _sysCtrl(uint32_t value) {
+    //SYS_CTRL was written: resets, and the clock.
+    if(value & USDHC_SYS_RSTA) {
+        memset(&_regs, 0, sizeof(_regs));
+        _cmdBusy = _dataBusy = false;
+        value = USDHC_SYS_DVS(0xF) | USDHC_SYS_SDCLKFS(0x80); //reset value
+    }
+    if(value & USDHC_SYS_RSTC) {
+        _cmdBusy = false;
+        _regs.INT_STATUS &= ~(USDHC_INT_CC | USDHC_INT_CMD_ERRORS);
+    }
+    if(value & USDHC_SYS_RSTD) {
+        _dataBusy = false;
+        _regs.INT_STATUS &= ~(USDHC_INT_TC | USDHC_INT_DATA_ERRORS);
+    }
+    uint32_t pre = (value >> 8) & 0xFF;
+    if(pre & (pre - 1)) _violation("SDCLKFS isn't a power of two");
+    _regs.SYS_CTRL = value & ~(USDHC_SYS_RSTA | USDHC_SYS_RSTC |
+        USDHC_SYS_RSTD | USDHC_SYS_INITA);
+    if(value & USDHC_SYS_INITA) sdSimAdvance(_clocks(80));
+}
+
+
+void usdhcSimAttach(MicronSdSim *card) {
+    /** Put a card in the slot (or take it out, with NULL), and reset the
+     *  controller.
+     *  @param card Card.
+     */
+    _card = card;
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_window, 0, sizeof(_window));
+    _sysCtrl(USDHC_SYS_RSTA);
+}
+
+
+MicronUsdhcSimStats *usdhcSimStats() {
+    /** Get what the model has seen.
+     *  @return Its statistics, which can be reset by writing to them.
+     */
+    return &_stats;
+}
+
+
+uint32_t usdhcSimDmaAddr(const void *ptr, uint32_t len) {
+    /** Give the DMA an address for a buffer.
+     *  @param ptr Buffer.
+     *  @param len Its length in bytes.
+     *  @return Address for the descriptors, or 0 if it's too long.
+     *  @note The address stays good until DMA_WINDOWS more are handed out.
+     */
+    if(len > DMA_WINDOW) {
+        _violation("DMA buffer too long");
+        return 0;
+    }
+    uint32_t w = _nextWindow++ % DMA_WINDOWS;
+    _window[w].ptr = (uint8_t*)ptr;
+    _window[w].len = len;
+    return DMA_BASE + (w * DMA_WINDOW);
+}
+
+
+uint32_t usdhcSimRead(uint32_t offset) {
+    /** Read a register.
+     *  @param offset Its offset in MicronUsdhcRegs.
+     *  @return Its value.
+     */
+    _update();
+    _stats.reads++;
+    if(offset == offsetof(MicronUsdhcRegs, PRES_STATE)) {
+        uint32_t st = USDHC_PRES_SDSTB | (_card ? USDHC_PRES_CINST : 0);
+        if(_cmdBusy) st |= USDHC_PRES_CIHB;
+        if(_dataBusy) st |= USDHC_PRES_CDIHB | USDHC_PRES_DLA;
+        if(_card) _cardTime(sdSimTime());
+        if(!_card || !sdSimBusyUntil(_card)) st |= USDHC_PRES_DAT0;
+        return st;
+    }
+    if(offset % 4 || offset >= sizeof(_regs)) {
+        _violation("bad register read");
+        return 0;
+    }
+    return ((uint32_t*)&_regs)[offset / 4];
+}
+
+
+void usdhcSimWrite(uint32_t offset, uint32_t value) {
+    /** Write a register.
+     *  @param offset Its offset in MicronUsdhcRegs.
+     *  @param value Value to write.
+     */
+    _update();
+    _stats.writes++;
+    if(offset % 4 || offset >= sizeof(_regs)) {
+        _violation("bad register write");
+        return;
+    }
+    switch(offset) {
+        case offsetof(MicronUsdhcRegs, INT_STATUS):
+            _regs.INT_STATUS &= ~value; //write 1 to clear
+            break;
+        case offsetof(MicronUsdhcRegs, SYS_CTRL):
+            _sysCtrl(value);
+            break;
+        case offsetof(MicronUsdhcRegs, CMD_XFR_TYP):
+            _regs.CMD_XFR_TYP = value;
+            _command();
+            break;
+        case offsetof(MicronUsdhcRegs, PRES_STATE):
+            break; //read only
+        default:
+            ((uint32_t*)&_regs)[offset / 4] = value;
+            break;
+    }
+}